@@ -37,16 +37,38 @@
  *
  ***********************************************************************/
 
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
 #include <globus_ftp_client.h>
 
 #include "gridftp-common.h"
+#include "handletable.h"
 #include "misc.h"
+#include "node.h"
+#include "md5.h"
 
 /*
  * Protects the FTP transactions list from concurrent access by multiple threads
  */
 static globus_mutex_t transactionListLock_;
 
+/*
+ * Broadcast whenever any FTP transaction completes, for threads waiting
+ * on several at once. Used with the transaction list mutex
+ */
+static globus_cond_t anyTransactionDone_;
+
+static void releaseFtpRelay(ftpRelay_t *relay, ftpTransaction_t *t);
+
 
 /***********************************************************************
 *   int startupReplicationSystem()
@@ -63,12 +85,23 @@ int startupReplicationSystem()
 {
     logMessage(DEBUG, "startupReplicationSystem");
 
+    if (!initTransferHandles())
+    {
+	return 0;
+    }
+
     if (globus_mutex_init(&transactionListLock_, NULL))
     {
 	logMessage(ERROR, "Unable to initialise FTP transaction list mutex");
 	return 0;
     }
 
+    if (globus_cond_init(&anyTransactionDone_, NULL))
+    {
+	logMessage(ERROR, "Unable to initialise FTP transaction condition variable");
+	return 0;
+    }
+
     return 1;
 }
 
@@ -171,40 +204,274 @@ int isTransactionDoneLastCheck(ftpTransaction_t *t) {
 	return result;
 }
 
+/***********************************************************************
+ *   void markTransactionDone(ftpTransaction_t *t)
+ *
+ *   Flags an FTP transaction as completed and wakes any threads waiting
+ *   for it, either on their own or as one of several
+ *
+ *   Caller must hold the transaction list mutex!
+ *
+ *   Parameters:                                               [I/O]
+ *
+ *     t      points to the transaction structure               I
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void markTransactionDone(ftpTransaction_t *t) {
+	t->done = 1;
+	globus_cond_broadcast(&t->doneCond);
+	globus_cond_broadcast(&anyTransactionDone_);
+}
+
+/*
+ * Works out the absolute time timeOut seconds from now, for passing to
+ * globus_cond_timedwait
+ */
+static void getWaitDeadline(float timeOut, globus_abstime_t *deadline) {
+	struct timeval now;
+	long usec;
+
+	gettimeofday(&now, NULL);
+	usec = now.tv_usec + (long)((timeOut - (long)timeOut) * 1000000.0);
+	deadline->tv_sec = now.tv_sec + (long)timeOut + (usec / 1000000);
+	deadline->tv_nsec = (usec % 1000000) * 1000;
+}
+
+/*
+ * Sleeps on the transaction's condition variable until it completes or
+ * the time out expires. Caller must hold the transaction list mutex
+ */
+static void waitForTransactionLocked(ftpTransaction_t *t, float timeOut) {
+	globus_abstime_t deadline;
+
+	getWaitDeadline(timeOut, &deadline);
+	while (!t->done) {
+		if (globus_cond_timedwait(&t->doneCond, &transactionListLock_,
+				&deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+}
+
+/*
+ * Idle sessions, most recently returned first. Protected by the
+ * transaction list mutex
+ */
+static ftpSession_t *idleSessions_ = NULL;
+
+/*
+ * Destroys a session's Globus handle, closing any connections cached in
+ * it, and frees the session. Returns 1 on success, 0 on failure
+ */
+static int destroyFtpSession(ftpSession_t *s) {
+	globus_result_t err;
+
+	err = globus_ftp_client_handle_destroy(&s->handle);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_handle_destroy");
+
+		/*
+		 * Probably the least destructive option here is to leak the
+		 * memory if that happens.
+		 */
+		return 0;
+	}
+
+	if (s->hostname) {
+		globus_libc_free(s->hostname);
+	}
+	globus_libc_free(s);
+	return 1;
+}
+
+/*
+ * Gets a session for an operation on hostname: an idle one from the
+ * pool if there is one, otherwise a new one. Idle sessions which have
+ * been in the pool too long are thrown away on the way past, as the
+ * server has probably dropped their connections by now. A NULL
+ * hostname always gets a new session which won't be kept.
+ *
+ * Caller must hold the transaction list mutex. Returns NULL on error
+ */
+static ftpSession_t *checkOutFtpSession(const char *hostname) {
+	ftpSession_t *s, *prev, *next, *found;
+	globus_ftp_client_handleattr_t handleAttr;
+	globus_result_t err;
+	time_t now;
+
+	now = time(NULL);
+	found = NULL;
+	prev = NULL;
+	s = idleSessions_;
+	while (s != NULL) {
+		next = s->next;
+		if (difftime(now, s->lastUsed) > s->idleTime) {
+			if (prev) {
+				prev->next = next;
+			} else {
+				idleSessions_ = next;
+			}
+			destroyFtpSession(s);
+		} else if ((!found) && (hostname) && (!strcmp(s->hostname, hostname))) {
+			if (prev) {
+				prev->next = next;
+			} else {
+				idleSessions_ = next;
+			}
+			found = s;
+		} else {
+			prev = s;
+		}
+		s = next;
+	}
+
+	if (found) {
+		logMessage(DEBUG, "Reusing FTP session for %s", hostname);
+		found->next = NULL;
+		return found;
+	}
+
+	s = globus_libc_malloc(sizeof(ftpSession_t));
+	if (!s) {
+		errorExit("Out of memory in checkOutFtpSession");
+	}
+	s->hostname = NULL;
+	s->next = NULL;
+
+	err = globus_ftp_client_handleattr_init(&handleAttr);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_handleattr_init");
+		globus_libc_free(s);
+		return NULL;
+	}
+
+	/* turn on connection caching, so that the session is worth keeping */
+	err = globus_ftp_client_handleattr_set_cache_all(&handleAttr, GLOBUS_TRUE);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_handleattr_set_cache_all");
+		globus_ftp_client_handleattr_destroy(&handleAttr);
+		globus_libc_free(s);
+		return NULL;
+	}
+
+	err = globus_ftp_client_handle_init(&s->handle, &handleAttr);
+	globus_ftp_client_handleattr_destroy(&handleAttr);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_handle_init");
+		globus_libc_free(s);
+		return NULL;
+	}
+
+	if (hostname) {
+		s->hostname = safe_strdup(hostname);
+		if (!s->hostname) {
+			errorExit("Out of memory in checkOutFtpSession");
+		}
+	}
+	return s;
+}
+
 /*
- * Each transaction is given a unique ID number. This variable holds the next ID
- * number, and is incremented each time one is used
+ * Works out whether a session is fit to be used again after the
+ * transaction it was checked out for. It is if the transaction finished
+ * and either succeeded or failed because the server said no (file not
+ * found, permission denied...), since in that case the control
+ * connection is still good. Anything else - timeouts, connection
+ * failures - might have left the cached connection broken
  */
-static int transactionId_ = 0;
+static int isFtpSessionHealthy(ftpTransaction_t *t) {
+	if (!t->done) {
+		return 0;
+	}
+	if (t->succeeded) {
+		return 1;
+	}
+	return ((t->error != NULL) &&
+		(globus_error_match(t->error, GLOBUS_FTP_CLIENT_MODULE,
+				    GLOBUS_FTP_CLIENT_ERROR_RESPONSE)));
+}
 
 /*
- * Start of current FTP transactions list
+ * Gives a transaction's session back to the pool, or destroys it if it
+ * isn't to be reused or the host already has as many idle sessions as
+ * it is allowed. Caller must hold the transaction list mutex. Returns
+ * 1 on success, 0 if the Globus handle couldn't be destroyed
  */
-static ftpTransaction_t *transactionListHead_= NULL;
+static int checkInFtpSession(ftpTransaction_t *t) {
+	ftpSession_t *s, *s2;
+	char *prop;
+	int maxIdle;
+	int idle;
+
+	s = t->session;
+	t->session = NULL;
+	t->handle = NULL;
+
+	if ((s->hostname == NULL) || (!isFtpSessionHealthy(t))) {
+		return destroyFtpSession(s);
+	}
+
+	maxIdle = FTP_SESSION_POOL_SIZE;
+	prop = getNodeProperty(s->hostname, "ftpsessions");
+	if (prop) {
+		maxIdle = atoi(prop);
+		globus_libc_free(prop);
+	}
+
+	s->idleTime = FTP_SESSION_IDLE_TIME;
+	prop = getNodeProperty(s->hostname, "ftpsessionidle");
+	if (prop) {
+		s->idleTime = atoi(prop);
+		globus_libc_free(prop);
+	}
+
+	idle = 0;
+	for (s2 = idleSessions_; s2 != NULL; s2 = s2->next) {
+		if (!strcmp(s2->hostname, s->hostname)) {
+			idle++;
+		}
+	}
+	if (idle >= maxIdle) {
+		return destroyFtpSession(s);
+	}
+
+	s->lastUsed = time(NULL);
+	s->next = idleSessions_;
+	idleSessions_ = s;
+	return 1;
+}
 
 /***********************************************************************
- *   ftpTransaction_t *newFtpTransaction(char *opname)
+ *   ftpTransaction_t *newFtpTransaction(char *opname,
+ *                                       const char *hostname)
  *
  *   Creates a new FTP transaction structure, initialises it ready to go,
- *   and links it onto the list. Does not allocate a transfer buffer in
+ *   and gives it a handle. Does not allocate a transfer buffer in
  *   the structure as not all operations need one.
  *
+ *   The Globus FTP handle is checked out of a pool of sessions kept for
+ *   the host, so that the control connection (and the GSI handshake and
+ *   login that went with it) cached in the handle by an earlier
+ *   operation can be used again. It goes back to the pool when the
+ *   transaction is destroyed.
+ *
  *   Caller must hold the transaction list mutex!
  *
  *   Parameters:                                               [I/O]
  *
  *     opname   Name of FTP operation, for error reports        I
+ *     hostname Host the operation is on. NULL if the session   I
+ *              shouldn't be kept afterwards
  *    
  *   Returns: pointer to new transaction, NULL on error
  ***********************************************************************/
-ftpTransaction_t *newFtpTransaction(char *opname) {
+ftpTransaction_t *newFtpTransaction(char *opname, const char *hostname) {
 
 	char *method_name = "newFtpTransaction";
 	ftpTransaction_t *t;
 	globus_result_t err;
 
-	globus_ftp_client_handleattr_t handleAttr;
-
 	logMessage(DEBUG, "%s(%s)", method_name, opname);
 
 	/* allocate structure */
@@ -221,78 +488,87 @@ ftpTransaction_t *newFtpTransaction(char *opname) {
 
 	/* initialise transaction status */
 	t->done = 0;
+	globus_cond_init(&t->doneCond, NULL);
 	t->succeeded = 0;
 	t->waiting = 1;
 	t->error = NULL;
 	t->length = 0;
+	t->mlstBuffer = NULL;
+	t->mlstLength = 0;
+	t->deadline = 0;
 	t->buffer = NULL;
 	t->bigBuffer = NULL;
 	t->offset = 0;
+	t->transferred = 0;
 	t->writing = 0;
 	t->checksum = NULL;
 	t->destFilepath = NULL;
 	t->hostname = NULL;
 	t->readToBuffer = 0;
 	t->file = NULL;
-	t->id = transactionId_;
-	transactionId_++;
-
-	/* initialise globus handle and attributes */
-	err = globus_ftp_client_handleattr_init(&handleAttr);
-	if (err != GLOBUS_SUCCESS) {
-		printError(err, "globus_ftp_client_handleattr_init");
-		globus_libc_free(t->opName);
-		globus_libc_free(t);
-		return NULL;
-	}
-
-	/* try to turn on connection caching */
-	err = globus_ftp_client_handleattr_set_cache_all(&handleAttr, GLOBUS_TRUE);
-	if (err != GLOBUS_SUCCESS) {
-		printError(err, "globus_ftp_client_handleattr_set_cache_all");
+	t->ring = NULL;
+	t->ringSize = 0;
+	t->outstanding = 0;
+	t->reachedEnd = 0;
+	t->relay = NULL;
+	globus_ftp_client_restart_marker_init(&t->received);
+	t->inPlace = 0;
+	t->digesting = 0;
+	t->emptyBlocks = NULL;
+	t->emptyCount = 0;
+	t->filling = 0;
+
+	/* get a globus handle, and initialise attributes */
+	t->session = checkOutFtpSession(hostname);
+	if (t->session == NULL) {
+		globus_cond_destroy(&t->doneCond);
 		globus_libc_free(t->opName);
 		globus_libc_free(t);
 		return NULL;
 	}
+	t->handle = &t->session->handle;
 
-	err = globus_ftp_client_handle_init(&t->handle, &handleAttr);
+	err = globus_ftp_client_operationattr_init(&t->attr);
 	if (err != GLOBUS_SUCCESS) {
-		printError(err, "globus_ftp_client_handle_init");
+		printError(err, "globus_ftp_client_operationattr_init");
+		destroyFtpSession(t->session);
+		globus_cond_destroy(&t->doneCond);
 		globus_libc_free(t->opName);
 		globus_libc_free(t);
 		return NULL;
 	}
 
-	err = globus_ftp_client_operationattr_init(&t->attr);
+	err = globus_ftp_client_operationattr_init(&t->attr2);
 	if (err != GLOBUS_SUCCESS) {
 		printError(err, "globus_ftp_client_operationattr_init");
-		globus_ftp_client_handle_destroy(&t->handle);
+		globus_ftp_client_operationattr_destroy(&t->attr);
+		destroyFtpSession(t->session);
+		globus_cond_destroy(&t->doneCond);
 		globus_libc_free(t->opName);
 		globus_libc_free(t);
 		return NULL;
 	}
 
-	err = globus_ftp_client_operationattr_init(&t->attr2);
-	if (err != GLOBUS_SUCCESS) {
-		printError(err, "globus_ftp_client_operationattr_init");
-		globus_ftp_client_handle_destroy(&t->handle);
+	/* the handle doubles as the transaction's ID */
+	t->id = allocateTransferHandle(HANDLE_OWNER_GLOBUS, t);
+	if (t->id < 0) {
+		globus_ftp_client_operationattr_destroy(&t->attr2);
+		globus_ftp_client_operationattr_destroy(&t->attr);
+		destroyFtpSession(t->session);
+		globus_cond_destroy(&t->doneCond);
 		globus_libc_free(t->opName);
 		globus_libc_free(t);
 		return NULL;
 	}
 
-	/* link onto the list */
-	t->next = transactionListHead_;
-	transactionListHead_ = t;
-
 	return t;
 }
 
 /***********************************************************************
  *   int destroyFtpTransaction(ftpTransaction_t *t)
  *
- *   Destroys an FTP transaction, freeing all its storage, destroying the
- *   Globus handles within, and unlinking it from the list
+ *   Destroys an FTP transaction, freeing all its storage, returning its
+ *   session to the pool (or destroying it), and releasing its handle
  *
  *   Caller must hold the list's mutex!
  *
@@ -303,48 +579,39 @@ ftpTransaction_t *newFtpTransaction(char *opname) {
  *   Returns: 1 on success, 0 on failure
  ***********************************************************************/
 int destroyFtpTransaction(ftpTransaction_t *t) {
-	ftpTransaction_t *t2;
 	globus_result_t err;
+	int i;
 
 	logMessage(DEBUG, "destroyFtpTransaction id %d", t->id);
 
-	/* unlink transaction from list */
-	if (transactionListHead_ == t) {
-		transactionListHead_ = t->next;
-	} else {
-		t2 = transactionListHead_;
-		while ((t2->next != NULL) && (t2->next != t)) {
-			t2 = t2->next;
-		}
-
-		if (t2->next == NULL) {
-			/* couldn't find that transaction in the list */
-			logMessage(WARN,
-					"Tried to destroy FTP transaction not found in list");
-			return 0;
-		}
-
-		t2->next = t->next;
+	/* make sure it's a live transaction, then retire its handle */
+	if (lookupTransferHandle(HANDLE_OWNER_GLOBUS, t->id) != t) {
+		logMessage(WARN,
+				"Tried to destroy FTP transaction not found in handle table");
+		return 0;
 	}
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, t->id);
 
-	/* destroy transaction */
-	err = globus_ftp_client_handle_destroy(&t->handle);
-	if (err != GLOBUS_SUCCESS) {
-		printError(err, "globus_ftp_client_handle_destroy");
+	/* let go of the relay, if this was one end of one */
+	if (t->relay) {
+		releaseFtpRelay(t->relay, t);
+		t->relay = NULL;
+	}
 
+	/* finished with the globus handle */
+	if (!checkInFtpSession(t)) {
 		/*
-		 * we report an error if the handle destroy failed.
-		 * Probably the least destructive option here though
-		 * is to leak the memory if that happens.
+		 * we report an error if the handle destroy failed, and leak
+		 * the rest of the transaction too.
 		 */
 		return 0;
 	}
 
-	globus_ftp_client_operationattr_destroy(&t->attr);
+	err = globus_ftp_client_operationattr_destroy(&t->attr);
 	if (err != GLOBUS_SUCCESS) {
 		printError(err, "globus_ftp_client_operationattr_destroy");
 	}
-	globus_ftp_client_operationattr_destroy(&t->attr2);
+	err = globus_ftp_client_operationattr_destroy(&t->attr2);
 	if (err != GLOBUS_SUCCESS) {
 		printError(err, "globus_ftp_client_operationattr_destroy");
 	}
@@ -352,6 +619,22 @@ int destroyFtpTransaction(ftpTransaction_t *t) {
 	if (t->buffer) {
 		globus_libc_free(t->buffer);
 	}
+	if (t->mlstBuffer) {
+		globus_libc_free(t->mlstBuffer);
+	}
+	if (t->ring) {
+		for (i = 0; i < t->ringSize; i++) {
+			globus_libc_free(t->ring[i]);
+		}
+		globus_libc_free(t->ring);
+	}
+	if (t->emptyBlocks) {
+		globus_libc_free(t->emptyBlocks);
+	}
+	if (t->file) {
+		/* transfer was abandoned part way through */
+		fclose(t->file);
+	}
 	if (t->bigBuffer) {
 			globus_libc_free(t->bigBuffer);
 	}
@@ -364,6 +647,8 @@ int destroyFtpTransaction(ftpTransaction_t *t) {
 	if (t->hostname) {
 			globus_libc_free(t->hostname);
 	}
+	globus_ftp_client_restart_marker_destroy(&t->received);
+	globus_cond_destroy(&t->doneCond);
 	globus_libc_free(t->opName);
 	globus_libc_free(t);
 
@@ -389,18 +674,30 @@ void completeCallback(void *data, globus_ftp_client_handle_t *handle,
 		globus_object_t *error) {
 	
 	ftpTransaction_t *t;
+	globus_ftp_control_mode_t mode;
 	t = (ftpTransaction_t *)data;
 
 	/* try to get access to list */
 	if (acquireTransactionListMutex()) {
 		/* flag transaction as done */
-		t->done = 1;
+		markTransactionDone(t);
 		t->error = globus_object_copy(error);
 		if (error == GLOBUS_SUCCESS) {
 			t->succeeded = 1;
 		} else {
 			printErrorObject(error, t->opName);
 			t->succeeded = 0;
+
+			/* A server that won't do MODE E only shows it by failing the
+			 * transfer, so point at the node's settings */
+			if ((globus_ftp_client_operationattr_get_mode(&t->attr, &mode)
+					== GLOBUS_SUCCESS) &&
+					(mode == GLOBUS_FTP_CONTROL_MODE_EXTENDED_BLOCK)) {
+				logMessage(WARN, "%s failed in extended block mode. If the "
+						"server refuses it, unset ftpstreams and ftpstriped "
+						"for %s", t->opName,
+						(t->hostname ? t->hostname : "the node"));
+			}
 		}
 
 		/* if the initiator is no longer waiting for this transaction, we
@@ -429,8 +726,6 @@ void completeCallback(void *data, globus_ftp_client_handle_t *handle,
  *   Returns: 1 if the operation completed, 0 if it timed out
  ***********************************************************************/
 int waitOnFtp(ftpTransaction_t *transaction, float timeOut) {
-	time_t startTime;
-	time_t endTime;
 
 	logMessage(DEBUG, "waitOnFtp id %d,%f", transaction->id, timeOut);
 
@@ -438,14 +733,11 @@ int waitOnFtp(ftpTransaction_t *transaction, float timeOut) {
 		timeOut = 45.0;
 	}
 
-	startTime = time(NULL);
-
-	endTime = time(NULL);
-	while ((!isTransactionDone(transaction)) && (difftime(endTime, startTime)
-			< timeOut)) {
-		globus_libc_usleep(1000);
-		endTime = time(NULL);
+	if (!acquireTransactionListMutex()) {
+		return 0;
 	}
+	waitForTransactionLocked(transaction, timeOut);
+	releaseTransactionListMutex();
 
 	if (!isTransactionDoneLastCheck(transaction)) {
 		logMessage(WARN, "Error in %s: operation timed out",
@@ -457,7 +749,7 @@ int waitOnFtp(ftpTransaction_t *transaction, float timeOut) {
 		 * Globus code. This doesn't seem to happen any more with 2.4 so I have
 		 * removed the unsatisfactory work around
 		 */
-		if (globus_ftp_client_abort(&transaction->handle) != GLOBUS_SUCCESS) {
+		if (globus_ftp_client_abort(transaction->handle) != GLOBUS_SUCCESS) {
 			logMessage(WARN, "Error aborting FTP operation %s",
 					transaction->opName);
 		}
@@ -549,6 +841,210 @@ digs_error_code_t getErrorAndMessageFromGlobus(globus_object_t *error,
 	return error_code;
 }
 
+/***********************************************************************
+ *   int setFtpTransferAttributes(globus_ftp_client_operationattr_t *attr,
+ *                                const char *hostname)
+ *
+ *   Tunes the data channel of a put, get or third party transfer to
+ *   suit a node, using these properties from the node table:
+ *
+ *     ftpstreams     number of parallel data streams. More than 1
+ *                    switches to extended block mode
+ *     ftpstriped     1 to use striping if the server supports it.
+ *                    This also needs extended block mode
+ *     ftptcpbuffer   TCP buffer size in bytes. If not given but both
+ *     ftplinkspeed   ftplinkspeed (Mbit/s) and ftprtt (ms) are, the
+ *     ftprtt         buffer is sized to the bandwidth-delay product
+ *     ftpdcau        data channel authentication: none, self or default
+ *     ftpprotection  data channel protection: clear, safe, confidential
+ *                    or private
+ *
+ *   Anything not set is left at the Globus default.
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     attr       operation attributes to set                         O
+ *     hostname   node the transfer is to or from                     I
+ *    
+ *   Returns: 1 if extended block mode was turned on, 0 if not
+ ***********************************************************************/
+int setFtpTransferAttributes(globus_ftp_client_operationattr_t *attr,
+		const char *hostname) {
+	char *prop;
+	char *rtt;
+	int streams = 1;
+	int striped = 0;
+	int extendedBlock = 0;
+	long long bufferSize = 0;
+	globus_result_t err;
+	globus_ftp_control_parallelism_t parallelism;
+	globus_ftp_control_tcpbuffer_t tcpBuffer;
+	globus_ftp_control_dcau_t dcau;
+
+	prop = getNodeProperty(hostname, "ftpstreams");
+	if (prop) {
+		streams = atoi(prop);
+		globus_libc_free(prop);
+	}
+	prop = getNodeProperty(hostname, "ftpstriped");
+	if (prop) {
+		striped = (!strcmp(prop, "1"));
+		globus_libc_free(prop);
+	}
+
+	/* Both parallel streams and striping only work in extended block
+	 * mode */
+	if ((streams > 1) || (striped)) {
+		err = globus_ftp_client_operationattr_set_mode(attr,
+				GLOBUS_FTP_CONTROL_MODE_EXTENDED_BLOCK);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_operationattr_set_mode");
+			logMessage(WARN, "Cannot use extended block mode for %s, "
+					"not using parallel streams or striping", hostname);
+		} else {
+			extendedBlock = 1;
+		}
+	}
+
+	if ((extendedBlock) && (streams > 1)) {
+		parallelism.mode = GLOBUS_FTP_CONTROL_PARALLELISM_FIXED;
+		parallelism.fixed.size = streams;
+		err = globus_ftp_client_operationattr_set_parallelism(attr,
+				&parallelism);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_operationattr_set_parallelism");
+		}
+	}
+
+	if ((extendedBlock) && (striped)) {
+		err = globus_ftp_client_operationattr_set_striped(attr, GLOBUS_TRUE);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_operationattr_set_striped");
+		}
+	}
+
+	prop = getNodeProperty(hostname, "ftptcpbuffer");
+	if (prop) {
+		bufferSize = strtoll(prop, NULL, 10);
+		globus_libc_free(prop);
+	} else {
+		prop = getNodeProperty(hostname, "ftplinkspeed");
+		rtt = getNodeProperty(hostname, "ftprtt");
+		if ((prop) && (rtt)) {
+			/* Mbit/s times ms gives bits*1000; want bytes */
+			bufferSize = (long long)((atof(prop) * atof(rtt) * 1000.0) / 8.0);
+		}
+		if (prop) globus_libc_free(prop);
+		if (rtt) globus_libc_free(rtt);
+	}
+	if (bufferSize > INT_MAX) {
+		/* Globus holds the size in an int */
+		logMessage(WARN, "TCP buffer size %lld for %s is too large, using %d",
+				bufferSize, hostname, INT_MAX);
+		bufferSize = INT_MAX;
+	}
+	if (bufferSize > 0) {
+		tcpBuffer.mode = GLOBUS_FTP_CONTROL_TCPBUFFER_FIXED;
+		tcpBuffer.fixed.size = (int)bufferSize;
+		err = globus_ftp_client_operationattr_set_tcp_buffer(attr, &tcpBuffer);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_operationattr_set_tcp_buffer");
+		}
+	}
+
+	prop = getNodeProperty(hostname, "ftpdcau");
+	if (prop) {
+		dcau.mode = GLOBUS_FTP_CONTROL_DCAU_DEFAULT;
+		if (!strcmp(prop, "none")) {
+			dcau.mode = GLOBUS_FTP_CONTROL_DCAU_NONE;
+		} else if (!strcmp(prop, "self")) {
+			dcau.mode = GLOBUS_FTP_CONTROL_DCAU_SELF;
+		} else if (strcmp(prop, "default")) {
+			logMessage(WARN, "Unknown ftpdcau setting %s for %s", prop,
+					hostname);
+		}
+		err = globus_ftp_client_operationattr_set_dcau(attr, &dcau);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_operationattr_set_dcau");
+		}
+		globus_libc_free(prop);
+	}
+
+	prop = getNodeProperty(hostname, "ftpprotection");
+	if (prop) {
+		err = GLOBUS_SUCCESS;
+		if (!strcmp(prop, "clear")) {
+			err = globus_ftp_client_operationattr_set_data_protection(attr,
+					GLOBUS_FTP_CONTROL_PROTECTION_CLEAR);
+		} else if (!strcmp(prop, "safe")) {
+			err = globus_ftp_client_operationattr_set_data_protection(attr,
+					GLOBUS_FTP_CONTROL_PROTECTION_SAFE);
+		} else if (!strcmp(prop, "confidential")) {
+			err = globus_ftp_client_operationattr_set_data_protection(attr,
+					GLOBUS_FTP_CONTROL_PROTECTION_CONFIDENTIAL);
+		} else if (!strcmp(prop, "private")) {
+			err = globus_ftp_client_operationattr_set_data_protection(attr,
+					GLOBUS_FTP_CONTROL_PROTECTION_PRIVATE);
+		} else {
+			logMessage(WARN, "Unknown ftpprotection setting %s for %s", prop,
+					hostname);
+		}
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_operationattr_set_data_protection");
+		}
+		globus_libc_free(prop);
+	}
+
+	return extendedBlock;
+}
+
+/***********************************************************************
+ *   void setFtpStreamMode(globus_ftp_client_operationattr_t *attr)
+ *
+ *   Puts a transfer tuned by setFtpTransferAttributes back into stream
+ *   mode, for when the other end can't use extended block mode.
+ *   Striping is turned off too, as it can't work without it
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     attr       operation attributes to change                    I/O
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void setFtpStreamMode(globus_ftp_client_operationattr_t *attr) {
+	globus_ftp_client_operationattr_set_mode(attr,
+			GLOBUS_FTP_CONTROL_MODE_STREAM);
+	globus_ftp_client_operationattr_set_striped(attr, GLOBUS_FALSE);
+}
+
+/***********************************************************************
+ *   void setFtpThirdPartyAttributes(ftpTransaction_t *t,
+ *                       const char *sourceHost, const char *destHost)
+ *
+ *   Tunes both ends of a third party transfer. The two servers have to
+ *   agree on the transfer mode, so if only one of them is set up for
+ *   extended block mode both are left in stream mode
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     t           transaction to set up                              O
+ *     sourceHost  node the data is coming from                       I
+ *     destHost    node the data is going to                          I
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void setFtpThirdPartyAttributes(ftpTransaction_t *t, const char *sourceHost,
+		const char *destHost) {
+	int sourceBlock, destBlock;
+
+	sourceBlock = setFtpTransferAttributes(&t->attr, sourceHost);
+	destBlock = setFtpTransferAttributes(&t->attr2, destHost);
+	if (sourceBlock != destBlock) {
+		setFtpStreamMode(&t->attr);
+		setFtpStreamMode(&t->attr2);
+	}
+}
+
 /***********************************************************************
  * void dataCallback(void *userArg, globus_ftp_client_handle_t *handle,
  *		    globus_object_t *error, globus_byte_t *buffer,
@@ -576,6 +1072,7 @@ void dataCallback(void *userArg, globus_ftp_client_handle_t *handle,
 	//releaseTransactionListMutex();
 
 	ftpTransaction_t *t;
+	int fd;
 
 	t = (ftpTransaction_t *)userArg;
 
@@ -587,6 +1084,9 @@ void dataCallback(void *userArg, globus_ftp_client_handle_t *handle,
 		globus_ftp_client_abort(handle);
 		t->succeeded = 0;
 		t->error = error;
+		if (!t->readToBuffer) {
+			t->outstanding--;
+		}
 
 		releaseTransactionListMutex();
 		return;
@@ -594,19 +1094,20 @@ void dataCallback(void *userArg, globus_ftp_client_handle_t *handle,
 
 	/* See if it's a read or a write currently in process */
 	if (t->writing) {
-		/* It's a write (put). See if it's finished */
-		if ((eof) || ((offset+length) >= t->length)) {
+		/* It's a write (put). This buffer is free again, so refill it
+		 * unless the whole file has already been sent. Another
+		 * callback may already be refilling, in which case it picks
+		 * this buffer up too */
+		t->transferred += length;
+		if ((t->reachedEnd) || (!t->succeeded)) {
+			t->outstanding--;
 			releaseTransactionListMutex();
 			return;
 		}
 
-		/* Not finished yet. Start the next block */
-		if (!startFtpWriteBlock(t)) {
-			globus_ftp_client_abort(handle);
-			t->succeeded = 0;
-
-			releaseTransactionListMutex();
-			return;
+		t->emptyBlocks[t->emptyCount++] = (char *)buffer;
+		if (!t->filling) {
+			refillFtpWriteBlocks(t);
 		}
 	} 
 	else if (t->readToBuffer) {
@@ -629,33 +1130,59 @@ void dataCallback(void *userArg, globus_ftp_client_handle_t *handle,
 		}
 
 		/* Not reached the end, so start reading the next block */
-		if (!startFtpReadBlock(t)) {
+		if (!startFtpReadBlock(t, t->buffer)) {
 			globus_ftp_client_abort(handle);
 			t->succeeded = 0;
 		}
 	} else {
-		/* We're reading data. Save the latest buffer into our file */
-		fwrite(t->buffer, 1, length, t->file);
-
-		/* See if we've reached the end yet */
+		/* We're reading data. Save this buffer into our file. Nothing
+		 * else touches the buffer until it's registered again, so the
+		 * disk write can be done without holding up the other blocks.
+		 * With parallel streams the blocks can arrive in any order */
 		if (eof) {
-			fclose(t->file);
-			releaseTransactionListMutex();
-			return;
+			t->reachedEnd = 1;
 		}
+		fd = fileno(t->file);
+		releaseTransactionListMutex();
 
-		/* Not reached the end, so start reading the next block */
-		if (!startFtpReadBlock(t)) {
+		if ((length > 0) &&
+				(pwrite(fd, buffer, length, offset) != (ssize_t)length)) {
+			logMessage(ERROR, "Error writing local file in %s", t->opName);
+			acquireTransactionListMutex();
+			t->outstanding--;
 			globus_ftp_client_abort(handle);
-
 			t->succeeded = 0;
+			releaseTransactionListMutex();
+			return;
+		}
+
+		acquireTransactionListMutex();
+		if (length > 0) {
+			globus_ftp_client_restart_marker_insert_range(&t->received,
+					offset, offset + length);
+			t->transferred += length;
+		}
+		if (!t->reachedEnd) {
+			/* Not reached the end, so read the next block into it */
+			if (!startFtpReadBlock(t, (char *)buffer)) {
+				t->outstanding--;
+				globus_ftp_client_abort(handle);
+				t->succeeded = 0;
+			}
+		} else {
+			t->outstanding--;
+			if (t->outstanding == 0) {
+				/* last block written */
+				fclose(t->file);
+				t->file = NULL;
+			}
 		}
 	}
 	releaseTransactionListMutex();
 }
 
 /***********************************************************************
- *   int startFtpReadBlock(ftpTransaction_t *t)
+ *   int startFtpReadBlock(ftpTransaction_t *t, char *buffer)
  *
  *   Starts reading a new block of data on the given FTP handle
  *
@@ -663,16 +1190,17 @@ void dataCallback(void *userArg, globus_ftp_client_handle_t *handle,
  *    
  *   Parameters:                                                     [I/O]
  *
- *     t      ftp transaction handle                                  I
+ *     t        ftp transaction handle                                I
+ *     buffer   buffer to read into (FTP_DATA_BUFFER_SIZE bytes)      I
  *    
  *   Returns: 1 on success, 0 on error
  ***********************************************************************/
-int startFtpReadBlock(ftpTransaction_t *t) {
+int startFtpReadBlock(ftpTransaction_t *t, char *buffer) {
 	globus_result_t err;
 
 	/* Tell Globus to read more data into the buffer */
-	err = globus_ftp_client_register_read(&t->handle,
-			(globus_byte_t *)t->buffer, FTP_DATA_BUFFER_SIZE, dataCallback, t);
+	err = globus_ftp_client_register_read(t->handle,
+			(globus_byte_t *)buffer, FTP_DATA_BUFFER_SIZE, dataCallback, t);
 	if (err != GLOBUS_SUCCESS) {
 		printError(err, "globus_ftp_client_register_read");
 		return 0;
@@ -682,22 +1210,23 @@ int startFtpReadBlock(ftpTransaction_t *t) {
 }
 
 /***********************************************************************
- *   int startFtpWriteBlock(ftpTransaction_t *t)
+ *   int nextFtpWriteBlock(ftpTransaction_t *t, globus_off_t *offset)
  *
- *   Starts writing a new block of data on the given FTP handle
+ *   Takes the next block of the local file for a put to send, moving
+ *   t->offset past it
  *
  *   Caller must hold transaction list mutex!
  *    
  *   Parameters:                                                     [I/O]
  *
- *     t    transaction structure pointer                             I
+ *     t        transaction structure pointer                        I/O
+ *     offset   receives where in the file the block starts            O
  *    
- *   Returns: 1 on success, 0 on error
+ *   Returns: length of the block. t->reachedEnd is set if it is the
+ *            last one
  ***********************************************************************/
-int startFtpWriteBlock(ftpTransaction_t *t) {
+static int nextFtpWriteBlock(ftpTransaction_t *t, globus_off_t *offset) {
 	int len;
-	int reachedEnd;
-	globus_result_t err;
 
 	/* See if there's a full buffer's worth still to send */
 	if ((t->length - t->offset) >= FTP_DATA_BUFFER_SIZE) {
@@ -706,48 +1235,300 @@ int startFtpWriteBlock(ftpTransaction_t *t) {
 		len = (t->length - t->offset);
 	}
 
-	/* Fill the buffer with data from the local file */
-	fread(t->buffer, 1, len, t->file);
-
-	/* Move up the file */
+	/* Move up the file, and check if we've got to the end yet */
+	*offset = t->offset;
 	t->offset += len;
+	if (t->offset >= t->length) {
+		t->reachedEnd = 1;
+	}
+	return len;
+}
 
-	/* Check if we've got to the end yet */
-	reachedEnd = 0;
+/***********************************************************************
+ *   int sendFtpWriteBlock(ftpTransaction_t *t, int fd, char *buffer,
+ *                         globus_off_t offset, int len, int eof)
+ *
+ *   Fills a buffer with a block of the local file, adds it to the
+ *   put's checksum and starts writing it on the given FTP handle.
+ *   Blocks must be sent in file order, one thread at a time
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     t        transaction structure pointer                         I
+ *     fd       descriptor of the local file                          I
+ *     buffer   buffer to use (FTP_DATA_BUFFER_SIZE bytes)            I
+ *     offset   where in the file the block starts                    I
+ *     len      length of the block                                   I
+ *     eof      set if this is the last block                         I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+static int sendFtpWriteBlock(ftpTransaction_t *t, int fd, char *buffer,
+		globus_off_t offset, int len, int eof) {
+	globus_result_t err;
 
-	if (t->offset >= t->length) {
-		reachedEnd = 1;
-		fclose(t->file);
+	if ((len > 0) && (pread(fd, buffer, len, offset) != (ssize_t)len)) {
+		logMessage(ERROR, "Error reading local file in %s", t->opName);
+		return 0;
+	}
+	if (t->digesting == 1) {
+		md5_append(&t->digest, (unsigned char *)buffer, len);
 	}
 
 	/* Tell Globus to send this buffer of data */
-	err = globus_ftp_client_register_write(&t->handle,
-			(globus_byte_t *)t->buffer, len, t->offset-len, reachedEnd,
-			dataCallback, t);
+	err = globus_ftp_client_register_write(t->handle,
+			(globus_byte_t *)buffer, len, offset, eof, dataCallback, t);
 	if (err != GLOBUS_SUCCESS) {
 		printError(err, "globus_ftp_client_register_write");
 		return 0;
 	}
-
 	return 1;
 }
+
 /***********************************************************************
- *   int startFtpWrite(char *filename, ftpTransaction_t *t, char *errorMessage)
+ *   int startFtpWriteBlock(ftpTransaction_t *t, char *buffer)
  *
- *   Starts off a write (put) operation on the given handle
+ *   Fills a buffer with the next block of the local file and starts
+ *   writing it on the given FTP handle. Used for the first blocks of a
+ *   put, before any of its data callbacks can be running
  *
  *   Caller must hold transaction list mutex!
  *    
  *   Parameters:                                                     [I/O]
  *
- *     filename  Name of local file to transfer                       I
- *     t         transaction structure pointer                        I
+ *     t        transaction structure pointer                         I
+ *     buffer   buffer to use (FTP_DATA_BUFFER_SIZE bytes)            I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+int startFtpWriteBlock(ftpTransaction_t *t, char *buffer) {
+	globus_off_t offset;
+	int len;
+
+	len = nextFtpWriteBlock(t, &offset);
+	if (!sendFtpWriteBlock(t, fileno(t->file), buffer, offset, len,
+				t->reachedEnd)) {
+		return 0;
+	}
+	t->outstanding++;
+
+	if (t->reachedEnd) {
+		fclose(t->file);
+		t->file = NULL;
+	}
+	return 1;
+}
+
+/***********************************************************************
+ *   void refillFtpWriteBlocks(ftpTransaction_t *t)
+ *
+ *   Refills the put's sent buffers with the next blocks of the local
+ *   file and sends them, until none are left waiting. The mutex is let
+ *   go while each block is read, so that the other transfers' callbacks
+ *   aren't held up by the disk. Callbacks that finish meanwhile leave
+ *   their buffers in t->emptyBlocks for this to pick up. The buffers
+ *   waiting count as outstanding, so the transaction can't complete
+ *   under it
+ *
+ *   Caller must hold transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     t        transaction structure pointer                        I/O
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void refillFtpWriteBlocks(ftpTransaction_t *t) {
+	globus_off_t offset;
+	char *buffer;
+	int len, fd, eof, ok;
+
+	t->filling = 1;
+	while ((t->emptyCount > 0) && (t->succeeded)) {
+		buffer = t->emptyBlocks[--t->emptyCount];
+		if (t->reachedEnd) {
+			/* the rest of the file went in earlier buffers */
+			t->outstanding--;
+			continue;
+		}
+		len = nextFtpWriteBlock(t, &offset);
+		eof = t->reachedEnd;
+		fd = fileno(t->file);
+
+		releaseTransactionListMutex();
+		ok = sendFtpWriteBlock(t, fd, buffer, offset, len, eof);
+		acquireTransactionListMutex();
+
+		if (eof) {
+			fclose(t->file);
+			t->file = NULL;
+		}
+		if (!ok) {
+			t->outstanding--;
+			globus_ftp_client_abort(t->handle);
+			t->succeeded = 0;
+		}
+	}
+
+	/* after a failure nothing more is sent */
+	t->outstanding -= t->emptyCount;
+	t->emptyCount = 0;
+	t->filling = 0;
+}
+
+/***********************************************************************
+ *   void allocateFtpRing(ftpTransaction_t *t, int maxBlocks)
+ *
+ *   Allocates the ring of buffers for a put or get. The number of
+ *   buffers comes from the node's 'ftpbuffers' property, or
+ *   FTP_DATA_BUFFER_COUNT if that isn't set
+ *
+ *   Caller must hold transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     t          transaction structure pointer                       I/O
+ *     maxBlocks  most buffers that could be useful, or 0 if unknown  I
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+static void allocateFtpRing(ftpTransaction_t *t, int maxBlocks) {
+	char *prop;
+	int i;
+
+	t->ringSize = FTP_DATA_BUFFER_COUNT;
+	if (t->hostname) {
+		prop = getNodeProperty(t->hostname, "ftpbuffers");
+		if (prop) {
+			t->ringSize = atoi(prop);
+			globus_libc_free(prop);
+		}
+	}
+	if ((maxBlocks > 0) && (t->ringSize > maxBlocks)) {
+		t->ringSize = maxBlocks;
+	}
+	if (t->ringSize < 1) {
+		t->ringSize = 1;
+	}
+
+	t->ring = globus_libc_malloc(t->ringSize * sizeof(char *));
+	t->emptyBlocks = globus_libc_malloc(t->ringSize * sizeof(char *));
+	if ((!t->ring) || (!t->emptyBlocks)) {
+		errorExit("Out of memory in allocateFtpRing");
+	}
+	for (i = 0; i < t->ringSize; i++) {
+		t->ring[i] = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+		if (!t->ring[i]) {
+			errorExit("Out of memory in allocateFtpRing");
+		}
+	}
+}
+
+/***********************************************************************
+ *   int digestFtpPrefix(ftpTransaction_t *t, globus_off_t length)
+ *
+ *   Feeds the start of a put's local file, which an earlier attempt
+ *   already sent, to its checksum
+ *
+ *   Parameters:                                                     [I/O]
+ *
+ *     t       transaction structure pointer                          I
+ *     length  number of bytes at the start of the file to add        I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+static int digestFtpPrefix(ftpTransaction_t *t, globus_off_t length) {
+	unsigned char *buffer;
+	globus_off_t offset = 0;
+	ssize_t n;
+
+	buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+	if (!buffer) {
+		errorExit("Out of memory in digestFtpPrefix");
+	}
+	while (offset < length) {
+		n = FTP_DATA_BUFFER_SIZE;
+		if (length - offset < n) {
+			n = (ssize_t)(length - offset);
+		}
+		n = pread(fileno(t->file), buffer, n, offset);
+		if (n <= 0) {
+			globus_libc_free(buffer);
+			return 0;
+		}
+		md5_append(&t->digest, buffer, n);
+		offset += n;
+	}
+	globus_libc_free(buffer);
+	return 1;
+}
+
+/***********************************************************************
+ *   int finishFtpDigest(ftpTransaction_t *t)
+ *
+ *   Finishes the checksum of the data a put has sent, storing it in
+ *   t->checksum in uppercase hex. Only meaningful once the whole file
+ *   has been sent
+ *
+ *   Caller must hold transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     t    transaction structure pointer                            I/O
+ *    
+ *   Returns: 1 if t->checksum holds the checksum, 0 if the transaction
+ *            doesn't keep one
+ ***********************************************************************/
+int finishFtpDigest(ftpTransaction_t *t) {
+	unsigned char md5[16];
+	int i;
+
+	if (t->digesting == 2) {
+		return 1;
+	}
+	if (t->digesting != 1) {
+		return 0;
+	}
+
+	md5_finish(&t->digest, md5);
+	if (t->checksum) {
+		globus_libc_free(t->checksum);
+	}
+	t->checksum = globus_libc_malloc(CHECKSUM_LENGTH + 1);
+	if (!t->checksum) {
+		errorExit("Out of memory in finishFtpDigest");
+	}
+	for (i = 0; i < 16; i++) {
+		sprintf(&t->checksum[i*2], "%02X", md5[i]);
+	}
+	t->digesting = 2;
+	return 1;
+}
+
+/***********************************************************************
+ *   int startFtpWrite(char *filename, ftpTransaction_t *t,
+ *                     globus_off_t restartOffset, char *errorMessage)
+ *
+ *   Starts off a write (put) operation on the given handle
+ *
+ *   Caller must hold transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     filename       Name of local file to transfer                  I
+ *     t              transaction structure pointer                   I
+ *     restartOffset  where in the file to start sending from. Must   I
+ *                    match the restart marker the put was started
+ *                    with (see getFtpRestartOffset)
  *    
  *   Returns: 1 on success, 0 on error
  ***********************************************************************/
 int startFtpWrite(const char *filename, ftpTransaction_t *t,
-		char *errorMessage) {
-	logMessage(1, "startFtpWrite(%s,%d)", filename, t->id);
+		globus_off_t restartOffset, char *errorMessage) {
+	int i;
+
+	logMessage(1, "startFtpWrite(%s,%d,%lld)", filename, t->id,
+			(long long)restartOffset);
 
 	/* Work out how many bytes to transfer */
 	t->length = getFileLength(filename);
@@ -765,14 +1546,35 @@ int startFtpWrite(const char *filename, ftpTransaction_t *t,
 	t->writing = 1;
 	t->readToBuffer = 0;
 
-	/* So far, transferred 0 bytes */
-	t->offset = 0;
+	/* So far, transferred nothing beyond what the server already has */
+	t->offset = restartOffset;
 
 	/* Not failed yet */
 	t->succeeded = 1;
 
-	/* Send the first block */
-	return startFtpWriteBlock(t);
+	/* The file is read straight through once, and checksummed as it
+	 * goes. What the server already has only needs reading for that */
+	posix_fadvise(fileno(t->file), 0, 0, POSIX_FADV_SEQUENTIAL);
+	md5_init(&t->digest);
+	t->digesting = 1;
+	if ((restartOffset > 0) && (!digestFtpPrefix(t, restartOffset))) {
+		logMessage(3, "startFtpWrite: unable to read %s", filename);
+		strncpy(errorMessage, "Could not read local file.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return 0;
+	}
+
+	/* Fill as many buffers as will be needed, up to the ring size */
+	allocateFtpRing(t, (int)((t->length - restartOffset +
+			FTP_DATA_BUFFER_SIZE - 1) / FTP_DATA_BUFFER_SIZE));
+
+	/* Send the first blocks */
+	for (i = 0; (i < t->ringSize) && (!t->reachedEnd); i++) {
+		if (!startFtpWriteBlock(t, t->ring[i])) {
+			return 0;
+		}
+	}
+	return 1;
 }
 
 /***********************************************************************
@@ -799,7 +1601,7 @@ void replicateCompleteCallback(void *data,
 	acquireTransactionListMutex();
 
 	/* Save result in case anything else wants it */
-	t->done = 1;
+	markTransactionDone(t);
 	t->succeeded = (error == GLOBUS_SUCCESS);
 	
 	if (error != GLOBUS_SUCCESS) {
@@ -809,6 +1611,7 @@ void replicateCompleteCallback(void *data,
 		} else {
 			printErrorObject(error, "copy to local");
 		}
+		abortFtpRelayPeer(t);
 	}
 
 	if (!t->waiting) {
@@ -833,8 +1636,6 @@ void replicateCompleteCallback(void *data,
  *   Returns: 1 if transaction completed, 0 if it timed out
  ***********************************************************************/
 int waitOnFtpLong(ftpTransaction_t *t, float timeOut) {
-	time_t startTime;
-	time_t endTime;
 
 	logMessage(1, "waitOnFtpLong id %d,%f", t->id, timeOut);
 
@@ -842,13 +1643,11 @@ int waitOnFtpLong(ftpTransaction_t *t, float timeOut) {
 		timeOut = 600.0;
 	}
 
-	startTime = time(NULL);
-
-	endTime = time(NULL);
-	while ((!isTransactionDone(t)) && (difftime(endTime, startTime) < timeOut)) {
-		globus_libc_usleep(1000);
-		endTime = time(NULL);
+	if (!acquireTransactionListMutex()) {
+		return 0;
 	}
+	waitForTransactionLocked(t, timeOut);
+	releaseTransactionListMutex();
 
 	if (!isTransactionDoneLastCheck(t)) {
 		if (t->writing) {
@@ -856,7 +1655,7 @@ int waitOnFtpLong(ftpTransaction_t *t, float timeOut) {
 		} else {
 			logMessage(3, "Error in copy to local: operation timed out");
 		}
-		globus_ftp_client_abort(&t->handle);
+		globus_ftp_client_abort(t->handle);
 		releaseTransactionListMutex();
 		return 0;
 	}
@@ -865,103 +1664,1502 @@ int waitOnFtpLong(ftpTransaction_t *t, float timeOut) {
 }
 
 /***********************************************************************
-*   int startFtpRead(char *filename, ftpTransaction_t *t)
-*
-*   Starts off a read (get) operation on the given handle
-*    
-*   Caller must hold the transaction list mutex!
-*
- *   Parameters:                                                     [I/O]
+ *   int waitOnFtpMany(int *handles, int count, float timeOut)
+ *    
+ *   Waits until at least one of several FTP transactions has completed,
+ *   or the time out expires. Unlike waitOnFtp, nothing is abandoned or
+ *   aborted on time out; the transactions are left for the caller to
+ *   wait on again or clean up
+ *    
+ *   Parameters:                                               [I/O]
  *
- *   filename 		Name of local file to transfer into                  I
- *   t         		transaction structure pointer                        I
- * 	 errorMessage	an error description string	(expects to have
- * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			 O
+ *    handles  IDs of the transactions to wait for              I
+ *    count    number of entries in handles                     I
+ *    timeOut  Time out value in seconds                        I
  *    
- *   Returns: 1 on success, 0 on error
-***********************************************************************/
-int startFtpRead(const char *filename, ftpTransaction_t *t, char *errorMessage)
-{
-    logMessage(DEBUG, "startFtpRead(%s,%d)", filename, t->id);
+ *   Returns: index into handles of a completed transaction (or of one
+ *            that no longer exists), -1 if none completed in time
+ ***********************************************************************/
+int waitOnFtpMany(int *handles, int count, float timeOut) {
+	globus_abstime_t deadline;
+	ftpTransaction_t *t;
+	int i;
 
-    /* Open the file we're storing the data in */
-    t->file = fopen(filename, "wb");
-    if (!t->file) {
-		logMessage(WARN, "startFtpRead: opening file %s for writing failed",
-				filename);
-		strncpy(errorMessage, "Could not open local file to write to.",
-				MAX_ERROR_MESSAGE_LENGTH);
-		return 0;
-    }
+	if (count <= 0) {
+		return -1;
+	}
 
-    /* This is not a write operation */
-    t->writing = 0;
-    t->readToBuffer = 0; /* nor a read to buffer. */
+	if (!acquireTransactionListMutex()) {
+		return -1;
+	}
 
-    /* FIXME: I think this is useless */
-    t->offset = 0;
+	getWaitDeadline(timeOut, &deadline);
+	for (;;) {
+		for (i = 0; i < count; i++) {
+			t = findTransaction(handles[i]);
+			if ((t == NULL) || (t->done)) {
+				releaseTransactionListMutex();
+				return i;
+			}
+		}
 
-    /* Not failed yet */
-    t->succeeded = 1;
+		if (globus_cond_timedwait(&anyTransactionDone_, &transactionListLock_,
+				&deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
 
-    /* Request the first block of file */
-    return startFtpReadBlock(t);
+	releaseTransactionListMutex();
+	return -1;
+}
+
+/*
+ * Runs a size or checksum command on a remote file and waits for it.
+ * For a checksum, 'length' is how much of the start of the file to
+ * cover. Returns 1 on success, 0 on error
+ */
+static int runFtpRangeQuery(const char *url, const char *hostname,
+		int checksum, globus_off_t length, globus_off_t *size,
+		char result[CHECKSUM_LENGTH + 1]) {
+	ftpTransaction_t *t;
+	globus_result_t err;
+	int succeeded;
+
+	acquireTransactionListMutex();
+	t = newFtpTransaction(checksum ? "get partial file checksum" :
+			"get partial file length", hostname);
+	if (!t) {
+		releaseTransactionListMutex();
+		return 0;
+	}
+
+	if (checksum) {
+		result[0] = '\0';
+		err = globus_ftp_client_cksm(t->handle, url, &t->attr, result, 0,
+				length, "MD5", completeCallback, t);
+	} else {
+		err = globus_ftp_client_size(t->handle, url, &t->attr, &t->length,
+				completeCallback, t);
+	}
+	if (err != GLOBUS_SUCCESS) {
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
+		return 0;
+	}
+	releaseTransactionListMutex();
+
+	/* checksumming a long file can take a while */
+	if (!waitOnFtp(t, checksum ? getNodeCopyTimeout(hostname) :
+			getNodeFtpTimeout(hostname))) {
+		return 0;
+	}
+
+	acquireTransactionListMutex();
+	succeeded = t->succeeded;
+	if (size) {
+		*size = t->length;
+	}
+	destroyFtpTransaction(t);
+	releaseTransactionListMutex();
+	return succeeded;
 }
 
 /***********************************************************************
-*   int startFtpReadToBuffer( ftpTransaction_t *t)
-*
-*   Starts off a read to buffer (get) operation on the given handle
-*    
-*   Caller must hold the transaction list mutex!
-*
+ *   int getFtpUrlChecksum(const char *url, const char *hostname,
+ *                         char checksum[CHECKSUM_LENGTH + 1])
+ *
+ *   Gets the MD5 checksum of a whole file on a GridFTP server, in upper
+ *   case hex as DiGS stores checksums
+ *    
  *   Parameters:                                                     [I/O]
  *
- *   t         		transaction structure pointer                        I
- * 	 errorMessage	an error description string	(expects to have
- * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			 O
+ *     url        gsiftp URL of the file                              I
+ *     hostname   node the file is on, for its time outs               I
+ *     checksum   receives the checksum                                 O
  *    
  *   Returns: 1 on success, 0 on error
-***********************************************************************/
-int startFtpReadToBuffer( ftpTransaction_t *t)
-{
-    logMessage(DEBUG, "startFtpReadToBuffer(%s,%d)",t->bigBuffer, t->id);
+ ***********************************************************************/
+int getFtpUrlChecksum(const char *url, const char *hostname,
+		char checksum[CHECKSUM_LENGTH + 1]) {
+	char *p;
 
-    /* This is not a write operation */
-    t->writing = 0;
-    
-    t->readToBuffer = 1;
+	if (!runFtpRangeQuery(url, hostname, 1, -1, NULL, checksum)) {
+		return 0;
+	}
+	for (p = checksum; *p; p++) {
+		*p = toupper(*p);
+	}
+	return 1;
+}
 
-    /* FIXME: I think this is useless */
-    t->offset = 0;
+/***********************************************************************
+ *   int getFtpUrlLength(const char *url, const char *hostname,
+ *                       globus_off_t *length)
+ *
+ *   Gets the length of a file on a GridFTP server
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     url        gsiftp URL of the file                              I
+ *     hostname   node the file is on, for its time outs               I
+ *     length     receives the length in bytes                          O
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+int getFtpUrlLength(const char *url, const char *hostname,
+		globus_off_t *length) {
+	return runFtpRangeQuery(url, hostname, 0, 0, length, NULL);
+}
 
-    /* Not failed yet */
-    t->succeeded = 1;
+/*
+ * Computes the MD5 checksum of the first 'length' bytes of a local
+ * file, in uppercase hex like the server's. Returns 1 on success, 0 on
+ * error
+ */
+static int getLocalRangeChecksum(const char *filename, globus_off_t length,
+		char result[CHECKSUM_LENGTH + 1]) {
+	md5_state_t md5State;
+	md5_byte_t digest[16];
+	char *buffer;
+	ssize_t n;
+	int fd;
+	int i;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+	if (!buffer) {
+		errorExit("Out of memory in getLocalRangeChecksum");
+	}
 
-    /* Request the first block of file */
-    return startFtpReadBlock(t);
+	md5_init(&md5State);
+	while (length > 0) {
+		n = read(fd, buffer, (length < FTP_DATA_BUFFER_SIZE) ?
+				(size_t)length : FTP_DATA_BUFFER_SIZE);
+		if (n <= 0) {
+			break;
+		}
+		md5_append(&md5State, (md5_byte_t *)buffer, (int)n);
+		length -= n;
+	}
+	md5_finish(&md5State, digest);
+	globus_libc_free(buffer);
+	close(fd);
+
+	if (length > 0) {
+		/* file is shorter than it was a moment ago */
+		return 0;
+	}
+	for (i = 0; i < 16; i++) {
+		sprintf(&result[i * 2], "%02X", digest[i]);
+	}
+	return 1;
 }
 
 /***********************************************************************
-*   ftpTransaction_t *findTransaction(int handle)
-*
-*   Finds the transaction to which the handle refers
-*    
-*   Caller must hold the transaction list mutex!
-*
-*   Parameters:                                                     [I/O]
-*
-*     handle   the identifier of the transaction                     I
-*    
-*   Returns: transaction, or NULL if not found
-***********************************************************************/
-ftpTransaction_t *findTransaction(int handle)
+ *   globus_off_t getFtpRestartOffset(const char *url, const char *hostname,
+ *                                    const char *localFile, int writing)
+ *
+ *   Works out where a put or get can carry on from after an earlier
+ *   attempt at it failed part way through. A failed get leaves its
+ *   partial local file behind (see keepPartialFtpRead), and a failed put
+ *   leaves the partial file on the server. If the partial file is
+ *   shorter than the source and its MD5 checksum matches that of the
+ *   same length at the start of the source, only the rest needs to be
+ *   sent. Nothing is kept about the earlier attempt except the partial
+ *   file itself, so a transfer resumes the same way after a restart of
+ *   the process.
+ *
+ *   Transfers of less than FTP_RESTART_MINIMUM bytes always start from
+ *   the beginning, which saves looking for a partial file. Resuming can
+ *   be turned off for a node by setting its 'ftprestart' property to 0.
+ *
+ *   Must not be called with the transaction list mutex held.
+ *
+ *   Parameters:                                                     [I/O]
+ *
+ *     url        for a put, the partial file on the server; for a     I
+ *                get, the source file
+ *     hostname   node the transfer is to or from                      I
+ *     localFile  for a put, the source file; for a get, the partial   I
+ *                file
+ *     writing    set for a put, clear for a get                       I
+ *
+ *   Returns: offset to restart the transfer at, 0 to start again from
+ *            the beginning
+ ***********************************************************************/
+globus_off_t getFtpRestartOffset(const char *url, const char *hostname,
+		const char *localFile, int writing) {
+	char localChecksum[CHECKSUM_LENGTH + 1];
+	char remoteChecksum[CHECKSUM_LENGTH + 1];
+	globus_off_t remoteLength;
+	globus_off_t partial, total;
+	struct stat statbuf;
+	char *prop;
+
+	prop = getNodeProperty(hostname, "ftprestart");
+	if (prop) {
+		if (!atoi(prop)) {
+			globus_libc_free(prop);
+			return 0;
+		}
+		globus_libc_free(prop);
+	}
+
+	/*
+	 * The local file is checked first, as that's cheaper. Whichever
+	 * end it is, there is too little to gain if it's small
+	 */
+	if ((stat(localFile, &statbuf) < 0) ||
+			(statbuf.st_size < FTP_RESTART_MINIMUM)) {
+		return 0;
+	}
+
+	if (!runFtpRangeQuery(url, hostname, 0, 0, &remoteLength, NULL)) {
+		/* for a put this is the usual case, with nothing there yet */
+		return 0;
+	}
+
+	if (writing) {
+		partial = remoteLength;
+		total = (globus_off_t)statbuf.st_size;
+	} else {
+		partial = (globus_off_t)statbuf.st_size;
+		total = remoteLength;
+	}
+	if ((partial <= 0) || (partial >= total)) {
+		return 0;
+	}
+
+	if ((!getLocalRangeChecksum(localFile, partial, localChecksum)) ||
+			(!runFtpRangeQuery(url, hostname, 1, partial, NULL,
+					remoteChecksum))) {
+		return 0;
+	}
+	if (strcasecmp(localChecksum, remoteChecksum)) {
+		logMessage(WARN, "Partial copy of %s doesn't match, starting again",
+				url);
+		return 0;
+	}
+
+	logMessage(INFO, "Resuming transfer of %s at byte %lld of %lld", url,
+			(long long)partial, (long long)total);
+	return partial;
+}
+
+/***********************************************************************
+ *   globus_ftp_client_restart_marker_t *
+ *   setFtpRestartMarker(globus_ftp_client_restart_marker_t *marker,
+ *                       globus_off_t restartOffset)
+ *
+ *   Sets up the restart marker to pass to globus_ftp_client_put or _get
+ *   for a transfer resuming at restartOffset
+ *
+ *   Parameters:                                                     [I/O]
+ *
+ *     marker         marker to set up                                 O
+ *     restartOffset  offset to resume at, from getFtpRestartOffset    I
+ *
+ *   Returns: marker, or NULL if the transfer is starting from the
+ *            beginning. A non-NULL marker must be destroyed with
+ *            globus_ftp_client_restart_marker_destroy once the transfer
+ *            has been started
+ ***********************************************************************/
+globus_ftp_client_restart_marker_t *setFtpRestartMarker(
+		globus_ftp_client_restart_marker_t *marker,
+		globus_off_t restartOffset) {
+	if (restartOffset <= 0) {
+		return NULL;
+	}
+	globus_ftp_client_restart_marker_init(marker);
+	globus_ftp_client_restart_marker_insert_range(marker, 0, restartOffset);
+	return marker;
+}
+
+/***********************************************************************
+ *   void keepPartialFtpRead(ftpTransaction_t *t, const char *filename)
+ *
+ *   Called when a get has failed. With parallel streams the blocks
+ *   arrive in any order, so the local file may have gaps; it is cut
+ *   back to the data received from the start of the file without any,
+ *   so that getFtpRestartOffset can carry on from the end of it
+ *
+ *   Caller must hold the transaction list mutex!
+ *
+ *   Parameters:                                                     [I/O]
+ *
+ *     t         the failed get                                        I
+ *     filename  the local file it was writing to                      I
+ *
+ *   Returns: (void)
+ ***********************************************************************/
+void keepPartialFtpRead(ftpTransaction_t *t, const char *filename) {
+	globus_off_t start, end;
+
+	if ((globus_ftp_client_restart_marker_get_first_block(&t->received,
+			&start, &end) != GLOBUS_SUCCESS) || (start != 0) ||
+			(end <= 0)) {
+		/* nothing worth keeping */
+		unlink(filename);
+		return;
+	}
+
+	if (truncate(filename, (off_t)end) < 0) {
+		unlink(filename);
+		return;
+	}
+	logMessage(DEBUG, "Kept %lld bytes of %s to resume from", (long long)end,
+			filename);
+}
+
+/***********************************************************************
+*   int startFtpReadBlocks(ftpTransaction_t *t, globus_off_t offset)
+*
+*   Registers the first blocks of a get whose local file is open
+*    
+*   Caller must hold the transaction list mutex!
+*
+ *   Parameters:                                                     [I/O]
+ *
+ *   t         		transaction structure pointer                        I
+ *   offset			offset in the file the data starts at                I
+ *    
+ *   Returns: 1 on success, 0 on error
+***********************************************************************/
+static int startFtpReadBlocks(ftpTransaction_t *t, globus_off_t offset)
+{
+    int i;
+
+    /* This is not a write operation */
+    t->writing = 0;
+    t->readToBuffer = 0; /* nor a read to buffer. */
+
+    t->offset = offset;
+
+    /* Not failed yet */
+    t->succeeded = 1;
+
+    /* Keep several blocks on their way at once */
+    allocateFtpRing(t, 0);
+    for (i = 0; i < t->ringSize; i++) {
+	if (!startFtpReadBlock(t, t->ring[i])) {
+	    return 0;
+	}
+	t->outstanding++;
+    }
+    return 1;
+}
+
+/***********************************************************************
+*   int startFtpRead(char *filename, ftpTransaction_t *t,
+*                    globus_off_t restartOffset, char *errorMessage)
+*
+*   Starts off a read (get) operation on the given handle
+*    
+*   Caller must hold the transaction list mutex!
+*
+ *   Parameters:                                                     [I/O]
+ *
+ *   filename 		Name of local file to transfer into                  I
+ *   t         		transaction structure pointer                        I
+ *   restartOffset	length of the data already in the file, which is     I
+ *   				kept. Must match the restart marker the get was
+ *   				started with (see getFtpRestartOffset)
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			 O
+ *    
+ *   Returns: 1 on success, 0 on error
+***********************************************************************/
+int startFtpRead(const char *filename, ftpTransaction_t *t,
+		 globus_off_t restartOffset, char *errorMessage)
+{
+    logMessage(DEBUG, "startFtpRead(%s,%d,%lld)", filename, t->id,
+	       (long long)restartOffset);
+
+    /* Open the file we're storing the data in */
+    if (restartOffset > 0) {
+	t->file = fopen(filename, "r+b");
+	globus_ftp_client_restart_marker_insert_range(&t->received, 0,
+						      restartOffset);
+    } else {
+	t->file = fopen(filename, "wb");
+    }
+    if (!t->file) {
+		logMessage(WARN, "startFtpRead: opening file %s for writing failed",
+				filename);
+		strncpy(errorMessage, "Could not open local file to write to.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return 0;
+    }
+
+    return startFtpReadBlocks(t, restartOffset);
+}
+
+/***********************************************************************
+*   int startFtpReadRange(char *filename, ftpTransaction_t *t,
+*                         globus_off_t offset, char *errorMessage)
+*
+*   Starts off a partial get on the given handle, writing the data into
+*   place in an existing local file without truncating it
+*    
+*   Caller must hold the transaction list mutex!
+*
+ *   Parameters:                                                     [I/O]
+ *
+ *   filename 		Name of local file to transfer into                  I
+ *   t         		transaction structure pointer                        I
+ *   offset			where the range being fetched starts                 I
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			 O
+ *    
+ *   Returns: 1 on success, 0 on error
+***********************************************************************/
+int startFtpReadRange(const char *filename, ftpTransaction_t *t,
+		      globus_off_t offset, char *errorMessage)
+{
+    logMessage(DEBUG, "startFtpReadRange(%s,%d,%lld)", filename, t->id,
+	       (long long)offset);
+
+    t->file = fopen(filename, "r+b");
+    if (!t->file) {
+		logMessage(WARN, "startFtpReadRange: opening file %s for writing failed",
+				filename);
+		strncpy(errorMessage, "Could not open local file to write to.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return 0;
+    }
+    t->inPlace = 1;
+
+    return startFtpReadBlocks(t, offset);
+}
+
+/***********************************************************************
+*   int startFtpReadToBuffer( ftpTransaction_t *t)
+*
+*   Starts off a read to buffer (get) operation on the given handle
+*    
+*   Caller must hold the transaction list mutex!
+*
+ *   Parameters:                                                     [I/O]
+ *
+ *   t         		transaction structure pointer                        I
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			 O
+ *    
+ *   Returns: 1 on success, 0 on error
+***********************************************************************/
+int startFtpReadToBuffer( ftpTransaction_t *t)
+{
+    logMessage(DEBUG, "startFtpReadToBuffer(%s,%d)",t->bigBuffer, t->id);
+
+    /* This is not a write operation */
+    t->writing = 0;
+    
+    t->readToBuffer = 1;
+
+    /* FIXME: I think this is useless */
+    t->offset = 0;
+
+    /* Not failed yet */
+    t->succeeded = 1;
+
+    /* Request the first block of file */
+    return startFtpReadBlock(t, t->buffer);
+}
+
+/***********************************************************************
+*   ftpTransaction_t *findTransaction(int handle)
+*
+*   Finds the transaction to which the handle refers
+*    
+*   Caller must hold the transaction list mutex!
+*
+*   Parameters:                                                     [I/O]
+*
+*     handle   the identifier of the transaction                     I
+*    
+*   Returns: transaction, or NULL if not found
+***********************************************************************/
+ftpTransaction_t *findTransaction(int handle)
 {
-  ftpTransaction_t *t;
+  return lookupTransferHandle(HANDLE_OWNER_GLOBUS, handle);
+}
+
+/*=====================================================================
+ *
+ * Streaming relay between two GridFTP servers
+ *
+ *===================================================================*/
+static void relayReadCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof);
+static void relayWriteCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof);
+
+/***********************************************************************
+ *   ftpRelay_t *newFtpRelay(ftpTransaction_t *reader,
+ *                           ftpTransaction_t *writer)
+ *
+ *   Creates a relay joining a get transaction to a put transaction and
+ *   allocates its ring of blocks
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     reader   transaction reading from the source                  I
+ *     writer   transaction writing to the destination               I
+ *    
+ *   Returns: pointer to the new relay
+ ***********************************************************************/
+ftpRelay_t *newFtpRelay(ftpTransaction_t *reader, ftpTransaction_t *writer) {
+	ftpRelay_t *relay;
+	int i;
+
+	relay = globus_libc_malloc(sizeof(ftpRelay_t));
+	if (!relay) {
+		errorExit("Out of memory in newFtpRelay");
+	}
+
+	for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+		relay->blocks[i].data = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+		if (!relay->blocks[i].data) {
+			errorExit("Out of memory in newFtpRelay");
+		}
+		relay->blocks[i].length = 0;
+		relay->blocks[i].offset = 0;
+		relay->blocks[i].state = RELAY_BLOCK_FREE;
+	}
+
+	relay->nextRead = 0;
+	relay->nextWrite = 0;
+	relay->readEof = 0;
+	relay->eofSent = 0;
+	relay->failed = 0;
+	relay->written = 0;
+
+	relay->reader = reader;
+	relay->writer = writer;
+	reader->relay = relay;
+	writer->relay = relay;
+	relay->refs = 2;
+
+	return relay;
+}
+
+/***********************************************************************
+ *   void releaseFtpRelay(ftpRelay_t *relay, ftpTransaction_t *t)
+ *
+ *   Called when one of the relay's transactions is destroyed. Frees
+ *   the relay once neither end refers to it any more
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     relay    the relay                                             I
+ *     t        the transaction being destroyed                       I
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+static void releaseFtpRelay(ftpRelay_t *relay, ftpTransaction_t *t) {
+	int i;
+
+	if (relay->reader == t) {
+		relay->reader = NULL;
+	}
+	if (relay->writer == t) {
+		relay->writer = NULL;
+	}
+
+	relay->refs--;
+	if (relay->refs > 0) {
+		return;
+	}
+
+	for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+		globus_libc_free(relay->blocks[i].data);
+	}
+	globus_libc_free(relay);
+}
+
+/***********************************************************************
+ *   void abortFtpRelayPeer(ftpTransaction_t *t)
+ *
+ *   If the transaction is one end of a relay, marks the relay failed
+ *   and aborts the transaction at the other end
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     t        the transaction that failed                           I
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void abortFtpRelayPeer(ftpTransaction_t *t) {
+	ftpRelay_t *relay = t->relay;
+	ftpTransaction_t *peer;
+
+	if (!relay) {
+		return;
+	}
+	relay->failed = 1;
+
+	peer = (relay->reader == t) ? relay->writer : relay->reader;
+	if ((peer) && (!peer->done)) {
+		if (globus_ftp_client_abort(peer->handle) != GLOBUS_SUCCESS) {
+			logMessage(WARN, "Error aborting FTP operation %s", peer->opName);
+		}
+	}
+}
 
-  t = transactionListHead_;
-  while ((t != NULL) && (t->id != handle)) {
-    t = t->next;
-  }
-  return t;
+/***********************************************************************
+ *   int pumpFtpRelay(ftpRelay_t *relay)
+ *
+ *   Moves the relay on as far as it can: registers writes for any full
+ *   blocks (in order), reads into any free blocks, and the final end
+ *   of file write once everything has been sent
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     relay    the relay                                             I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+static int pumpFtpRelay(ftpRelay_t *relay) {
+	relayBlock_t *b;
+	globus_result_t err;
+	int i, busy;
+
+	if ((relay->failed) || (!relay->writer)) {
+		return 0;
+	}
+
+	/* Send full blocks to the destination in the order they were read */
+	b = &relay->blocks[relay->nextWrite];
+	while (b->state == RELAY_BLOCK_FULL) {
+		if (b->length == 0) {
+			/* nothing in it (the source's end of file marker) */
+			b->state = RELAY_BLOCK_FREE;
+		} else {
+			b->state = RELAY_BLOCK_WRITING;
+			err = globus_ftp_client_register_write(relay->writer->handle,
+					(globus_byte_t *)b->data, b->length, b->offset,
+					GLOBUS_FALSE, relayWriteCallback, relay);
+			if (err != GLOBUS_SUCCESS) {
+				printError(err, "globus_ftp_client_register_write");
+				return 0;
+			}
+		}
+		relay->nextWrite = (relay->nextWrite + 1) % RELAY_BUFFER_COUNT;
+		b = &relay->blocks[relay->nextWrite];
+	}
+
+	/* Read more from the source into the free blocks */
+	if (!relay->readEof) {
+		b = &relay->blocks[relay->nextRead];
+		while (b->state == RELAY_BLOCK_FREE) {
+			b->state = RELAY_BLOCK_READING;
+			err = globus_ftp_client_register_read(relay->reader->handle,
+					(globus_byte_t *)b->data, FTP_DATA_BUFFER_SIZE,
+					relayReadCallback, relay);
+			if (err != GLOBUS_SUCCESS) {
+				printError(err, "globus_ftp_client_register_read");
+				b->state = RELAY_BLOCK_FREE;
+				return 0;
+			}
+			relay->nextRead = (relay->nextRead + 1) % RELAY_BUFFER_COUNT;
+			b = &relay->blocks[relay->nextRead];
+		}
+		return 1;
+	}
+
+	/* Source finished. Once every block has drained, close the put */
+	busy = 0;
+	for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+		if (relay->blocks[i].state != RELAY_BLOCK_FREE) {
+			busy = 1;
+		}
+	}
+	if ((!busy) && (!relay->eofSent)) {
+		relay->eofSent = 1;
+		b = &relay->blocks[relay->nextWrite];
+		b->state = RELAY_BLOCK_WRITING;
+		err = globus_ftp_client_register_write(relay->writer->handle,
+				(globus_byte_t *)b->data, 0, relay->written, GLOBUS_TRUE,
+				relayWriteCallback, relay);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_register_write");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/***********************************************************************
+ *   relayBlock_t *findRelayBlock(relayBlock_t *blocks,
+ *                                globus_byte_t *buffer)
+ *
+ *   Finds the block of a relay's or stream's ring owning a data buffer
+ *   passed back by Globus
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     blocks   the ring of RELAY_BUFFER_COUNT blocks                 I
+ *     buffer   data buffer from a read or write callback             I
+ *    
+ *   Returns: the block, or NULL if not found
+ ***********************************************************************/
+static relayBlock_t *findRelayBlock(relayBlock_t *blocks,
+		globus_byte_t *buffer) {
+	int i;
+
+	for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+		if ((globus_byte_t *)blocks[i].data == buffer) {
+			return &blocks[i];
+		}
+	}
+	return NULL;
+}
+
+/***********************************************************************
+ *   void relayReadCallback(...)
+ *
+ *   Data callback for reads from a relay's source. Marks the block as
+ *   full and moves the relay on
+ ***********************************************************************/
+static void relayReadCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof) {
+	ftpRelay_t *relay = (ftpRelay_t *)userArg;
+	relayBlock_t *b;
+
+	acquireTransactionListMutex();
+
+	b = findRelayBlock(relay->blocks, buffer);
+	if (b) {
+		b->length = length;
+		b->offset = offset;
+		b->state = RELAY_BLOCK_FULL;
+	}
+
+	if (error != GLOBUS_SUCCESS) {
+		printErrorObject(error, "relay read");
+		if (relay->reader) {
+			abortFtpRelayPeer(relay->reader);
+		}
+		releaseTransactionListMutex();
+		return;
+	}
+
+	if (eof) {
+		relay->readEof = 1;
+	}
+
+	if ((!pumpFtpRelay(relay)) && (!relay->failed) && (relay->reader)) {
+		abortFtpRelayPeer(relay->reader);
+		globus_ftp_client_abort(handle);
+	}
+
+	releaseTransactionListMutex();
+}
+
+/***********************************************************************
+ *   void relayWriteCallback(...)
+ *
+ *   Data callback for writes to a relay's destination. Frees the block
+ *   for reading into again and moves the relay on
+ ***********************************************************************/
+static void relayWriteCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof) {
+	ftpRelay_t *relay = (ftpRelay_t *)userArg;
+	relayBlock_t *b;
+
+	acquireTransactionListMutex();
+
+	b = findRelayBlock(relay->blocks, buffer);
+	if (b) {
+		b->state = RELAY_BLOCK_FREE;
+	}
+
+	if (error != GLOBUS_SUCCESS) {
+		printErrorObject(error, "relay write");
+		if (relay->writer) {
+			abortFtpRelayPeer(relay->writer);
+		}
+		releaseTransactionListMutex();
+		return;
+	}
+
+	relay->written += length;
+	if (relay->writer) {
+		relay->writer->offset = relay->written;
+		relay->writer->transferred = relay->written;
+	}
+
+	if ((!pumpFtpRelay(relay)) && (!relay->failed) && (relay->writer)) {
+		abortFtpRelayPeer(relay->writer);
+		globus_ftp_client_abort(handle);
+	}
+
+	releaseTransactionListMutex();
+}
+
+/***********************************************************************
+ *   int startFtpRelay(ftpRelay_t *relay)
+ *
+ *   Starts data flowing through a relay once the get and put
+ *   operations have both been started
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     relay    the relay                                             I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+int startFtpRelay(ftpRelay_t *relay) {
+	relay->reader->succeeded = 1;
+	relay->writer->succeeded = 1;
+	relay->writer->writing = 1;
+	relay->writer->offset = 0;
+	return pumpFtpRelay(relay);
+}
+
+/***********************************************************************
+ *   void relayReadCompleteCallback(void *data,
+ *               globus_ftp_client_handle_t *handle, globus_object_t *error)
+ *    
+ *   Callback invoked by Globus when the get at the source end of a
+ *   relay completes. Nobody waits on the reading transaction (the put
+ *   carries the relay's result) so it is destroyed here; if the get
+ *   failed the put is aborted too
+ *    
+ *   Parameters:                                               [I/O]
+ *
+ *    data   Pointer to transaction structure of operation      I
+ *    handle Pointer to handle of operation                     I
+ *    error  Pointer to Globus error object indicating result   I    
+ *
+ *   Returns: (void)
+ ***********************************************************************/
+void relayReadCompleteCallback(void *data,
+		globus_ftp_client_handle_t *handle, globus_object_t *error) {
+	ftpTransaction_t *t;
+
+	t = (ftpTransaction_t *)data;
+
+	acquireTransactionListMutex();
+
+	markTransactionDone(t);
+	t->succeeded = (error == GLOBUS_SUCCESS);
+	if (error != GLOBUS_SUCCESS) {
+		printErrorObject(error, "relay from source");
+		abortFtpRelayPeer(t);
+	}
+
+	destroyFtpTransaction(t);
+
+	releaseTransactionListMutex();
+}
+
+/***********************************************************************
+ *   digs_error_code_t startFtpUrlRelay(char *errorMessage,
+ *               const char *fromHost, const char *fromUrl,
+ *               const char *toHost, const char *toUrl, char *checksum,
+ *               const char *destFilepath, int *handle)
+ *
+ *   Starts streaming a file from one GridFTP URL to another through a
+ *   relay. The handle returned is that of the transaction writing to
+ *   the destination, which carries the result of the whole relay. The
+ *   checksum of the source and the destination (in whatever form the
+ *   one ending the transaction wants it) are kept in that transaction
+ *   for checking the copy against
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     errorMessage  buffer to receive error message                    O
+ *     fromHost      node the file is read from                       I
+ *     fromUrl       URL to read the file from                        I
+ *     toHost        node the file is written to                      I
+ *     toUrl         URL to write the file to                         I
+ *     checksum      checksum of the source file. Freed with the      I
+ *                   writing transaction, or here on error
+ *     destFilepath  destination recorded in the writing transaction  I
+ *     handle        receives the handle of the writing transaction     O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t startFtpUrlRelay(char *errorMessage, const char *fromHost,
+		const char *fromUrl, const char *toHost, const char *toUrl,
+		char *checksum, const char *destFilepath, int *handle) {
+	globus_result_t err;
+	globus_object_t *errorObject;
+	ftpTransaction_t *reader;
+	ftpTransaction_t *writer;
+	ftpRelay_t *relay;
+
+	*handle = -1;
+
+	acquireTransactionListMutex();
+	writer = newFtpTransaction("relay write", toHost);
+	if (!writer) {
+		releaseTransactionListMutex();
+		globus_libc_free(checksum);
+		return DIGS_UNKNOWN_ERROR;
+	}
+	reader = newFtpTransaction("relay read", fromHost);
+	if (!reader) {
+		destroyFtpTransaction(writer);
+		releaseTransactionListMutex();
+		globus_libc_free(checksum);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	/* Nobody waits on the reading end; the writing end carries the
+	 * result of the whole relay */
+	reader->waiting = 0;
+
+	relay = newFtpRelay(reader, writer);
+
+	writer->writing = 1;
+	writer->checksum = checksum;
+	writer->destFilepath = safe_strdup(destFilepath);
+	writer->hostname = safe_strdup(toHost);
+
+	/* Blocks may only be sent out of order if the destination is in
+	 * extended block mode, so the source has to follow it */
+	setFtpTransferAttributes(&reader->attr, fromHost);
+	if (!setFtpTransferAttributes(&writer->attr, toHost)) {
+		setFtpStreamMode(&reader->attr);
+	}
+
+	err = globus_ftp_client_put(writer->handle, toUrl, &writer->attr, NULL,
+			replicateCompleteCallback, writer);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_put");
+		destroyFtpTransaction(reader);
+		destroyFtpTransaction(writer);
+		releaseTransactionListMutex();
+
+		errorObject = globus_error_get(err);
+		return getErrorAndMessageFromGlobus(errorObject, errorMessage);
+	}
+
+	err = globus_ftp_client_get(reader->handle, fromUrl, &reader->attr, NULL,
+			relayReadCompleteCallback, reader);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_get");
+		/* The put has started, so abort it and let its callback clean up
+		 * the writing end once the caller is no longer waiting */
+		destroyFtpTransaction(reader);
+		writer->waiting = 0;
+		globus_ftp_client_abort(writer->handle);
+		releaseTransactionListMutex();
+
+		errorObject = globus_error_get(err);
+		return getErrorAndMessageFromGlobus(errorObject, errorMessage);
+	}
+
+	/* and start moving data between them */
+	if (!startFtpRelay(relay)) {
+		writer->waiting = 0;
+		abortFtpRelayPeer(reader);
+		globus_ftp_client_abort(reader->handle);
+		releaseTransactionListMutex();
+		strncpy(errorMessage, "Could not start relaying data.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	*handle = writer->id;
+	releaseTransactionListMutex();
+
+	return DIGS_SUCCESS;
+}
+
+/*=====================================================================
+ *
+ * Streams between a GridFTP server and a thread of this process
+ *
+ *===================================================================*/
+static void streamReadCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof);
+static void streamWriteCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof);
+static void fillFtpStream(ftpStream_t *s);
+
+/***********************************************************************
+ *   digs_error_code_t openFtpStream(char *errorMessage,
+ *               const char *hostname, const char *url, int writing,
+ *               ftpStream_t **stream)
+ *
+ *   Starts a get or put of a GridFTP URL whose data is read or written
+ *   a piece at a time by the calling thread, with readFtpStream or
+ *   writeFtpStream. The stream must be finished with closeFtpStream
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     errorMessage  buffer to receive error message                    O
+ *     hostname      node the URL is on                               I
+ *     url           gsiftp URL of the file                           I
+ *     writing       set for a put, clear for a get                   I
+ *     stream        receives the stream                                O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t openFtpStream(char *errorMessage, const char *hostname,
+		const char *url, int writing, ftpStream_t **stream) {
+	ftpStream_t *s;
+	ftpTransaction_t *t;
+	globus_result_t err;
+	int i;
+
+	*stream = NULL;
+
+	acquireTransactionListMutex();
+	t = newFtpTransaction(writing ? "stream write" : "stream read", hostname);
+	if (!t) {
+		releaseTransactionListMutex();
+		strcpy(errorMessage, "Error creating new FTP transaction");
+		return DIGS_UNKNOWN_ERROR;
+	}
+	t->writing = writing;
+	if (hostname) {
+		t->hostname = safe_strdup(hostname);
+	}
+
+	/* The calling thread deals with the data in order */
+	setFtpTransferAttributes(&t->attr, hostname);
+	setFtpStreamMode(&t->attr);
+
+	if (writing) {
+		err = globus_ftp_client_put(t->handle, url, &t->attr, NULL,
+				completeCallback, t);
+	} else {
+		err = globus_ftp_client_get(t->handle, url, &t->attr, NULL,
+				completeCallback, t);
+	}
+	if (err != GLOBUS_SUCCESS) {
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
+		return getErrorAndMessageFromGlobus(globus_error_get(err),
+				errorMessage);
+	}
+
+	s = globus_libc_malloc(sizeof(ftpStream_t));
+	if (!s) {
+		errorExit("Out of memory in openFtpStream");
+	}
+	for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+		s->blocks[i].data = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+		if (!s->blocks[i].data) {
+			errorExit("Out of memory in openFtpStream");
+		}
+		s->blocks[i].length = 0;
+		s->blocks[i].offset = 0;
+		s->blocks[i].state = RELAY_BLOCK_FREE;
+	}
+	s->t = t;
+	s->writing = writing;
+	s->current = writing ? 0 : -1;
+	s->used = 0;
+	s->offset = 0;
+	s->eof = 0;
+	s->failed = 0;
+
+	/* a get starts reading straight away, to have data ready */
+	if (!writing) {
+		fillFtpStream(s);
+	}
+
+	*stream = s;
+	releaseTransactionListMutex();
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *   int waitOnFtpStream(ftpStream_t *s)
+ *
+ *   Waits for a block of a stream to be called back, or its transfer
+ *   to finish. Gives up if nothing has happened within the node's FTP
+ *   time out
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     s        the stream                                            I
+ *    
+ *   Returns: 1 if something happened, 0 if it timed out
+ ***********************************************************************/
+static int waitOnFtpStream(ftpStream_t *s) {
+	globus_abstime_t deadline;
+	float timeOut;
+
+	timeOut = -1.0;
+	if (s->t->hostname) {
+		timeOut = getNodeFtpTimeout(s->t->hostname);
+	}
+	if (timeOut < 0.0) {
+		timeOut = 45.0;
+	}
+
+	getWaitDeadline(timeOut, &deadline);
+	if (globus_cond_timedwait(&s->t->doneCond, &transactionListLock_,
+			&deadline) == ETIMEDOUT) {
+		logMessage(WARN, "Error in %s: operation timed out", s->t->opName);
+		return 0;
+	}
+	return 1;
+}
+
+/***********************************************************************
+ *   void fillFtpStream(ftpStream_t *s)
+ *
+ *   Registers reads into all the free blocks of a get's ring, unless
+ *   the end of the file has already been reached
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     s        the stream                                            I
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+static void fillFtpStream(ftpStream_t *s) {
+	globus_result_t err;
+	int i;
+
+	for (i = 0; (i < RELAY_BUFFER_COUNT) && (!s->eof) && (!s->failed); i++) {
+		if (s->blocks[i].state != RELAY_BLOCK_FREE) {
+			continue;
+		}
+		s->blocks[i].state = RELAY_BLOCK_READING;
+		err = globus_ftp_client_register_read(s->t->handle,
+				(globus_byte_t *)s->blocks[i].data, FTP_DATA_BUFFER_SIZE,
+				streamReadCallback, s);
+		if (err != GLOBUS_SUCCESS) {
+			printError(err, "globus_ftp_client_register_read");
+			s->blocks[i].state = RELAY_BLOCK_FREE;
+			s->failed = 1;
+		}
+	}
+}
+
+/***********************************************************************
+ *   int readFtpStream(ftpStream_t *s, char *buffer, int length)
+ *
+ *   Reads the next part of the file from a get stream, waiting for it
+ *   to arrive if need be
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     s        the stream                                            I
+ *     buffer   receives the data                                       O
+ *     length   how many bytes to read                                I
+ *    
+ *   Returns: number of bytes read, which is only less than length at
+ *            the end of the file, or -1 on error
+ ***********************************************************************/
+int readFtpStream(ftpStream_t *s, char *buffer, int length) {
+	relayBlock_t *b;
+	globus_size_t n;
+	int copied = 0;
+	int busy;
+	int i;
+
+	acquireTransactionListMutex();
+	while (copied < length) {
+		/* find the block that carries on from where the thread got to */
+		if (s->current < 0) {
+			busy = 0;
+			for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+				b = &s->blocks[i];
+				if ((b->state == RELAY_BLOCK_FULL) &&
+						(b->offset == s->offset)) {
+					s->current = i;
+					s->used = 0;
+				}
+				if (b->state == RELAY_BLOCK_READING) {
+					busy = 1;
+				}
+			}
+		}
+
+		if (s->current < 0) {
+			if ((s->failed) || ((s->t->done) && (!s->t->succeeded))) {
+				releaseTransactionListMutex();
+				return -1;
+			}
+			if ((s->eof) && (!busy)) {
+				/* end of file */
+				break;
+			}
+			fillFtpStream(s);
+			if ((!s->failed) && (!waitOnFtpStream(s))) {
+				s->failed = 1;
+			}
+			continue;
+		}
+
+		b = &s->blocks[s->current];
+		n = b->length - s->used;
+		if (n > (globus_size_t)(length - copied)) {
+			n = length - copied;
+		}
+		memcpy(buffer + copied, b->data + s->used, n);
+		copied += n;
+		s->used += n;
+		s->offset += n;
+
+		if (s->used == b->length) {
+			/* all used, so it can be read into again */
+			b->state = RELAY_BLOCK_FREE;
+			s->current = -1;
+			fillFtpStream(s);
+		}
+	}
+	releaseTransactionListMutex();
+	return copied;
+}
+
+/***********************************************************************
+ *   int sendFtpStreamBlock(ftpStream_t *s, globus_bool_t eof)
+ *
+ *   Registers the write of the block a put stream has been filling and
+ *   moves on to the next one
+ *
+ *   Caller must hold the transaction list mutex!
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     s        the stream                                            I
+ *     eof      set if this is the last block of the file             I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+static int sendFtpStreamBlock(ftpStream_t *s, globus_bool_t eof) {
+	relayBlock_t *b = &s->blocks[s->current];
+	globus_result_t err;
+
+	b->length = s->used;
+	b->offset = s->offset;
+	b->state = RELAY_BLOCK_WRITING;
+	err = globus_ftp_client_register_write(s->t->handle,
+			(globus_byte_t *)b->data, b->length, b->offset, eof,
+			streamWriteCallback, s);
+	if (err != GLOBUS_SUCCESS) {
+		printError(err, "globus_ftp_client_register_write");
+		b->state = RELAY_BLOCK_FREE;
+		s->failed = 1;
+		return 0;
+	}
+
+	s->offset += s->used;
+	s->used = 0;
+	s->current = (s->current + 1) % RELAY_BUFFER_COUNT;
+	return 1;
+}
+
+/***********************************************************************
+ *   int writeFtpStream(ftpStream_t *s, const char *buffer, int length)
+ *
+ *   Writes the next part of the file to a put stream, waiting for room
+ *   in the ring if need be
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     s        the stream                                            I
+ *     buffer   the data                                              I
+ *     length   how many bytes to write                               I
+ *    
+ *   Returns: 1 on success, 0 on error
+ ***********************************************************************/
+int writeFtpStream(ftpStream_t *s, const char *buffer, int length) {
+	relayBlock_t *b;
+	globus_size_t n;
+	int copied = 0;
+
+	acquireTransactionListMutex();
+	while (copied < length) {
+		if ((s->failed) || (s->t->done)) {
+			releaseTransactionListMutex();
+			return 0;
+		}
+
+		b = &s->blocks[s->current];
+		if (b->state != RELAY_BLOCK_FREE) {
+			/* ring full, wait for the oldest write to be sent */
+			if (!waitOnFtpStream(s)) {
+				s->failed = 1;
+			}
+			continue;
+		}
+
+		n = FTP_DATA_BUFFER_SIZE - s->used;
+		if (n > (globus_size_t)(length - copied)) {
+			n = length - copied;
+		}
+		memcpy(b->data + s->used, buffer + copied, n);
+		copied += n;
+		s->used += n;
+
+		if ((s->used == FTP_DATA_BUFFER_SIZE) &&
+				(!sendFtpStreamBlock(s, GLOBUS_FALSE))) {
+			releaseTransactionListMutex();
+			return 0;
+		}
+	}
+	releaseTransactionListMutex();
+	return 1;
+}
+
+/***********************************************************************
+ *   digs_error_code_t closeFtpStream(char *errorMessage,
+ *               ftpStream_t *s, int complete)
+ *
+ *   Finishes with a stream and frees it. If complete is set, a put is
+ *   finished off with whatever is left in its ring and both kinds wait
+ *   for the server to confirm the transfer; otherwise the transfer is
+ *   aborted
+ *    
+ *   Parameters:                                                     [I/O]
+ *
+ *     errorMessage  buffer to receive error message                    O
+ *     s             the stream                                       I
+ *     complete      set if the whole file has been read or written   I
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t closeFtpStream(char *errorMessage, ftpStream_t *s,
+		int complete) {
+	ftpTransaction_t *t = s->t;
+	digs_error_code_t result = DIGS_SUCCESS;
+	int i;
+
+	acquireTransactionListMutex();
+
+	if ((complete) && (s->writing)) {
+		while ((!s->failed) && (!t->done) &&
+				(s->blocks[s->current].state != RELAY_BLOCK_FREE)) {
+			if (!waitOnFtpStream(s)) {
+				s->failed = 1;
+			}
+		}
+		if ((!s->failed) && (!t->done)) {
+			sendFtpStreamBlock(s, GLOBUS_TRUE);
+		}
+	}
+	if ((complete) && (!s->writing) && (!s->eof)) {
+		/* the thread stopped before the end of the file */
+		complete = 0;
+	}
+
+	/* wait for the server to confirm it, and give up if it doesn't */
+	while ((complete) && (!s->failed) && (!t->done)) {
+		if (!waitOnFtpStream(s)) {
+			s->failed = 1;
+		}
+	}
+	if (!t->done) {
+		if (globus_ftp_client_abort(t->handle) != GLOBUS_SUCCESS) {
+			logMessage(WARN, "Error aborting FTP operation %s", t->opName);
+		}
+		/* Globus calls back every block before the operation itself */
+		while (!t->done) {
+			globus_cond_wait(&t->doneCond, &transactionListLock_);
+		}
+	}
+
+	if (!t->succeeded) {
+		result = getErrorAndMessageFromGlobus(t->error, errorMessage);
+	} else if ((!complete) || (s->failed)) {
+		strcpy(errorMessage, "Stream transfer did not complete");
+		result = DIGS_UNKNOWN_ERROR;
+	}
+
+	destroyFtpTransaction(t);
+	releaseTransactionListMutex();
+
+	for (i = 0; i < RELAY_BUFFER_COUNT; i++) {
+		globus_libc_free(s->blocks[i].data);
+	}
+	globus_libc_free(s);
+	return result;
+}
+
+/***********************************************************************
+ *   void streamReadCallback(...)
+ *
+ *   Data callback for reads into a get stream's ring. Marks the block
+ *   as full and wakes the thread reading the stream
+ ***********************************************************************/
+static void streamReadCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof) {
+	ftpStream_t *s = (ftpStream_t *)userArg;
+	relayBlock_t *b;
+
+	acquireTransactionListMutex();
+
+	b = findRelayBlock(s->blocks, buffer);
+	if (error != GLOBUS_SUCCESS) {
+		printErrorObject(error, "stream read");
+		s->failed = 1;
+		if (b) {
+			b->state = RELAY_BLOCK_FREE;
+		}
+	} else if (b) {
+		b->length = length;
+		b->offset = offset;
+		b->state = (length > 0) ? RELAY_BLOCK_FULL : RELAY_BLOCK_FREE;
+		s->t->transferred += length;
+	}
+	if (eof) {
+		s->eof = 1;
+	}
+
+	globus_cond_broadcast(&s->t->doneCond);
+	releaseTransactionListMutex();
+}
+
+/***********************************************************************
+ *   void streamWriteCallback(...)
+ *
+ *   Data callback for writes from a put stream's ring. Frees the block
+ *   for filling again and wakes the thread writing the stream
+ ***********************************************************************/
+static void streamWriteCallback(void *userArg, globus_ftp_client_handle_t *handle,
+		globus_object_t *error, globus_byte_t *buffer, globus_size_t length,
+		globus_off_t offset, globus_bool_t eof) {
+	ftpStream_t *s = (ftpStream_t *)userArg;
+	relayBlock_t *b;
+
+	acquireTransactionListMutex();
+
+	b = findRelayBlock(s->blocks, buffer);
+	if (b) {
+		b->state = RELAY_BLOCK_FREE;
+	}
+	if (error != GLOBUS_SUCCESS) {
+		printErrorObject(error, "stream write");
+		s->failed = 1;
+	} else {
+		s->t->transferred += length;
+	}
+
+	globus_cond_broadcast(&s->t->doneCond);
+	releaseTransactionListMutex();
 }
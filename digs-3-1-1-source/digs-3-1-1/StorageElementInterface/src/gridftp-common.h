@@ -40,17 +40,47 @@
 #ifndef _GRIDFTP_COMMON_H_
 #define _GRIDFTP_COMMON_H_
 
+#include <time.h>
+
 #include <globus_ftp_client.h>
 #include "misc.h"
+#include "md5.h"
+
+struct ftpRelay_s;
 
 /*
- * A linked list of these structures represents all the GridFTP transactions
- * currently in progress
+ * A Globus FTP client handle, together with the connections it has
+ * cached, kept between operations on the same host. See
+ * newFtpTransaction
  */
-typedef struct ftpTransaction_s {
-	/* The Globus FTP handle for this transaction */
+typedef struct ftpSession_s {
 	globus_ftp_client_handle_t handle;
 
+	/* Host the session is kept for, NULL if it is not to be reused */
+	char *hostname;
+
+	/* When the session was last returned to the pool */
+	time_t lastUsed;
+
+	/* How long it may sit in the pool before being thrown away */
+	int idleTime;
+
+	/* Next idle session in the pool */
+	struct ftpSession_s *next;
+} ftpSession_t;
+
+/*
+ * One of these structures represents each GridFTP transaction currently
+ * in progress. They are found from their IDs through the transfer handle
+ * table
+ */
+typedef struct ftpTransaction_s {
+	/* The Globus FTP handle for this transaction, part of 'session' */
+	globus_ftp_client_handle_t *handle;
+
+	/* The session checked out of the pool for this transaction */
+	ftpSession_t *session;
+
 	/* Globus FTP attributes structure for this transaction */
 	globus_ftp_client_operationattr_t attr;
 
@@ -63,6 +93,12 @@ typedef struct ftpTransaction_s {
 	/* Cleared until transaction completes, then set */
 	int done;
 
+	/*
+	 * Signalled when 'done' is set. Used with the transaction list
+	 * mutex
+	 */
+	globus_cond_t doneCond;
+
 	/* Once 'done' is set, this is set if the transaction was a success */
 	int succeeded;
 
@@ -86,6 +122,19 @@ typedef struct ftpTransaction_s {
 	 */
 	globus_off_t length;
 
+	/*
+	 * Receives the fact string and its length if the FTP operation is
+	 * an MLST. Allocated by Globus, freed with the transaction
+	 */
+	globus_byte_t *mlstBuffer;
+	globus_size_t mlstLength;
+
+	/*
+	 * Time by which an asynchronous checksum must have finished, 0 if
+	 * the operation has no deadline
+	 */
+	time_t deadline;
+
 	/*
 	 * The buffer used to store data being transferred
 	 */
@@ -134,16 +183,191 @@ typedef struct ftpTransaction_s {
 	globus_off_t offset;
 
 	/*
-	 * ID number for transaction
+	 * Bytes this transaction has sent (put) or received and written
+	 * (get) so far, not counting any kept from an earlier attempt
+	 */
+	globus_off_t transferred;
+
+	/*
+	 * Ring of data buffers for a put or get, so that several blocks
+	 * can be in flight at once, and the number of them
+	 */
+	char **ring;
+	int ringSize;
+
+	/*
+	 * Number of ring buffers registered with Globus whose callbacks
+	 * haven't finished yet
+	 */
+	int outstanding;
+
+	/*
+	 * Set once the last block of the file has been sent (put) or
+	 * received (get)
+	 */
+	int reachedEnd;
+
+	/*
+	 * ID number for transaction, which is also its transfer handle
 	 */
 	int id;
 
-	/* Points to next transaction in linked list */
-	struct ftpTransaction_s *next;
+	/*
+	 * If this transaction is one end of a streaming relay, the relay
+	 * it belongs to. NULL otherwise
+	 */
+	struct ftpRelay_s *relay;
+
+	/*
+	 * Byte ranges of a get that have been written to the local file,
+	 * including any kept from an earlier attempt. See
+	 * keepPartialFtpRead
+	 */
+	globus_ftp_client_restart_marker_t received;
+
+	/*
+	 * Set if the operation is a get of part of a file, written into
+	 * place in a local file that other gets may share. Such a get is
+	 * not checksummed, renamed or removed when it ends
+	 */
+	int inPlace;
+
+	/*
+	 * MD5 of the local file a put sends, fed with each block as it is
+	 * read for sending, and whether it is being worked out (1) or has
+	 * been finished into checksum (2). See finishFtpDigest
+	 */
+	md5_state_t digest;
+	int digesting;
+
+	/*
+	 * Ring buffers of a put that have been sent and are waiting to be
+	 * refilled, and whether a data callback is refilling them. Only
+	 * one callback refills at a time, so the blocks are still read,
+	 * checksummed and registered in file order. See
+	 * refillFtpWriteBlocks
+	 */
+	char **emptyBlocks;
+	int emptyCount;
+	int filling;
 } ftpTransaction_t;
 
 #define FTP_DATA_BUFFER_SIZE 1048576
 
+/*
+ * Default number of idle sessions kept per host, and how long (in
+ * seconds) they are kept. Can be changed per node with the
+ * 'ftpsessions' and 'ftpsessionidle' properties
+ */
+#define FTP_SESSION_POOL_SIZE 4
+#define FTP_SESSION_IDLE_TIME 60
+
+/*
+ * Default number of FTP_DATA_BUFFER_SIZE buffers in flight for a put or
+ * get. Can be changed per node with the 'ftpbuffers' property
+ */
+#define FTP_DATA_BUFFER_COUNT 4
+
+/*
+ * Smallest transfer worth resuming from a partial file rather than
+ * starting again (see getFtpRestartOffset)
+ */
+#define FTP_RESTART_MINIMUM (16 * 1048576)
+
+/*
+ * Number of FTP_DATA_BUFFER_SIZE blocks in a relay's ring. This bounds
+ * how far the read from the source can get ahead of the write to the
+ * destination
+ */
+#define RELAY_BUFFER_COUNT 4
+
+/*
+ * States of a block in a relay's ring
+ */
+enum { RELAY_BLOCK_FREE,      /* empty, can be read into */
+       RELAY_BLOCK_READING,   /* read from source outstanding */
+       RELAY_BLOCK_FULL,      /* holds data waiting to be written */
+       RELAY_BLOCK_WRITING    /* write to destination outstanding */
+};
+
+typedef struct relayBlock_s {
+	char *data;
+	globus_size_t length;
+	globus_off_t offset;
+	int state;
+} relayBlock_t;
+
+/*
+ * A streaming relay copies a file between two GridFTP servers through
+ * this process without storing it locally. Blocks are read from the
+ * source into a bounded ring and written to the destination in the
+ * same order; a new read is only started when a block has been freed
+ * by a completed write, so a slow destination throttles the source.
+ *
+ * The relay is shared by the reading and the writing transaction and
+ * is freed when both have been destroyed.
+ */
+typedef struct ftpRelay_s {
+	relayBlock_t blocks[RELAY_BUFFER_COUNT];
+
+	/* Next block to be read into, and next block to be written out */
+	int nextRead;
+	int nextWrite;
+
+	/* Transactions at each end, NULL once destroyed */
+	ftpTransaction_t *reader;
+	ftpTransaction_t *writer;
+
+	/* Set once the source has reported end of file */
+	int readEof;
+
+	/* Set once the final (end of file) write has been registered */
+	int eofSent;
+
+	/* Set if either end has failed */
+	int failed;
+
+	/* Total bytes written so far */
+	globus_off_t written;
+
+	/* Number of transactions still referring to the relay */
+	int refs;
+} ftpRelay_t;
+
+/*
+ * A get or put between a GridFTP server and a thread of this process
+ * that produces or consumes the data itself, such as a transfer to or
+ * from a node that doesn't speak GridFTP. The data goes through a ring
+ * of RELAY_BUFFER_COUNT blocks in file order (the transfer is always
+ * in stream mode), and the thread waits while the ring is empty (get)
+ * or full (put), so the slower end sets the pace. See openFtpStream
+ */
+typedef struct ftpStream_s {
+	/* The get or put */
+	ftpTransaction_t *t;
+
+	relayBlock_t blocks[RELAY_BUFFER_COUNT];
+
+	/* Set for a put */
+	int writing;
+
+	/*
+	 * Block the thread is reading out of or filling, -1 if a get is
+	 * between blocks, and how many bytes of it have been used
+	 */
+	int current;
+	globus_size_t used;
+
+	/* How far through the file the thread has got */
+	globus_off_t offset;
+
+	/* Set once a get has been given the end of the file */
+	int eof;
+
+	/* Set if a read or write has failed */
+	int failed;
+} ftpStream_t;
+
 /***********************************************************************
 *   int startupReplicationSystem()
 *
@@ -159,8 +383,9 @@ int acquireTransactionListMutex();
 
 int isTransactionDone(ftpTransaction_t *t);
 int isTransactionDoneLastCheck(ftpTransaction_t *t);
+void markTransactionDone(ftpTransaction_t *t);
 
-ftpTransaction_t *newFtpTransaction(char *opname);
+ftpTransaction_t *newFtpTransaction(char *opname, const char *hostname);
 int destroyFtpTransaction(ftpTransaction_t *t);
 ftpTransaction_t *findTransaction(int handle);
 
@@ -176,16 +401,56 @@ void replicateCompleteCallback(void *data,
 
 int waitOnFtp(ftpTransaction_t *transaction, float timeOut);
 int waitOnFtpLong(ftpTransaction_t *t, float timeOut);
+int waitOnFtpMany(int *handles, int count, float timeOut);
 
 digs_error_code_t getErrorAndMessageFromGlobus(globus_object_t *error,
 					       char *errorMessage);
 
 
-int startFtpReadBlock(ftpTransaction_t *t);
-int startFtpWriteBlock(ftpTransaction_t *t);
+int startFtpReadBlock(ftpTransaction_t *t, char *buffer);
+int startFtpWriteBlock(ftpTransaction_t *t, char *buffer);
+void refillFtpWriteBlocks(ftpTransaction_t *t);
 int startFtpWrite(const char *filename, ftpTransaction_t *t,
-		  char *errorMessage);
-int startFtpRead(const char *filename, ftpTransaction_t *t, char *errorMessage);
+		  globus_off_t restartOffset, char *errorMessage);
+int startFtpRead(const char *filename, ftpTransaction_t *t,
+		 globus_off_t restartOffset, char *errorMessage);
+int startFtpReadRange(const char *filename, ftpTransaction_t *t,
+		      globus_off_t offset, char *errorMessage);
 int startFtpReadToBuffer( ftpTransaction_t *t);
+int finishFtpDigest(ftpTransaction_t *t);
+
+globus_off_t getFtpRestartOffset(const char *url, const char *hostname,
+				 const char *localFile, int writing);
+globus_ftp_client_restart_marker_t *setFtpRestartMarker(
+		globus_ftp_client_restart_marker_t *marker,
+		globus_off_t restartOffset);
+void keepPartialFtpRead(ftpTransaction_t *t, const char *filename);
+
+int setFtpTransferAttributes(globus_ftp_client_operationattr_t *attr,
+			     const char *hostname);
+void setFtpStreamMode(globus_ftp_client_operationattr_t *attr);
+void setFtpThirdPartyAttributes(ftpTransaction_t *t, const char *sourceHost,
+				const char *destHost);
+
+ftpRelay_t *newFtpRelay(ftpTransaction_t *reader, ftpTransaction_t *writer);
+int startFtpRelay(ftpRelay_t *relay);
+void abortFtpRelayPeer(ftpTransaction_t *t);
+void relayReadCompleteCallback(void *data,
+			       globus_ftp_client_handle_t *handle, globus_object_t *error);
+digs_error_code_t startFtpUrlRelay(char *errorMessage, const char *fromHost,
+				   const char *fromUrl, const char *toHost,
+				   const char *toUrl, char *checksum,
+				   const char *destFilepath, int *handle);
+
+digs_error_code_t openFtpStream(char *errorMessage, const char *hostname,
+				const char *url, int writing, ftpStream_t **stream);
+int readFtpStream(ftpStream_t *s, char *buffer, int length);
+int writeFtpStream(ftpStream_t *s, const char *buffer, int length);
+digs_error_code_t closeFtpStream(char *errorMessage, ftpStream_t *s,
+				 int complete);
+int getFtpUrlChecksum(const char *url, const char *hostname,
+		      char checksum[CHECKSUM_LENGTH + 1]);
+int getFtpUrlLength(const char *url, const char *hostname,
+		    globus_off_t *length);
 
 #endif
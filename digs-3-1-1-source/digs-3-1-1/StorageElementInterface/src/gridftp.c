@@ -37,6 +37,9 @@
  *
  ***********************************************************************/
 
+#include <strings.h>
+#include <time.h>
+
 #include <globus_ftp_client.h>
 #include "gridftp.h"
 #include "misc.h"
@@ -46,6 +49,22 @@
 
 char *TIMEOUT_MESSAGE = "Timed out.";
 
+/*
+ * Rate, in MB/s, at which a node is assumed to read a file it is
+ * checksumming, used to set checksum deadlines. Overridden by the node's
+ * 'checksumrate' property
+ */
+#define CHECKSUM_RATE 10.0
+
+/* Number of MLSTs digs_statMany_globus keeps in flight at once */
+#define STAT_MANY_CONCURRENCY 8
+
+/*
+ * Default number of directory listings a node scan keeps in flight,
+ * overridden by the node's 'scanlistings' property
+ */
+#define SCAN_LISTINGS 4
+
 /***********************************************************************
  *   digs_error_code_t digs_getLength_globus(char *errorMessage, 
  * 		const char *filePath,const char *hostname, long long int *fileLength)
@@ -73,26 +92,34 @@ digs_error_code_t digs_getLength_globus(char *errorMessage,
 	globus_result_t err;
 	digs_error_code_t digsError;
 	ftpTransaction_t *t;
+	digs_stat_t stat;
 
 	*fileLength = -1;
 
 	char *urlBuffer;
 
-	int isDir = 0;
-	digsError = digs_isDirectory_globus(errorMessage, filePath, hostname, &isDir);
+	/* one MLST gives both the type and, from most servers, the size */
+	digsError = digs_stat_globus(errorMessage, filePath, hostname, &stat);
 	if (digsError != DIGS_SUCCESS) {
 		return digsError;
 	}
-	if (isDir) {
+	length = stat.size;
+	if (stat.isDirectory) {
+		digs_freeStat(&stat);
 		return DIGS_FILE_IS_DIR;
 	}
+	digs_freeStat(&stat);
+	if (length >= 0) {
+		*fileLength = length;
+		return DIGS_SUCCESS;
+	}
 
 	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, filePath) < 0) {
 		errorExit("Out of memory in digs_getLength_globus");
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("get remote file length");
+	t = newFtpTransaction("get remote file length", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
@@ -100,7 +127,7 @@ digs_error_code_t digs_getLength_globus(char *errorMessage,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_size(handle, urlBuffer, &t->attr, &t->length,
 			completeCallback, t);
@@ -183,14 +210,14 @@ digs_error_code_t digs_doesExist_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("existence check");
+	t = newFtpTransaction("existence check", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
 		return DIGS_UNKNOWN_ERROR;
 	}
 
-	err = globus_ftp_client_exists(&t->handle, urlBuffer, &t->attr,
+	err = globus_ftp_client_exists(t->handle, urlBuffer, &t->attr,
 			completeCallback, t);
 
 	if (err != GLOBUS_SUCCESS) {
@@ -336,7 +363,7 @@ digs_error_code_t digs_isDirectory_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("existence check");
+	t = newFtpTransaction("existence check", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
@@ -350,7 +377,7 @@ digs_error_code_t digs_isDirectory_globus(char *errorMessage,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_mlst(handle, urlBuffer, &t->attr, mlst_buffer,
 			mlst_buffer_length, completeCallback, t);
@@ -480,7 +507,7 @@ digs_error_code_t digs_getOwner_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("existence check");
+	t = newFtpTransaction("existence check", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
@@ -494,7 +521,7 @@ digs_error_code_t digs_getOwner_globus(char *errorMessage,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_mlst(handle, urlBuffer, &t->attr, mlst_buffer,
 			mlst_buffer_length, completeCallback, t);
@@ -613,7 +640,7 @@ digs_error_code_t digs_getGroup_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("existence check");
+	t = newFtpTransaction("existence check", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
@@ -627,7 +654,7 @@ digs_error_code_t digs_getGroup_globus(char *errorMessage,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_mlst(handle, urlBuffer, &t->attr, mlst_buffer,
 			mlst_buffer_length, completeCallback, t);
@@ -841,7 +868,7 @@ digs_error_code_t digs_getPermissions_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("existence check");
+	t = newFtpTransaction("existence check", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
@@ -855,7 +882,7 @@ digs_error_code_t digs_getPermissions_globus(char *errorMessage,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_mlst(handle, urlBuffer, &t->attr, mlst_buffer,
 			mlst_buffer_length, completeCallback, t);
@@ -974,7 +1001,7 @@ digs_error_code_t digs_setPermissions_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("chmod");
+	t = newFtpTransaction("chmod", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
@@ -983,7 +1010,7 @@ digs_error_code_t digs_setPermissions_globus(char *errorMessage,
 
 	int octalPermissions = convertToOctal(permissions);
 		
-	err = globus_ftp_client_chmod(&t->handle,
+	err = globus_ftp_client_chmod(t->handle,
 									urlBuffer, octalPermissions, &t->attr,
 									completeCallback, t);
 
@@ -1065,7 +1092,7 @@ digs_error_code_t digs_getModificationTime_globus(char *errorMessage,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("get modification time of remote file");
+	t = newFtpTransaction("get modification time of remote file", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
@@ -1073,7 +1100,7 @@ digs_error_code_t digs_getModificationTime_globus(char *errorMessage,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_modification_time(handle, urlBuffer, &t->attr,
 			&modification_time_globus, completeCallback, t);
@@ -1123,6 +1150,351 @@ digs_error_code_t digs_getModificationTime_globus(char *errorMessage,
 }
 
 
+/*
+ * Replaces one of the strings in a stat structure with a copy of value
+ */
+static void setStatString(char **field, const char *value) {
+	if (*field) {
+		globus_libc_free(*field);
+	}
+	*field = safe_strdup(value);
+	if (!*field) {
+		errorExit("Out of memory in setStatString");
+	}
+}
+
+/*
+ * Converts the value of an MLST or MLSD Modify fact (YYYYMMDDHHMMSS[.sss],
+ * always GMT) to a time_t. Returns -1 if the value can't be parsed
+ */
+static time_t parseMlstTime(const char *value) {
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(value, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+			&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+		return (time_t)-1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return timegm(&tm);
+}
+
+/*
+ * Fills in a stat structure from an MLST fact string like the one shown
+ * above parseMlst. Unlike parseMlst this works on a copy, so the buffer
+ * Globus returned is left intact and needn't be NUL terminated. Facts
+ * the server didn't send leave their fields alone
+ */
+static void parseMlstFacts(const globus_byte_t *facts, globus_size_t length,
+		digs_stat_t *stat) {
+	char *copy;
+	char *start;
+	char *fact;
+	char *value;
+	char *savePtr;
+	time_t modificationTime;
+
+	copy = globus_libc_malloc(length + 1);
+	if (!copy) {
+		errorExit("Out of memory in parseMlstFacts");
+	}
+	memcpy(copy, facts, length);
+	copy[length] = '\0';
+
+	/* the facts end at the space before the path name */
+	start = copy;
+	while (*start == ' ') {
+		start++;
+	}
+	fact = strchr(start, ' ');
+	if (fact) {
+		*fact = '\0';
+	}
+
+	for (fact = strtok_r(start, ";", &savePtr); fact != NULL;
+			fact = strtok_r(NULL, ";", &savePtr)) {
+		value = strchr(fact, '=');
+		if (!value) {
+			continue;
+		}
+		*value++ = '\0';
+
+		if (strcasecmp(fact, "Type") == 0) {
+			stat->isDirectory = (strcasecmp(value, "dir") == 0) ||
+				(strcasecmp(value, "cdir") == 0) ||
+				(strcasecmp(value, "pdir") == 0);
+		} else if (strcasecmp(fact, "Size") == 0) {
+			stat->size = strtoll(value, NULL, 10);
+		} else if (strcasecmp(fact, "Modify") == 0) {
+			modificationTime = parseMlstTime(value);
+			if (modificationTime != (time_t)-1) {
+				stat->modificationTime = modificationTime;
+			}
+		} else if (strcasecmp(fact, "UNIX.owner") == 0) {
+			setStatString(&stat->owner, value);
+		} else if (strcasecmp(fact, "UNIX.group") == 0) {
+			setStatString(&stat->group, value);
+		} else if (strcasecmp(fact, "UNIX.mode") == 0) {
+			setStatString(&stat->permissions, value);
+		}
+	}
+
+	globus_libc_free(copy);
+}
+
+/*
+ * Starts the MLST of a file for digs_stat_globus or digs_statMany_globus.
+ * On success the transaction is returned in *transaction, to be waited
+ * for and then passed to finishStatGlobus
+ */
+static digs_error_code_t startStatGlobus(char *errorMessage,
+		const char *filePath, const char *hostname,
+		ftpTransaction_t **transaction) {
+
+	char *urlBuffer;
+	ftpTransaction_t *t;
+	globus_result_t err;
+
+	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, filePath) < 0) {
+		errorExit("Out of memory in startStatGlobus");
+	}
+
+	acquireTransactionListMutex();
+	t = newFtpTransaction("stat", hostname);
+	if (!t) {
+		releaseTransactionListMutex();
+		globus_libc_free(urlBuffer);
+		strncpy(errorMessage, "Could not start FTP transaction.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	err = globus_ftp_client_mlst(t->handle, urlBuffer, &t->attr,
+			&t->mlstBuffer, &t->mlstLength, completeCallback, t);
+	globus_libc_free(urlBuffer);
+
+	if (err != GLOBUS_SUCCESS) {
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
+
+		/* Turn the error code into a Globus object */
+		globus_object_t *errorObject;
+		errorObject = globus_error_get(err);
+		return getErrorAndMessageFromGlobus(errorObject, errorMessage);
+	}
+
+	releaseTransactionListMutex();
+	*transaction = t;
+	return DIGS_SUCCESS;
+}
+
+/*
+ * Collects the result of an MLST started by startStatGlobus once it has
+ * completed, and destroys its transaction
+ */
+static digs_error_code_t finishStatGlobus(char *errorMessage,
+		ftpTransaction_t *t, digs_stat_t *stat) {
+
+	acquireTransactionListMutex();
+
+	if (!t->succeeded) {
+		globus_object_t *error;
+		error = (globus_object_t *)t->error;
+
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
+
+		return getErrorAndMessageFromGlobus(error, errorMessage);
+	}
+
+	if (t->mlstBuffer == NULL) {
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
+
+		strncpy(errorMessage, "Could not parse the file details.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	parseMlstFacts(t->mlstBuffer, t->mlstLength, stat);
+
+	destroyFtpTransaction(t);
+	releaseTransactionListMutex();
+	return DIGS_SUCCESS;
+}
+
+/*
+ * Gives up on a transaction that hasn't completed in time, or is no
+ * longer wanted. As with waitOnFtp, if it is still running the callback
+ * is left to destroy it
+ */
+static void abandonFtpTransaction(ftpTransaction_t *t) {
+	int done;
+
+	done = isTransactionDoneLastCheck(t);
+	if (done < 0) {
+		return;
+	}
+
+	if (done) {
+		destroyFtpTransaction(t);
+	} else if (globus_ftp_client_abort(t->handle) != GLOBUS_SUCCESS) {
+		logMessage(WARN, "Error aborting FTP operation %s", t->opName);
+	}
+	releaseTransactionListMutex();
+}
+
+/***********************************************************************
+ *  digs_error_code_t digs_stat_globus(char *errorMessage,
+ *		const char *filePath, const char *hostname, digs_stat_t *stat);
+ * 
+ *     Gets everything about a file the node can report, in a single
+ *     MLST. GridFTP doesn't keep checksums, so stat->checksum is always
+ *     NULL. Free the result with digs_freeStat.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 stat			the file's details									O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_stat_globus(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat) {
+
+	digs_error_code_t result;
+	ftpTransaction_t *t;
+
+	errorMessage[0] = '\0';
+	digs_initStat(stat);
+
+	logMessage(DEBUG, "digs_stat_globus(%s,%s)", hostname, filePath);
+
+	result = startStatGlobus(errorMessage, filePath, hostname, &t);
+	if (result != DIGS_SUCCESS) {
+		return result;
+	}
+
+	if (!waitOnFtp(t, getNodeFtpTimeout(hostname))) {
+		/* timed out */
+		strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_NO_RESPONSE;
+	}
+
+	return finishStatGlobus(errorMessage, t, stat);
+}
+
+/***********************************************************************
+ *  digs_error_code_t digs_statMany_globus(char *errorMessage,
+ *		const char *hostname, int count, const char **filePaths,
+ * 		digs_stat_t *stats, digs_error_code_t *results);
+ * 
+ *     As digs_stat_globus for a list of files on one node. Several
+ *     MLSTs are kept in flight at once, each on its own pooled session.
+ *     If none of them completes within the node's FTP time out the node
+ *     is given up on, and the files not yet done are left as
+ *     DIGS_NO_RESPONSE.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 count			the number of files									I
+ * 	 filePaths		the full paths to the files							I
+ * 	 stats			array of count entries receiving the details		O
+ * 	 results		array of count entries receiving the result
+ * 					for each file										O
+ *    
+ *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+ *            code of the first failure, described in errorMessage
+ ***********************************************************************/
+digs_error_code_t digs_statMany_globus(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results) {
+
+	ftpTransaction_t *inFlight[STAT_MANY_CONCURRENCY];
+	int handles[STAT_MANY_CONCURRENCY];
+	int fileIndex[STAT_MANY_CONCURRENCY];
+	int numInFlight = 0;
+	int next = 0;
+	int done;
+	int file;
+	int i;
+	float timeOut;
+	char fileError[MAX_ERROR_MESSAGE_LENGTH];
+	digs_error_code_t firstError = DIGS_SUCCESS;
+
+	errorMessage[0] = '\0';
+	for (i = 0; i < count; i++) {
+		digs_initStat(&stats[i]);
+		results[i] = DIGS_NO_RESPONSE;
+	}
+
+	logMessage(DEBUG, "digs_statMany_globus(%s, %d files)", hostname, count);
+
+	timeOut = getNodeFtpTimeout(hostname);
+
+	while ((next < count) || (numInFlight > 0)) {
+
+		/* keep the pipeline full */
+		while ((next < count) && (numInFlight < STAT_MANY_CONCURRENCY)) {
+			fileError[0] = '\0';
+			results[next] = startStatGlobus(fileError, filePaths[next],
+					hostname, &inFlight[numInFlight]);
+			if (results[next] == DIGS_SUCCESS) {
+				handles[numInFlight] = inFlight[numInFlight]->id;
+				fileIndex[numInFlight] = next;
+				numInFlight++;
+			} else if (firstError == DIGS_SUCCESS) {
+				firstError = results[next];
+				snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "%s: %s",
+						filePaths[next], fileError);
+			}
+			next++;
+		}
+
+		if (numInFlight == 0) {
+			break;
+		}
+
+		done = waitOnFtpMany(handles, numInFlight, timeOut);
+		if (done < 0) {
+			/* nothing came back in time, give up on the node */
+			for (i = 0; i < numInFlight; i++) {
+				abandonFtpTransaction(inFlight[i]);
+			}
+			if (firstError == DIGS_SUCCESS) {
+				firstError = DIGS_NO_RESPONSE;
+				strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
+			}
+			break;
+		}
+
+		file = fileIndex[done];
+		fileError[0] = '\0';
+		results[file] = finishStatGlobus(fileError, inFlight[done],
+				&stats[file]);
+		if ((results[file] != DIGS_SUCCESS) && (firstError == DIGS_SUCCESS)) {
+			firstError = results[file];
+			snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "%s: %s",
+					filePaths[file], fileError);
+		}
+
+		/* move the last one into the gap */
+		numInFlight--;
+		inFlight[done] = inFlight[numInFlight];
+		handles[done] = handles[numInFlight];
+		fileIndex[done] = fileIndex[numInFlight];
+	}
+
+	return firstError;
+}
+
 /* Remove the last part of the string including and after the last file
  * separator. */
 void removeLastPartOfPath(char *filePath) {
@@ -1186,95 +1558,85 @@ digs_error_code_t makePathValid(char *errorMessage, const char *host,
 	return result;
 }
 
-/***********************************************************************
- * 
- *digs_error_code_t digs_getChecksum_globus (char *errorMessage, 
- * const char *filePath,const char *hostname, char **fileChecksum,
- * digs_checksum_type_t checksumType)
- * 
- * Gets a 32 character checksum of a file on a node using the defined 
- * checksum type.
- * Hex digits will be returned in uppercase.
- *
- * Returned checksum is stored in variable fileChecksum.
- * Note that fileChecksum should be freed 
- * accordingly to the way it was allocated in the implementation.
- * Use digs_free_string to free it.
- * 
- *   Parameters:                                                	 [I/O]
- *
- * 	 errorMessage	an error description string	(expects to have
- * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
- * 	 filePath 		the full path to the file							I
- *   hostname  		the FQDN of the host to contact          			I
- * 	 fileChecksum	the checksum is stored in variable fileChecksum. 	O
- * 	 checksumType	the checkdigs_checksum_type_t						I
- *    
- *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
- ***********************************************************************/
+/*
+ * Works out how long a checksum of a file of the given length may take:
+ * the node's FTP time out plus the time to read the file at its
+ * 'checksumrate' (in MB/s). Files of unknown length get the copy time
+ * out
+ */
+static float getChecksumTimeout(const char *hostname, long long int fileLength) {
+	char *prop;
+	float rate;
 
-digs_error_code_t digs_getChecksum_globus(char *errorMessage,
-		const char *filePath, const char *hostname, char **fileChecksum,
-		digs_checksum_type_t checksumType) {
+	if (fileLength < 0) {
+		return getNodeCopyTimeout(hostname);
+	}
 
-	logMessage(DEBUG, "digs_getChecksum_globus(%s,%s)", filePath, hostname);
+	rate = CHECKSUM_RATE;
+	prop = getNodeProperty(hostname, "checksumrate");
+	if (prop) {
+		rate = atof(prop);
+		globus_libc_free(prop);
+	}
+	if (rate <= 0.0) {
+		rate = CHECKSUM_RATE;
+	}
 
-	char *checksum=  globus_libc_malloc((CHECKSUM_LENGTH +1) * sizeof(char));
+	return getNodeFtpTimeout(hostname) +
+		((float)fileLength / (rate * 1048576.0));
+}
+
+/*
+ * Starts a CKSM of a file, which must finish within timeOut seconds. The
+ * checksum is written to t->checksum when it completes
+ */
+static digs_error_code_t startChecksumGlobus(char *errorMessage,
+		const char *filePath, const char *hostname,
+		digs_checksum_type_t checksumType, float timeOut,
+		ftpTransaction_t **transaction) {
 
-	checksum[0] = '\0';
-	errorMessage[0] = '\0';
 	globus_result_t err;
-	digs_error_code_t digsError;
-	*fileChecksum = checksum;
-	char algorithm[4];
+	ftpTransaction_t *t;
 	char *urlBuffer;
 	globus_off_t offset = 0; /*File offset to start calculating checksum.*/
 	/*Length of data to read from the starting offset. Use -1 to read the 
 	 * entire file.*/
 	globus_off_t length = -1;
 
-	if (checksumType == DIGS_MD5_CHECKSUM) {
-		strcpy(algorithm, "MD5");
-	} else {
+	if (checksumType != DIGS_MD5_CHECKSUM) {
 		strncpy(errorMessage, "Only the MD5 checksum algorithm is supported.",
 				MAX_ERROR_MESSAGE_LENGTH);
 		return DIGS_UNSUPPORTED_CHECKSUM_TYPE;
 	}
 
-	int isDir = 0;
-	digsError = digs_isDirectory_globus(errorMessage, filePath, hostname, &isDir);
-	if (digsError != DIGS_SUCCESS) {
-		return digsError;
-	}
-	if (isDir) {
-		return DIGS_FILE_IS_DIR;
-	}
-
 	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, filePath) < 0) {
-		errorExit("Out of memory in digs_getChecksum_globus");
+		errorExit("Out of memory in startChecksumGlobus");
 	}
 
 	acquireTransactionListMutex();
-	ftpTransaction_t *t;
-	t = newFtpTransaction("get remote file checksum");
+	t = newFtpTransaction("get remote file checksum", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
 		return DIGS_UNKNOWN_ERROR; 
 	}
 
-	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	t->checksum = globus_libc_malloc((CHECKSUM_LENGTH + 1) * sizeof(char));
+	if (!t->checksum) {
+		errorExit("Out of memory in startChecksumGlobus");
+	}
+	t->checksum[0] = '\0';
+	t->deadline = time(NULL) + (time_t)timeOut;
 
 	/*	- globus_ftp_client_cksm -- good as it only supports MD5*/
-	err = globus_ftp_client_cksm(handle, urlBuffer, &t->attr, *fileChecksum,
-			offset, length, algorithm, completeCallback, t);
+	err = globus_ftp_client_cksm(t->handle, urlBuffer, &t->attr, t->checksum,
+			offset, length, "MD5", completeCallback, t);
+	globus_libc_free(urlBuffer);
 
 	if (err != GLOBUS_SUCCESS) {
 
 		destroyFtpTransaction(t);
 		releaseTransactionListMutex();
-		globus_libc_free(urlBuffer);
 
 		globus_object_t *errorObject;
 
@@ -1285,15 +1647,17 @@ digs_error_code_t digs_getChecksum_globus(char *errorMessage,
 	}
 
 	releaseTransactionListMutex();
-	globus_libc_free(urlBuffer);
-
-	int timeOut = getNodeFtpTimeout(hostname); //TODO relate to file length
+	*transaction = t;
+	return DIGS_SUCCESS;
+}
 
-	if (!waitOnFtp(t, timeOut)) {
-		/* timed out */
-		strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
-		return DIGS_NO_RESPONSE;
-	}
+/*
+ * Collects the checksum from a completed startChecksumGlobus transaction
+ * and destroys the transaction
+ */
+static digs_error_code_t finishChecksumGlobus(char *errorMessage,
+		ftpTransaction_t *t, char **fileChecksum) {
+	char *p;
 
 	acquireTransactionListMutex();
 	if (!t->succeeded) {
@@ -1306,51 +1670,273 @@ digs_error_code_t digs_getChecksum_globus(char *errorMessage,
 		return getErrorAndMessageFromGlobus(error, errorMessage);
 	}
 
+	*fileChecksum = t->checksum;
+	t->checksum = NULL;
+
 	destroyFtpTransaction(t);
 	releaseTransactionListMutex(); 
-	/*Convert checksum to uppercase. */
-	char *p;
-	p = *fileChecksum;
 
-	  while( *p ) {
-	    *p = toupper(*p);
-	    p++;
-	  }
+	/*Convert checksum to uppercase. */
+	for (p = *fileChecksum; *p; p++) {
+		*p = toupper(*p);
+	}
 
 	return DIGS_SUCCESS;
 }
 
 /***********************************************************************
- *digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
- *		const char *localPath, const char *hostname, const char *SURL,
- *		int *handle);
+ * 
+ *digs_error_code_t digs_getChecksum_globus (char *errorMessage, 
+ * const char *filePath,const char *hostname, char **fileChecksum,
+ * digs_checksum_type_t checksumType)
+ * 
+ * Gets a 32 character checksum of a file on a node using the defined 
+ * checksum type.
+ * Hex digits will be returned in uppercase.
  *
- * Start a put operation (push) of a local file to a remote storage element with 
- * a specified remote location (SURL). A handle is returned to uniquely 
- * identify this transfer.
- * If a file with the chosen name already exists at the remote location, it will 
- * be overwritten without a warning.
+ * Returned checksum is stored in variable fileChecksum.
+ * Note that fileChecksum should be freed 
+ * accordingly to the way it was allocated in the implementation.
+ * Use digs_free_string to free it.
  * 
  *   Parameters:                                                	 [I/O]
  *
  * 	 errorMessage	an error description string	(expects to have
  * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
- *   hostname  		the FQDN of the host to contact          			I	
- * 	 localPath 		the full path to the local location to get 
- * 					the file from										I
- * 	 SURL 			the remote location to put the file to				I	
- * 	 handle 		the id of the transfer								O					
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 fileChecksum	the checksum is stored in variable fileChecksum. 	O
+ * 	 checksumType	the checkdigs_checksum_type_t						I
  *    
  *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
  ***********************************************************************/
-digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
-		const char *hostname, const char *localPath, const char *SURL,
-		int *handle) {
 
-	logMessage(DEBUG, "digs_startPutTransfer_globus(%s,%s,%s)", localPath,
-			hostname, SURL);
-	char *urlBuffer;
-	globus_result_t err;
+digs_error_code_t digs_getChecksum_globus(char *errorMessage,
+		const char *filePath, const char *hostname, char **fileChecksum,
+		digs_checksum_type_t checksumType) {
+
+	logMessage(DEBUG, "digs_getChecksum_globus(%s,%s)", filePath, hostname);
+
+	digs_error_code_t digsError;
+	ftpTransaction_t *t;
+	float timeOut;
+	digs_stat_t stat;
+
+	errorMessage[0] = '\0';
+	*fileChecksum = NULL;
+
+	/* the same MLST that says it isn't a directory gives the length the
+	 * time out is worked out from. A server that doesn't report the size
+	 * gets as long as a copy */
+	digsError = digs_stat_globus(errorMessage, filePath, hostname, &stat);
+	if (digsError != DIGS_SUCCESS) {
+		return digsError;
+	}
+	if (stat.isDirectory) {
+		digs_freeStat(&stat);
+		return DIGS_FILE_IS_DIR;
+	}
+	timeOut = getChecksumTimeout(hostname, stat.size);
+	digs_freeStat(&stat);
+
+	digsError = startChecksumGlobus(errorMessage, filePath, hostname,
+			checksumType, timeOut, &t);
+	if (digsError != DIGS_SUCCESS) {
+		return digsError;
+	}
+
+	if (!waitOnFtp(t, timeOut)) {
+		/* timed out */
+		strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_NO_RESPONSE;
+	}
+
+	return finishChecksumGlobus(errorMessage, t, fileChecksum);
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_startChecksum_globus(char *errorMessage,
+ * const char *filePath, const char *hostname,
+ * digs_checksum_type_t checksumType, long long int fileLength,
+ * int *handle)
+ * 
+ * Starts a server side checksum of a file without waiting for it. The
+ * deadline is the node's FTP time out plus the time to read the file at
+ * the node's 'checksumrate' property (in MB/s, default 10), or the copy
+ * time out if the length isn't known. The handle is an FTP transaction
+ * handle and can be waited on with digs_waitForTransfers_globus.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 checksumType	the checkdigs_checksum_type_t						I
+ * 	 fileLength		length of the file in bytes, or -1 if unknown		I
+ * 	 handle 		the id of the checksum								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startChecksum_globus(char *errorMessage,
+		const char *filePath, const char *hostname,
+		digs_checksum_type_t checksumType, long long int fileLength,
+		int *handle) {
+
+	digs_error_code_t result;
+	ftpTransaction_t *t;
+
+	logMessage(DEBUG, "digs_startChecksum_globus(%s,%s,%lld)", filePath,
+			hostname, fileLength);
+
+	errorMessage[0] = '\0';
+	*handle = -1;
+
+	result = startChecksumGlobus(errorMessage, filePath, hostname,
+			checksumType, getChecksumTimeout(hostname, fileLength), &t);
+	if (result != DIGS_SUCCESS) {
+		return result;
+	}
+
+	*handle = t->id;
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_monitorChecksum_globus(char *errorMessage,
+ * int handle, digs_transfer_status_t *status)
+ * 
+ * Checks whether a checksum started with digs_startChecksum_globus has
+ * finished, or has passed its deadline.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the checksum								I
+ * 	 status			the status of the checksum							O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_monitorChecksum_globus(char *errorMessage, int handle,
+		digs_transfer_status_t *status) {
+
+	ftpTransaction_t *t;
+	*status = DIGS_TRANSFER_FAILED;
+	errorMessage[0] = '\0';
+
+	acquireTransactionListMutex();
+
+	t = findTransaction(handle);
+
+	if (t == NULL) {
+		/* couldn't find it at all */
+		releaseTransactionListMutex();
+		strncpy(errorMessage, "Couldn't find the transaction.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	if (!t->done) {
+		if ((t->deadline) && (time(NULL) > t->deadline)) {
+			/* taken too long, digs_endChecksum_globus will abort it */
+			releaseTransactionListMutex();
+			strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
+			return DIGS_NO_RESPONSE;
+		}
+
+		/* still in progress */
+		releaseTransactionListMutex();
+		*status = DIGS_TRANSFER_IN_PROGRESS;
+		return DIGS_SUCCESS;
+	}
+
+	if (!t->succeeded) {
+		releaseTransactionListMutex();
+		return getErrorAndMessageFromGlobus(t->error, errorMessage);
+	}
+
+	*status = DIGS_TRANSFER_DONE;
+	releaseTransactionListMutex();
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_endChecksum_globus(char *errorMessage, int handle,
+ * char **fileChecksum)
+ * 
+ * Collects the result of a checksum started with
+ * digs_startChecksum_globus, aborting it if it is still running.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the checksum								I
+ * 	 fileChecksum	the checksum, in uppercase hex, or NULL on error	O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_endChecksum_globus(char *errorMessage, int handle,
+		char **fileChecksum) {
+
+	ftpTransaction_t *t;
+	int done;
+
+	errorMessage[0] = '\0';
+	*fileChecksum = NULL;
+
+	acquireTransactionListMutex();
+	t = findTransaction(handle);
+	if (t == NULL) {
+		releaseTransactionListMutex();
+		strncpy(errorMessage, "Couldn't find the transaction.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+	done = t->done;
+	releaseTransactionListMutex();
+
+	if (!done) {
+		abandonFtpTransaction(t);
+		strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_NO_RESPONSE;
+	}
+
+	return finishChecksumGlobus(errorMessage, t, fileChecksum);
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
+ *		const char *localPath, const char *hostname, const char *SURL,
+ *		int *handle);
+ *
+ * Start a put operation (push) of a local file to a remote storage element with 
+ * a specified remote location (SURL). A handle is returned to uniquely 
+ * identify this transfer.
+ * If a file with the chosen name already exists at the remote location, it will 
+ * be overwritten without a warning.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 localPath 		the full path to the local location to get 
+ * 					the file from										I
+ * 	 SURL 			the remote location to put the file to				I	
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
+		const char *hostname, const char *localPath, const char *SURL,
+		int *handle) {
+
+	logMessage(DEBUG, "digs_startPutTransfer_globus(%s,%s,%s)", localPath,
+			hostname, SURL);
+	char *urlBuffer;
+	globus_result_t err;
 	ftpTransaction_t *t;
 	*handle = -1;
 	errorMessage[0] = '\0';
@@ -1375,8 +1961,13 @@ digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
 		return err;
 	}
 	
+	/* Carry on from where an earlier attempt got to, if it can */
+	globus_off_t restartOffset;
+	globus_ftp_client_restart_marker_t restartMarker;
+	restartOffset = getFtpRestartOffset(urlBuffer, hostname, localPath, 1);
+
 	acquireTransactionListMutex();
-	t = newFtpTransaction("write");
+	t = newFtpTransaction("write", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
@@ -1384,28 +1975,21 @@ digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
 		return DIGS_UNKNOWN_ERROR;
 	}
 
-	t->buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
-	if (!t->buffer) {
-		globus_libc_free(urlBuffer);
-		destroyFtpTransaction(t);
-		releaseTransactionListMutex();
-		return DIGS_UNKNOWN_ERROR;
-	}
-
 	logMessage(DEBUG, "Transfer to path %s", urlBuffer);
 	
-	/* Set the checksum of the file before it's transferred.*/
-	char *localChecksum = "no checksum set";
-	getChecksum(localPath, &localChecksum);
-	t->checksum = safe_strdup(localChecksum); 
-	globus_libc_free(localChecksum);
-	
+	/* The checksum of the file is worked out as it's sent (see
+	 * finishFtpDigest) */
 	t->destFilepath = safe_strdup(SURL);
 	t->hostname = safe_strdup(hostname);
 
 	/* Start up a put operation */
-	err = globus_ftp_client_put(&t->handle, urlBuffer, &t->attr, NULL,
+	setFtpTransferAttributes(&t->attr, hostname);
+	err = globus_ftp_client_put(t->handle, urlBuffer, &t->attr,
+			setFtpRestartMarker(&restartMarker, restartOffset),
 			replicateCompleteCallback, t);
+	if (restartOffset > 0) {
+		globus_ftp_client_restart_marker_destroy(&restartMarker);
+	}
 
 	if (err != GLOBUS_SUCCESS) {
 		printError(err, "globus_ftp_client_put");
@@ -1420,9 +2004,9 @@ digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
 	}
 
 	/* and start sending data to FTP module */
-	if (!startFtpWrite(localPath, t, errorMessage)) {
+	if (!startFtpWrite(localPath, t, restartOffset, errorMessage)) {
 		releaseTransactionListMutex();
-		globus_ftp_client_abort(&t->handle);
+		globus_ftp_client_abort(t->handle);
 		globus_libc_free(urlBuffer);
 		return DIGS_UNKNOWN_ERROR;
 	}
@@ -1434,6 +2018,104 @@ digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
 
 	return DIGS_SUCCESS;
 }
+
+/***********************************************************************
+ * digs_error_code_t digs_startRelayTransfer_globus(char *errorMessage,
+ *		const char *fromHost, const char *fromSURL, const char *toHost,
+ *		const char *toSURL, int *handle);
+ *
+ * Start a copy of a file from one storage element to another, streamed
+ * through this process without being stored on the local disk. The data
+ * passes through a small ring of buffers, so a slow destination holds
+ * back the read from the source. The handle returned is monitored,
+ * ended and cancelled in the same way as a put transfer to toHost, and
+ * ending it checks the copy against the checksum of the source file.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   fromHost  		the FQDN of the host to copy from          			I	
+ * 	 fromSURL 		the location of the file on fromHost				I	
+ *   toHost  		the FQDN of the host to copy to          			I	
+ * 	 toSURL 		the location to put the file on toHost				I	
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startRelayTransfer_globus(char *errorMessage,
+		const char *fromHost, const char *fromSURL, const char *toHost,
+		const char *toSURL, int *handle) {
+
+	logMessage(DEBUG, "digs_startRelayTransfer_globus(%s,%s,%s,%s)", fromHost,
+			fromSURL, toHost, toSURL);
+	char *fromUrl;
+	char *toUrl;
+	char *sourceChecksum;
+	digs_error_code_t result;
+	*handle = -1;
+	errorMessage[0] = '\0';
+
+	/* The copy is verified against the source's own checksum when the
+	 * transfer is ended, as there is no local copy to checksum */
+	result = digs_getChecksum_globus(errorMessage, fromSURL, fromHost,
+			&sourceChecksum, DIGS_MD5_CHECKSUM);
+	if (result != DIGS_SUCCESS) {
+		logMessage(WARN, "Unable to get checksum of %s on %s for relay",
+				fromSURL, fromHost);
+		globus_libc_free(sourceChecksum);
+		return result;
+	}
+
+	/* Make sure the directory structure exists at the other end */
+	result = makePathValid(errorMessage, toHost, toSURL);
+	if (result != DIGS_SUCCESS) {
+		logMessage(WARN,
+				"makePathValid(%s,%s) failed in digs_startRelayTransfer_globus",
+				toHost, toSURL);
+		globus_libc_free(sourceChecksum);
+		return result;
+	}
+
+	if (safe_asprintf(&fromUrl, "gsiftp://%s%s", fromHost, fromSURL)<0) {
+		errorExit("Out of memory in digs_startRelayTransfer_globus");
+	}
+	/* Written as -LOCKED until complete, as for a normal put */
+	if (safe_asprintf(&toUrl, "gsiftp://%s%s-LOCKED", toHost, toSURL)<0) {
+		errorExit("Out of memory in digs_startRelayTransfer_globus");
+	}
+
+	result = startFtpUrlRelay(errorMessage, fromHost, fromUrl, toHost, toUrl,
+			sourceChecksum, toSURL, handle);
+
+	globus_libc_free(fromUrl);
+	globus_libc_free(toUrl);
+
+	return result;
+}
+
+/***********************************************************************
+ * char *digs_getRelayURL_globus(const char *hostname, const char *SURL);
+ *
+ * Gets the gsiftp URL of a file, for a node of another type to relay
+ * it to or from with its digs_startPeerRelayTransfer.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ *   hostname  		the FQDN of the host the file is on        			I	
+ * 	 SURL 			the location of the file on hostname				I	
+ *    
+ *   Returns: the URL, to be freed with globus_libc_free
+ ***********************************************************************/
+char *digs_getRelayURL_globus(const char *hostname, const char *SURL) {
+	char *url;
+
+	if (safe_asprintf(&url, "gsiftp://%s%s", hostname, SURL) < 0) {
+		errorExit("Out of memory in digs_getRelayURL_globus");
+	}
+	return url;
+}
+
 /***********************************************************************
 *   char *substituteSlashes(char *filename)
 *    
@@ -1602,41 +2284,134 @@ digs_error_code_t digs_startGetTransfer_globus(char *errorMessage,
 	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, SURL)<0) {
 		errorExit("Out of memory in digs_startGetTransfer_globus");
 	}
+
+	/* Name the file <filename>-LOCKED until it's completely transferred
+	 */
+	char *lockedLocalPath;
+	if (safe_asprintf(&lockedLocalPath, "%s-LOCKED", localPath)<0) {
+		errorExit("Out of memory in digs_startGetTransfer_globus");
+	}
+
+	/* Carry on from where an earlier attempt got to, if it can */
+	globus_off_t restartOffset;
+	globus_ftp_client_restart_marker_t restartMarker;
+	restartOffset = getFtpRestartOffset(urlBuffer, hostname, lockedLocalPath,
+			0);
 	
 	acquireTransactionListMutex();
-	t = newFtpTransaction("read");
+	t = newFtpTransaction("read", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
+		globus_libc_free(lockedLocalPath);
 		return DIGS_UNKNOWN_ERROR;
 	}
 
-	t->buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
-	if (!t->buffer) {
+	logMessage(DEBUG, "Transfer from path %s", urlBuffer);
+	
+	t->checksum = safe_strdup(remoteChecksum); 
+	globus_libc_free(remoteChecksum);
+
+	t->destFilepath = safe_strdup(localPath);
+	t->hostname = safe_strdup(hostname);
+
+	/* Start up a get operation */
+	setFtpTransferAttributes(&t->attr, hostname);
+	err = globus_ftp_client_get(t->handle, urlBuffer, &t->attr,
+			setFtpRestartMarker(&restartMarker, restartOffset),
+			replicateCompleteCallback, t);
+	if (restartOffset > 0) {
+		globus_ftp_client_restart_marker_destroy(&restartMarker);
+	}
+
+	if (err != GLOBUS_SUCCESS) {
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
+		globus_libc_free(lockedLocalPath);
+
+		/* Turn the error code into a Globus object */
+		globus_object_t *errorObject;
+		errorObject = globus_error_get(err);
+		return getErrorAndMessageFromGlobus(errorObject, errorMessage);
+	}
+
+	/* and start sending data to FTP module */
+	if (!startFtpRead(lockedLocalPath, t, restartOffset, errorMessage)) {
+		globus_ftp_client_abort(t->handle);
 		destroyFtpTransaction(t);
 		releaseTransactionListMutex();
+		globus_libc_free(urlBuffer);
+		globus_libc_free(lockedLocalPath);
 		return DIGS_UNKNOWN_ERROR;
 	}
+	
+	*handle = t->id;
+	releaseTransactionListMutex();
+	globus_libc_free(urlBuffer);
+	globus_libc_free(lockedLocalPath);
 
-	logMessage(DEBUG, "Transfer from path %s", urlBuffer);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_startGetRangeTransfer_globus(char *errorMessage,
+ *		const char *hostname, const char *SURL, const char *localPath,
+ *		long long offset, long long length, int *handle);
+ *
+ * Starts a get of part of a file (SURL) from a remote hostname, using a
+ * partial GridFTP get. The data is written into place in localPath,
+ * which must already exist. A handle is returned to uniquely identify
+ * this transfer.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 SURL 			the remote location to get the file from			I	
+ * 	 localPath 		the local file to write the range into				I
+ * 	 offset			where the range starts, in bytes					I
+ * 	 length			the length of the range, in bytes					I
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startGetRangeTransfer_globus(char *errorMessage,
+		const char *hostname, const char *SURL, const char *localPath,
+		long long offset, long long length, int *handle) {
+
+	logMessage(DEBUG, "digs_startGetRangeTransfer_globus(%s,%s,%s,%lld,%lld)",
+			localPath, hostname, SURL, offset, length);
 	
-	t->checksum = safe_strdup(remoteChecksum); 
-	globus_libc_free(remoteChecksum);
+	char *urlBuffer;
+	globus_result_t err;
+	ftpTransaction_t *t;
+	*handle = -1;
+	errorMessage[0] = '\0';
 
 	/* Construct URL for file */
-	/* Name the file <filename>-LOCKED until it's completely transferred
-	 */
-	char *lockedLocalPath;
-	if (safe_asprintf(&lockedLocalPath, "%s-LOCKED", localPath)<0) {
-		errorExit("Out of memory in digs_startGetTransfer_globus");
+	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, SURL)<0) {
+		errorExit("Out of memory in digs_startGetRangeTransfer_globus");
 	}
+
+	acquireTransactionListMutex();
+	t = newFtpTransaction("read", hostname);
+
+	if (!t) {
+		releaseTransactionListMutex();
+		globus_libc_free(urlBuffer);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
 	t->destFilepath = safe_strdup(localPath);
 	t->hostname = safe_strdup(hostname);
 
-	/* Start up a put operation */
-	err = globus_ftp_client_get(&t->handle, urlBuffer, &t->attr, NULL,
+	/* Start up a get of just the range */
+	setFtpTransferAttributes(&t->attr, hostname);
+	err = globus_ftp_client_partial_get(t->handle, urlBuffer, &t->attr, NULL,
+			(globus_off_t)offset, (globus_off_t)(offset + length),
 			replicateCompleteCallback, t);
 
 	if (err != GLOBUS_SUCCESS) {
@@ -1650,9 +2425,9 @@ digs_error_code_t digs_startGetTransfer_globus(char *errorMessage,
 		return getErrorAndMessageFromGlobus(errorObject, errorMessage);
 	}
 
-	/* and start sending data to FTP module */
-	if (!startFtpRead(lockedLocalPath, t, errorMessage)) {
-		globus_ftp_client_abort(&t->handle);
+	/* and start writing the data into place */
+	if (!startFtpReadRange(localPath, t, (globus_off_t)offset, errorMessage)) {
+		globus_ftp_client_abort(t->handle);
 		destroyFtpTransaction(t);
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
@@ -1662,7 +2437,6 @@ digs_error_code_t digs_startGetTransfer_globus(char *errorMessage,
 	*handle = t->id;
 	releaseTransactionListMutex();
 	globus_libc_free(urlBuffer);
-	globus_libc_free(lockedLocalPath);
 
 	return DIGS_SUCCESS;
 }
@@ -1726,6 +2500,71 @@ digs_error_code_t digs_monitorTransfer_globus(char *errorMessage, int handle,
 	return DIGS_SUCCESS;
 }
 
+/***********************************************************************
+ *digs_error_code_t digs_getTransferProgress_globus(char *errorMessage,
+ *		int handle, long long *bytes);
+ * 
+ * Gets how many bytes of a file a transfer has moved so far, not
+ * counting any kept from an earlier attempt that it resumed.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 bytes			receives the number of bytes moved					O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferProgress_globus(char *errorMessage,
+		int handle, long long *bytes) {
+	ftpTransaction_t *t;
+
+	errorMessage[0] = '\0';
+	*bytes = 0;
+
+	acquireTransactionListMutex();
+	t = findTransaction(handle);
+	if (t == NULL) {
+		releaseTransactionListMutex();
+		strncpy(errorMessage, "Couldn't find the transaction.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+	*bytes = (long long)t->transferred;
+	releaseTransactionListMutex();
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_waitForTransfers_globus(char *errorMessage,
+ *		int *handles, int count, float timeOut, int *completed);
+ * 
+ * Blocks until at least one of several transfers, identified by their
+ * handles, has finished (successfully or not) or the time out expires.
+ * Lets a caller with many transfers outstanding sleep until there is
+ * something to do instead of polling each of them in turn.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handles 		the ids of the transfers							I
+ * 	 count 			the number of handles								I
+ * 	 timeOut 		the longest time to wait, in seconds				I
+ * 	 completed		index into handles of a finished transfer, or
+ * 					-1 if none finished before the time out				O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_waitForTransfers_globus(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed) {
+
+	errorMessage[0] = '\0';
+	*completed = waitOnFtpMany(handles, count, timeOut);
+	return DIGS_SUCCESS;
+}
+
 /***********************************************************************
  * digs_error_code_t digs_endTransfer_globus(char *errorMessage, int handle)
  * 
@@ -1761,24 +2600,49 @@ logMessage(DEBUG, "start digs_endTransfer_globus");
 				MAX_ERROR_MESSAGE_LENGTH);
 		return DIGS_UNKNOWN_ERROR;
 	}
+	char *lockedFilepath; 
+	if (safe_asprintf(&lockedFilepath, "%s-LOCKED", (t->destFilepath))<0) {
+		errorExit("Out of memory in digs_endTransfer_globus");
+	}
+
 	/* If the transaction wasn't successful return the error*/
 	if (!t->succeeded) {
 		globus_object_t *error;
 		error = (globus_object_t *)t->error;
 
+		if (t->inPlace) {
+			/* the file belongs to whoever started the range */
+			destroyFtpTransaction(t);
+			releaseTransactionListMutex();
+			globus_libc_free(lockedFilepath);
+			return getErrorAndMessageFromGlobus(error, errorMessage);
+		}
+
+		/* A failed put leaves its partial file on the server; keep
+		 * what a get received too, so a retry can resume */
+		if (!t->writing) {
+			keepPartialFtpRead(t, lockedFilepath);
+		}
+
 		destroyFtpTransaction(t);
 		releaseTransactionListMutex();
+		globus_libc_free(lockedFilepath);
 
 		return getErrorAndMessageFromGlobus(error, errorMessage);
 	}
+	/* a range is checked by whoever puts the file together */
+	if (t->inPlace) {
+		destroyFtpTransaction(t);
+		releaseTransactionListMutex();
+		globus_libc_free(lockedFilepath);
+		return DIGS_SUCCESS;
+	}
+
 	/*check the checksum and remove LOCKED */
 	char *actualChecksum = "no checksum set";
-	char *lockedFilepath; 
-	if (safe_asprintf(&lockedFilepath, "%s-LOCKED", (t->destFilepath))<0) {
-		errorExit("Out of memory in digs_endTransfer_globus");
-	}
 	
 	if (t->writing) {//put
+		finishFtpDigest(t);
 		logMessage(DEBUG, "before get checksum in digs_endTransfer_globus");
 		releaseTransactionListMutex();
 		result = digs_getChecksum_globus(errorMessage, lockedFilepath,
@@ -1818,7 +2682,8 @@ logMessage(DEBUG, "start digs_endTransfer_globus");
 			result = digs_rm_globus(errorMessage, t->hostname, lockedFilepath);
 			acquireTransactionListMutex();
 		} else {//get
-			//TODO remove file on local machine
+			/* so that a retry doesn't try to resume from it */
+			unlink(lockedFilepath);
 		}
 		logMessage(WARN, "local checksum %s", actualChecksum);
 		logMessage(WARN, "remote checksum %s", t->checksum);
@@ -1836,6 +2701,54 @@ logMessage(DEBUG, "start digs_endTransfer_globus");
 	return result;
 }
 
+/***********************************************************************
+ * digs_error_code_t digs_getTransferChecksum_globus(char *errorMessage,
+ *		int handle, char **checksum);
+ * 
+ * Gets the MD5 checksum of the local file sent by a put that has
+ * finished, worked out from the data as it was sent.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 checksum		receives the checksum, to be freed with
+ * 					digs_free_string_globus								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferChecksum_globus(char *errorMessage,
+		int handle, char **checksum) {
+	ftpTransaction_t *t;
+
+	errorMessage[0] = '\0';
+	*checksum = NULL;
+
+	acquireTransactionListMutex();
+	t = findTransaction(handle);
+	if (t == NULL) {
+		releaseTransactionListMutex();
+		strncpy(errorMessage, "Couldn't find the transaction.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	if ((!t->writing) || (!t->reachedEnd) || (!finishFtpDigest(t))) {
+		releaseTransactionListMutex();
+		strncpy(errorMessage, "The transfer has no checksum of what it sent.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	*checksum = safe_strdup(t->checksum);
+	releaseTransactionListMutex();
+	if (!*checksum) {
+		errorExit("Out of memory in digs_getTransferChecksum_globus");
+	}
+	return DIGS_SUCCESS;
+}
+
 /***********************************************************************
  * digs_error_code_t digs_cancelTransfer_globus(char *errorMessage, int handle)
  * 
@@ -1870,9 +2783,11 @@ digs_error_code_t digs_cancelTransfer_globus(char *errorMessage, int handle){
 	}
 	
 	/* Cancel the transfer. */
-	if (globus_ftp_client_abort(&t->handle) != GLOBUS_SUCCESS) {
+	if (globus_ftp_client_abort(t->handle) != GLOBUS_SUCCESS) {
 		logMessage(WARN, "Error aborting FTP operation %s", t->opName);
 	}
+	/* and the read from the source too, if it's a relay */
+	abortFtpRelayPeer(t);
 
 	/* Remove the file if it has been created. */
 	char *lockedFilepath;
@@ -1887,10 +2802,13 @@ digs_error_code_t digs_cancelTransfer_globus(char *errorMessage, int handle){
 	destFilepath = safe_strdup(t->destFilepath);
 
 	int isWriting = t->writing;//The callback will destroy the transaction.
+	int inPlace = t->inPlace;
 	t->waiting = 0;
 	releaseTransactionListMutex();
 
-	if (isWriting) {//put
+	if (inPlace) {
+		/* leave the file to whoever started the range */
+	} else if (isWriting) {//put
 		/* remove locked file */
 		digs_rm_globus(errorMessage, hostname, lockedFilepath);
 		/* remove unlocked file */
@@ -1938,7 +2856,7 @@ digs_error_code_t digs_mkdir_globus(char *errorMessage, const char *hostname,
 	}
 	
 	acquireTransactionListMutex();
-	t = newFtpTransaction("mkdir");
+	t = newFtpTransaction("mkdir", hostname);
 
 	if (!t) {
 		releaseTransactionListMutex();
@@ -1957,7 +2875,7 @@ digs_error_code_t digs_mkdir_globus(char *errorMessage, const char *hostname,
 	logMessage(DEBUG, "make dir %s", urlBuffer);
 
 	/* mkdir */
-	err = globus_ftp_client_mkdir( &t->handle, urlBuffer, &t->attr,
+	err = globus_ftp_client_mkdir( t->handle, urlBuffer, &t->attr,
 			completeCallback, t);
 	
 	if (err != GLOBUS_SUCCESS) {
@@ -2094,7 +3012,7 @@ digs_error_code_t digs_copy_globus(char *errorMessage, const char *hostname,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("move file");
+	t = newFtpTransaction("move file", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(source_url);
@@ -2103,10 +3021,11 @@ digs_error_code_t digs_copy_globus(char *errorMessage, const char *hostname,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 	//source_url = "gsiftp://qcdgrid4.epcc.ed.ac.uk/home/eilidh/testData/NEW/myDir-DIR-anotherDir-DIR-file1.txt"
 	//source_url = safe_strdup("gsiftp://qcdgrid3.epcc.ed.ac.uk/home/eilidh/hopeCopyWorks");
 	
+	setFtpThirdPartyAttributes(t, hostname, hostname);
 	err = globus_ftp_client_third_party_transfer(handle, source_url,
 			 &t->attr, dest_url, &t->attr2, NULL, completeCallback, t);
 
@@ -2199,7 +3118,7 @@ digs_error_code_t digs_mv_globus(char *errorMessage, const char *hostname,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("move file");
+	t = newFtpTransaction("move file", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(source_url);
@@ -2208,7 +3127,7 @@ digs_error_code_t digs_mv_globus(char *errorMessage, const char *hostname,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 	
 	err = globus_ftp_client_move(handle, source_url, dest_url, &t->attr, completeCallback, t);
 
@@ -2295,7 +3214,7 @@ digs_error_code_t digs_rm_globus(char *errorMessage, const char *hostname,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("remove file");
+	t = newFtpTransaction("remove file", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
@@ -2303,7 +3222,7 @@ digs_error_code_t digs_rm_globus(char *errorMessage, const char *hostname,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_delete(handle, urlBuffer, &t->attr,
 			completeCallback, t);
@@ -2378,7 +3297,7 @@ digs_error_code_t digs_rmdir_globus(char *errorMessage, const char *hostname,
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("remove directory");
+	t = newFtpTransaction("remove directory", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
@@ -2386,7 +3305,7 @@ digs_error_code_t digs_rmdir_globus(char *errorMessage, const char *hostname,
 	}
 
 	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	globus_ftp_client_handle_t *handle= t->handle;
 
 	err = globus_ftp_client_rmdir(handle, urlBuffer, &t->attr,
 			completeCallback, t);
@@ -2431,88 +3350,121 @@ digs_error_code_t digs_rmdir_globus(char *errorMessage, const char *hostname,
 	return DIGS_SUCCESS;
 }
 
-/***********************************************************************
- *digs_error_code_t getList(char *errorMessage,
- *	const char *hostname, const char *dir, char **oneDirlist)
- * 
- * Gets a listing of the files and dirs directly under the dir.
- * 
- *   Parameters:                                                	 [I/O]
- *
- * 	 errorMessage	an error description string	(expects to have
- * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
- *   hostname  		the FQDN of the host to contact          			I	
- * 	 dir			the directory to be listed							I
- *   list    		machine readable ls of the dir				 	    O		
- *    
- *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
- ***********************************************************************/
-digs_error_code_t getListFromGlobus(char *errorMessage,
-		const char *hostname, const char *dir, char **oneDirlist) {
+/*
+ * Starts a machine readable listing (MLSD) of a directory, read into the
+ * transaction's big buffer. On success the transaction is returned in
+ * *transaction, to be waited for and its buffer collected once done
+ */
+static digs_error_code_t startListGlobus(char *errorMessage,
+		const char *hostname, const char *dir, ftpTransaction_t **transaction) {
 
-	char *urlBuffer; /* buffer holding the gsiftp URL to check   */
+	char *urlBuffer;
 	ftpTransaction_t *t;
 	globus_result_t err;
-	float timeOut;
-	
-	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, dir)<0) {
-		errorExit("Out of memory in digs_scanNode_globus");
+
+	if (safe_asprintf(&urlBuffer, "gsiftp://%s%s", hostname, dir) < 0) {
+		errorExit("Out of memory in startListGlobus");
 	}
 
 	acquireTransactionListMutex();
-	t = newFtpTransaction("readToBuffer");
-
+	t = newFtpTransaction("directory listing", hostname);
 	if (!t) {
 		releaseTransactionListMutex();
 		globus_libc_free(urlBuffer);
+		strncpy(errorMessage, "Could not start FTP transaction.",
+				MAX_ERROR_MESSAGE_LENGTH);
 		return DIGS_UNKNOWN_ERROR;
 	}
 
-	/* The Globus FTP handle for this transaction */
-	globus_ftp_client_handle_t *handle= &t->handle;
+	t->buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+	t->bigBuffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
+	if ((!t->buffer) || (!t->bigBuffer)) {
+		errorExit("Out of memory in startListGlobus");
+	}
+	t->bigBuffer[0] = '\0';
 
-	err = globus_ftp_client_machine_list(handle, urlBuffer, &t->attr,
+	err = globus_ftp_client_machine_list(t->handle, urlBuffer, &t->attr,
 			replicateCompleteCallback, t);
+	globus_libc_free(urlBuffer);
 
 	if (err != GLOBUS_SUCCESS) {
 		destroyFtpTransaction(t);
 		releaseTransactionListMutex();
-		globus_libc_free(urlBuffer);
-		globus_object_t *errorObject;
 
 		/* Turn the error code into a Globus object */
+		globus_object_t *errorObject;
 		errorObject = globus_error_get(err);
 		return getErrorAndMessageFromGlobus(errorObject, errorMessage);
 	}
 
-	releaseTransactionListMutex();
-	globus_libc_free(urlBuffer);
-	
-	t->buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
-	if (!t->buffer) {
-		globus_libc_free(urlBuffer);
-		destroyFtpTransaction(t);
-		releaseTransactionListMutex();
-		errorExit("Out of memory in digs_scanNode_globus");
+	/*
+	 * and start receiving data. If that fails the abort makes the
+	 * listing complete with an error, which is reported when it's
+	 * collected
+	 */
+	if (!startFtpReadToBuffer(t)) {
+		globus_ftp_client_abort(t->handle);
 	}
-	t->bigBuffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
-	if (!t->bigBuffer) {
-		globus_libc_free(urlBuffer);
+
+	releaseTransactionListMutex();
+	*transaction = t;
+	return DIGS_SUCCESS;
+}
+
+/*
+ * Collects the listing from a completed startListGlobus transaction and
+ * destroys the transaction. On success *listing receives the MLSD text,
+ * which the caller frees
+ */
+static digs_error_code_t finishListGlobus(char *errorMessage,
+		ftpTransaction_t *t, char **listing) {
+
+	acquireTransactionListMutex();
+	if (!t->succeeded) {
+		globus_object_t *error = (globus_object_t *)t->error;
+
 		destroyFtpTransaction(t);
 		releaseTransactionListMutex();
-		errorExit("Out of memory in digs_scanNode_globus");
+
+		return getErrorAndMessageFromGlobus(error, errorMessage);
 	}
-	t->bigBuffer[0]='\0';
-		    
+
+	/* take the buffer over rather than copying it */
+	*listing = t->bigBuffer;
+	t->bigBuffer = NULL;
+
+	destroyFtpTransaction(t);
 	releaseTransactionListMutex();
-	
-	/* and start receiving data */
-	if (!startFtpReadToBuffer(t)) {
-		releaseTransactionListMutex();
-		globus_ftp_client_abort(&t->handle);
-		return 0;
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *digs_error_code_t getList(char *errorMessage,
+ *	const char *hostname, const char *dir, char **oneDirlist)
+ * 
+ * Gets a listing of the files and dirs directly under the dir.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 dir			the directory to be listed							I
+ *   list    		machine readable ls of the dir				 	    O		
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t getListFromGlobus(char *errorMessage,
+		const char *hostname, const char *dir, char **oneDirlist) {
+
+	ftpTransaction_t *t;
+	digs_error_code_t result;
+	float timeOut;
+
+	result = startListGlobus(errorMessage, hostname, dir, &t);
+	if (result != DIGS_SUCCESS) {
+		return result;
 	}
-	releaseTransactionListMutex();
 
 	timeOut = getNodeCopyTimeout(hostname);
 
@@ -2523,23 +3475,7 @@ digs_error_code_t getListFromGlobus(char *errorMessage,
 		return DIGS_NO_RESPONSE;
 	}
 
-	acquireTransactionListMutex();
-	if (!t->succeeded) {
-
-		globus_object_t *error = (globus_object_t *)t->error;
-
-		destroyFtpTransaction(t);
-		releaseTransactionListMutex();
-
-		return getErrorAndMessageFromGlobus(error, errorMessage);
-	}
-
-	*oneDirlist = safe_strdup(t->bigBuffer);
-	
-	destroyFtpTransaction(t);
-	releaseTransactionListMutex();
-
-	return DIGS_SUCCESS;
+	return finishListGlobus(errorMessage, t, oneDirlist);
 }
 
 /***********************************************************************
@@ -2729,13 +3665,369 @@ digs_error_code_t digs_copyFromInbox_globus(char *errorMessage,
 	return result;
 }
 
+/*
+ * A directory found by scanTreeGlobus but not listed yet
+ */
+typedef struct scanDir_s {
+	char *path;
+	struct scanDir_s *next;
+} scanDir_t;
+
+/*
+ * State of a scan by scanTreeGlobus
+ */
+typedef struct treeScan_s {
+	int allFiles;
+	digs_scan_callback_t callback;
+	void *userData;
+
+	/*
+	 * If not NULL, set to each file's modification time (or -1 if the
+	 * server didn't send one) before the callback is called for it
+	 */
+	time_t *modTime;
+
+	/* Set once the callback has asked for the scan to stop */
+	int stopped;
+
+	/*
+	 * Directories waiting to be listed, most recently found first so
+	 * the walk stays roughly depth first and the queue stays short
+	 */
+	scanDir_t *pending;
+
+	/*
+	 * Listings in progress, their handles (for waitOnFtpMany) and the
+	 * directory each one is of
+	 */
+	ftpTransaction_t **inFlight;
+	int *handles;
+	char **inFlightDirs;
+	int numInFlight;
+	int maxInFlight;
+
+	/* Reused to build the full path of each file passed to the callback */
+	char *pathBuffer;
+	int pathBufferSize;
+} treeScan_t;
+
+/*
+ * Builds dir/name in the scan's path buffer
+ */
+static char *makeScanPath(treeScan_t *scan, const char *dir, const char *name) {
+	int dirLength = strlen(dir);
+	int length = dirLength + strlen(name) + 2;
+
+	if (length > scan->pathBufferSize) {
+		scan->pathBufferSize = length * 2;
+		scan->pathBuffer = globus_libc_realloc(scan->pathBuffer,
+				scan->pathBufferSize);
+		if (!scan->pathBuffer) {
+			errorExit("Out of memory in makeScanPath");
+		}
+	}
+
+	strcpy(scan->pathBuffer, dir);
+	if ((dirLength == 0) || (dir[dirLength - 1] != '/')) {
+		strcat(scan->pathBuffer, "/");
+	}
+	strcat(scan->pathBuffer, name);
+	return scan->pathBuffer;
+}
+
+/*
+ * Adds a directory to the front of the scan's pending list
+ */
+static void pushScanDir(treeScan_t *scan, const char *path) {
+	scanDir_t *d;
+
+	d = globus_libc_malloc(sizeof(scanDir_t));
+	if (!d) {
+		errorExit("Out of memory in pushScanDir");
+	}
+	d->path = safe_strdup(path);
+	if (!d->path) {
+		errorExit("Out of memory in pushScanDir");
+	}
+	d->next = scan->pending;
+	scan->pending = d;
+}
+
+/*
+ * Splits one line of an MLSD listing in place. Returns the entry's name
+ * and points *type and *modify at the values of its Type and Modify
+ * facts, all NUL terminated inside the line (NULL for a fact that isn't
+ * there). Returns NULL if the line isn't a listing entry
+ */
+static char *parseMlsdLine(char *line, char **type, char **modify) {
+	char *name;
+	char *fact;
+	char *next;
+
+	*type = NULL;
+	*modify = NULL;
+
+	/* the facts end at the space before the name */
+	name = strchr(line, ' ');
+	if (!name) {
+		return NULL;
+	}
+	*name++ = '\0';
+
+	for (fact = line; *fact; fact = next) {
+		next = strchr(fact, ';');
+		if (next) {
+			*next++ = '\0';
+		} else {
+			next = fact + strlen(fact);
+		}
+		if (strncasecmp(fact, "Type=", 5) == 0) {
+			*type = fact + 5;
+		} else if (strncasecmp(fact, "Modify=", 7) == 0) {
+			*modify = fact + 7;
+		}
+	}
+	return name;
+}
+
+/*
+ * Goes through a directory listing, passing the files in it to the
+ * scan's callback and queueing the subdirectories to be listed. The
+ * listing is parsed in place
+ */
+static void processScanListing(treeScan_t *scan, const char *dir,
+		char *listing) {
+	char *line;
+	char *next;
+	char *name;
+	char *type;
+	char *modify;
+	int length;
+
+	for (line = listing; (*line) && (!scan->stopped); line = next) {
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		} else {
+			next = line + strlen(line);
+		}
+
+		length = strlen(line);
+		if ((length > 0) && (line[length - 1] == '\r')) {
+			line[length - 1] = '\0';
+		}
+
+		name = parseMlsdLine(line, &type, &modify);
+		if ((!name) || (!type)) {
+			continue;
+		}
+
+		if (!strcasecmp(type, "dir")) {
+			pushScanDir(scan, makeScanPath(scan, dir, name));
+		} else if (!strcasecmp(type, "file")) {
+			/* Filter out locked files */
+			if ((!scan->allFiles) && (strstr(name, "-LOCKED") != NULL)) {
+				continue;
+			}
+			if (scan->modTime) {
+				*scan->modTime = modify ? parseMlstTime(modify) : (time_t)-1;
+			}
+			if (!scan->callback(makeScanPath(scan, dir, name),
+					scan->userData)) {
+				scan->stopped = 1;
+			}
+		}
+	}
+}
+
+/***********************************************************************
+ * digs_error_code_t scanTreeGlobus(char *errorMessage,
+ *	 const char *hostname, int numTopDirs, const char **topDirs,
+ *	 int allFiles, digs_scan_callback_t callback, void *userData,
+ *	 time_t *modTime)
+ * 
+ * Walks the directory trees under one or more directories, passing each
+ * file found to the callback. Several directories are listed at once
+ * (SCAN_LISTINGS, or the node's 'scanlistings' property), each on its
+ * own pooled session, and each listing is handled as soon as it
+ * arrives.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 numTopDirs		number of directories to walk						I
+ * 	 topDirs		the directories to walk								I
+ * 	 allFiles		Show all files or hide any temporary (locked files) I
+ * 	 callback		called with the full path of each file				I
+ * 	 userData		passed through to the callback						I
+ * 	 modTime		if not NULL, set to each file's modification time	O
+ * 					(-1 if unknown) before the callback is called for it
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+static digs_error_code_t scanTreeGlobus(char *errorMessage,
+		const char *hostname, int numTopDirs, const char **topDirs,
+		int allFiles, digs_scan_callback_t callback, void *userData,
+		time_t *modTime) {
+
+	digs_error_code_t result = DIGS_SUCCESS;
+	treeScan_t scan;
+	scanDir_t *d;
+	ftpTransaction_t *t;
+	char *listing;
+	char *dir;
+	char *prop;
+	float timeOut;
+	int done;
+	int i;
+
+	logMessage(DEBUG, "scanTreeGlobus(%s, %d dirs)", hostname, numTopDirs);
+
+	scan.allFiles = allFiles;
+	scan.callback = callback;
+	scan.userData = userData;
+	scan.modTime = modTime;
+	scan.stopped = 0;
+	scan.pending = NULL;
+	scan.numInFlight = 0;
+	scan.pathBuffer = NULL;
+	scan.pathBufferSize = 0;
+
+	scan.maxInFlight = SCAN_LISTINGS;
+	prop = getNodeProperty(hostname, "scanlistings");
+	if (prop) {
+		scan.maxInFlight = atoi(prop);
+		globus_libc_free(prop);
+	}
+	if (scan.maxInFlight < 1) {
+		scan.maxInFlight = 1;
+	}
+
+	scan.inFlight = globus_libc_malloc(scan.maxInFlight * sizeof(ftpTransaction_t *));
+	scan.handles = globus_libc_malloc(scan.maxInFlight * sizeof(int));
+	scan.inFlightDirs = globus_libc_malloc(scan.maxInFlight * sizeof(char *));
+	if ((!scan.inFlight) || (!scan.handles) || (!scan.inFlightDirs)) {
+		errorExit("Out of memory in scanTreeGlobus");
+	}
+
+	/* push in reverse so they are listed in the order given */
+	for (i = numTopDirs - 1; i >= 0; i--) {
+		pushScanDir(&scan, topDirs[i]);
+	}
+
+	timeOut = getNodeCopyTimeout(hostname);
+
+	while ((!scan.stopped) && ((scan.pending) || (scan.numInFlight > 0))) {
+
+		/* keep as many listings going as allowed */
+		while ((scan.pending) && (scan.numInFlight < scan.maxInFlight)) {
+			d = scan.pending;
+			scan.pending = d->next;
+
+			result = startListGlobus(errorMessage, hostname, d->path, &t);
+			if (result != DIGS_SUCCESS) {
+				globus_libc_free(d->path);
+				globus_libc_free(d);
+				break;
+			}
+
+			scan.inFlight[scan.numInFlight] = t;
+			scan.handles[scan.numInFlight] = t->id;
+			scan.inFlightDirs[scan.numInFlight] = d->path;
+			scan.numInFlight++;
+			globus_libc_free(d);
+		}
+		if ((result != DIGS_SUCCESS) || (scan.numInFlight == 0)) {
+			break;
+		}
+
+		/* deal with whichever listing finishes first */
+		done = waitOnFtpMany(scan.handles, scan.numInFlight, timeOut);
+		if (done < 0) {
+			strncpy(errorMessage, TIMEOUT_MESSAGE, MAX_ERROR_MESSAGE_LENGTH);
+			result = DIGS_NO_RESPONSE;
+			break;
+		}
+
+		t = scan.inFlight[done];
+		dir = scan.inFlightDirs[done];
+		scan.numInFlight--;
+		scan.inFlight[done] = scan.inFlight[scan.numInFlight];
+		scan.handles[done] = scan.handles[scan.numInFlight];
+		scan.inFlightDirs[done] = scan.inFlightDirs[scan.numInFlight];
+
+		result = finishListGlobus(errorMessage, t, &listing);
+		if (result == DIGS_SUCCESS) {
+			processScanListing(&scan, dir, listing);
+			globus_libc_free(listing);
+		}
+		globus_libc_free(dir);
+		if (result != DIGS_SUCCESS) {
+			break;
+		}
+	}
+
+	/* tidy up anything left after an error or an early stop */
+	for (i = 0; i < scan.numInFlight; i++) {
+		abandonFtpTransaction(scan.inFlight[i]);
+		globus_libc_free(scan.inFlightDirs[i]);
+	}
+	while (scan.pending) {
+		d = scan.pending;
+		scan.pending = d->next;
+		globus_libc_free(d->path);
+		globus_libc_free(d);
+	}
+	globus_libc_free(scan.inFlight);
+	globus_libc_free(scan.handles);
+	globus_libc_free(scan.inFlightDirs);
+	if (scan.pathBuffer) {
+		globus_libc_free(scan.pathBuffer);
+	}
+
+	return result;
+}
+
+/*
+ * Array of file paths built up by addToScanList, for the scans that
+ * return their results as one list
+ */
+typedef struct scanList_s {
+	char **list;
+	int length;
+	int size;
+} scanList_t;
+
+/*
+ * Scan callback which appends each file to a scanList_t
+ */
+static int addToScanList(const char *filePath, void *userData) {
+	scanList_t *l = (scanList_t *)userData;
+
+	if (l->length >= l->size) {
+		l->size = (l->size < 64) ? 64 : l->size * 2;
+		l->list = globus_libc_realloc(l->list, l->size * sizeof(char *));
+		if (!l->list) {
+			errorExit("Out of memory in addToScanList");
+		}
+	}
+
+	l->list[l->length] = safe_strdup(filePath);
+	if (!l->list[l->length]) {
+		errorExit("Out of memory in addToScanList");
+	}
+	l->length++;
+	return 1;
+}
+
 /***********************************************************************
  * digs_error_code_t getListOfFilesBelowThisDir(char *errorMessage,
  *	 const char *hostname, path_s *topDir, char ***list, int *listLength,
  * 	 int allFiles)
  * 
- * Add the files under this directory to the list of files. Maintain list
- * of dirs that are still to be listed.
+ * Add the files under this directory to the list of files.
  * 
  *   Parameters:                                                	 [I/O]
  *
@@ -2752,114 +4044,141 @@ digs_error_code_t getListOfFilesBelowThisDir(char *errorMessage,
 		const char *hostname, const char *topDir, char ***listOfFiles,
 		int *listLength, int allFiles) {
 
-	digs_error_code_t result = DIGS_UNKNOWN_ERROR;	
-	char **oneDirList;
-	oneDirList = globus_malloc(sizeof(char**));
+	digs_error_code_t result;
+	scanList_t l;
 
-	logMessage(DEBUG, "digs_scanNode_globus(%s,%s)", hostname, topDir);
-	result = getListFromGlobus(errorMessage, hostname, topDir, oneDirList);
-	if (result != DIGS_SUCCESS){
-		return result;
+	l.list = *listOfFiles;
+	l.length = *listLength;
+	l.size = *listLength;
+
+	result = scanTreeGlobus(errorMessage, hostname, 1, &topDir, allFiles,
+			addToScanList, &l, NULL);
+
+	*listOfFiles = l.list;
+	*listLength = l.length;
+	return result;
+}
+
+/*
+ * Finds the data directories (data, data1, data2, ...) on a node from a
+ * single listing of its top directory. Returns their full paths in
+ * *dataDirs, to be freed with digs_free_string_array_globus
+ */
+static digs_error_code_t getDataDirsGlobus(char *errorMessage,
+		const char *hostname, char ***dataDirs, int *numDataDirs) {
+
+	digs_error_code_t result;
+	char *topDir;
+	char *listing;
+	char *line;
+	char *next;
+	char *name;
+	char *type;
+	char *modify;
+	char *dataDir;
+	int length;
+
+	*dataDirs = NULL;
+	*numDataDirs = 0;
+
+	topDir = getNodePath(hostname);
+	if (!topDir) {
+		strncpy(errorMessage, "No path configured for node",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_NO_SERVICE;
 	}
-	
-	char *row;
-	char **tempList; // Just to help with parsing.
-	int lengthOfTempList = 0;
-	tempList = globus_malloc(sizeof(*tempList));
-	row = strtok(*oneDirList, "\n");
-	/* for each row */
-	while (row) {
-		/* Add item to temp list */
-		lengthOfTempList++;
-		tempList = globus_realloc(tempList,((lengthOfTempList)* sizeof(*tempList)));
-		tempList[lengthOfTempList-1] = safe_strdup(row);
+	logMessage(DEBUG, "topDir is (%s)", topDir);
 
-		row = strtok('\0', "\n");
+	result = getListFromGlobus(errorMessage, hostname, topDir, &listing);
+	if (result != DIGS_SUCCESS) {
+		return result;
 	}
-	
-	char *type, *tmp;
-	char *lastItem, *lastItem2 = NULL;
-	char *parsedItem;
-	int i;
-	for (i=0; i<lengthOfTempList; i++) {
-		/*getType of item */
-	        tmp = safe_strdup(tempList[i]);
-		type = parseMlst("Type", tmp);
 
-		if (!strcmp(type, "file")) {
-			/* If it's a file add to the list of files */
-			parsedItem = strtok(tempList[i], "; ");
-			while (parsedItem) {
-				lastItem2 = parsedItem;
-				parsedItem = strtok('\0', "; ");
-			}
-			lastItem = safe_strdup(lastItem2);
-			lastItem[strlen(lastItem)-1]='\0'; //remove the line break after file name
-			
-			int isLockedFile = 0;
-			char *lockedSuffix = "-LOCKED";
-			if(strstr(lastItem, lockedSuffix)!=NULL){
-				isLockedFile = 1;
-			}
-			
-			if (allFiles || (!isLockedFile)) { //Filter out locked files
-				int stringLength = strlen(topDir)+strlen(lastItem);
-				char *filePath= globus_malloc((stringLength + 2)*sizeof(char));
-				if (!filePath) {
-					errorExit("Out of memory in scanNode");
-				}
-				strncpy(filePath, topDir, stringLength);
-				strncat(filePath, "/", stringLength);
-				strncat(filePath, lastItem, stringLength);
-
-				(*listLength)++;
-				(*listOfFiles) = globus_realloc((*listOfFiles), *listLength * sizeof(char**));
-				(*listOfFiles)[*listLength-1] = filePath;
-			}
-			globus_free(lastItem);
-		} 
-		else if (!strcmp(type, "dir")) {
-			/* If it's a dir get the list of files below it. */
-			parsedItem = strtok(tempList[i], "; ");
-			while (parsedItem) {
-				lastItem2 = parsedItem;
-				parsedItem = strtok('\0', "; ");
-			}
-			lastItem = safe_strdup(lastItem2);
-			lastItem[strlen(lastItem)-1]='\0'; //remove the line break after file name
+	for (line = listing; *line; line = next) {
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		} else {
+			next = line + strlen(line);
+		}
 
-			int stringLength = strlen(topDir)+strlen(lastItem);
-			char *filePath = globus_malloc((stringLength + 2)*sizeof(char));
-			if (!filePath) {
-				errorExit("Out of memory in scanNode");
-			}
-			strncpy(filePath, topDir, stringLength);
-			strncat(filePath, "/", stringLength);
-			strncat(filePath, lastItem, stringLength);
-			
-			globus_free(lastItem);
-			result = getListOfFilesBelowThisDir(errorMessage, hostname,
-					filePath, listOfFiles, listLength, allFiles);
-			globus_free(filePath);
-			if (result != DIGS_SUCCESS) {
-				return result;
-			}
-		}	
-		globus_libc_free(tmp);
+		length = strlen(line);
+		if ((length > 0) && (line[length - 1] == '\r')) {
+			line[length - 1] = '\0';
+		}
+
+		name = parseMlsdLine(line, &type, &modify);
+		if ((!name) || (!type) || (strcasecmp(type, "dir") != 0) ||
+				(strncmp(name, "data", 4) != 0) ||
+				(strspn(&name[4], "0123456789") != strlen(&name[4]))) {
+			continue;
+		}
+
+		if (safe_asprintf(&dataDir, "%s/%s", topDir, name) < 0) {
+			errorExit("Out of memory in getDataDirsGlobus");
+		}
+		(*numDataDirs)++;
+		*dataDirs = globus_libc_realloc(*dataDirs,
+				(*numDataDirs) * sizeof(char *));
+		if (!*dataDirs) {
+			errorExit("Out of memory in getDataDirsGlobus");
+		}
+		(*dataDirs)[(*numDataDirs) - 1] = dataDir;
 	}
 
-	// tidy up
-	globus_free(*oneDirList);
-	globus_free(oneDirList);
-	digs_free_string_array_globus(&tempList, &lengthOfTempList);
+	globus_libc_free(listing);
 	return DIGS_SUCCESS;
 }
 
+/***********************************************************************
+ * digs_error_code_t digs_scanNodeStream_globus(char *errorMessage,
+ * const char *hostname, int allFiles, digs_scan_callback_t callback,
+ * void *userData);
+ * 
+ * As digs_scanNode_globus, but each file is passed to the callback as
+ * soon as it is found. Several directories are listed at once, up to
+ * the node's 'scanlistings' property (default 4).
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 allFiles		Show all files or hide any temporary (locked files) I
+ * 	 callback		called with the full path of each file				I
+ * 	 userData		passed through to the callback						I
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful, or if the
+ *            callback stopped the scan).
+ ***********************************************************************/
+digs_error_code_t digs_scanNodeStream_globus(char *errorMessage,
+		const char *hostname, int allFiles, digs_scan_callback_t callback,
+		void *userData) {
+
+	digs_error_code_t result;
+	char **dataDirs;
+	int numDataDirs;
+
+	errorMessage[0] = '\0';
+	logMessage(DEBUG, "digs_scanNodeStream_globus(%s)", hostname);
+
+	result = getDataDirsGlobus(errorMessage, hostname, &dataDirs, &numDataDirs);
+	if (result != DIGS_SUCCESS) {
+		return result;
+	}
+
+	result = scanTreeGlobus(errorMessage, hostname, numDataDirs,
+			(const char **)dataDirs, allFiles, callback, userData, NULL);
+
+	digs_free_string_array_globus(&dataDirs, &numDataDirs);
+	return result;
+}
+
 /***********************************************************************
  * digs_error_code_t digs_scanNode_globus(char *errorMessage, 
  * const char *hostname, char ***list, int *listLength, int allFiles);
  * 
- * Gets a recursive list of all the files below the inbox.
+ * Gets a recursive list of all the files below the data directories.
  * Setting the allFiles flag to zero will hide any temporary (locked) 
  * files.
  *
@@ -2881,55 +4200,19 @@ digs_error_code_t getListOfFilesBelowThisDir(char *errorMessage,
 digs_error_code_t digs_scanNode_globus(char *errorMessage,
 		const char *hostname, char ***list, int *listLength, int allFiles) {
 
-	digs_error_code_t result = DIGS_UNKNOWN_ERROR;	
-	errorMessage[0] = '\0';
-	
-	/* Setup list of files. */
-	*listLength = 0;
-	char **listOfFiles;
-	listOfFiles = globus_malloc(sizeof(char**));
-	*list = listOfFiles;
-	
-
-	char *topDir = safe_strdup(getNodePath(hostname));
+	digs_error_code_t result;
+	scanList_t l;
 
-	logMessage(DEBUG, "getNodePath (%s)",hostname);
-	logMessage(DEBUG, "topDir is (%s)",topDir);
-	
-	int stringLength = strlen(topDir)+strlen("path1");
-	char *dataPath= globus_malloc((stringLength +2)*sizeof(char));
-	if (!dataPath) {
-		errorExit("Out of memory in scanNode");
-	}
-	strncpy(dataPath, topDir, stringLength);
-	strncat(dataPath, "/", stringLength);
-	strncat(dataPath, "data", stringLength);
-	
-	char *dataDir;
-	dataDir = safe_strdup(dataPath);
+	l.list = NULL;
+	l.length = 0;
+	l.size = 0;
 
-	int doesExist = 0;
-	int i=1;
-	do{
-		result = getListOfFilesBelowThisDir(errorMessage, hostname, dataDir, list,
-				listLength, allFiles);
-		globus_free(dataDir);
-		if (safe_asprintf(&dataDir, "%s%d", dataPath, i) < 0) {
-			errorExit("Out of memory in digs_scanNode_globus");
-		}
+	result = digs_scanNodeStream_globus(errorMessage, hostname, allFiles,
+			addToScanList, &l);
 
-		i++;
-		// Check if the next path exists
-		result = digs_doesExist_globus(errorMessage, dataDir, hostname, &doesExist);
-		if (!((result == DIGS_SUCCESS)||(result == DIGS_UNSPECIFIED_SERVER_ERROR))) {
-			globus_free(dataDir);
-			globus_free(topDir);
-			return result;
-		}
-	}while((DIGS_SUCCESS == result) && (doesExist == 1));// next data dir exists.
-	
-	globus_free(topDir);
-	return DIGS_SUCCESS;
+	*list = l.list;
+	*listLength = l.length;
+	return result;
 }
 
 /***********************************************************************
@@ -2959,14 +4242,11 @@ digs_error_code_t digs_scanNode_globus(char *errorMessage,
 digs_error_code_t digs_scanInbox_globus(char *errorMessage,
 		const char *hostname, char ***list, int *listLength, int allFiles) {
 
-	digs_error_code_t result = DIGS_UNKNOWN_ERROR;	
 	errorMessage[0] = '\0';
 	
 	/* Setup list of files. */
 	*listLength = 0;
-	char **listOfFiles;
-	listOfFiles = globus_malloc(sizeof(char**));
-	*list = listOfFiles;
+	*list = NULL;
 
 	char *inbox = getNodeInbox(hostname);
 	if(inbox==NULL){
@@ -3002,6 +4282,47 @@ void digs_free_string_array_globus(char ***arrayOfStrings, int *listLength) {
     *listLength = 0;
 }
 
+/*
+ * Locked files found by the housekeeping scan. The modification time of
+ * each file comes with it in the listing, so only the files old enough
+ * to delete are kept, plus any the server didn't give a time for
+ */
+typedef struct lockedScan_s {
+	scanList_t oldFiles;
+	scanList_t undatedFiles;
+	time_t modTime;
+} lockedScan_t;
+
+/*
+ * Age after which a locked file is assumed to be left over from a
+ * transfer that failed
+ */
+#define LOCKED_FILE_MAX_AGE (24.0 * 60.0 * 60.0)
+
+/*
+ * Scan callback for housekeeping, which keeps only the locked files
+ * inside data directories
+ */
+static int addLockedFileToScanList(const char *filePath, void *userData) {
+	lockedScan_t *scan = (lockedScan_t *)userData;
+	int l = strlen(filePath);
+
+	if ((strstr(filePath, "/data") == NULL) || (l < 7) ||
+			(strcmp(&filePath[l - 7], "-LOCKED") != 0)) {
+		return 1;
+	}
+
+	logMessage(WARN, "Found locked file %s", filePath);
+
+	if (scan->modTime == (time_t)-1) {
+		return addToScanList(filePath, &scan->undatedFiles);
+	}
+	if (difftime(time(NULL), scan->modTime) > LOCKED_FILE_MAX_AGE) {
+		return addToScanList(filePath, &scan->oldFiles);
+	}
+	return 1;
+}
+
 /***********************************************************************
  * void digs_housekeeping_globus(char *errorMessage, char *hostname);
  *
@@ -3017,9 +4338,8 @@ void digs_free_string_array_globus(char ***arrayOfStrings, int *listLength) {
  ***********************************************************************/
 digs_error_code_t digs_housekeeping_globus(char *errorMessage, char *hostname)
 {
-    char **list = NULL;
-    int listLength = 0;
-    char *topdir;
+    lockedScan_t scan;
+    const char *topdir;
     int i;
     digs_error_code_t result;
 
@@ -3040,51 +4360,60 @@ digs_error_code_t digs_housekeeping_globus(char *errorMessage, char *hostname)
 	return DIGS_NO_SERVICE;
     }
 
-    result = getListOfFilesBelowThisDir(errorMessage, hostname, topdir, &list,
-					&listLength, 1);
+    /*
+     * only the locked files inside data directories are kept, sorted by
+     * the modification times in the listing so that most files need no
+     * request of their own
+     */
+    memset(&scan, 0, sizeof(scan));
+    result = scanTreeGlobus(errorMessage, hostname, 1, &topdir, 1,
+			    addLockedFileToScanList, &scan, &scan.modTime);
     if (result != DIGS_SUCCESS)
     {
+	digs_free_string_array_globus(&scan.oldFiles.list,
+				      &scan.oldFiles.length);
+	digs_free_string_array_globus(&scan.undatedFiles.list,
+				      &scan.undatedFiles.length);
 	return result;
     }
 
-    /* check each file to see if it's a locked one */
-    for (i = 0; i < listLength; i++)
+    /* the server didn't give times for these, so ask for each one */
+    for (i = 0; i < scan.undatedFiles.length; i++)
     {
-	/* only do files inside data directory */
-	if (strstr(list[i], "/data") != NULL)
+	time_t modtime;
+
+	result = digs_getModificationTime_globus(errorMessage,
+						 scan.undatedFiles.list[i],
+						 hostname, &modtime);
+	if (result != DIGS_SUCCESS)
 	{
-	    int l = strlen(list[i]);
-	    if (!strcmp(&list[i][l - 7], "-LOCKED"))
-	    {
-		time_t modtime;
-
-		logMessage(WARN, "Found locked file %s", list[i]);
-
-		/* found a locked file */
-		/* get its modification time */
-		result = digs_getModificationTime_globus(errorMessage,
-							 list[i], hostname, &modtime);
-		if (result != DIGS_SUCCESS)
-		{
-		    digs_free_string_array_globus(&list, &listLength);
-		    return result;
-		}
+	    break;
+	}
+	if (difftime(time(NULL), modtime) > LOCKED_FILE_MAX_AGE)
+	{
+	    addToScanList(scan.undatedFiles.list[i], &scan.oldFiles);
+	}
+    }
+    digs_free_string_array_globus(&scan.undatedFiles.list,
+				  &scan.undatedFiles.length);
+    if (result != DIGS_SUCCESS)
+    {
+	digs_free_string_array_globus(&scan.oldFiles.list,
+				      &scan.oldFiles.length);
+	return result;
+    }
 
-		/* see if it's old enough to safely delete */
-		if (difftime(time(NULL), modtime) > 24.0 * 60.0 * 60.0)
-		{
-		    logMessage(WARN, "Removing %s", list[i]);
-		    result = digs_rm_globus(errorMessage, hostname, list[i]);
-		    if (result != DIGS_SUCCESS)
-		    {
-			digs_free_string_array_globus(&list, &listLength);
-			return result;
-		    }
-		}
-	    }
+    /* these are old enough to safely delete */
+    for (i = 0; i < scan.oldFiles.length; i++)
+    {
+	logMessage(WARN, "Removing %s", scan.oldFiles.list[i]);
+	result = digs_rm_globus(errorMessage, hostname, scan.oldFiles.list[i]);
+	if (result != DIGS_SUCCESS)
+	{
+	    break;
 	}
     }
 
-    digs_free_string_array_globus(&list, &listLength);
-    return DIGS_SUCCESS;
+    digs_free_string_array_globus(&scan.oldFiles.list, &scan.oldFiles.length);
+    return result;
 }
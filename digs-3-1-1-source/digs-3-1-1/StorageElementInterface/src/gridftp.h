@@ -99,6 +99,73 @@ digs_error_code_t digs_getChecksum_globus(char *errorMessage,
 		const char *filePath, const char *hostname, char **fileChecksum,
 		digs_checksum_type_t checksumType) ;
 
+/***********************************************************************
+ *digs_error_code_t digs_startChecksum_globus(char *errorMessage,
+ * const char *filePath, const char *hostname,
+ * digs_checksum_type_t checksumType, long long int fileLength,
+ * int *handle)
+ * 
+ * Starts a server side checksum of a file without waiting for it. The
+ * deadline is the node's FTP time out plus the time to read the file at
+ * the node's 'checksumrate' property (in MB/s, default 10), or the copy
+ * time out if the length isn't known. The handle is an FTP transaction
+ * handle and can be waited on with digs_waitForTransfers_globus.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 checksumType	the checkdigs_checksum_type_t						I
+ * 	 fileLength		length of the file in bytes, or -1 if unknown		I
+ * 	 handle 		the id of the checksum								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startChecksum_globus(char *errorMessage,
+		const char *filePath, const char *hostname,
+		digs_checksum_type_t checksumType, long long int fileLength,
+		int *handle);
+
+/***********************************************************************
+ *digs_error_code_t digs_monitorChecksum_globus(char *errorMessage,
+ * int handle, digs_transfer_status_t *status)
+ * 
+ * Checks whether a checksum started with digs_startChecksum_globus has
+ * finished, or has passed its deadline.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the checksum								I
+ * 	 status			the status of the checksum							O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_monitorChecksum_globus(char *errorMessage, int handle,
+		digs_transfer_status_t *status);
+
+/***********************************************************************
+ *digs_error_code_t digs_endChecksum_globus(char *errorMessage, int handle,
+ * char **fileChecksum)
+ * 
+ * Collects the result of a checksum started with
+ * digs_startChecksum_globus, aborting it if it is still running.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the checksum								I
+ * 	 fileChecksum	the checksum, in uppercase hex, or NULL on error	O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_endChecksum_globus(char *errorMessage, int handle,
+		char **fileChecksum);
+
 /***********************************************************************
  * digs_error_code_t digs_isDirectory_globus (char *errorMessage,
  * const char *filePath, const char *hostname, int *isDirectory)
@@ -305,6 +372,52 @@ digs_error_code_t digs_getModificationTime_globus(char *errorMessage,
 		const char *filePath, const char *hostname,
 		time_t *modificationTime);
 
+/***********************************************************************
+ *  digs_error_code_t digs_stat_globus(char *errorMessage,
+ *		const char *filePath, const char *hostname, digs_stat_t *stat);
+ * 
+ *     Gets everything about a file the node can report, in a single
+ *     MLST. Free the result with digs_freeStat.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 stat			the file's details									O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_stat_globus(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat);
+
+/***********************************************************************
+ *  digs_error_code_t digs_statMany_globus(char *errorMessage,
+ *		const char *hostname, int count, const char **filePaths,
+ * 		digs_stat_t *stats, digs_error_code_t *results);
+ * 
+ *     As digs_stat_globus for a list of files on one node. Several
+ *     MLSTs are kept in flight at once, each on its own pooled session.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 count			the number of files									I
+ * 	 filePaths		the full paths to the files							I
+ * 	 stats			array of count entries receiving the details		O
+ * 	 results		array of count entries receiving the result
+ * 					for each file										O
+ *    
+ *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+ *            code of the first failure, described in errorMessage
+ ***********************************************************************/
+digs_error_code_t digs_statMany_globus(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results);
+
 ///***********************************************************************
 //* partially implemented get_list.
 // ***********************************************************************/
@@ -339,6 +452,46 @@ digs_error_code_t digs_getModificationTime_globus(char *errorMessage,
 digs_error_code_t digs_startPutTransfer_globus(char *errorMessage,
 		const char *localPath, const char *hostname, const char *SURL, int *handle);
 
+/***********************************************************************
+ *digs_error_code_t digs_startRelayTransfer_globus(char *errorMessage,
+ *		const char *fromHost, const char *fromSURL, const char *toHost,
+ *		const char *toSURL, int *handle);
+ *
+ * Start a copy of a file from one node to another, streamed through a 
+ * bounded set of buffers in this process rather than staged on local disk.
+ * The handle returned behaves like that of a put to toHost.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   fromHost  		the FQDN of the host to copy from          			I	
+ * 	 fromSURL 		the location of the file on fromHost				I	
+ *   toHost  		the FQDN of the host to copy to          			I	
+ * 	 toSURL 		the location to put the file on toHost				I	
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startRelayTransfer_globus(char *errorMessage,
+		const char *fromHost, const char *fromSURL, const char *toHost,
+		const char *toSURL, int *handle);
+
+/***********************************************************************
+ *char *digs_getRelayURL_globus(const char *hostname, const char *SURL);
+ *
+ * Gets the gsiftp URL of a file, for a node of another type to relay
+ * it to or from.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ *   hostname  		the FQDN of the host the file is on        			I	
+ * 	 SURL 			the location of the file on hostname				I	
+ *    
+ *   Returns: the URL, to be freed with globus_libc_free
+ ***********************************************************************/
+char *digs_getRelayURL_globus(const char *hostname, const char *SURL);
+
 /***********************************************************************
  *digs_error_code_t digs_startCopyToInbox_globus(char *errorMessage,
  *		const char *hostname, const char *localPath, , const char *lfn,
@@ -393,6 +546,49 @@ digs_error_code_t digs_startCopyToInbox_globus(char *errorMessage,
 digs_error_code_t digs_monitorTransfer_globus(char *errorMessage, int handle, 
 		digs_transfer_status_t *status, int *percentComplete);
 
+/***********************************************************************
+ *digs_error_code_t digs_getTransferProgress_globus(char *errorMessage,
+ *		int handle, long long *bytes);
+ * 
+ * Gets how many bytes of a file a transfer has moved so far, not
+ * counting any kept from an earlier attempt that it resumed.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 bytes			receives the number of bytes moved					O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferProgress_globus(char *errorMessage,
+		int handle, long long *bytes);
+
+/***********************************************************************
+ *digs_error_code_t digs_waitForTransfers_globus(char *errorMessage,
+ *		int *handles, int count, float timeOut, int *completed);
+ * 
+ * Blocks until at least one of several transfers, identified by their
+ * handles, has finished (successfully or not) or the time out expires.
+ * Lets a caller with many transfers outstanding sleep until there is
+ * something to do instead of polling each of them in turn.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handles 		the ids of the transfers							I
+ * 	 count 			the number of handles								I
+ * 	 timeOut 		the longest time to wait, in seconds				I
+ * 	 completed		index into handles of a finished transfer, or
+ * 					-1 if none finished before the time out				O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_waitForTransfers_globus(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed);
+
 /***********************************************************************
  * digs_error_code_t digs_endTransfer_globus(char *errorMessage, int handle)
  * 
@@ -412,6 +608,26 @@ digs_error_code_t digs_monitorTransfer_globus(char *errorMessage, int handle,
  ***********************************************************************/
 digs_error_code_t digs_endTransfer_globus(char *errorMessage, int handle);
 
+/***********************************************************************
+ * digs_error_code_t digs_getTransferChecksum_globus(char *errorMessage,
+ *		int handle, char **checksum);
+ * 
+ * Gets the MD5 checksum of the local file sent by a put that has
+ * finished, worked out from the data as it was sent.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 checksum		receives the checksum, to be freed with
+ * 					digs_free_string_globus								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferChecksum_globus(char *errorMessage,
+		int handle, char **checksum);
+
 /***********************************************************************
  * digs_error_code_t digs_cancelTransfer_globus(char *errorMessage, int handle)
  * 
@@ -492,6 +708,33 @@ digs_error_code_t digs_startGetTransfer_globus(char *errorMessage,
 		const char *hostname, const char *SURL, const char *localPath,
 		int *handle);
 
+/***********************************************************************
+ *digs_error_code_t digs_startGetRangeTransfer_globus(char *errorMessage,
+ *		const char *hostname, const char *SURL, const char *localPath,
+ *		long long offset, long long length, int *handle);
+ *
+ * Starts a get of part of a file (SURL) from a remote hostname, using a
+ * partial GridFTP get. The data is written into place in localPath,
+ * which must already exist. A handle is returned to uniquely identify
+ * this transfer.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 SURL 			the remote location to get the file from			I	
+ * 	 localPath 		the local file to write the range into				I
+ * 	 offset			where the range starts, in bytes					I
+ * 	 length			the length of the range, in bytes					I
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startGetRangeTransfer_globus(char *errorMessage,
+		const char *hostname, const char *SURL, const char *localPath,
+		long long offset, long long length, int *handle);
+
 /***********************************************************************
  * digs_error_code_t digs_mv_globus(char *errorMessage, const char *hostname, 
  * const char *filePathFrom, const char *filePathTo);
@@ -621,6 +864,31 @@ digs_error_code_t digs_copyFromInbox_globus(char *errorMessage,
 digs_error_code_t digs_scanNode_globus(char *errorMessage,
 		const char *hostname, char ***list, int *listLength, int allFiles);
 
+/***********************************************************************
+ * digs_error_code_t digs_scanNodeStream_globus(char *errorMessage,
+ * const char *hostname, int allFiles, digs_scan_callback_t callback,
+ * void *userData);
+ * 
+ * As digs_scanNode_globus, but each file is passed to the callback as
+ * soon as it is found. Several directories are listed at once, up to
+ * the node's 'scanlistings' property (default 4).
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 allFiles		Show all files or hide any temporary (locked files) I
+ * 	 callback		called with the full path of each file				I
+ * 	 userData		passed through to the callback						I
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful, or if the
+ *            callback stopped the scan).
+ ***********************************************************************/
+digs_error_code_t digs_scanNodeStream_globus(char *errorMessage,
+		const char *hostname, int allFiles, digs_scan_callback_t callback,
+		void *userData);
+
 /***********************************************************************
  * digs_error_code_t digs_scanInbox_globus(char *errorMessage, 
  * const char *hostname, char ***list, int *listLength, int allFiles);
@@ -0,0 +1,282 @@
+/***********************************************************************
+ *
+ *   Filename:   handletable.c
+ *
+ *   Authors:    DiGS developers        (digs)     EPCC.
+ *
+ *   Purpose:    Table mapping transfer handles to the structures that
+ *               the storage element adaptors keep for them
+ *
+ *   Contents:   Handle allocation, lookup and release
+ *
+ *   Used in:    Called by the Globus, SRM, OMERO and local SE adaptors
+ *
+ *   Contact:    epcc-support@epcc.ed.ac.uk
+ *
+ *   Copyright (c) 2026 The University of Edinburgh
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 2 of the
+ *   License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ *   MA 02111-1307, USA.
+ *
+ *   As a special exception, you may link this program with code
+ *   developed by the OGSA-DAI project without such code being covered
+ *   by the GNU General Public License.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+
+#include <globus_common.h>
+
+#include "handletable.h"
+#include "misc.h"
+
+#define HANDLE_INDEX_MASK       ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK  ((1 << HANDLE_GENERATION_BITS) - 1)
+
+typedef struct handleSlot_s {
+	/* Structure the handle refers to, NULL if the slot is free */
+	void * volatile object;
+
+	/* Adaptor which allocated the handle */
+	volatile int owner;
+
+	/* Bumped each time the slot is released */
+	volatile int generation;
+
+	/* Index of next free slot if this one is free, -1 at end of list */
+	int nextFree;
+} handleSlot_t;
+
+/*
+ * Chunks of slots. Entries are filled in order and never change once
+ * set, which is what lets lookups go ahead without the lock
+ */
+static handleSlot_t * volatile handleChunks_[HANDLE_MAX_CHUNKS];
+static int numHandleChunks_ = 0;
+
+/* First free slot, -1 if all allocated slots are in use */
+static int firstFreeHandle_ = -1;
+
+/* Protects allocation and release */
+static globus_mutex_t handleTableLock_;
+static int handleTableInitialised_ = 0;
+
+/*
+ * Returns the slot with the given index, NULL if its chunk hasn't been
+ * allocated yet
+ */
+static handleSlot_t *getHandleSlot(int index)
+{
+	handleSlot_t *chunk;
+
+	chunk = handleChunks_[index / HANDLE_CHUNK_SIZE];
+	if (chunk == NULL) {
+		return NULL;
+	}
+	return &chunk[index % HANDLE_CHUNK_SIZE];
+}
+
+/*
+ * Allocates another chunk of slots and puts them all on the free list.
+ * Caller must hold the table lock
+ *
+ * Returns 1 on success, 0 if the table can't grow any more
+ */
+static int addHandleChunk()
+{
+	handleSlot_t *chunk;
+	int base;
+	int i;
+
+	if (numHandleChunks_ >= HANDLE_MAX_CHUNKS) {
+		return 0;
+	}
+
+	chunk = globus_libc_malloc(HANDLE_CHUNK_SIZE * sizeof(handleSlot_t));
+	if (!chunk) {
+		errorExit("Out of memory in addHandleChunk");
+	}
+
+	base = numHandleChunks_ * HANDLE_CHUNK_SIZE;
+	for (i = 0; i < HANDLE_CHUNK_SIZE; i++) {
+		chunk[i].object = NULL;
+		chunk[i].owner = -1;
+		chunk[i].generation = 0;
+		chunk[i].nextFree = base + i + 1;
+	}
+	chunk[HANDLE_CHUNK_SIZE - 1].nextFree = firstFreeHandle_;
+
+	/* slots must be visible before the chunk pointer is */
+	__sync_synchronize();
+	handleChunks_[numHandleChunks_] = chunk;
+	numHandleChunks_++;
+
+	firstFreeHandle_ = base;
+	return 1;
+}
+
+/***********************************************************************
+*   int initTransferHandles()
+*
+*   Sets up the transfer handle table. Must be called once before any
+*   storage element is used
+*
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+int initTransferHandles()
+{
+	if (handleTableInitialised_) {
+		return 1;
+	}
+
+	if (globus_mutex_init(&handleTableLock_, NULL)) {
+		logMessage(ERROR, "Unable to initialise transfer handle table mutex");
+		return 0;
+	}
+	handleTableInitialised_ = 1;
+	return 1;
+}
+
+/***********************************************************************
+*   int allocateTransferHandle(int owner, void *object)
+*
+*   Gives out a new handle referring to object
+*
+*   Parameters:                                                  [I/O]
+*
+*     owner    adaptor the handle belongs to (enum in header)     I
+*     object   the adaptor's structure for the transfer. Must     I
+*              not be NULL
+*
+*   Returns: the new handle (never negative), -1 if the table is full
+***********************************************************************/
+int allocateTransferHandle(int owner, void *object)
+{
+	handleSlot_t *slot;
+	int index;
+	int handle;
+
+	globus_mutex_lock(&handleTableLock_);
+
+	if ((firstFreeHandle_ < 0) && (!addHandleChunk())) {
+		globus_mutex_unlock(&handleTableLock_);
+		logMessage(ERROR, "Too many transfers in progress, no handle free");
+		return -1;
+	}
+
+	index = firstFreeHandle_;
+	slot = getHandleSlot(index);
+	firstFreeHandle_ = slot->nextFree;
+
+	slot->owner = owner;
+	__sync_synchronize();
+	slot->object = object;
+
+	handle = (slot->generation << HANDLE_INDEX_BITS) | index;
+
+	globus_mutex_unlock(&handleTableLock_);
+	return handle;
+}
+
+/***********************************************************************
+*   void *lookupTransferHandle(int owner, int handle)
+*
+*   Finds the structure a handle refers to. Doesn't take any lock: the
+*   slot's generation is read before and after the rest of it, and if it
+*   changed in between the slot was released (and possibly reused) while
+*   it was being read, which makes the handle stale anyway
+*
+*   Parameters:                                                  [I/O]
+*
+*     owner    adaptor looking the handle up                      I
+*     handle   the handle                                         I
+*
+*   Returns: the structure, or NULL if the handle is invalid, stale or
+*            belongs to another adaptor
+***********************************************************************/
+void *lookupTransferHandle(int owner, int handle)
+{
+	handleSlot_t *slot;
+	void *object;
+	int generation;
+	int slotOwner;
+
+	if (handle < 0) {
+		return NULL;
+	}
+
+	slot = getHandleSlot(handle & HANDLE_INDEX_MASK);
+	if (slot == NULL) {
+		return NULL;
+	}
+
+	generation = slot->generation;
+	__sync_synchronize();
+	object = slot->object;
+	slotOwner = slot->owner;
+	__sync_synchronize();
+
+	if ((slot->generation != generation) ||
+	    (generation != ((handle >> HANDLE_INDEX_BITS) & HANDLE_GENERATION_MASK)) ||
+	    (slotOwner != owner)) {
+		return NULL;
+	}
+	return object;
+}
+
+/***********************************************************************
+*   void releaseTransferHandle(int owner, int handle)
+*
+*   Invalidates a handle so that its slot can be reused. Does nothing to
+*   the structure it referred to
+*
+*   Parameters:                                                  [I/O]
+*
+*     owner    adaptor the handle belongs to                      I
+*     handle   the handle                                         I
+*
+*   Returns: (void)
+***********************************************************************/
+void releaseTransferHandle(int owner, int handle)
+{
+	handleSlot_t *slot;
+	int index;
+
+	if (handle < 0) {
+		return;
+	}
+
+	index = handle & HANDLE_INDEX_MASK;
+
+	globus_mutex_lock(&handleTableLock_);
+
+	slot = getHandleSlot(index);
+	if ((slot == NULL) || (slot->object == NULL) || (slot->owner != owner) ||
+	    (slot->generation != ((handle >> HANDLE_INDEX_BITS) & HANDLE_GENERATION_MASK))) {
+		globus_mutex_unlock(&handleTableLock_);
+		logMessage(WARN, "Tried to release unknown transfer handle %d", handle);
+		return;
+	}
+
+	slot->object = NULL;
+	__sync_synchronize();
+	slot->generation = (slot->generation + 1) & HANDLE_GENERATION_MASK;
+
+	slot->nextFree = firstFreeHandle_;
+	firstFreeHandle_ = index;
+
+	globus_mutex_unlock(&handleTableLock_);
+}
@@ -0,0 +1,129 @@
+/***********************************************************************
+ *
+ *   Filename:   handletable.h
+ *
+ *   Authors:    DiGS developers        (digs)     EPCC.
+ *
+ *   Purpose:    Table mapping transfer handles to the structures that
+ *               the storage element adaptors keep for them
+ *
+ *   Contents:   Handle allocation, lookup and release
+ *
+ *   Used in:    Called by the Globus, SRM, OMERO and local SE adaptors
+ *
+ *   Contact:    epcc-support@epcc.ed.ac.uk
+ *
+ *   Copyright (c) 2026 The University of Edinburgh
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 2 of the
+ *   License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ *   MA 02111-1307, USA.
+ *
+ *   As a special exception, you may link this program with code
+ *   developed by the OGSA-DAI project without such code being covered
+ *   by the GNU General Public License.
+ *
+ ***********************************************************************/
+
+#ifndef _HANDLETABLE_H_
+#define _HANDLETABLE_H_
+
+/*
+ * A handle is the index of a slot in the table plus the generation of
+ * that slot when the handle was given out. The slot's generation is
+ * bumped every time it is released, so a handle kept after its transfer
+ * has ended no longer matches and is rejected rather than resolving to
+ * whatever transfer has reused the slot.
+ *
+ * The slots live in fixed size chunks which are never moved or freed,
+ * so a lookup is two array indexes and needs no lock. Allocating and
+ * releasing handles is serialised by a mutex inside the table.
+ *
+ * The table does nothing to keep the structures alive. Each adaptor
+ * has a lock of its own which it holds across a lookup and every use
+ * of what it found, and it releases a handle under that lock before
+ * freeing the structure, so that a transfer being ended on one thread
+ * can't be freed while another is still using it.
+ */
+#define HANDLE_INDEX_BITS       18
+#define HANDLE_GENERATION_BITS  12
+#define HANDLE_CHUNK_SIZE       1024
+#define HANDLE_MAX_CHUNKS       ((1 << HANDLE_INDEX_BITS) / HANDLE_CHUNK_SIZE)
+
+/*
+ * Which adaptor owns a handle. Each adaptor only resolves its own, so a
+ * handle passed to the wrong storage element is reported as unknown
+ */
+enum { HANDLE_OWNER_GLOBUS, HANDLE_OWNER_SRM, HANDLE_OWNER_OMERO,
+       HANDLE_OWNER_LOCAL };
+
+/***********************************************************************
+*   int initTransferHandles()
+*
+*   Sets up the transfer handle table. Must be called once before any
+*   storage element is used
+*
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+int initTransferHandles();
+
+/***********************************************************************
+*   int allocateTransferHandle(int owner, void *object)
+*
+*   Gives out a new handle referring to object
+*
+*   Parameters:                                                  [I/O]
+*
+*     owner    adaptor the handle belongs to (enum above)         I
+*     object   the adaptor's structure for the transfer. Must     I
+*              not be NULL
+*
+*   Returns: the new handle (never negative), -1 if the table is full
+***********************************************************************/
+int allocateTransferHandle(int owner, void *object);
+
+/***********************************************************************
+*   void *lookupTransferHandle(int owner, int handle)
+*
+*   Finds the structure a handle refers to. Nothing keeps it alive, so
+*   the caller must hold its adaptor's transfer lock from the lookup
+*   until it has finished with the structure
+*
+*   Parameters:                                                  [I/O]
+*
+*     owner    adaptor looking the handle up                      I
+*     handle   the handle                                         I
+*
+*   Returns: the structure, or NULL if the handle is invalid, stale or
+*            belongs to another adaptor
+***********************************************************************/
+void *lookupTransferHandle(int owner, int handle);
+
+/***********************************************************************
+*   void releaseTransferHandle(int owner, int handle)
+*
+*   Invalidates a handle so that its slot can be reused. Does nothing to
+*   the structure it referred to, which may be freed once the adaptor's
+*   transfer lock has been dropped after this
+*
+*   Parameters:                                                  [I/O]
+*
+*     owner    adaptor the handle belongs to                      I
+*     handle   the handle                                         I
+*
+*   Returns: (void)
+***********************************************************************/
+void releaseTransferHandle(int owner, int handle);
+
+#endif
@@ -0,0 +1,2297 @@
+/***********************************************************************
+ *
+ *   Filename:   local.c
+ *
+ *   Authors:    DiGS developers        (digs)     EPCC.
+ *
+ *   Purpose:    The local file system storage element adaptor
+ *
+ *   Contents:   Implementation of SE adaptor functions for storage
+ *               mounted on this machine
+ *
+ *   Used in:    Control thread, clients
+ *
+ *   Contact:    epcc-support@epcc.ed.ac.uk
+ *
+ *   Copyright (c) 2026 The University of Edinburgh
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 2 of the
+ *   License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ *   MA 02111-1307, USA.
+ *
+ *   As a special exception, you may link this program with code
+ *   developed by the OGSA-DAI project without such code being covered
+ *   by the GNU General Public License.
+ *
+ ***********************************************************************/
+/*
+ * A local node's path is a directory on this machine, typically on a
+ * parallel file system shared with the rest of the cluster, so its
+ * SURLs are ordinary file names and everything is done with system
+ * calls instead of through GridFTP.
+ *
+ * Transfers and checksums each run in a thread of their own so that
+ * they can be started, monitored and waited for like any other
+ * adaptor's. Copies are cloned (reflinked) where the file system can,
+ * and otherwise done in the kernel with copy_file_range, falling back
+ * to read and write if neither is available.
+ */
+
+/* for copy_file_range, statx and the FICLONE ioctl */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <globus_common.h>
+
+#include "local.h"
+#include "misc.h"
+#include "node.h"
+#include "md5.h"
+#include "handletable.h"
+
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+/*
+ * Largest amount copied by one copy_file_range call, so that a
+ * cancellation is noticed between calls
+ */
+#define LOCAL_COPY_CHUNK (64 * 1048576)
+
+/* Size of the buffer used to read files for checksums and plain copies */
+#define LOCAL_IO_BUFFER_SIZE 1048576
+
+/* Kinds of operation a local transfer can be */
+enum { LOCAL_COPY, LOCAL_CHECKSUM };
+
+/*
+ * A copy or checksum running in its own thread. The thread owns the
+ * structure until it sets 'done'; after that only the thread that
+ * started the operation touches it
+ */
+typedef struct localTransfer_s {
+	/* Handle of the operation */
+	int id;
+
+	int kind;
+
+	/*
+	 * File being read and, for a copy, the name it ends up under. A
+	 * copy is written to destination-LOCKED and only renamed when
+	 * digs_endTransfer_local is called
+	 */
+	char *source;
+	char *destination;
+	char *lockedPath;
+
+	/* Whether to check the copy's checksum against the source's */
+	int verify;
+
+	/* Length of the source and how much has been copied so far */
+	long long length;
+	long long copied;
+
+	/* Set to make the thread give up as soon as it can */
+	int cancelled;
+
+	/*
+	 * Set once the thread has finished, and whether it succeeded. If
+	 * not, 'error' is the errno of the failure, or 0 if a copy didn't
+	 * match its source
+	 */
+	int done;
+	int succeeded;
+	int error;
+
+	/* Result of a checksum, uppercase hex */
+	char checksum[CHECKSUM_LENGTH + 1];
+} localTransfer_t;
+
+/*
+ * Protects the 'done', 'succeeded', 'error', 'cancelled' and 'copied'
+ * fields of all transfers. localTransferDone_ is broadcast whenever a
+ * transfer finishes
+ */
+static globus_mutex_t localTransferLock_;
+static globus_cond_t localTransferDone_;
+
+/***********************************************************************
+*   int startupLocalStorage()
+*
+*   Sets up the local storage adaptor. Must be called once before any
+*   local storage element is used
+*
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+int startupLocalStorage()
+{
+	if (globus_mutex_init(&localTransferLock_, NULL)) {
+		logMessage(ERROR, "Unable to initialise local transfer mutex");
+		return 0;
+	}
+
+	if (globus_cond_init(&localTransferDone_, NULL)) {
+		logMessage(ERROR, "Unable to initialise local transfer condition variable");
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Turns the errno from a failed system call into a DiGS error code, and
+ * describes it in errorMessage
+ */
+static digs_error_code_t localError(char *errorMessage, int err,
+		const char *operation, const char *filePath)
+{
+	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "%s %s: %s", operation,
+			filePath, strerror(err));
+
+	switch (err) {
+	case ENOENT:
+	case ENOTDIR:
+		return DIGS_FILE_NOT_FOUND;
+	case EISDIR:
+		return DIGS_FILE_IS_DIR;
+	case EACCES:
+	case EPERM:
+	case EROFS:
+		return DIGS_AUTH_FAILED;
+	case EEXIST:
+	case ENOTEMPTY:
+	case ENOSPC:
+	case EDQUOT:
+	case EIO:
+		return DIGS_UNSPECIFIED_SERVER_ERROR;
+	default:
+		return DIGS_UNKNOWN_ERROR;
+	}
+}
+
+/*
+ * Gets a file's metadata. Uses statx where available, asking only for
+ * the fields DiGS uses, which saves parallel file systems from having
+ * to gather the rest. Returns 0 on success or an errno
+ */
+static int statLocalFile(const char *filePath, struct stat *st)
+{
+#ifdef STATX_BASIC_STATS
+	struct statx stx;
+
+	if (statx(AT_FDCWD, filePath, 0, STATX_TYPE | STATX_MODE | STATX_UID |
+			STATX_GID | STATX_SIZE | STATX_MTIME, &stx) == 0) {
+		memset(st, 0, sizeof(struct stat));
+		st->st_mode = stx.stx_mode;
+		st->st_uid = stx.stx_uid;
+		st->st_gid = stx.stx_gid;
+		st->st_size = stx.stx_size;
+		st->st_mtime = stx.stx_mtime.tv_sec;
+		return 0;
+	}
+	if (errno != ENOSYS) {
+		return errno;
+	}
+#endif
+	if (stat(filePath, st) < 0) {
+		return errno;
+	}
+	return 0;
+}
+
+/*
+ * Returns the name of a user or group as a new string, or its number if
+ * it has no name
+ */
+static char *getUserName(uid_t uid)
+{
+	struct passwd pw;
+	struct passwd *result;
+	char buffer[1024];
+	char *name;
+
+	if ((getpwuid_r(uid, &pw, buffer, sizeof(buffer), &result) == 0) &&
+			(result != NULL)) {
+		name = safe_strdup(pw.pw_name);
+	} else if (safe_asprintf(&name, "%d", (int)uid) < 0) {
+		name = NULL;
+	}
+	if (!name) {
+		errorExit("Out of memory in getUserName");
+	}
+	return name;
+}
+
+static char *getGroupName(gid_t gid)
+{
+	struct group gr;
+	struct group *result;
+	char buffer[1024];
+	char *name;
+
+	if ((getgrgid_r(gid, &gr, buffer, sizeof(buffer), &result) == 0) &&
+			(result != NULL)) {
+		name = safe_strdup(gr.gr_name);
+	} else if (safe_asprintf(&name, "%d", (int)gid) < 0) {
+		name = NULL;
+	}
+	if (!name) {
+		errorExit("Out of memory in getGroupName");
+	}
+	return name;
+}
+
+/*
+ * Returns a file's permissions in the same form as the GridFTP adaptor
+ * (e.g. "0644") as a new string
+ */
+static char *formatPermissions(mode_t mode)
+{
+	char *permissions;
+
+	if (safe_asprintf(&permissions, "%04o", (unsigned int)(mode & 07777)) < 0) {
+		errorExit("Out of memory in formatPermissions");
+	}
+	return permissions;
+}
+
+/*
+ * Computes the MD5 checksum of a local file, in uppercase hex. Gives up
+ * if *cancelled is set while it's reading. Returns 0 on success or an
+ * errno
+ */
+static int checksumLocalFile(const char *filePath,
+		char checksum[CHECKSUM_LENGTH + 1], int *cancelled)
+{
+	md5_state_t md5State;
+	md5_byte_t digest[16];
+	char *buffer;
+	ssize_t n;
+	int fd;
+	int i;
+
+	fd = open(filePath, O_RDONLY);
+	if (fd < 0) {
+		return errno;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	buffer = globus_libc_malloc(LOCAL_IO_BUFFER_SIZE);
+	if (!buffer) {
+		errorExit("Out of memory in checksumLocalFile");
+	}
+
+	md5_init(&md5State);
+	while ((n = read(fd, buffer, LOCAL_IO_BUFFER_SIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			i = errno;
+			globus_libc_free(buffer);
+			close(fd);
+			return i;
+		}
+		if ((cancelled) && (*cancelled)) {
+			globus_libc_free(buffer);
+			close(fd);
+			return ECANCELED;
+		}
+		md5_append(&md5State, (md5_byte_t *)buffer, (int)n);
+	}
+	md5_finish(&md5State, digest);
+
+	globus_libc_free(buffer);
+	close(fd);
+
+	for (i = 0; i < 16; i++) {
+		sprintf(&checksum[i * 2], "%02X", digest[i]);
+	}
+	return 0;
+}
+
+/*
+ * Copies what's left of one open file to another with read and write
+ */
+static int copyLocalFileData(localTransfer_t *t, int in, int out)
+{
+	char *buffer;
+	ssize_t n, written, w;
+	int err = 0;
+
+	buffer = globus_libc_malloc(LOCAL_IO_BUFFER_SIZE);
+	if (!buffer) {
+		errorExit("Out of memory in copyLocalFileData");
+	}
+
+	while ((n = read(in, buffer, LOCAL_IO_BUFFER_SIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = errno;
+			break;
+		}
+		for (written = 0; written < n; written += w) {
+			w = write(out, buffer + written, n - written);
+			if (w < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				err = errno;
+				break;
+			}
+		}
+		if (err) {
+			break;
+		}
+
+		globus_mutex_lock(&localTransferLock_);
+		t->copied += n;
+		if (t->cancelled) {
+			err = ECANCELED;
+		}
+		globus_mutex_unlock(&localTransferLock_);
+		if (err) {
+			break;
+		}
+	}
+
+	globus_libc_free(buffer);
+	return err;
+}
+
+/*
+ * Copies a transfer's source to its locked path, as cheaply as the file
+ * system allows. Returns 0 on success or an errno
+ */
+static int copyLocalFile(localTransfer_t *t)
+{
+	int in, out;
+	int err = 0;
+
+	in = open(t->source, O_RDONLY);
+	if (in < 0) {
+		return errno;
+	}
+	out = open(t->lockedPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		err = errno;
+		close(in);
+		return err;
+	}
+
+#ifdef FICLONE
+	/* on a copy-on-write file system this shares the blocks instantly */
+	if (ioctl(out, FICLONE, in) == 0) {
+		globus_mutex_lock(&localTransferLock_);
+		t->copied = t->length;
+		globus_mutex_unlock(&localTransferLock_);
+		close(in);
+		close(out);
+		return 0;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	for (;;) {
+		ssize_t n;
+
+		n = copy_file_range(in, NULL, out, NULL, LOCAL_COPY_CHUNK, 0);
+		if (n == 0) {
+			break;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* not supported here: copy the rest the slow way */
+			if ((errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) ||
+					(errno == EOPNOTSUPP)) {
+				err = copyLocalFileData(t, in, out);
+			} else {
+				err = errno;
+			}
+			break;
+		}
+
+		globus_mutex_lock(&localTransferLock_);
+		t->copied += n;
+		if (t->cancelled) {
+			err = ECANCELED;
+		}
+		globus_mutex_unlock(&localTransferLock_);
+		if (err) {
+			break;
+		}
+	}
+#else
+	err = copyLocalFileData(t, in, out);
+#endif
+
+	/* the file must be on disk before it is renamed into place */
+	if ((!err) && (fsync(out) < 0) && (errno != EINVAL)) {
+		err = errno;
+	}
+
+	close(in);
+	if ((close(out) < 0) && (!err)) {
+		err = errno;
+	}
+	return err;
+}
+
+/*
+ * Body of the thread running a local transfer or checksum
+ */
+static void *localTransferThread(void *arg)
+{
+	localTransfer_t *t = (localTransfer_t *)arg;
+	char copyChecksum[CHECKSUM_LENGTH + 1];
+	int err;
+
+	if (t->kind == LOCAL_CHECKSUM) {
+		err = checksumLocalFile(t->source, t->checksum, &t->cancelled);
+	} else {
+		err = copyLocalFile(t);
+
+		if ((!err) && (t->verify)) {
+			err = checksumLocalFile(t->source, t->checksum, &t->cancelled);
+			if (!err) {
+				err = checksumLocalFile(t->lockedPath, copyChecksum,
+						&t->cancelled);
+			}
+			if ((!err) && (strcmp(t->checksum, copyChecksum))) {
+				logMessage(WARN, "Copy of %s to %s doesn't match (%s, %s)",
+						t->source, t->lockedPath, t->checksum, copyChecksum);
+				err = -1;
+			}
+		}
+	}
+
+	globus_mutex_lock(&localTransferLock_);
+	t->succeeded = (err == 0);
+	t->error = (err > 0) ? err : 0;
+	t->done = 1;
+	globus_cond_broadcast(&localTransferDone_);
+	globus_mutex_unlock(&localTransferLock_);
+
+	return NULL;
+}
+
+/*
+ * Frees a transfer. Must only be called once its thread has finished and
+ * its handle has been released
+ */
+static void destroyLocalTransfer(localTransfer_t *t)
+{
+	globus_libc_free(t->source);
+	if (t->destination) {
+		globus_libc_free(t->destination);
+	}
+	if (t->lockedPath) {
+		globus_libc_free(t->lockedPath);
+	}
+	globus_libc_free(t);
+}
+
+/*
+ * Starts a copy or checksum of a file in a thread of its own. For a copy
+ * the file is written to destination-LOCKED
+ */
+static digs_error_code_t startLocalTransfer(char *errorMessage, int kind,
+		const char *hostname, const char *source, const char *destination,
+		int *handle)
+{
+	localTransfer_t *t;
+	globus_thread_t thread;
+	struct stat st;
+	char *prop;
+	int err;
+
+	*handle = -1;
+	errorMessage[0] = '\0';
+
+	err = statLocalFile(source, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't read", source);
+	}
+	if (S_ISDIR(st.st_mode)) {
+		strncpy(errorMessage, "Expected a file but found a directory.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_FILE_IS_DIR;
+	}
+
+	t = globus_libc_malloc(sizeof(localTransfer_t));
+	if (!t) {
+		errorExit("Out of memory in startLocalTransfer");
+	}
+	t->kind = kind;
+	t->source = safe_strdup(source);
+	t->destination = NULL;
+	t->lockedPath = NULL;
+	if (!t->source) {
+		errorExit("Out of memory in startLocalTransfer");
+	}
+	if (destination) {
+		t->destination = safe_strdup(destination);
+		if ((!t->destination) ||
+				(safe_asprintf(&t->lockedPath, "%s-LOCKED", destination) < 0)) {
+			errorExit("Out of memory in startLocalTransfer");
+		}
+	}
+
+	/* copies are checked against the source unless the node says not to */
+	t->verify = 1;
+	prop = getNodeProperty(hostname, "verifycopies");
+	if (prop) {
+		t->verify = atoi(prop);
+		globus_libc_free(prop);
+	}
+
+	t->length = (long long)st.st_size;
+	t->copied = 0;
+	t->cancelled = 0;
+	t->done = 0;
+	t->succeeded = 0;
+	t->error = 0;
+	t->checksum[0] = '\0';
+
+	t->id = allocateTransferHandle(HANDLE_OWNER_LOCAL, t);
+	if (t->id < 0) {
+		t->id = -1;
+		destroyLocalTransfer(t);
+		strncpy(errorMessage, "Too many transfers in progress.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	if (globus_thread_create(&thread, NULL, localTransferThread, t) != 0) {
+		/* the handle hasn't been given out yet */
+		releaseTransferHandle(HANDLE_OWNER_LOCAL, t->id);
+		destroyLocalTransfer(t);
+		strncpy(errorMessage, "Could not start transfer thread.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	*handle = t->id;
+	return DIGS_SUCCESS;
+}
+
+/*
+ * Finds a local transfer from its handle. Caller must hold
+ * localTransferLock_, and only use the transfer until releasing it
+ */
+static localTransfer_t *findLocalTransfer(char *errorMessage, int handle)
+{
+	localTransfer_t *t;
+
+	t = lookupTransferHandle(HANDLE_OWNER_LOCAL, handle);
+	if (t == NULL) {
+		strncpy(errorMessage, "Couldn't find the transfer.",
+				MAX_ERROR_MESSAGE_LENGTH);
+	}
+	return t;
+}
+
+/*
+ * Finds a local transfer from its handle and releases the handle, so
+ * that no other thread can find it and the caller can end it and free it
+ */
+static localTransfer_t *claimLocalTransfer(char *errorMessage, int handle)
+{
+	localTransfer_t *t;
+
+	globus_mutex_lock(&localTransferLock_);
+	t = findLocalTransfer(errorMessage, handle);
+	if (t) {
+		releaseTransferHandle(HANDLE_OWNER_LOCAL, handle);
+	}
+	globus_mutex_unlock(&localTransferLock_);
+	return t;
+}
+
+/*
+ * Stops a transfer's thread, if it's still running, and waits for it to
+ * finish
+ */
+static void stopLocalTransfer(localTransfer_t *t)
+{
+	globus_mutex_lock(&localTransferLock_);
+	t->cancelled = 1;
+	while (!t->done) {
+		globus_cond_wait(&localTransferDone_, &localTransferLock_);
+	}
+	globus_mutex_unlock(&localTransferLock_);
+}
+
+/*
+ * The error a finished transfer failed with
+ */
+static digs_error_code_t getLocalTransferError(char *errorMessage,
+		localTransfer_t *t)
+{
+	if (t->error == 0) {
+		strncpy(errorMessage,
+				"The checksums of the local and remote files do not match.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_INVALID_CHECKSUM;
+	}
+	return localError(errorMessage, t->error,
+			(t->kind == LOCAL_CHECKSUM) ? "Can't checksum" : "Can't copy",
+			t->source);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getLength_local(char *errorMessage, const char *filePath,
+*           const char *hostname, long long int *fileLength)
+*
+*   Gets the size of a file in bytes
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     fileLength      Size of the file (-1 on error)            O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getLength_local(char *errorMessage, const char *filePath,
+		const char *hostname, long long int *fileLength)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*fileLength = -1;
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+	if (S_ISDIR(st.st_mode)) {
+		return DIGS_FILE_IS_DIR;
+	}
+
+	*fileLength = (long long int)st.st_size;
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getChecksum_local(char *errorMessage,
+*           const char *filePath, const char *hostname, char **fileChecksum,
+*           digs_checksum_type_t checksumType)
+*
+*   Computes the MD5 checksum of a file by reading it, and waits for
+*   the result
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     fileChecksum    The checksum, in uppercase hex. To be     O
+*                     freed with digs_free_string_local
+*     checksumType    Must be DIGS_MD5_CHECKSUM                 I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getChecksum_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **fileChecksum,
+		digs_checksum_type_t checksumType)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*fileChecksum = NULL;
+
+	logMessage(DEBUG, "digs_getChecksum_local(%s,%s)", filePath, hostname);
+
+	if (checksumType != DIGS_MD5_CHECKSUM) {
+		strncpy(errorMessage, "Only the MD5 checksum algorithm is supported.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNSUPPORTED_CHECKSUM_TYPE;
+	}
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+	if (S_ISDIR(st.st_mode)) {
+		return DIGS_FILE_IS_DIR;
+	}
+
+	*fileChecksum = globus_libc_malloc(CHECKSUM_LENGTH + 1);
+	if (!*fileChecksum) {
+		errorExit("Out of memory in digs_getChecksum_local");
+	}
+
+	err = checksumLocalFile(filePath, *fileChecksum, NULL);
+	if (err) {
+		globus_libc_free(*fileChecksum);
+		*fileChecksum = NULL;
+		return localError(errorMessage, err, "Can't checksum", filePath);
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_startChecksum_local(char *errorMessage,
+*           const char *filePath, const char *hostname,
+*           digs_checksum_type_t checksumType, long long int fileLength,
+*           int *handle)
+*
+*   Starts computing the MD5 checksum of a file in a thread of its
+*   own. The result is collected with digs_endChecksum_local
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     checksumType    Must be DIGS_MD5_CHECKSUM                 I
+*     fileLength      Not used                                  I
+*     handle          Handle of the checksum (-1 on error)      O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_startChecksum_local(char *errorMessage,
+		const char *filePath, const char *hostname,
+		digs_checksum_type_t checksumType, long long int fileLength,
+		int *handle)
+{
+	*handle = -1;
+	if (checksumType != DIGS_MD5_CHECKSUM) {
+		strncpy(errorMessage, "Only the MD5 checksum algorithm is supported.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_UNSUPPORTED_CHECKSUM_TYPE;
+	}
+
+	return startLocalTransfer(errorMessage, LOCAL_CHECKSUM, hostname,
+			filePath, NULL, handle);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_monitorChecksum_local(char *errorMessage, int handle,
+*           digs_transfer_status_t *status)
+*
+*   Checks how far a checksum started by digs_startChecksum_local
+*   has got
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handle          Handle of the checksum                    I
+*     status          Whether it is in progress, done or failed O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful). A checksum
+*            that failed returns the reason it failed
+***********************************************************************/
+digs_error_code_t digs_monitorChecksum_local(char *errorMessage, int handle,
+		digs_transfer_status_t *status)
+{
+	int percentComplete;
+
+	return digs_monitorTransfer_local(errorMessage, handle, status,
+			&percentComplete);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_endChecksum_local(char *errorMessage, int handle,
+*           char **fileChecksum)
+*
+*   Collects the result of a checksum and frees its handle. A
+*   checksum that hasn't finished is stopped
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handle          Handle of the checksum                    I
+*     fileChecksum    The checksum, in uppercase hex. To be     O
+*                     freed with digs_free_string_local
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_endChecksum_local(char *errorMessage, int handle,
+		char **fileChecksum)
+{
+	localTransfer_t *t;
+	digs_error_code_t result = DIGS_SUCCESS;
+	int done;
+
+	errorMessage[0] = '\0';
+	*fileChecksum = NULL;
+
+	t = claimLocalTransfer(errorMessage, handle);
+	if (!t) {
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	globus_mutex_lock(&localTransferLock_);
+	done = t->done;
+	globus_mutex_unlock(&localTransferLock_);
+
+	if (!done) {
+		stopLocalTransfer(t);
+		strncpy(errorMessage, "The checksum had not finished.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		result = DIGS_UNKNOWN_ERROR;
+	} else if (t->succeeded) {
+		*fileChecksum = safe_strdup(t->checksum);
+		if (!*fileChecksum) {
+			errorExit("Out of memory in digs_endChecksum_local");
+		}
+	} else {
+		result = getLocalTransferError(errorMessage, t);
+	}
+
+	destroyLocalTransfer(t);
+	return result;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_doesExist_local(char *errorMessage,
+*           const char *filePath, const char *hostname, int *doesExist)
+*
+*   Checks whether a file or directory exists
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     doesExist       1 if it exists, 0 if not                  O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_doesExist_local(char *errorMessage,
+		const char *filePath, const char *hostname, int *doesExist)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*doesExist = 0;
+
+	err = statLocalFile(filePath, &st);
+	if ((err == ENOENT) || (err == ENOTDIR)) {
+		return DIGS_SUCCESS;
+	}
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	*doesExist = 1;
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_isDirectory_local(char *errorMessage,
+*           const char *filePath, const char *hostname, int *isDirectory)
+*
+*   Checks whether a path is a directory
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     isDirectory     1 if it is a directory, 0 if not          O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_isDirectory_local(char *errorMessage,
+		const char *filePath, const char *hostname, int *isDirectory)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*isDirectory = 0;
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	*isDirectory = S_ISDIR(st.st_mode) ? 1 : 0;
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   void digs_free_string_local(char **string)
+*
+*   Frees a string returned by this adaptor and sets it to NULL
+*
+*   Parameters:                                               [I/O]
+*
+*     string          The string to free                        I/O
+*
+*   Returns: (void)
+***********************************************************************/
+void digs_free_string_local(char **string)
+{
+	if (*string) {
+		globus_libc_free(*string);
+	}
+	*string = NULL;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getOwner_local(char *errorMessage,
+*           const char *filePath, const char *hostname, char **ownerName)
+*
+*   Gets the name of a file's owner, or their number if they have
+*   no name on this machine
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     ownerName       The owner. To be freed with               O
+*                     digs_free_string_local
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getOwner_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **ownerName)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*ownerName = NULL;
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	*ownerName = getUserName(st.st_uid);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getGroup_local(char *errorMessage,
+*           const char *filePath, const char *hostname, char **groupName)
+*
+*   Gets the name of a file's group, or its number if it has no
+*   name on this machine
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     groupName       The group. To be freed with               O
+*                     digs_free_string_local
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getGroup_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **groupName)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*groupName = NULL;
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	*groupName = getGroupName(st.st_gid);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_setGroup_local(char *errorMessage,
+*           const char *filePath, const char *hostname, const char *groupName)
+*
+*   Changes the group of a file
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     groupName       Name of the new group                     I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_setGroup_local(char *errorMessage,
+		const char *filePath, const char *hostname, const char *groupName)
+{
+	struct group gr;
+	struct group *result;
+	char buffer[1024];
+
+	errorMessage[0] = '\0';
+
+	if ((getgrnam_r(groupName, &gr, buffer, sizeof(buffer), &result) != 0) ||
+			(result == NULL)) {
+		snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Unknown group %s",
+				groupName);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	if (chown(filePath, (uid_t)-1, gr.gr_gid) < 0) {
+		return localError(errorMessage, errno, "Can't change group of",
+				filePath);
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getPermissions_local(char *errorMessage,
+*           const char *filePath, const char *hostname, char **permissions)
+*
+*   Gets the permissions of a file as an octal string, such as
+*   "0644"
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     permissions     The permissions. To be freed with         O
+*                     digs_free_string_local
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getPermissions_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **permissions)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	*permissions = NULL;
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	*permissions = formatPermissions(st.st_mode);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_setPermissions_local(char *errorMessage,
+*           const char *filePath, const char *hostname, const char *permissions)
+*
+*   Changes the permissions of a file
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     permissions     Octal string such as "0644"               I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_setPermissions_local(char *errorMessage,
+		const char *filePath, const char *hostname, const char *permissions)
+{
+	char *end;
+	long mode;
+
+	errorMessage[0] = '\0';
+
+	mode = strtol(permissions, &end, 8);
+	if ((*end) || (mode < 0) || (mode > 07777)) {
+		snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+				"Invalid permissions %s", permissions);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	if (chmod(filePath, (mode_t)mode) < 0) {
+		return localError(errorMessage, errno, "Can't change permissions of",
+				filePath);
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getModificationTime_local(char *errorMessage,
+*           const char *filePath, const char *hostname, time_t *modificationTime)
+*
+*   Gets the time a file was last modified
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     modificationTime  The modification time                   O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getModificationTime_local(char *errorMessage,
+		const char *filePath, const char *hostname, time_t *modificationTime)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	*modificationTime = st.st_mtime;
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_stat_local(char *errorMessage, const char *filePath,
+*           const char *hostname, digs_stat_t *stat)
+*
+*   Gets all of a file's metadata with a single stat
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     filePath        Full path of the file                     I
+*     hostname        Node the file is on                       I
+*     stat            The metadata. To be freed with            O
+*                     digs_freeStat
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_stat_local(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat)
+{
+	struct stat st;
+	int err;
+
+	errorMessage[0] = '\0';
+	digs_initStat(stat);
+
+	err = statLocalFile(filePath, &st);
+	if (err) {
+		return localError(errorMessage, err, "Can't stat", filePath);
+	}
+
+	stat->isDirectory = S_ISDIR(st.st_mode) ? 1 : 0;
+	stat->size = (long long int)st.st_size;
+	stat->modificationTime = st.st_mtime;
+	stat->owner = getUserName(st.st_uid);
+	stat->group = getGroupName(st.st_gid);
+	stat->permissions = formatPermissions(st.st_mode);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_statMany_local(char *errorMessage,
+*           const char *hostname, int count, const char **filePaths,
+*           digs_stat_t *stats, digs_error_code_t *results)
+*
+*   Gets the metadata of several files at once. Each file's own
+*   result is in results; errorMessage describes the first failure
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     count           Number of files                           I
+*     filePaths       Full paths of the files                   I
+*     stats           The metadata of each file                 O
+*     results         Result of each file's stat                O
+*
+*   Returns: DIGS_SUCCESS
+***********************************************************************/
+digs_error_code_t digs_statMany_local(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results)
+{
+	char fileError[MAX_ERROR_MESSAGE_LENGTH];
+	int i;
+
+	errorMessage[0] = '\0';
+
+	for (i = 0; i < count; i++) {
+		results[i] = digs_stat_local(fileError, filePaths[i], hostname,
+				&stats[i]);
+		if ((results[i] != DIGS_SUCCESS) && (errorMessage[0] == '\0')) {
+			strncpy(errorMessage, fileError, MAX_ERROR_MESSAGE_LENGTH);
+		}
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   char *substituteSlashes(char *filename)
+*
+*   Utility function to replace all the slashes (directory separators)
+*   in a filename with the sequence '-DIR-'. This is done to avoid
+*   maintaining a complex, globally-writable directory hierarchy within
+*   the 'NEW' directory.
+*
+*   Parameters:                                    [I/O]
+*
+*     filename pointer to the filename to process   I
+*
+*   Returns: pointer to the processed filename. Should be freed by the
+*            caller. Returns NULL on error.
+***********************************************************************/
+static char *substituteSlashes(const char *filename)
+{
+	char *newFilename;
+	int i, j;
+
+	newFilename = globus_libc_malloc(5 * strlen(filename) + 1);
+	if (!newFilename) {
+		errorExit("Out of memory in substituteSlashes");
+	}
+
+	for (i = 0, j = 0; filename[i]; i++) {
+		if (filename[i] == '/') {
+			memcpy(&newFilename[j], "-DIR-", 5);
+			j += 5;
+		} else {
+			newFilename[j++] = filename[i];
+		}
+	}
+	newFilename[j] = 0;
+	return newFilename;
+}
+
+/*
+ * Works out where a file with the given LFN lives in a node's inbox
+ */
+static digs_error_code_t getInboxPath(const char *hostname, const char *lfn,
+		char **inboxPath)
+{
+	char *inbox;
+	char *flatFilename;
+
+	inbox = getNodeInbox(hostname);
+	if (inbox == NULL) {
+		/* This storage element doesn't have an inbox. */
+		return DIGS_NO_INBOX;
+	}
+
+	flatFilename = substituteSlashes(lfn);
+	if (safe_asprintf(inboxPath, "%s/%s", inbox, flatFilename) < 0) {
+		errorExit("Out of memory in getInboxPath");
+	}
+	globus_libc_free(flatFilename);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_startPutTransfer_local(char *errorMessage,
+*           const char *hostname, const char *localPath, const char *SURL,
+*           int *handle)
+*
+*   Starts copying a file from local disk onto the node. The copy
+*   is written to SURL-LOCKED and renamed by digs_endTransfer_local
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     localPath       File to copy                              I
+*     SURL            Where to put it on the node               I
+*     handle          Handle of the transfer (-1 on error)      O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_startPutTransfer_local(char *errorMessage,
+		const char *hostname, const char *localPath, const char *SURL,
+		int *handle)
+{
+	logMessage(DEBUG, "digs_startPutTransfer_local(%s,%s,%s)", localPath,
+			hostname, SURL);
+
+	return startLocalTransfer(errorMessage, LOCAL_COPY, hostname, localPath,
+			SURL, handle);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_startCopyToInbox_local(char *errorMessage,
+*           const char *hostname, const char *localPath, const char *lfn,
+*           int *handle)
+*
+*   Starts copying a file from local disk into the node's inbox
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     localPath       File to copy                              I
+*     lfn             Logical filename it is to have            I
+*     handle          Handle of the transfer (-1 on error)      O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful).
+*            DIGS_NO_INBOX if the node has no inbox
+***********************************************************************/
+digs_error_code_t digs_startCopyToInbox_local(char *errorMessage,
+		const char *hostname, const char *localPath, const char *lfn,
+		int *handle)
+{
+	digs_error_code_t result;
+	char *inboxPath;
+
+	*handle = -1;
+	errorMessage[0] = '\0';
+
+	result = getInboxPath(hostname, lfn, &inboxPath);
+	if (result != DIGS_SUCCESS) {
+		return result;
+	}
+
+	result = startLocalTransfer(errorMessage, LOCAL_COPY, hostname, localPath,
+			inboxPath, handle);
+	globus_libc_free(inboxPath);
+	return result;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_startGetTransfer_local(char *errorMessage,
+*           const char *hostname, const char *SURL, const char *localPath,
+*           int *handle)
+*
+*   Starts copying a file from the node to local disk
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     SURL            File to copy                              I
+*     localPath       Where to put it                           I
+*     handle          Handle of the transfer (-1 on error)      O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_startGetTransfer_local(char *errorMessage,
+		const char *hostname, const char *SURL, const char *localPath,
+		int *handle)
+{
+	logMessage(DEBUG, "digs_startGetTransfer_local(%s,%s,%s)", SURL,
+			hostname, localPath);
+
+	return startLocalTransfer(errorMessage, LOCAL_COPY, hostname, SURL,
+			localPath, handle);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_startRelayTransfer_local(char *errorMessage,
+*           const char *fromHost, const char *fromSURL, const char *toHost,
+*           const char *toSURL, int *handle)
+*
+*   Starts copying a file between two local nodes. Both are mounted
+*   here, so this is an ordinary copy
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     fromHost        Node the file is on                       I
+*     fromSURL        File to copy                              I
+*     toHost          Node to copy it to                        I
+*     toSURL          Where to put it                           I
+*     handle          Handle of the transfer (-1 on error)      O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_startRelayTransfer_local(char *errorMessage,
+		const char *fromHost, const char *fromSURL, const char *toHost,
+		const char *toSURL, int *handle)
+{
+	logMessage(DEBUG, "digs_startRelayTransfer_local(%s,%s,%s,%s)", fromHost,
+			fromSURL, toHost, toSURL);
+
+	/* both nodes are mounted here, so this is just a copy */
+	return startLocalTransfer(errorMessage, LOCAL_COPY, toHost, fromSURL,
+			toSURL, handle);
+}
+
+/***********************************************************************
+*   char *digs_getRelayURL_local(const char *hostname, const char *SURL)
+*
+*   Gets the URL of a file, for a node of another type to relay it to
+*   or from. The node is mounted here, so it is a file URL
+*
+*   Parameters:                                               [I/O]
+*
+*     hostname        Node the file is on                       I
+*     SURL            The file                                  I
+*
+*   Returns: the URL, to be freed with globus_libc_free
+***********************************************************************/
+char *digs_getRelayURL_local(const char *hostname, const char *SURL)
+{
+	char *url;
+
+	if (safe_asprintf(&url, "file://%s", SURL) < 0) {
+		errorExit("Out of memory in digs_getRelayURL_local");
+	}
+	return url;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_monitorTransfer_local(char *errorMessage, int handle,
+*           digs_transfer_status_t *status, int *percentComplete)
+*
+*   Checks how far a transfer has got. percentComplete only
+*   reaches 100 once the transfer has finished
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handle          Handle of the transfer                    I
+*     status          Whether it is in progress, done or failed O
+*     percentComplete How much of the file has been copied      O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful). A transfer
+*            that failed returns the reason it failed
+***********************************************************************/
+digs_error_code_t digs_monitorTransfer_local(char *errorMessage, int handle,
+		digs_transfer_status_t *status, int *percentComplete)
+{
+	localTransfer_t *t;
+	digs_error_code_t result = DIGS_SUCCESS;
+
+	errorMessage[0] = '\0';
+	*status = DIGS_TRANSFER_FAILED;
+	*percentComplete = 0;
+
+	globus_mutex_lock(&localTransferLock_);
+	t = findLocalTransfer(errorMessage, handle);
+	if (!t) {
+		globus_mutex_unlock(&localTransferLock_);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	if (!t->done) {
+		*status = DIGS_TRANSFER_IN_PROGRESS;
+		if (t->length > 0) {
+			*percentComplete = (int)((t->copied * 100) / t->length);
+		}
+		/* 100 only once it has finished */
+		if (*percentComplete > 99) {
+			*percentComplete = 99;
+		}
+	} else if (!t->succeeded) {
+		result = getLocalTransferError(errorMessage, t);
+	} else {
+		*status = DIGS_TRANSFER_DONE;
+		*percentComplete = 100;
+	}
+	globus_mutex_unlock(&localTransferLock_);
+	return result;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_getTransferProgress_local(char *errorMessage,
+*           int handle, long long *bytes)
+*
+*   Gets the number of bytes a transfer has copied so far
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handle          Handle of the transfer                    I
+*     bytes           Bytes copied                              O
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_getTransferProgress_local(char *errorMessage,
+		int handle, long long *bytes)
+{
+	localTransfer_t *t;
+
+	errorMessage[0] = '\0';
+	*bytes = 0;
+
+	globus_mutex_lock(&localTransferLock_);
+	t = findLocalTransfer(errorMessage, handle);
+	if (!t) {
+		globus_mutex_unlock(&localTransferLock_);
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	*bytes = t->copied;
+	globus_mutex_unlock(&localTransferLock_);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_waitForTransfers_local(char *errorMessage,
+*           int *handles, int count, float timeOut, int *completed)
+*
+*   Waits until one of several transfers or checksums finishes, or
+*   the time runs out
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handles         Handles of the transfers                  I
+*     count           Number of handles                         I
+*     timeOut         Longest time to wait, in seconds          I
+*     completed       Index in handles of one that finished,    O
+*                     or -1 if none did in time
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_waitForTransfers_local(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed)
+{
+	localTransfer_t *t;
+	globus_abstime_t deadline;
+	struct timeval now;
+	long usec;
+	int i;
+
+	errorMessage[0] = '\0';
+	*completed = -1;
+
+	gettimeofday(&now, NULL);
+	usec = now.tv_usec + (long)((timeOut - (long)timeOut) * 1000000.0);
+	deadline.tv_sec = now.tv_sec + (long)timeOut + (usec / 1000000);
+	deadline.tv_nsec = (usec % 1000000) * 1000;
+
+	globus_mutex_lock(&localTransferLock_);
+	for (;;) {
+		for (i = 0; i < count; i++) {
+			t = lookupTransferHandle(HANDLE_OWNER_LOCAL, handles[i]);
+			if ((t == NULL) || (t->done)) {
+				*completed = i;
+				globus_mutex_unlock(&localTransferLock_);
+				return DIGS_SUCCESS;
+			}
+		}
+
+		if (globus_cond_timedwait(&localTransferDone_, &localTransferLock_,
+				&deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	globus_mutex_unlock(&localTransferLock_);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_endTransfer_local(char *errorMessage, int handle)
+*
+*   Finishes a transfer, renaming the copy into place if it
+*   succeeded and deleting it if not, and frees its handle. A
+*   transfer that hasn't finished is stopped
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handle          Handle of the operation                   I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_endTransfer_local(char *errorMessage, int handle)
+{
+	localTransfer_t *t;
+	digs_error_code_t result = DIGS_SUCCESS;
+	int done;
+
+	errorMessage[0] = '\0';
+
+	t = claimLocalTransfer(errorMessage, handle);
+	if (!t) {
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	globus_mutex_lock(&localTransferLock_);
+	done = t->done;
+	globus_mutex_unlock(&localTransferLock_);
+
+	if (!done) {
+		stopLocalTransfer(t);
+		strncpy(errorMessage, "The transfer had not finished.",
+				MAX_ERROR_MESSAGE_LENGTH);
+		result = DIGS_UNKNOWN_ERROR;
+	} else if (!t->succeeded) {
+		result = getLocalTransferError(errorMessage, t);
+	} else if (rename(t->lockedPath, t->destination) < 0) {
+		/* remove -LOCKED extension */
+		result = localError(errorMessage, errno, "Can't rename", t->lockedPath);
+	}
+
+	if (result != DIGS_SUCCESS) {
+		unlink(t->lockedPath);
+	}
+
+	destroyLocalTransfer(t);
+	return result;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_cancelTransfer_local(char *errorMessage, int handle)
+*
+*   Stops a transfer, deletes the partial copy and frees its handle
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     handle          Handle of the operation                   I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_cancelTransfer_local(char *errorMessage, int handle)
+{
+	localTransfer_t *t;
+
+	errorMessage[0] = '\0';
+
+	t = claimLocalTransfer(errorMessage, handle);
+	if (!t) {
+		return DIGS_UNKNOWN_ERROR;
+	}
+
+	stopLocalTransfer(t);
+	if (t->lockedPath) {
+		unlink(t->lockedPath);
+	}
+
+	destroyLocalTransfer(t);
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_mkdir_local(char *errorMessage, const char *hostname,
+*           const char *filePath)
+*
+*   Creates a directory
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     filePath        Full path of the directory                I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_mkdir_local(char *errorMessage, const char *hostname,
+		const char *filePath)
+{
+	errorMessage[0] = '\0';
+
+	if (mkdir(filePath, 0777) < 0) {
+		return localError(errorMessage, errno, "Can't create directory",
+				filePath);
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_mkdirtree_local(char *errorMessage,
+*           const char *hostname, const char *filePath)
+*
+*   Creates a directory and any missing directories above it
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     filePath        Full path of the directory                I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_mkdirtree_local(char *errorMessage,
+		const char *hostname, const char *filePath)
+{
+	char *path;
+	char *slash;
+
+	errorMessage[0] = '\0';
+
+	path = safe_strdup(filePath);
+	if (!path) {
+		errorExit("Out of memory in digs_mkdirtree_local");
+	}
+
+	/* make each missing directory on the way down */
+	for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if ((mkdir(path, 0777) < 0) && (errno != EEXIST)) {
+			localError(errorMessage, errno, "Can't create directory", path);
+			globus_libc_free(path);
+			return DIGS_UNSPECIFIED_SERVER_ERROR;
+		}
+		*slash = '/';
+	}
+	globus_libc_free(path);
+
+	return digs_mkdir_local(errorMessage, hostname, filePath);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_mv_local(char *errorMessage, const char *hostname,
+*           const char *filePathFrom, const char *filePathTo)
+*
+*   Renames a file on the node
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     filePathFrom    Current path of the file                  I
+*     filePathTo      New path of the file                      I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_mv_local(char *errorMessage, const char *hostname,
+		const char *filePathFrom, const char *filePathTo)
+{
+	errorMessage[0] = '\0';
+
+	if (rename(filePathFrom, filePathTo) < 0) {
+		return localError(errorMessage, errno, "Can't rename", filePathFrom);
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_rm_local(char *errorMessage, const char *hostname,
+*           const char *filePath)
+*
+*   Deletes a file
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     filePath        Full path of the file                     I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_rm_local(char *errorMessage, const char *hostname,
+		const char *filePath)
+{
+	errorMessage[0] = '\0';
+
+	if (unlink(filePath) < 0) {
+		return localError(errorMessage, errno, "Can't delete", filePath);
+	}
+	return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_rmdir_local(char *errorMessage, const char *hostname,
+*           const char *dirPath)
+*
+*   Deletes an empty directory
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     dirPath         Full path of the directory                I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_rmdir_local(char *errorMessage, const char *hostname,
+		const char *dirPath)
+{
+	errorMessage[0] = '\0';
+
+	if (rmdir(dirPath) < 0) {
+		return localError(errorMessage, errno, "Can't delete directory",
+				dirPath);
+	}
+	return DIGS_SUCCESS;
+}
+
+/*
+ * Whether a directory entry is a directory. Uses the type from readdir
+ * when the file system gives one
+ */
+static int isLocalDirectory(const char *path, struct dirent *entry)
+{
+	struct stat st;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+	if (entry->d_type != DT_UNKNOWN) {
+		return (entry->d_type == DT_DIR);
+	}
+#endif
+	if (lstat(path, &st) < 0) {
+		return 0;
+	}
+	return S_ISDIR(st.st_mode);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_rmr_local(char *errorMessage, const char *hostname,
+*           const char *filePath)
+*
+*   Deletes a file, or a directory and everything in it
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     filePath        Full path to delete                       I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_rmr_local(char *errorMessage, const char *hostname,
+		const char *filePath)
+{
+	digs_error_code_t result = DIGS_SUCCESS;
+	struct dirent *entry;
+	char *path;
+	DIR *dir;
+
+	errorMessage[0] = '\0';
+
+	dir = opendir(filePath);
+	if (!dir) {
+		if (errno == ENOTDIR) {
+			return digs_rm_local(errorMessage, hostname, filePath);
+		}
+		return localError(errorMessage, errno, "Can't list", filePath);
+	}
+
+	while ((result == DIGS_SUCCESS) && ((entry = readdir(dir)) != NULL)) {
+		if ((!strcmp(entry->d_name, ".")) || (!strcmp(entry->d_name, ".."))) {
+			continue;
+		}
+		if (safe_asprintf(&path, "%s/%s", filePath, entry->d_name) < 0) {
+			errorExit("Out of memory in digs_rmr_local");
+		}
+		if (isLocalDirectory(path, entry)) {
+			result = digs_rmr_local(errorMessage, hostname, path);
+		} else {
+			result = digs_rm_local(errorMessage, hostname, path);
+		}
+		globus_libc_free(path);
+	}
+	closedir(dir);
+
+	if (result != DIGS_SUCCESS) {
+		return result;
+	}
+	return digs_rmdir_local(errorMessage, hostname, filePath);
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_copyFromInbox_local(char *errorMessage,
+*           const char *hostname, const char *lfn, const char *targetPath)
+*
+*   Moves a file from the node's inbox to its place on the node
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     lfn             Logical filename of the file              I
+*     targetPath      Where to put it                           I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful).
+*            DIGS_NO_INBOX if the node has no inbox
+***********************************************************************/
+digs_error_code_t digs_copyFromInbox_local(char *errorMessage,
+		const char *hostname, const char *lfn, const char *targetPath)
+{
+	digs_error_code_t result;
+	char *inboxPath;
+
+	errorMessage[0] = '\0';
+
+	result = getInboxPath(hostname, lfn, &inboxPath);
+	if (result != DIGS_SUCCESS) {
+		return result;
+	}
+
+	/* the inbox is normally on the same file system, so just move it */
+	result = digs_mv_local(errorMessage, hostname, inboxPath, targetPath);
+	globus_libc_free(inboxPath);
+	return result;
+}
+
+/*
+ * Walks the tree under a directory, passing each file to the callback.
+ * Returns 0 if the callback stopped the walk, 1 otherwise
+ */
+static int walkLocalTree(char *errorMessage, digs_error_code_t *result,
+		const char *dirPath, int allFiles, digs_scan_callback_t callback,
+		void *userData)
+{
+	struct dirent *entry;
+	char *path;
+	DIR *dir;
+	int carryOn = 1;
+
+	dir = opendir(dirPath);
+	if (!dir) {
+		*result = localError(errorMessage, errno, "Can't list", dirPath);
+		return 0;
+	}
+
+	while ((carryOn) && ((entry = readdir(dir)) != NULL)) {
+		if ((!strcmp(entry->d_name, ".")) || (!strcmp(entry->d_name, ".."))) {
+			continue;
+		}
+		if (safe_asprintf(&path, "%s/%s", dirPath, entry->d_name) < 0) {
+			errorExit("Out of memory in walkLocalTree");
+		}
+
+		if (isLocalDirectory(path, entry)) {
+			carryOn = walkLocalTree(errorMessage, result, path, allFiles,
+					callback, userData);
+		} else if ((allFiles) || (strstr(entry->d_name, "-LOCKED") == NULL)) {
+			carryOn = callback(path, userData);
+		}
+		globus_libc_free(path);
+	}
+
+	closedir(dir);
+	return carryOn;
+}
+
+/*
+ * Whether a name is that of a data directory: data, data1, data2, ...
+ */
+static int isDataDirName(const char *name)
+{
+	return ((strncmp(name, "data", 4) == 0) &&
+			(strspn(&name[4], "0123456789") == strlen(&name[4])));
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_scanNodeStream_local(char *errorMessage,
+*           const char *hostname, int allFiles, digs_scan_callback_t callback,
+*           void *userData)
+*
+*   Walks the data directories of a node, passing each file found
+*   to the callback as it goes
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     allFiles        Whether to include locked files           I
+*     callback        Called with the full path of each file.   I
+*                     Returns 0 to stop the scan
+*     userData        Passed through to the callback            I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_scanNodeStream_local(char *errorMessage,
+		const char *hostname, int allFiles, digs_scan_callback_t callback,
+		void *userData)
+{
+	digs_error_code_t result = DIGS_SUCCESS;
+	struct dirent *entry;
+	char *topDir;
+	char *path;
+	DIR *dir;
+	int carryOn = 1;
+
+	errorMessage[0] = '\0';
+
+	topDir = getNodePath(hostname);
+	if (!topDir) {
+		strncpy(errorMessage, "No path configured for node",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_NO_SERVICE;
+	}
+
+	dir = opendir(topDir);
+	if (!dir) {
+		return localError(errorMessage, errno, "Can't list", topDir);
+	}
+
+	while ((carryOn) && (result == DIGS_SUCCESS) &&
+			((entry = readdir(dir)) != NULL)) {
+		if (!isDataDirName(entry->d_name)) {
+			continue;
+		}
+		if (safe_asprintf(&path, "%s/%s", topDir, entry->d_name) < 0) {
+			errorExit("Out of memory in digs_scanNodeStream_local");
+		}
+		if (isLocalDirectory(path, entry)) {
+			carryOn = walkLocalTree(errorMessage, &result, path, allFiles,
+					callback, userData);
+		}
+		globus_libc_free(path);
+	}
+
+	closedir(dir);
+	return result;
+}
+
+/*
+ * Array of file paths built up by addToLocalList
+ */
+typedef struct localList_s {
+	char **list;
+	int length;
+	int size;
+} localList_t;
+
+/*
+ * Scan callback which appends each file to a localList_t
+ */
+static int addToLocalList(const char *filePath, void *userData)
+{
+	localList_t *l = (localList_t *)userData;
+
+	if (l->length >= l->size) {
+		l->size = (l->size < 64) ? 64 : l->size * 2;
+		l->list = globus_libc_realloc(l->list, l->size * sizeof(char *));
+		if (!l->list) {
+			errorExit("Out of memory in addToLocalList");
+		}
+	}
+
+	l->list[l->length] = safe_strdup(filePath);
+	if (!l->list[l->length]) {
+		errorExit("Out of memory in addToLocalList");
+	}
+	l->length++;
+	return 1;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_scanNode_local(char *errorMessage,
+*           const char *hostname, char ***list, int *listLength, int allFiles)
+*
+*   Lists all the files in a node's data directories
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     list            Full paths of the files. To be freed with O
+*                     digs_free_string_array_local
+*     listLength      Number of files in the list               O
+*     allFiles        Whether to include locked files           I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_scanNode_local(char *errorMessage,
+		const char *hostname, char ***list, int *listLength, int allFiles)
+{
+	digs_error_code_t result;
+	localList_t l;
+
+	l.list = NULL;
+	l.length = 0;
+	l.size = 0;
+
+	result = digs_scanNodeStream_local(errorMessage, hostname, allFiles,
+			addToLocalList, &l);
+
+	*list = l.list;
+	*listLength = l.length;
+	return result;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_scanInbox_local(char *errorMessage,
+*           const char *hostname, char ***list, int *listLength, int allFiles)
+*
+*   Lists all the files in a node's inbox
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node the file is on                       I
+*     list            Full paths of the files. To be freed with O
+*                     digs_free_string_array_local
+*     listLength      Number of files in the list               O
+*     allFiles        Whether to include locked files           I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful).
+*            DIGS_NO_INBOX if the node has no inbox
+***********************************************************************/
+digs_error_code_t digs_scanInbox_local(char *errorMessage,
+		const char *hostname, char ***list, int *listLength, int allFiles)
+{
+	digs_error_code_t result = DIGS_SUCCESS;
+	char *inbox;
+	localList_t l;
+
+	errorMessage[0] = '\0';
+	*list = NULL;
+	*listLength = 0;
+
+	inbox = getNodeInbox(hostname);
+	if (inbox == NULL) {
+		/* This storage element doesn't have an inbox. */
+		return DIGS_NO_INBOX;
+	}
+
+	l.list = NULL;
+	l.length = 0;
+	l.size = 0;
+
+	walkLocalTree(errorMessage, &result, inbox, allFiles, addToLocalList, &l);
+
+	*list = l.list;
+	*listLength = l.length;
+	return result;
+}
+
+/***********************************************************************
+*   void digs_free_string_array_local(char ***arrayOfStrings, int *listLength)
+*
+*   Frees a list returned by digs_scanNode_local or
+*   digs_scanInbox_local
+*
+*   Parameters:                                               [I/O]
+*
+*     arrayOfStrings  The list to free                          I/O
+*     listLength      Its length, set to 0                      I/O
+*
+*   Returns: (void)
+***********************************************************************/
+void digs_free_string_array_local(char ***arrayOfStrings, int *listLength)
+{
+	int i;
+
+	for (i = 0; i < (*listLength); i++) {
+		globus_libc_free((*arrayOfStrings)[i]);
+	}
+	if (*arrayOfStrings) {
+		globus_libc_free(*arrayOfStrings);
+	}
+	*arrayOfStrings = NULL;
+	*listLength = 0;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_ping_local(char *errorMessage, const char *hostname)
+*
+*   Checks that a node's storage is mounted, by looking for its
+*   data directory
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node to check                             I
+*
+*   Returns: DIGS_SUCCESS if the node is usable, DIGS_NO_SERVICE if not
+***********************************************************************/
+digs_error_code_t digs_ping_local(char *errorMessage, const char *hostname)
+{
+	struct stat st;
+	char *dataPath;
+	char *topDir;
+	int err;
+
+	errorMessage[0] = '\0';
+
+	topDir = getNodePath(hostname);
+	if (!topDir) {
+		strncpy(errorMessage, "No path configured for node",
+				MAX_ERROR_MESSAGE_LENGTH);
+		return DIGS_NO_SERVICE;
+	}
+
+	if (safe_asprintf(&dataPath, "%s/data", topDir) < 0) {
+		errorExit("Out of memory in digs_ping_local");
+	}
+
+	/* an unmounted file system shows up as a missing data directory */
+	err = statLocalFile(dataPath, &st);
+	if ((!err) && (!S_ISDIR(st.st_mode))) {
+		err = ENOTDIR;
+	}
+	if (err) {
+		localError(errorMessage, err, "Can't find", dataPath);
+		globus_libc_free(dataPath);
+		return DIGS_NO_SERVICE;
+	}
+
+	globus_libc_free(dataPath);
+	return DIGS_SUCCESS;
+}
+
+/*
+ * Scan callback for housekeeping, which removes locked files over a day
+ * old
+ */
+static int removeOldLockedFile(const char *filePath, void *userData)
+{
+	struct stat st;
+	int l = strlen(filePath);
+
+	if ((l < 7) || (strcmp(&filePath[l - 7], "-LOCKED") != 0)) {
+		return 1;
+	}
+
+	logMessage(WARN, "Found locked file %s", filePath);
+	if ((statLocalFile(filePath, &st) == 0) &&
+			(difftime(time(NULL), st.st_mtime) > 24.0 * 60.0 * 60.0)) {
+		logMessage(WARN, "Removing %s", filePath);
+		if (unlink(filePath) < 0) {
+			logMessage(WARN, "Error removing %s: %s", filePath,
+					strerror(errno));
+		}
+	}
+	return 1;
+}
+
+/***********************************************************************
+*   digs_error_code_t digs_housekeeping_local(char *errorMessage, char *hostname)
+*
+*   Deletes locked files over a day old, which are left over from
+*   copies that failed
+*
+*   Parameters:                                               [I/O]
+*
+*     errorMessage    Receives a description of any error       O
+*     hostname        Node to tidy up                           I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t digs_housekeeping_local(char *errorMessage, char *hostname)
+{
+	logMessage(WARN, "Running housekeeping for %s", hostname);
+
+	return digs_scanNodeStream_local(errorMessage, hostname, 1,
+			removeOldLockedFile, NULL);
+}
@@ -0,0 +1,231 @@
+/***********************************************************************
+ *
+ *   Filename:   local.h
+ *
+ *   Authors:    DiGS developers        (digs)     EPCC.
+ *
+ *   Purpose:    The local file system storage element adaptor
+ *
+ *   Contents:   Function prototypes for this module
+ *
+ *   Used in:    Control thread, clients
+ *
+ *   Contact:    epcc-support@epcc.ed.ac.uk
+ *
+ *   Copyright (c) 2026 The University of Edinburgh
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 2 of the
+ *   License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ *   MA 02111-1307, USA.
+ *
+ *   As a special exception, you may link this program with code
+ *   developed by the OGSA-DAI project without such code being covered
+ *   by the GNU General Public License.
+ *
+ ***********************************************************************/
+/*
+ * Storage element adaptor for nodes whose storage is mounted on this
+ * machine (node type "local"). SURLs are plain paths under the node's
+ * path. Each digs_X_local function behaves as described for digs_X in
+ * struct storageElement (node.h); only the differences are noted here.
+ *
+ * Node properties read by this adaptor:
+ *   verifycopies  - 0 to skip comparing the checksums of each copy and
+ *                   its source (default 1)
+ */
+
+#ifndef _LOCAL_H_
+#define _LOCAL_H_
+
+#include "misc.h"
+
+/***********************************************************************
+*   int startupLocalStorage()
+*
+*   Sets up the local storage adaptor. Must be called once before any
+*   local storage element is used
+*
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+int startupLocalStorage();
+
+digs_error_code_t digs_getLength_local(char *errorMessage, const char *filePath,
+		const char *hostname, long long int *fileLength);
+
+/*
+ * Only DIGS_MD5_CHECKSUM is supported. The checksum is computed here by
+ * reading the file
+ */
+digs_error_code_t digs_getChecksum_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **fileChecksum,
+		digs_checksum_type_t checksumType);
+
+/*
+ * The checksum is computed in a thread of its own. fileLength is not
+ * used
+ */
+digs_error_code_t digs_startChecksum_local(char *errorMessage,
+		const char *filePath, const char *hostname,
+		digs_checksum_type_t checksumType, long long int fileLength,
+		int *handle);
+
+digs_error_code_t digs_monitorChecksum_local(char *errorMessage, int handle,
+		digs_transfer_status_t *status);
+
+digs_error_code_t digs_endChecksum_local(char *errorMessage, int handle,
+		char **fileChecksum);
+
+digs_error_code_t digs_doesExist_local(char *errorMessage,
+		const char *filePath, const char *hostname, int *doesExist);
+
+digs_error_code_t digs_isDirectory_local(char *errorMessage,
+		const char *filePath, const char *hostname, int *isDirectory);
+
+void digs_free_string_local(char **string);
+
+/*
+ * Owners and groups are reported by name, or by number if they have no
+ * name on this machine
+ */
+digs_error_code_t digs_getOwner_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **ownerName);
+
+digs_error_code_t digs_getGroup_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **groupName);
+
+digs_error_code_t digs_setGroup_local(char *errorMessage,
+		const char *filePath, const char *hostname, const char *groupName);
+
+digs_error_code_t digs_getPermissions_local(char *errorMessage,
+		const char *filePath, const char *hostname, char **permissions);
+
+/*
+ * permissions is an octal string such as "0644"
+ */
+digs_error_code_t digs_setPermissions_local(char *errorMessage,
+		const char *filePath, const char *hostname, const char *permissions);
+
+digs_error_code_t digs_getModificationTime_local(char *errorMessage,
+		const char *filePath, const char *hostname, time_t *modificationTime);
+
+/*
+ * Checksums are not kept, so stat->checksum is always NULL
+ */
+digs_error_code_t digs_stat_local(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat);
+
+digs_error_code_t digs_statMany_local(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results);
+
+/*
+ * Transfers are local copies, each run in a thread of its own. The copy
+ * is written to SURL-LOCKED and renamed by digs_endTransfer_local. It
+ * is cloned where the file system supports it and otherwise copied in
+ * the kernel, then (unless verifycopies is 0) checked against the
+ * source before it is reported done
+ */
+digs_error_code_t digs_startPutTransfer_local(char *errorMessage,
+		const char *hostname, const char *localPath, const char *SURL,
+		int *handle);
+
+digs_error_code_t digs_startCopyToInbox_local(char *errorMessage,
+		const char *hostname, const char *localPath, const char *lfn,
+		int *handle);
+
+/*
+ * percentComplete goes up as the file is copied
+ */
+digs_error_code_t digs_monitorTransfer_local(char *errorMessage, int handle,
+		digs_transfer_status_t *status, int *percentComplete);
+
+/*
+ * bytes is how much has been copied so far
+ */
+digs_error_code_t digs_getTransferProgress_local(char *errorMessage,
+		int handle, long long *bytes);
+
+digs_error_code_t digs_waitForTransfers_local(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed);
+
+digs_error_code_t digs_endTransfer_local(char *errorMessage, int handle);
+
+digs_error_code_t digs_cancelTransfer_local(char *errorMessage, int handle);
+
+digs_error_code_t digs_startGetTransfer_local(char *errorMessage,
+		const char *hostname, const char *SURL, const char *localPath,
+		int *handle);
+
+/*
+ * Both nodes must be mounted on this machine
+ */
+digs_error_code_t digs_startRelayTransfer_local(char *errorMessage,
+		const char *fromHost, const char *fromSURL, const char *toHost,
+		const char *toSURL, int *handle);
+
+/*
+ * Nodes of other types reach files here through this machine's file
+ * system
+ */
+char *digs_getRelayURL_local(const char *hostname, const char *SURL);
+
+digs_error_code_t digs_mkdir_local(char *errorMessage, const char *hostname,
+		const char *filePath);
+
+digs_error_code_t digs_mkdirtree_local(char *errorMessage,
+		const char *hostname, const char *filePath);
+
+digs_error_code_t digs_mv_local(char *errorMessage, const char *hostname,
+		const char *filePathFrom, const char *filePathTo);
+
+digs_error_code_t digs_rm_local(char *errorMessage, const char *hostname,
+		const char *filePath);
+
+digs_error_code_t digs_rmdir_local(char *errorMessage, const char *hostname,
+		const char *dirPath);
+
+digs_error_code_t digs_rmr_local(char *errorMessage, const char *hostname,
+		const char *filePath);
+
+/*
+ * The file is renamed out of the inbox rather than copied, so it is no
+ * longer there afterwards
+ */
+digs_error_code_t digs_copyFromInbox_local(char *errorMessage,
+		const char *hostname, const char *lfn, const char *targetPath);
+
+digs_error_code_t digs_scanNode_local(char *errorMessage,
+		const char *hostname, char ***list, int *listLength, int allFiles);
+
+digs_error_code_t digs_scanNodeStream_local(char *errorMessage,
+		const char *hostname, int allFiles, digs_scan_callback_t callback,
+		void *userData);
+
+digs_error_code_t digs_scanInbox_local(char *errorMessage,
+		const char *hostname, char ***list, int *listLength, int allFiles);
+
+void digs_free_string_array_local(char ***arrayOfStrings, int *listLength);
+
+/*
+ * Checks that the node's data directory is there, which it won't be if
+ * its file system isn't mounted
+ */
+digs_error_code_t digs_ping_local(char *errorMessage, const char *hostname);
+
+/*
+ * Removes locked files more than a day old from the data directories
+ */
+digs_error_code_t digs_housekeeping_local(char *errorMessage, char *hostname);
+
+#endif
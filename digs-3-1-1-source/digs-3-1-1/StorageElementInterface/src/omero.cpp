@@ -9,15 +9,14 @@
  *
  * Current limitations:
  *  - only one OMERO server on a grid is supported
- *  - file transfers happen synchronously, so startPutTransfer and
- *    startGetTransfer don't return until the file has been transferred.
- *    This could be fixed by running them in a separate thread and
- *    implementing the monitor/end/cancel methods
+ *  - each file transfer runs in a thread of its own, so a large number
+ *    started at once means a large number of threads (most of them
+ *    waiting for a session from the pool)
  *  - many methods aren't implemented - only the essential ones are,
  *    and some of them don't do anything
- *  - the checksum operation might be slow as it copies the file to the
- *    local machine and then checksums it on there (OMERO doesn't support
- *    MD5)
+ *  - OMERO only keeps SHA-1 checksums, so the MD5 of each uploaded file
+ *    is kept in an annotation on it. Checksumming a file put before
+ *    that was done means copying it to the local machine
  *  - may be memory/other resource leaks in some methods. Not sure whether
  *    the OMERO objects are intelligent enough to free themselves or not
  */
@@ -27,17 +26,28 @@ extern "C" {
   #include "omero.h"
   #include "misc.h"
   #include "replica.h"
+  #include "handletable.h"
+  #include "md5.h"
+  #include "gridftp-common.h"
 }
 
 // Domain
 #include <omero/client.h>
+#include <omero/sys/ParametersI.h>
+#include <omero/model/CommentAnnotationI.h>
+#include <omero/model/OriginalFileAnnotationLinkI.h>
+// OpenSSL, from Globus
+#include <openssl/sha.h>
 // Std
 #include <iostream>
 #include <cassert>
 #include <vector>
 #include <time.h>
 #include <map>
+#include <deque>
 #include <cstdio>
+#include <errno.h>
+#include <sys/time.h>
 
 using namespace std;
 
@@ -58,10 +68,98 @@ static omero::api::IAdminPrx adminService_;
 static omero::api::IQueryPrx queryService_;
 static omero::api::IUpdatePrx updateService_;
 
-static int nextHandle_ = 0;
+/*
+ * A session used for file transfers: a connection of its own and a
+ * RawFileStore, which is kept open and pointed at each file in turn.
+ * The metadata calls share the main session above instead, as its
+ * services are stateless. 'broken' is set if the connection fails
+ */
+struct omeroSession_t
+{
+  omero::client *client;
+  omero::api::RawFileStorePrx raw;
+  int broken;
+};
+
+/*
+ * Transfer sessions not in use. Up to maxSessions_ (the node's
+ * 'omerosessions' property) are opened; a transfer that finds them all
+ * busy waits for one to be returned
+ */
+#define OMERO_DEFAULT_SESSIONS 4
+
+static vector<omeroSession_t *> idleSessions_;
+static int numSessions_ = 0;
+static int maxSessions_ = OMERO_DEFAULT_SESSIONS;
+
+/*
+ * A put or get running in its own thread. The thread owns the structure
+ * until it sets 'finished'; after that only the thread that started the
+ * transfer touches it
+ */
+struct omeroTransfer_t
+{
+  int id;
+  int put;
+
+  // full DiGS path, the OMERO path and the local file
+  char *surl;
+  char *path;
+  char *localPath;
+
+  // for a relay, the node at the other end, or NULL. If 'stream' is set
+  // it is a GridFTP node and localPath is the gsiftp URL of the file
+  // there, read or written through a stream rather than a local file
+  char *peerHost;
+  int stream;
+
+  // OMERO user to give a put file to, or NULL
+  char *owner;
+
+  // MD5 the catalogue has for a put file, or NULL
+  char *expectedMd5;
+
+  // MD5 of the data a put sent or a get received, worked out as it went,
+  // empty until then
+  char md5[33];
+
+  // OMERO id of the file being put, once it has been created
+  long long fileId;
+
+  // length of the file and how much has been transferred so far
+  long long length;
+  long long transferred;
+
+  // set to make the thread give up as soon as it can
+  int cancelled;
+
+  // set once the thread has finished, with the result
+  int finished;
+  digs_error_code_t result;
+  char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+};
+
+/*
+ * Protects the connection to the server, the session pool and the
+ * 'transferred', 'cancelled', 'finished' and result fields of all
+ * transfers. omeroChanged_ is broadcast whenever a session is returned
+ * or a transfer finishes
+ */
+static globus_mutex_t omeroLock_;
+static globus_cond_t omeroChanged_;
+static globus_thread_once_t omeroOnce_ = GLOBUS_THREAD_ONCE_INIT;
+
 
 static char *filenamePrefix_ = NULL;
 
+/*
+ * Files are moved to and from OMERO in blocks of this many bytes, with
+ * up to this many block reads or writes outstanding at once. The node's
+ * 'omeroblocksize' and 'omeroblocksinflight' properties override them
+ */
+#define OMERO_DEFAULT_BLOCK_SIZE 1048576
+#define OMERO_DEFAULT_BLOCKS_IN_FLIGHT 4
+
 /*
  * Map from user certificate DNs to OMERO usernames
  */
@@ -168,9 +266,46 @@ static char *dnToUser(const char *dn)
 }
 
 /*
- * Connect to the OMERO server for the first time (if necessary)
+ * Creates an OMERO client object using the grid's ice.config. It has no
+ * session until createSession is called on it
  */
-static int omeroStartup(const char *host)
+static omero::client *newOMEROClient()
+{
+  int argc = 2;
+  char *argv[3];
+  argv[0] = "digs";
+  if (safe_asprintf(&argv[1], "--Ice.Config=%s/ice.config", getQcdgridPath()) < 0) {
+    errorExit("Out of memory in newOMEROClient");
+  }
+  argv[2] = NULL;
+  omero::client *client = new omero::client(argc, argv);
+  globus_libc_free(argv[1]);
+  return client;
+}
+
+/*
+ * Reads a positive integer property of the OMERO node, returning def if
+ * it isn't set
+ */
+static int getOMEROIntProperty(const char *prop, int def)
+{
+  char *value = getNodeProperty(omeroServer_, (char *)prop);
+  if (value == NULL) {
+    return def;
+  }
+  int result = atoi(value);
+  globus_libc_free(value);
+  if (result <= 0) {
+    return def;
+  }
+  return result;
+}
+
+/*
+ * Connect to the OMERO server for the first time (if necessary). Must be
+ * called with omeroLock_ held
+ */
+static int connectOMERO(const char *host)
 {
   if (omeroServer_ != NULL) {
     if (!strcmp(omeroServer_, host)) {
@@ -194,16 +329,7 @@ static int omeroStartup(const char *host)
   // initialise on this server
   try {
     // create OMERO client object
-    int argc = 2;
-    char *argv[3];
-    argv[0] = "digs";
-    if (safe_asprintf(&argv[1], "--Ice.Config=%s/ice.config", getQcdgridPath()) < 0) {
-      logMessage(ERROR, "Out of memory");
-      return 0;
-    }
-    argv[2] = NULL;
-    omeroClient_ = new omero::client(argc, argv);
-    globus_libc_free(argv[1]);
+    omeroClient_ = newOMEROClient();
 
     // create service factory
     serviceFactory_ = omeroClient_->createSession();
@@ -221,9 +347,106 @@ static int omeroStartup(const char *host)
     return 0;
   }
 
+  maxSessions_ = getOMEROIntProperty("omerosessions", OMERO_DEFAULT_SESSIONS);
+
   return 1;
 }
 
+static void initOMEROLock()
+{
+  globus_mutex_init(&omeroLock_, NULL);
+  globus_cond_init(&omeroChanged_, NULL);
+}
+
+/*
+ * Connect to the OMERO server for the first time (if necessary). Safe to
+ * call from any thread
+ */
+static int omeroStartup(const char *host)
+{
+  globus_thread_once(&omeroOnce_, initOMEROLock);
+
+  globus_mutex_lock(&omeroLock_);
+  int result = connectOMERO(host);
+  globus_mutex_unlock(&omeroLock_);
+  return result;
+}
+
+/*
+ * Takes a transfer session from the pool, opening a new one if fewer
+ * than maxSessions_ are open and waiting for one to be returned
+ * otherwise. Returns NULL if a new session can't be opened
+ */
+static omeroSession_t *getOMEROSession()
+{
+  omeroSession_t *s;
+
+  globus_mutex_lock(&omeroLock_);
+  while ((idleSessions_.empty()) && (numSessions_ >= maxSessions_)) {
+    globus_cond_wait(&omeroChanged_, &omeroLock_);
+  }
+  if (!idleSessions_.empty()) {
+    s = idleSessions_.back();
+    idleSessions_.pop_back();
+    globus_mutex_unlock(&omeroLock_);
+    return s;
+  }
+  numSessions_++;
+  globus_mutex_unlock(&omeroLock_);
+
+  // connecting takes a while, so it's done without the lock
+  s = new omeroSession_t;
+  s->client = NULL;
+  s->broken = 0;
+  try {
+    s->client = newOMEROClient();
+    s->client->createSession()->closeOnDestroy();
+    s->raw = s->client->getSession()->createRawFileStore();
+  }
+  catch (const Ice::Exception &ex) {
+    logMessage(ERROR, "Error opening OMERO transfer session: %s", ex.what());
+    delete s->client;
+    delete s;
+
+    globus_mutex_lock(&omeroLock_);
+    numSessions_--;
+    globus_cond_broadcast(&omeroChanged_);
+    globus_mutex_unlock(&omeroLock_);
+    return NULL;
+  }
+  return s;
+}
+
+/*
+ * Gives a transfer session back to the pool. A broken one is closed
+ * instead, and the next transfer to need it opens a new one
+ */
+static void putOMEROSession(omeroSession_t *s)
+{
+  int broken = s->broken;
+
+  if (broken) {
+    try {
+      s->raw->close();
+    }
+    catch (const Ice::Exception &ex) {
+      // expected, the connection has gone
+    }
+    delete s->client;
+    delete s;
+  }
+
+  globus_mutex_lock(&omeroLock_);
+  if (broken) {
+    numSessions_--;
+  }
+  else {
+    idleSessions_.push_back(s);
+  }
+  globus_cond_broadcast(&omeroChanged_);
+  globus_mutex_unlock(&omeroLock_);
+}
+
 /*
  * Retrieves the OMERO OriginalFile object for a file
  */
@@ -246,10 +469,66 @@ static char *toOMEROName(const char *name)
   return safe_strdup(&name[strlen(filenamePrefix_)]);
 }
 
-static char *getFileFormat(const char *filename)
+/*
+ * Namespace of the annotation holding the MD5 checksum of an uploaded
+ * file, as uppercase hex
+ */
+#define OMERO_MD5_NS "digs.md5"
+
+/*
+ * Query for the links from a file to its MD5 annotations, fetching the
+ * annotations with them
+ */
+#define OMERO_MD5_LINK_QUERY "select l from OriginalFileAnnotationLink l join fetch l.child where l.parent.id = :id and l.child.ns = :ns"
+
+/*
+ * Deletes a file from OMERO. Its MD5 annotation, and the link to it,
+ * are deleted first, as the link would stop the file being deleted.
+ * Throws omero::ServerError or Ice::Exception on failure
+ */
+static void deleteOMEROFile(long long fileId)
 {
-  char *dot = strrchr(filename, '.');
-  if (dot == NULL) return "TIFF";
+  omero::sys::ParametersIPtr params = new omero::sys::ParametersI();
+  params->add("id", omero::rtypes::rlong(fileId));
+  params->add("ns", omero::rtypes::rstring(OMERO_MD5_NS));
+  omero::api::IObjectList links = queryService_->findAllByQuery(OMERO_MD5_LINK_QUERY, params);
+
+  for (unsigned int i = 0; i < links.size(); i++) {
+    omero::model::OriginalFileAnnotationLinkPtr link =
+      omero::model::OriginalFileAnnotationLinkPtr::dynamicCast(links[i]);
+    if (!link) {
+      continue;
+    }
+    omero::model::AnnotationPtr note = link->getChild();
+    updateService_->deleteObject(link);
+    if (note) {
+      updateService_->deleteObject(note);
+    }
+  }
+
+  omero::model::OriginalFileIPtr file = new omero::model::OriginalFileI(new omero::RLong(fileId), false);
+  updateService_->deleteObject(file);
+}
+
+/*
+ * Format given to a file that isn't a recognised image, such as a gauge
+ * configuration or propagator
+ */
+#define OMERO_BINARY_FORMAT "application/octet-stream"
+
+/*
+ * Format given to a file whose own format the server doesn't know
+ */
+#define OMERO_FALLBACK_FORMAT "JPEG"
+
+/*
+ * Works out a file's format from its name. Returns NULL if the name
+ * doesn't say
+ */
+static const char *getFileFormat(const char *filename)
+{
+  const char *dot = strrchr(filename, '.');
+  if (dot == NULL) return NULL;
   dot++;
 
   if ((!strcasecmp(dot, "jpg")) || (!strcasecmp(dot, "jpeg"))) {
@@ -261,40 +540,215 @@ static char *getFileFormat(const char *filename)
   if (!strcasecmp(dot, "png")) {
     return "PNG";
   }
+  if ((!strcasecmp(dot, "tif")) || (!strcasecmp(dot, "tiff"))) {
+    return "TIFF";
+  }
+
+  return NULL;
+}
+
+/*
+ * Works out the format of an open local file from the first few bytes
+ * of it, or from its name if they aren't recognised. Anything else is
+ * plain binary data. Leaves the file positioned at the start
+ */
+static const char *detectFileFormat(FILE *f, const char *filename)
+{
+  unsigned char magic[8];
+  size_t n = fread(magic, 1, sizeof(magic), f);
+  rewind(f);
+
+  if ((n >= 3) && (magic[0] == 0xff) && (magic[1] == 0xd8) && (magic[2] == 0xff)) {
+    return "JPEG";
+  }
+  if ((n >= 8) && (!memcmp(magic, "\x89PNG\r\n\x1a\n", 8))) {
+    return "PNG";
+  }
+  if ((n >= 4) && ((!memcmp(magic, "II*\0", 4)) || (!memcmp(magic, "MM\0*", 4)))) {
+    return "TIFF";
+  }
+  if ((n >= 2) && (magic[0] == 'B') && (magic[1] == 'M')) {
+    return "BMP";
+  }
+
+  const char *format = getFileFormat(filename);
+  return (format ? format : OMERO_BINARY_FORMAT);
+}
+
+/*
+ * Writes a digest out as uppercase hex, as DiGS stores checksums
+ */
+static void digestToHex(const unsigned char *digest, int len, char *hex)
+{
+  for (int i = 0; i < len; i++) {
+    sprintf(&hex[i * 2], "%02X", digest[i]);
+  }
+  hex[len * 2] = 0;
+}
+
+/*
+ * Records how far a transfer has got. Returns 0 if it has been cancelled
+ * and should stop. t may be NULL for a transfer nobody is watching
+ */
+static int omeroTransferProgress(omeroTransfer_t *t, long long transferred)
+{
+  int cancelled;
+
+  if (t == NULL) {
+    return 1;
+  }
+  globus_mutex_lock(&omeroLock_);
+  t->transferred = transferred;
+  cancelled = t->cancelled;
+  globus_mutex_unlock(&omeroLock_);
+  return !cancelled;
+}
 
-  return "TIFF";
+/*
+ * Waits for the replies to block reads or writes still outstanding when
+ * a transfer gives up part way, so that the session goes back to the
+ * pool with nothing left in flight on its file store. What the replies
+ * say no longer matters
+ */
+static void drainOMERORequests(deque<Ice::AsyncResultPtr> &requests)
+{
+  while (!requests.empty()) {
+    requests.front()->waitForCompleted();
+    requests.pop_front();
+  }
 }
 
 /*
- * Puts a local file to an OMERO server.
- * filePath is the OMERO path for the file
+ * The other end of a put or get: the local file, or for a relay with a
+ * GridFTP node, a stream of the file there
  */
-static int doOMEROPut(const char *localFile, const char *filePath)
+struct omeroLocalEnd_t
 {
   FILE *f;
-  long long length = getFileLength(localFile);
+  ftpStream_t *stream;
+};
 
-  f = fopen(localFile, "rb");
-  if (!f) {
-    logMessage(ERROR, "Cannot open local file %s", localFile);
-    return 0;
+/*
+ * Opens the local end of a transfer for reading (put) or writing (get).
+ * A transfer that isn't a relay uses localFile, which need not be the
+ * transfer's own (t may be NULL)
+ */
+static digs_error_code_t openOMEROLocalEnd(char *errorMessage, omeroTransfer_t *t,
+					   const char *localFile, int writing,
+					   omeroLocalEnd_t *end)
+{
+  end->f = NULL;
+  end->stream = NULL;
+
+  if ((t != NULL) && (t->stream)) {
+    return openFtpStream(errorMessage, t->peerHost, t->localPath, writing, &end->stream);
+  }
+
+  end->f = fopen(localFile, writing ? "wb" : "rb");
+  if (!end->f) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Cannot %s local file %s",
+	     writing ? "create" : "open", localFile);
+    return DIGS_UNKNOWN_ERROR;
+  }
+  return DIGS_SUCCESS;
+}
+
+/*
+ * Reads the next length bytes from the local end of a put. Returns 0
+ * if they couldn't all be read
+ */
+static int readOMEROLocalEnd(omeroLocalEnd_t *end, void *buffer, long long length)
+{
+  if (end->stream) {
+    return (readFtpStream(end->stream, (char *)buffer, (int)length) == length);
+  }
+  return (fread(buffer, 1, length, end->f) == (size_t)length);
+}
+
+/*
+ * Writes the next length bytes to the local end of a get. Returns 0 on
+ * error
+ */
+static int writeOMEROLocalEnd(omeroLocalEnd_t *end, const void *buffer, long long length)
+{
+  if (end->stream) {
+    return writeFtpStream(end->stream, (const char *)buffer, (int)length);
+  }
+  return (fwrite(buffer, 1, length, end->f) == (size_t)length);
+}
+
+/*
+ * Finishes with the local end of a transfer. If complete is set the
+ * whole file has been read or written, and a stream waits for the
+ * GridFTP server to confirm it; otherwise a stream is aborted. Does
+ * nothing if the end has already been closed
+ */
+static digs_error_code_t closeOMEROLocalEnd(char *errorMessage, omeroLocalEnd_t *end,
+					    int complete)
+{
+  char ignored[MAX_ERROR_MESSAGE_LENGTH];
+  digs_error_code_t result = DIGS_SUCCESS;
+
+  if (end->stream) {
+    result = closeFtpStream(complete ? errorMessage : ignored, end->stream, complete);
+    end->stream = NULL;
+  }
+  if (end->f) {
+    if ((fclose(end->f) != 0) && (complete)) {
+      strcpy(errorMessage, "Error writing local file");
+      result = DIGS_UNKNOWN_ERROR;
+    }
+    end->f = NULL;
+  }
+  return result;
+}
+
+/*
+ * Puts a transfer's local file, or the GridFTP file it relays, to the
+ * OMERO server over a session from the pool, and gives it to the
+ * transfer's owner
+ */
+static digs_error_code_t doOMEROPut(char *errorMessage, omeroSession_t *s,
+				    omeroTransfer_t *t)
+{
+  omeroLocalEnd_t src;
+  digs_error_code_t result;
+  long long length = t->length;
+  int blockSize = getOMEROIntProperty("omeroblocksize", OMERO_DEFAULT_BLOCK_SIZE);
+  unsigned int inFlight = getOMEROIntProperty("omeroblocksinflight",
+					      OMERO_DEFAULT_BLOCKS_IN_FLIGHT);
+  deque<Ice::AsyncResultPtr> writes;
+
+  result = openOMEROLocalEnd(errorMessage, t, t->localPath, 0, &src);
+  if (result != DIGS_SUCCESS) {
+    return result;
   }
 
   try {
     /*
-     * Create OMERO original file object and set properties
+     * Create OMERO original file object and set properties. A stream
+     * can't be looked into before it is sent, so goes by its name
      */
     omero::model::OriginalFileIPtr file = new omero::model::OriginalFileI();
-    //char *fmt = getFileFormat(localFile);
-    char *fmt = "JPEG";
+    const char *fmt;
+    if (src.f) {
+      fmt = detectFileFormat(src.f, t->localPath);
+    }
+    else {
+      fmt = getFileFormat(t->path);
+      if (fmt == NULL) fmt = OMERO_BINARY_FORMAT;
+    }
     omero::model::FormatPtr format = omero::model::FormatPtr::dynamicCast(queryService_->findByString("Format", "value", fmt));
+    if (!format) {
+      format = omero::model::FormatPtr::dynamicCast(queryService_->findByString("Format", "value", OMERO_FALLBACK_FORMAT));
+    }
     
-    const char *name = strrchr(filePath, '/');
-    if (name == NULL) name = filePath;
+    const char *name = strrchr(t->path, '/');
+    if (name == NULL) name = t->path;
     else name++;
     
     omero::RStringPtr nameptr = new omero::RString(name);
-    omero::RStringPtr pathptr = new omero::RString(filePath);
+    omero::RStringPtr pathptr = new omero::RString(t->path);
     omero::RStringPtr sha1ptr = new omero::RString("pending");
     omero::RLongPtr size = new omero::RLong(length);
 
@@ -306,97 +760,543 @@ static int doOMEROPut(const char *localFile, const char *filePath)
     
     // upload the data
     omero::model::OriginalFileIPtr ofs = omero::model::OriginalFileIPtr::dynamicCast(updateService_->saveAndReturnObject(file));
-    omero::api::RawFileStorePrx raw = omeroClient_->getSession()->createRawFileStore();
-    raw->setFileId(ofs->getId()->val);
+    t->fileId = ofs->getId()->val;
+    s->raw->setFileId(t->fileId);
+
+    /*
+     * The block is marshalled when the write is sent, so one buffer
+     * does for all of them. Only the replies are waited for, oldest
+     * first, once there are too many outstanding. The checksums are
+     * worked out from the blocks as they go
+     */
+    md5_state_t md5;
+    SHA_CTX sha1;
+    md5_init(&md5);
+    SHA1_Init(&sha1);
 
+    Ice::ByteSeq block(blockSize);
+    deque<long long> writeSizes;
     long long offset = 0;
+    long long written = 0;
     long long todo;
-    while (offset < length) {
-      if ((length - offset) >= 1048576) {
-	todo = 1048576;
+    while ((offset < length) || (!writes.empty())) {
+      if ((writes.size() >= inFlight) || (offset >= length)) {
+	s->raw->end_write(writes.front());
+	written += writeSizes.front();
+	writes.pop_front();
+	writeSizes.pop_front();
+
+	if (!omeroTransferProgress(t, written)) {
+	  drainOMERORequests(writes);
+	  closeOMEROLocalEnd(errorMessage, &src, 0);
+	  strcpy(errorMessage, "Transfer cancelled");
+	  return DIGS_UNKNOWN_ERROR;
+	}
+	continue;
+      }
+
+      if ((length - offset) >= blockSize) {
+	todo = blockSize;
       }
       else {
 	todo = length - offset;
+	block.resize(todo);
       }
-      
-      Ice::ByteSeq byteseq;
-      for (int i = 0; i < (int)todo; i++) {
-	byteseq.push_back((unsigned char)fgetc(f));
+
+      if (!readOMEROLocalEnd(&src, &block[0], todo)) {
+	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Error reading %s",
+		 t->localPath);
+	drainOMERORequests(writes);
+	closeOMEROLocalEnd(errorMessage, &src, 0);
+	return DIGS_UNKNOWN_ERROR;
       }
-      
-      raw->write(byteseq, offset, length);
+      md5_append(&md5, (const md5_byte_t *)&block[0], (int)todo);
+      SHA1_Update(&sha1, &block[0], todo);
+
+      writes.push_back(s->raw->begin_write(block, offset, (int)todo));
+      writeSizes.push_back(todo);
       offset += todo;
     }
     
-    fclose(f);
+    result = closeOMEROLocalEnd(errorMessage, &src, 1);
+    if (result != DIGS_SUCCESS) {
+      return result;
+    }
+
+    unsigned char md5sum[16];
+    unsigned char sha1sum[SHA_DIGEST_LENGTH];
+    char md5hex[33];
+    char sha1hex[(SHA_DIGEST_LENGTH * 2) + 1];
+    md5_finish(&md5, md5sum);
+    SHA1_Final(sha1sum, &sha1);
+    digestToHex(md5sum, 16, md5hex);
+    digestToHex(sha1sum, SHA_DIGEST_LENGTH, sha1hex);
+    strcpy(t->md5, md5hex);
+
+    if ((t->expectedMd5 != NULL) && (strcasecmp(t->expectedMd5, md5hex))) {
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+	       "Checksum of %s (%s) doesn't match the catalogue (%s)", t->localPath,
+	       md5hex, t->expectedMd5);
+      return DIGS_UNKNOWN_ERROR;
+    }
+
+    // record the checksums, SHA-1 on the file itself and MD5 beside it
+    ofs->setSha1(new omero::RString(sha1hex));
+    ofs = omero::model::OriginalFileIPtr::dynamicCast(updateService_->saveAndReturnObject(ofs));
+
+    omero::model::CommentAnnotationIPtr md5note = new omero::model::CommentAnnotationI();
+    md5note->setNs(new omero::RString(OMERO_MD5_NS));
+    md5note->setTextValue(new omero::RString(md5hex));
+    omero::model::OriginalFileAnnotationLinkIPtr link = new omero::model::OriginalFileAnnotationLinkI();
+    link->setParent(new omero::model::OriginalFileI(ofs->getId(), false));
+    link->setChild(md5note);
+    updateService_->saveObject(link);
+
+    // give the file to the user who submitted it
+    if (t->owner != NULL) {
+      try {
+	adminService_->changeOwner(ofs, t->owner);
+      }
+      catch (omero::ServerError se) {
+	// the failed transfer's file is removed, with its MD5 annotation, by
+	// removeOMEROTransferFile
+	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Error setting file owner to %s",
+		 t->owner);
+	return DIGS_AUTH_FAILED;
+      }
+    }
   }
   catch (omero::ServerError se) {
-    fclose(f);
-    logMessage(ERROR, "OMERO server error: %s", se.message.c_str());
-    return 0;
+    drainOMERORequests(writes);
+    closeOMEROLocalEnd(errorMessage, &src, 0);
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "OMERO server error: %s", se.message.c_str());
+    return DIGS_UNSPECIFIED_SERVER_ERROR;
+  }
+  catch (const Ice::Exception &ex) {
+    // the session is dropped, so anything outstanding goes with it
+    closeOMEROLocalEnd(errorMessage, &src, 0);
+    s->broken = 1;
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "OMERO connection error: %s", ex.what());
+    return DIGS_NO_CONNECTION;
   }
 
-  return 1;
+  return DIGS_SUCCESS;
 }
 
 /*
- * Retrieves an OMERO file into a local file.
- * filePath is the full DiGS path, not necessarily the OMERO path
+ * Retrieves an OMERO file into a local file over a session from the
+ * pool, or for a relay, into the GridFTP file t streams to. filePath is
+ * the full DiGS path, not necessarily the OMERO path. Progress and the
+ * MD5 of what arrived are recorded in t if it isn't NULL
  */
-static int doOMEROGet(const char *filePath, const char *localFile)
+static digs_error_code_t doOMEROGet(char *errorMessage, omeroSession_t *s,
+				    const char *filePath, const char *localFile,
+				    omeroTransfer_t *t)
 {
-  FILE *f = fopen(localFile, "wb");
-  if (!f) {
-    logMessage(ERROR, "Cannot create local file %s", localFile);
-    return 0;
-  }
+  omeroLocalEnd_t dest;
+  digs_error_code_t result;
+  md5_state_t md5;
+  int blockSize = getOMEROIntProperty("omeroblocksize", OMERO_DEFAULT_BLOCK_SIZE);
+  unsigned int inFlight = getOMEROIntProperty("omeroblocksinflight",
+					      OMERO_DEFAULT_BLOCKS_IN_FLIGHT);
+  deque<Ice::AsyncResultPtr> reads;
 
   char *path = toOMEROName(filePath);
   if (path == NULL) {
-    logMessage(ERROR, "File %s not in correct path", filePath);
-    return 0;
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not in correct path", filePath);
+    return DIGS_FILE_NOT_FOUND;
+  }
+
+  result = openOMEROLocalEnd(errorMessage, t, localFile, 1, &dest);
+  if (result != DIGS_SUCCESS) {
+    globus_libc_free(path);
+    return result;
   }
+  md5_init(&md5);
+
   try {
     omero::model::OriginalFileIPtr file = getOMEROFile(path);
     globus_libc_free(path);
     path = NULL;
+
+    if (!file) {
+      closeOMEROLocalEnd(errorMessage, &dest, 0);
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not found", filePath);
+      return DIGS_FILE_NOT_FOUND;
+    }
     
-    omero::api::RawFileStorePrx raw = omeroClient_->getSession()->createRawFileStore();
-    raw->setFileId(file->id->val);
-    if (!raw->exists()) {
-      fclose(f);
-      logMessage(ERROR, "Tried to get non-existent file %s from OMERO", filePath);
-      return 0;
+    s->raw->setFileId(file->id->val);
+    if (!s->raw->exists()) {
+      closeOMEROLocalEnd(errorMessage, &dest, 0);
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+	       "Tried to get non-existent file %s from OMERO", filePath);
+      return DIGS_FILE_NOT_FOUND;
     }
     
     long long length = file->getSize()->val;
+    if (t != NULL) {
+      globus_mutex_lock(&omeroLock_);
+      t->length = length;
+      globus_mutex_unlock(&omeroLock_);
+    }
+
+    /*
+     * Keep several block reads outstanding, asking for the next as
+     * soon as the oldest arrives and has been written out
+     */
     long long offset = 0;
+    long long written = 0;
     long long todo;
-    while (offset < length) {
-      if ((length - offset) >= 1048576) {
-	todo = 1048576;
+    deque<long long> readSizes;
+    while ((offset < length) || (!reads.empty())) {
+      while ((offset < length) && (reads.size() < inFlight)) {
+	if ((length - offset) >= blockSize) {
+	  todo = blockSize;
+	}
+	else {
+	  todo = length - offset;
+	}
+	reads.push_back(s->raw->begin_read(offset, (int)todo));
+	readSizes.push_back(todo);
+	offset += todo;
       }
-      else {
-	todo = length - offset;
+
+      Ice::ByteSeq block = s->raw->end_read(reads.front());
+      todo = readSizes.front();
+      reads.pop_front();
+      readSizes.pop_front();
+
+      if (((long long)block.size() != todo) ||
+	  (!writeOMEROLocalEnd(&dest, &block[0], todo))) {
+	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+		 "Error writing %s from OMERO to %s", filePath, localFile);
+	drainOMERORequests(reads);
+	closeOMEROLocalEnd(errorMessage, &dest, 0);
+	return DIGS_UNKNOWN_ERROR;
       }
-      
-      Ice::ByteSeq byteseq = raw->read(offset, todo);
-      for (int i = 0; i < (int)todo; i++) {
-	unsigned char c1 = byteseq.at(i);
-	fputc(c1, f);
+      md5_append(&md5, (const md5_byte_t *)&block[0], (int)todo);
+      written += todo;
+
+      if (!omeroTransferProgress(t, written)) {
+	drainOMERORequests(reads);
+	closeOMEROLocalEnd(errorMessage, &dest, 0);
+	strcpy(errorMessage, "Transfer cancelled");
+	return DIGS_UNKNOWN_ERROR;
       }
-      
-      offset += todo;
     }
-    fclose(f);
+    result = closeOMEROLocalEnd(errorMessage, &dest, 1);
+    if (result != DIGS_SUCCESS) {
+      return result;
+    }
   }
   catch (omero::ServerError se) {
-    logMessage(ERROR, "OMERO server error: %s", se.message.c_str());
-    fclose(f);
-    return 0;
+    drainOMERORequests(reads);
+    if (path) globus_libc_free(path);
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "OMERO server error: %s", se.message.c_str());
+    closeOMEROLocalEnd(errorMessage, &dest, 0);
+    return DIGS_UNSPECIFIED_SERVER_ERROR;
+  }
+  catch (const Ice::Exception &ex) {
+    if (path) globus_libc_free(path);
+    s->broken = 1;
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "OMERO connection error: %s", ex.what());
+    closeOMEROLocalEnd(errorMessage, &dest, 0);
+    return DIGS_NO_CONNECTION;
   }
 
-  return 1;
+  if (t != NULL) {
+    unsigned char md5sum[16];
+    md5_finish(&md5, md5sum);
+    digestToHex(md5sum, 16, t->md5);
+  }
+  return DIGS_SUCCESS;
+}
+
+/*
+ * Removes whatever a transfer has written: the local file of a get, or
+ * the OMERO file of a put. A get streamed to a GridFTP node leaves its
+ * partial file there, under the -LOCKED name the replication gave it
+ */
+static void removeOMEROTransferFile(omeroTransfer_t *t)
+{
+  if (!t->put) {
+    if (!t->stream) {
+      unlink(t->localPath);
+    }
+    return;
+  }
+  if (t->fileId <= 0) {
+    return;
+  }
+  try {
+    deleteOMEROFile(t->fileId);
+    t->fileId = 0;
+  }
+  catch (const Ice::Exception &ex) {
+    logMessage(WARN, "Error removing %s from OMERO: %s", t->path, ex.what());
+  }
+}
+
+static digs_error_code_t lookupOMEROMd5(char *errorMessage, const char *filePath,
+					char **md5);
+
+/*
+ * Checks the data a relay copied. A get must match the MD5 recorded
+ * when the file was put, if there is one, and whatever was streamed
+ * must match the copy the GridFTP server has
+ */
+static digs_error_code_t checkOMERORelay(char *errorMessage, omeroTransfer_t *t)
+{
+  char peerMd5[CHECKSUM_LENGTH + 1];
+
+  if (!t->put) {
+    char *stored;
+    digs_error_code_t result = lookupOMEROMd5(errorMessage, t->surl, &stored);
+    if (result != DIGS_SUCCESS) {
+      return result;
+    }
+    if (stored != NULL) {
+      int match = !strcasecmp(stored, t->md5);
+      if (!match) {
+	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+		 "Checksum of %s (%s) doesn't match OMERO's (%s)", t->surl,
+		 t->md5, stored);
+      }
+      globus_libc_free(stored);
+      if (!match) {
+	return DIGS_INVALID_CHECKSUM;
+      }
+    }
+  }
+
+  if (!t->stream) {
+    return DIGS_SUCCESS;
+  }
+  if (!getFtpUrlChecksum(t->localPath, t->peerHost, peerMd5)) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Cannot get checksum of %s",
+	     t->localPath);
+    return DIGS_UNKNOWN_ERROR;
+  }
+  if (strcasecmp(peerMd5, t->md5)) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+	     "Checksum of %s (%s) doesn't match %s (%s)", t->surl, t->md5,
+	     t->localPath, peerMd5);
+    return DIGS_INVALID_CHECKSUM;
+  }
+  return DIGS_SUCCESS;
+}
+
+/*
+ * Body of the thread running an OMERO transfer
+ */
+static void *omeroTransferThread(void *arg)
+{
+  omeroTransfer_t *t = (omeroTransfer_t *)arg;
+  char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+  digs_error_code_t result;
+
+  errorMessage[0] = 0;
+
+  omeroSession_t *s = getOMEROSession();
+  if (s == NULL) {
+    strcpy(errorMessage, "Error connecting to OMERO");
+    result = DIGS_NO_CONNECTION;
+  }
+  else if (!omeroTransferProgress(t, 0)) {
+    // cancelled while waiting for the session
+    putOMEROSession(s);
+    strcpy(errorMessage, "Transfer cancelled");
+    result = DIGS_UNKNOWN_ERROR;
+  }
+  else {
+    if (t->put) {
+      result = doOMEROPut(errorMessage, s, t);
+    }
+    else {
+      result = doOMEROGet(errorMessage, s, t->surl, t->localPath, t);
+    }
+    putOMEROSession(s);
+
+    if ((result == DIGS_SUCCESS) && (t->peerHost != NULL)) {
+      result = checkOMERORelay(errorMessage, t);
+    }
+  }
+
+  if (result != DIGS_SUCCESS) {
+    logMessage(ERROR, "OMERO transfer of %s failed: %s", t->surl, errorMessage);
+    removeOMEROTransferFile(t);
+  }
+
+  globus_mutex_lock(&omeroLock_);
+  t->result = result;
+  strcpy(t->errorMessage, errorMessage);
+  t->finished = 1;
+  globus_cond_broadcast(&omeroChanged_);
+  globus_mutex_unlock(&omeroLock_);
+
+  return NULL;
+}
+
+/*
+ * Frees a transfer. Must only be called once its thread has finished and
+ * its handle has been released
+ */
+static void destroyOMEROTransfer(omeroTransfer_t *t)
+{
+  globus_libc_free(t->surl);
+  globus_libc_free(t->path);
+  globus_libc_free(t->localPath);
+  if (t->peerHost) {
+    globus_libc_free(t->peerHost);
+  }
+  if (t->owner) {
+    globus_libc_free(t->owner);
+  }
+  if (t->expectedMd5) {
+    globus_libc_free(t->expectedMd5);
+  }
+  globus_libc_free(t);
+}
+
+/*
+ * Starts a put or get of a file in a thread of its own. For a relay,
+ * peerHost is the node at the other end; if stream is set, localPath is
+ * the gsiftp URL of the file there rather than a local file
+ */
+static digs_error_code_t startOMEROTransfer(char *errorMessage, int put,
+					    const char *SURL, const char *localPath,
+					    const char *peerHost, int stream,
+					    int *handle)
+{
+  globus_thread_t thread;
+
+  *handle = -1;
+
+  char *path = toOMEROName(SURL);
+  if (path == NULL) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not in correct path", SURL);
+    return DIGS_FILE_NOT_FOUND;
+  }
+
+  omeroTransfer_t *t = (omeroTransfer_t *)globus_libc_malloc(sizeof(omeroTransfer_t));
+  if (t == NULL) {
+    errorExit("Out of memory in startOMEROTransfer");
+  }
+  t->id = -1;
+  t->put = put;
+  t->surl = safe_strdup(SURL);
+  t->path = path;
+  t->localPath = safe_strdup(localPath);
+  t->peerHost = NULL;
+  t->stream = stream;
+  t->owner = NULL;
+  t->expectedMd5 = NULL;
+  t->md5[0] = 0;
+  t->fileId = 0;
+  t->length = 0;
+  t->transferred = 0;
+  t->cancelled = 0;
+  t->finished = 0;
+  t->result = DIGS_SUCCESS;
+  t->errorMessage[0] = 0;
+  if (peerHost != NULL) {
+    t->peerHost = safe_strdup(peerHost);
+  }
+  if ((t->surl == NULL) || (t->localPath == NULL) ||
+      ((peerHost != NULL) && (t->peerHost == NULL))) {
+    errorExit("Out of memory in startOMEROTransfer");
+  }
+
+  if (put) {
+    if (stream) {
+      globus_off_t length;
+      t->length = (getFtpUrlLength(localPath, peerHost, &length) ? length : -1);
+    }
+    else {
+      t->length = getFileLength(localPath);
+    }
+    if (t->length < 0) {
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Cannot get size of %s",
+	       localPath);
+      destroyOMEROTransfer(t);
+      return DIGS_UNKNOWN_ERROR;
+    }
+
+    // the file will be given to the user who submitted it
+    char *ownerdn = getRLSAttribute(path, "submitter");
+    if (ownerdn != NULL) {
+      char *username = dnToUser(ownerdn);
+      if (username != NULL) {
+	t->owner = safe_strdup(username);
+      }
+      globus_libc_free(ownerdn);
+    }
+
+    // and what is uploaded is checked against the catalogue's checksum
+    t->expectedMd5 = getRLSAttribute(path, "md5sum");
+  }
+
+  t->id = allocateTransferHandle(HANDLE_OWNER_OMERO, t);
+  if (t->id < 0) {
+    destroyOMEROTransfer(t);
+    strcpy(errorMessage, "Too many transfers in progress");
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  if (globus_thread_create(&thread, NULL, omeroTransferThread, t) != 0) {
+    // the handle hasn't been given out yet
+    releaseTransferHandle(HANDLE_OWNER_OMERO, t->id);
+    destroyOMEROTransfer(t);
+    strcpy(errorMessage, "Could not start transfer thread");
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  *handle = t->id;
+  errorMessage[0] = 0;
+  return DIGS_SUCCESS;
+}
+
+/*
+ * Finds an OMERO transfer from its handle. Caller must hold omeroLock_,
+ * and only use the transfer until releasing it
+ */
+static omeroTransfer_t *findOMEROTransfer(char *errorMessage, int handle)
+{
+  omeroTransfer_t *t = (omeroTransfer_t *)lookupTransferHandle(HANDLE_OWNER_OMERO, handle);
+  if (t == NULL) {
+    strcpy(errorMessage, "Couldn't find the transfer.");
+  }
+  return t;
+}
+
+/*
+ * Finds an OMERO transfer from its handle and releases the handle, so
+ * that no other thread can find it and the caller can end it and free it
+ */
+static omeroTransfer_t *claimOMEROTransfer(char *errorMessage, int handle)
+{
+  globus_thread_once(&omeroOnce_, initOMEROLock);
+
+  globus_mutex_lock(&omeroLock_);
+  omeroTransfer_t *t = findOMEROTransfer(errorMessage, handle);
+  if (t != NULL) {
+    releaseTransferHandle(HANDLE_OWNER_OMERO, handle);
+  }
+  globus_mutex_unlock(&omeroLock_);
+  return t;
+}
+
+/*
+ * Tells a transfer's thread to give up and waits for it to finish
+ */
+static void stopOMEROTransfer(omeroTransfer_t *t)
+{
+  globus_mutex_lock(&omeroLock_);
+  t->cancelled = 1;
+  while (!t->finished) {
+    globus_cond_wait(&omeroChanged_, &omeroLock_);
+  }
+  globus_mutex_unlock(&omeroLock_);
 }
 
 /***********************************************************************
@@ -419,10 +1319,47 @@ static int doOMEROGet(const char *filePath, const char *localFile)
 digs_error_code_t digs_getLength_omero(char *errorMessage, const char *filePath,
 		const char *hostname, long long int *fileLength)
 {
-  if (!omeroStartup(hostname)) {
-    strcpy(errorMessage, "Error connecting to OMERO");
-    return DIGS_NO_CONNECTION;
-  }
+  if (!omeroStartup(hostname)) {
+    strcpy(errorMessage, "Error connecting to OMERO");
+    return DIGS_NO_CONNECTION;
+  }
+
+  char *path = toOMEROName(filePath);
+  if (path == NULL) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not in correct path", filePath);
+    return DIGS_FILE_NOT_FOUND;
+  }
+  try {
+    omero::model::OriginalFileIPtr file = getOMEROFile(path);
+    globus_libc_free(path);
+    path = NULL;
+
+    *fileLength = file->getSize()->val;
+  }
+  catch (omero::ServerError se) {
+    globus_libc_free(path);
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "OMERO error: %s", se.message.c_str());
+    return DIGS_UNSPECIFIED_SERVER_ERROR;
+  }
+
+  errorMessage[0] = 0;
+  return DIGS_SUCCESS;
+}
+
+/*
+ * Query for the MD5 annotation on a file
+ */
+#define OMERO_MD5_QUERY "select l.child from OriginalFileAnnotationLink l where l.parent.path = :path and l.child.ns = :ns"
+
+/*
+ * Looks up the MD5 recorded when a file was uploaded. md5 is set to NULL
+ * if the file doesn't have one. The caller must already have called
+ * omeroStartup
+ */
+static digs_error_code_t lookupOMEROMd5(char *errorMessage, const char *filePath,
+					char **md5)
+{
+  *md5 = NULL;
 
   char *path = toOMEROName(filePath);
   if (path == NULL) {
@@ -430,11 +1367,17 @@ digs_error_code_t digs_getLength_omero(char *errorMessage, const char *filePath,
     return DIGS_FILE_NOT_FOUND;
   }
   try {
-    omero::model::OriginalFileIPtr file = getOMEROFile(path);
+    omero::sys::ParametersIPtr params = new omero::sys::ParametersI();
+    params->add("path", omero::rtypes::rstring(path));
+    params->add("ns", omero::rtypes::rstring(OMERO_MD5_NS));
+    omero::model::CommentAnnotationPtr note =
+      omero::model::CommentAnnotationPtr::dynamicCast(queryService_->findByQuery(OMERO_MD5_QUERY, params));
     globus_libc_free(path);
     path = NULL;
 
-    *fileLength = file->getSize()->val;
+    if ((note) && (note->getTextValue())) {
+      *md5 = safe_strdup(note->getTextValue()->val.c_str());
+    }
   }
   catch (omero::ServerError se) {
     globus_libc_free(path);
@@ -442,7 +1385,6 @@ digs_error_code_t digs_getLength_omero(char *errorMessage, const char *filePath,
     return DIGS_UNSPECIFIED_SERVER_ERROR;
   }
 
-  errorMessage[0] = 0;
   return DIGS_SUCCESS;
 }
 
@@ -487,6 +1429,18 @@ digs_error_code_t digs_getChecksum_omero(char *errorMessage,
     return DIGS_NO_CONNECTION;
   }
 
+  // normally the MD5 was recorded when the file was put
+  char *md5;
+  digs_error_code_t result = lookupOMEROMd5(errorMessage, filePath, &md5);
+  if (result != DIGS_SUCCESS) {
+    return result;
+  }
+  if (md5 != NULL) {
+    *fileChecksum = md5;
+    errorMessage[0] = 0;
+    return DIGS_SUCCESS;
+  }
+
   /*
    * OMERO can only do SHA-1, so need to copy the file to local and md5sum it
    */
@@ -496,11 +1450,18 @@ digs_error_code_t digs_getChecksum_omero(char *errorMessage,
     return DIGS_UNKNOWN_ERROR;
   }
 
-  if (!doOMEROGet(filePath, tmpfile)) {
+  omeroSession_t *s = getOMEROSession();
+  if (s == NULL) {
+    globus_libc_free(tmpfile);
+    strcpy(errorMessage, "Error connecting to OMERO");
+    return DIGS_NO_CONNECTION;
+  }
+  result = doOMEROGet(errorMessage, s, filePath, tmpfile, NULL);
+  putOMEROSession(s);
+  if (result != DIGS_SUCCESS) {
     unlink(tmpfile);
     globus_libc_free(tmpfile);
-    strcpy(errorMessage, "Error fetching file from OMERO for checksum");
-    return DIGS_UNSPECIFIED_SERVER_ERROR;
+    return result;
   }
 
   unsigned char cksum[16];
@@ -946,6 +1907,166 @@ digs_error_code_t digs_getModificationTime_omero(char *errorMessage,
   return DIGS_NO_SERVICE;
 }
 
+/*
+ * Query used by digs_stat_omero. The owner and group come back with the
+ * file, so the one query covers everything
+ */
+#define OMERO_STAT_QUERY "select f from OriginalFile f join fetch f.details.owner join fetch f.details.group where f.path = :path"
+
+/*
+ * Looks up one file with OMERO_STAT_QUERY and fills in stat from it.
+ * The caller must already have called omeroStartup
+ */
+static digs_error_code_t statOMEROFile(char *errorMessage, const char *filePath,
+				       digs_stat_t *stat)
+{
+  char *path = toOMEROName(filePath);
+  if (path == NULL) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not in correct path", filePath);
+    return DIGS_FILE_NOT_FOUND;
+  }
+  try {
+    omero::sys::ParametersIPtr params = new omero::sys::ParametersI();
+    params->add("path", omero::rtypes::rstring(path));
+    omero::model::OriginalFileIPtr file =
+      omero::model::OriginalFileIPtr::dynamicCast(queryService_->findByQuery(OMERO_STAT_QUERY, params));
+    globus_libc_free(path);
+    path = NULL;
+
+    if (!file) {
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not found", filePath);
+      return DIGS_FILE_NOT_FOUND;
+    }
+
+    // OMERO only holds files, and only SHA-1 checksums of them
+    stat->isDirectory = 0;
+    if (file->getSize()) {
+      stat->size = file->getSize()->val;
+    }
+    if (file->getMtime()) {
+      // OMERO times are in milliseconds
+      stat->modificationTime = (time_t)(file->getMtime()->val / 1000);
+    }
+
+    omero::model::DetailsPtr details = file->getDetails();
+    if ((details->owner) && (details->owner->omeName)) {
+      char *dn = userToDN(details->owner->omeName->val.c_str());
+      if (dn == NULL) {
+	logMessage(WARN, "No DN mapping found for user %s", details->owner->omeName->val.c_str());
+      }
+      else {
+	stat->owner = safe_strdup(dn);
+      }
+    }
+    if ((details->group) && (details->group->name)) {
+      stat->group = safe_strdup(details->group->name->val.c_str());
+    }
+
+    omero::model::PermissionsPtr perms = details->permissions;
+    if (perms) {
+      stat->permissions = safe_strdup("0000");
+      if (perms->isUserRead()) stat->permissions[1] += 4;
+      if (perms->isUserWrite()) stat->permissions[1] += 2;
+      if (perms->isGroupRead()) stat->permissions[2] += 4;
+      if (perms->isGroupWrite()) stat->permissions[2] += 2;
+      if (perms->isWorldRead()) stat->permissions[3] += 4;
+      if (perms->isWorldWrite()) stat->permissions[3] += 2;
+    }
+  }
+  catch (omero::ServerError se) {
+    globus_libc_free(path);
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "OMERO error: %s", se.message.c_str());
+    return DIGS_UNSPECIFIED_SERVER_ERROR;
+  }
+
+  return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ *  digs_error_code_t digs_stat_omero(char *errorMessage,
+ *		const char *filePath, const char *hostname, digs_stat_t *stat);
+ * 
+ *     Gets everything about a file the node can report, in a single
+ *     query of the OMERO server. OMERO only keeps SHA-1 checksums, so
+ *     stat->checksum is always NULL. Free the result with digs_freeStat.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 stat			the file's details									O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_stat_omero(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat)
+{
+  digs_initStat(stat);
+
+  if (!omeroStartup(hostname)) {
+    strcpy(errorMessage, "Error connecting to OMERO");
+    return DIGS_NO_CONNECTION;
+  }
+
+  errorMessage[0] = 0;
+  return statOMEROFile(errorMessage, filePath, stat);
+}
+
+/***********************************************************************
+ *  digs_error_code_t digs_statMany_omero(char *errorMessage,
+ *		const char *hostname, int count, const char **filePaths,
+ * 		digs_stat_t *stats, digs_error_code_t *results);
+ * 
+ *     As digs_stat_omero for a list of files on one node. Each file is
+ *     looked up in turn over the one OMERO session.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 count			the number of files									I
+ * 	 filePaths		the full paths to the files							I
+ * 	 stats			array of count entries receiving the details		O
+ * 	 results		array of count entries receiving the result
+ * 					for each file										O
+ *    
+ *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+ *            code of the first failure, described in errorMessage
+ ***********************************************************************/
+digs_error_code_t digs_statMany_omero(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results)
+{
+  digs_error_code_t result = DIGS_SUCCESS;
+  char fileError[MAX_ERROR_MESSAGE_LENGTH];
+  int i;
+
+  for (i = 0; i < count; i++) {
+    digs_initStat(&stats[i]);
+    results[i] = DIGS_NO_CONNECTION;
+  }
+
+  if (!omeroStartup(hostname)) {
+    strcpy(errorMessage, "Error connecting to OMERO");
+    return DIGS_NO_CONNECTION;
+  }
+
+  errorMessage[0] = 0;
+  for (i = 0; i < count; i++) {
+    fileError[0] = 0;
+    results[i] = statOMEROFile(fileError, filePaths[i], &stats[i]);
+    if ((results[i] != DIGS_SUCCESS) && (result == DIGS_SUCCESS)) {
+      result = results[i];
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "%s: %s", filePaths[i], fileError);
+    }
+  }
+
+  return result;
+}
+
 ///***********************************************************************
 //* partially implemented get_list.
 // ***********************************************************************/
@@ -985,44 +2106,7 @@ digs_error_code_t digs_startPutTransfer_omero(char *errorMessage,
     return DIGS_NO_CONNECTION;
   }
 
-  // just do this synchronously for now
-  char *path = toOMEROName(SURL);
-  if (path == NULL) {
-    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not in correct path", SURL);
-    return DIGS_FILE_NOT_FOUND;
-  }
-  if (!doOMEROPut(localPath, path)) {
-    strcpy(errorMessage, "Error uploading file to OMERO");
-    globus_libc_free(path);
-    return DIGS_UNSPECIFIED_SERVER_ERROR;
-  }
-
-  // now get file owner and set it in OMERO
-  char *ownerdn = getRLSAttribute(path, "submitter");
-  if (ownerdn != NULL) {
-    char *username = dnToUser(ownerdn);
-    if (username != NULL) {
-      try {
-	omero::model::OriginalFileIPtr file = getOMEROFile(path);
-	adminService_->changeOwner(file, username);
-      }
-      catch (omero::ServerError se) {
-	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Error setting file owner to %s",
-		 username);
-	globus_libc_free(ownerdn);
-	globus_libc_free(path);
-	return DIGS_AUTH_FAILED;
-      }
-    }
-    globus_libc_free(ownerdn);
-  }
-
-  globus_libc_free(path);
-
-  *handle = nextHandle_++;
-
-  errorMessage[0] = 0;
-  return DIGS_SUCCESS;
+  return startOMEROTransfer(errorMessage, 1, SURL, localPath, NULL, 0, handle);
 }
 
 /***********************************************************************
@@ -1077,20 +2161,137 @@ digs_error_code_t digs_startCopyToInbox_omero(char *errorMessage,
  * 	 handle 			the id of the transfer								I
  * 	 status				the status of the transfer							O	
  * 	 percentComplete	percentage of the transfer that has been completed
- * 						In this implementation goes from 0 directly to 100	O					
+ * 						Reaches 100 only once the transfer has finished		O					
  *    
  *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
  ***********************************************************************/
 digs_error_code_t digs_monitorTransfer_omero(char *errorMessage, int handle, 
 		digs_transfer_status_t *status, int *percentComplete)
 {
-  /*
-   * We do the whole transfer synchronously in the put/get function, so just return success here
-   */
-  *status = DIGS_TRANSFER_DONE;
-  *percentComplete = 100;
+  errorMessage[0] = 0;
+  *status = DIGS_TRANSFER_FAILED;
+  *percentComplete = 0;
+
+  digs_error_code_t result = DIGS_SUCCESS;
+
+  globus_thread_once(&omeroOnce_, initOMEROLock);
+
+  globus_mutex_lock(&omeroLock_);
+  omeroTransfer_t *t = findOMEROTransfer(errorMessage, handle);
+  if (t == NULL) {
+    globus_mutex_unlock(&omeroLock_);
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  if (!t->finished) {
+    *status = DIGS_TRANSFER_IN_PROGRESS;
+    if (t->length > 0) {
+      *percentComplete = (int)((t->transferred * 100) / t->length);
+    }
+    // 100 only once it has finished
+    if (*percentComplete > 99) {
+      *percentComplete = 99;
+    }
+  }
+  else if (t->result != DIGS_SUCCESS) {
+    strcpy(errorMessage, t->errorMessage);
+    result = t->result;
+  }
+  else {
+    *status = DIGS_TRANSFER_DONE;
+    *percentComplete = 100;
+  }
+  globus_mutex_unlock(&omeroLock_);
+  return result;
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_getTransferProgress_omero(char *errorMessage,
+ *		int handle, long long *bytes);
+ * 
+ * Gets how many bytes of a file a transfer has moved so far.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 bytes			receives the number of bytes moved					O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferProgress_omero(char *errorMessage, int handle,
+						 long long *bytes)
+{
+  errorMessage[0] = 0;
+  *bytes = 0;
+
+  globus_thread_once(&omeroOnce_, initOMEROLock);
+
+  globus_mutex_lock(&omeroLock_);
+  omeroTransfer_t *t = findOMEROTransfer(errorMessage, handle);
+  if (t == NULL) {
+    globus_mutex_unlock(&omeroLock_);
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  *bytes = t->transferred;
+  globus_mutex_unlock(&omeroLock_);
+  return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ * digs_error_code_t digs_waitForTransfers_omero(char *errorMessage,
+ *		int *handles, int count, float timeOut, int *completed)
+ * 
+ * Waits until one of several transfers finishes or the time out passes.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handles		the ids of the transfers							I
+ * 	 count			the number of transfers								I
+ * 	 timeOut		the longest to wait, in seconds						I
+ * 	 completed		index in handles of a finished transfer, or -1
+ * 					if none finished in time							O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_waitForTransfers_omero(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed)
+{
+  globus_abstime_t deadline;
+  struct timeval now;
+  long usec;
+  int i;
 
   errorMessage[0] = 0;
+  *completed = -1;
+
+  gettimeofday(&now, NULL);
+  usec = now.tv_usec + (long)((timeOut - (long)timeOut) * 1000000.0);
+  deadline.tv_sec = now.tv_sec + (long)timeOut + (usec / 1000000);
+  deadline.tv_nsec = (usec % 1000000) * 1000;
+
+  globus_thread_once(&omeroOnce_, initOMEROLock);
+
+  globus_mutex_lock(&omeroLock_);
+  for (;;) {
+    for (i = 0; i < count; i++) {
+      omeroTransfer_t *t = (omeroTransfer_t *)lookupTransferHandle(HANDLE_OWNER_OMERO, handles[i]);
+      if ((t == NULL) || (t->finished)) {
+	*completed = i;
+	globus_mutex_unlock(&omeroLock_);
+	return DIGS_SUCCESS;
+      }
+    }
+
+    if (globus_cond_timedwait(&omeroChanged_, &omeroLock_, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  globus_mutex_unlock(&omeroLock_);
   return DIGS_SUCCESS;
 }
 
@@ -1113,8 +2314,78 @@ digs_error_code_t digs_monitorTransfer_omero(char *errorMessage, int handle,
  ***********************************************************************/
 digs_error_code_t digs_endTransfer_omero(char *errorMessage, int handle)
 {
-  // nothing to do, transfers are synchronous
+  digs_error_code_t result = DIGS_SUCCESS;
+
+  errorMessage[0] = 0;
+
+  omeroTransfer_t *t = claimOMEROTransfer(errorMessage, handle);
+  if (t == NULL) {
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  globus_mutex_lock(&omeroLock_);
+  int finished = t->finished;
+  globus_mutex_unlock(&omeroLock_);
+
+  if (!finished) {
+    stopOMEROTransfer(t);
+    removeOMEROTransferFile(t);
+    strcpy(errorMessage, "The transfer had not finished.");
+    result = DIGS_UNKNOWN_ERROR;
+  }
+  else if (t->result != DIGS_SUCCESS) {
+    // the thread has already removed anything it wrote
+    strcpy(errorMessage, t->errorMessage);
+    result = t->result;
+  }
+
+  destroyOMEROTransfer(t);
+  return result;
+}
+
+/***********************************************************************
+ * digs_error_code_t digs_getTransferChecksum_omero(char *errorMessage,
+ *		int handle, char **checksum)
+ * 
+ * Gets the MD5 checksum of the local file sent by a put that has
+ * finished, worked out from the data as it was sent.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 checksum		receives the checksum, to be freed with
+ * 					digs_free_string_omero								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferChecksum_omero(char *errorMessage, int handle,
+						 char **checksum)
+{
   errorMessage[0] = 0;
+  *checksum = NULL;
+
+  globus_thread_once(&omeroOnce_, initOMEROLock);
+
+  globus_mutex_lock(&omeroLock_);
+  omeroTransfer_t *t = findOMEROTransfer(errorMessage, handle);
+  if (t == NULL) {
+    globus_mutex_unlock(&omeroLock_);
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  if ((!t->put) || (!t->finished) || (t->result != DIGS_SUCCESS) || (t->md5[0] == 0)) {
+    globus_mutex_unlock(&omeroLock_);
+    strcpy(errorMessage, "The transfer has no checksum of what it sent.");
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  *checksum = safe_strdup(t->md5);
+  globus_mutex_unlock(&omeroLock_);
+  if (*checksum == NULL) {
+    errorExit("Out of memory in digs_getTransferChecksum_omero");
+  }
   return DIGS_SUCCESS;
 }
 
@@ -1134,8 +2405,16 @@ digs_error_code_t digs_endTransfer_omero(char *errorMessage, int handle)
  ***********************************************************************/
 digs_error_code_t digs_cancelTransfer_omero(char *errorMessage, int handle)
 {
-  // nothing to do, transfers are synchronous
   errorMessage[0] = 0;
+
+  omeroTransfer_t *t = claimOMEROTransfer(errorMessage, handle);
+  if (t == NULL) {
+    return DIGS_UNKNOWN_ERROR;
+  }
+
+  stopOMEROTransfer(t);
+  removeOMEROTransferFile(t);
+  destroyOMEROTransfer(t);
   return DIGS_SUCCESS;
 }
 
@@ -1218,23 +2497,56 @@ digs_error_code_t digs_startGetTransfer_omero(char *errorMessage,
     return DIGS_NO_CONNECTION;
   }
 
-  // do it synchronously for now
-  char *path = toOMEROName(SURL);
-  if (path == NULL) {
-    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not in correct path", SURL);
-    return DIGS_FILE_NOT_FOUND;
-  }
-  if (!doOMEROGet(path, localPath)) {
-    strcpy(errorMessage, "Error getting file from OMERO");
-    globus_libc_free(path);
-    return DIGS_UNSPECIFIED_SERVER_ERROR;
-  }
-  globus_libc_free(path);
+  return startOMEROTransfer(errorMessage, 0, SURL, localPath, NULL, 0, handle);
+}
+
+/***********************************************************************
+ *digs_error_code_t digs_startPeerRelayTransfer_omero(char *errorMessage,
+ *		const char *hostname, const char *SURL, const char *peerHost,
+ *		const char *peerURL, int toPeer, int *handle);
+ *
+ * Starts a copy between SURL and a file on a node of another type,
+ * given by the URL from that node's digs_getRelayURL, without staging
+ * it on local disk. A gsiftp:// file is read or written as a stream
+ * by the transfer's thread, block by block as it goes to or comes from
+ * OMERO. Ending the transfer reports whether the data matched at both
+ * ends.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 SURL 			the location of the file on hostname				I	
+ *   peerHost  		the FQDN of the node at the other end      			I	
+ * 	 peerURL		the URL of the file on peerHost						I
+ * 	 toPeer			set to copy SURL to peerURL, clear to copy
+ * 					peerURL to SURL										I
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startPeerRelayTransfer_omero(char *errorMessage,
+		const char *hostname, const char *SURL, const char *peerHost,
+		const char *peerURL, int toPeer, int *handle)
+{
+  *handle = -1;
 
-  *handle = nextHandle_++;
+  if (!omeroStartup(hostname)) {
+    strcpy(errorMessage, "Error connecting to OMERO");
+    return DIGS_NO_CONNECTION;
+  }
 
-  errorMessage[0] = 0;
-  return DIGS_SUCCESS;
+  // a node mounted here is read or written like a local file
+  if (!strncmp(peerURL, "file://", 7)) {
+    return startOMEROTransfer(errorMessage, !toPeer, SURL, peerURL + 7, peerHost, 0,
+			      handle);
+  }
+  if (strncmp(peerURL, "gsiftp://", 9)) {
+    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "Cannot relay to or from %s", peerURL);
+    return DIGS_UNKNOWN_ERROR;
+  }
+  return startOMEROTransfer(errorMessage, !toPeer, SURL, peerURL, peerHost, 1, handle);
 }
 
 /***********************************************************************
@@ -1294,7 +2606,11 @@ digs_error_code_t digs_rm_omero(char *errorMessage, const char *hostname,
     globus_libc_free(path);
     path = NULL;
 
-    updateService_->deleteObject(file);
+    if (!file) {
+      snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH, "File %s not found", filePath);
+      return DIGS_FILE_NOT_FOUND;
+    }
+    deleteOMEROFile(file->id->val);
   }
   catch (omero::ServerError se) {
     globus_libc_free(path);
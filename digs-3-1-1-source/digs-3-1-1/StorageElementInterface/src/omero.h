@@ -261,6 +261,52 @@ digs_error_code_t digs_getModificationTime_omero(char *errorMessage,
 		const char *filePath, const char *hostname,
 		time_t *modificationTime);
 
+/***********************************************************************
+ *  digs_error_code_t digs_stat_omero(char *errorMessage,
+ *		const char *filePath, const char *hostname, digs_stat_t *stat);
+ * 
+ *     Gets everything about a file the node can report, in a single
+ *     query of the OMERO server. Free the result with digs_freeStat.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 stat			the file's details									O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_stat_omero(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat);
+
+/***********************************************************************
+ *  digs_error_code_t digs_statMany_omero(char *errorMessage,
+ *		const char *hostname, int count, const char **filePaths,
+ * 		digs_stat_t *stats, digs_error_code_t *results);
+ * 
+ *     As digs_stat_omero for a list of files on one node. Each
+ *     file is looked up in turn over the one OMERO session.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 count			the number of files									I
+ * 	 filePaths		the full paths to the files							I
+ * 	 stats			array of count entries receiving the details		O
+ * 	 results		array of count entries receiving the result
+ * 					for each file										O
+ *    
+ *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+ *            code of the first failure, described in errorMessage
+ ***********************************************************************/
+digs_error_code_t digs_statMany_omero(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results);
+
 ///***********************************************************************
 //* partially implemented get_list.
 // ***********************************************************************/
@@ -342,13 +388,52 @@ digs_error_code_t digs_startCopyToInbox_omero(char *errorMessage,
  * 	 handle 			the id of the transfer								I
  * 	 status				the status of the transfer							O	
  * 	 percentComplete	percentage of the transfer that has been completed
- * 						In this implementation goes from 0 directly to 100	O					
+ * 						Reaches 100 only once the transfer has finished		O					
  *    
  *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
  ***********************************************************************/
 digs_error_code_t digs_monitorTransfer_omero(char *errorMessage, int handle, 
 		digs_transfer_status_t *status, int *percentComplete);
 
+/***********************************************************************
+ *digs_error_code_t digs_getTransferProgress_omero(char *errorMessage,
+ *		int handle, long long *bytes);
+ * 
+ * Gets how many bytes of a file a transfer has moved so far.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 bytes			receives the number of bytes moved					O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferProgress_omero(char *errorMessage, int handle,
+		long long *bytes);
+
+/***********************************************************************
+ * digs_error_code_t digs_waitForTransfers_omero(char *errorMessage,
+ *		int *handles, int count, float timeOut, int *completed)
+ * 
+ * Waits until one of several transfers finishes or the time out passes.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handles		the ids of the transfers							I
+ * 	 count			the number of transfers								I
+ * 	 timeOut		the longest to wait, in seconds						I
+ * 	 completed		index in handles of a finished transfer, or -1
+ * 					if none finished in time							O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_waitForTransfers_omero(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed);
+
 /***********************************************************************
  * digs_error_code_t digs_endTransfer_omero(char *errorMessage, int handle)
  * 
@@ -368,6 +453,26 @@ digs_error_code_t digs_monitorTransfer_omero(char *errorMessage, int handle,
  ***********************************************************************/
 digs_error_code_t digs_endTransfer_omero(char *errorMessage, int handle);
 
+/***********************************************************************
+ * digs_error_code_t digs_getTransferChecksum_omero(char *errorMessage,
+ *		int handle, char **checksum)
+ * 
+ * Gets the MD5 checksum of the local file sent by a put that has
+ * finished, worked out from the data as it was sent.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 checksum		receives the checksum, to be freed with
+ * 					digs_free_string_omero								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferChecksum_omero(char *errorMessage, int handle,
+		char **checksum);
+
 /***********************************************************************
  * digs_error_code_t digs_cancelTransfer_omero(char *errorMessage, int handle)
  * 
@@ -448,6 +553,36 @@ digs_error_code_t digs_startGetTransfer_omero(char *errorMessage,
 		const char *hostname, const char *SURL, const char *localPath,
 		int *handle);
 
+/***********************************************************************
+ *digs_error_code_t digs_startPeerRelayTransfer_omero(char *errorMessage,
+ *		const char *hostname, const char *SURL, const char *peerHost,
+ *		const char *peerURL, int toPeer, int *handle);
+ *
+ * Starts a copy between SURL and a file on a node of another type,
+ * given by the URL from that node's digs_getRelayURL, without staging
+ * it on local disk. A gsiftp:// file is read or written as a stream
+ * by the transfer's thread, block by block as it goes to or comes from
+ * OMERO. Ending the transfer reports whether the data matched at both
+ * ends.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 SURL 			the location of the file on hostname				I	
+ *   peerHost  		the FQDN of the node at the other end      			I	
+ * 	 peerURL		the URL of the file on peerHost						I
+ * 	 toPeer			set to copy SURL to peerURL, clear to copy
+ * 					peerURL to SURL										I
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startPeerRelayTransfer_omero(char *errorMessage,
+		const char *hostname, const char *SURL, const char *peerHost,
+		const char *peerURL, int toPeer, int *handle);
+
 /***********************************************************************
  * digs_error_code_t digs_mv_omero(char *errorMessage, const char *hostname, 
  * const char *filePathFrom, const char *filePathTo);
@@ -75,14 +75,15 @@ digs_error_code_t srm_gsiftp_thirdPartyCopy(char *errorMessage,
 	       sourceTurl, targetTurl);
     
     acquireTransactionListMutex();
-    t = newFtpTransaction("3rd party copy");
+    t = newFtpTransaction("3rd party copy", hostname);
     if (!t) {
 	releaseTransactionListMutex();
 	strcpy(errorMessage, "Error creating new FTP transaction");
 	return DIGS_UNKNOWN_ERROR;
     }
     
-    err = globus_ftp_client_third_party_transfer(&t->handle, sourceTurl,
+    setFtpThirdPartyAttributes(t, hostname, hostname);
+    err = globus_ftp_client_third_party_transfer(t->handle, sourceTurl,
 						 &t->attr, targetTurl,
 						 &t->attr2, NULL,
 						 completeCallback, t);
@@ -117,6 +118,27 @@ digs_error_code_t srm_gsiftp_thirdPartyCopy(char *errorMessage,
     return result;
 }
 
+/***********************************************************************
+ * int srm_gsiftp_waitForTransfers(int *handles, int count,
+ *                                 float timeOut)
+ * 
+ * Blocks until at least one of several GridFTP put/get transfers has
+ * finished, or the time out expires
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     handles        handles identifying the transfers           I
+ *     count          number of handles                           I
+ *     timeOut        longest time to wait, in seconds            I
+ * 
+ *   Returns: index into handles of a finished transfer, or -1 if none
+ *            finished in time
+ ***********************************************************************/
+int srm_gsiftp_waitForTransfers(int *handles, int count, float timeOut)
+{
+    return waitOnFtpMany(handles, count, timeOut);
+}
+
 /***********************************************************************
  * digs_error_code_t srm_gsiftp_cancelTransfer(char *errorMessage,
  *                                             int handle)
@@ -149,14 +171,14 @@ digs_error_code_t srm_gsiftp_cancelTransfer(char *errorMessage,
     }
     
     /* cancel gridftp operation */
-    if (globus_ftp_client_abort(&t->handle) != GLOBUS_SUCCESS) {
+    if (globus_ftp_client_abort(t->handle) != GLOBUS_SUCCESS) {
 	logMessage(WARN, "Error aborting FTP operation");
     }
     
     /* this will cause the callback to destroy the FTP transaction */
     t->waiting = 0;
     
-    if (!t->writing) {
+    if ((!t->writing) && (!t->inPlace)) {
 	/* for a get transfer, remove the downloaded file(s) */
 	if (safe_asprintf(&lockedPath, "%s-LOCKED", t->destFilepath) < 0) {
 	    errorExit("Out of memory in srm_gsiftp_cancelTransfer");
@@ -210,13 +232,25 @@ digs_error_code_t srm_gsiftp_endTransfer(char *errorMessage, int handle)
     /* if it failed, return the error */
     if (!t->succeeded) {
 	error = (globus_object_t *)t->error;
+	if ((!t->writing) && (!t->inPlace)) {
+	    /* keep what was received, so a retry can resume */
+	    if (safe_asprintf(&lockedPath, "%s-LOCKED", t->destFilepath) < 0) {
+		errorExit("Out of memory in srm_gsiftp_endTransfer");
+	    }
+	    keepPartialFtpRead(t, lockedPath);
+	    globus_libc_free(lockedPath);
+	}
 	destroyFtpTransaction(t);
 	releaseTransactionListMutex();
 	return getErrorAndMessageFromGlobus(error, errorMessage);
     }
 
-    if (t->writing) {
+    if (t->inPlace) {
+	/* range of a file - whoever put it together checks it */
+    }
+    else if (t->writing) {
 	/* put transfer completed. Checksum the uploaded file */
+	finishFtpDigest(t);
 	releaseTransactionListMutex();
 	
 	csum = globus_libc_malloc(CHECKSUM_LENGTH+1);
@@ -263,6 +297,87 @@ digs_error_code_t srm_gsiftp_endTransfer(char *errorMessage, int handle)
     return result;
 }
 
+/***********************************************************************
+ * digs_error_code_t srm_gsiftp_getTransferChecksum(char *errorMessage,
+ *                                                  int handle,
+ *                                                  char **checksum)
+ * 
+ * Gets the checksum of the local file a finished GridFTP put sent
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage   buffer to receive error message               O
+ *     handle         handle identifying transfer                 I
+ *     checksum       receives the checksum, to be freed by the     O
+ *                    caller
+ * 
+ *   Returns: DiGS error code
+ ***********************************************************************/
+digs_error_code_t srm_gsiftp_getTransferChecksum(char *errorMessage,
+						 int handle,
+						 char **checksum)
+{
+    ftpTransaction_t *t;
+    
+    logMessage(DEBUG, "srm_gsiftp_getTransferChecksum(%d)", handle);
+    *checksum = NULL;
+    
+    acquireTransactionListMutex();
+    t = findTransaction(handle);
+    if (!t) {
+	releaseTransactionListMutex();
+	strcpy(errorMessage,
+	       "Invalid handle passed to srm_gsiftp_getTransferChecksum");
+	return DIGS_UNKNOWN_ERROR;
+    }
+    
+    if ((!t->writing) || (!t->reachedEnd) || (!finishFtpDigest(t))) {
+	releaseTransactionListMutex();
+	strcpy(errorMessage, "Transfer has no checksum of what it sent");
+	return DIGS_UNKNOWN_ERROR;
+    }
+    
+    *checksum = safe_strdup(t->checksum);
+    releaseTransactionListMutex();
+    return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+ * digs_error_code_t srm_gsiftp_getTransferProgress(char *errorMessage,
+ *                                                  int handle,
+ *                                                  long long *bytes)
+ * 
+ * Gets how many bytes a GridFTP put/get has moved so far
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage      buffer to receive error message            O
+ *     handle            handle identifying transfer              I
+ *     bytes             receives the number of bytes moved         O
+ * 
+ *   Returns: DiGS error code
+ ***********************************************************************/
+digs_error_code_t srm_gsiftp_getTransferProgress(char *errorMessage,
+						 int handle,
+						 long long *bytes)
+{
+    ftpTransaction_t *t;
+
+    *bytes = 0;
+
+    acquireTransactionListMutex();
+    t = findTransaction(handle);
+    if (!t) {
+	releaseTransactionListMutex();
+	strcpy(errorMessage,
+	       "Invalid transaction handle passed to srm_gsiftp_getTransferProgress");
+	return DIGS_UNKNOWN_ERROR;
+    }
+    *bytes = (long long)t->transferred;
+    releaseTransactionListMutex();
+    return DIGS_SUCCESS;
+}
+
 /***********************************************************************
  * digs_error_code_t
  * srm_gsiftp_monitorTransfer(char *errorMessage,
@@ -353,7 +468,6 @@ digs_error_code_t srm_gsiftp_startPutTransfer(char *errorMessage,
     digs_error_code_t result = DIGS_SUCCESS;
     ftpTransaction_t *t;
     globus_object_t *errorObject;
-    char *csum;
     
     logMessage(DEBUG, "srm_gsiftp_startPutTransfer(%s,%s,%s)", hostname,
 	       turl, localFile);
@@ -362,21 +476,17 @@ digs_error_code_t srm_gsiftp_startPutTransfer(char *errorMessage,
     
     /* get FTP transaction */
     acquireTransactionListMutex();
-    t = newFtpTransaction("write");
+    t = newFtpTransaction("write", hostname);
     if (!t) {
 	releaseTransactionListMutex();
 	strcpy(errorMessage, "Error creating new FTP write transaction");
 	return DIGS_UNKNOWN_ERROR;
     }
     
-    t->buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
-    if (!t->buffer) {
-	errorExit("Out of memory in srm_gsiftp_startPutTransfer");
-    }
-    
-    /* get local checksum for comparison after transfer */
-    getChecksum(localFile, &csum);
-    t->checksum = csum; /* will be freed when transaction destroyed */
+    /*
+     * the local checksum for comparison after the transfer is worked
+     * out as the data is sent (see finishFtpDigest)
+     */
     
     /*
      * it should be safe to put a URL in here as the low level gridftp
@@ -385,8 +495,12 @@ digs_error_code_t srm_gsiftp_startPutTransfer(char *errorMessage,
     t->destFilepath = safe_strdup(turl);
     t->hostname = safe_strdup(hostname);
     
-    /* start the put operation */
-    err = globus_ftp_client_put(&t->handle, turl, &t->attr, NULL,
+    /*
+     * start the put operation. Each srmPrepareToPut hands out a new
+     * TURL, so there is never a partial upload to resume
+     */
+    setFtpTransferAttributes(&t->attr, hostname);
+    err = globus_ftp_client_put(t->handle, turl, &t->attr, NULL,
 				replicateCompleteCallback, t);
     if (err != GLOBUS_SUCCESS) {
 	destroyFtpTransaction(t);
@@ -396,9 +510,9 @@ digs_error_code_t srm_gsiftp_startPutTransfer(char *errorMessage,
     }
     
     /* start sending the data */
-    if (!startFtpWrite(localFile, t, errorMessage)) {
+    if (!startFtpWrite(localFile, t, 0, errorMessage)) {
 	releaseTransactionListMutex();
-	globus_ftp_client_abort(&t->handle);
+	globus_ftp_client_abort(t->handle);
 	return DIGS_UNKNOWN_ERROR;
     }
     releaseTransactionListMutex();
@@ -438,6 +552,8 @@ digs_error_code_t srm_gsiftp_startGetTransfer(char *errorMessage,
     char *csum;
     char *lockedPath;
     digs_error_code_t result;
+    globus_off_t restartOffset;
+    globus_ftp_client_restart_marker_t restartMarker;
     
     logMessage(DEBUG, "srm_gsiftp_startGetTransfer(%s,%s,%s)", hostname,
 	       turl, localFile);
@@ -452,44 +568,48 @@ digs_error_code_t srm_gsiftp_startGetTransfer(char *errorMessage,
 	return result;
     }
     
+    if (safe_asprintf(&lockedPath, "%s-LOCKED", localFile) < 0) {
+	errorExit("Out of memory in srm_gsiftp_startGetTransfer");
+    }
+
+    /* a gsiftp TURL can carry on from an earlier partial download */
+    restartOffset = getFtpRestartOffset(turl, hostname, lockedPath, 0);
+    
     /* create the FTP transaction */
     acquireTransactionListMutex();
-    t = newFtpTransaction("read");
+    t = newFtpTransaction("read", hostname);
     if (!t) {
 	releaseTransactionListMutex();
 	globus_libc_free(csum);
+	globus_libc_free(lockedPath);
 	strcpy(errorMessage, "Creating FTP transaction failed");
 	return DIGS_UNKNOWN_ERROR;
     }
     
-    /* allocate the buffer */
-    t->buffer = globus_libc_malloc(FTP_DATA_BUFFER_SIZE);
-    if (!t->buffer) {
-	errorExit("Out of memory in srm_gsiftp_startGetTransfer");
-    }
-    
     /* initialise other fields of structure */
     t->destFilepath = safe_strdup(localFile);
     t->hostname = safe_strdup(hostname);
     t->checksum = csum;
     
     /* initiate actual gridftp transfer */
-    err = globus_ftp_client_get(&t->handle, turl, &t->attr, NULL,
+    setFtpTransferAttributes(&t->attr, hostname);
+    err = globus_ftp_client_get(t->handle, turl, &t->attr,
+				setFtpRestartMarker(&restartMarker, restartOffset),
 				replicateCompleteCallback, t);
+    if (restartOffset > 0) {
+	globus_ftp_client_restart_marker_destroy(&restartMarker);
+    }
     if (err != GLOBUS_SUCCESS) {
 	destroyFtpTransaction(t);
 	releaseTransactionListMutex();
+	globus_libc_free(lockedPath);
 	errorObject = globus_error_get(err);
 	return getErrorAndMessageFromGlobus(errorObject, errorMessage);
     }
     
-    if (safe_asprintf(&lockedPath, "%s-LOCKED", localFile) < 0) {
-	errorExit("Out of memory in srm_gsiftp_startGetTransfer");
-    }
-    
     /* and start reading data */
-    if (!startFtpRead(lockedPath, t, errorMessage)) {
-	globus_ftp_client_abort(&t->handle);
+    if (!startFtpRead(lockedPath, t, restartOffset, errorMessage)) {
+	globus_ftp_client_abort(t->handle);
 	destroyFtpTransaction(t);
 	releaseTransactionListMutex();
 	globus_libc_free(lockedPath);
@@ -504,6 +624,202 @@ digs_error_code_t srm_gsiftp_startGetTransfer(char *errorMessage,
 }
 
 
+/***********************************************************************
+ * digs_error_code_t
+ * srm_gsiftp_startRelayTransfer(char *errorMessage,
+ *                               char *hostname,
+ *                               char *turl,
+ *                               const char *peerHost,
+ *                               const char *peerUrl,
+ *                               int toPeer,
+ *                               int *handle)
+ * 
+ * Initiates a GridFTP relay between a TURL and a file on another
+ * GridFTP server, streamed through this process. The transfer is
+ * monitored and ended like a put; ending it checks the copy against
+ * the checksum the source had when the relay started
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage      buffer to receive error message            O
+ *     hostname          FQDN of host the TURL is on              I
+ *     turl              transfer URL of the SRM file             I
+ *     peerHost          FQDN of the other GridFTP server         I
+ *     peerUrl           gsiftp URL of the file on peerHost       I
+ *     toPeer            set to copy from the TURL to peerUrl,    I
+ *                       clear to copy the other way
+ *     handle            receives handle identifying transfer       O
+ * 
+ *   Returns: DiGS error code
+ ***********************************************************************/
+digs_error_code_t srm_gsiftp_startRelayTransfer(char *errorMessage,
+						char *hostname,
+						char *turl,
+						const char *peerHost,
+						const char *peerUrl,
+						int toPeer,
+						int *handle)
+{
+    const char *fromHost, *fromUrl, *toHost, *toUrl;
+    digs_error_code_t result;
+    char *csum;
+    
+    logMessage(DEBUG, "srm_gsiftp_startRelayTransfer(%s,%s,%s,%s,%d)",
+	       hostname, turl, peerHost, peerUrl, toPeer);
+    *handle = -1;
+    
+    if (toPeer) {
+	fromHost = hostname;
+	fromUrl = turl;
+	toHost = peerHost;
+	toUrl = peerUrl;
+    }
+    else {
+	fromHost = peerHost;
+	fromUrl = peerUrl;
+	toHost = hostname;
+	toUrl = turl;
+    }
+    
+    /* there's no local copy, so the source's checksum is the reference */
+    csum = globus_libc_malloc(CHECKSUM_LENGTH+1);
+    if (!csum) {
+	errorExit("Out of memory in srm_gsiftp_startRelayTransfer");
+    }
+    csum[0] = 0;
+    result = srm_gsiftp_checksum(errorMessage, (char *)fromUrl, &csum);
+    if (result != DIGS_SUCCESS) {
+	globus_libc_free(csum);
+	return result;
+    }
+    
+    /*
+     * the destination URL is kept for srm_gsiftp_endTransfer to
+     * checksum, as for a put
+     */
+    return startFtpUrlRelay(errorMessage, fromHost, fromUrl, toHost, toUrl,
+			    csum, toUrl, handle);
+}
+
+
+/***********************************************************************
+ * digs_error_code_t
+ * srm_gsiftp_startGetRangeTransfer(char *errorMessage,
+ *                                  char *hostname,
+ *                                  char *turl,
+ *                                  char *localFile,
+ *                                  long long offset,
+ *                                  long long length,
+ *                                  int *handle)
+ * 
+ * Initiates a partial GridFTP get, writing the range into place in an
+ * existing local file. The range isn't checksummed
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage      buffer to receive error message            O
+ *     hostname          FQDN of host to transfer from            I
+ *     turl              transfer URL of remote file              I
+ *     localFile         full path to local file                  I
+ *     offset            where the range starts                   I
+ *     length            length of the range                      I
+ *     handle            receives handle identifying transfer       O
+ * 
+ *   Returns: DiGS error code
+ ***********************************************************************/
+digs_error_code_t srm_gsiftp_startGetRangeTransfer(char *errorMessage,
+						   char *hostname,
+						   char *turl,
+						   char *localFile,
+						   long long offset,
+						   long long length,
+						   int *handle)
+{
+    globus_result_t err;
+    globus_object_t *errorObject;
+    ftpTransaction_t *t;
+    
+    logMessage(DEBUG, "srm_gsiftp_startGetRangeTransfer(%s,%s,%s,%lld,%lld)",
+	       hostname, turl, localFile, offset, length);
+    *handle = -1;
+    
+    /* create the FTP transaction */
+    acquireTransactionListMutex();
+    t = newFtpTransaction("read", hostname);
+    if (!t) {
+	releaseTransactionListMutex();
+	strcpy(errorMessage, "Creating FTP transaction failed");
+	return DIGS_UNKNOWN_ERROR;
+    }
+    
+    /* initialise other fields of structure */
+    t->destFilepath = safe_strdup(localFile);
+    t->hostname = safe_strdup(hostname);
+    
+    /* initiate actual gridftp transfer */
+    setFtpTransferAttributes(&t->attr, hostname);
+    err = globus_ftp_client_partial_get(t->handle, turl, &t->attr, NULL,
+					(globus_off_t)offset,
+					(globus_off_t)(offset + length),
+					replicateCompleteCallback, t);
+    if (err != GLOBUS_SUCCESS) {
+	destroyFtpTransaction(t);
+	releaseTransactionListMutex();
+	errorObject = globus_error_get(err);
+	return getErrorAndMessageFromGlobus(errorObject, errorMessage);
+    }
+    
+    /* and start writing the data into place */
+    if (!startFtpReadRange(localFile, t, (globus_off_t)offset, errorMessage)) {
+	globus_ftp_client_abort(t->handle);
+	destroyFtpTransaction(t);
+	releaseTransactionListMutex();
+	return DIGS_UNKNOWN_ERROR;
+    }
+    
+    /* return handle to caller */
+    *handle = t->id;
+    releaseTransactionListMutex();
+    return DIGS_SUCCESS;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t srm_gsiftp_getLength(char *errorMessage,
+ *                                        const char *hostname,
+ *                                        const char *url,
+ *                                        long long *length)
+ * 
+ * Gets the length of a file on a GridFTP server.
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage   buffer to receive error message               O
+ *     hostname       FQDN of the server                          I
+ *     url            gsiftp URL for the file                     I
+ *     length         receives the length in bytes                  O
+ * 
+ *   Returns: DiGS error code
+ ***********************************************************************/
+digs_error_code_t srm_gsiftp_getLength(char *errorMessage,
+				       const char *hostname,
+				       const char *url,
+				       long long *length)
+{
+    globus_off_t size;
+    
+    logMessage(DEBUG, "srm_gsiftp_getLength(%s,%s)", hostname, url);
+    
+    *length = -1;
+    if (!getFtpUrlLength(url, hostname, &size)) {
+	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+		 "Cannot get length of %s", url);
+	return DIGS_UNKNOWN_ERROR;
+    }
+    *length = (long long)size;
+    return DIGS_SUCCESS;
+}
+
 /***********************************************************************
  * digs_error_code_t srm_gsiftp_checksum(char *errorMessage,
  *                                       char *turl,
@@ -535,13 +851,13 @@ digs_error_code_t srm_gsiftp_checksum(char *errorMessage, char *turl,
     
     /* initiate checksum operation */
     acquireTransactionListMutex();
-    t = newFtpTransaction("get remote file checksum");
+    t = newFtpTransaction("get remote file checksum", NULL);
     if (!t) {
 	releaseTransactionListMutex();
 	return DIGS_UNKNOWN_ERROR;
     }
     
-    err = globus_ftp_client_cksm(&t->handle, turl, &t->attr, *fileChecksum,
+    err = globus_ftp_client_cksm(t->handle, turl, &t->attr, *fileChecksum,
 				 0, -1, "MD5", completeCallback, t);
     if (err != GLOBUS_SUCCESS) {
 	destroyFtpTransaction(t);
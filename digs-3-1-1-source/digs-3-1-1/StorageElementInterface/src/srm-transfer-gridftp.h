@@ -46,6 +46,14 @@
 digs_error_code_t srm_gsiftp_checksum(char *errorMessage, char *turl,
 				      char **fileChecksum);
 
+/*
+ * Gets the length of a remote file
+ */
+digs_error_code_t srm_gsiftp_getLength(char *errorMessage,
+				       const char *hostname,
+				       const char *url,
+				       long long *length);
+
 /*
  * Initiates a get transfer
  */
@@ -55,6 +63,28 @@ digs_error_code_t srm_gsiftp_startGetTransfer(char *errorMessage,
 					      char *localFile,
 					      int *handle);
 
+/*
+ * Initiates a get of part of a file, written into place locally
+ */
+digs_error_code_t srm_gsiftp_startGetRangeTransfer(char *errorMessage,
+						   char *hostname,
+						   char *turl,
+						   char *localFile,
+						   long long offset,
+						   long long length,
+						   int *handle);
+
+/*
+ * Initiates a relay between a TURL and a file on another GridFTP server
+ */
+digs_error_code_t srm_gsiftp_startRelayTransfer(char *errorMessage,
+						char *hostname,
+						char *turl,
+						const char *peerHost,
+						const char *peerUrl,
+						int toPeer,
+						int *handle);
+
 /*
  * Gets the status of a transfer in progress
  */
@@ -68,6 +98,25 @@ srm_gsiftp_monitorTransfer(char *errorMessage, int handle,
  */
 digs_error_code_t srm_gsiftp_endTransfer(char *errorMessage, int handle);
 
+/*
+ * Gets how many bytes a transfer has moved so far
+ */
+digs_error_code_t srm_gsiftp_getTransferProgress(char *errorMessage,
+						 int handle,
+						 long long *bytes);
+
+/*
+ * Gets the checksum of the data a put sent, worked out as it went
+ */
+digs_error_code_t srm_gsiftp_getTransferChecksum(char *errorMessage,
+						 int handle,
+						 char **checksum);
+
+/*
+ * Waits for one of several transfers to finish
+ */
+int srm_gsiftp_waitForTransfers(int *handles, int count, float timeOut);
+
 /*
  * Cancels a transfer in progress
  */
@@ -38,10 +38,42 @@
 /* delete files from inbox if they're still there after 2 days */
 #define INBOX_DELETION_TIME (48.0 * 60.0 * 60.0)
 
+/* most SURLs digs_statMany_srm puts in one srmLs request */
+#define SRM_MAX_STAT_PATHS 100
+
+/* most files put in one srmPrepareToPut or srmPrepareToGet request */
+#define SRM_MAX_REQUEST_FILES 100
+
+/*
+ * A request still waiting for TURLs is polled after SRM_MIN_POLL_INTERVAL
+ * seconds, then at doubling intervals up to SRM_MAX_POLL_INTERVAL, unless
+ * the server estimates how long it will be
+ */
+#define SRM_MIN_POLL_INTERVAL 0.5
+#define SRM_MAX_POLL_INTERVAL 60.0
+
+/*
+ * Most connections kept open to one SRM node at once, unless its
+ * "srmconnections" property says otherwise. A connection left idle for
+ * longer than SRM_MAX_IDLE_TIME seconds is closed rather than reused,
+ * as the server has probably dropped it by then
+ */
+#define SRM_DEFAULT_CONNECTIONS 4
+#define SRM_MAX_IDLE_TIME 60.0
+
+/*
+ * Directories are listed SRM_LS_PAGE_SIZE entries at a time. If the
+ * server says that is too many, the page is halved, down to
+ * SRM_LS_MIN_PAGE_SIZE
+ */
+#define SRM_LS_PAGE_SIZE 1000
+#define SRM_LS_MIN_PAGE_SIZE 16
+
 #include "misc.h"
 #include "node.h"
 #include "srm.h"
 #include "srm-transfer-gridftp.h"
+#include "handletable.h"
 
 #include "soapH.h"
 #include "gsi.h"
@@ -52,19 +84,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+/*
+ * An open connection to an SRM node that nobody is using
+ */
+typedef struct srm_connection_s
+{
+    struct soap *soap;
+    double lastUsed;
+} srm_connection_t;
 
 /*
- * Information and soap structures for each SRM node used so far
+ * Information and pool of soap structures for each SRM node used so
+ * far. Each thread calling the node checks a structure out of the pool
+ * for the duration of the call, so several calls can be in progress at
+ * once, and the connections are kept alive between calls
  */
 typedef struct srm_node_info_s
 {
     char *hostname;
-    struct soap soap;
     char *endpoint;
+
+    /*
+     * Set up with the GSI plugin and credential, but never used for a
+     * call itself. The structures in the pool are copies of it
+     */
+    struct soap soap;
+
+    /* most structures allowed, and number that exist now */
+    int maxConnections;
+    int numConnections;
+
+    /* structures not checked out, most recently used last */
+    int numIdle;
+    srm_connection_t *idle;
+
+    /* signalled whenever a structure goes back into the pool */
+    globus_cond_t returned;
 } srm_node_info_t;
 
+/*
+ * Nodes never move once they have been added, as other threads may be
+ * waiting on them. srmPoolLock_ protects the list and all the pools
+ */
 static int numSrmNodes_ = 0;
-static srm_node_info_t *srmNodes_ = NULL;
+static srm_node_info_t **srmNodes_ = NULL;
+
+static globus_mutex_t srmPoolLock_;
+static globus_thread_once_t srmPoolOnce_ = GLOBUS_THREAD_ONCE_INIT;
+
+/*
+ * Protects the transfers and the requests they share. A transfer found
+ * from its handle may only be used while this is held, and its handle
+ * is released under it before it is freed, so that no other thread can
+ * still be using it. Take it before srmPoolLock_, never after, and
+ * don't hold a pooled connection while waiting for it
+ */
+static globus_mutex_t srmTransferLock_;
 
 /*
  * Information on transfers in progress
@@ -73,6 +152,47 @@ enum { DIGS_SRM_GET_TRANSFER, DIGS_SRM_PUT_TRANSFER };
 enum { DIGS_SRM_WAITING_FOR_TURL, DIGS_SRM_WAITING_FOR_GRIDFTP,
        DIGS_SRM_FINISHED, DIGS_SRM_ERROR };
 
+/*
+ * A prepare request sent to an SRM server. It is shared by the
+ * transfers of all the files it asked for, and polling it gets the
+ * status of every one of them at once
+ */
+typedef struct srm_request_s
+{
+    /* hostname request was sent to */
+    char *hostname;
+
+    /* SRM request token */
+    char *token;
+
+    /* get, put */
+    int type;
+
+    /* part of the file a get fetches, written into place in localFile.
+     * rangeLength is -1 to get the whole file */
+    long long rangeOffset;
+    long long rangeLength;
+
+    /* number of transfers still using this request */
+    int refCount;
+
+    /* number of files, their SURLs and, once ready, their TURLs */
+    int count;
+    char **surls;
+    char **turls;
+
+    /* result of each file, and a message for each one that failed */
+    digs_error_code_t *results;
+    char **messages;
+
+    /* number of files with neither a TURL nor an error yet */
+    int pending;
+
+    /* when to poll next, and the interval that was scheduled with */
+    double nextPoll;
+    double interval;
+} srm_request_t;
+
 typedef struct srm_transfer_s
 {
     /* DiGS handle for transfer */
@@ -90,28 +210,33 @@ typedef struct srm_transfer_s
     /* local filename transfer is from/to */
     char *localFile;
 
+    /* for a relay, the GridFTP node at the other end. localFile is then
+     * the gsiftp URL of the file there, not a local path */
+    char *peerHost;
+
     /* full path to remote file */
     char *remoteFile;
 
     /* SRM request token */
     char *token;
 
+    /* request the transfer's TURL comes from, and its file's index in it */
+    srm_request_t *request;
+    int fileIndex;
+
     /* get, put */
     int type;
 
+    /* part of the file a get fetches, written into place in localFile.
+     * rangeLength is -1 to get the whole file */
+    long long rangeOffset;
+    long long rangeLength;
+
     /* waiting for TURL, waiting for gridftp operation */
     int status;
 } srm_transfer_t;
 
-static int numSrmTransfers_ = 0;
-static srm_transfer_t *srmTransfers_ = NULL;
-
-/*
- * GridFTP adaptor allocates handles starting from 0, so allocate
- * them independently starting from 1 billion to keep them
- * distinctive
- */
-static int nextSrmHandle_ = 1000000000;
+static void releaseSrmRequest(srm_request_t *r);
 
 /***********************************************************************
  * srm_transfer_t *newSrmTransfer(char *hostname, char *localFile,
@@ -137,23 +262,31 @@ static srm_transfer_t *newSrmTransfer(const char *hostname,
 	       type);
 
     /* allocate new transfer structure */
-    numSrmTransfers_++;
-    srmTransfers_ = realloc(srmTransfers_,
-			    numSrmTransfers_*sizeof(srm_transfer_t));
-    t = &srmTransfers_[numSrmTransfers_-1];
+    t = globus_libc_malloc(sizeof(srm_transfer_t));
+    if (!t) {
+	errorExit("Out of memory in newSrmTransfer");
+    }
   
     /* get a handle */
-    t->handle = nextSrmHandle_;
-    nextSrmHandle_++;
+    t->handle = allocateTransferHandle(HANDLE_OWNER_SRM, t);
+    if (t->handle < 0) {
+	globus_libc_free(t);
+	return NULL;
+    }
     
     /* initialise */
     t->hostname = safe_strdup(hostname);
     t->localFile = safe_strdup(localFile);
+    t->peerHost = NULL;
     t->gid = -1;
     t->remoteFile = NULL;
     t->turl = NULL;
     t->token = NULL;
+    t->request = NULL;
+    t->fileIndex = -1;
     t->type = type;
+    t->rangeOffset = 0;
+    t->rangeLength = -1;
     t->status = DIGS_SRM_WAITING_FOR_TURL;
     
     return t;
@@ -162,7 +295,8 @@ static srm_transfer_t *newSrmTransfer(const char *hostname,
 /***********************************************************************
  * srm_transfer_t *findSrmTransfer(int handle)
  * 
- * Finds an existing SRM transfer given its handle
+ * Finds an existing SRM transfer given its handle. Caller must hold
+ * srmTransferLock_, and only use the transfer until releasing it
  * 
  *   Parameters:                                                 [I/O]
  *
@@ -172,70 +306,255 @@ static srm_transfer_t *newSrmTransfer(const char *hostname,
  ***********************************************************************/
 static srm_transfer_t *findSrmTransfer(int handle)
 {
-    srm_transfer_t *t = NULL;
-    int i;
-    
     logMessage(DEBUG, "findSrmTransfer(%d)", handle);
     
-    for (i = 0; i < numSrmTransfers_; i++) {
-	if (srmTransfers_[i].handle == handle) {
-	    t = &srmTransfers_[i];
-	    break;
-	}
+    return lookupTransferHandle(HANDLE_OWNER_SRM, handle);
+}
+
+/***********************************************************************
+ * srm_transfer_t *claimSrmTransfer(int handle)
+ * 
+ * Finds an existing SRM transfer given its handle and releases the
+ * handle, so that the caller has the transfer to itself and can end it.
+ * Caller must hold srmTransferLock_
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     handle   handle identifying the transfer                   I
+ * 
+ *   Returns: pointer to transfer on success, NULL on error
+ ***********************************************************************/
+static srm_transfer_t *claimSrmTransfer(int handle)
+{
+    srm_transfer_t *t;
+
+    t = findSrmTransfer(handle);
+    if (t) {
+	releaseTransferHandle(HANDLE_OWNER_SRM, handle);
     }
     return t;
 }
 
 /***********************************************************************
- * void destroySrmTransfer(int handle)
+ * void destroySrmTransfer(srm_transfer_t *t)
  * 
- * Frees an existing SRM transfer given its handle
+ * Frees an SRM transfer claimed with claimSrmTransfer
  * 
  *   Parameters:                                                 [I/O]
  *
- *     handle   handle identifying the transfer                   I
+ *     t        the transfer                                      I
  * 
  *   Returns: (void)
  ***********************************************************************/
-static void destroySrmTransfer(int handle)
+static void destroySrmTransfer(srm_transfer_t *t)
+{
+    logMessage(DEBUG, "destroySrmTransfer(%d)", t->handle);
+    
+    if (t->hostname)
+	globus_libc_free(t->hostname);
+    if (t->localFile)
+	globus_libc_free(t->localFile);
+    if (t->peerHost)
+	globus_libc_free(t->peerHost);
+    if (t->turl)
+	globus_libc_free(t->turl);
+    if (t->token)
+	globus_libc_free(t->token);
+    if (t->remoteFile)
+	globus_libc_free(t->remoteFile);
+    if (t->request) {
+	/* other transfers may still be using the request */
+	globus_mutex_lock(&srmTransferLock_);
+	releaseSrmRequest(t->request);
+	globus_mutex_unlock(&srmTransferLock_);
+    }
+    globus_libc_free(t);
+}
+
+/***********************************************************************
+ * double srmTimeNow()
+ *
+ * Gets the current time, for scheduling polls of SRM
+ * requests and expiring idle connections
+ *
+ *   Returns: seconds since the epoch
+ ***********************************************************************/
+static double srmTimeNow()
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)now.tv_sec + ((double)now.tv_usec / 1000000.0);
+}
+
+/***********************************************************************
+ *   void initSrmPool()
+ * 
+ *     Creates the locks protecting the connection pools and the
+ *     transfers. Run once, by whichever thread needs them first
+ ***********************************************************************/
+static void initSrmPool()
+{
+    globus_mutex_init(&srmPoolLock_, NULL);
+    globus_mutex_init(&srmTransferLock_, NULL);
+}
+
+/***********************************************************************
+ *   void lockSrmTransfers()
+ * 
+ *     Takes srmTransferLock_, creating it first if need be
+ ***********************************************************************/
+static void lockSrmTransfers()
+{
+    globus_thread_once(&srmPoolOnce_, initSrmPool);
+    globus_mutex_lock(&srmTransferLock_);
+}
+
+/***********************************************************************
+ *   srm_node_info_t *findSrmNode(const char *hostname)
+ * 
+ *     Looks up a node that has been used before. Caller must hold
+ *     srmPoolLock_
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     hostname   FQDN of the node                                I
+ * 
+ *   Returns: the node's information, or NULL if it isn't known yet
+ ***********************************************************************/
+static srm_node_info_t *findSrmNode(const char *hostname)
 {
     int i;
 
-    logMessage(DEBUG, "destroySrmTransfer(%d)", handle);
+    for (i = 0; i < numSrmNodes_; i++) {
+	if (!strcmp(hostname, srmNodes_[i]->hostname)) {
+	    return srmNodes_[i];
+	}
+    }
+    return NULL;
+}
+
+/***********************************************************************
+ *   srm_node_info_t *addSrmNode(const char *hostname)
+ * 
+ *     Sets up the template soap structure for a node not used before,
+ *     acquiring the credential that all its connections will share,
+ *     and adds it to the list. Caller must hold srmPoolLock_
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     hostname   FQDN of the node                                I
+ * 
+ *   Returns: the node's information, or NULL on error
+ ***********************************************************************/
+static srm_node_info_t *addSrmNode(const char *hostname)
+{
+    srm_node_info_t *node;
+    srm_node_info_t **newNodes;
+    char *prop;
     
-    for (i = 0; i < numSrmTransfers_; i++) {
-	if (srmTransfers_[i].handle == handle) {
-	    break;
+    /* get SRM node info from DiGS config */
+    prop = getNodeProperty(hostname, "endpoint");
+    if (!prop) {
+	logMessage(ERROR, "SRM node %s has no endpoint property",
+		   hostname);
+	return NULL;
+    }
+    
+    node = globus_libc_malloc(sizeof(srm_node_info_t));
+    if (!node) {
+	errorExit("Out of memory in addSrmNode");
+    }
+    node->hostname = safe_strdup(hostname);
+    if (!node->hostname) {
+	errorExit("Out of memory in addSrmNode");
+    }
+    node->endpoint = prop;
+    
+    node->maxConnections = SRM_DEFAULT_CONNECTIONS;
+    prop = getNodeProperty(hostname, "srmconnections");
+    if (prop) {
+	if (atoi(prop) > 0) {
+	    node->maxConnections = atoi(prop);
 	}
+	globus_libc_free(prop);
     }
-    if (i >= numSrmTransfers_) {
-	/* didn't find it */
-	return;
+    node->numConnections = 0;
+    node->numIdle = 0;
+    node->idle = globus_libc_malloc(node->maxConnections *
+				    sizeof(srm_connection_t));
+    if (!node->idle) {
+	errorExit("Out of memory in addSrmNode");
+    }
+    
+    /* initialise GSOAP, keeping connections open between calls */
+    soap_init2(&node->soap, SOAP_IO_KEEPALIVE, SOAP_IO_KEEPALIVE);
+    
+    /* initialise GSI plugin */
+    if (soap_register_plugin(&node->soap, globus_gsi)) {
+	logMessage(ERROR, "Error registering GSOAP GSI plugin");
+	soap_done(&node->soap);
+	globus_libc_free(node->idle);
+	globus_libc_free(node->endpoint);
+	globus_libc_free(node->hostname);
+	globus_libc_free(node);
+	return NULL;
+    }
+    
+    if (gsi_acquire_credential(&node->soap) < 0) {
+	logMessage(ERROR, "Error acquiring credential in GSI plugin");
+	soap_done(&node->soap);
+	globus_libc_free(node->idle);
+	globus_libc_free(node->endpoint);
+	globus_libc_free(node->hostname);
+	globus_libc_free(node);
+	return NULL;
     }
     
-    if (srmTransfers_[i].hostname)
-	globus_libc_free(srmTransfers_[i].hostname);
-    if (srmTransfers_[i].localFile)
-	globus_libc_free(srmTransfers_[i].localFile);
-    if (srmTransfers_[i].turl)
-	globus_libc_free(srmTransfers_[i].turl);
-    if (srmTransfers_[i].token)
-	globus_libc_free(srmTransfers_[i].token);
-    if (srmTransfers_[i].remoteFile)
-	globus_libc_free(srmTransfers_[i].remoteFile);
+    globus_cond_init(&node->returned, NULL);
     
-    numSrmTransfers_--;
-    for (; i < numSrmTransfers_; i++) {
-	srmTransfers_[i] = srmTransfers_[i+1];
+    newNodes = globus_libc_realloc(srmNodes_, (numSrmNodes_ + 1) *
+				   sizeof(srm_node_info_t *));
+    if (!newNodes) {
+	errorExit("Out of memory in addSrmNode");
     }
+    srmNodes_ = newNodes;
+    srmNodes_[numSrmNodes_] = node;
+    numSrmNodes_++;
+    
+    return node;
+}
+
+/***********************************************************************
+ *   void closeSrmConnection(srm_node_info_t *node, struct soap *soap)
+ * 
+ *     Closes one of a node's connections and frees its soap structure.
+ *     Caller must hold srmPoolLock_
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     node       node the connection is to                      I/O
+ *     soap       structure to free                               I
+ * 
+ *   Returns: (void)
+ ***********************************************************************/
+static void closeSrmConnection(srm_node_info_t *node, struct soap *soap)
+{
+    soap_free(soap);
+    node->numConnections--;
 }
 
 /***********************************************************************
  *   int srmInit(char *hostname, struct soap **soap, char **endpoint)
  * 
- *     Prepares to access the SRM server on the specified host. Caller
- *     should not free anything returned from this function, but should
- *     call srmDone when finished with it.
+ *     Prepares to access the SRM server on the specified host, checking
+ *     a soap structure out of the host's pool. An idle connection is
+ *     reused if there is one; otherwise a new one is opened, unless the
+ *     host already has as many as it is allowed, in which case this
+ *     waits for another thread to finish with one. Caller should not
+ *     free anything returned from this function, but must call srmDone
+ *     when finished with it, and must not call srmInit again for the
+ *     same host before then.
  * 
  *   Parameters:                                                 [I/O]
  *
@@ -248,66 +567,64 @@ static void destroySrmTransfer(int handle)
 static int srmInit(const char *hostname, struct soap **soap,
 		   char **endpoint)
 {
-    int i;
+    srm_node_info_t *node;
+    struct soap *s = NULL;
+    double now;
     
     logMessage(DEBUG, "srmInit(%s)", hostname);
     
-    /* look for structure, see if this host is already initialised */
-    for (i = 0; i < numSrmNodes_; i++) {
-	if (!strcmp(hostname, srmNodes_[i].hostname)) {
-	    /* found it */
-	    *soap = &srmNodes_[i].soap;
-	    *endpoint = srmNodes_[i].endpoint;
-	    return 1;
-	}
-    }
-    
-    /* not found, need to initialise for this node */
     *soap = NULL;
     *endpoint = NULL;
     
-    numSrmNodes_++;
-    srmNodes_ = globus_libc_realloc(srmNodes_,
-				    numSrmNodes_ *
-				    sizeof(srm_node_info_t));
-    if (!srmNodes_) {
-	logMessage(ERROR, "Out of memory in srmInit");
-	return 0;
-    }
-    
-    srmNodes_[numSrmNodes_ - 1].hostname = safe_strdup(hostname);
-    if (!srmNodes_[numSrmNodes_ - 1].hostname) {
-	logMessage(ERROR, "Out of memory in srmInit");
-	return 0;
-    }
+    globus_thread_once(&srmPoolOnce_, initSrmPool);
+    globus_mutex_lock(&srmPoolLock_);
     
-    /* get SRM node info from DiGS config */
-    srmNodes_[numSrmNodes_ - 1].endpoint = getNodeProperty(hostname,
-							   "endpoint");
-    if (!srmNodes_[numSrmNodes_ - 1].endpoint) {
-	logMessage(ERROR, "SRM node %s has no endpoint property",
-		   hostname);
-	return 0;
+    /* look for structure, see if this host is already initialised */
+    node = findSrmNode(hostname);
+    if (!node) {
+	/* not found, need to initialise for this node */
+	node = addSrmNode(hostname);
+	if (!node) {
+	    globus_mutex_unlock(&srmPoolLock_);
+	    return 0;
+	}
     }
     
-    /* initialise GSOAP */
-    soap_init(&srmNodes_[numSrmNodes_ - 1].soap);
-    
-    /* initialise GSI plugin */
-    if (soap_register_plugin(&srmNodes_[numSrmNodes_ - 1].soap,
-			     globus_gsi)) {
-	logMessage(ERROR, "Error registering GSOAP GSI plugin");
-	return 0;
+    while (!s) {
+	/* close connections that have sat idle too long */
+	now = srmTimeNow();
+	while ((node->numIdle > 0) &&
+	       ((now - node->idle[0].lastUsed) > SRM_MAX_IDLE_TIME)) {
+	    closeSrmConnection(node, node->idle[0].soap);
+	    node->numIdle--;
+	    memmove(&node->idle[0], &node->idle[1],
+		    node->numIdle * sizeof(srm_connection_t));
+	}
+	
+	if (node->numIdle > 0) {
+	    /* reuse the most recently used connection */
+	    node->numIdle--;
+	    s = node->idle[node->numIdle].soap;
+	}
+	else if (node->numConnections < node->maxConnections) {
+	    /* open a new one, sharing the node's credential */
+	    s = soap_copy(&node->soap);
+	    if (!s) {
+		logMessage(ERROR, "Out of memory in srmInit");
+		globus_mutex_unlock(&srmPoolLock_);
+		return 0;
+	    }
+	    node->numConnections++;
+	}
+	else {
+	    globus_cond_wait(&node->returned, &srmPoolLock_);
+	}
     }
     
-    if (gsi_acquire_credential(&srmNodes_[numSrmNodes_ - 1].soap)
-	< 0) {
-	logMessage(ERROR, "Error acquiring credential in GSI plugin");
-	return 0;
-    }
+    globus_mutex_unlock(&srmPoolLock_);
     
-    *soap = &srmNodes_[numSrmNodes_ - 1].soap;
-    *endpoint = srmNodes_[numSrmNodes_ - 1].endpoint;
+    *soap = s;
+    *endpoint = node->endpoint;
     
     return 1;
 }
@@ -315,9 +632,11 @@ static int srmInit(const char *hostname, struct soap **soap,
 /***********************************************************************
  *   int srmDone(char *hostname, struct soap *soap)
  * 
- *   Cleans up after access to SRM server. After this function is
- *   called, any results from the last SOAP call will no longer be valid
- *   so duplicate them elsewhere first if they are needed.
+ *   Cleans up after access to SRM server and returns the soap structure
+ *   to the host's pool, leaving its connection open for the next call.
+ *   After this function is called, any results from the last SOAP call
+ *   will no longer be valid so duplicate them elsewhere first if they
+ *   are needed.
  * 
  *   Parameters:                                                 [I/O]
  *
@@ -328,9 +647,26 @@ static int srmInit(const char *hostname, struct soap **soap,
  ***********************************************************************/
 static void srmDone(const char *hostname, struct soap *soap)
 {
+    srm_node_info_t *node;
+    
     logMessage(DEBUG, "srmDone(%s)", hostname);
     soap_destroy(soap);
     soap_end(soap);
+    
+    /* don't reuse a connection that a failed call may have left in a
+     * bad state */
+    if (soap->error != SOAP_OK) {
+	soap_closesock(soap);
+	soap->error = SOAP_OK;
+    }
+    
+    globus_mutex_lock(&srmPoolLock_);
+    node = findSrmNode(hostname);
+    node->idle[node->numIdle].soap = soap;
+    node->idle[node->numIdle].lastUsed = srmTimeNow();
+    node->numIdle++;
+    globus_cond_signal(&node->returned);
+    globus_mutex_unlock(&srmPoolLock_);
 }
 
 /***********************************************************************
@@ -485,225 +821,437 @@ digs_error_code_t processSrmError(char *errorMessage,
  * 18: in progress
  * 21: file in cache
  * 22: file pinned
- * 24: space available
- * 25: lower space granted
+ * 24: space available (puts only)
+ * 25: lower space granted (puts only)
  */
 
 /***********************************************************************
- * digs_error_code_t checkPutRequest(char *errorMessage,
- *                                   struct soap *soap,
- *                                   char *endpoint,
- *                                   char *token,
- *                                   char **TURL);
- * 
- * Checks the status of an SRM put request. If the request completed
- * successfully, returns DIGS_SUCCESS and sets TURL to the transport
- * URL. If still pending, returns DIGS_SUCCESS and sets TURL to NULL.
- * If it failed, returns an error code.
- * 
+ * int srmStatusIsPending(int code, int type)
+ *
+ * Checks whether an SRM status code for a file in a get or put request
+ * means that the request is going well, rather than that it failed
+ *
  *   Parameters:                                                 [I/O]
  *
- *     errorMessage   buffer to receive error message               O
- *     soap           soap structure for contacting server        I
- *     endpoint       SRM endpoint URL                            I
- *     token          token identifying request                   I
- *     TURL           receives transport URL if available           O
- *                    (caller should free)
- * 
- *   Returns: DiGS error code corresponding to SRM error
+ *     code   SRM status code                                     I
+ *     type   DIGS_SRM_GET_TRANSFER or DIGS_SRM_PUT_TRANSFER      I
+ *
+ *   Returns: 1 if the request is succeeding or still in progress,
+ *            0 if it failed
  ***********************************************************************/
-static digs_error_code_t checkPutRequest(char *errorMessage,
-					 struct soap *soap,
-					 char *endpoint,
-					 char *token,
-					 char **TURL)
+static int srmStatusIsPending(int code, int type)
 {
-    digs_error_code_t result = DIGS_SUCCESS;
-    struct ns1__srmStatusOfPutRequestRequest req;
-    struct ns1__srmStatusOfPutRequestResponse_ resp;
-    struct ns1__TPutRequestFileStatus *status;
-    
-    logMessage(DEBUG, "checkPutRequest(%s,%s)", endpoint, token);
-    
-    *TURL = NULL;
-    
-    req.requestToken = token;
-    req.authorizationID = NULL;
-    req.arrayOfTargetSURLs = NULL;
-    
-    if (soap_call_ns1__srmStatusOfPutRequest(soap, endpoint,
-					     "StatusOfPutRequest", &req,
-					     &resp) == SOAP_OK) {
-	switch (resp.srmStatusOfPutRequestResponse->returnStatus->statusCode) {
-	case 0:
-	case 17:
-	case 18:
-	case 21:
-	case 22:
-	case 24:
-	case 25:
-	{
-	    status =
-		&resp.srmStatusOfPutRequestResponse->arrayOfFileStatuses->statusArray[0];
-	    switch (status->status->statusCode) {
-	    case 0:
-	    case 17:
-	    case 18:
-	    case 21:
-	    case 22:
-	    case 24:
-	    case 25:
-		if (status->transferURL) {
-		    *TURL = safe_strdup(status->transferURL);
-		}
-		break;
-	    default:
-		result = processSrmError(errorMessage, status->status);
-		break;
-	    }
-	}
-	break;
-	default:
-	    /* request for status failed */
-	    result = 
-		processSrmError(errorMessage,
-				resp.srmStatusOfPutRequestResponse->returnStatus);
-	    break;
-	}
-    }
-    else {
-	result = DIGS_NO_CONNECTION;
-	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
-    }
-    
-    return result;
+    switch (code) {
+    case 0:
+    case 17:
+    case 18:
+    case 21:
+    case 22:
+	return 1;
+    case 24:
+    case 25:
+	return (type == DIGS_SRM_PUT_TRANSFER);
+    }
+    return 0;
 }
 
 /***********************************************************************
- * digs_error_code_t checkGetRequest(char *errorMessage,
- *                                   struct soap *soap,
- *                                   char *endpoint,
- *                                   char *token,
- *                                   char **TURL);
- * 
- * Checks the status of an SRM get request. If the request completed
- * successfully, returns DIGS_SUCCESS and sets TURL to the transport
- * URL. If still pending, returns DIGS_SUCCESS and sets TURL to NULL.
- * If it failed, returns an error code.
- * 
+ * srm_request_t *newSrmRequest(const char *hostname, int type,
+ *                              int count, char **surls, char *token)
+ *
+ * Creates the structure recording a prepare request and the state of
+ * each of its files
+ *
  *   Parameters:                                                 [I/O]
  *
- *     errorMessage   buffer to receive error message               O
- *     soap           soap structure for contacting server        I
- *     endpoint       SRM endpoint URL                            I
- *     token          token identifying request                   I
- *     TURL           receives transport URL if available           O
- *                    (caller should free)
- * 
- *   Returns: DiGS error code corresponding to SRM error
+ *     hostname   FQDN of the host the request was sent to        I
+ *     type       DIGS_SRM_GET_TRANSFER or DIGS_SRM_PUT_TRANSFER  I
+ *     count      number of files in the request                  I
+ *     surls      SURLs of the files                              I
+ *     token      request token. Freed with the request           I
+ *
+ *   Returns: pointer to new request, which has no references yet
  ***********************************************************************/
-static digs_error_code_t checkGetRequest(char *errorMessage,
-					 struct soap *soap,
-					 char *endpoint,
-					 char *token,
-					 char **TURL)
+static srm_request_t *newSrmRequest(const char *hostname, int type,
+				    int count, char **surls, char *token)
 {
-    digs_error_code_t result = DIGS_SUCCESS;
-    struct ns1__srmStatusOfGetRequestRequest req;
-    struct ns1__srmStatusOfGetRequestResponse_ resp;
-    struct ns1__TGetRequestFileStatus *status;
-    
-    logMessage(DEBUG, "checkGetRequest(%s,%s)", endpoint, token);
-    
-    *TURL = NULL;
-    
-    req.requestToken = token;
-    req.authorizationID = NULL;
-    req.arrayOfSourceSURLs = NULL;
-    
-    if (soap_call_ns1__srmStatusOfGetRequest(soap, endpoint, "StatusOfGetRequest", &req, &resp)
-	== SOAP_OK) {
-	switch (resp.srmStatusOfGetRequestResponse->returnStatus->statusCode) {
-	case 0:
-	case 17:
-	case 18:
-	case 21:
-	case 22:
-	{
-	    status = &resp.srmStatusOfGetRequestResponse->arrayOfFileStatuses->statusArray[0];
-	    switch (status->status->statusCode) {
-	    case 0:
-	    case 17:
-	    case 18:
-	    case 21:
-	    case 22:
-		if (status->transferURL) {
-		    *TURL = safe_strdup(status->transferURL);
-		}
-		break;
-	    default:
-		result = processSrmError(errorMessage, status->status);
-		break;
-	    }
-	}
-	break;
-	default:
-	    /* request for status failed */
-	    result = processSrmError(errorMessage, resp.srmStatusOfGetRequestResponse->returnStatus);
-	    break;
-	}
-    }
-    else {
-	result = DIGS_NO_CONNECTION;
-	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+    srm_request_t *r;
+    int i;
+
+    r = globus_libc_malloc(sizeof(srm_request_t));
+    if (!r) {
+	errorExit("Out of memory in newSrmRequest");
     }
-    
-    return result;
-}
 
+    r->hostname = safe_strdup(hostname);
+    r->token = token;
+    r->type = type;
+    r->refCount = 0;
+    r->count = count;
+    r->surls = globus_libc_malloc(count * sizeof(char *));
+    r->turls = globus_libc_malloc(count * sizeof(char *));
+    r->messages = globus_libc_malloc(count * sizeof(char *));
+    r->results = globus_libc_malloc(count * sizeof(digs_error_code_t));
+    if ((!r->surls) || (!r->turls) || (!r->messages) || (!r->results)) {
+	errorExit("Out of memory in newSrmRequest");
+    }
+    for (i = 0; i < count; i++) {
+	r->surls[i] = safe_strdup(surls[i]);
+	r->turls[i] = NULL;
+	r->messages[i] = NULL;
+	r->results[i] = DIGS_SUCCESS;
+    }
+    r->pending = count;
+    r->interval = SRM_MIN_POLL_INTERVAL;
+    r->nextPoll = srmTimeNow() + SRM_MIN_POLL_INTERVAL;
 
-/***********************************************************************
+    return r;
+}
+
+/***********************************************************************
+ * void releaseSrmRequest(srm_request_t *r)
+ *
+ * Drops a transfer's reference to a request, freeing the request once
+ * none of its transfers are left
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     r   the request                                            I
+ *
+ *   Returns: (void)
+ ***********************************************************************/
+static void releaseSrmRequest(srm_request_t *r)
+{
+    int i;
+
+    r->refCount--;
+    if (r->refCount > 0) {
+	return;
+    }
+
+    for (i = 0; i < r->count; i++) {
+	globus_libc_free(r->surls[i]);
+	if (r->turls[i])
+	    globus_libc_free(r->turls[i]);
+	if (r->messages[i])
+	    globus_libc_free(r->messages[i]);
+    }
+    globus_libc_free(r->surls);
+    globus_libc_free(r->turls);
+    globus_libc_free(r->messages);
+    globus_libc_free(r->results);
+    globus_libc_free(r->hostname);
+    globus_libc_free(r->token);
+    globus_libc_free(r);
+}
+
+/***********************************************************************
+ * void failSrmRequestFile(srm_request_t *r, int i,
+ *                         digs_error_code_t result, char *message)
+ *
+ * Records that one file in a request has failed
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     r         the request                                      I/O
+ *     i         index of the file                                I
+ *     result    DiGS error code for the failure                  I
+ *     message   description of the failure                       I
+ *
+ *   Returns: (void)
+ ***********************************************************************/
+static void failSrmRequestFile(srm_request_t *r, int i,
+			       digs_error_code_t result, char *message)
+{
+    if ((r->turls[i]) || (r->results[i] != DIGS_SUCCESS)) {
+	return;
+    }
+    r->results[i] = result;
+    r->messages[i] = safe_strdup(message);
+    r->pending--;
+}
+
+/***********************************************************************
+ * int recordSrmFileStatus(srm_request_t *r, int j, char *surl,
+ *                         struct ns1__TReturnStatus *status,
+ *                         char *transferURL, int *estimatedWaitTime)
+ *
+ * Records the status the server gave for one file of a request
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     r                   the request                            I/O
+ *     j                   position of the status in the response I
+ *     surl                SURL the status is for, if given       I
+ *     status              the file's status                      I
+ *     transferURL         the file's TURL, if it's ready         I
+ *     estimatedWaitTime   server's estimate of how long until    I
+ *                         the TURL is ready, if given
+ *
+ *   Returns: the estimated wait time in seconds if the file is still
+ *            pending and the server gave one, otherwise -1
+ ***********************************************************************/
+static int recordSrmFileStatus(srm_request_t *r, int j, char *surl,
+			       struct ns1__TReturnStatus *status,
+			       char *transferURL, int *estimatedWaitTime)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result;
+    int i;
+
+    /* statuses should name their SURL, but fall back on the order */
+    i = j;
+    if (surl) {
+	for (i = 0; i < r->count; i++) {
+	    if (!strcmp(surl, r->surls[i])) {
+		break;
+	    }
+	}
+    }
+    if ((i >= r->count) || (r->turls[i]) ||
+	(r->results[i] != DIGS_SUCCESS) || (!status)) {
+	return -1;
+    }
+
+    if (!srmStatusIsPending(status->statusCode, r->type)) {
+	result = processSrmError(errbuf, status);
+	failSrmRequestFile(r, i, result, errbuf);
+	return -1;
+    }
+
+    if (transferURL) {
+	r->turls[i] = safe_strdup(transferURL);
+	r->pending--;
+	return -1;
+    }
+
+    if (estimatedWaitTime) {
+	return *estimatedWaitTime;
+    }
+    return -1;
+}
+
+/***********************************************************************
+ * void scheduleSrmPoll(srm_request_t *r, int estimatedWaitTime)
+ *
+ * Works out when a request with files still pending should next be
+ * polled. The server's estimate of the wait is used when it gives
+ * one; otherwise the interval doubles each time, up to a limit
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     r                   the request                            I/O
+ *     estimatedWaitTime   shortest wait estimated by the server  I
+ *                         for any pending file, or -1
+ *
+ *   Returns: (void)
+ ***********************************************************************/
+static void scheduleSrmPoll(srm_request_t *r, int estimatedWaitTime)
+{
+    if (estimatedWaitTime >= 0) {
+	r->interval = (double)estimatedWaitTime;
+    }
+    else {
+	r->interval *= 2.0;
+    }
+    if (r->interval < SRM_MIN_POLL_INTERVAL) {
+	r->interval = SRM_MIN_POLL_INTERVAL;
+    }
+    if (r->interval > SRM_MAX_POLL_INTERVAL) {
+	r->interval = SRM_MAX_POLL_INTERVAL;
+    }
+    r->nextPoll = srmTimeNow() + r->interval;
+}
+
+/***********************************************************************
+ * int minimumWait(int a, int b)
+ *
+ * Combines two estimated wait times, either of which may be -1 for
+ * none
+ *
+ *   Returns: the shorter wait, or -1 if neither was given
+ ***********************************************************************/
+static int minimumWait(int a, int b)
+{
+    if (a < 0) {
+	return b;
+    }
+    if ((b >= 0) && (b < a)) {
+	return b;
+    }
+    return a;
+}
+
+/***********************************************************************
+ * void pollSrmRequest(srm_request_t *r)
+ *
+ * Asks the server for the status of every file in a request, if any
+ * are still waiting for a TURL and the next poll is due. One status
+ * call covers the whole request, however many files it has
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     r   the request                                            I/O
+ *
+ *   Returns: (void)
+ ***********************************************************************/
+static void pollSrmRequest(srm_request_t *r)
+{
+    struct soap *soap;
+    char *endpoint;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    struct ns1__TReturnStatus *returnStatus = NULL;
+    digs_error_code_t result;
+    int wait = -1;
+    int ok;
+    int i;
+
+    if ((r->pending == 0) || (srmTimeNow() < r->nextPoll)) {
+	return;
+    }
+
+    logMessage(DEBUG, "pollSrmRequest(%s,%s)", r->hostname, r->token);
+
+    errbuf[0] = 0;
+    if (!srmInit(r->hostname, &soap, &endpoint)) {
+	for (i = 0; i < r->count; i++) {
+	    failSrmRequestFile(r, i, DIGS_NO_SERVICE,
+			       "Cannot contact SRM server");
+	}
+	return;
+    }
+
+    if (r->type == DIGS_SRM_GET_TRANSFER) {
+	struct ns1__srmStatusOfGetRequestRequest req;
+	struct ns1__srmStatusOfGetRequestResponse_ resp;
+	struct ns1__ArrayOfTGetRequestFileStatus *files;
+	struct ns1__TGetRequestFileStatus *status;
+
+	req.requestToken = r->token;
+	req.authorizationID = NULL;
+	req.arrayOfSourceSURLs = NULL;
+
+	ok = (soap_call_ns1__srmStatusOfGetRequest(soap, endpoint,
+						   "StatusOfGetRequest",
+						   &req, &resp) == SOAP_OK);
+	if (ok) {
+	    returnStatus = resp.srmStatusOfGetRequestResponse->returnStatus;
+	    files = resp.srmStatusOfGetRequestResponse->arrayOfFileStatuses;
+	    for (i = 0; (files) && (i < files->__sizestatusArray); i++) {
+		status = &files->statusArray[i];
+		wait = minimumWait(wait,
+				   recordSrmFileStatus(r, i, status->sourceSURL,
+						       status->status,
+						       status->transferURL,
+						       status->estimatedWaitTime));
+	    }
+	}
+    }
+    else {
+	struct ns1__srmStatusOfPutRequestRequest req;
+	struct ns1__srmStatusOfPutRequestResponse_ resp;
+	struct ns1__ArrayOfTPutRequestFileStatus *files;
+	struct ns1__TPutRequestFileStatus *status;
+
+	req.requestToken = r->token;
+	req.authorizationID = NULL;
+	req.arrayOfTargetSURLs = NULL;
+
+	ok = (soap_call_ns1__srmStatusOfPutRequest(soap, endpoint,
+						   "StatusOfPutRequest",
+						   &req, &resp) == SOAP_OK);
+	if (ok) {
+	    returnStatus = resp.srmStatusOfPutRequestResponse->returnStatus;
+	    files = resp.srmStatusOfPutRequestResponse->arrayOfFileStatuses;
+	    for (i = 0; (files) && (i < files->__sizestatusArray); i++) {
+		status = &files->statusArray[i];
+		wait = minimumWait(wait,
+				   recordSrmFileStatus(r, i, status->SURL,
+						       status->status,
+						       status->transferURL,
+						       status->estimatedWaitTime));
+	    }
+	}
+    }
+
+    if (!ok) {
+	soap_sprint_fault(soap, errbuf, MAX_ERROR_MESSAGE_LENGTH);
+	for (i = 0; i < r->count; i++) {
+	    failSrmRequestFile(r, i, DIGS_NO_CONNECTION, errbuf);
+	}
+    }
+    else if ((r->pending > 0) &&
+	     (!srmStatusIsPending(returnStatus->statusCode, r->type)) &&
+	     (returnStatus->statusCode != 27)) {
+	/*
+	 * The whole request failed. A partial success (27) just means some
+	 * files failed, and their own statuses say which
+	 */
+	result = processSrmError(errbuf, returnStatus);
+	for (i = 0; i < r->count; i++) {
+	    failSrmRequestFile(r, i, result, errbuf);
+	}
+    }
+
+    srmDone(r->hostname, soap);
+
+    if (r->pending > 0) {
+	scheduleSrmPoll(r, wait);
+    }
+}
+
+/***********************************************************************
  * digs_error_code_t initiatePutRequest(char *errorMessage,
  *                                      struct soap *soap,
  *                                      char *endpoint,
- *                                      char *path,
- *                                      char **token,
- *                                      char **protocol,
- *                                      ULONG64 size);
- * 
- * Initiates an SRM put request.
- * 
+ *                                      const char *hostname,
+ *                                      int count, char **paths,
+ *                                      ULONG64 *sizes,
+ *                                      srm_request_t **request);
+ *
+ * Initiates an SRM put request for one or more files
+ *
  *   Parameters:                                                 [I/O]
  *
  *     errorMessage   buffer to receive error message               O
  *     soap           soap structure for contacting server        I
  *     endpoint       SRM endpoint URL                            I
- *     path           URL to destination                          I
- *     token          receives token identifying request            O
- *                    (caller should free)
- *     protocol       receives protocol identifier                  O
- *                    (caller should free)
- *     size           size of file to be put                      I
- * 
+ *     hostname       FQDN of the host being accessed             I
+ *     count          number of files                             I
+ *     paths          URLs to destinations                        I
+ *     sizes          sizes of files to be put                    I
+ *     request        receives the new request                      O
+ *
  *   Returns: DiGS error code corresponding to SRM error
  ***********************************************************************/
 static digs_error_code_t initiatePutRequest(char *errorMessage,
 					    struct soap *soap,
 					    char *endpoint,
-					    char *path,
-					    char **token,
-					    char **protocol,
-					    ULONG64 size)
+					    const char *hostname,
+					    int count, char **paths,
+					    ULONG64 *sizes,
+					    srm_request_t **request)
 {
     digs_error_code_t result = DIGS_SUCCESS;
     struct ns1__srmPrepareToPutRequest req;
     struct ns1__srmPrepareToPutResponse_ resp;
     struct ns1__ArrayOfTPutFileRequest reqs;
-    struct ns1__TPutFileRequest pfr;
-    
-    logMessage(DEBUG, "initiatePutRequest(%s,%s,%d)", endpoint, path,
-	       (int)size);
-    
+    struct ns1__TPutFileRequest *pfr;
+    struct ns1__ArrayOfTPutRequestFileStatus *files;
+    struct ns1__TPutRequestFileStatus *status;
+    int wait = -1;
+    int i;
+
+    logMessage(DEBUG, "initiatePutRequest(%s,%s,%d files)", endpoint,
+	       paths[0], count);
+
+    *request = NULL;
+
+    pfr = globus_libc_malloc(count * sizeof(struct ns1__TPutFileRequest));
+    if (!pfr) {
+	errorExit("Out of memory in initiatePutRequest");
+    }
+
     req.authorizationID = NULL;
     req.arrayOfFileRequests = &reqs;
     req.userRequestDescription = NULL;
@@ -716,30 +1264,41 @@ static digs_error_code_t initiatePutRequest(char *errorMessage,
     req.targetSpaceToken = NULL;
     req.targetFileRetentionPolicyInfo = NULL;
     req.transferParameters = NULL;
-    
-    reqs.__sizerequestArray = 1;
-    reqs.requestArray = &pfr;
-    
-    pfr.targetSURL = path;
-    pfr.expectedFileSize = &size;
-    
+
+    reqs.__sizerequestArray = count;
+    reqs.requestArray = pfr;
+
+    for (i = 0; i < count; i++) {
+	pfr[i].targetSURL = paths[i];
+	pfr[i].expectedFileSize = &sizes[i];
+    }
+
     if (soap_call_ns1__srmPrepareToPut(soap, endpoint,
 				       "PrepareToPut", &req, &resp)
 	== SOAP_OK) {
 	/* check for errors here - 17 means request queued */
-	switch (resp.srmPrepareToPutResponse->returnStatus->statusCode) {
-	case 0:
-	case 17:
-	case 18:
-	case 21:
-	case 22:
-	case 24:
-	case 25:
+	if (srmStatusIsPending(resp.srmPrepareToPutResponse->returnStatus->statusCode,
+			       DIGS_SRM_PUT_TRANSFER)) {
 	    /* success */
-	    *token = safe_strdup(resp.srmPrepareToPutResponse->requestToken);
-	    *protocol = safe_strdup("gsiftp");
-	    break;
-	default:
+	    *request = newSrmRequest(hostname, DIGS_SRM_PUT_TRANSFER, count,
+				     paths,
+				     safe_strdup(resp.srmPrepareToPutResponse->requestToken));
+
+	    /* a quick server may have some TURLs ready already */
+	    files = resp.srmPrepareToPutResponse->arrayOfFileStatuses;
+	    for (i = 0; (files) && (i < files->__sizestatusArray); i++) {
+		status = &files->statusArray[i];
+		wait = minimumWait(wait,
+				   recordSrmFileStatus(*request, i, status->SURL,
+						       status->status,
+						       status->transferURL,
+						       status->estimatedWaitTime));
+	    }
+	    if (wait >= 0) {
+		scheduleSrmPoll(*request, wait);
+	    }
+	}
+	else {
 	    /* error */
 	    result = processSrmError(errorMessage,
 				     resp.srmPrepareToPutResponse->returnStatus);
@@ -749,7 +1308,8 @@ static digs_error_code_t initiatePutRequest(char *errorMessage,
 	result = DIGS_NO_CONNECTION;
 	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
     }
-    
+
+    globus_libc_free(pfr);
     return result;
 }
 
@@ -757,64 +1317,74 @@ static digs_error_code_t initiatePutRequest(char *errorMessage,
  * digs_error_code_t initiateGetRequest(char *errorMessage,
  *                                      struct soap *soap,
  *                                      char *endpoint,
- *                                      char *path,
- *                                      char **token,
- *                                      char **protocol);
- * 
- * Initiates an SRM get request.
- * 
+ *                                      const char *hostname,
+ *                                      int count, char **paths,
+ *                                      srm_request_t **request);
+ *
+ * Initiates an SRM get request for one or more files
+ *
  *   Parameters:                                                 [I/O]
  *
  *     errorMessage   buffer to receive error message               O
  *     soap           soap structure for contacting server        I
  *     endpoint       SRM endpoint URL                            I
- *     path           URL to source file                          I
- *     token          receives token identifying request            O
- *                    (caller should free)
- *     protocol       receives protocol identifier                  O
- *                    (caller should free)
- * 
+ *     hostname       FQDN of the host being accessed             I
+ *     count          number of files                             I
+ *     paths          URLs to source files                        I
+ *     request        receives the new request                      O
+ *
  *   Returns: DiGS error code corresponding to SRM error
  ***********************************************************************/
 static digs_error_code_t initiateGetRequest(char *errorMessage,
 					    struct soap *soap,
 					    char *endpoint,
-					    char *path,
-					    char **token,
-					    char **protocol)
+					    const char *hostname,
+					    int count, char **paths,
+					    srm_request_t **request)
 {
     digs_error_code_t result = DIGS_SUCCESS;
     struct ns1__srmPrepareToGetRequest req;
     struct ns1__srmPrepareToGetResponse_ resp;
     struct ns1__ArrayOfTGetFileRequest reqs;
-    struct ns1__TGetFileRequest gfr;
+    struct ns1__TGetFileRequest *gfr;
     struct ns1__TTransferParameters tp;
     struct ns1__ArrayOfString protos;
     struct ns1__TDirOption diropt;
+    struct ns1__ArrayOfTGetRequestFileStatus *files;
+    struct ns1__TGetRequestFileStatus *status;
     char *supportedProto = "gsiftp";
-    
-    logMessage(DEBUG, "initiateGetRequest(%s,%s)", endpoint, path);
-    
-    *token = NULL;
-    *protocol = NULL;
-    
+    int wait = -1;
+    int i;
+
+    logMessage(DEBUG, "initiateGetRequest(%s,%s,%d files)", endpoint,
+	       paths[0], count);
+
+    *request = NULL;
+
+    gfr = globus_libc_malloc(count * sizeof(struct ns1__TGetFileRequest));
+    if (!gfr) {
+	errorExit("Out of memory in initiateGetRequest");
+    }
+
     diropt.isSourceADirectory = xsd__boolean__false_;
     diropt.allLevelRecursive = NULL;
     diropt.numOfLevels = NULL;
-    gfr.sourceSURL = path;
-    gfr.dirOption = &diropt;
-    
-    reqs.__sizerequestArray = 1;
-    reqs.requestArray = &gfr;
-    
+    for (i = 0; i < count; i++) {
+	gfr[i].sourceSURL = paths[i];
+	gfr[i].dirOption = &diropt;
+    }
+
+    reqs.__sizerequestArray = count;
+    reqs.requestArray = gfr;
+
     protos.__sizestringArray = 1;
     protos.stringArray = &supportedProto;
-    
+
     tp.accessPattern = NULL;
     tp.connectionType = NULL;
     tp.arrayOfClientNetworks = NULL;
     tp.arrayOfTransferProtocols = &protos;
-    
+
     req.authorizationID = NULL;
     req.arrayOfFileRequests = &reqs;
     req.userRequestDescription = NULL;
@@ -825,21 +1395,33 @@ static digs_error_code_t initiateGetRequest(char *errorMessage,
     req.targetSpaceToken = NULL;
     req.targetFileRetentionPolicyInfo = NULL;
     req.transferParameters = &tp;
-    
+
     if (soap_call_ns1__srmPrepareToGet(soap, endpoint, "PrepareToGet", &req, &resp)
 	== SOAP_OK) {
 	/* check for errors here - 17 means request queued */
-	switch (resp.srmPrepareToGetResponse->returnStatus->statusCode) {
-	case 0:
-	case 17:
-	case 18:
-	case 21:
-	case 22:
+	if (srmStatusIsPending(resp.srmPrepareToGetResponse->returnStatus->statusCode,
+			       DIGS_SRM_GET_TRANSFER)) {
 	    /* success */
-	    *token = safe_strdup(resp.srmPrepareToGetResponse->requestToken);
-	    *protocol = safe_strdup("gsiftp");
-	    break;
-	default:
+	    *request = newSrmRequest(hostname, DIGS_SRM_GET_TRANSFER, count,
+				     paths,
+				     safe_strdup(resp.srmPrepareToGetResponse->requestToken));
+
+	    /* a quick server may have some TURLs ready already */
+	    files = resp.srmPrepareToGetResponse->arrayOfFileStatuses;
+	    for (i = 0; (files) && (i < files->__sizestatusArray); i++) {
+		status = &files->statusArray[i];
+		wait = minimumWait(wait,
+				   recordSrmFileStatus(*request, i,
+						       status->sourceSURL,
+						       status->status,
+						       status->transferURL,
+						       status->estimatedWaitTime));
+	    }
+	    if (wait >= 0) {
+		scheduleSrmPoll(*request, wait);
+	    }
+	}
+	else {
 	    /* error */
 	    result = processSrmError(errorMessage, resp.srmPrepareToGetResponse->returnStatus);
 	}
@@ -848,10 +1430,103 @@ static digs_error_code_t initiateGetRequest(char *errorMessage,
 	result = DIGS_NO_CONNECTION;
 	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
     }
-    
+
+    globus_libc_free(gfr);
     return result;
 }
-					    
+
+/***********************************************************************
+ * digs_error_code_t waitForSrmTurl(char *errorMessage,
+ *                                  srm_request_t *r, int i,
+ *                                  char **turl)
+ *
+ * Waits for the TURL of one file in a request, polling the request as
+ * it falls due
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage   buffer to receive error message               O
+ *     r              the request                                 I/O
+ *     i              index of the file in the request            I
+ *     turl           receives the TURL (caller should free)        O
+ *
+ *   Returns: DiGS error code for the file
+ ***********************************************************************/
+static digs_error_code_t waitForSrmTurl(char *errorMessage,
+					srm_request_t *r, int i,
+					char **turl)
+{
+    double wait;
+
+    *turl = NULL;
+    for (;;) {
+	pollSrmRequest(r);
+	if (r->results[i] != DIGS_SUCCESS) {
+	    strncpy(errorMessage, r->messages[i], MAX_ERROR_MESSAGE_LENGTH);
+	    return r->results[i];
+	}
+	if (r->turls[i]) {
+	    *turl = safe_strdup(r->turls[i]);
+	    return DIGS_SUCCESS;
+	}
+
+	wait = r->nextPoll - srmTimeNow();
+	if (wait > 0.0) {
+	    globus_libc_usleep((unsigned long)(wait * 1000000.0));
+	}
+    }
+}
+
+/***********************************************************************
+ * struct ns1__TGroupPermission *chooseGroupPermission(
+ *                                  struct ns1__TPermissionReturn *perm)
+ * 
+ * Works out which of the group ACLs srmGetPermission returned for a
+ * file is to be considered its group. If there is only one entry, that
+ * is the one. Otherwise it is the last with a non-zero mode, or just
+ * the last if they are all zero.
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     perm     one file's entry from the srmGetPermission response  I
+ * 
+ *   Returns: The chosen entry, NULL if there are no group ACLs
+ ***********************************************************************/
+static struct ns1__TGroupPermission *
+chooseGroupPermission(struct ns1__TPermissionReturn *perm)
+{
+    struct ns1__ArrayOfTGroupPermission *groups;
+    int i;
+    int grp;
+
+    if ((!perm) || (!perm->arrayOfGroupPermissions) ||
+	(!perm->arrayOfGroupPermissions->groupPermissionArray) ||
+	(perm->arrayOfGroupPermissions->__sizegroupPermissionArray < 1)) {
+	return NULL;
+    }
+    groups = perm->arrayOfGroupPermissions;
+
+    /*
+     * If there's only one entry, return that
+     */
+    if (groups->__sizegroupPermissionArray == 1) {
+	return &groups->groupPermissionArray[0];
+    }
+
+    /* look for the last one that has non-zero mode */
+    grp = -1;
+    for (i = 0; i < groups->__sizegroupPermissionArray; i++) {
+	if (groups->groupPermissionArray[i].mode) {
+	    grp = i;
+	}
+    }
+
+    /* they were all zero, return the last one */
+    if (grp < 0) {
+	grp = groups->__sizegroupPermissionArray - 1;
+    }
+    return &groups->groupPermissionArray[grp];
+}
 
 /***********************************************************************
  * digs_error_code_t getGroupInfo(char *errorMessage,
@@ -887,8 +1562,7 @@ static digs_error_code_t getGroupInfo(char *errorMessage,
     struct ns1__srmGetPermissionResponse_ resp;
     struct ns1__ArrayOfAnyURI surls;
     struct ns1__TPermissionReturn *perm;
-    int i;
-    int grp;
+    struct ns1__TGroupPermission *grp;
     
     logMessage(DEBUG, "getGroupInfo(%s)", path);
     
@@ -905,35 +1579,11 @@ static digs_error_code_t getGroupInfo(char *errorMessage,
 					&req, &resp) == SOAP_OK) {
 	if (resp.srmGetPermissionResponse->returnStatus->statusCode == 0) {
 	    perm = resp.srmGetPermissionResponse->arrayOfPermissionReturns->permissionArray;
-	    if ((perm) && (perm->arrayOfGroupPermissions)) {
-		/* We have the group permissions now. Find the right one */
-		grp = -1;
-		
-		/*
-		 * If there's only one entry, return that
-		 */
-		if (perm->arrayOfGroupPermissions->__sizegroupPermissionArray == 1) {
-		    grp = 0;
-		}
-		else {
-		    /* look for the last one that has non-zero mode */
-		    for (i = 0; i < perm->arrayOfGroupPermissions->__sizegroupPermissionArray; i++) {
-			if (perm->arrayOfGroupPermissions->groupPermissionArray[i].mode) {
-			    grp = i;
-			}
-		    }
-		    
-		    /* they were all zero, return the last one */
-		    if (grp < 0) {
-			grp = perm->arrayOfGroupPermissions->__sizegroupPermissionArray - 1;
-		    }
-		}
-		
+	    grp = chooseGroupPermission(perm);
+	    if (grp) {
 		/* return its name and mode */
-		*group = 
-		    safe_strdup(perm->arrayOfGroupPermissions->groupPermissionArray[grp].groupID);
-		*perms =
-		    perm->arrayOfGroupPermissions->groupPermissionArray[grp].mode;
+		*group = safe_strdup(grp->groupID);
+		*perms = grp->mode;
 	    }
 	    else {
 		strcpy(errorMessage, "No group permissions returned");
@@ -1170,8 +1820,7 @@ digs_error_code_t digs_getChecksum_srm(char *errorMessage,
     char *endpoint;
     char *path;
     digs_error_code_t result = DIGS_SUCCESS;
-    char *token;
-    char *protocol;
+    srm_request_t *request;
     char *turl = NULL;
     int isdir = 0;
     
@@ -1202,24 +1851,17 @@ digs_error_code_t digs_getChecksum_srm(char *errorMessage,
     path = constructSRMPath(hostname, filePath);
     
     /* first get a gsiftp transfer URL for the file */
-    result = initiateGetRequest(errorMessage, soap, endpoint, path,
-				&token, &protocol);
+    result = initiateGetRequest(errorMessage, soap, endpoint, hostname, 1,
+				&path, &request);
+    globus_libc_free(path);
+    srmDone(hostname, soap);
+
     if (result == DIGS_SUCCESS) {
-	
 	/* wait for transfer URL to become available */
-	while ((result == DIGS_SUCCESS) && (turl == NULL)) {
-	    result = checkGetRequest(errorMessage, soap, endpoint, token,
-				     &turl);
-	    globus_libc_usleep(10000);
-	}
-	
-	globus_libc_free(protocol);
-	globus_libc_free(token);
+	result = waitForSrmTurl(errorMessage, request, 0, &turl);
+	releaseSrmRequest(request);
     }
     
-    globus_libc_free(path);
-    srmDone(hostname, soap);
-    
     if (turl != NULL) {
 	/* if we got the TURL successfully, actually do the checksum */
 	result = srm_gsiftp_checksum(errorMessage, turl, fileChecksum);
@@ -2052,231 +2694,814 @@ digs_error_code_t digs_getModificationTime_srm(char *errorMessage,
 
 
 /***********************************************************************
- * digs_error_code_t digs_startPutTransfer_srm(char *errorMessage,
- *                                             const char *hostname,
- *		                               const char *localPath,
- *                                             const char *SURL,
- *                                             int *handle);
- *
- * Start a put operation (push) of a local file to a remote hostname
- * with a specified remote location (SURL). A handle is returned to
- * uniquely identify this transfer.
+ * void fillStatFromSrm(struct ns1__TMetaDataPathDetail *detail,
+ *                      digs_stat_t *stat)
  * 
- * If a file with the chosen name already exists at the remote location,
- * it may be overwriten without a warning.
- *
- * Parameters:                                                   [I/O]
- *
- *   errorMessage   buffer to receive message on error (must be at  O
- *                  least MAX_ERROR_MESSAGE_LENGTH chars)
- *   localPath      full path to local file to upload             I
- *   hostname       FQDN of the host to contact                   I
- *   SURL           location to upload file to                    I
- *   handle         receives unique id for transfer                 O
+ * Copies what an srmLs path detail says about a file into a stat
+ * structure. Elements the server left out leave their fields alone.
+ * The group and its permissions are replaced afterwards by
+ * fillStatGroupsFromSrm
+ * 
+ *   Parameters:                                                 [I/O]
  *
- * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ *     detail    the path detail from the srmLs response          I
+ *     stat      structure to fill in                               O
+ * 
+ *   Returns: (void)
  ***********************************************************************/
-digs_error_code_t digs_startPutTransfer_srm(char *errorMessage,
-					    const char *hostname,
-					    const char *localPath,
-					    const char *SURL,
-					    int *handle)
+static void fillStatFromSrm(struct ns1__TMetaDataPathDetail *detail,
+			    digs_stat_t *stat)
 {
-    struct soap *soap;
-    char *endpoint;
-    char *path;
-    char *token;
-    char *protocol;
-    char *dirname;
-    char *slash;
-    digs_error_code_t result = DIGS_SUCCESS;
-    srm_transfer_t *t;
-    long long size;
-    
-    logMessage(DEBUG, "digs_startPutTransfer_srm(%s,%s,%s)", hostname,
-	       localPath, SURL);
-    
-    errorMessage[0] = 0;
-    *handle = -1;
-    
-    /*
-     * Get the local file size
-     */
-    size = getFileLength(localPath);
-    if (size < 0) {
-	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
-		 "Cannot get size of local file %s", localPath);
-	return DIGS_UNKNOWN_ERROR;
+    char *p;
+
+    if (detail->type) {
+	stat->isDirectory = ((*detail->type) == 1);
     }
-    
-    path = constructSRMPath(hostname, SURL);
-    
-    /* make sure the remote directory exists */
-    dirname = safe_strdup(SURL);
-    slash = strrchr(dirname, '/');
-    if (slash) {
-	*slash = 0;
-	digs_mkdirtree_srm(errorMessage, hostname, dirname);
+    if (detail->size) {
+	stat->size = (long long int) *detail->size;
     }
-    globus_libc_free(dirname);
-    
-    if (!srmInit(hostname, &soap, &endpoint)) {
-	globus_libc_free(path);
-	return DIGS_NO_SERVICE;
+    if (detail->lastModificationTime) {
+	stat->modificationTime = *detail->lastModificationTime;
     }
-    
-    result = initiatePutRequest(errorMessage, soap, endpoint, path,
-				&token, &protocol, (ULONG64)size);
-    if (result == DIGS_SUCCESS) {
-	t = newSrmTransfer(hostname, localPath, DIGS_SRM_PUT_TRANSFER);
-	t->token = token; /* will be freed when transfer destroyed */
-	t->remoteFile = path;
-	*handle = t->handle;
-	globus_libc_free(protocol);
+    if ((detail->ownerPermission) && (detail->ownerPermission->userID)) {
+	stat->owner = safe_strdup(detail->ownerPermission->userID);
     }
-    else {
-	globus_libc_free(path);
+    if ((detail->groupPermission) && (detail->groupPermission->groupID)) {
+	stat->group = safe_strdup(detail->groupPermission->groupID);
+    }
+    if ((detail->ownerPermission) && (detail->groupPermission) &&
+	(detail->otherPermission)) {
+	stat->permissions = safe_strdup("0000");
+	stat->permissions[1] = '0' + detail->ownerPermission->mode;
+	stat->permissions[2] = '0' + detail->groupPermission->mode;
+	stat->permissions[3] = '0' + *detail->otherPermission;
+    }
+
+    /* only MD5 is any use to DiGS, other types are ignored */
+    if ((detail->checkSumType) && (detail->checkSumValue) &&
+	(strcasecmp(detail->checkSumType, "MD5") == 0)) {
+	stat->checksum = safe_strdup(detail->checkSumValue);
+	for (p = stat->checksum; *p; p++) {
+	    *p = toupper(*p);
+	}
+	stat->checksumType = DIGS_MD5_CHECKSUM;
     }
-    
-    srmDone(hostname, soap);
-    return result;
 }
 
 
 /***********************************************************************
-*   char *substituteSlashes(char *filename)
-*    
-*   Utility function to replace all the slashes (directory separators)
-*   in a filename with the sequence '-DIR-'. This is done to avoid
-*   maintaining a complex, globally-writable directory hierarchy within
-*   the 'NEW' directory.
-*    
-*   Parameters:                                    [I/O]
-*
-*     filename pointer to the filename to process   I
-*    
-*   Returns: pointer to the processed filename. Should be freed by the
-*            caller. Returns NULL on error.
-***********************************************************************/
-static char *substituteSlashes(const char *filename)
+ * void fillStatGroupsFromSrm(struct soap *soap, char *endpoint,
+ *                            int count, char **paths,
+ *                            digs_stat_t *stats,
+ *                            digs_error_code_t *results)
+ * 
+ * Sets the group of each file stat'd to the ACL group, chosen as
+ * digs_getGroup_srm does, and the group permissions to that ACL's
+ * mode as digs_getPermissions_srm does. srmLs reports the owning group
+ * instead, which is not necessarily the same. All the files are asked
+ * about in one srmGetPermission. If that fails, the groups are left
+ * out, so that nobody records the wrong one
+ * 
+ *   Parameters:                                                 [I/O]
+ *
+ *     soap      SOAP structure for contacting server             I
+ *     endpoint  SRM server endpoint URL                          I
+ *     count     number of files                                  I
+ *     paths     SURLs of the files                               I
+ *     stats     the details from srmLs, to be corrected          I/O
+ *     results   the result of the srmLs for each file            I
+ * 
+ *   Returns: (void)
+ ***********************************************************************/
+static void fillStatGroupsFromSrm(struct soap *soap, char *endpoint,
+				  int count, char **paths,
+				  digs_stat_t *stats,
+				  digs_error_code_t *results)
 {
-    char *newFilename;
-    int i, j;
-    
-    logMessage(1, "substituteSlashes(%s)", filename);
-    
-    newFilename = globus_libc_malloc(5 * strlen(filename));
-    if (!newFilename)
-    {
-	errorExit("Out of memory in substituteSlashes");
+    struct ns1__srmGetPermissionRequest req;
+    struct ns1__srmGetPermissionResponse_ resp;
+    struct ns1__ArrayOfAnyURI surls;
+    struct ns1__ArrayOfTPermissionReturn *perms = NULL;
+    struct ns1__TGroupPermission *grp;
+    int i;
+
+    req.authorizationID = NULL;
+    req.storageSystemInfo = NULL;
+    req.arrayOfSURLs = &surls;
+    surls.__sizeurlArray = count;
+    surls.urlArray = paths;
+
+    if ((soap_call_ns1__srmGetPermission(soap, endpoint, "getPermission",
+					 &req, &resp) == SOAP_OK) &&
+	(resp.srmGetPermissionResponse->returnStatus->statusCode < 2)) {
+	perms = resp.srmGetPermissionResponse->arrayOfPermissionReturns;
+	/* the returns come back in the same order as the SURLs */
+	if ((perms) && ((perms->__sizepermissionArray != count) ||
+			(!perms->permissionArray))) {
+	    perms = NULL;
+	}
     }
 
-    i = 0;
-    j = 0;
-    while (filename[i])
-    {
-	if (filename[i] == '/')
-	{
-	    newFilename[j] = '-';
-	    newFilename[j+1] = 'D';
-	    newFilename[j+2] = 'I';
-	    newFilename[j+3] = 'R';
-	    newFilename[j+4] = '-';
-	    j += 5;
+    for (i = 0; i < count; i++) {
+	if (results[i] != DIGS_SUCCESS) {
+	    continue;
 	}
-	else
-	{
-	    newFilename[j] = filename[i];
-	    j++;
+
+	grp = NULL;
+	if ((perms) && ((!perms->permissionArray[i].status) ||
+			(perms->permissionArray[i].status->statusCode < 2))) {
+	    grp = chooseGroupPermission(&perms->permissionArray[i]);
 	}
 
-	i++;
+	if (stats[i].group) {
+	    globus_libc_free(stats[i].group);
+	    stats[i].group = NULL;
+	}
+	if (!grp) {
+	    logMessage(WARN, "Unable to get group ACL of %s", paths[i]);
+	    continue;
+	}
+	stats[i].group = safe_strdup(grp->groupID);
+	if (stats[i].permissions) {
+	    stats[i].permissions[2] = '0' + grp->mode;
+	}
     }
-    newFilename[j] = 0;
-    return newFilename;
 }
 
+
 /***********************************************************************
- * digs_error_code_t digs_startCopyToInbox_srm(char *errorMessage,
- *		                               const char *hostname,
- *                                             const char *localPath,
- *                                             const char *lfn,
- *                                             int *handle) 
- * 
- * This method is effectively a wrapper around digs_startPutTransfer()
- * that firstly resolves the target SURL based on the specific 
- * configuration of the SE (identified by its hostname). Not all
- * SEs have Inboxes. If this function is called on an SE that does not
- * have an Inbox, then an appropriate error is returned.
- *
- * A handle is returned to uniquely identify this transfer.
+ * digs_error_code_t statSrmPaths(char *errorMessage, struct soap *soap,
+ *                                char *endpoint, const char *hostname,
+ *                                int count, const char **filePaths,
+ *                                digs_stat_t *stats,
+ *                                digs_error_code_t *results)
  * 
- * If a file with the chosen name already exists at the remote
- * location, it will be overwriten without a warning.
+ * Stats a list of files with one detailed srmLs
  * 
- * Parameters:                                                  [I/O]
+ *   Parameters:                                                 [I/O]
  *
- *   errorMessage   buffer to receive message on error (must be    O
- *                  at least MAX_ERROR_MESSAGE_LENGTH chars)
- *   hostname       FQDN of the host to contact                  I
- *   localPath      full path to local file to upload            I
- *   lfn            logical name for file on grid                I
- *   handle         receives unique ID for transfer                O
- *    
- * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ *     errorMessage   buffer to receive error message for the       O
+ *                    first failure (at least
+ *                    MAX_ERROR_MESSAGE_LENGTH chars)
+ *     soap           SOAP structure for contacting server        I
+ *     endpoint       SRM server endpoint URL                     I
+ *     hostname       FQDN of host to contact                     I
+ *     count          number of files                             I
+ *     filePaths      full paths of the files                     I
+ *     stats          receive the details of each file              O
+ *     results        receive the result for each file              O
+ * 
+ *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+ *            code of the first failure
  ***********************************************************************/
-digs_error_code_t digs_startCopyToInbox_srm(char *errorMessage,
-					    const char *hostname,
-					    const char *localPath,
-					    const char *lfn,
-					    int *handle)
+static digs_error_code_t statSrmPaths(char *errorMessage,
+				      struct soap *soap, char *endpoint,
+				      const char *hostname, int count,
+				      const char **filePaths,
+				      digs_stat_t *stats,
+				      digs_error_code_t *results)
 {
     digs_error_code_t result = DIGS_SUCCESS;
-    char *inbox;
-    char *flatFilename;
-    char *remoteFilename;
+    char fileError[MAX_ERROR_MESSAGE_LENGTH];
+    char **paths;
+    int i;
     
-    logMessage(DEBUG, "digs_startCopyToInbox_srm(%s,%s,%s)", hostname,
-	       localPath, lfn);
+    struct ns1__srmLsRequest req;
+    struct ns1__srmLsResponse_ resp;
+    struct ns1__ArrayOfAnyURI arrayOfSURLs;
+    struct ns1__TMetaDataPathDetail *detail;
+    enum xsd__boolean detailed = xsd__boolean__true_;
+    enum xsd__boolean recursive = xsd__boolean__false_;
+
+    paths = globus_libc_malloc(count * sizeof(char *));
+    if (!paths) {
+	errorExit("Out of memory in statSrmPaths");
+    }
+    for (i = 0; i < count; i++) {
+	paths[i] = constructSRMPath(hostname, filePaths[i]);
+    }
     
-    *handle = -1;
-    errorMessage[0] = 0;
+    req.authorizationID = NULL;
+    req.storageSystemInfo = NULL;
+    req.fileStorageType = NULL;
+    req.fullDetailedList = &detailed;
+    req.allLevelRecursive = &recursive;
+    req.numOfLevels = NULL;
+    req.offset = NULL;
+    req.count = NULL;
+    req.arrayOfSURLs = &arrayOfSURLs;
+    arrayOfSURLs.__sizeurlArray = count;
+    arrayOfSURLs.urlArray = paths;
     
-    inbox = getNodeInbox(hostname);
-    if (!inbox) {
-	return DIGS_NO_INBOX;
+    if (soap_call_ns1__srmLs(soap, endpoint, "Ls", &req, &resp)
+	== SOAP_OK) {
+	/*
+	 * as for the single attribute queries, status code 1 is allowed.
+	 * It is also what comes back when only some of the paths failed,
+	 * which the per-path statuses below sort out
+	 */
+	if (resp.srmLsResponse->returnStatus->statusCode < 2) {
+	    if ((!resp.srmLsResponse->details) ||
+		(resp.srmLsResponse->details->__sizepathDetailArray != count) ||
+		(!resp.srmLsResponse->details->pathDetailArray)) {
+		result = DIGS_UNSPECIFIED_SERVER_ERROR;
+		sprintf(errorMessage,
+			"Required element missing from SRM server response");
+		for (i = 0; i < count; i++) {
+		    results[i] = result;
+		}
+	    }
+	    else {
+		/* details come back in the same order as the SURLs */
+		for (i = 0; i < count; i++) {
+		    detail = &resp.srmLsResponse->details->pathDetailArray[i];
+		    if ((detail->status) && (detail->status->statusCode >= 2)) {
+			results[i] = processSrmError(fileError, detail->status);
+			if (result == DIGS_SUCCESS) {
+			    result = results[i];
+			    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+				     "%s: %s", filePaths[i], fileError);
+			}
+		    }
+		    else {
+			fillStatFromSrm(detail, &stats[i]);
+			results[i] = DIGS_SUCCESS;
+		    }
+		}
+		fillStatGroupsFromSrm(soap, endpoint, count, paths, stats,
+				      results);
+	    }
+	}
+	else {
+	    result = processSrmError(errorMessage,
+				     resp.srmLsResponse->returnStatus);
+	    for (i = 0; i < count; i++) {
+		results[i] = result;
+	    }
+	}
     }
-    
-    flatFilename = substituteSlashes(lfn);
-    if (!flatFilename) {
-	errorExit("Out of memory in digs_startCopyToInbox_srm");
+    else {
+	/* SOAP error */
+	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+	result = DIGS_NO_CONNECTION;
+	for (i = 0; i < count; i++) {
+	    results[i] = result;
+	}
     }
-    
-    if (safe_asprintf(&remoteFilename, "%s/%s", inbox,
-		      flatFilename) < 0) {
-	errorExit("Out of memory in digs_startCopyToInbox_srm");    
+
+    for (i = 0; i < count; i++) {
+	globus_libc_free(paths[i]);
     }
-    globus_libc_free(flatFilename);
-    
-    result = digs_startPutTransfer_srm(errorMessage, hostname, localPath,
-				       remoteFilename, handle);
+    globus_libc_free(paths);
     
-    globus_libc_free(remoteFilename);
     return result;
 }
 
 
 /***********************************************************************
- * digs_error_code_t
- * digs_monitorTransfer_srm(char *errorMessage, int handle,
- *                          digs_transferStatus_t *status,
- *                          int *percentComplete);
+ * digs_error_code_t digs_stat_srm(char *errorMessage,
+ *                                 const char *filePath,
+ *                                 const char *hostname,
+ *                                 digs_stat_t *stat);
  * 
- * Checks the progress of a transfer, identified by a handle, and
- * returns its status. Also returns the percentage of the transfer
- * that has been completed.
+ * Gets everything about a file the node can report, in a single
+ * detailed srmLs. The checksum is filled in if the server keeps an
+ * MD5 one. Free the result with digs_freeStat.
  * 
- * Parameters:                                                  [I/O]
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive error message (should be at
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars long)      O
+ *   filePath       the full path to the file                     I
+ *   hostname       the FQDN of the host to contact               I
+ *   stat           receives the file's details                     O
+ *    
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_stat_srm(char *errorMessage,
+				const char *filePath,
+				const char *hostname,
+				digs_stat_t *stat)
+{
+    struct soap *soap;
+    char *endpoint;
+    digs_error_code_t result;
+    digs_error_code_t fileResult;
+    
+    logMessage(DEBUG, "digs_stat_srm(%s,%s)", filePath, hostname);
+    
+    digs_initStat(stat);
+    
+    errorMessage[0] = 0;
+    if (!srmInit(hostname, &soap, &endpoint)) {
+	return DIGS_NO_SERVICE;
+    }
+    
+    result = statSrmPaths(errorMessage, soap, endpoint, hostname, 1,
+			  &filePath, stat, &fileResult);
+    
+    srmDone(hostname, soap);
+    
+    return result;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t digs_statMany_srm(char *errorMessage,
+ *                                     const char *hostname, int count,
+ *                                     const char **filePaths,
+ *                                     digs_stat_t *stats,
+ *                                     digs_error_code_t *results);
+ * 
+ * As digs_stat_srm for a list of files on one node. The paths are sent
+ * in detailed srmLs requests of up to SRM_MAX_STAT_PATHS SURLs each.
+ * 
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive error message for the first   O
+ *                  failure (should be at least
+ *                  MAX_ERROR_MESSAGE_LENGTH chars long)
+ *   hostname       the FQDN of the host to contact               I
+ *   count          number of files                               I
+ *   filePaths      full paths of the files                       I
+ *   stats          receive the details of each file                O
+ *   results        receive the result for each file                O
+ *    
+ * Returns: DIGS_SUCCESS if every file was stat'd, otherwise the code
+ *          of the first failure
+ ***********************************************************************/
+digs_error_code_t digs_statMany_srm(char *errorMessage,
+				    const char *hostname, int count,
+				    const char **filePaths,
+				    digs_stat_t *stats,
+				    digs_error_code_t *results)
+{
+    struct soap *soap;
+    char *endpoint;
+    digs_error_code_t result = DIGS_SUCCESS;
+    digs_error_code_t batchResult;
+    char batchError[MAX_ERROR_MESSAGE_LENGTH];
+    int start;
+    int batch;
+    int i;
+    
+    logMessage(DEBUG, "digs_statMany_srm(%s, %d files)", hostname, count);
+    
+    for (i = 0; i < count; i++) {
+	digs_initStat(&stats[i]);
+	results[i] = DIGS_NO_SERVICE;
+    }
+    
+    errorMessage[0] = 0;
+    if (!srmInit(hostname, &soap, &endpoint)) {
+	return DIGS_NO_SERVICE;
+    }
+    
+    for (start = 0; start < count; start += batch) {
+	batch = count - start;
+	if (batch > SRM_MAX_STAT_PATHS) {
+	    batch = SRM_MAX_STAT_PATHS;
+	}
+	
+	batchError[0] = 0;
+	batchResult = statSrmPaths(batchError, soap, endpoint, hostname,
+				   batch, &filePaths[start], &stats[start],
+				   &results[start]);
+	if ((batchResult != DIGS_SUCCESS) && (result == DIGS_SUCCESS)) {
+	    result = batchResult;
+	    strcpy(errorMessage, batchError);
+	}
+	
+	/* don't keep trying a server that isn't answering */
+	if (batchResult == DIGS_NO_CONNECTION) {
+	    break;
+	}
+    }
+    
+    srmDone(hostname, soap);
+    
+    return result;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t startSrmRequestTransfers(char *errorMessage,
+ *                                            const char *hostname,
+ *                                            int type,
+ *                                            srm_request_t *request,
+ *                                            digs_error_code_t requestResult,
+ *                                            int n, char **paths,
+ *                                            int *files,
+ *                                            const char **localPaths,
+ *                                            int *handles,
+ *                                            digs_error_code_t *results)
+ *
+ * Creates a transfer for each file of a prepare request just sent, or
+ * records the request's failure against each of them
+ *
+ *   Parameters:                                                 [I/O]
+ *
+ *     errorMessage   receives message for the first failure         O
+ *     hostname       FQDN of the host the request was sent to     I
+ *     type           DIGS_SRM_GET_TRANSFER or DIGS_SRM_PUT_TRANSFER I
+ *     request        the request, NULL if it failed               I
+ *     requestResult  result of sending the request                I
+ *     n              number of files in the request               I
+ *     paths          SRM path of each file. Freed here            I
+ *     files          index of each file in localPaths, handles    I
+ *                    and results
+ *     localPaths     local files being transferred                I
+ *     handles        receive the handle of each new transfer        O
+ *     results        receive the result for each file               O
+ *
+ *   Returns: DIGS_SUCCESS if every transfer was created, otherwise the
+ *            code of the first failure
+ ***********************************************************************/
+static digs_error_code_t
+startSrmRequestTransfers(char *errorMessage, const char *hostname,
+			 int type, srm_request_t *request,
+			 digs_error_code_t requestResult, int n,
+			 char **paths, int *files, const char **localPaths,
+			 int *handles, digs_error_code_t *results)
+{
+    srm_transfer_t *t;
+    digs_error_code_t result = DIGS_SUCCESS;
+    int i, k;
+
+    for (k = 0; k < n; k++) {
+	i = files[k];
+	if (requestResult != DIGS_SUCCESS) {
+	    results[i] = requestResult;
+	    result = requestResult;
+	    globus_libc_free(paths[k]);
+	    continue;
+	}
+
+	t = newSrmTransfer(hostname, localPaths[i], type);
+	if (!t) {
+	    if (result == DIGS_SUCCESS) {
+		strncpy(errorMessage, "Too many transfers in progress",
+			MAX_ERROR_MESSAGE_LENGTH);
+		result = DIGS_UNKNOWN_ERROR;
+	    }
+	    results[i] = DIGS_UNKNOWN_ERROR;
+	    globus_libc_free(paths[k]);
+	    continue;
+	}
+
+	/* the handle can be looked up as soon as it is allocated */
+	lockSrmTransfers();
+	t->token = safe_strdup(request->token);
+	t->remoteFile = paths[k]; /* will be freed when transfer destroyed */
+	t->request = request;
+	t->fileIndex = k;
+	request->refCount++;
+	globus_mutex_unlock(&srmTransferLock_);
+
+	handles[i] = t->handle;
+	results[i] = DIGS_SUCCESS;
+    }
+
+    /* nothing took the request up */
+    if ((request) && (request->refCount == 0)) {
+	releaseSrmRequest(request);
+    }
+
+    return result;
+}
+
+/***********************************************************************
+ * digs_error_code_t digs_startPutTransfers_srm(char *errorMessage,
+ *                                              const char *hostname,
+ *                                              int count,
+ *                                              const char **localPaths,
+ *                                              const char **SURLs,
+ *                                              int *handles,
+ *                                              digs_error_code_t *results);
+ *
+ * Starts put operations of several local files to one host. The files
+ * are sent in srmPrepareToPut requests of up to SRM_MAX_REQUEST_FILES
+ * each, and the transfers of a request all get their TURLs from one
+ * status poll. Each file gets its own handle, used as for
+ * digs_startPutTransfer_srm.
+ *
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive message for the first       O
+ *                  failure (must be at least
+ *                  MAX_ERROR_MESSAGE_LENGTH chars)
+ *   hostname       FQDN of the host to contact                   I
+ *   count          number of files                               I
+ *   localPaths     full paths to local files to upload           I
+ *   SURLs          locations to upload files to                  I
+ *   handles        receive unique id for each transfer, or -1      O
+ *   results        receive the result for each file                O
+ *
+ * Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+ *          code of the first failure
+ ***********************************************************************/
+digs_error_code_t digs_startPutTransfers_srm(char *errorMessage,
+					     const char *hostname,
+					     int count,
+					     const char **localPaths,
+					     const char **SURLs,
+					     int *handles,
+					     digs_error_code_t *results)
+{
+    struct soap *soap;
+    char *endpoint;
+    char **paths;
+    ULONG64 *sizes;
+    int *files;
+    char *dirname;
+    char *lastDir = NULL;
+    char *slash;
+    long long size;
+    srm_request_t *request;
+    digs_error_code_t result = DIGS_SUCCESS;
+    digs_error_code_t batchResult;
+    char batchError[MAX_ERROR_MESSAGE_LENGTH];
+    int start, end;
+    int n;
+    int i;
+
+    logMessage(DEBUG, "digs_startPutTransfers_srm(%s, %d files)", hostname,
+	       count);
+
+    errorMessage[0] = 0;
+    for (i = 0; i < count; i++) {
+	handles[i] = -1;
+	results[i] = DIGS_NO_SERVICE;
+    }
+
+    paths = globus_libc_malloc(SRM_MAX_REQUEST_FILES * sizeof(char *));
+    sizes = globus_libc_malloc(SRM_MAX_REQUEST_FILES * sizeof(ULONG64));
+    files = globus_libc_malloc(SRM_MAX_REQUEST_FILES * sizeof(int));
+    if ((!paths) || (!sizes) || (!files)) {
+	errorExit("Out of memory in digs_startPutTransfers_srm");
+    }
+
+    for (start = 0; start < count; start = end) {
+	end = start + SRM_MAX_REQUEST_FILES;
+	if (end > count) {
+	    end = count;
+	}
+
+	n = 0;
+	for (i = start; i < end; i++) {
+	    /*
+	     * Get the local file size
+	     */
+	    size = getFileLength(localPaths[i]);
+	    if (size < 0) {
+		results[i] = DIGS_UNKNOWN_ERROR;
+		if (result == DIGS_SUCCESS) {
+		    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+			     "Cannot get size of local file %s", localPaths[i]);
+		    result = DIGS_UNKNOWN_ERROR;
+		}
+		continue;
+	    }
+
+	    /*
+	     * make sure the remote directory exists. Files in the same
+	     * directory usually come together, so it's only done once
+	     */
+	    dirname = safe_strdup(SURLs[i]);
+	    slash = strrchr(dirname, '/');
+	    if (slash) {
+		*slash = 0;
+		if ((!lastDir) || (strcmp(dirname, lastDir))) {
+		    digs_mkdirtree_srm(batchError, hostname, dirname);
+		    if (lastDir) {
+			globus_libc_free(lastDir);
+		    }
+		    lastDir = dirname;
+		    dirname = NULL;
+		}
+	    }
+	    if (dirname) {
+		globus_libc_free(dirname);
+	    }
+
+	    paths[n] = constructSRMPath(hostname, SURLs[i]);
+	    sizes[n] = (ULONG64)size;
+	    files[n] = i;
+	    n++;
+	}
+	if (n == 0) {
+	    continue;
+	}
+
+	request = NULL;
+	batchError[0] = 0;
+	if (!srmInit(hostname, &soap, &endpoint)) {
+	    strcpy(batchError, "Cannot contact SRM server");
+	    batchResult = DIGS_NO_SERVICE;
+	}
+	else {
+	    batchResult = initiatePutRequest(batchError, soap, endpoint,
+					     hostname, n, paths, sizes,
+					     &request);
+	    srmDone(hostname, soap);
+	}
+
+	batchResult = startSrmRequestTransfers(batchError, hostname,
+					       DIGS_SRM_PUT_TRANSFER, request,
+					       batchResult, n, paths, files,
+					       localPaths, handles, results);
+	if ((batchResult != DIGS_SUCCESS) && (result == DIGS_SUCCESS)) {
+	    result = batchResult;
+	    strcpy(errorMessage, batchError);
+	}
+    }
+
+    if (lastDir) {
+	globus_libc_free(lastDir);
+    }
+    globus_libc_free(paths);
+    globus_libc_free(sizes);
+    globus_libc_free(files);
+
+    return result;
+}
+
+/***********************************************************************
+ * digs_error_code_t digs_startPutTransfer_srm(char *errorMessage,
+ *                                             const char *hostname,
+ *		                               const char *localPath,
+ *                                             const char *SURL,
+ *                                             int *handle);
+ *
+ * Start a put operation (push) of a local file to a remote hostname
+ * with a specified remote location (SURL). A handle is returned to
+ * uniquely identify this transfer.
+ *
+ * If a file with the chosen name already exists at the remote location,
+ * it may be overwriten without a warning.
+ *
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive message on error (must be at  O
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars)
+ *   localPath      full path to local file to upload             I
+ *   hostname       FQDN of the host to contact                   I
+ *   SURL           location to upload file to                    I
+ *   handle         receives unique id for transfer                 O
+ *
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startPutTransfer_srm(char *errorMessage,
+					    const char *hostname,
+					    const char *localPath,
+					    const char *SURL,
+					    int *handle)
+{
+    digs_error_code_t result;
+
+    logMessage(DEBUG, "digs_startPutTransfer_srm(%s,%s,%s)", hostname,
+	       localPath, SURL);
+
+    digs_startPutTransfers_srm(errorMessage, hostname, 1, &localPath,
+			       &SURL, handle, &result);
+    return result;
+}
+
+
+/***********************************************************************
+*   char *substituteSlashes(char *filename)
+*    
+*   Utility function to replace all the slashes (directory separators)
+*   in a filename with the sequence '-DIR-'. This is done to avoid
+*   maintaining a complex, globally-writable directory hierarchy within
+*   the 'NEW' directory.
+*    
+*   Parameters:                                    [I/O]
+*
+*     filename pointer to the filename to process   I
+*    
+*   Returns: pointer to the processed filename. Should be freed by the
+*            caller. Returns NULL on error.
+***********************************************************************/
+static char *substituteSlashes(const char *filename)
+{
+    char *newFilename;
+    int i, j;
+    
+    logMessage(1, "substituteSlashes(%s)", filename);
+    
+    newFilename = globus_libc_malloc(5 * strlen(filename));
+    if (!newFilename)
+    {
+	errorExit("Out of memory in substituteSlashes");
+    }
+
+    i = 0;
+    j = 0;
+    while (filename[i])
+    {
+	if (filename[i] == '/')
+	{
+	    newFilename[j] = '-';
+	    newFilename[j+1] = 'D';
+	    newFilename[j+2] = 'I';
+	    newFilename[j+3] = 'R';
+	    newFilename[j+4] = '-';
+	    j += 5;
+	}
+	else
+	{
+	    newFilename[j] = filename[i];
+	    j++;
+	}
+
+	i++;
+    }
+    newFilename[j] = 0;
+    return newFilename;
+}
+
+/***********************************************************************
+ * digs_error_code_t digs_startCopyToInbox_srm(char *errorMessage,
+ *		                               const char *hostname,
+ *                                             const char *localPath,
+ *                                             const char *lfn,
+ *                                             int *handle) 
+ * 
+ * This method is effectively a wrapper around digs_startPutTransfer()
+ * that firstly resolves the target SURL based on the specific 
+ * configuration of the SE (identified by its hostname). Not all
+ * SEs have Inboxes. If this function is called on an SE that does not
+ * have an Inbox, then an appropriate error is returned.
+ *
+ * A handle is returned to uniquely identify this transfer.
+ * 
+ * If a file with the chosen name already exists at the remote
+ * location, it will be overwriten without a warning.
+ * 
+ * Parameters:                                                  [I/O]
+ *
+ *   errorMessage   buffer to receive message on error (must be    O
+ *                  at least MAX_ERROR_MESSAGE_LENGTH chars)
+ *   hostname       FQDN of the host to contact                  I
+ *   localPath      full path to local file to upload            I
+ *   lfn            logical name for file on grid                I
+ *   handle         receives unique ID for transfer                O
+ *    
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startCopyToInbox_srm(char *errorMessage,
+					    const char *hostname,
+					    const char *localPath,
+					    const char *lfn,
+					    int *handle)
+{
+    digs_error_code_t result = DIGS_SUCCESS;
+    char *inbox;
+    char *flatFilename;
+    char *remoteFilename;
+    
+    logMessage(DEBUG, "digs_startCopyToInbox_srm(%s,%s,%s)", hostname,
+	       localPath, lfn);
+    
+    *handle = -1;
+    errorMessage[0] = 0;
+    
+    inbox = getNodeInbox(hostname);
+    if (!inbox) {
+	return DIGS_NO_INBOX;
+    }
+    
+    flatFilename = substituteSlashes(lfn);
+    if (!flatFilename) {
+	errorExit("Out of memory in digs_startCopyToInbox_srm");
+    }
+    
+    if (safe_asprintf(&remoteFilename, "%s/%s", inbox,
+		      flatFilename) < 0) {
+	errorExit("Out of memory in digs_startCopyToInbox_srm");    
+    }
+    globus_libc_free(flatFilename);
+    
+    result = digs_startPutTransfer_srm(errorMessage, hostname, localPath,
+				       remoteFilename, handle);
+    
+    globus_libc_free(remoteFilename);
+    return result;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t
+ * digs_monitorTransfer_srm(char *errorMessage, int handle,
+ *                          digs_transferStatus_t *status,
+ *                          int *percentComplete);
+ * 
+ * Checks the progress of a transfer, identified by a handle, and
+ * returns its status. Also returns the percentage of the transfer
+ * that has been completed.
+ * 
+ * Parameters:                                                  [I/O]
  *
  *   errorMessage   buffer to receive error message (must be at    O
  *                  least MAX_ERROR_MESSAGE_LENGTH chars)
@@ -2293,8 +3518,6 @@ digs_monitorTransfer_srm(char *errorMessage, int handle,
 {
     srm_transfer_t *t;
     digs_error_code_t result = DIGS_SUCCESS;
-    struct soap *soap;
-    char *endpoint;
     int pcl;
     
     logMessage(DEBUG, "digs_monitorTransfer_srm(%d)", handle);
@@ -2303,8 +3526,12 @@ digs_monitorTransfer_srm(char *errorMessage, int handle,
     
     *status = DIGS_TRANSFER_IN_PROGRESS;
     
+    /* held throughout, as polling changes the request other transfers
+     * share */
+    lockSrmTransfers();
     t = findSrmTransfer(handle);
     if (!t) {
+	globus_mutex_unlock(&srmTransferLock_);
 	/* bad handle */
 	strcpy(errorMessage, "Bad handle passed to digs_monitorTransfer");
 	return DIGS_UNKNOWN_ERROR;
@@ -2324,81 +3551,73 @@ digs_monitorTransfer_srm(char *errorMessage, int handle,
 	
     case DIGS_SRM_WAITING_FOR_TURL:
     {
+	/* no data moves until the server has the file ready */
 	*percentComplete = 0;
-	if (!srmInit(t->hostname, &soap, &endpoint)) {
-	    return DIGS_NO_SERVICE;
+	*status = DIGS_TRANSFER_IN_PREPARATION;
+
+	/*
+	 * One poll of the request covers every file in it, and isn't
+	 * made at all until the next one is due
+	 */
+	pollSrmRequest(t->request);
+
+	if (t->request->results[t->fileIndex] != DIGS_SUCCESS) {
+	    /* failed */
+	    logMessage(WARN, "SRM %s request returned failure",
+		       (t->type == DIGS_SRM_GET_TRANSFER) ? "get" : "put");
+	    result = t->request->results[t->fileIndex];
+	    strncpy(errorMessage, t->request->messages[t->fileIndex],
+		    MAX_ERROR_MESSAGE_LENGTH);
+	    t->status = DIGS_SRM_ERROR;
+	    *status = DIGS_TRANSFER_FAILED;
 	}
-	
-	switch (t->type) {
-	case DIGS_SRM_GET_TRANSFER:
-	{
-	    /* monitor SRM get request */
-	    result = checkGetRequest(errorMessage, soap, endpoint,
-				     t->token, &t->turl);
-	    if (result != DIGS_SUCCESS) {
-		/* failed */
-		logMessage(WARN, "checkGetRequest returned failure");
-		t->status = DIGS_SRM_ERROR;
-		*status = DIGS_TRANSFER_FAILED;
-		*percentComplete = 0;
+	else if (t->request->turls[t->fileIndex]) {
+	    /* ready to start GridFTP transfer */
+	    t->turl = safe_strdup(t->request->turls[t->fileIndex]);
+	    if (t->peerHost) {
+		result = srm_gsiftp_startRelayTransfer(errorMessage,
+						       t->hostname,
+						       t->turl,
+						       t->peerHost,
+						       t->localFile,
+						       (t->type == DIGS_SRM_GET_TRANSFER),
+						       &t->gid);
 	    }
-	    else if (t->turl) {
-		/* ready to start GridFTP transfer */
+	    else if ((t->type == DIGS_SRM_GET_TRANSFER) && (t->rangeLength >= 0)) {
+		result = srm_gsiftp_startGetRangeTransfer(errorMessage,
+							  t->hostname,
+							  t->turl,
+							  t->localFile,
+							  t->rangeOffset,
+							  t->rangeLength,
+							  &t->gid);
+	    }
+	    else if (t->type == DIGS_SRM_GET_TRANSFER) {
 		result = srm_gsiftp_startGetTransfer(errorMessage,
 						     t->hostname,
 						     t->turl,
 						     t->localFile,
 						     &t->gid);
-		if (result == DIGS_SUCCESS) {
-		    *percentComplete = 50;
-		    *status = DIGS_TRANSFER_IN_PROGRESS;
-		    t->status = DIGS_SRM_WAITING_FOR_GRIDFTP;
-		}
-		else {
-		    logMessage(WARN, "starting gridftp get failed");
-		    *percentComplete = 0;
-		    *status = DIGS_TRANSFER_FAILED;
-		    t->status = DIGS_SRM_ERROR;
-		}
 	    }
-	}
-	break;
-	case DIGS_SRM_PUT_TRANSFER:
-	{
-	    /* monitor SRM put request */
-	    result = checkPutRequest(errorMessage, soap, endpoint,
-				     t->token, &t->turl);
-	    if (result != DIGS_SUCCESS) {
-		/* failed */
-		logMessage(WARN, "checkPutRequest returned failure");
-		t->status = DIGS_SRM_ERROR;
-		*status = DIGS_TRANSFER_FAILED;
-		*percentComplete = 0;
-	    }
-	    else if (t->turl) {
-		/* ready to start GridFTP transfer */
+	    else {
 		result = srm_gsiftp_startPutTransfer(errorMessage,
 						     t->hostname,
 						     t->turl,
 						     t->localFile,
 						     &t->gid);
-		if (result == DIGS_SUCCESS) {
-		    *percentComplete = 50;
-		    *status = DIGS_TRANSFER_IN_PROGRESS;
-		    t->status = DIGS_SRM_WAITING_FOR_GRIDFTP;
-		}
-		else {
-		    logMessage(WARN, "starting gridftp put failed");
-		    *percentComplete = 0;
-		    *status = DIGS_TRANSFER_FAILED;
-		    t->status = DIGS_SRM_ERROR;
-		}
+	    }
+	    if (result == DIGS_SUCCESS) {
+		*percentComplete = 50;
+		*status = DIGS_TRANSFER_IN_PROGRESS;
+		t->status = DIGS_SRM_WAITING_FOR_GRIDFTP;
+	    }
+	    else {
+		logMessage(WARN, "starting gridftp %s failed",
+			   (t->type == DIGS_SRM_GET_TRANSFER) ? "get" : "put");
+		*status = DIGS_TRANSFER_FAILED;
+		t->status = DIGS_SRM_ERROR;
 	    }
 	}
-	break;
-	}
-	
-	srmDone(t->hostname, soap);
     }
     break;
     
@@ -2419,13 +3638,215 @@ digs_monitorTransfer_srm(char *errorMessage, int handle,
 	    t->status = DIGS_SRM_ERROR;
 	}
     }
-    break;
+    break;
+    }
+    
+    globus_mutex_unlock(&srmTransferLock_);
+    return result;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t digs_waitForTransfers_srm(char *errorMessage,
+ *                                             int *handles, int count,
+ *                                             float timeOut,
+ *                                             int *completed);
+ *
+ * Blocks until at least one of several transfers has finished or is
+ * ready to move on to its GridFTP stage, or the time out expires. The
+ * transfers' SRM requests are polled as they fall due, and the time
+ * in between is spent waiting on the GridFTP transfers already running
+ *
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive error message (must be at    O
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars)
+ *   handles        IDs of the transfers                          I
+ *   count          number of handles                             I
+ *   timeOut        longest time to wait, in seconds              I
+ *   completed      receives index into handles of a transfer that  O
+ *                  needs attention, or -1 if none did in time
+ *
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_waitForTransfers_srm(char *errorMessage,
+					    int *handles, int count,
+					    float timeOut, int *completed)
+{
+    srm_transfer_t *t;
+    int *gids;
+    int *gidIndices;
+    int numGids;
+    double deadline, wake, now;
+    int done;
+    int i;
+
+    errorMessage[0] = 0;
+    *completed = -1;
+
+    gids = globus_libc_malloc(count * sizeof(int));
+    gidIndices = globus_libc_malloc(count * sizeof(int));
+    if ((!gids) || (!gidIndices)) {
+	errorExit("Out of memory in digs_waitForTransfers_srm");
+    }
+
+    deadline = srmTimeNow() + timeOut;
+    while (*completed < 0) {
+	numGids = 0;
+	wake = deadline;
+	lockSrmTransfers();
+	for (i = 0; i < count; i++) {
+	    t = findSrmTransfer(handles[i]);
+	    if ((!t) || (t->status == DIGS_SRM_FINISHED) ||
+		(t->status == DIGS_SRM_ERROR)) {
+		*completed = i;
+		break;
+	    }
+	    if (t->status == DIGS_SRM_WAITING_FOR_TURL) {
+		pollSrmRequest(t->request);
+		if ((t->request->turls[t->fileIndex]) ||
+		    (t->request->results[t->fileIndex] != DIGS_SUCCESS)) {
+		    /* digs_monitorTransfer will move it on */
+		    *completed = i;
+		    break;
+		}
+		if (t->request->nextPoll < wake) {
+		    wake = t->request->nextPoll;
+		}
+	    }
+	    else {
+		gids[numGids] = t->gid;
+		gidIndices[numGids] = i;
+		numGids++;
+	    }
+	}
+	/* not held while waiting, so the transfers can be ended */
+	globus_mutex_unlock(&srmTransferLock_);
+	if (*completed >= 0) {
+	    break;
+	}
+
+	now = srmTimeNow();
+	if (now >= deadline) {
+	    break;
+	}
+	if (wake < now) {
+	    wake = now;
+	}
+
+	if (numGids > 0) {
+	    done = srm_gsiftp_waitForTransfers(gids, numGids,
+					       (float)(wake - now));
+	    if (done >= 0) {
+		*completed = gidIndices[done];
+	    }
+	}
+	else {
+	    globus_libc_usleep((unsigned long)((wake - now) * 1000000.0));
+	}
+    }
+
+    globus_libc_free(gids);
+    globus_libc_free(gidIndices);
+    return DIGS_SUCCESS;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t digs_getTransferProgress_srm(char *errorMessage,
+ *                                                int handle,
+ *                                                long long *bytes)
+ * 
+ * Gets how many bytes a transfer has moved so far. Nothing has moved
+ * until the GridFTP transfer has been started
+ *
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive error message (must be at
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars)           O
+ *   handle         handle of the transfer                        I
+ *   bytes          receives the number of bytes moved              O
+ *    
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferProgress_srm(char *errorMessage, int handle,
+					       long long *bytes)
+{
+    srm_transfer_t *t;
+
+    digs_error_code_t result = DIGS_SUCCESS;
+
+    errorMessage[0] = 0;
+    *bytes = 0;
+
+    lockSrmTransfers();
+    t = findSrmTransfer(handle);
+    if (!t) {
+	globus_mutex_unlock(&srmTransferLock_);
+	/* bad handle */
+	strcpy(errorMessage, "Bad handle passed to digs_getTransferProgress");
+	return DIGS_UNKNOWN_ERROR;
+    }
+
+    if (t->status == DIGS_SRM_WAITING_FOR_GRIDFTP) {
+	result = srm_gsiftp_getTransferProgress(errorMessage, t->gid, bytes);
+    }
+    globus_mutex_unlock(&srmTransferLock_);
+    return result;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t digs_getTransferChecksum_srm(char *errorMessage,
+ *                                                int handle,
+ *                                                char **checksum)
+ * 
+ * Gets the MD5 checksum of the local file sent by a put that has
+ * finished, worked out from the data as it was sent
+ *
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive error message (must be at
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars)           O
+ *   handle         handle of the transfer                        I
+ *   checksum       receives the checksum, to be freed with         O
+ *                  digs_free_string_srm
+ *    
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferChecksum_srm(char *errorMessage, int handle,
+					       char **checksum)
+{
+    srm_transfer_t *t;
+
+    logMessage(DEBUG, "digs_getTransferChecksum_srm(%d)", handle);
+
+    digs_error_code_t result;
+
+    errorMessage[0] = 0;
+    *checksum = NULL;
+
+    lockSrmTransfers();
+    t = findSrmTransfer(handle);
+    if (!t) {
+	globus_mutex_unlock(&srmTransferLock_);
+	/* bad handle */
+	strcpy(errorMessage, "Bad handle passed to digs_getTransferChecksum");
+	return DIGS_UNKNOWN_ERROR;
+    }
+
+    if ((t->type != DIGS_SRM_PUT_TRANSFER) ||
+	(t->status != DIGS_SRM_FINISHED)) {
+	strcpy(errorMessage, "Transfer has no checksum of what it sent");
+	result = DIGS_UNKNOWN_ERROR;
     }
-    
+    else {
+	result = srm_gsiftp_getTransferChecksum(errorMessage, t->gid, checksum);
+    }
+    globus_mutex_unlock(&srmTransferLock_);
     return result;
 }
 
-
 /***********************************************************************
  * digs_error_code_t digs_endTransfer_srm(char *errorMessage,
  *                                        int handle)
@@ -2459,7 +3880,9 @@ digs_error_code_t digs_endTransfer_srm(char *errorMessage, int handle)
     
     errorMessage[0] = 0;
     
-    t = findSrmTransfer(handle);
+    lockSrmTransfers();
+    t = claimSrmTransfer(handle);
+    globus_mutex_unlock(&srmTransferLock_);
     if (!t) {
 	/* bad handle */
 	strcpy(errorMessage, "Bad handle passed to digs_endTransfer");
@@ -2499,7 +3922,7 @@ digs_error_code_t digs_endTransfer_srm(char *errorMessage, int handle)
 	}
     }
     
-    destroySrmTransfer(handle);
+    destroySrmTransfer(t);
     
     return result;
 }
@@ -2528,17 +3951,25 @@ digs_error_code_t digs_cancelTransfer_srm(char *errorMessage, int handle)
     char *endpoint;
     struct ns1__srmAbortRequestRequest req;
     struct ns1__srmAbortRequestResponse_ resp;
+    struct ns1__srmAbortFilesRequest filesReq;
+    struct ns1__srmAbortFilesResponse_ filesResp;
+    struct ns1__ArrayOfAnyURI surls;
+    int shared;
     
     logMessage(DEBUG, "digs_cancelTransfer_srm(%d)", handle);
 
     errorMessage[0] = 0;
     
-    t = findSrmTransfer(handle);
+    lockSrmTransfers();
+    t = claimSrmTransfer(handle);
     if (!t) {
+	globus_mutex_unlock(&srmTransferLock_);
 	/* bad handle */
 	strcpy(errorMessage, "Bad handle passed to digs_endTransfer");
 	return DIGS_UNKNOWN_ERROR;
     }
+    shared = (t->request->refCount > 1);
+    globus_mutex_unlock(&srmTransferLock_);
     
     /* check whether there's a gridftp transaction to be cancelled */
     switch (t->status) {
@@ -2550,10 +3981,34 @@ digs_error_code_t digs_cancelTransfer_srm(char *errorMessage, int handle)
 	break;
     }
     
-    /* abort the SRM request */
+    /*
+     * abort the SRM request, or just this file if other transfers are
+     * still using the request
+     */
     if (!srmInit(t->hostname, &soap, &endpoint)) {
 	result = DIGS_NO_SERVICE;
     }
+    else if (shared) {
+	filesReq.requestToken = t->token;
+	filesReq.authorizationID = NULL;
+	filesReq.arrayOfSURLs = &surls;
+	surls.__sizeurlArray = 1;
+	surls.urlArray = &t->remoteFile;
+	
+	if (soap_call_ns1__srmAbortFiles(soap, endpoint, "AbortFiles",
+					 &filesReq, &filesResp) == SOAP_OK) {
+	    if (filesResp.srmAbortFilesResponse->returnStatus->statusCode != 0) {
+		result = processSrmError(errorMessage,
+					 filesResp.srmAbortFilesResponse->returnStatus);
+	    }
+	}
+	else {
+	    soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+	    result = DIGS_NO_CONNECTION;
+	}
+	
+	srmDone(t->hostname, soap);
+    }
     else {
 	req.requestToken = t->token;
 	req.authorizationID = NULL;
@@ -2573,7 +4028,7 @@ digs_error_code_t digs_cancelTransfer_srm(char *errorMessage, int handle)
 	srmDone(t->hostname, soap);
     }
     
-    destroySrmTransfer(handle);
+    destroySrmTransfer(t);
     
     return result;
 }
@@ -2705,6 +4160,133 @@ digs_error_code_t digs_mkdirtree_srm(char *errorMessage,
 }
 
 
+/***********************************************************************
+ * digs_error_code_t digs_startGetTransfers_srm(char *errorMessage,
+ *                                              const char *hostname,
+ *                                              int count,
+ *                                              const char **SURLs,
+ *                                              const char **localPaths,
+ *                                              int *handles,
+ *                                              digs_error_code_t *results);
+ *
+ * Starts get operations of several files from one host. The files are
+ * asked for in srmPrepareToGet requests of up to SRM_MAX_REQUEST_FILES
+ * each, and the transfers of a request all get their TURLs from one
+ * status poll. Each file gets its own handle, used as for
+ * digs_startGetTransfer_srm.
+ *
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive message for the first       O
+ *                  failure (must be at least
+ *                  MAX_ERROR_MESSAGE_LENGTH chars)
+ *   hostname       FQDN of host to contact                       I
+ *   count          number of files                               I
+ *   SURLs          full paths to files                           I
+ *   localPaths     local paths to store the files in             I
+ *   handles        receive ID for each transfer, or -1             O
+ *   results        receive the result for each file                O
+ *
+ * Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+ *          code of the first failure
+ ***********************************************************************/
+digs_error_code_t digs_startGetTransfers_srm(char *errorMessage,
+					     const char *hostname,
+					     int count,
+					     const char **SURLs,
+					     const char **localPaths,
+					     int *handles,
+					     digs_error_code_t *results)
+{
+    struct soap *soap;
+    char *endpoint;
+    char **paths;
+    int *files;
+    srm_request_t *request;
+    digs_error_code_t result = DIGS_SUCCESS;
+    digs_error_code_t batchResult;
+    char batchError[MAX_ERROR_MESSAGE_LENGTH];
+    FILE *f;
+    int start, end;
+    int n;
+    int i;
+
+    logMessage(DEBUG, "digs_startGetTransfers_srm(%s, %d files)", hostname,
+	       count);
+
+    errorMessage[0] = 0;
+    for (i = 0; i < count; i++) {
+	handles[i] = -1;
+	results[i] = DIGS_NO_SERVICE;
+    }
+
+    paths = globus_libc_malloc(SRM_MAX_REQUEST_FILES * sizeof(char *));
+    files = globus_libc_malloc(SRM_MAX_REQUEST_FILES * sizeof(int));
+    if ((!paths) || (!files)) {
+	errorExit("Out of memory in digs_startGetTransfers_srm");
+    }
+
+    for (start = 0; start < count; start = end) {
+	end = start + SRM_MAX_REQUEST_FILES;
+	if (end > count) {
+	    end = count;
+	}
+
+	n = 0;
+	for (i = start; i < end; i++) {
+	    /*
+	     * Check we can write to the file
+	     */
+	    f = fopen(localPaths[i], "wb");
+	    if (!f) {
+		results[i] = DIGS_UNKNOWN_ERROR;
+		if (result == DIGS_SUCCESS) {
+		    snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
+			     "Cannot open local file %s for writing",
+			     localPaths[i]);
+		    result = DIGS_UNKNOWN_ERROR;
+		}
+		continue;
+	    }
+	    fclose(f);
+	    unlink(localPaths[i]);
+
+	    paths[n] = constructSRMPath(hostname, SURLs[i]);
+	    files[n] = i;
+	    n++;
+	}
+	if (n == 0) {
+	    continue;
+	}
+
+	request = NULL;
+	batchError[0] = 0;
+	if (!srmInit(hostname, &soap, &endpoint)) {
+	    strcpy(batchError, "Cannot contact SRM server");
+	    batchResult = DIGS_NO_SERVICE;
+	}
+	else {
+	    batchResult = initiateGetRequest(batchError, soap, endpoint,
+					     hostname, n, paths, &request);
+	    srmDone(hostname, soap);
+	}
+
+	batchResult = startSrmRequestTransfers(batchError, hostname,
+					       DIGS_SRM_GET_TRANSFER, request,
+					       batchResult, n, paths, files,
+					       localPaths, handles, results);
+	if ((batchResult != DIGS_SUCCESS) && (result == DIGS_SUCCESS)) {
+	    result = batchResult;
+	    strcpy(errorMessage, batchError);
+	}
+    }
+
+    globus_libc_free(paths);
+    globus_libc_free(files);
+
+    return result;
+}
+
 /***********************************************************************
  * digs_error_code_t digs_startGetTransfer_srm(char *errorMessage,
  *		                               const char *hostname,
@@ -2712,10 +4294,10 @@ digs_error_code_t digs_mkdirtree_srm(char *errorMessage,
  *                                             const char *localPath,
  *		                               int *handle);
  *
- * Starts a get operation (pull) of a file (SURL) from a  
+ * Starts a get operation (pull) of a file (SURL) from a
  * remote hostname to local destination file path. A handle is
  * returned to uniquely identify this transfer.
- * 
+ *
  * Parameters:                                                  [I/O]
  *
  *   errorMessage   buffer to receive message on error (must be    O
@@ -2732,57 +4314,213 @@ digs_error_code_t digs_startGetTransfer_srm(char *errorMessage,
 					    const char *SURL,
 					    const char *localPath,
 					    int *handle)
+{
+    digs_error_code_t result;
+
+    logMessage(DEBUG, "digs_startGetTransfer_srm(%s,%s,%s)", hostname,
+	       SURL, localPath);
+
+    digs_startGetTransfers_srm(errorMessage, hostname, 1, &SURL,
+			       &localPath, handle, &result);
+    return result;
+}
+
+/***********************************************************************
+ * digs_error_code_t digs_startGetRangeTransfer_srm(char *errorMessage,
+ *                                                  const char *hostname,
+ *                                                  const char *SURL,
+ *                                                  const char *localPath,
+ *                                                  long long offset,
+ *                                                  long long length,
+ *                                                  int *handle);
+ *
+ * Starts a get of part of a file (SURL) from a remote hostname. Once
+ * the SRM server has given a TURL for the file, the range is fetched
+ * from it with a partial GridFTP get and written into place in
+ * localPath, which must already exist.
+ *
+ * Parameters:                                                  [I/O]
+ *
+ *   errorMessage   buffer to receive message on error (must be    O
+ *                  at least MAX_ERROR_MESSAGE_LENGTH)
+ *   hostname       FQDN of host to contact                      I
+ *   SURL           full path to file                            I
+ *   localPath      local file to write the range into           I
+ *   offset         where the range starts, in bytes             I
+ *   length         length of the range, in bytes                I
+ *   handle         receives ID for transfer                       O
+ *
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startGetRangeTransfer_srm(char *errorMessage,
+						 const char *hostname,
+						 const char *SURL,
+						 const char *localPath,
+						 long long offset,
+						 long long length,
+						 int *handle)
 {
     struct soap *soap;
     char *endpoint;
     char *path;
-    char *token;
-    char *protocol;
-    digs_error_code_t result = DIGS_SUCCESS;
+    int file = 0;
+    srm_request_t *request = NULL;
     srm_transfer_t *t;
-    FILE *f;
-    
-    logMessage(DEBUG, "digs_startGetTransfer_srm(%s,%s,%s)", hostname,
-	       SURL, localPath);
-    
+    digs_error_code_t result;
+
+    logMessage(DEBUG, "digs_startGetRangeTransfer_srm(%s,%s,%s,%lld,%lld)",
+	       hostname, SURL, localPath, offset, length);
+
     errorMessage[0] = 0;
     *handle = -1;
-    
-    /*
-     * Check we can write to the file
-     */
-    f = fopen(localPath, "wb");
-    if (!f) {
+
+    path = constructSRMPath(hostname, SURL);
+    if (!srmInit(hostname, &soap, &endpoint)) {
+	strcpy(errorMessage, "Cannot contact SRM server");
+	result = DIGS_NO_SERVICE;
+    }
+    else {
+	result = initiateGetRequest(errorMessage, soap, endpoint, hostname, 1,
+				    &path, &request);
+	srmDone(hostname, soap);
+    }
+
+    startSrmRequestTransfers(errorMessage, hostname, DIGS_SRM_GET_TRANSFER,
+			     request, result, 1, &path, &file, &localPath,
+			     handle, &result);
+    if (result != DIGS_SUCCESS) {
+	return result;
+    }
+
+    lockSrmTransfers();
+    t = findSrmTransfer(*handle);
+    t->rangeOffset = offset;
+    t->rangeLength = length;
+    globus_mutex_unlock(&srmTransferLock_);
+    return DIGS_SUCCESS;
+}
+
+
+/***********************************************************************
+ * digs_error_code_t digs_startPeerRelayTransfer_srm(char *errorMessage,
+ *                                                   const char *hostname,
+ *                                                   const char *SURL,
+ *                                                   const char *peerHost,
+ *                                                   const char *peerURL,
+ *                                                   int toPeer,
+ *                                                   int *handle);
+ *
+ * Starts a copy between a file (SURL) on an SRM node and a file on a
+ * node of another type, without staging it on local disk. Once the
+ * SRM server has given a TURL for the file, a file:// peer is simply
+ * got into or put from, and a gsiftp:// one is relayed to or from the
+ * TURL through this process. Ending the transfer checks the copy
+ * against the checksum of the source.
+ *
+ * Parameters:                                                  [I/O]
+ *
+ *   errorMessage   buffer to receive message on error (must be    O
+ *                  at least MAX_ERROR_MESSAGE_LENGTH)
+ *   hostname       FQDN of host to contact                      I
+ *   SURL           full path to file                            I
+ *   peerHost       FQDN of the node at the other end            I
+ *   peerURL        URL of the file on peerHost                  I
+ *   toPeer         set to copy SURL to peerURL, clear to copy   I
+ *                  peerURL to SURL
+ *   handle         receives ID for transfer                       O
+ *
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startPeerRelayTransfer_srm(char *errorMessage,
+						  const char *hostname,
+						  const char *SURL,
+						  const char *peerHost,
+						  const char *peerURL,
+						  int toPeer,
+						  int *handle)
+{
+    struct soap *soap;
+    char *endpoint;
+    char *path;
+    char *dirname;
+    char *slash;
+    char dirError[MAX_ERROR_MESSAGE_LENGTH];
+    ULONG64 size;
+    long long length;
+    int file = 0;
+    srm_request_t *request = NULL;
+    srm_transfer_t *t;
+    digs_error_code_t result;
+
+    logMessage(DEBUG, "digs_startPeerRelayTransfer_srm(%s,%s,%s,%s,%d)",
+	       hostname, SURL, peerHost, peerURL, toPeer);
+
+    errorMessage[0] = 0;
+    *handle = -1;
+
+    /* a node mounted here is no different from a local file */
+    if (!strncmp(peerURL, "file://", 7)) {
+	if (toPeer) {
+	    return digs_startGetTransfer_srm(errorMessage, hostname, SURL,
+					     peerURL + 7, handle);
+	}
+	return digs_startPutTransfer_srm(errorMessage, hostname, peerURL + 7,
+					 SURL, handle);
+    }
+    if (strncmp(peerURL, "gsiftp://", 9)) {
 	snprintf(errorMessage, MAX_ERROR_MESSAGE_LENGTH,
-		 "Cannot open local file %s for writing", localPath);
+		 "Cannot relay to or from %s", peerURL);
 	return DIGS_UNKNOWN_ERROR;
     }
-    fclose(f);
-    unlink(localPath);
-    
-    if (!srmInit(hostname, &soap, &endpoint)) {
-	return DIGS_NO_SERVICE;
+
+    if (!toPeer) {
+	/* the put request wants the size, and the directory must exist */
+	result = srm_gsiftp_getLength(errorMessage, peerHost, peerURL, &length);
+	if (result != DIGS_SUCCESS) {
+	    return result;
+	}
+	size = (ULONG64)length;
+
+	dirname = safe_strdup(SURL);
+	slash = strrchr(dirname, '/');
+	if (slash) {
+	    *slash = 0;
+	    digs_mkdirtree_srm(dirError, hostname, dirname);
+	}
+	globus_libc_free(dirname);
     }
-    
+
     path = constructSRMPath(hostname, SURL);
-    
-    result = initiateGetRequest(errorMessage, soap, endpoint, path,
-				&token, &protocol);
-    if (result == DIGS_SUCCESS) {
-	t = newSrmTransfer(hostname, localPath, DIGS_SRM_GET_TRANSFER);
-	t->token = token; /* will be freed when transfer destroyed */
-	t->remoteFile = path;
-	*handle = t->handle;
-	globus_libc_free(protocol);
+    if (!srmInit(hostname, &soap, &endpoint)) {
+	strcpy(errorMessage, "Cannot contact SRM server");
+	result = DIGS_NO_SERVICE;
     }
     else {
-	globus_libc_free(path);
+	if (toPeer) {
+	    result = initiateGetRequest(errorMessage, soap, endpoint, hostname,
+					1, &path, &request);
+	}
+	else {
+	    result = initiatePutRequest(errorMessage, soap, endpoint, hostname,
+					1, &path, &size, &request);
+	}
+	srmDone(hostname, soap);
+    }
+
+    startSrmRequestTransfers(errorMessage, hostname,
+			     toPeer ? DIGS_SRM_GET_TRANSFER : DIGS_SRM_PUT_TRANSFER,
+			     request, result, 1, &path, &file, &peerURL,
+			     handle, &result);
+    if (result != DIGS_SUCCESS) {
+	return result;
     }
-    
-    srmDone(hostname, soap);
-    return result;
-}
 
+    lockSrmTransfers();
+    t = findSrmTransfer(*handle);
+    t->peerHost = safe_strdup(peerHost);
+    globus_mutex_unlock(&srmTransferLock_);
+    return DIGS_SUCCESS;
+}
 
 /***********************************************************************
  * digs_error_code_t digs_mv_srm(char *errorMessage,
@@ -3032,10 +4770,10 @@ digs_error_code_t digs_copyFromInbox_srm(char *errorMessage,
     char *sourcePath;
     char *sourceSurl;
     char *targetSurl;
-    char *proto;
-    char *sourceToken;
-    char *targetToken;
+    srm_request_t *sourceRequest;
+    srm_request_t *targetRequest;
     long long size;
+    ULONG64 targetSize;
     char *sourceTurl = NULL;
     char *targetTurl = NULL;
     char *targetDir;
@@ -3079,182 +4817,521 @@ digs_error_code_t digs_copyFromInbox_srm(char *errorMessage,
     globus_libc_free(targetDir);
     
     if (!srmInit(hostname, &soap, &endpoint)) {
+	globus_libc_free(sourceSurl);
+	globus_libc_free(targetSurl);
 	return DIGS_NO_SERVICE;
     }
     
     /* request TURLs for both files */
-    result = initiateGetRequest(errorMessage, soap, endpoint, sourceSurl,
-				&sourceToken, &proto);
+    targetSize = (ULONG64)size;
+    result = initiateGetRequest(errorMessage, soap, endpoint, hostname, 1,
+				&sourceSurl, &sourceRequest);
+    if (result == DIGS_SUCCESS) {
+	result = initiatePutRequest(errorMessage, soap, endpoint, hostname, 1,
+				    &targetSurl, &targetSize, &targetRequest);
+	if (result != DIGS_SUCCESS) {
+	    releaseSrmRequest(sourceRequest);
+	}
+    }
+    
+    /* polling the requests needs a connection of its own */
+    srmDone(hostname, soap);
+    
     if (result == DIGS_SUCCESS) {
-	globus_libc_free(proto);
+	/* wait for both TURLs to become available */
+	result = waitForSrmTurl(errorMessage, sourceRequest, 0,
+				&sourceTurl);
+	if (result == DIGS_SUCCESS) {
+	    result = waitForSrmTurl(errorMessage, targetRequest, 0,
+				    &targetTurl);
+	}
+	    
+	/* if we got both TURLs, do the transfer */
+	if ((sourceTurl) && (targetTurl)) {
+	    result = srm_gsiftp_thirdPartyCopy(errorMessage, hostname,
+					       sourceTurl, targetTurl);
+	    if ((result == DIGS_SUCCESS) &&
+		(!srmInit(hostname, &soap, &endpoint))) {
+		result = DIGS_NO_SERVICE;
+	    }
+	    if (result == DIGS_SUCCESS) {
+		struct ns1__srmPutDoneRequest req;
+		struct ns1__srmPutDoneResponse_ resp;
+		struct ns1__ArrayOfAnyURI surls;
+		char *tpath;
+		    
+		/* call putDone */
+		tpath = targetSurl;
+		    
+		req.authorizationID = NULL;
+		req.requestToken = targetRequest->token;
+		req.arrayOfSURLs = &surls;
+		    
+		surls.__sizeurlArray = 1;
+		surls.urlArray = &tpath;
+		    
+		if (soap_call_ns1__srmPutDone(soap, endpoint, "PutDone", &req,
+					      &resp) == SOAP_OK) {
+		    if (resp.srmPutDoneResponse->returnStatus->statusCode != 0) {
+			result =
+			    processSrmError(errorMessage,
+					    resp.srmPutDoneResponse->returnStatus);
+		    }
+		    else {
+			    
+		    }
+		}
+		else {
+		    soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+		    result = DIGS_NO_CONNECTION;
+		}
+		srmDone(hostname, soap);
+	    }
+	}
+	    
+	if (sourceTurl) globus_libc_free(sourceTurl);
+	if (targetTurl) globus_libc_free(targetTurl);
+	    
+	releaseSrmRequest(targetRequest);
+	releaseSrmRequest(sourceRequest);
+    }
+    
+    globus_libc_free(sourceSurl);
+    globus_libc_free(targetSurl);
+    return result;
+}
+
+/*
+ * List of file paths built up by a scan, grown as needed
+ */
+typedef struct srm_list_s
+{
+    char **list;
+    int length;
+    int alloced;
+} srm_list_t;
+
+/***********************************************************************
+ * int addToSrmList(const char *filePath, void *userData)
+ * 
+ * Scan callback which adds each file found to an srm_list_t
+ * 
+ * Parameters:                                                   [I/O]
+ *
+ *   filePath   path of the file found                            I
+ *   userData   the list to add it to                            I/O
+ *    
+ * Returns: 1, to carry on scanning
+ ***********************************************************************/
+static int addToSrmList(const char *filePath, void *userData)
+{
+    srm_list_t *l = (srm_list_t *)userData;
+    
+    if (l->length == l->alloced) {
+	l->alloced = (l->alloced == 0) ? 64 : (l->alloced * 2);
+	l->list = globus_libc_realloc(l->list, l->alloced * sizeof(char*));
+	if (!l->list) {
+	    errorExit("Out of memory in addToSrmList");
+	}
+    }
+    l->list[l->length] = safe_strdup(filePath);
+    l->length++;
+    return 1;
+}
+
+/***********************************************************************
+ * digs_error_code_t listSrmPage(char *errorMessage,
+ *                               const char *hostname, char *surl,
+ *                               int offset, int *count,
+ *                               char ***files, int *numFiles,
+ *                               char ***dirs, int *numDirs,
+ *                               int *numEntries)
+ * 
+ * Lists one page of a directory on an SRM node. If the server handles
+ * the listing asynchronously, its status is polled with backoff until
+ * it is ready. The connection is given back before this returns, so
+ * the names are copied out of the response.
+ * 
+ * Parameters:                                                   [I/O]
+ *
+ *   errorMessage   buffer to receive error message (must be at     O
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars)
+ *   hostname       FQDN of the host to contact                   I
+ *   surl           SURL of the directory                         I
+ *   offset         index of the first entry wanted               I
+ *   count          most entries wanted. Reduced if the server     I/O
+ *                  says it is too many
+ *   files          receives paths of regular files in the page     O
+ *   numFiles       receives number of files                        O
+ *   dirs           receives paths of subdirectories in the page    O
+ *   numDirs        receives number of subdirectories               O
+ *   numEntries     receives number of entries the server returned  O
+ *    
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+static digs_error_code_t listSrmPage(char *errorMessage,
+				     const char *hostname, char *surl,
+				     int offset, int *count,
+				     char ***files, int *numFiles,
+				     char ***dirs, int *numDirs,
+				     int *numEntries)
+{
+    struct soap *soap;
+    char *endpoint;
+    digs_error_code_t result = DIGS_SUCCESS;
+    char *token = NULL;
+    double interval = SRM_MIN_POLL_INTERVAL;
+    struct ns1__TReturnStatus *returnStatus;
+    struct ns1__ArrayOfTMetaDataPathDetail *details;
+    struct ns1__ArrayOfTMetaDataPathDetail *entries;
+    struct ns1__TMetaDataPathDetail *entry;
+    int i;
+    
+    struct ns1__srmLsRequest req;
+    struct ns1__srmLsResponse_ resp;
+    struct ns1__srmStatusOfLsRequestRequest sreq;
+    struct ns1__srmStatusOfLsRequestResponse_ sresp;
+    struct ns1__ArrayOfAnyURI arrayOfSURLs;
+    enum xsd__boolean detailed = xsd__boolean__false_;
+    enum xsd__boolean recursive = xsd__boolean__false_;
+    int levels = 1;
+    
+    *files = NULL;
+    *numFiles = 0;
+    *dirs = NULL;
+    *numDirs = 0;
+    *numEntries = 0;
+    
+    for (;;) {
+	if (!srmInit(hostname, &soap, &endpoint)) {
+	    strcpy(errorMessage, "Cannot contact SRM server");
+	    result = DIGS_NO_SERVICE;
+	    break;
+	}
 	
-	result = initiatePutRequest(errorMessage, soap, endpoint, targetSurl,
-				    &targetToken, &proto, (ULONG64)size);
-	if (result == DIGS_SUCCESS) {
-	    globus_libc_free(proto);
+	if (!token) {
+	    req.authorizationID = NULL;
+	    req.storageSystemInfo = NULL;
+	    req.fileStorageType = NULL;
+	    req.fullDetailedList = &detailed;
+	    req.allLevelRecursive = &recursive;
+	    req.numOfLevels = &levels;
+	    req.offset = &offset;
+	    req.count = count;
+	    req.arrayOfSURLs = &arrayOfSURLs;
+	    arrayOfSURLs.__sizeurlArray = 1;
+	    arrayOfSURLs.urlArray = &surl;
 	    
-	    /* wait for both TURLs to become available */
-	    while ((!sourceTurl) || (!targetTurl)) {
-		result = checkGetRequest(errorMessage, soap, endpoint, sourceToken,
-					 &sourceTurl);
-		if (result != DIGS_SUCCESS) {
-		    break;
-		}
-		
-		result = checkPutRequest(errorMessage, soap, endpoint, targetToken,
-					 &targetTurl);
-		if (result != DIGS_SUCCESS) {
-		    break;
-		}
-		
-		globus_libc_usleep(10000);
+	    if (soap_call_ns1__srmLs(soap, endpoint, "Ls", &req, &resp)
+		!= SOAP_OK) {
+		soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+		srmDone(hostname, soap);
+		result = DIGS_NO_CONNECTION;
+		break;
+	    }
+	    returnStatus = resp.srmLsResponse->returnStatus;
+	    details = resp.srmLsResponse->details;
+	    if (resp.srmLsResponse->requestToken) {
+		token = safe_strdup(resp.srmLsResponse->requestToken);
 	    }
+	}
+	else {
+	    sreq.authorizationID = NULL;
+	    sreq.requestToken = token;
+	    sreq.offset = &offset;
+	    sreq.count = count;
 	    
-	    /* if we got both TURLs, do the transfer */
-	    if ((sourceTurl) && (targetTurl)) {
-		result = srm_gsiftp_thirdPartyCopy(errorMessage, hostname,
-						   sourceTurl, targetTurl);
-		if (result == DIGS_SUCCESS) {
-		    struct ns1__srmPutDoneRequest req;
-		    struct ns1__srmPutDoneResponse_ resp;
-		    struct ns1__ArrayOfAnyURI surls;
-		    char *tpath;
-		    
-		    /* call putDone */
-		    tpath = targetSurl;
-		    
-		    req.authorizationID = NULL;
-		    req.requestToken = targetToken;
-		    req.arrayOfSURLs = &surls;
-		    
-		    surls.__sizeurlArray = 1;
-		    surls.urlArray = &tpath;
-		    
-		    if (soap_call_ns1__srmPutDone(soap, endpoint, "PutDone", &req,
-						  &resp) == SOAP_OK) {
-			if (resp.srmPutDoneResponse->returnStatus->statusCode != 0) {
-			    result =
-				processSrmError(errorMessage,
-						resp.srmPutDoneResponse->returnStatus);
-			}
-			else {
-			    
-			}
-		    }
-		    else {
-			soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
-			result = DIGS_NO_CONNECTION;
-		    }
+	    if (soap_call_ns1__srmStatusOfLsRequest(soap, endpoint,
+						    "StatusOfLsRequest",
+						    &sreq, &sresp)
+		!= SOAP_OK) {
+		soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+		srmDone(hostname, soap);
+		result = DIGS_NO_CONNECTION;
+		break;
+	    }
+	    returnStatus = sresp.srmStatusOfLsRequestResponse->returnStatus;
+	    details = sresp.srmStatusOfLsRequestResponse->details;
+	}
+	
+	if ((returnStatus->statusCode == 17) ||
+	    (returnStatus->statusCode == 18)) {
+	    /* queued or in progress, wait before asking again */
+	    srmDone(hostname, soap);
+	    if (!token) {
+		strcpy(errorMessage, "SRM server gave no token for listing");
+		result = DIGS_UNKNOWN_ERROR;
+		break;
+	    }
+	    globus_libc_usleep((unsigned long)(interval * 1000000.0));
+	    interval *= 2.0;
+	    if (interval > SRM_MAX_POLL_INTERVAL) {
+		interval = SRM_MAX_POLL_INTERVAL;
+	    }
+	    continue;
+	}
+	
+	if ((returnStatus->statusCode == 13) &&
+	    (*count > SRM_LS_MIN_PAGE_SIZE)) {
+	    /* too many results, ask for a smaller page */
+	    srmDone(hostname, soap);
+	    *count /= 2;
+	    logMessage(DEBUG, "srmLs page too large, trying %d", *count);
+	    if (token) {
+		globus_libc_free(token);
+		token = NULL;
+	    }
+	    continue;
+	}
+	
+	if (returnStatus->statusCode != 0) {
+	    result = processSrmError(errorMessage, returnStatus);
+	    srmDone(hostname, soap);
+	    break;
+	}
+	
+	/*
+	 * The directory itself is the only top level entry; the page of
+	 * its contents is below it
+	 */
+	entries = NULL;
+	if ((details) && (details->__sizepathDetailArray > 0)) {
+	    entries = details->pathDetailArray[0].arrayOfSubPaths;
+	}
+	if (entries) {
+	    *numEntries = entries->__sizepathDetailArray;
+	    *files = globus_libc_malloc((*numEntries + 1) * sizeof(char*));
+	    *dirs = globus_libc_malloc((*numEntries + 1) * sizeof(char*));
+	    if ((!*files) || (!*dirs)) {
+		errorExit("Out of memory in listSrmPage");
+	    }
+	    for (i = 0; i < *numEntries; i++) {
+		entry = &entries->pathDetailArray[i];
+		if ((entry->type) && (*entry->type == 1)) {
+		    (*dirs)[*numDirs] = safe_strdup(entry->path);
+		    (*numDirs)++;
+		}
+		else {
+		    (*files)[*numFiles] = safe_strdup(entry->path);
+		    (*numFiles)++;
 		}
 	    }
-	    
-	    if (sourceTurl) globus_libc_free(sourceTurl);
-	    if (targetTurl) globus_libc_free(targetTurl);
-	    
-	    globus_libc_free(targetToken);
 	}
-	globus_libc_free(sourceToken);
+	srmDone(hostname, soap);
+	break;
     }
     
-    srmDone(hostname, soap);
-    globus_libc_free(sourceSurl);
-    globus_libc_free(targetSurl);
+    if (token) {
+	globus_libc_free(token);
+    }
     return result;
 }
 
 /***********************************************************************
- * int countSrmList(struct ns1__ArrayOfTMetaDataPathDetail *l,
- *                  int allFiles)
+ * digs_error_code_t scanSrmDirectory(char *errorMessage,
+ *                                    const char *hostname,
+ *                                    const char *dirPath,
+ *                                    int recurse, int allFiles,
+ *                                    digs_scan_callback_t callback,
+ *                                    void *userData, int *stopped)
  * 
- * Helper function which counts the number of regular files in an SRM
- * list. Directories are not included in the count. The function
- * automatically recurses into sub-directories (assuming the original
- * list operation was recursive).
+ * Lists a directory on an SRM node a page at a time, passing each file
+ * to a callback. Subdirectories are listed in turn rather than asking
+ * the server for the whole tree at once, so only one page is held in
+ * memory, plus the paths of directories still to be listed. A failure
+ * to list one directory doesn't stop the others being listed.
  * 
  * Parameters:                                                   [I/O]
  *
- *   l          pointer to directory info returned by SRM         I
- *   allFiles   whether to include files with a "-LOCKED" suffix  I
+ *   errorMessage   buffer to receive message for the first error   O
+ *                  (must be at least MAX_ERROR_MESSAGE_LENGTH chars)
+ *   hostname       FQDN of the host to contact                   I
+ *   dirPath        path of the directory on the node             I
+ *   recurse        whether to list subdirectories as well        I
+ *   allFiles       whether to include files with a "-LOCKED"     I
+ *                  suffix
+ *   callback       called for each file. Returns 0 to stop       I
+ *   userData       passed through to the callback                I
+ *   stopped        set to 1 if the callback stopped the scan       O
  *    
- * Returns: number of regular files in listing
+ * Returns: DIGS_SUCCESS if everything was listed, otherwise the code of
+ *          the first failure
  ***********************************************************************/
-static int countSrmList(struct ns1__ArrayOfTMetaDataPathDetail *l,
-			int allFiles)
+static digs_error_code_t scanSrmDirectory(char *errorMessage,
+					  const char *hostname,
+					  const char *dirPath,
+					  int recurse, int allFiles,
+					  digs_scan_callback_t callback,
+					  void *userData, int *stopped)
 {
+    digs_error_code_t result = DIGS_SUCCESS;
+    digs_error_code_t pageResult;
+    char pageError[MAX_ERROR_MESSAGE_LENGTH];
+    char **stack;
+    int stackSize = 0;
+    int stackAlloced = 16;
+    char *dir;
+    char *surl;
+    char **files, **dirs;
+    int numFiles, numDirs, numEntries;
+    int pageSize = SRM_LS_PAGE_SIZE;
+    int offset;
+    int len;
     int i;
-    int count = 0;
     
-    if (!l) {
-	return 0;
+    *stopped = 0;
+    
+    stack = globus_libc_malloc(stackAlloced * sizeof(char*));
+    if (!stack) {
+	errorExit("Out of memory in scanSrmDirectory");
     }
+    stack[stackSize++] = safe_strdup(dirPath);
     
-    for (i = 0; i < l->__sizepathDetailArray; i++) {
-	if ((*l->pathDetailArray[i].type) == 1) {
-	    /* subdirectory */
-	    count += countSrmList(l->pathDetailArray[i].arrayOfSubPaths,
-				  allFiles);
-	}
-	else {
-	    /* file */
-	    if (allFiles) {
-		count++;
+    while (stackSize > 0) {
+	dir = stack[--stackSize];
+	surl = constructSRMPath(hostname, dir);
+	
+	logMessage(DEBUG, "listing %s", dir);
+	
+	offset = 0;
+	do {
+	    pageResult = listSrmPage(pageError, hostname, surl, offset,
+				     &pageSize, &files, &numFiles, &dirs,
+				     &numDirs, &numEntries);
+	    if (pageResult != DIGS_SUCCESS) {
+		if (result == DIGS_SUCCESS) {
+		    result = pageResult;
+		    strcpy(errorMessage, pageError);
+		}
+		break;
 	    }
-	    else {
-		int len = strlen(l->pathDetailArray[i].path);
-		if (strcmp(&l->pathDetailArray[i].path[len-7], "-LOCKED")) {
-		    count++;
+	    
+	    for (i = 0; i < numFiles; i++) {
+		len = strlen(files[i]);
+		if ((!*stopped) &&
+		    ((allFiles) || (len < 7) ||
+		     (strcmp(&files[i][len-7], "-LOCKED")))) {
+		    if (!callback(files[i], userData)) {
+			*stopped = 1;
+		    }
+		}
+		globus_libc_free(files[i]);
+	    }
+	    
+	    for (i = 0; i < numDirs; i++) {
+		if (recurse) {
+		    if (stackSize == stackAlloced) {
+			stackAlloced *= 2;
+			stack = globus_libc_realloc(stack, stackAlloced *
+						    sizeof(char*));
+			if (!stack) {
+			    errorExit("Out of memory in scanSrmDirectory");
+			}
+		    }
+		    stack[stackSize++] = dirs[i];
+		}
+		else {
+		    globus_libc_free(dirs[i]);
 		}
 	    }
+	    
+	    if (files) globus_libc_free(files);
+	    if (dirs) globus_libc_free(dirs);
+	    
+	    offset += numEntries;
+	    
+	    /*
+	     * A short page is the end of the directory. So is a long one:
+	     * the server has ignored the count and sent everything
+	     */
+	} while ((!*stopped) && (numEntries > 0) &&
+		 (numEntries == pageSize));
+	
+	globus_libc_free(surl);
+	globus_libc_free(dir);
+	
+	if (*stopped) {
+	    break;
 	}
     }
-    return count;
+    
+    while (stackSize > 0) {
+	globus_libc_free(stack[--stackSize]);
+    }
+    globus_libc_free(stack);
+    
+    return result;
 }
 
 /***********************************************************************
- * int populateSrmList(struct ns1__ArrayOfTMetaDataPathDetail *l,
- *                     int allFiles, char **list, int listpos)
+ * digs_error_code_t digs_scanNodeStream_srm(char *errorMessage,
+ *                                           const char *hostname,
+ *                                           int allFiles,
+ *                                           digs_scan_callback_t callback,
+ *                                           void *userData)
  * 
- * Helper function which translates an SRM list structure into a simple
- * list of filenames as required by the DiGS SE interface. Recurses into
- * sub-directories if they're included in the listing.
+ * Finds all the DiGS data files on a node, passing each one to a
+ * callback as it is found. The data directories are listed a page at
+ * a time.
  * 
  * Parameters:                                                   [I/O]
  *
- *   l          pointer to directory info returned by SRM         I
- *   allFiles   whether to include files with a "-LOCKED" suffix  I
- *   list       DiGS list to add files to (must have enough space I
- *              allocated)
- *   listpos    first unused index in list                        I
+ *   errorMessage   buffer to receive error message (must be at     O
+ *                  least MAX_ERROR_MESSAGE_LENGTH chars)
+ *   hostname       FQDN of the host to contact                   I
+ *   allFiles       whether to show -LOCKED files                 I
+ *   callback       called for each file. Returns 0 to stop       I
+ *   userData       passed through to the callback                I
  *    
- * Returns: next unused index in list
+ * Returns: A DiGs error code (DIGS_SUCCESS if successful, or if the
+ *          callback stopped the scan).
  ***********************************************************************/
-static int populateSrmList(struct ns1__ArrayOfTMetaDataPathDetail *l,
-			   int allFiles, char **list, int listpos)
+digs_error_code_t digs_scanNodeStream_srm(char *errorMessage,
+					  const char *hostname,
+					  int allFiles,
+					  digs_scan_callback_t callback,
+					  void *userData)
 {
-    int i;
-    int pos = listpos;
+    digs_error_code_t result = DIGS_SUCCESS;
+    digs_error_code_t dirResult;
+    char dirError[MAX_ERROR_MESSAGE_LENGTH];
+    char *topDir = getNodePath(hostname);
+    char *dataDir;
+    int dirnum = 1;
+    int exists = 0;
+    int stopped = 0;
+    
+    logMessage(DEBUG, "digs_scanNodeStream_srm(%s)", hostname);
     
-    if (!l) {
-	return pos;
+    if (!topDir) {
+	strcpy(errorMessage, "Error getting node path in scanNode");
+	return DIGS_UNKNOWN_ERROR;
     }
     
-    for (i = 0; i < l->__sizepathDetailArray; i++) {
-	if ((*l->pathDetailArray[i].type) == 1) {
-	    /* subdirectory */
-	    pos = populateSrmList(l->pathDetailArray[i].arrayOfSubPaths,
-				  allFiles, list, pos);
-	}
-	else {
-	    int len = strlen(l->pathDetailArray[i].path);
-	    if ((allFiles) || (strcmp(&l->pathDetailArray[i].path[len-7],
-				      "-LOCKED"))) {
-		/* file */
-		list[pos] = safe_strdup(l->pathDetailArray[i].path);
-		pos++;
-	    }
+    dataDir = globus_libc_malloc(strlen(topDir) + 10);
+    
+    errorMessage[0] = 0;
+    
+    /* loop over all data directories */
+    sprintf(dataDir, "%s/data", topDir);
+    digs_doesExist_srm(errorMessage, dataDir, hostname, &exists);
+    
+    while ((exists) && (!stopped)) {
+	dirResult = scanSrmDirectory(dirError, hostname, dataDir, 1,
+				     allFiles, callback, userData,
+				     &stopped);
+	if ((dirResult != DIGS_SUCCESS) && (result == DIGS_SUCCESS)) {
+	    result = dirResult;
+	    strcpy(errorMessage, dirError);
 	}
+	
+	sprintf(dataDir, "%s/data%d", topDir, dirnum);
+	dirnum++;
+	digs_doesExist_srm(dirError, dataDir, hostname, &exists);
     }
-    return pos;
+    
+    globus_libc_free(dataDir);
+    return result;
 }
 
 /***********************************************************************
@@ -3289,104 +5366,18 @@ digs_error_code_t digs_scanNode_srm(char *errorMessage,
 				    char ***list, int *listLength,
 				    int allFiles)
 {
-    struct soap *soap;
-    char *endpoint;
-    digs_error_code_t result = DIGS_SUCCESS;
-    char *topDir = getNodePath(hostname);
-    char *dataDir;
-    int dirnum = 1;
-    int exists = 0;
-    int count;
-    int pos;
-    
-    char *paths[2] = { NULL, NULL };
-    struct ns1__srmLsRequest req;
-    struct ns1__srmLsResponse_ resp;
-    struct ns1__ArrayOfAnyURI arrayOfSURLs;
-    enum xsd__boolean detailed = xsd__boolean__false_;
-    enum xsd__boolean recursive = xsd__boolean__true_;
+    digs_error_code_t result;
+    srm_list_t l = { NULL, 0, 0 };
     
     logMessage(DEBUG, "digs_scanNode_srm(%s)", hostname);
     
-    if (!topDir) {
-	strcpy(errorMessage, "Error getting node path in scanNode");
-	return DIGS_UNKNOWN_ERROR;
-    }
-    
-    dataDir = globus_libc_malloc(strlen(topDir) + 10);
-    
-    /* initialise list to empty */
-    *list = globus_libc_malloc(sizeof(char*));
-    *listLength = 0;
-    
-    errorMessage[0] = 0;
-    
-    /* loop over all data directories */
-    sprintf(dataDir, "%s/data", topDir);
-    digs_doesExist_srm(errorMessage, dataDir, hostname, &exists);
-    
-    while (exists) {
-	/*
-	 * have to re-init soap every time as existence check method
-	 * will undo it
-	 */
-	if (!srmInit(hostname, &soap, &endpoint)) {
-	    return DIGS_NO_SERVICE;
-	}
-	
-	/* list this data directory */
-	req.authorizationID = NULL;
-	req.storageSystemInfo = NULL;
-	req.fileStorageType = NULL;
-	req.fullDetailedList = &detailed;
-	req.allLevelRecursive = &recursive;
-	req.numOfLevels = NULL;
-	req.offset = NULL;
-	req.count = NULL;
-	req.arrayOfSURLs = &arrayOfSURLs;
-	arrayOfSURLs.__sizeurlArray = 1;
-	arrayOfSURLs.urlArray = &paths[0];
-	paths[0] = constructSRMPath(hostname, dataDir);
-	
-	logMessage(DEBUG, "listing %s", dataDir);
-	
-	if (soap_call_ns1__srmLs(soap, endpoint, "Ls", &req, &resp) ==
-	    SOAP_OK) {
-	    
-	    if (resp.srmLsResponse->returnStatus->statusCode == 0) {
-		/* count how many files */
-		count = countSrmList(resp.srmLsResponse->details, allFiles);
-		
-		if (count > 0) {
-		    /* expand list as needed */
-		    pos = *listLength;
-		    (*listLength) += count;
-		    (*list) = realloc((*list), (*listLength)*sizeof(char*));
-		    
-		    /* put the filenames in the list */
-		    populateSrmList(resp.srmLsResponse->details, allFiles, *list, pos);
-		}
-	    }
-	    else {
-		result = processSrmError(errorMessage,
-					 resp.srmLsResponse->returnStatus);
-	    }
-	}
-	else {
-	    result = DIGS_NO_CONNECTION;
-	    soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
-	}
-	
-	srmDone(hostname, soap);
-	
-	globus_libc_free(paths[0]);
-	
-	sprintf(dataDir, "%s/data%d", topDir, dirnum);
-	dirnum++;
-	digs_doesExist_srm(errorMessage, dataDir, hostname, &exists);
+    result = digs_scanNodeStream_srm(errorMessage, hostname, allFiles,
+				     addToSrmList, &l);
+    if (!l.list) {
+	l.list = globus_libc_malloc(sizeof(char*));
     }
-    
-    globus_libc_free(dataDir);
+    *list = l.list;
+    *listLength = l.length;
     return result;
 }
 
@@ -3422,18 +5413,10 @@ digs_error_code_t digs_scanInbox_srm(char *errorMessage,
 				     char ***list, int *listLength,
 				     int allFiles)
 {
-    struct soap *soap;
-    char *endpoint;
-    digs_error_code_t result = DIGS_SUCCESS;
+    digs_error_code_t result;
     char *inboxDir;
-    int count;
-    char *paths[2] = { NULL, NULL };
-    struct ns1__srmLsRequest req;
-    struct ns1__srmLsResponse_ resp;
-    struct ns1__ArrayOfAnyURI arrayOfSURLs;
-    enum xsd__boolean detailed = xsd__boolean__false_;
-    /* inbox should never have nested directories in it */
-    enum xsd__boolean recursive = xsd__boolean__false_;
+    srm_list_t l = { NULL, 0, 0 };
+    int stopped;
     
     logMessage(DEBUG, "digs_scanInbox_srm(%s)", hostname);
     
@@ -3446,46 +5429,15 @@ digs_error_code_t digs_scanInbox_srm(char *errorMessage,
     }
     
     errorMessage[0] = 0;
-    if (!srmInit(hostname, &soap, &endpoint)) {
-	return DIGS_NO_SERVICE;
-    }
-    
-    req.authorizationID = NULL;
-    req.storageSystemInfo = NULL;
-    req.fileStorageType = NULL;
-    req.fullDetailedList = &detailed;
-    req.allLevelRecursive = &recursive;
-    req.numOfLevels = NULL;
-    req.offset = NULL;
-    req.count = NULL;
-    req.arrayOfSURLs = &arrayOfSURLs;
-    arrayOfSURLs.__sizeurlArray = 1;
-    arrayOfSURLs.urlArray = &paths[0];
-    paths[0] = constructSRMPath(hostname, inboxDir);
     
-    if (soap_call_ns1__srmLs(soap, endpoint, "Ls", &req, &resp)
-	== SOAP_OK) {
-	if (resp.srmLsResponse->returnStatus->statusCode == 0) {
-	    count = countSrmList(resp.srmLsResponse->details, allFiles);
-	    if (count > 0) {
-		(*listLength) = count;
-		(*list) = realloc((*list), (*listLength)*sizeof(char*));
-		populateSrmList(resp.srmLsResponse->details, allFiles, *list,
-				0);
-	    }
-	}
-	else {
-	    result = processSrmError(errorMessage,
-				     resp.srmLsResponse->returnStatus);
-	}
-    }
-    else {
-	result = DIGS_NO_CONNECTION;
-	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
+    /* inbox should never have nested directories in it */
+    result = scanSrmDirectory(errorMessage, hostname, inboxDir, 0,
+			      allFiles, addToSrmList, &l, &stopped);
+    if (l.list) {
+	globus_libc_free(*list);
+	*list = l.list;
+	*listLength = l.length;
     }
-    
-    globus_libc_free(paths[0]);
-    srmDone(hostname, soap);
     return result;
 }
 
@@ -3514,10 +5466,6 @@ digs_error_code_t digs_rmr_srm(char *errorMessage, const char *hostname,
     digs_error_code_t result = DIGS_SUCCESS;
     char *path;
     
-    struct ns1__srmLsRequest lreq;
-    struct ns1__srmLsResponse_ lresp;
-    struct ns1__ArrayOfAnyURI arrayOfSURLs;
-    enum xsd__boolean detailed = xsd__boolean__false_;
     enum xsd__boolean recursive = xsd__boolean__true_;
     
     int isdir = 0;
@@ -3525,8 +5473,8 @@ digs_error_code_t digs_rmr_srm(char *errorMessage, const char *hostname,
     struct ns1__srmRmdirRequest req;
     struct ns1__srmRmdirResponse_ resp;
     
-    char **list = NULL;
-    int listLength = 0;
+    srm_list_t l = { NULL, 0, 0 };
+    int stopped;
     int i;
     
     logMessage(DEBUG, "digs_rmr_srm(%s,%s)", hostname, filePath);
@@ -3543,57 +5491,27 @@ digs_error_code_t digs_rmr_srm(char *errorMessage, const char *hostname,
     }
     
     errorMessage[0] = 0;
-    if (!srmInit(hostname, &soap, &endpoint)) {
-	return DIGS_NO_SERVICE;
-    }
-    
-    path = constructSRMPath(hostname, filePath);
     
     /*
      * handle recursive directory delete. SRM's recursive rmdir won't
      * work if there are regular files within the directory tree (at
      * least on DPM). So we have to scan for them and delete them first.
+     * They are all listed before any are deleted, as deleting would
+     * move the later pages of a listing
      */
-    lreq.authorizationID = NULL;
-    lreq.storageSystemInfo = NULL;
-    lreq.fileStorageType = NULL;
-    lreq.fullDetailedList = &detailed;
-    lreq.allLevelRecursive = &recursive;
-    lreq.numOfLevels = NULL;
-    lreq.offset = NULL;
-    lreq.count = NULL;
-    lreq.arrayOfSURLs = &arrayOfSURLs;
-    arrayOfSURLs.__sizeurlArray = 1;
-    arrayOfSURLs.urlArray = &path;
-    
-    if (soap_call_ns1__srmLs(soap, endpoint, "Ls", &lreq, &lresp)
-	== SOAP_OK) {
-	if (lresp.srmLsResponse->returnStatus->statusCode == 0) {
-	    listLength = countSrmList(lresp.srmLsResponse->details, 1);
-	    if (listLength) {
-		list = globus_libc_malloc(listLength * sizeof(char*));
-		populateSrmList(lresp.srmLsResponse->details, 1, list, 0);
-	    }
-	}
-	else {
-	    result = processSrmError(errorMessage,
-				     lresp.srmLsResponse->returnStatus);
-	}
-    }
-    else {
-	result = DIGS_NO_CONNECTION;
-	soap_sprint_fault(soap, errorMessage, MAX_ERROR_MESSAGE_LENGTH);
-    }
-    srmDone(hostname, soap);
+    result = scanSrmDirectory(errorMessage, hostname, filePath, 1, 1,
+			      addToSrmList, &l, &stopped);
     
     /* delete the files listed */
-    if (list) {
-	for (i = 0; i < listLength; i++) {
-	    digs_rm_srm(errorMessage, hostname, list[i]);
+    if (l.list) {
+	for (i = 0; i < l.length; i++) {
+	    digs_rm_srm(errorMessage, hostname, l.list[i]);
 	}
-	digs_free_string_array_srm(&list, &listLength);
+	digs_free_string_array_srm(&l.list, &l.length);
     }
     
+    path = constructSRMPath(hostname, filePath);
+    
     if (!srmInit(hostname, &soap, &endpoint)) {
 	globus_libc_free(path);
 	return DIGS_NO_SERVICE;
@@ -297,6 +297,52 @@ digs_error_code_t digs_getModificationTime_srm(char *errorMessage,
 		const char *filePath, const char *hostname,
 		time_t *modificationTime);
 
+/***********************************************************************
+ *  digs_error_code_t digs_stat_srm(char *errorMessage,
+ *		const char *filePath, const char *hostname, digs_stat_t *stat);
+ * 
+ *     Gets everything about a file the node can report, in a single
+ *     detailed srmLs. Free the result with digs_freeStat.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 filePath 		the full path to the file							I
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 stat			the file's details									O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_stat_srm(char *errorMessage, const char *filePath,
+		const char *hostname, digs_stat_t *stat);
+
+/***********************************************************************
+ *  digs_error_code_t digs_statMany_srm(char *errorMessage,
+ *		const char *hostname, int count, const char **filePaths,
+ * 		digs_stat_t *stats, digs_error_code_t *results);
+ * 
+ *     As digs_stat_srm for a list of files on one node. The paths
+ *     are sent in one detailed srmLs request.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I
+ * 	 count			the number of files									I
+ * 	 filePaths		the full paths to the files							I
+ * 	 stats			array of count entries receiving the details		O
+ * 	 results		array of count entries receiving the result
+ * 					for each file										O
+ *    
+ *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+ *            code of the first failure, described in errorMessage
+ ***********************************************************************/
+digs_error_code_t digs_statMany_srm(char *errorMessage,
+		const char *hostname, int count, const char **filePaths,
+		digs_stat_t *stats, digs_error_code_t *results);
+
 ///***********************************************************************
 //* partially implemented get_list.
 // ***********************************************************************/
@@ -331,6 +377,35 @@ digs_error_code_t digs_getModificationTime_srm(char *errorMessage,
 digs_error_code_t digs_startPutTransfer_srm(char *errorMessage,
 		const char *localPath, const char *hostname, const char *SURL, int *handle);
 
+/***********************************************************************
+ *digs_error_code_t digs_startPutTransfers_srm(char *errorMessage,
+ *		const char *hostname, int count, const char **localPaths,
+ *		const char **SURLs, int *handles, digs_error_code_t *results);
+ *
+ * As digs_startPutTransfer_srm for several files to the same host. The
+ * files share srmPrepareToPut requests of up to SRM_MAX_REQUEST_FILES
+ * files, so a whole batch costs one prepare call and one status poll
+ * at a time, but each file still gets its own handle.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string for the first failure
+ * 					(expects to have MAX_ERROR_MESSAGE_LENGTH
+ * 					assigned already)									O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 count			the number of files									I
+ * 	 localPaths		the full paths to the local files					I
+ * 	 SURLs			the remote locations to put the files to			I
+ * 	 handles		the id of each transfer, or -1 if it failed			O
+ * 	 results		the result for each file							O
+ *    
+ *   Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+ *            code of the first failure
+ ***********************************************************************/
+digs_error_code_t digs_startPutTransfers_srm(char *errorMessage,
+		const char *hostname, int count, const char **localPaths,
+		const char **SURLs, int *handles, digs_error_code_t *results);
+
 /***********************************************************************
  *digs_error_code_t digs_startCopyToInbox_srm(char *errorMessage,
  *		const char *hostname, const char *localPath, , const char *lfn,
@@ -385,6 +460,69 @@ digs_error_code_t digs_startCopyToInbox_srm(char *errorMessage,
 digs_error_code_t digs_monitorTransfer_srm(char *errorMessage, int handle, 
 		digs_transfer_status_t *status, int *percentComplete);
 
+/***********************************************************************
+ *digs_error_code_t digs_waitForTransfers_srm(char *errorMessage,
+ *		int *handles, int count, float timeOut, int *completed);
+ * 
+ * Blocks until at least one of several transfers has finished, or has
+ * its TURL and is ready for digs_monitorTransfer_srm to start the
+ * GridFTP transfer, or the time out expires. Requests are only polled
+ * when their next poll falls due.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)		O
+ * 	 handles 		the ids of the transfers						I
+ * 	 count 			the number of handles							I
+ * 	 timeOut 		the longest time to wait, in seconds			I
+ * 	 completed		index into handles of a transfer needing
+ * 					attention, or -1 if none did in time			O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_waitForTransfers_srm(char *errorMessage,
+		int *handles, int count, float timeOut, int *completed);
+
+/***********************************************************************
+ * digs_error_code_t digs_getTransferProgress_srm(char *errorMessage,
+ *		int handle, long long *bytes);
+ * 
+ * Gets how many bytes a transfer has moved so far. Nothing has moved
+ * until the GridFTP transfer has been started.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 bytes			receives the number of bytes moved					O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferProgress_srm(char *errorMessage, int handle,
+		long long *bytes);
+
+/***********************************************************************
+ * digs_error_code_t digs_getTransferChecksum_srm(char *errorMessage,
+ *		int handle, char **checksum);
+ * 
+ * Gets the MD5 checksum of the local file sent by a put that has
+ * finished, worked out from the data as it was sent.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ * 	 handle 		the id of the transfer								I
+ * 	 checksum		receives the checksum, to be freed with
+ * 					digs_free_string_srm								O
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_getTransferChecksum_srm(char *errorMessage, int handle,
+		char **checksum);
+
 /***********************************************************************
  * digs_error_code_t digs_endTransfer_srm(char *errorMessage, int handle)
  * 
@@ -484,6 +622,87 @@ digs_error_code_t digs_startGetTransfer_srm(char *errorMessage,
 		const char *hostname, const char *SURL, const char *localPath,
 		int *handle);
 
+/***********************************************************************
+ *digs_error_code_t digs_startGetTransfers_srm(char *errorMessage,
+ *		const char *hostname, int count, const char **SURLs,
+ *		const char **localPaths, int *handles, digs_error_code_t *results);
+ *
+ * As digs_startGetTransfer_srm for several files from the same host,
+ * sharing srmPrepareToGet requests of up to SRM_MAX_REQUEST_FILES files.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string for the first failure
+ * 					(expects to have MAX_ERROR_MESSAGE_LENGTH
+ * 					assigned already)									O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 count			the number of files									I
+ * 	 SURLs			the remote locations to get the files from			I
+ * 	 localPaths		the full paths to store the files in				I
+ * 	 handles		the id of each transfer, or -1 if it failed			O
+ * 	 results		the result for each file							O
+ *    
+ *   Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+ *            code of the first failure
+ ***********************************************************************/
+digs_error_code_t digs_startGetTransfers_srm(char *errorMessage,
+		const char *hostname, int count, const char **SURLs,
+		const char **localPaths, int *handles, digs_error_code_t *results);
+
+/***********************************************************************
+ *digs_error_code_t digs_startGetRangeTransfer_srm(char *errorMessage,
+ *		const char *hostname, const char *SURL, const char *localPath,
+ *		long long offset, long long length, int *handle);
+ *
+ * As digs_startGetTransfer_srm for length bytes of the file from offset
+ * onwards, written into place in localPath, which must already exist.
+ * The range is not checksummed.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 SURL 			the remote location to get the file from			I	
+ * 	 localPath 		the local file to write the range into				I
+ * 	 offset			where the range starts, in bytes					I
+ * 	 length			the length of the range, in bytes					I
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startGetRangeTransfer_srm(char *errorMessage,
+		const char *hostname, const char *SURL, const char *localPath,
+		long long offset, long long length, int *handle);
+
+/***********************************************************************
+ *digs_error_code_t digs_startPeerRelayTransfer_srm(char *errorMessage,
+ *		const char *hostname, const char *SURL, const char *peerHost,
+ *		const char *peerURL, int toPeer, int *handle);
+ *
+ * Starts a copy between SURL and a file on a node of another type,
+ * given by the URL from that node's digs_getRelayURL, without staging
+ * it on local disk. The handle is monitored, ended and cancelled with
+ * this adaptor's functions; ending it checks the copy.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 SURL 			the location of the file on hostname				I	
+ *   peerHost  		the FQDN of the node at the other end      			I	
+ * 	 peerURL		the URL of the file on peerHost						I
+ * 	 toPeer			set to copy SURL to peerURL, clear to copy
+ * 					peerURL to SURL										I
+ * 	 handle 		the id of the transfer								O					
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+ ***********************************************************************/
+digs_error_code_t digs_startPeerRelayTransfer_srm(char *errorMessage,
+		const char *hostname, const char *SURL, const char *peerHost,
+		const char *peerURL, int toPeer, int *handle);
+
 /***********************************************************************
  * digs_error_code_t digs_mv_srm(char *errorMessage, const char *hostname, 
  * const char *filePathFrom, const char *filePathTo);
@@ -613,6 +832,33 @@ digs_error_code_t digs_copyFromInbox_srm(char *errorMessage,
 digs_error_code_t digs_scanNode_srm(char *errorMessage,
 		const char *hostname, char ***list, int *listLength, int allFiles);
 
+/***********************************************************************
+ * digs_error_code_t digs_scanNodeStream_srm(char *errorMessage,
+ * const char *hostname, int allFiles, digs_scan_callback_t callback,
+ * void *userData);
+ * 
+ * As digs_scanNode_srm, but each file is passed to the callback as
+ * soon as it is found. Directories are listed one at a time, in pages
+ * of up to SRM_LS_PAGE_SIZE entries, so the server never has to send
+ * a whole tree in one response. Listings the server queues are polled
+ * with srmStatusOfLsRequest until they are ready.
+ * 
+ *   Parameters:                                                	 [I/O]
+ *
+ * 	 errorMessage	an error description string	(expects to have
+ * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+ *   hostname  		the FQDN of the host to contact          			I	
+ * 	 allFiles		Show all files or hide any temporary (locked files) I
+ * 	 callback		called with the full path of each file				I
+ * 	 userData		passed through to the callback						I
+ *    
+ *   Returns: A DiGs error code (DIGS_SUCCESS if successful, or if the
+ *            callback stopped the scan).
+ ***********************************************************************/
+digs_error_code_t digs_scanNodeStream_srm(char *errorMessage,
+		const char *hostname, int allFiles, digs_scan_callback_t callback,
+		void *userData);
+
 /***********************************************************************
  * digs_error_code_t digs_scanInbox_srm(char *errorMessage, 
  * const char *hostname, char ***list, int *listLength, int allFiles);
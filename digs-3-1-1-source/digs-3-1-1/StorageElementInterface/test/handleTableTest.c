@@ -0,0 +1,195 @@
+/***********************************************************************
+ *
+ *   Filename:   handleTableTest.c
+ *
+ *   Authors:    DiGS developers        (digs)     EPCC.
+ *
+ *   Purpose:    Tests the transfer handle table shared by the storage
+ *               element adaptors.
+ *
+ *   Contents:   Unit tests.
+ *
+ *   Used in:    Called by runAllTests.c
+ *
+ *   Contact:    epcc-support@epcc.ed.ac.uk
+ *
+ *   Copyright (c) 2026 The University of Edinburgh
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 2 of the
+ *   License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ *   MA 02111-1307, USA.
+ *
+ *   As a special exception, you may link this program with code
+ *   developed by the OGSA-DAI project without such code being covered
+ *   by the GNU General Public License.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+
+#include "CuTest.h"
+#include "handletable.h"
+
+/* Structures for handles to refer to. Only their addresses matter */
+static int transferA_;
+static int transferB_;
+
+void TestHandleLookupSuccessful(CuTest *tc) {
+
+	int handle;
+
+	handle = allocateTransferHandle(HANDLE_OWNER_GLOBUS, &transferA_);
+
+	CuAssertTrue(tc, handle >= 0);
+	CuAssertPtrEquals(tc, &transferA_,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, handle));
+
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, handle);
+}
+
+void TestHandleLookupOtherOwner(CuTest *tc) {
+
+	int handle;
+
+	handle = allocateTransferHandle(HANDLE_OWNER_SRM, &transferA_);
+
+	/* A handle given to the wrong storage element is unknown to it */
+	CuAssertPtrEquals(tc, NULL,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, handle));
+	CuAssertPtrEquals(tc, NULL,
+			lookupTransferHandle(HANDLE_OWNER_LOCAL, handle));
+
+	releaseTransferHandle(HANDLE_OWNER_SRM, handle);
+}
+
+void TestHandleLookupInvalid(CuTest *tc) {
+
+	/* Negative, and in a chunk that has never been allocated */
+	CuAssertPtrEquals(tc, NULL,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, -1));
+	CuAssertPtrEquals(tc, NULL,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS,
+					(1 << HANDLE_INDEX_BITS) - 1));
+}
+
+void TestHandleLookupAfterRelease(CuTest *tc) {
+
+	int handle;
+
+	handle = allocateTransferHandle(HANDLE_OWNER_GLOBUS, &transferA_);
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, handle);
+
+	CuAssertPtrEquals(tc, NULL,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, handle));
+}
+
+void TestHandleStaleAfterSlotReused(CuTest *tc) {
+
+	int oldHandle;
+	int newHandle;
+
+	oldHandle = allocateTransferHandle(HANDLE_OWNER_GLOBUS, &transferA_);
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, oldHandle);
+
+	/* The slot just freed is the first one given out again */
+	newHandle = allocateTransferHandle(HANDLE_OWNER_GLOBUS, &transferB_);
+
+	CuAssertIntEquals(tc, oldHandle & ((1 << HANDLE_INDEX_BITS) - 1),
+			newHandle & ((1 << HANDLE_INDEX_BITS) - 1));
+	CuAssertTrue(tc, oldHandle != newHandle);
+	CuAssertPtrEquals(tc, NULL,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, oldHandle));
+	CuAssertPtrEquals(tc, &transferB_,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, newHandle));
+
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, newHandle);
+}
+
+void TestHandleReleaseOtherOwner(CuTest *tc) {
+
+	int handle;
+
+	handle = allocateTransferHandle(HANDLE_OWNER_OMERO, &transferA_);
+
+	/* Ignored, as the handle isn't the caller's */
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, handle);
+
+	CuAssertPtrEquals(tc, &transferA_,
+			lookupTransferHandle(HANDLE_OWNER_OMERO, handle));
+
+	releaseTransferHandle(HANDLE_OWNER_OMERO, handle);
+}
+
+void TestHandleReleaseStale(CuTest *tc) {
+
+	int oldHandle;
+	int newHandle;
+
+	oldHandle = allocateTransferHandle(HANDLE_OWNER_GLOBUS, &transferA_);
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, oldHandle);
+	newHandle = allocateTransferHandle(HANDLE_OWNER_GLOBUS, &transferB_);
+
+	/* Releasing the old handle again mustn't free the slot's new user */
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, oldHandle);
+
+	CuAssertPtrEquals(tc, &transferB_,
+			lookupTransferHandle(HANDLE_OWNER_GLOBUS, newHandle));
+
+	releaseTransferHandle(HANDLE_OWNER_GLOBUS, newHandle);
+}
+
+void TestHandleTableGrows(CuTest *tc) {
+
+	int count = (2 * HANDLE_CHUNK_SIZE) + 1;
+	int *handles;
+	int i;
+
+	handles = malloc(count * sizeof(int));
+	CuAssertPtrNotNull(tc, handles);
+
+	/* More than one chunk's worth, all live at once */
+	for (i = 0; i < count; i++) {
+		handles[i] = allocateTransferHandle(HANDLE_OWNER_LOCAL, &handles[i]);
+		CuAssertTrue(tc, handles[i] >= 0);
+	}
+	for (i = 0; i < count; i++) {
+		CuAssertPtrEquals(tc, &handles[i],
+				lookupTransferHandle(HANDLE_OWNER_LOCAL, handles[i]));
+	}
+
+	for (i = 0; i < count; i++) {
+		releaseTransferHandle(HANDLE_OWNER_LOCAL, handles[i]);
+	}
+	for (i = 0; i < count; i++) {
+		CuAssertPtrEquals(tc, NULL,
+				lookupTransferHandle(HANDLE_OWNER_LOCAL, handles[i]));
+	}
+
+	free(handles);
+}
+
+CuSuite* HandleTableGetSuite() {
+	CuSuite* suite;
+	initTransferHandles();
+	suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestHandleLookupSuccessful);
+	SUITE_ADD_TEST(suite, TestHandleLookupOtherOwner);
+	SUITE_ADD_TEST(suite, TestHandleLookupInvalid);
+	SUITE_ADD_TEST(suite, TestHandleLookupAfterRelease);
+	SUITE_ADD_TEST(suite, TestHandleStaleAfterSlotReused);
+	SUITE_ADD_TEST(suite, TestHandleReleaseOtherOwner);
+	SUITE_ADD_TEST(suite, TestHandleReleaseStale);
+	SUITE_ADD_TEST(suite, TestHandleTableGrows);
+	return suite;
+}
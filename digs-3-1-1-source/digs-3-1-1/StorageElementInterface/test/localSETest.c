@@ -0,0 +1,453 @@
+/***********************************************************************
+ *
+ *   Filename:   localSETest.c
+ *
+ *   Authors:    DiGS developers        (digs)     EPCC.
+ *
+ *   Purpose:    Tests the local file system storage element adaptor
+ *
+ *   Contents:   Unit tests.
+ *
+ *   Used in:    Called by runAllTests.c
+ *
+ *   Contact:    epcc-support@epcc.ed.ac.uk
+ *
+ *   Copyright (c) 2026 The University of Edinburgh
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 2 of the
+ *   License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ *   MA 02111-1307, USA.
+ *
+ *   As a special exception, you may link this program with code
+ *   developed by the OGSA-DAI project without such code being covered
+ *   by the GNU General Public License.
+ *
+ ***********************************************************************/
+
+/*
+ * Unlike globusSETest.c these need no configured node: the adaptor works
+ * on plain paths, so each test runs in a scratch directory made under
+ * /tmp when the suite is set up. The host name isn't in the node list,
+ * so the adaptor's node properties all take their defaults.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "CuTest.h"
+#include "misc.h"
+#include "local.h"
+#include "handletable.h"
+
+static char *local_host_ = "local-se-test";
+
+/* Scratch directory holding everything the tests create */
+static char local_dir_[] = "/tmp/digs-local-se-test-XXXXXX";
+
+/* A file in the scratch directory, and its length and MD5 checksum */
+static char *local_file_;
+static char *local_file_data_ = "Test data for the local SE\n";
+static char *local_file_checksum_ = "13A3925EC53F6BF5DEBBA01CD6B73A01";
+
+static char *localPath(char *name)
+{
+	char *path;
+
+	if (safe_asprintf(&path, "%s/%s", local_dir_, name) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return path;
+}
+
+/*
+ * Waits for a local transfer or checksum to finish
+ */
+static void waitForLocal(CuTest *tc, int handle)
+{
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	int completed;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_waitForTransfers_local(
+			errorMessage, &handle, 1, 30.0, &completed));
+	CuAssertIntEquals(tc, 0, completed);
+}
+
+void TestLocalGetLengthSuccessful(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	long long int length = 0;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_getLength_local(errorMessage,
+			local_file_, local_host_, &length));
+	CuAssertIntEquals(tc, (int)strlen(local_file_data_), (int)length);
+}
+
+void TestLocalGetLengthNoFile(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	long long int length = 0;
+	char *path = localPath("nonExistentFile.txt");
+
+	CuAssertIntEquals(tc, DIGS_FILE_NOT_FOUND, digs_getLength_local(
+			errorMessage, path, local_host_, &length));
+	CuAssertIntEquals(tc, -1, (int)length);
+
+	free(path);
+}
+
+void TestLocalGetLengthFileIsDir(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	long long int length = 0;
+
+	CuAssertIntEquals(tc, DIGS_FILE_IS_DIR, digs_getLength_local(
+			errorMessage, local_dir_, local_host_, &length));
+	CuAssertIntEquals(tc, -1, (int)length);
+}
+
+void TestLocalGetChecksumSuccessful(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	char *checksum = NULL;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_getChecksum_local(errorMessage,
+			local_file_, local_host_, &checksum, DIGS_MD5_CHECKSUM));
+	CuAssertStrEquals(tc, local_file_checksum_, checksum);
+
+	digs_free_string_local(&checksum);
+	CuAssertPtrEquals(tc, NULL, checksum);
+}
+
+void TestLocalGetChecksumUnsupportedType(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	char *checksum = NULL;
+
+	CuAssertIntEquals(tc, DIGS_UNSUPPORTED_CHECKSUM_TYPE,
+			digs_getChecksum_local(errorMessage, local_file_, local_host_,
+					&checksum, DIGS_CRC_CHECKSUM));
+	CuAssertPtrEquals(tc, NULL, checksum);
+}
+
+void TestLocalChecksumInBackground(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	digs_transfer_status_t status;
+	char *checksum = NULL;
+	int handle;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_startChecksum_local(
+			errorMessage, local_file_, local_host_, DIGS_MD5_CHECKSUM,
+			strlen(local_file_data_), &handle));
+	waitForLocal(tc, handle);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_monitorChecksum_local(
+			errorMessage, handle, &status));
+	CuAssertIntEquals(tc, DIGS_TRANSFER_DONE, status);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_endChecksum_local(errorMessage,
+			handle, &checksum));
+	CuAssertStrEquals(tc, local_file_checksum_, checksum);
+	digs_free_string_local(&checksum);
+
+	/* the handle is no longer valid */
+	CuAssertIntEquals(tc, DIGS_UNKNOWN_ERROR, digs_monitorChecksum_local(
+			errorMessage, handle, &status));
+}
+
+void TestLocalDoesExist(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	int doesExist = -1;
+	char *path = localPath("nonExistentFile.txt");
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			local_file_, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 1, doesExist);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			path, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+
+	free(path);
+}
+
+void TestLocalIsDirectory(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	int isDirectory = -1;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_isDirectory_local(errorMessage,
+			local_dir_, local_host_, &isDirectory));
+	CuAssertIntEquals(tc, 1, isDirectory);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_isDirectory_local(errorMessage,
+			local_file_, local_host_, &isDirectory));
+	CuAssertIntEquals(tc, 0, isDirectory);
+}
+
+void TestLocalSetPermissions(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	char *permissions = NULL;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_setPermissions_local(
+			errorMessage, local_file_, local_host_, "0640"));
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_getPermissions_local(
+			errorMessage, local_file_, local_host_, &permissions));
+	CuAssertStrEquals(tc, "0640", permissions);
+	digs_free_string_local(&permissions);
+
+	CuAssertIntEquals(tc, DIGS_UNKNOWN_ERROR, digs_setPermissions_local(
+			errorMessage, local_file_, local_host_, "rw-r-----"));
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_setPermissions_local(
+			errorMessage, local_file_, local_host_, "0644"));
+}
+
+void TestLocalStat(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	digs_stat_t stat;
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_stat_local(errorMessage,
+			local_file_, local_host_, &stat));
+	CuAssertIntEquals(tc, 0, stat.isDirectory);
+	CuAssertIntEquals(tc, (int)strlen(local_file_data_), (int)stat.size);
+	CuAssertStrEquals(tc, "0644", stat.permissions);
+	CuAssertPtrNotNull(tc, stat.owner);
+	CuAssertPtrNotNull(tc, stat.group);
+	digs_freeStat(&stat);
+}
+
+void TestLocalPutTransferSuccessful(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	digs_transfer_status_t status;
+	int percentComplete;
+	char *checksum = NULL;
+	int doesExist;
+	int handle;
+	char *target = localPath("uploadedFile.txt");
+	char *locked = localPath("uploadedFile.txt-LOCKED");
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_startPutTransfer_local(
+			errorMessage, local_host_, local_file_, target, &handle));
+	waitForLocal(tc, handle);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_monitorTransfer_local(
+			errorMessage, handle, &status, &percentComplete));
+	CuAssertIntEquals(tc, DIGS_TRANSFER_DONE, status);
+	CuAssertIntEquals(tc, 100, percentComplete);
+
+	/* the copy only gets its real name when the transfer is ended */
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			target, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_endTransfer_local(errorMessage,
+			handle));
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			locked, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_getChecksum_local(errorMessage,
+			target, local_host_, &checksum, DIGS_MD5_CHECKSUM));
+	CuAssertStrEquals(tc, local_file_checksum_, checksum);
+	digs_free_string_local(&checksum);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_rm_local(errorMessage,
+			local_host_, target));
+
+	free(target);
+	free(locked);
+}
+
+void TestLocalPutTransferNoDir(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	digs_transfer_status_t status;
+	int percentComplete;
+	int handle;
+	char *target = localPath("noSuchDir/uploadedFile.txt");
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_startPutTransfer_local(
+			errorMessage, local_host_, local_file_, target, &handle));
+	waitForLocal(tc, handle);
+
+	CuAssertIntEquals(tc, DIGS_FILE_NOT_FOUND, digs_monitorTransfer_local(
+			errorMessage, handle, &status, &percentComplete));
+	CuAssertIntEquals(tc, DIGS_TRANSFER_FAILED, status);
+	CuAssertIntEquals(tc, DIGS_FILE_NOT_FOUND, digs_endTransfer_local(
+			errorMessage, handle));
+
+	free(target);
+}
+
+void TestLocalPutTransferNoSource(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	int handle;
+	char *source = localPath("nonExistentFile.txt");
+	char *target = localPath("uploadedFile.txt");
+
+	CuAssertIntEquals(tc, DIGS_FILE_NOT_FOUND, digs_startPutTransfer_local(
+			errorMessage, local_host_, source, target, &handle));
+	CuAssertIntEquals(tc, -1, handle);
+
+	free(source);
+	free(target);
+}
+
+void TestLocalCancelTransfer(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	digs_transfer_status_t status;
+	int percentComplete;
+	int doesExist;
+	int handle;
+	char *target = localPath("cancelledFile.txt");
+	char *locked = localPath("cancelledFile.txt-LOCKED");
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_startPutTransfer_local(
+			errorMessage, local_host_, local_file_, target, &handle));
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_cancelTransfer_local(
+			errorMessage, handle));
+
+	/* nothing is left behind, and the handle has gone */
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			target, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			locked, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+	CuAssertIntEquals(tc, DIGS_UNKNOWN_ERROR, digs_monitorTransfer_local(
+			errorMessage, handle, &status, &percentComplete));
+
+	free(target);
+	free(locked);
+}
+
+void TestLocalMkDirTreeAndRmr(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	int isDirectory;
+	int doesExist;
+	char *top = localPath("notHere");
+	char *tree = localPath("notHere/NotADir/Idontexist/newDir");
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_mkdirtree_local(errorMessage,
+			local_host_, tree));
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_isDirectory_local(errorMessage,
+			tree, local_host_, &isDirectory));
+	CuAssertIntEquals(tc, 1, isDirectory);
+
+	/* the last directory already exists now */
+	CuAssertIntEquals(tc, DIGS_UNSPECIFIED_SERVER_ERROR, digs_mkdir_local(
+			errorMessage, local_host_, tree));
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_rmr_local(errorMessage,
+			local_host_, top));
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			top, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+
+	free(top);
+	free(tree);
+}
+
+void TestLocalMv(CuTest *tc) {
+
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+	int doesExist;
+	char *moved = localPath("movedFile.txt");
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_mv_local(errorMessage,
+			local_host_, local_file_, moved));
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			local_file_, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 0, doesExist);
+
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_mv_local(errorMessage,
+			local_host_, moved, local_file_));
+	CuAssertIntEquals(tc, DIGS_SUCCESS, digs_doesExist_local(errorMessage,
+			local_file_, local_host_, &doesExist));
+	CuAssertIntEquals(tc, 1, doesExist);
+
+	free(moved);
+}
+
+/*
+ * Removes the scratch directory when the tests have finished
+ */
+static void cleanupLocal(void) {
+	char errorMessage[MAX_ERROR_MESSAGE_LENGTH];
+
+	digs_rmr_local(errorMessage, local_host_, local_dir_);
+}
+
+/*
+ * Makes the scratch directory and the file the tests read
+ */
+static void setupLocal(void) {
+	FILE *f;
+
+	if (!mkdtemp(local_dir_)) {
+		fprintf(stderr, "Can't create %s\n", local_dir_);
+		exit(1);
+	}
+	atexit(cleanupLocal);
+	local_file_ = localPath("file1.txt");
+
+	f = fopen(local_file_, "w");
+	if (!f) {
+		fprintf(stderr, "Can't create %s\n", local_file_);
+		exit(1);
+	}
+	fputs(local_file_data_, f);
+	fclose(f);
+	chmod(local_file_, 0644);
+
+	if ((!initTransferHandles()) || (!startupLocalStorage())) {
+		fprintf(stderr, "Can't start the local storage adaptor\n");
+		exit(1);
+	}
+}
+
+CuSuite* LocalSEGetSuite() {
+	CuSuite* suite;
+	setupLocal();
+	suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestLocalGetLengthSuccessful);
+	SUITE_ADD_TEST(suite, TestLocalGetLengthNoFile);
+	SUITE_ADD_TEST(suite, TestLocalGetLengthFileIsDir);
+	SUITE_ADD_TEST(suite, TestLocalGetChecksumSuccessful);
+	SUITE_ADD_TEST(suite, TestLocalGetChecksumUnsupportedType);
+	SUITE_ADD_TEST(suite, TestLocalChecksumInBackground);
+	SUITE_ADD_TEST(suite, TestLocalDoesExist);
+	SUITE_ADD_TEST(suite, TestLocalIsDirectory);
+	SUITE_ADD_TEST(suite, TestLocalSetPermissions);
+	SUITE_ADD_TEST(suite, TestLocalStat);
+	SUITE_ADD_TEST(suite, TestLocalPutTransferSuccessful);
+	SUITE_ADD_TEST(suite, TestLocalPutTransferNoDir);
+	SUITE_ADD_TEST(suite, TestLocalPutTransferNoSource);
+	SUITE_ADD_TEST(suite, TestLocalCancelTransfer);
+	SUITE_ADD_TEST(suite, TestLocalMkDirTreeAndRmr);
+	SUITE_ADD_TEST(suite, TestLocalMv);
+	return suite;
+}
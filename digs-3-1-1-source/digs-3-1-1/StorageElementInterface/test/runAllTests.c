@@ -2,12 +2,16 @@
 #include "CuTest.h"
     
     CuSuite* StrUtilGetSuite();
+    CuSuite* HandleTableGetSuite();
+    CuSuite* LocalSEGetSuite();
     
     void RunAllTests(void) {
         CuString *output = CuStringNew();
         CuSuite* suite = CuSuiteNew();
         
         CuSuiteAddSuite(suite, StrUtilGetSuite());
+        CuSuiteAddSuite(suite, HandleTableGetSuite());
+        CuSuiteAddSuite(suite, LocalSEGetSuite());
     
         CuSuiteRun(suite);
         CuSuiteSummary(suite, output);
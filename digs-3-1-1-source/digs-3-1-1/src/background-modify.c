@@ -605,8 +605,9 @@ int handleNewModification(char *lfn, char *realLfn, char *host)
 		   realLfn, host, digsErrorToString(result), errbuf);
 	return 0;
     }
+    /* not there if the storage element moved it out of the inbox */
     result = se->digs_rm(errbuf, host, fullSrcPath);
-    if (result != DIGS_SUCCESS)
+    if ((result != DIGS_SUCCESS) && (result != DIGS_FILE_NOT_FOUND))
     {
 	logMessage(ERROR, "Error removing %s from inbox on %s: %s (%s)",
 		   realLfn, host, digsErrorToString(result), errbuf);
@@ -635,7 +636,7 @@ int handleNewModification(char *lfn, char *realLfn, char *host)
     tmpfile = getTemporaryFile();
 
     /* copy the modified file over it */
-    if (!copyToLocal(host, fullDestPath, tmpfile))
+    if (!copyToLocal(host, fullDestPath, tmpfile, NULL))
     {
 	logMessage(ERROR, "Error fetching modified file %s from %s",
 		   realLfn, host);
@@ -652,7 +653,7 @@ int handleNewModification(char *lfn, char *realLfn, char *host)
 	    fullDestPath = constructFilename(pendingModifications_[i].host,
 					     realLfn);
 	    if (!copyFromLocal(tmpfile, pendingModifications_[i].host,
-			       fullDestPath))
+			       fullDestPath, NULL))
 	    {
 		/* failed - make node dead */
 		logMessage(ERROR, "Error updating %s on %s; setting to dead",
@@ -718,7 +719,7 @@ int tryModificationsOnHost(char *host)
 	    srcfile = constructFilename(pendingModifications_[i].source,
 					pendingModifications_[i].lfn);
 	    if (!copyToLocal(pendingModifications_[i].source,
-			     srcfile, tmpfile))
+			     srcfile, tmpfile, NULL))
 	    {
 		logMessage(ERROR, "Error fetching modified file %s from %s",
 			   pendingModifications_[i].lfn,
@@ -731,7 +732,7 @@ int tryModificationsOnHost(char *host)
 		 * Try to upload the source file on this host
 		 */
 		destfile = constructFilename(host, pendingModifications_[i].lfn);
-		if (!copyFromLocal(tmpfile, host, destfile))
+		if (!copyFromLocal(tmpfile, host, destfile, NULL))
 		{
 		    logMessage(ERROR, "Error copying modified file %s to %s",
 			       pendingModifications_[i].lfn, host);
@@ -49,6 +49,8 @@
 #include "background-new.h"
 #include "background-permissions.h"
 #include "background-modify.h"
+#include "repqueue.h"
+#include "bandwidth.h"
 
 void touchDirectory(char *destination, char *dir);
 int iLikeThisFile(char *destination, char *file);
@@ -76,7 +78,7 @@ extern int qcdgridPort_;
 enum { MT_ADD, MT_TOUCHDIR, MT_TOUCH, MT_CHECK, MT_REMOVE, MT_DISABLE,
        MT_ENABLE, MT_DELETE, MT_RMDIR, MT_RETIRE, MT_UNRETIRE, MT_PING,
        MT_LOCK, MT_UNLOCK, MT_LOCKDIR, MT_UNLOCKDIR, MT_REPLCOUNT,
-       MT_REPLCOUNTDIR, MT_MODIFY
+       MT_REPLCOUNTDIR, MT_MODIFY, MT_REPPRIO, MT_REPCANCEL
 };
 
 /*
@@ -332,6 +334,46 @@ static void handleMessagePutFile(qcdgridMessage_t *msg)
   addPendingAdd(msg->numParams, msg->params);
 }
 
+/*
+ * putFiles <node> <group> <permissions> <time> <submitter>, followed by
+ * <lfn> <size> <md5sum> for each of the files copied to the node's inbox.
+ * Each file is handled as a putFile message, and the node then checked
+ */
+static void handleMessagePutFiles(qcdgridMessage_t *msg)
+{
+    char *params[7];
+    int i;
+
+    if (((msg->numParams - 5) % 3) != 0)
+    {
+	logMessage(5, "processMessages: putFiles has %d params", msg->numParams);
+	return;
+    }
+
+    /* Pending adds are found by the node they were put on */
+    if (nodeIndexFromName(msg->params[0]) < 0)
+    {
+	logMessage(5, "processMessages: node %s doesn't exist", msg->params[0]);
+	return;
+    }
+
+    params[1] = msg->params[1];
+    params[2] = msg->params[2];
+    params[5] = msg->params[3];
+    params[6] = msg->params[4];
+    for (i = 5; i < msg->numParams; i += 3)
+    {
+	params[0] = msg->params[i];
+	params[3] = msg->params[i + 1];
+	params[4] = msg->params[i + 2];
+
+	logMessage(5, "Putting file on a grid: %s", params[0]);
+	addPendingAdd(7, params);
+    }
+
+    addToCheckList(msg->params[0]);
+}
+
 static void handleMessageChmod(qcdgridMessage_t *msg)
 {
   logMessage(5, "Request to change permissions of file[s]: %s", msg->params[2]);
@@ -399,6 +441,25 @@ static void handleMessageModify(qcdgridMessage_t *msg)
     }
 }
 
+static void handleMessageRepprio(qcdgridMessage_t *msg)
+{
+    logMessage(5, "Setting priority of replication %s to %s", msg->params[0],
+	       msg->params[1]);
+    if (!setReplicationPriority(atoi(msg->params[0]), atoi(msg->params[1])))
+    {
+	logMessage(5, "Replication %s is not in the queue", msg->params[0]);
+    }
+}
+
+static void handleMessageRepcancel(qcdgridMessage_t *msg)
+{
+    logMessage(5, "Cancelling replication %s", msg->params[0]);
+    if (!cancelReplication(atoi(msg->params[0])))
+    {
+	logMessage(5, "Replication %s is not in the queue", msg->params[0]);
+    }
+}
+
 /*
  * All the possible message types are in this list
  */
@@ -426,6 +487,7 @@ static struct {
     { "ping", 0, 0, authAlways, handleMessagePing },
 //RADEK changed to authUKQCDGroupOnly from authAlways
     { "putFile", 7, 7, authPutFile, handleMessagePutFile },
+    { "putFiles", 8, 5 + (3 * MAX_PUT_BATCH_FILES), authPutFile, handleMessagePutFiles },
     { "chmod", 4, 4, authUKQCDGroupOnly, handleMessageChmod },
     { "lock", 1, 1, authLockFile, handleMessageLock },
     { "unlock", 1, 1, authUnlockFile, handleMessageUnlock },
@@ -434,6 +496,8 @@ static struct {
     { "replcount", 2, 2, authReplCountFile, handleMessageReplcount },
     { "replcountdir", 2, 2, authReplCountDirectory, handleMessageReplcountdir },
     { "modify", 5, 5, authModify, handleMessageModify },
+    { "repprio", 2, 2, authAdminOnly, handleMessageRepprio },
+    { "repcancel", 1, 1, authAdminOnly, handleMessageRepcancel },
     { NULL, -1, -1, NULL, NULL }
 };
 
@@ -714,6 +778,12 @@ static globus_bool_t authCallback(void *arg, globus_io_handle_t *handle,
 /* socket on which we listen for messages */
 static globus_io_handle_t sock_;
 
+/*
+ * Buffer messages are read into. Only one connection is handled at a
+ * time, as the next listen isn't registered until a message is done
+ */
+static char msgBuffer[MAX_MESSAGE_LENGTH];
+
 /***********************************************************************
 *   void listenCallback(void *arg, globus_io_handle_t *handle,
 *                       globus_result_t result)
@@ -733,7 +803,6 @@ static void listenCallback(void *arg, globus_io_handle_t *handle,
 {
     globus_io_handle_t sock2;
     globus_result_t errorCode;
-    char msgBuffer[2048];
     globus_size_t n, o;
 
     qcdgridMessage_t *msg;
@@ -768,13 +837,27 @@ static void listenCallback(void *arg, globus_io_handle_t *handle,
 	return;
     }
 
-    /* read the message */
-    errorCode = globus_io_read(&sock2, (globus_byte_t *)msgBuffer, 2046, 1, &n);
+    /* read the message. A long one can arrive in several pieces, so keep
+     * reading until its terminating NUL */
+    n = 0;
+    for (;;)
+    {
+	o = 0;
+	errorCode = globus_io_read(&sock2, (globus_byte_t *)&msgBuffer[n],
+				   MAX_MESSAGE_LENGTH - 1 - n, 1, &o);
+	n += o;
+	if ((errorCode != GLOBUS_SUCCESS) || (o == 0) ||
+	    (memchr(msgBuffer, 0, n)) || (n >= MAX_MESSAGE_LENGTH - 1))
+	{
+	    break;
+	}
+    }
     /*
      * globus_io_read seems to be returning undocumented error values at
      * random, even when the read succeeds (for all intents and purposes).
+     * So an error only counts if the whole message didn't arrive
       */
-    if (errorCode != GLOBUS_SUCCESS)
+    if ((errorCode != GLOBUS_SUCCESS) && (!memchr(msgBuffer, 0, n)))
     {
 	logMessage(5, "Error reading from Globus socket");
 	globus_io_close(&sock2);
@@ -985,6 +1068,7 @@ void processMessages()
     while (msg)
     {
 	logMessage(5, "Got message type %d from queue", msg->type);
+	noteClientActivity();
 	messageTypes[msg->type].handler(msg);
 	freeMessage(msg);
 	msg = getMessageFromQueue();
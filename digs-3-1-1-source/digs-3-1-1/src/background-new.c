@@ -706,9 +706,11 @@ static int unNewFile(char *lfn, struct storageElement *se)
 	globus_libc_free(disk);
 	return 0;
     }
-	/* delete the file from the inbox. */
+	/* delete the file from the inbox. Storage elements which move the
+	 * file out of the inbox rather than copying it have nothing left
+	 * to delete */
 	result = se->digs_rm(errbuf, host, fullSrcPath);
-	if (result != DIGS_SUCCESS) {
+	if ((result != DIGS_SUCCESS) && (result != DIGS_FILE_NOT_FOUND)) {
 		logMessage(ERROR, "Error deleting file %s from on %s: %s (%s)",
 				fullSrcPath, host, digsErrorToString(result), errbuf);
 		globus_libc_free(fullDestPath);
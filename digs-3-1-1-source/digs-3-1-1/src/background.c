@@ -66,6 +66,7 @@
 #include "background-msg.h"
 #include "background-permissions.h"
 #include "repqueue.h"
+#include "bandwidth.h"
 
 #define TEMP_SPACE_THRESHOLD 10240
 
@@ -772,6 +773,8 @@ static void makeFreeSpace()
 			{
 			    /* stop if freed enough already */
 			    if (freed >= FREE_PER_ITERATION) break;
+			    /* or if the node is busy */
+			    if (!reserveBandwidth(node, NULL, 0)) break;
 			    nc = getNumCopies(locfiles[j], 0);
 			    if (nc > getFileReplicaCount(locfiles[j]))
 			    {
@@ -1462,22 +1465,35 @@ static void purgeInbox() {
 								"Error running purge inbox on %s: %s (%s)",
 								fromHost, digsErrorToString(result), errbuf);
 					} else { // successfully got list of files from inbox
-						// go through each file and check modification time.
+						// get the modification times of all the files at once
+						digs_stat_t *stats;
+						digs_error_code_t *results;
+
+						stats = globus_malloc(lengthOfList * sizeof(digs_stat_t));
+						results = globus_malloc(lengthOfList * sizeof(digs_error_code_t));
+						if ((lengthOfList > 0) && ((!stats) || (!results))) {
+							errorExit("Out of memory in purgeInbox");
+						}
+
+						logMessage(DEBUG,
+								"Checking modification times of %d files on host %s.",
+								lengthOfList, fromHost);
+						se->digs_statMany(errbuf, fromHost, lengthOfList,
+								(const char **)(*list), stats, results);
+
 						for (fileItr = 0; fileItr < lengthOfList; fileItr++) {
-							logMessage(
-									DEBUG,
-									"Checking modification time of %s on host %s.",
-									(*list)[fileItr], fromHost);
-							result = se->digs_getModificationTime(errbuf, (*list)[fileItr], fromHost, &modtime);
-							if (result != DIGS_SUCCESS) {
+							if (results[fileItr] != DIGS_SUCCESS) {
 								logMessage(
 										5,
 										"Error running purge inbox on %s: %s (%s)",
-										fromHost, digsErrorToString(result),
-										errbuf);
+										fromHost, digsErrorToString(results[fileItr]),
+										(*list)[fileItr]);
 							} else { // successfully got modification time
-								/* see if it's old enough to safely delete - older than 1 day.*/
-								if (difftime(time(NULL), modtime) > 24.0 * 60.0 * 60.0) {
+								modtime = stats[fileItr].modificationTime;
+								/* see if it's old enough to safely delete - older than 1 day.
+								 * A time of 0 means the node couldn't say */
+								if ((modtime != 0) &&
+									(difftime(time(NULL), modtime) > 24.0 * 60.0 * 60.0)) {
 									logMessage(WARN, "Removing %s", (*list)[fileItr]);
 									result = se->digs_rm(errbuf, fromHost, (*list)[fileItr]);
 									if (result != DIGS_SUCCESS) {
@@ -1490,7 +1506,10 @@ static void purgeInbox() {
 									}
 								}
 							}
+							digs_freeStat(&stats[fileItr]);
 						}
+						globus_free(stats);
+						globus_free(results);
 						se->digs_free_string_array(list, &lengthOfList);
 					}
 				}
@@ -1913,6 +1932,10 @@ int main(int argc, char *argv[])
      */
     loadPendingModList();
 
+    /* Restore the replication queue, restarting or resuming any
+     * replications that were in progress when the thread stopped */
+    loadReplicationQueue();
+
     /*
      * Read config information from qcdgrid.conf
      */
@@ -1927,6 +1950,7 @@ int main(int argc, char *argv[])
     newCheckFrequency_ = getConfigIntValue("miscconf", "new_check_frequency", 5);
     verifyFrequency_ = getConfigIntValue("miscconf", "verify_frequency", 20);
     groupModification_ = getConfigIntValue("miscconf", "group_modification", 0);
+    loadBandwidthLimits();
 
     readControlThreadState();
 
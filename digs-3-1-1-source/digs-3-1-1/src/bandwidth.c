@@ -0,0 +1,487 @@
+/***********************************************************************
+*
+*   Filename:   bandwidth.c
+*
+*   Authors:    DiGS developers        (digs)     EPCC.
+*
+*   Purpose:    Limits the bandwidth used by transfers that the control
+*               thread starts itself (replication, checksumming and
+*               freeing space), so that they don't swamp user traffic
+*
+*   Contents:   Token bucket and time window management
+*
+*   Used in:    QCDgrid central control thread
+*
+*   Contact:    epcc-support@epcc.ed.ac.uk
+*
+*   Copyright (c) 2026 The University of Edinburgh
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of the
+*   License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful, but
+*   WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*   General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program; if not, write to the Free Software
+*   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+*   MA 02111-1307, USA.
+*
+*   As a special exception, you may link this program with code
+*   developed by the OGSA-DAI project without such code being covered
+*   by the GNU General Public License.
+*
+***********************************************************************/
+
+/*
+ * Every node, and every site, has a token bucket which fills at its
+ * configured rate. A transfer may start if all the buckets it passes
+ * through (source and destination node, and their sites) are not in
+ * debt; the whole size of the file is then taken from each of them.
+ * Buckets can go negative, so a file larger than the burst size still
+ * gets through, but nothing else starts on those nodes until the debt
+ * has been paid back at the configured rate.
+ *
+ * The rates are all in KB/s and are set in the main config file:
+ *
+ *   bandwidth_default=<rate>            for nodes with no rate of their
+ *                                       own (0, the default, means no
+ *                                       limit)
+ *   site_bandwidth=<site> <rate>        for all the nodes at a site
+ *   bandwidth_window=<HH:MM>-<HH:MM> <percent>
+ *                                       scales every rate during the
+ *                                       given time of day (0 stops the
+ *                                       control thread's transfers)
+ *   bandwidth_burst=<seconds>           size of each bucket, in seconds
+ *                                       of transfer at its rate
+ *   bandwidth_yield_time=<seconds>      how long to back off after a
+ *   bandwidth_yield_percent=<percent>   client talks to the control
+ *                                       thread, and how far to back off
+ *
+ * and a node's own rate can be set with its 'bandwidth' property.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <globus_common.h>
+
+#include "bandwidth.h"
+#include "config.h"
+#include "node.h"
+#include "misc.h"
+
+typedef struct tokenBucket_s
+{
+    char *name;            /* Node FQDN or site name */
+    int isSite;
+
+    double rate;           /* Full rate in bytes per second, 0 if unlimited */
+    double tokens;         /* Bytes that may be sent now. May be negative */
+    time_t lastFilled;
+} tokenBucket_t;
+
+static tokenBucket_t *buckets_ = NULL;
+static int numBuckets_ = 0;
+
+/*
+ * A time of day during which the rates are scaled. Times are in minutes
+ * past midnight; a window with end before start runs over midnight
+ */
+typedef struct bandwidthWindow_s
+{
+    int start;
+    int end;
+    int percent;
+} bandwidthWindow_t;
+
+static bandwidthWindow_t *windows_ = NULL;
+static int numWindows_ = 0;
+
+/* Rate for nodes with no 'bandwidth' property, bytes per second */
+static double defaultRate_ = 0.0;
+
+/* Seconds worth of transfer each bucket can hold */
+static int burstTime_ = 60;
+
+/* Back off to this percentage for this long after client activity */
+static int yieldPercent_ = 10;
+static int yieldTime_ = 300;
+
+static time_t lastClientActivity_ = 0;
+
+/***********************************************************************
+*   double parseRate(char *str)
+*
+*   Converts a rate from the config file to bytes per second
+*
+*   Parameters:                                                     [I/O]
+*
+*    str     Rate in KB/s                                            I
+*
+*   Returns: rate in bytes per second, 0 for no limit
+***********************************************************************/
+static double parseRate(char *str)
+{
+    double rate;
+
+    rate = atof(str) * 1024.0;
+    if (rate < 0.0)
+    {
+	rate = 0.0;
+    }
+    return rate;
+}
+
+/***********************************************************************
+*   void loadBandwidthLimits()
+*
+*   Reads the bandwidth limits and time windows from the main config
+*   file. Should be called once at startup, after the config file has
+*   been loaded
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: (void)
+***********************************************************************/
+void loadBandwidthLimits()
+{
+    char *value;
+    char *rate;
+    int sh, sm, eh, em, percent;
+
+    value = getFirstConfigValue("miscconf", "bandwidth_default");
+    if (value)
+    {
+	defaultRate_ = parseRate(value);
+    }
+    burstTime_ = getConfigIntValue("miscconf", "bandwidth_burst", 60);
+    if (burstTime_ < 1)
+    {
+	burstTime_ = 1;
+    }
+    yieldPercent_ = getConfigIntValue("miscconf", "bandwidth_yield_percent", 10);
+    yieldTime_ = getConfigIntValue("miscconf", "bandwidth_yield_time", 300);
+
+    /* Site limits are set up front; node buckets are created on first use */
+    value = getFirstConfigValue("miscconf", "site_bandwidth");
+    while (value)
+    {
+	rate = strchr(value, ' ');
+	if (!rate)
+	{
+	    logMessage(5, "Invalid site_bandwidth line: %s", value);
+	}
+	else
+	{
+	    buckets_ = globus_libc_realloc(buckets_, (numBuckets_ + 1) *
+					   sizeof(tokenBucket_t));
+	    if (!buckets_)
+	    {
+		errorExit("Out of memory in loadBandwidthLimits");
+	    }
+	    buckets_[numBuckets_].name = safe_strdup(value);
+	    if (!buckets_[numBuckets_].name)
+	    {
+		errorExit("Out of memory in loadBandwidthLimits");
+	    }
+	    buckets_[numBuckets_].name[rate - value] = 0;
+	    buckets_[numBuckets_].isSite = 1;
+	    buckets_[numBuckets_].rate = parseRate(rate + 1);
+	    buckets_[numBuckets_].tokens = buckets_[numBuckets_].rate * burstTime_;
+	    buckets_[numBuckets_].lastFilled = time(NULL);
+	    logMessage(3, "Site %s limited to %s KB/s", buckets_[numBuckets_].name,
+		       rate + 1);
+	    numBuckets_++;
+	}
+	value = getNextConfigValue("miscconf", "site_bandwidth");
+    }
+
+    value = getFirstConfigValue("miscconf", "bandwidth_window");
+    while (value)
+    {
+	if ((sscanf(value, "%d:%d-%d:%d %d", &sh, &sm, &eh, &em, &percent) != 5) ||
+	    (percent < 0))
+	{
+	    logMessage(5, "Invalid bandwidth_window line: %s", value);
+	}
+	else
+	{
+	    windows_ = globus_libc_realloc(windows_, (numWindows_ + 1) *
+					   sizeof(bandwidthWindow_t));
+	    if (!windows_)
+	    {
+		errorExit("Out of memory in loadBandwidthLimits");
+	    }
+	    windows_[numWindows_].start = (sh * 60) + sm;
+	    windows_[numWindows_].end = (eh * 60) + em;
+	    windows_[numWindows_].percent = percent;
+	    numWindows_++;
+	}
+	value = getNextConfigValue("miscconf", "bandwidth_window");
+    }
+}
+
+/***********************************************************************
+*   void noteClientActivity()
+*
+*   Records that a client has just used the grid. The control thread's
+*   own transfers are slowed down for a while afterwards
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: (void)
+***********************************************************************/
+void noteClientActivity()
+{
+    lastClientActivity_ = time(NULL);
+}
+
+/***********************************************************************
+*   int getCurrentPercentage()
+*
+*   Works out what percentage of the configured rates may be used just
+*   now, from the time windows and recent client activity
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: percentage of full rate
+***********************************************************************/
+static int getCurrentPercentage()
+{
+    time_t now;
+    struct tm *tm;
+    int minute;
+    int i;
+    int percent = 100;
+
+    now = time(NULL);
+    tm = localtime(&now);
+    minute = (tm->tm_hour * 60) + tm->tm_min;
+
+    /* First matching window wins */
+    for (i = 0; i < numWindows_; i++)
+    {
+	if (windows_[i].start <= windows_[i].end)
+	{
+	    if ((minute >= windows_[i].start) && (minute < windows_[i].end))
+	    {
+		percent = windows_[i].percent;
+		break;
+	    }
+	}
+	else
+	{
+	    if ((minute >= windows_[i].start) || (minute < windows_[i].end))
+	    {
+		percent = windows_[i].percent;
+		break;
+	    }
+	}
+    }
+
+    if ((lastClientActivity_) && ((now - lastClientActivity_) < yieldTime_))
+    {
+	percent = (percent * yieldPercent_) / 100;
+    }
+
+    return percent;
+}
+
+/***********************************************************************
+*   tokenBucket_t *getNodeBucket(char *node)
+*
+*   Finds the bucket for a node, creating it if this is the first time
+*   the node has been used
+*
+*   Parameters:                                                     [I/O]
+*
+*    node    FQDN of the node                                        I
+*
+*   Returns: pointer to the bucket
+***********************************************************************/
+static tokenBucket_t *getNodeBucket(char *node)
+{
+    int i;
+    char *prop;
+
+    for (i = 0; i < numBuckets_; i++)
+    {
+	if ((!buckets_[i].isSite) && (!strcmp(buckets_[i].name, node)))
+	{
+	    return &buckets_[i];
+	}
+    }
+
+    buckets_ = globus_libc_realloc(buckets_, (numBuckets_ + 1) *
+				   sizeof(tokenBucket_t));
+    if (!buckets_)
+    {
+	errorExit("Out of memory in getNodeBucket");
+    }
+    buckets_[numBuckets_].name = safe_strdup(node);
+    if (!buckets_[numBuckets_].name)
+    {
+	errorExit("Out of memory in getNodeBucket");
+    }
+    buckets_[numBuckets_].isSite = 0;
+
+    prop = getNodeProperty(node, "bandwidth");
+    if (prop)
+    {
+	buckets_[numBuckets_].rate = parseRate(prop);
+	globus_libc_free(prop);
+    }
+    else
+    {
+	buckets_[numBuckets_].rate = defaultRate_;
+    }
+    buckets_[numBuckets_].tokens = buckets_[numBuckets_].rate * burstTime_;
+    buckets_[numBuckets_].lastFilled = time(NULL);
+
+    numBuckets_++;
+    return &buckets_[numBuckets_ - 1];
+}
+
+/***********************************************************************
+*   tokenBucket_t *getSiteBucket(char *node)
+*
+*   Finds the bucket for the site a node is at
+*
+*   Parameters:                                                     [I/O]
+*
+*    node    FQDN of the node                                        I
+*
+*   Returns: pointer to the bucket, NULL if the site is not limited
+***********************************************************************/
+static tokenBucket_t *getSiteBucket(char *node)
+{
+    int i;
+    char *site;
+
+    site = getNodeSite(node);
+    if (!site)
+    {
+	return NULL;
+    }
+
+    for (i = 0; i < numBuckets_; i++)
+    {
+	if ((buckets_[i].isSite) && (!strcmp(buckets_[i].name, site)))
+	{
+	    return &buckets_[i];
+	}
+    }
+    return NULL;
+}
+
+/***********************************************************************
+*   int bucketAllows(tokenBucket_t *b, int percent)
+*
+*   Tops up a bucket for the time since it was last filled, and checks
+*   whether a transfer may start through it
+*
+*   Parameters:                                                     [I/O]
+*
+*    b        the bucket                                             I/O
+*    percent  percentage of the full rate currently allowed          I
+*
+*   Returns: 1 if a transfer may start, 0 if not
+***********************************************************************/
+static int bucketAllows(tokenBucket_t *b, int percent)
+{
+    time_t now;
+    double rate;
+
+    if ((!b) || (b->rate <= 0.0))
+    {
+	return 1;
+    }
+
+    rate = (b->rate * percent) / 100.0;
+    now = time(NULL);
+    b->tokens += rate * (double)(now - b->lastFilled);
+    if (b->tokens > (rate * burstTime_))
+    {
+	b->tokens = rate * burstTime_;
+    }
+    b->lastFilled = now;
+
+    return ((rate > 0.0) && (b->tokens >= 0.0));
+}
+
+/***********************************************************************
+*   int reserveBandwidth(char *fromNode, char *toNode, long long bytes)
+*
+*   Called by the control thread before it starts a transfer of its own.
+*   If the bandwidth limits allow the transfer now, it is charged to the
+*   nodes and sites involved
+*
+*   Parameters:                                                     [I/O]
+*
+*    fromNode  node the data is read from, or NULL                   I
+*    toNode    node the data is written to, or NULL                  I
+*    bytes     size of the transfer                                  I
+*
+*   Returns: 1 if the transfer may go ahead, 0 if it should wait
+***********************************************************************/
+int reserveBandwidth(char *fromNode, char *toNode, long long bytes)
+{
+    tokenBucket_t *b[4];
+    int percent;
+    int i;
+
+    percent = getCurrentPercentage();
+
+    /* Look up all the buckets first, as creating one may move the rest */
+    if (fromNode)
+    {
+	getNodeBucket(fromNode);
+    }
+    if (toNode)
+    {
+	getNodeBucket(toNode);
+    }
+    b[0] = fromNode ? getNodeBucket(fromNode) : NULL;
+    b[1] = fromNode ? getSiteBucket(fromNode) : NULL;
+    b[2] = toNode ? getNodeBucket(toNode) : NULL;
+    b[3] = toNode ? getSiteBucket(toNode) : NULL;
+
+    /* Within a site, the site's link isn't used */
+    if ((b[1]) && (b[1] == b[3]))
+    {
+	b[1] = NULL;
+	b[3] = NULL;
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+	if (!bucketAllows(b[i], percent))
+	{
+	    logMessage(1, "Bandwidth limit of %s reached, deferring transfer",
+		       b[i]->name);
+	    return 0;
+	}
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+	if ((b[i]) && (b[i]->rate > 0.0))
+	{
+	    b[i]->tokens -= (double)bytes;
+	}
+    }
+    return 1;
+}
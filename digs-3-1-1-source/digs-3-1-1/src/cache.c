@@ -0,0 +1,833 @@
+/***********************************************************************
+*
+*   Filename:   cache.c
+*
+*   Authors:    DiGS developers        (digs)     EPCC.
+*
+*   Purpose:    Keeps copies of files fetched from the grid in a local
+*               directory, so that getting the same file again doesn't
+*               need another transfer
+*
+*   Contents:   Cache lookup, insertion and eviction
+*
+*   Used in:    Client tools
+*
+*   Contact:    epcc-support@epcc.ed.ac.uk
+*
+*   Copyright (c) 2026 The University of Edinburgh
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of the
+*   License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful, but
+*   WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*   General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program; if not, write to the Free Software
+*   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+*   MA 02111-1307, USA.
+*
+*   As a special exception, you may link this program with code
+*   developed by the OGSA-DAI project without such code being covered
+*   by the GNU General Public License.
+*
+***********************************************************************/
+
+/*
+ * The cache is off unless the DIGS_CACHE_DIR environment variable names
+ * a directory for it. Every client process on a host (or on a cluster,
+ * if the directory is on a shared file system) that sets it to the same
+ * place shares the same cache. DIGS_CACHE_SIZE sets its size limit in
+ * MB (default CACHE_DEFAULT_SIZE).
+ *
+ * Files are stored by content rather than by name, as
+ *
+ *   <dir>/<first two digits of checksum>/<md5sum>-<size>
+ *
+ * taken from the catalogue, so a file that has been modified since it
+ * was cached is simply not found, and identical files under different
+ * names are only kept once. A file's checksum is checked against its
+ * key both when it is added and each time it is delivered, and a cached
+ * file found to be corrupt is removed. Files are given to the caller as
+ * a clone (reflink) where the file system can do that, otherwise as a
+ * copy. They are never hard linked, as the caller would then share the
+ * cache's writable copy.
+ *
+ * Users sharing a cache have to share a group, which should own the
+ * cache directory. Everything in it belongs to that group and is group
+ * writable (the directories are setgid, mode 02770), so any of them can
+ * mark a file as used and evict it, whoever added it. A cache directory
+ * that DiGS creates itself belongs to the creator's primary group.
+ *
+ * Using a file sets its modification time, and when the cache grows
+ * over its limit the files that were used longest ago are removed.
+ * An fcntl lock on <dir>/lock keeps processes from removing a file
+ * while another is delivering it: it is held shared for delivery and
+ * exclusively while adding and evicting. New files are written under a
+ * temporary name first and renamed into place, so a half written file
+ * is never seen.
+ */
+
+/* for the FICLONE ioctl */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <globus_common.h>
+
+#include "cache.h"
+#include "replica.h"
+#include "misc.h"
+
+/* Size limit if DIGS_CACHE_SIZE isn't set, in MB */
+#define CACHE_DEFAULT_SIZE 10240
+
+/* Temporary files older than this (seconds) were left by a process that
+ * died, and are removed during eviction */
+#define CACHE_STALE_TEMP_AGE 86400
+
+#define CACHE_COPY_BUFFER_SIZE 65536
+
+/* Modes for the cache directories and the files in them */
+#define CACHE_DIR_MODE  02770
+#define CACHE_FILE_MODE 0660
+
+/*
+ * A file found in the cache when evicting
+ */
+typedef struct cacheEntry_s
+{
+    char *path;
+    time_t lastUsed;
+    long long size;
+} cacheEntry_t;
+
+static int cacheInitialised_ = 0;
+static char *cacheDir_ = NULL;
+static long long cacheLimit_ = 0;
+
+/***********************************************************************
+*   static int initCache()
+*
+*   Reads the cache settings from the environment the first time it is
+*   called, and makes sure the cache directory exists
+*
+*   Parameters:                                [I/O]
+*
+*     None
+*
+*   Returns: 1 if the cache is in use, 0 if not
+***********************************************************************/
+static int initCache()
+{
+    char *dir;
+    char *size;
+    long long mb;
+
+    if (cacheInitialised_)
+    {
+	return (cacheDir_ != NULL);
+    }
+    cacheInitialised_ = 1;
+
+    dir = getenv("DIGS_CACHE_DIR");
+    if ((!dir) || (!*dir))
+    {
+	return 0;
+    }
+
+    mb = CACHE_DEFAULT_SIZE;
+    size = getenv("DIGS_CACHE_SIZE");
+    if (size)
+    {
+	mb = strtoll(size, NULL, 10);
+	if (mb <= 0)
+	{
+	    logMessage(3, "Invalid DIGS_CACHE_SIZE %s, not using cache", size);
+	    return 0;
+	}
+    }
+    cacheLimit_ = mb * 1024 * 1024;
+
+    if (mkdir(dir, 0770) == 0)
+    {
+	/* the umask mustn't stop the group sharing it. An existing
+	 * directory is left as whoever set it up made it */
+	chmod(dir, CACHE_DIR_MODE);
+    }
+    else if (errno != EEXIST)
+    {
+	logMessage(3, "Cannot create cache directory %s: %s", dir,
+		   strerror(errno));
+	return 0;
+    }
+
+    cacheDir_ = safe_strdup(dir);
+    if (!cacheDir_)
+    {
+	errorExit("Out of memory in initCache");
+    }
+    logMessage(1, "Caching files in %s, up to %lld MB", cacheDir_, mb);
+    return 1;
+}
+
+/***********************************************************************
+*   static int lockCache(short type)
+*
+*   Takes the lock on the whole cache, waiting for it if necessary
+*
+*   Parameters:                                [I/O]
+*
+*     type  F_RDLCK to deliver a file, F_WRLCK  I
+*           to change the cache
+*
+*   Returns: A file descriptor to pass to unlockCache, or -1 on error
+***********************************************************************/
+static int lockCache(short type)
+{
+    char *lockFile;
+    struct flock lock;
+    int fd;
+
+    safe_asprintf(&lockFile, "%s/lock", cacheDir_);
+    fd = open(lockFile, O_RDWR | O_CREAT, CACHE_FILE_MODE);
+    if (fd < 0)
+    {
+	logMessage(3, "Cannot open cache lock %s: %s", lockFile,
+		   strerror(errno));
+	globus_libc_free(lockFile);
+	return -1;
+    }
+    globus_libc_free(lockFile);
+
+    /* whoever creates it, everyone sharing the cache has to be able to
+     * lock it */
+    fchmod(fd, CACHE_FILE_MODE);
+
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    while (fcntl(fd, F_SETLKW, &lock) < 0)
+    {
+	if (errno != EINTR)
+	{
+	    logMessage(3, "Cannot lock cache: %s", strerror(errno));
+	    close(fd);
+	    return -1;
+	}
+    }
+    return fd;
+}
+
+/*
+ * Releases the lock taken by lockCache
+ */
+static void unlockCache(int fd)
+{
+    /* closing the file drops the lock */
+    close(fd);
+}
+
+/*
+ * Returns the path a file with the given key is cached at. To be freed
+ * by the caller
+ */
+static char *getCachePath(char *key)
+{
+    char *path;
+
+    safe_asprintf(&path, "%s/%.2s/%s", cacheDir_, key, key);
+    return path;
+}
+
+/*
+ * Returns the size of a file from its cache key
+ */
+static long long getKeySize(char *key)
+{
+    return strtoll(strchr(key, '-') + 1, NULL, 10);
+}
+
+/***********************************************************************
+*   static int checkCacheFile(char *path, char *key)
+*
+*   Checks that a file's contents match its cache key
+*
+*   Parameters:                                [I/O]
+*
+*     path  File to check                       I
+*     key   Key from getCacheKey                I
+*
+*   Returns: 1 if the checksum matches, 0 if not
+***********************************************************************/
+static int checkCacheFile(char *path, char *key)
+{
+    char md5sum[CHECKSUM_LENGTH + 1];
+    unsigned char md5[16];
+    int i;
+
+    computeMd5Checksum(path, md5);
+    for (i = 0; i < 16; i++)
+    {
+	sprintf(&md5sum[i*2], "%02x", md5[i]);
+    }
+
+    /* keys are made with a lower case checksum */
+    return (strncmp(md5sum, key, CHECKSUM_LENGTH) == 0);
+}
+
+/***********************************************************************
+*   static int cloneCacheFile(char *from, char *to)
+*
+*   Clones a file into or out of the cache, so that the two share their
+*   blocks until either is changed. Only copy-on-write file systems can
+*   do this
+*
+*   Parameters:                                [I/O]
+*
+*     from  File to clone                       I
+*     to    File to create                      I
+*
+*   Returns: 1 on success, 0 if the file system can't
+***********************************************************************/
+static int cloneCacheFile(char *from, char *to)
+{
+#ifdef FICLONE
+    int in, out;
+    int ok;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+    {
+	return 0;
+    }
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+    {
+	close(in);
+	return 0;
+    }
+
+    ok = (ioctl(out, FICLONE, in) == 0);
+    close(in);
+    close(out);
+    if (!ok)
+    {
+	unlink(to);
+    }
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+/***********************************************************************
+*   static int copyCacheFile(char *from, char *to)
+*
+*   Copies a file into or out of the cache
+*
+*   Parameters:                                [I/O]
+*
+*     from  File to copy                        I
+*     to    File to create                      I
+*
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+static int copyCacheFile(char *from, char *to)
+{
+    char *buffer;
+    ssize_t n, written;
+    int in, out;
+    int ok = 1;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+    {
+	return 0;
+    }
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+    {
+	close(in);
+	return 0;
+    }
+
+    buffer = globus_libc_malloc(CACHE_COPY_BUFFER_SIZE);
+    if (!buffer)
+    {
+	errorExit("Out of memory in copyCacheFile");
+    }
+
+    while ((ok) && ((n = read(in, buffer, CACHE_COPY_BUFFER_SIZE)) != 0))
+    {
+	if (n < 0)
+	{
+	    if (errno != EINTR)
+	    {
+		ok = 0;
+	    }
+	    continue;
+	}
+	for (written = 0; written < n; )
+	{
+	    ssize_t w = write(out, buffer + written, n - written);
+	    if (w < 0)
+	    {
+		if (errno != EINTR)
+		{
+		    ok = 0;
+		    break;
+		}
+		continue;
+	    }
+	    written += w;
+	}
+    }
+    globus_libc_free(buffer);
+
+    close(in);
+    if (close(out) < 0)
+    {
+	ok = 0;
+    }
+    if (!ok)
+    {
+	unlink(to);
+    }
+    return ok;
+}
+
+/***********************************************************************
+*   char *getCacheKey(char *lfn)
+*
+*   Works out the name a file is cached under, from its checksum and
+*   size in the catalogue
+*
+*   Parameters:                                [I/O]
+*
+*     lfn  Logical filename                     I
+*
+*   Returns: The key, to be freed by the caller, or NULL if the file
+*            can't be cached
+***********************************************************************/
+char *getCacheKey(char *lfn)
+{
+    char *md5sum;
+    char *size;
+    char *key = NULL;
+    char *end;
+
+    if (!initCache())
+    {
+	return NULL;
+    }
+
+    md5sum = getRLSAttribute(lfn, "md5sum");
+    if (!md5sum)
+    {
+	return NULL;
+    }
+    size = getRLSAttribute(lfn, "size");
+    if (!size)
+    {
+	globus_libc_free(md5sum);
+	return NULL;
+    }
+
+    /* A file without a proper checksum yet can't be told apart from
+     * another version of itself */
+    if ((isValidChecksum(md5sum)) && (strtoll(size, &end, 10) >= 0) &&
+	(end != size) && (*end == 0))
+    {
+	convertToLowerCase(md5sum);
+	safe_asprintf(&key, "%s-%s", md5sum, size);
+    }
+    else
+    {
+	logMessage(1, "Not caching %s, no valid checksum in catalogue", lfn);
+    }
+
+    globus_libc_free(md5sum);
+    globus_libc_free(size);
+    return key;
+}
+
+/***********************************************************************
+*   static void removeCorruptCacheFile(char *path, struct stat *found)
+*
+*   Removes a cached file found to be corrupt, so that nobody else reads
+*   it in full only to reject it. The cache must not be locked
+*
+*   Parameters:                                [I/O]
+*
+*     path   Cached file                        I
+*     found  What stat said of the corrupt file I
+*
+*   Returns: (void)
+***********************************************************************/
+static void removeCorruptCacheFile(char *path, struct stat *found)
+{
+    struct stat statBuf;
+    int lock;
+
+    lock = lockCache(F_WRLCK);
+    if (lock < 0)
+    {
+	return;
+    }
+
+    /* someone may have replaced it while the cache was unlocked */
+    if ((stat(path, &statBuf) == 0) && (statBuf.st_dev == found->st_dev) &&
+	(statBuf.st_ino == found->st_ino))
+    {
+	if (unlink(path) == 0)
+	{
+	    logMessage(3, "Removed corrupt cache file %s", path);
+	}
+	else
+	{
+	    logMessage(3, "Cannot remove corrupt cache file %s: %s", path,
+		       strerror(errno));
+	}
+    }
+
+    unlockCache(lock);
+}
+
+/***********************************************************************
+*   int getFileFromCache(char *key, char *pfn)
+*
+*   Delivers a file from the cache, if it is there
+*
+*   Parameters:                                [I/O]
+*
+*     key  Key from getCacheKey (may be NULL)   I
+*     pfn  Local file to create                 I
+*
+*   Returns: 1 if the file was delivered, 0 if it must be fetched
+***********************************************************************/
+int getFileFromCache(char *key, char *pfn)
+{
+    struct stat statBuf;
+    char *path;
+    int lock;
+    int delivered = 0;
+    int corrupt = 0;
+
+    if (!key)
+    {
+	return 0;
+    }
+
+    lock = lockCache(F_RDLCK);
+    if (lock < 0)
+    {
+	return 0;
+    }
+
+    path = getCachePath(key);
+    if ((stat(path, &statBuf) < 0) || (!S_ISREG(statBuf.st_mode)))
+    {
+	logMessage(1, "%s not in cache", key);
+    }
+    else if (statBuf.st_size != getKeySize(key))
+    {
+	/* Something has been changing it behind our back */
+	logMessage(3, "Cached file %s has been modified, not using it", path);
+	corrupt = 1;
+    }
+    else
+    {
+	unlink(pfn);
+
+	delivered = ((cloneCacheFile(path, pfn)) || (copyCacheFile(path, pfn)));
+	if (!delivered)
+	{
+	    logMessage(3, "Error delivering %s from cache", pfn);
+	}
+	else if (!checkCacheFile(pfn, key))
+	{
+	    /* checked after delivery, so that it's what the caller actually
+	     * got that is checked */
+	    logMessage(3, "Cached file %s is corrupt, not using it", path);
+	    unlink(pfn);
+	    delivered = 0;
+	    corrupt = 1;
+	}
+	else
+	{
+	    /* mark it as recently used */
+	    if (utime(path, NULL) < 0)
+	    {
+		logMessage(3, "Cannot mark cache file %s as used: %s", path,
+			   strerror(errno));
+	    }
+	    logMessage(1, "Delivered %s from cache file %s", pfn, path);
+	}
+    }
+
+    unlockCache(lock);
+    if (corrupt)
+    {
+	removeCorruptCacheFile(path, &statBuf);
+    }
+    globus_libc_free(path);
+    return delivered;
+}
+
+/*
+ * Orders cache entries by when they were last used, oldest first
+ */
+static int compareCacheEntries(const void *a, const void *b)
+{
+    const cacheEntry_t *ea = a;
+    const cacheEntry_t *eb = b;
+
+    if (ea->lastUsed < eb->lastUsed) return -1;
+    if (ea->lastUsed > eb->lastUsed) return 1;
+    return 0;
+}
+
+/***********************************************************************
+*   static void evictCacheFiles()
+*
+*   Removes the least recently used files from the cache until it is
+*   within its size limit, and any temporary files left behind by
+*   processes that died. The cache must be locked exclusively
+*
+*   Parameters:                                [I/O]
+*
+*     None
+*
+*   Returns: (void)
+***********************************************************************/
+static void evictCacheFiles()
+{
+    cacheEntry_t *entries = NULL;
+    int numEntries = 0;
+    int maxEntries = 0;
+    long long total = 0;
+    DIR *top, *sub;
+    struct dirent *topEnt, *subEnt;
+    struct stat statBuf;
+    char *subdir;
+    char *path;
+    time_t now;
+    int i;
+
+    top = opendir(cacheDir_);
+    if (!top)
+    {
+	logMessage(3, "Cannot read cache directory %s", cacheDir_);
+	return;
+    }
+
+    time(&now);
+    while ((topEnt = readdir(top)) != NULL)
+    {
+	if ((topEnt->d_name[0] == '.') || (strlen(topEnt->d_name) != 2))
+	{
+	    continue;
+	}
+	safe_asprintf(&subdir, "%s/%s", cacheDir_, topEnt->d_name);
+	sub = opendir(subdir);
+	if (!sub)
+	{
+	    globus_libc_free(subdir);
+	    continue;
+	}
+
+	while ((subEnt = readdir(sub)) != NULL)
+	{
+	    if ((!strcmp(subEnt->d_name, ".")) ||
+		(!strcmp(subEnt->d_name, "..")))
+	    {
+		continue;
+	    }
+	    safe_asprintf(&path, "%s/%s", subdir, subEnt->d_name);
+	    if ((stat(path, &statBuf) < 0) || (!S_ISREG(statBuf.st_mode)))
+	    {
+		globus_libc_free(path);
+		continue;
+	    }
+
+	    /* temporary files are only added by someone holding the lock,
+	     * so a recent one may still be being written */
+	    if (subEnt->d_name[0] == '.')
+	    {
+		if ((now - statBuf.st_mtime) > CACHE_STALE_TEMP_AGE)
+		{
+		    logMessage(1, "Removing stale cache file %s", path);
+		    unlink(path);
+		}
+		globus_libc_free(path);
+		continue;
+	    }
+
+	    if (numEntries == maxEntries)
+	    {
+		maxEntries += 256;
+		entries = globus_libc_realloc(entries, maxEntries *
+					      sizeof(cacheEntry_t));
+		if (!entries)
+		{
+		    errorExit("Out of memory in evictCacheFiles");
+		}
+	    }
+	    entries[numEntries].path = path;
+	    entries[numEntries].lastUsed = statBuf.st_mtime;
+	    entries[numEntries].size = statBuf.st_size;
+	    total += statBuf.st_size;
+	    numEntries++;
+	}
+	closedir(sub);
+	globus_libc_free(subdir);
+    }
+    closedir(top);
+
+    if (total > cacheLimit_)
+    {
+	qsort(entries, numEntries, sizeof(cacheEntry_t), compareCacheEntries);
+	for (i = 0; (i < numEntries) && (total > cacheLimit_); i++)
+	{
+	    if (unlink(entries[i].path) == 0)
+	    {
+		logMessage(1, "Evicted %s from cache", entries[i].path);
+		total -= entries[i].size;
+	    }
+	    else
+	    {
+		logMessage(3, "Cannot evict %s from cache: %s", entries[i].path,
+			   strerror(errno));
+	    }
+	}
+    }
+
+    for (i = 0; i < numEntries; i++)
+    {
+	globus_libc_free(entries[i].path);
+    }
+    if (entries)
+    {
+	globus_libc_free(entries);
+    }
+}
+
+/***********************************************************************
+*   void addFileToCache(char *key, char *pfn)
+*
+*   Keeps a copy of a file just fetched in the cache, evicting the least
+*   recently used files if the cache is then over its size limit
+*
+*   Parameters:                                [I/O]
+*
+*     key  Key from getCacheKey (may be NULL)   I
+*     pfn  Local file that was fetched          I
+*
+*   Returns: (void)
+***********************************************************************/
+void addFileToCache(char *key, char *pfn)
+{
+    struct stat statBuf;
+    char *subdir;
+    char *tmpPath;
+    char *path;
+    int lock;
+
+    if (!key)
+    {
+	return;
+    }
+
+    /* Make sure what arrived is what the catalogue describes */
+    if ((stat(pfn, &statBuf) < 0) || (statBuf.st_size != getKeySize(key)))
+    {
+	logMessage(3, "Not caching %s, size doesn't match catalogue", pfn);
+	return;
+    }
+    if (statBuf.st_size > cacheLimit_)
+    {
+	logMessage(1, "Not caching %s, larger than the cache", pfn);
+	return;
+    }
+
+    safe_asprintf(&subdir, "%s/%.2s", cacheDir_, key);
+    if (mkdir(subdir, 0770) == 0)
+    {
+	chmod(subdir, CACHE_DIR_MODE);
+    }
+    else if (errno != EEXIST)
+    {
+	logMessage(3, "Cannot create cache directory %s: %s", subdir,
+		   strerror(errno));
+	globus_libc_free(subdir);
+	return;
+    }
+    safe_asprintf(&tmpPath, "%s/.%s.%d", subdir, key, (int)getpid());
+    globus_libc_free(subdir);
+
+    /* The copy is made before taking the lock, so that others can keep
+     * using the cache while a large file is copied in */
+    if (((!cloneCacheFile(pfn, tmpPath)) && (!copyCacheFile(pfn, tmpPath))) ||
+	(chmod(tmpPath, CACHE_FILE_MODE) < 0))
+    {
+	logMessage(3, "Error copying %s into cache", pfn);
+	unlink(tmpPath);
+	globus_libc_free(tmpPath);
+	return;
+    }
+
+    /* The size was checked above, but a damaged transfer can still have
+     * the right size. The copy is checked rather than pfn, as it is what
+     * will be kept */
+    if (!checkCacheFile(tmpPath, key))
+    {
+	logMessage(3, "Not caching %s, checksum doesn't match catalogue", pfn);
+	unlink(tmpPath);
+	globus_libc_free(tmpPath);
+	return;
+    }
+
+    lock = lockCache(F_WRLCK);
+    if (lock < 0)
+    {
+	unlink(tmpPath);
+	globus_libc_free(tmpPath);
+	return;
+    }
+
+    path = getCachePath(key);
+    if (rename(tmpPath, path) < 0)
+    {
+	logMessage(3, "Error adding %s to cache: %s", path, strerror(errno));
+	unlink(tmpPath);
+    }
+    else
+    {
+	logMessage(1, "Added %s to cache as %s", pfn, path);
+	evictCacheFiles();
+    }
+
+    unlockCache(lock);
+    globus_libc_free(path);
+    globus_libc_free(tmpPath);
+}
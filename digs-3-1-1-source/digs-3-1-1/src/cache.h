@@ -0,0 +1,90 @@
+/***********************************************************************
+*
+*   Filename:   cache.h
+*
+*   Authors:    DiGS developers        (digs)     EPCC.
+*
+*   Purpose:    Keeps copies of files fetched from the grid in a local
+*               directory, so that getting the same file again doesn't
+*               need another transfer
+*
+*   Contents:   Function prototypes
+*
+*   Used in:    Client tools
+*
+*   Contact:    epcc-support@epcc.ed.ac.uk
+*
+*   Copyright (c) 2026 The University of Edinburgh
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of the
+*   License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful, but
+*   WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*   General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program; if not, write to the Free Software
+*   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+*   MA 02111-1307, USA.
+*
+*   As a special exception, you may link this program with code
+*   developed by the OGSA-DAI project without such code being covered
+*   by the GNU General Public License.
+*
+***********************************************************************/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/***********************************************************************
+*   char *getCacheKey(char *lfn)
+*
+*   Works out the name a file is cached under, from its checksum and
+*   size in the catalogue. A file that is modified gets a new key, so an
+*   old copy in the cache is never used for it
+*
+*   Parameters:                                [I/O]
+*
+*     lfn  Logical filename                     I
+*
+*   Returns: The key, to be freed by the caller, or NULL if the cache is
+*            not in use or the catalogue has no valid checksum for the
+*            file
+***********************************************************************/
+char *getCacheKey(char *lfn);
+
+/***********************************************************************
+*   int getFileFromCache(char *key, char *pfn)
+*
+*   Delivers a file from the cache, if it is there
+*
+*   Parameters:                                [I/O]
+*
+*     key  Key from getCacheKey (may be NULL)   I
+*     pfn  Local file to create                 I
+*
+*   Returns: 1 if the file was delivered, 0 if it must be fetched
+***********************************************************************/
+int getFileFromCache(char *key, char *pfn);
+
+/***********************************************************************
+*   void addFileToCache(char *key, char *pfn)
+*
+*   Keeps a copy of a file just fetched in the cache, evicting the least
+*   recently used files if the cache is then over its size limit.
+*   Failures are only logged, as the file itself was fetched anyway
+*
+*   Parameters:                                [I/O]
+*
+*     key  Key from getCacheKey (may be NULL)   I
+*     pfn  Local file that was fetched          I
+*
+*   Returns: (void)
+***********************************************************************/
+void addFileToCache(char *key, char *pfn);
+
+#endif
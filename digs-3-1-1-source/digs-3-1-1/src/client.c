@@ -41,6 +41,7 @@
 #include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
 
@@ -49,10 +50,16 @@
 #include "node.h"
 #include "job.h"
 #include "misc.h"
+#include "cache.h"
 
 char **qcdgridList();
 void qcdgridDestroyList(char **list);
 
+/*
+ * Path to the QCDgrid software on the control node, in node.c
+ */
+extern char *primaryNodePath_;
+
 /*=====================================================================
  *
  * Node administration functions, involving sending messages
@@ -434,320 +441,1532 @@ int qcdgridPing()
 
 /*=====================================================================
  *
- * Getting files/directories from grid
+ * Replication queue administration
  *
  *===================================================================*/
-static int copyFromStorage(char *node, char *lfn, char *pfn)
+/***********************************************************************
+*   int qcdgridGetReplicationQueue(char *pfn)
+*    
+*   Fetches the last saved snapshot of the control thread's replication
+*   queue
+*    
+*   Parameters:                                [I/O]
+*
+*     pfn  Local file to save the queue to      I
+*
+*   Returns: 1 on success, 0 on failure
+************************************************************************/
+int qcdgridGetReplicationQueue(char *pfn)
 {
-  char *pathBuffer;
-  int result;
+    char *remoteName;
+    int result;
 
-  pathBuffer = constructFilename(node, lfn);
-  if (!pathBuffer) {
-    logMessage(ERROR, "constructFilename failed for %s on %s in copyFromStorage",
-	       lfn, node);
-    return 0;
-  }
+    logMessage(1, "qcdgridGetReplicationQueue(%s)", pfn);
 
-  result = copyToLocal(node, pathBuffer, pfn);
-  globus_libc_free(pathBuffer);
-  return result;
+    if (safe_asprintf(&remoteName, "%s/repqueue", primaryNodePath_) < 0)
+    {
+	errorExit("Out of memory in qcdgridGetReplicationQueue");
+    }
+
+    result = copyToLocal(getMainNodeName(), remoteName, pfn, NULL);
+    globus_libc_free(remoteName);
+    return result;
 }
 
 /***********************************************************************
-*   int qcdgridGetFile(char *lfn, char *pfn);
+*   int qcdgridSetReplicationPriority(int id, int priority)
 *    
-*   Retrieves one file from the data grid to the local disk
+*   Changes the priority of a queued replication. Only works if the
+*   user is privileged
 *    
 *   Parameters:                                [I/O]
 *
-*     lfn  Logical grid filename                I
-*     pfn  Physical local filename              I
-*    
+*     id        ID of replication in queue      I
+*     priority  new priority (higher is sooner) I
+*
 *   Returns: 1 on success, 0 on failure
-***********************************************************************/
-int qcdgridGetFile(char *lfn, char *pfn)
+************************************************************************/
+int qcdgridSetReplicationPriority(int id, int priority)
 {
-    char *source;
-
-//RADEK - change to single slash
-    char *ssLFN = substituteChars(lfn, "//", "/");
-//changed all references to "lfn" into "ssLFN"
+    char *msgBuffer;
 
-    logMessage(1, "qcdgridGetFile(%s,%s)", ssLFN, pfn);
+    logMessage(1, "qcdgridSetReplicationPriority(%d,%d)", id, priority);
 
-    /* Find nearest copy of file */
-    source = getBestCopyLocation(ssLFN);
-    if (!source) 
+    if (safe_asprintf(&msgBuffer, "repprio %d %d", id, priority) < 0)
     {
-	logMessage(5, "File %s not found on grid", ssLFN);
-	return 0;
+	errorExit("Out of memory in qcdgridSetReplicationPriority");
     }
 
-    if (!makeLocalPathValid(pfn))
+    if (!sendMessageToMainNode(msgBuffer))
     {
-	logMessage(5, "Error making directory structure on local file system");
+	globus_libc_free(msgBuffer);
+	logMessage(5, "Error sending message to main node");
 	return 0;
     }
 
-    /* Transfer it to local storage */    
-    while (!copyFromStorage(source, ssLFN, pfn)) 
-    {
-	logMessage(3, "Error copying from %s", source);
-
-	/* If it didn't work, try next best copy */
-	source = getNextBestCopyLocation(ssLFN);
-	if (!source) 
-	{
-	    logMessage(5, "All copies of %s are inaccessible", ssLFN);
-	    return 0;
-	}
-    }
-
-    logMessage(3, "File %s successfully retrieved from %s", ssLFN, source);
-
-    globus_libc_free(ssLFN);
+    globus_libc_free(msgBuffer);
 
     return 1;
 }
 
 /***********************************************************************
-*   int qcdgridGetDirectory(char *ldn, char *pdn);
+*   int qcdgridCancelReplication(int id)
 *    
-*   Retrieves a whole directory from the data grid to the local disk
+*   Cancels a queued or running replication. Only works if the user is
+*   privileged
 *    
 *   Parameters:                                [I/O]
 *
-*     ldn  Logical grid directory name          I
-*     pdn  Physical local directory name        I
-*    
+*     id    ID of replication in queue          I
+*
 *   Returns: 1 on success, 0 on failure
-***********************************************************************/
-int qcdgridGetDirectory(char *ldn, char *pdn)
+************************************************************************/
+int qcdgridCancelReplication(int id)
 {
-    int dirFound = 0;
-    char *dir, *lfn, *pfn;
-    int result;
-    int dlen;
-
-//RADEK - change to single slash
-    char *ssLDN = substituteChars(ldn, "//", "/");
-//changed all references to "ldn" into "ssLDN"
-
+    char *msgBuffer;
 
-    logMessage(1, "qcdgridGetDirectory(%s,%s)", ssLDN, pdn);
+    logMessage(1, "qcdgridCancelReplication(%d)", id);
 
-    dir = globus_libc_malloc(strlen(ssLDN) + 2);
-    if (!dir)
-    {
-	errorExit("Out of memory in qcdgridGetDirectory");
-    }
-    strcpy(dir, ssLDN);
-    if (dir[strlen(dir) - 1] != '/')
+    if (safe_asprintf(&msgBuffer, "repcancel %d", id) < 0)
     {
-	strcat(dir, "/");
+	errorExit("Out of memory in qcdgridCancelReplication");
     }
-    
-    dlen = strlen(dir);
 
-    /*
-     * Not using forEachFileInDirectory iterator here as it would
-     * make construction of physical filename more complicated
-     */
-    lfn = getFirstFile();
-    while (lfn)
-    {
-	if (!strncmp(lfn, dir, dlen))
-	{
-	    if (safe_asprintf(&pfn, "%s/%s", pdn, &lfn[dlen]) < 0)
-	    {
-		errorExit("Out of memory in qcdgridGetDirectory");
-	    }
-	    
-	    logMessage(4, "%s -> %s", lfn, pfn);
-	    dirFound = 1;
-	    
-	    result = qcdgridGetFile(lfn, pfn);
-	    globus_libc_free(pfn);
-	}
-	globus_libc_free(lfn);
-	lfn = getNextFile();
-    }
-    globus_libc_free(dir);
-    if (!dirFound)
+    if (!sendMessageToMainNode(msgBuffer))
     {
-	logMessage(5, "Directory %s not found on grid", ssLDN);
+	globus_libc_free(msgBuffer);
+	logMessage(5, "Error sending message to main node");
 	return 0;
     }
 
-    globus_libc_free(ssLDN);
+    globus_libc_free(msgBuffer);
 
     return 1;
 }
 
-
 /*=====================================================================
  *
- * Putting files/directories on grid
+ * Getting files/directories from grid
  *
  *===================================================================*/
-/***********************************************************************
-*   int copyToSEInbox(char *localFile, char *remoteHost, char *lfn)
-*
-*   Copies a file from the local file system to a remote SE's inbox
-*    
-*   Parameters:                                                     [I/O]
-*
-*     localFile   Full pathname to file on local machine             I
-*     remoteHost  FQDN of SE to copy to                              I
-*     lfn         Desired logical filename for file                  I
-*    
-*   Returns: 1 on success, 0 on error
-***********************************************************************/
-static int copyToSEInbox(char *localFile, char *remoteHost, char *lfn)
+static int copyFromStorage(char *node, char *lfn, char *pfn)
 {
-  struct storageElement *se;
-  int handle;
-  time_t startTime, endTime;
-  char errbuf[MAX_ERROR_MESSAGE_LENGTH];
-  digs_error_code_t result;
-  float timeout;
-  int percentComplete;
-  digs_transfer_status_t status;
+  char *pathBuffer;
+  int result;
+  double rate;
 
-  se = getNode(remoteHost);
-  if (!se) {
-    logMessage(ERROR, "Cannot find node %s", remoteHost);
+  pathBuffer = constructFilename(node, lfn);
+  if (!pathBuffer) {
+    logMessage(ERROR, "constructFilename failed for %s on %s in copyFromStorage",
+	       lfn, node);
     return 0;
   }
 
-  result = se->digs_startCopyToInbox(errbuf, remoteHost, localFile,
-				     lfn, &handle);
-  if (result != DIGS_SUCCESS) {
-	  if (result == DIGS_NO_INBOX){
-		    logMessage(INFO, "Did not copy to inbox on %s: %s (%s)", remoteHost,
-			       digsErrorToString(result), errbuf);
-	  }
-	  else{
-		    logMessage(ERROR, "Error starting copy to inbox on %s: %s (%s)", remoteHost,
-			       digsErrorToString(result), errbuf);
-	  }
-    return 0;
+  result = copyToLocal(node, pathBuffer, pfn, &rate);
+  globus_libc_free(pathBuffer);
+  if ((result) && (rate > 0.0)) {
+    logMessage(3, "Got %s from %s at %.1f KB/s", lfn, node, rate / 1024.0);
   }
+  return result;
+}
 
-  timeout = getNodeCopyTimeout(remoteHost);
+/*
+ * Files of at least STRIPE_MIN_SIZE bytes with copies on more than one
+ * node that can fetch part of a file are fetched in STRIPE_CHUNK_SIZE
+ * ranges from up to STRIPE_MAX_SOURCES of them at once
+ */
+#define STRIPE_MIN_SIZE (256LL * 1048576LL)
+#define STRIPE_CHUNK_SIZE (64LL * 1048576LL)
+#define STRIPE_MAX_SOURCES 4
+
+/*
+ * An idle source takes over a range from another once the range has
+ * been running for STRIPE_SLOW_FACTOR times as long as the idle source
+ * would take to fetch the whole of it
+ */
+#define STRIPE_SLOW_FACTOR 2.0
+
+/*
+ * A node a striped get is fetching ranges from
+ */
+typedef struct stripeSource_s {
+    char *name;                  /* points into the node table        */
+    struct storageElement *se;
+    char *remoteFile;            /* path to the file on the node      */
+    int chunk;                   /* range being fetched, -1 if idle   */
+    int handle;
+    time_t started;
+    transferWatchdog_t watchdog;
+    long long bytesDone;         /* bytes fetched by completed ranges */
+    double secondsBusy;          /* time taken to fetch them          */
+    int failures;
+    int dropped;                 /* set once given up on              */
+} stripeSource_t;
+
+/* States of a range of a striped get */
+enum { CHUNK_QUEUED, CHUNK_ACTIVE, CHUNK_DONE };
 
-  startTime = time(NULL);
-  do {
-    result = se->digs_monitorTransfer(errbuf, handle, &status, &percentComplete);
-    if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED)) {
-      logMessage(ERROR, "Error in put transfer to %s: %s (%s)", remoteHost,
-		 digsErrorToString(result), errbuf);
-      se->digs_endTransfer(errbuf, handle);
-      return 0;
+/***********************************************************************
+*   double stripeSourceRate(stripeSource_t *src)
+*
+*   Works out how fast a source has been fetching ranges
+*    
+*   Parameters:                                      [I/O]
+*
+*     src  the source                                  I
+*    
+*   Returns: bytes per second, or 0 if nothing has been fetched yet
+***********************************************************************/
+static double stripeSourceRate(stripeSource_t *src)
+{
+    if (src->bytesDone == 0)
+    {
+	return 0.0;
     }
-    if (status == DIGS_TRANSFER_DONE) {
-      break;
+    if (src->secondsBusy < 1.0)
+    {
+	return (double)src->bytesDone;
     }
-
-    globus_libc_usleep(1000);
-
-    endTime = time(NULL);
-  } while (difftime(endTime, startTime) < timeout);
-
-  result = se->digs_endTransfer(errbuf, handle);
-  if (result != DIGS_SUCCESS) {
-    logMessage(ERROR, "Error in end transfer to %s: %s (%s)", remoteHost,
-	       digsErrorToString(result), errbuf);
-    return 0;
-  }
-
-  return 1;
+    return (double)src->bytesDone / src->secondsBusy;
 }
 
 /***********************************************************************
-*   int qcdgridPutFile(char *pfn, char *lfn, char *permissions)
+*   void endStripeRange(stripeSource_t *src, int *chunks, int succeeded,
+*                       long long chunkLen)
 *
-*   Puts one file onto the data grid    
+*   Records the end of a range fetched by a striped get. A source whose
+*   ranges keep failing is given up on
 *    
 *   Parameters:                                      [I/O]
 *
-*     pfn    Physical filename of file on local disk  I
-*     lfn    Logical name for file on grid            I
-*     permissions  'public' or 'private'              I
+*     src        the source that fetched the range    I/O
+*     chunks     states of the ranges                 I/O
+*     succeeded  whether the range was fetched         I
+*     chunkLen   length of the range                   I
 *    
-*   Returns: 1 on success, 0 on failure
+*   Returns: (void)
 ***********************************************************************/
-int qcdgridPutFile(char *pfn, char *lfn, char *permissions)
+static void endStripeRange(stripeSource_t *src, int *chunks, int succeeded,
+			   long long chunkLen)
 {
-    char *destination;
-    char **list;
-    char *msgBuffer;
-    FILE *f;
-    int i;
-    int success = 0;
-
-    char *DN, *tmpDN;
+    if (succeeded)
+    {
+	chunks[src->chunk] = CHUNK_DONE;
+	src->bytesDone += chunkLen;
+	src->secondsBusy += difftime(time(NULL), src->started);
+    }
+    else
+    {
+	chunks[src->chunk] = CHUNK_QUEUED;
+	src->failures++;
+	if (src->failures >= getNodeTransferAttempts(src->name))
+	{
+	    logMessage(3, "Giving up on %s for striped get", src->name);
+	    src->dropped = 1;
+	}
+    }
+    src->chunk = -1;
+}
 
-    char *group;
-    long long size;
+/***********************************************************************
+*   int getFileStriped(char *lfn, char *pfn)
+*
+*   Fetches a large file in ranges from several of its copies at once.
+*   Each range is written into place as it arrives, and the whole file
+*   is checked against the catalogue's checksum at the end. Ranges that
+*   fail are fetched again from another copy, and the ranges still
+*   outstanding on a slow node are taken over by faster ones
+*    
+*   Parameters:                                      [I/O]
+*
+*     lfn  Logical grid filename                       I
+*     pfn  Physical local filename                     I
+*    
+*   Returns: 1 if the file was fetched, 0 if it wasn't (because it's not
+*            worth striping, or the striped get failed)
+***********************************************************************/
+static int getFileStriped(char *lfn, char *pfn)
+{
+    stripeSource_t sources[STRIPE_MAX_SOURCES];
+    stripeSource_t *src, *slow;
+    struct storageElement *se;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    char *sizestr, *rlsMd5;
+    char *lockedPath;
+    char *name;
+    char md5sum[CHECKSUM_LENGTH + 1];
     unsigned char md5[16];
-    char hexBuffer[40];
-    
-    //    char * permissions; //read from user or private by default
-    // permissions = "private";
-    
-    time_t now;
-    char * space = " ";
-    char * plus  = "+";
-
-    logMessage(1, "qcdgridPutFile(%s,%s)", pfn, lfn);
-
-    logMessage(1, "Trying to get the DN of the user");
-    if (getUserIdentity(&DN) == 0)
+    long long size, chunkLen;
+    int numChunks, chunksDone;
+    int *chunks;
+    int numSources = 0;
+    int active, waitFrom = 0;
+    digs_error_code_t result;
+    digs_transfer_status_t status;
+    int percentComplete;
+    double rate, slowest;
+    int fd;
+    int i, j;
+
+    /* Only worth it for big files */
+    if (!getAttrValueFromRLS(lfn, "size", &sizestr))
     {
-      logMessage(5, "Error obtaining user identity");
+	return 0;
     }
-    logMessage(1, "DN of the user: %s", DN);
-    logMessage(1, "Trying to get the group of the user");
-    if(getUserGroup(DN, &group) == 0)
+    size = strtoll(sizestr, NULL, 10);
+    globus_libc_free(sizestr);
+    if (size < STRIPE_MIN_SIZE)
     {
-      globus_libc_free(DN);
-      globus_libc_free(group);
-      logMessage(5, "Error obtaining user group");
-      return 0;
+	return 0;
     }
-    logMessage(1, "User group: %s", group);
 
-    /*
-     * check user is allowed to submit files as this group. Control thread
-     * will do the actual enforcement later but if we check here we can
-     * actually tell the user what's wrong
-     */
-    if (!userInGroup(DN, group))
+    /* Copies to fetch from, best first */
+    name = getBestCopyLocation(lfn);
+    while ((name) && (numSources < STRIPE_MAX_SOURCES))
     {
-      char **groups;
-      int numGroups;
-      logMessage(ERROR, "Error: %s not a member of group %s", DN, group);
-      if (getUserGroups(DN, &numGroups, &groups)) {
-	globus_libc_printf("Your groups: ");
-	for (i = 0; i < numGroups; i++) {
+	se = getNode(name);
+	if ((se) && (se->digs_startGetRangeTransfer != NULL))
+	{
+	    src = &sources[numSources];
+	    src->remoteFile = constructFilename(name, lfn);
+	    if (src->remoteFile)
+	    {
+		src->name = name;
+		src->se = se;
+		src->chunk = -1;
+		src->bytesDone = 0;
+		src->secondsBusy = 0.0;
+		src->failures = 0;
+		src->dropped = 0;
+		numSources++;
+	    }
+	}
+	name = getNextBestCopyLocation(lfn);
+    }
+    if (numSources < 2)
+    {
+	for (i = 0; i < numSources; i++)
+	{
+	    globus_libc_free(sources[i].remoteFile);
+	}
+	return 0;
+    }
+
+    /* Can only put it together if there's something to check it with */
+    rlsMd5 = getRLSAttribute(lfn, "md5sum");
+    if (!rlsMd5)
+    {
+	for (i = 0; i < numSources; i++)
+	{
+	    globus_libc_free(sources[i].remoteFile);
+	}
+	return 0;
+    }
+
+    logMessage(3, "Getting %s in ranges from %d nodes", lfn, numSources);
+
+    /* Make space for the whole file, named so it isn't mistaken for the
+     * real thing until it's complete */
+    if (safe_asprintf(&lockedPath, "%s-LOCKED", pfn) < 0)
+    {
+	errorExit("Out of memory in getFileStriped");
+    }
+    fd = open(lockedPath, O_WRONLY | O_CREAT, 0644);
+    if ((fd < 0) || (ftruncate(fd, (off_t)size) < 0))
+    {
+	logMessage(5, "Cannot create local file %s", lockedPath);
+	if (fd >= 0)
+	{
+	    close(fd);
+	}
+	for (i = 0; i < numSources; i++)
+	{
+	    globus_libc_free(sources[i].remoteFile);
+	}
+	globus_libc_free(rlsMd5);
+	globus_libc_free(lockedPath);
+	return 0;
+    }
+    close(fd);
+
+    numChunks = (int)((size + STRIPE_CHUNK_SIZE - 1) / STRIPE_CHUNK_SIZE);
+    chunks = globus_libc_malloc(numChunks * sizeof(int));
+    if (!chunks)
+    {
+	errorExit("Out of memory in getFileStriped");
+    }
+    for (i = 0; i < numChunks; i++)
+    {
+	chunks[i] = CHUNK_QUEUED;
+    }
+    chunksDone = 0;
+
+    while (chunksDone < numChunks)
+    {
+	/* Give idle sources something to do */
+	for (i = 0; i < numSources; i++)
+	{
+	    src = &sources[i];
+	    if ((src->dropped) || (src->chunk >= 0))
+	    {
+		continue;
+	    }
+
+	    for (j = 0; j < numChunks; j++)
+	    {
+		if (chunks[j] == CHUNK_QUEUED)
+		{
+		    break;
+		}
+	    }
+
+	    if (j >= numChunks)
+	    {
+		/* Nothing left to start - take over from the slowest
+		 * source if this one could fetch its range much sooner */
+		rate = stripeSourceRate(src);
+		slow = NULL;
+		slowest = 0.0;
+		for (j = 0; j < numSources; j++)
+		{
+		    if ((sources[j].chunk < 0) ||
+			(difftime(time(NULL), sources[j].started) <= slowest))
+		    {
+			continue;
+		    }
+		    slow = &sources[j];
+		    slowest = difftime(time(NULL), sources[j].started);
+		}
+		if ((slow == NULL) || (rate <= 0.0) ||
+		    (slowest < STRIPE_SLOW_FACTOR * (STRIPE_CHUNK_SIZE / rate)))
+		{
+		    continue;
+		}
+		logMessage(3, "Moving range %d of %s from %s to %s", slow->chunk,
+			   lfn, slow->name, src->name);
+		slow->se->digs_cancelTransfer(errbuf, slow->handle);
+		chunks[slow->chunk] = CHUNK_QUEUED;
+		j = slow->chunk;
+		slow->chunk = -1;
+	    }
+
+	    chunkLen = size - ((long long)j * STRIPE_CHUNK_SIZE);
+	    if (chunkLen > STRIPE_CHUNK_SIZE)
+	    {
+		chunkLen = STRIPE_CHUNK_SIZE;
+	    }
+	    result = src->se->digs_startGetRangeTransfer(errbuf, src->name,
+							 src->remoteFile, lockedPath,
+							 (long long)j * STRIPE_CHUNK_SIZE,
+							 chunkLen, &src->handle);
+	    src->chunk = j;
+	    if (result != DIGS_SUCCESS)
+	    {
+		logMessage(ERROR, "Error starting range get from %s: %s (%s)",
+			   src->name, digsErrorToString(result), errbuf);
+		endStripeRange(src, chunks, 0, chunkLen);
+		continue;
+	    }
+	    chunks[j] = CHUNK_ACTIVE;
+	    src->started = time(NULL);
+	    startTransferWatchdog(&src->watchdog, src->se, src->name, src->handle,
+				  chunkLen);
+	}
+
+	/* See how the ranges are getting on */
+	active = 0;
+	for (i = 0; i < numSources; i++)
+	{
+	    src = &sources[i];
+	    if (src->chunk < 0)
+	    {
+		continue;
+	    }
+	    chunkLen = size - ((long long)src->chunk * STRIPE_CHUNK_SIZE);
+	    if (chunkLen > STRIPE_CHUNK_SIZE)
+	    {
+		chunkLen = STRIPE_CHUNK_SIZE;
+	    }
+
+	    result = src->se->digs_monitorTransfer(errbuf, src->handle, &status,
+						   &percentComplete);
+	    if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED))
+	    {
+		logMessage(ERROR, "Error in range get from %s: %s (%s)", src->name,
+			   digsErrorToString(result), errbuf);
+		src->se->digs_endTransfer(errbuf, src->handle);
+		endStripeRange(src, chunks, 0, chunkLen);
+	    }
+	    else if (status == DIGS_TRANSFER_DONE)
+	    {
+		result = src->se->digs_endTransfer(errbuf, src->handle);
+		if (result != DIGS_SUCCESS)
+		{
+		    logMessage(ERROR, "Error in end transfer from %s: %s (%s)",
+			       src->name, digsErrorToString(result), errbuf);
+		}
+		else
+		{
+		    chunksDone++;
+		}
+		endStripeRange(src, chunks, (result == DIGS_SUCCESS), chunkLen);
+	    }
+	    else if (!checkTransferWatchdog(&src->watchdog, status, percentComplete))
+	    {
+		logMessage(ERROR, "Giving up on range get from %s", src->name);
+		src->se->digs_cancelTransfer(errbuf, src->handle);
+		endStripeRange(src, chunks, 0, chunkLen);
+	    }
+	    else
+	    {
+		active++;
+	    }
+	}
+
+	if (chunksDone >= numChunks)
+	{
+	    break;
+	}
+	for (i = 0; i < numSources; i++)
+	{
+	    if (!sources[i].dropped)
+	    {
+		break;
+	    }
+	}
+	if ((i >= numSources) && (active == 0))
+	{
+	    logMessage(3, "No nodes left to get ranges of %s from", lfn);
+	    break;
+	}
+
+	/* Sleep until one of the ranges finishes, taking turns between them */
+	for (i = 0; i < numSources; i++)
+	{
+	    src = &sources[(waitFrom + i) % numSources];
+	    if (src->chunk >= 0)
+	    {
+		waitFrom = (waitFrom + i + 1) % numSources;
+		waitForTransfer(src->se, src->handle, 1.0);
+		break;
+	    }
+	}
+    }
+
+    for (i = 0; i < numSources; i++)
+    {
+	globus_libc_free(sources[i].remoteFile);
+    }
+    globus_libc_free(chunks);
+
+    if (chunksDone < numChunks)
+    {
+	unlink(lockedPath);
+	globus_libc_free(rlsMd5);
+	globus_libc_free(lockedPath);
+	return 0;
+    }
+
+    /* Check what was put together is the file in the catalogue */
+    computeMd5Checksum(lockedPath, md5);
+    for (i = 0; i < 16; i++)
+    {
+	sprintf(&md5sum[i*2], "%02X", md5[i]);
+    }
+    if (strcasecmp(md5sum, rlsMd5))
+    {
+	logMessage(5, "Checksum of %s fetched in ranges is %s, expected %s", lfn,
+		   md5sum, rlsMd5);
+	unlink(lockedPath);
+	globus_libc_free(rlsMd5);
+	globus_libc_free(lockedPath);
+	return 0;
+    }
+
+    if (rename(lockedPath, pfn) < 0)
+    {
+	logMessage(5, "Cannot rename %s to %s", lockedPath, pfn);
+	unlink(lockedPath);
+	globus_libc_free(rlsMd5);
+	globus_libc_free(lockedPath);
+	return 0;
+    }
+
+    globus_libc_free(rlsMd5);
+    globus_libc_free(lockedPath);
+    return 1;
+}
+
+/***********************************************************************
+*   int qcdgridGetFile(char *lfn, char *pfn);
+*    
+*   Retrieves one file from the data grid to the local disk
+*    
+*   Parameters:                                [I/O]
+*
+*     lfn  Logical grid filename                I
+*     pfn  Physical local filename              I
+*    
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+int qcdgridGetFile(char *lfn, char *pfn)
+{
+    char *source;
+    char *cacheKey;
+
+//RADEK - change to single slash
+    char *ssLFN = substituteChars(lfn, "//", "/");
+//changed all references to "lfn" into "ssLFN"
+
+    logMessage(1, "qcdgridGetFile(%s,%s)", ssLFN, pfn);
+
+    /* Find nearest copy of file */
+    source = getBestCopyLocation(ssLFN);
+    if (!source) 
+    {
+	logMessage(5, "File %s not found on grid", ssLFN);
+	return 0;
+    }
+
+    if (!makeLocalPathValid(pfn))
+    {
+	logMessage(5, "Error making directory structure on local file system");
+	return 0;
+    }
+
+    /* We may have fetched this version of it before */
+    cacheKey = getCacheKey(ssLFN);
+    if (getFileFromCache(cacheKey, pfn))
+    {
+	logMessage(3, "File %s successfully retrieved from local cache", ssLFN);
+	globus_libc_free(cacheKey);
+	globus_libc_free(ssLFN);
+	return 1;
+    }
+
+    /* Big files come faster from several copies at once */
+    if (getFileStriped(ssLFN, pfn))
+    {
+	logMessage(3, "File %s successfully retrieved in ranges", ssLFN);
+	addFileToCache(cacheKey, pfn);
+	if (cacheKey) globus_libc_free(cacheKey);
+	globus_libc_free(ssLFN);
+	return 1;
+    }
+    source = getBestCopyLocation(ssLFN);
+
+    /* Transfer it to local storage */    
+    while (!copyFromStorage(source, ssLFN, pfn)) 
+    {
+	logMessage(3, "Error copying from %s", source);
+
+	/* If it didn't work, try next best copy */
+	source = getNextBestCopyLocation(ssLFN);
+	if (!source) 
+	{
+	    logMessage(5, "All copies of %s are inaccessible", ssLFN);
+	    if (cacheKey) globus_libc_free(cacheKey);
+	    globus_libc_free(ssLFN);
+	    return 0;
+	}
+    }
+
+    logMessage(3, "File %s successfully retrieved from %s", ssLFN, source);
+
+    addFileToCache(cacheKey, pfn);
+    if (cacheKey) globus_libc_free(cacheKey);
+    globus_libc_free(ssLFN);
+
+    return 1;
+}
+
+/*
+ * qcdgridGetDirectory keeps up to GET_MAX_IN_FLIGHT copies from storage
+ * going at once, and no more than a node's 'getsinflight' property
+ * (default GET_NODE_IN_FLIGHT) from any one node
+ */
+#define GET_MAX_IN_FLIGHT 16
+#define GET_NODE_IN_FLIGHT 4
+
+/* States of a getJob_t */
+enum { GET_QUEUED, GET_STARTING, GET_COPYING, GET_DONE, GET_FAILED };
+
+/* Need access to the preference order list in node.c, to break ties
+ * between equally loaded copies */
+extern nodeList_t *prefList_;
+
+/*
+ * A node files are being fetched from by qcdgridGetDirectory
+ */
+typedef struct getNode_s {
+    char *name;                  /* points into the node table        */
+    struct storageElement *se;
+    int prefPos;                 /* position in preference order      */
+    int maxInFlight;
+    int inFlight;
+    int assigned;                /* files fetched or being fetched    */
+    int numStarting;             /* files chosen to start this round  */
+    int *starting;               /* their indices in the job list     */
+} getNode_t;
+
+/*
+ * One file being fetched by qcdgridGetDirectory
+ */
+typedef struct getJob_s {
+    char *lfn;
+    char *pfn;
+    int numSources;
+    char sources[MAX_PFNS];      /* node indices from getFileList     */
+    char tried[MAX_PFNS];        /* nonzero for sources given up on   */
+    int source;                  /* which of the sources is in use    */
+    getNode_t *node;             /* node it is being fetched from     */
+    char *remoteFile;            /* its path on that node             */
+    int handle;
+    int attempt;                 /* failed attempts on that node      */
+    transferWatchdog_t watchdog;
+    int state;
+} getJob_t;
+
+/***********************************************************************
+*   getNode_t *findGetNode(getNode_t *nodes, int idx)
+*
+*   Returns qcdgridGetDirectory's record of a node, setting it up the
+*   first time the node is seen
+*    
+*   Parameters:                                      [I/O]
+*
+*     nodes  records for every node in the table, by    I/O
+*            index
+*     idx    index of the node                          I
+*    
+*   Returns: the node, or NULL if it can't be used
+***********************************************************************/
+static getNode_t *findGetNode(getNode_t *nodes, int idx)
+{
+    getNode_t *gn;
+    char *prop;
+    int i;
+
+    if ((idx < 0) || (idx >= getNumNodes()))
+    {
+	return NULL;
+    }
+    gn = &nodes[idx];
+    if (gn->name != NULL)
+    {
+	return (gn->se != NULL) ? gn : NULL;
+    }
+
+    gn->name = getNodeName(idx);
+    gn->se = NULL;
+
+    /* same nodes as getBestCopyLocation would consider */
+    if ((isNodeDead(gn->name)) || (isNodeDisabled(gn->name)))
+    {
+	return NULL;
+    }
+    for (i = 0; i < prefList_->count; i++)
+    {
+	if (prefList_->nodes[i] == idx)
+	{
+	    break;
+	}
+    }
+    if (i >= prefList_->count)
+    {
+	return NULL;
+    }
+    gn->prefPos = i;
+
+    gn->se = getNode(gn->name);
+    if (!gn->se)
+    {
+	logMessage(ERROR, "Cannot find node %s", gn->name);
+	return NULL;
+    }
+    gn->maxInFlight = GET_NODE_IN_FLIGHT;
+    prop = getNodeProperty(gn->name, "getsinflight");
+    if (prop)
+    {
+	if (atoi(prop) > 0)
+	{
+	    gn->maxInFlight = atoi(prop);
+	}
+	globus_libc_free(prop);
+    }
+    return gn;
+}
+
+/***********************************************************************
+*   int chooseGetNode(getJob_t *job, getNode_t *nodes, getNode_t **chosen)
+*
+*   Picks the copy of a file to fetch: of the sources not yet given up
+*   on, the one on the node with the fewest files fetched from it so
+*   far, falling back on the preference order between equals
+*    
+*   Parameters:                                      [I/O]
+*
+*     job     the file to fetch                       I/O
+*     nodes   qcdgridGetDirectory's node records      I/O
+*     chosen  receives the node, or NULL if all the     O
+*             sources are busy
+*    
+*   Returns: 1 if a node was chosen or all are busy, 0 if no source is
+*            left to try
+***********************************************************************/
+static int chooseGetNode(getJob_t *job, getNode_t *nodes, getNode_t **chosen)
+{
+    getNode_t *gn;
+    int remaining = 0;
+    int i;
+
+    *chosen = NULL;
+    for (i = 0; i < job->numSources; i++)
+    {
+	if (job->tried[i])
+	{
+	    continue;
+	}
+	gn = findGetNode(nodes, job->sources[i]);
+	if (!gn)
+	{
+	    job->tried[i] = 1;
+	    continue;
+	}
+	remaining = 1;
+
+	if (gn->inFlight + gn->numStarting >= gn->maxInFlight)
+	{
+	    continue;
+	}
+	if ((*chosen == NULL) || (gn->assigned < (*chosen)->assigned) ||
+	    ((gn->assigned == (*chosen)->assigned) &&
+	     (gn->prefPos < (*chosen)->prefPos)))
+	{
+	    *chosen = gn;
+	    job->source = i;
+	}
+    }
+    return remaining;
+}
+
+/***********************************************************************
+*   void finishGetCopy(getJob_t *job, int succeeded)
+*
+*   Records the end of a copy from storage. A failed copy is tried again
+*   from the same node up to the node's number of transfer attempts,
+*   then from the file's other locations
+*    
+*   Parameters:                                      [I/O]
+*
+*     job        the file                             I/O
+*     succeeded  whether the copy worked               I
+*    
+*   Returns: (void)
+***********************************************************************/
+static void finishGetCopy(getJob_t *job, int succeeded)
+{
+    getNode_t *gn = job->node;
+
+    globus_libc_free(job->remoteFile);
+    job->remoteFile = NULL;
+
+    if (job->state == GET_COPYING)
+    {
+	gn->inFlight--;
+    }
+    if (succeeded)
+    {
+	job->state = GET_DONE;
+	logMessage(3, "File %s successfully retrieved from %s", job->lfn,
+		   gn->name);
+	return;
+    }
+
+    gn->assigned--;
+    job->attempt++;
+    if (job->attempt >= getNodeTransferAttempts(gn->name))
+    {
+	logMessage(3, "Error copying %s from %s", job->lfn, gn->name);
+	job->tried[job->source] = 1;
+	job->attempt = 0;
+    }
+    else
+    {
+	logMessage(WARN, "Retrying get of %s from %s (attempt %d of %d)",
+		   job->lfn, gn->name, job->attempt + 1,
+		   getNodeTransferAttempts(gn->name));
+    }
+    job->state = GET_QUEUED;
+}
+
+/***********************************************************************
+*   void startGetCopies(getNode_t *gn, getJob_t *jobs)
+*
+*   Starts the copies chosen to come from a node, in one batch
+*    
+*   Parameters:                                      [I/O]
+*
+*     gn    the node                                  I/O
+*     jobs  qcdgridGetDirectory's list of files       I/O
+*    
+*   Returns: (void)
+***********************************************************************/
+static void startGetCopies(getNode_t *gn, getJob_t *jobs)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    const char **remoteFiles;
+    const char **localFiles;
+    int *handles;
+    digs_error_code_t *results;
+    getJob_t *job;
+    int i;
+
+    remoteFiles = globus_libc_malloc(gn->numStarting * sizeof(char *));
+    localFiles = globus_libc_malloc(gn->numStarting * sizeof(char *));
+    handles = globus_libc_malloc(gn->numStarting * sizeof(int));
+    results = globus_libc_malloc(gn->numStarting * sizeof(digs_error_code_t));
+    if ((!remoteFiles) || (!localFiles) || (!handles) || (!results))
+    {
+	errorExit("Out of memory in startGetCopies");
+    }
+
+    for (i = 0; i < gn->numStarting; i++)
+    {
+	job = &jobs[gn->starting[i]];
+	remoteFiles[i] = job->remoteFile;
+	localFiles[i] = job->pfn;
+    }
+
+    if (startGetTransfers(gn->se, errbuf, gn->name, gn->numStarting,
+			  remoteFiles, localFiles, handles, results)
+	!= DIGS_SUCCESS)
+    {
+	logMessage(ERROR, "Error starting get transfers from %s: %s", gn->name,
+		   errbuf);
+    }
+
+    for (i = 0; i < gn->numStarting; i++)
+    {
+	job = &jobs[gn->starting[i]];
+	if (results[i] != DIGS_SUCCESS)
+	{
+	    finishGetCopy(job, 0);
+	    continue;
+	}
+	job->handle = handles[i];
+	job->state = GET_COPYING;
+	startTransferWatchdog(&job->watchdog, gn->se, gn->name, job->handle, -1);
+	gn->inFlight++;
+    }
+    gn->numStarting = 0;
+
+    globus_libc_free(remoteFiles);
+    globus_libc_free(localFiles);
+    globus_libc_free(handles);
+    globus_libc_free(results);
+}
+
+/***********************************************************************
+*   int qcdgridGetDirectory(char *ldn, char *pdn);
+*    
+*   Retrieves a whole directory from the data grid to the local disk.
+*   The locations of all the files are read from the replica catalogue
+*   at once, then the files are fetched in parallel, spread across the
+*   nodes holding copies of them
+*    
+*   Parameters:                                [I/O]
+*
+*     ldn  Logical grid directory name          I
+*     pdn  Physical local directory name        I
+*    
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+int qcdgridGetDirectory(char *ldn, char *pdn)
+{
+    char *dir, *wildcard;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    logicalFileInfo_t *list;
+    int numFiles;
+    getJob_t *jobs;
+    getJob_t *job;
+    getNode_t *nodes;
+    getNode_t *gn;
+    int count = 0;
+    int inFlight = 0;
+    int active;
+    int waitFrom = 0;
+    digs_error_code_t result;
+    digs_transfer_status_t status;
+    int percentComplete;
+    int allOK = 1;
+    int dlen;
+    int i;
+
+//RADEK - change to single slash
+    char *ssLDN = substituteChars(ldn, "//", "/");
+//changed all references to "ldn" into "ssLDN"
+
+
+    logMessage(1, "qcdgridGetDirectory(%s,%s)", ssLDN, pdn);
+
+    dir = globus_libc_malloc(strlen(ssLDN) + 2);
+    if (!dir)
+    {
+	errorExit("Out of memory in qcdgridGetDirectory");
+    }
+    strcpy(dir, ssLDN);
+    if (dir[strlen(dir) - 1] != '/')
+    {
+	strcat(dir, "/");
+    }
+    
+    dlen = strlen(dir);
+
+    /*
+     * One query for every file in the directory and all its locations.
+     * A directory name that is itself a pattern gets everything and is
+     * matched below
+     */
+    if (strpbrk(dir, "*?[\\"))
+    {
+	wildcard = safe_strdup("*");
+    }
+    else if (safe_asprintf(&wildcard, "%s*", dir) < 0)
+    {
+	wildcard = NULL;
+    }
+    if (!wildcard)
+    {
+	errorExit("Out of memory in qcdgridGetDirectory");
+    }
+    list = getFileList(wildcard, &numFiles);
+    globus_libc_free(wildcard);
+    if (!list)
+    {
+	numFiles = 0;
+    }
+
+    jobs = globus_libc_malloc((numFiles + 1) * sizeof(getJob_t));
+    nodes = globus_libc_malloc(getNumNodes() * sizeof(getNode_t));
+    if ((!jobs) || (!nodes))
+    {
+	errorExit("Out of memory in qcdgridGetDirectory");
+    }
+    for (i = 0; i < getNumNodes(); i++)
+    {
+	nodes[i].name = NULL;
+	nodes[i].se = NULL;
+	nodes[i].inFlight = 0;
+	nodes[i].assigned = 0;
+	nodes[i].numStarting = 0;
+	nodes[i].starting = NULL;
+    }
+
+    for (i = 0; i < numFiles; i++)
+    {
+	if (strncmp(list[i].lfn, dir, dlen))
+	{
+	    continue;
+	}
+
+	job = &jobs[count];
+	job->lfn = safe_strdup(list[i].lfn);
+	if (!job->lfn)
+	{
+	    errorExit("Out of memory in qcdgridGetDirectory");
+	}
+	if (safe_asprintf(&job->pfn, "%s/%s", pdn, &job->lfn[dlen]) < 0)
+	{
+	    errorExit("Out of memory in qcdgridGetDirectory");
+	}
+	job->numSources = list[i].numPfns;
+	memcpy(job->sources, list[i].pfns, MAX_PFNS);
+	memset(job->tried, 0, MAX_PFNS);
+	job->node = NULL;
+	job->remoteFile = NULL;
+	job->attempt = 0;
+	job->state = GET_QUEUED;
+	count++;
+
+	logMessage(4, "%s -> %s", job->lfn, job->pfn);
+	if (!makeLocalPathValid(job->pfn))
+	{
+	    logMessage(5, "Error making directory structure on local file system");
+	    job->state = GET_FAILED;
+	}
+    }
+    if (list)
+    {
+	freeFileList(list, numFiles);
+    }
+    globus_libc_free(dir);
+
+    if (count == 0)
+    {
+	logMessage(5, "Directory %s not found on grid", ssLDN);
+	globus_libc_free(jobs);
+	globus_libc_free(nodes);
+	globus_libc_free(ssLDN);
+	return 0;
+    }
+
+    do
+    {
+	active = 0;
+
+	/* Choose where to fetch queued files from while there's room */
+	for (i = 0; (i < count) && (inFlight < GET_MAX_IN_FLIGHT); i++)
+	{
+	    job = &jobs[i];
+	    if (job->state != GET_QUEUED)
+	    {
+		continue;
+	    }
+	    if (!chooseGetNode(job, nodes, &gn))
+	    {
+		logMessage(5, "All copies of %s are inaccessible", job->lfn);
+		job->state = GET_FAILED;
+		continue;
+	    }
+	    if (gn == NULL)
+	    {
+		/* all its sources are busy */
+		continue;
+	    }
+
+	    job->remoteFile = constructFilename(gn->name, job->lfn);
+	    if (!job->remoteFile)
+	    {
+		logMessage(ERROR, "constructFilename failed for %s on %s in "
+			   "qcdgridGetDirectory", job->lfn, gn->name);
+		job->state = GET_FAILED;
+		continue;
+	    }
+	    job->node = gn;
+	    job->state = GET_STARTING;
+	    gn->assigned++;
+	    inFlight++;
+
+	    if (gn->starting == NULL)
+	    {
+		gn->starting = globus_libc_malloc(gn->maxInFlight * sizeof(int));
+		if (!gn->starting)
+		{
+		    errorExit("Out of memory in qcdgridGetDirectory");
+		}
+	    }
+	    gn->starting[gn->numStarting++] = i;
+	}
+
+	/* Start them, a batch per node */
+	for (i = 0; i < getNumNodes(); i++)
+	{
+	    if (nodes[i].numStarting > 0)
+	    {
+		startGetCopies(&nodes[i], jobs);
+	    }
+	}
+
+	/* See how the copies are getting on */
+	inFlight = 0;
+	for (i = 0; i < count; i++)
+	{
+	    job = &jobs[i];
+	    if (job->state == GET_QUEUED)
+	    {
+		active = 1;
+	    }
+	    if (job->state != GET_COPYING)
+	    {
+		continue;
+	    }
+	    active = 1;
+
+	    gn = job->node;
+	    result = gn->se->digs_monitorTransfer(errbuf, job->handle, &status,
+						  &percentComplete);
+	    if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED))
+	    {
+		logMessage(ERROR, "Error in get transfer from %s: %s (%s)", gn->name,
+			   digsErrorToString(result), errbuf);
+		gn->se->digs_endTransfer(errbuf, job->handle);
+		finishGetCopy(job, 0);
+	    }
+	    else if (status == DIGS_TRANSFER_DONE)
+	    {
+		result = gn->se->digs_endTransfer(errbuf, job->handle);
+		if (result != DIGS_SUCCESS)
+		{
+		    logMessage(ERROR, "Error in end transfer from %s: %s (%s)",
+			       gn->name, digsErrorToString(result), errbuf);
+		}
+		finishGetCopy(job, (result == DIGS_SUCCESS));
+	    }
+	    else if (!checkTransferWatchdog(&job->watchdog, status, percentComplete))
+	    {
+		logMessage(ERROR, "Giving up on get transfer of %s from %s", job->lfn,
+			   gn->name);
+		gn->se->digs_cancelTransfer(errbuf, job->handle);
+		finishGetCopy(job, 0);
+	    }
+	    else
+	    {
+		inFlight++;
+	    }
+	}
+
+	/* Sleep until one of the copies finishes, taking turns between them */
+	if (inFlight > 0)
+	{
+	    for (i = 0; i < count; i++)
+	    {
+		job = &jobs[(waitFrom + i) % count];
+		if (job->state == GET_COPYING)
+		{
+		    waitFrom = (waitFrom + i + 1) % count;
+		    waitForTransfer(job->node->se, job->handle, 1.0);
+		    break;
+		}
+	    }
+	}
+    } while (active);
+
+    for (i = 0; i < count; i++)
+    {
+	job = &jobs[i];
+	if (job->state != GET_DONE)
+	{
+	    logMessage(5, "Error retrieving file %s", job->lfn);
+	    allOK = 0;
+	}
+	globus_libc_free(job->lfn);
+	globus_libc_free(job->pfn);
+    }
+    for (i = 0; i < getNumNodes(); i++)
+    {
+	if (nodes[i].starting)
+	{
+	    globus_libc_free(nodes[i].starting);
+	}
+    }
+
+    globus_libc_free(jobs);
+    globus_libc_free(nodes);
+    globus_libc_free(ssLDN);
+
+    return allOK;
+}
+
+
+/*=====================================================================
+ *
+ * Putting files/directories on grid
+ *
+ *===================================================================*/
+/***********************************************************************
+*   void getSentChecksum(struct storageElement *se, int handle,
+*                        char *md5sum)
+*
+*   Gets the checksum a finished put worked out from the data it sent,
+*   so that the file doesn't have to be read again to find it
+*    
+*   Parameters:                                                     [I/O]
+*
+*     se          Storage element the file was put on                I
+*     handle      The finished transfer, not yet ended               I
+*     md5sum      Receives the checksum as hex, or an empty string if  O
+*                 the SE doesn't have one. Must hold
+*                 CHECKSUM_LENGTH+1 chars
+*    
+*   Returns: (void)
+***********************************************************************/
+static void getSentChecksum(struct storageElement *se, int handle,
+			    char *md5sum)
+{
+  char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+  char *checksum;
+
+  md5sum[0] = 0;
+  if (!se->digs_getTransferChecksum) {
+    return;
+  }
+  if (se->digs_getTransferChecksum(errbuf, handle, &checksum) != DIGS_SUCCESS) {
+    logMessage(DEBUG, "No checksum from put transfer: %s", errbuf);
+    return;
+  }
+  if (strlen(checksum) == CHECKSUM_LENGTH) {
+    strcpy(md5sum, checksum);
+  }
+  se->digs_free_string(&checksum);
+}
+
+/***********************************************************************
+*   void getPutChecksum(char *pfn, char *md5sum)
+*
+*   Makes sure md5sum holds the checksum of a file that has been put,
+*   reading the file to work it out if the transfer couldn't say
+*    
+*   Parameters:                                                     [I/O]
+*
+*     pfn         Full pathname to file on local machine             I
+*     md5sum      The checksum from getSentChecksum, filled in if   I/O
+*                 it is empty
+*    
+*   Returns: (void)
+***********************************************************************/
+static void getPutChecksum(char *pfn, char *md5sum)
+{
+  unsigned char md5[16];
+  int i;
+
+  if (md5sum[0]) {
+    return;
+  }
+  logMessage(1, "Computing checksum");
+  computeMd5Checksum(pfn, md5);
+  for (i = 0; i < 16; i++) {
+    sprintf(&md5sum[i*2], "%02X", md5[i]);
+  }
+}
+
+/***********************************************************************
+*   digs_error_code_t tryCopyToSEInbox(struct storageElement *se,
+*                        char *localFile, char *remoteHost, char *lfn,
+*                        char *md5sum)
+*
+*   Makes one attempt at copying a file from the local file system to a
+*   remote SE's inbox
+*    
+*   Parameters:                                                     [I/O]
+*
+*     se          Storage element to copy to                         I
+*     localFile   Full pathname to file on local machine             I
+*     remoteHost  FQDN of SE to copy to                              I
+*     lfn         Desired logical filename for file                  I
+*     md5sum      Receives the checksum of what was sent, if the      O
+*                 SE worked it out (see getSentChecksum)
+*    
+*   Returns: DIGS_SUCCESS, or the DiGS error code the copy failed with.
+*            A copy given up on because it stalled is DIGS_NO_RESPONSE
+***********************************************************************/
+static digs_error_code_t tryCopyToSEInbox(struct storageElement *se,
+					  char *localFile, char *remoteHost,
+					  char *lfn, char *md5sum)
+{
+  int handle;
+  char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+  digs_error_code_t result;
+  transferWatchdog_t watchdog;
+  int percentComplete;
+  digs_transfer_status_t status;
+
+  md5sum[0] = 0;
+  result = se->digs_startCopyToInbox(errbuf, remoteHost, localFile,
+				     lfn, &handle);
+  if (result != DIGS_SUCCESS) {
+	  if (result == DIGS_NO_INBOX){
+		    logMessage(INFO, "Did not copy to inbox on %s: %s (%s)", remoteHost,
+			       digsErrorToString(result), errbuf);
+	  }
+	  else{
+		    logMessage(ERROR, "Error starting copy to inbox on %s: %s (%s)", remoteHost,
+			       digsErrorToString(result), errbuf);
+	  }
+    return result;
+  }
+
+  startTransferWatchdog(&watchdog, se, remoteHost, handle,
+			getFileLength(localFile));
+  while (1) {
+    result = se->digs_monitorTransfer(errbuf, handle, &status, &percentComplete);
+    if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED)) {
+      logMessage(ERROR, "Error in put transfer to %s: %s (%s)", remoteHost,
+		 digsErrorToString(result), errbuf);
+      se->digs_endTransfer(errbuf, handle);
+      return (result != DIGS_SUCCESS) ? result : DIGS_UNKNOWN_ERROR;
+    }
+    if (!checkTransferWatchdog(&watchdog, status, percentComplete)) {
+      logMessage(ERROR, "Giving up on put transfer to %s", remoteHost);
+      se->digs_cancelTransfer(errbuf, handle);
+      return DIGS_NO_RESPONSE;
+    }
+    if (status == DIGS_TRANSFER_DONE) {
+      getSentChecksum(se, handle, md5sum);
+      break;
+    }
+
+    waitForTransfer(se, handle, 1.0);
+  }
+
+  result = se->digs_endTransfer(errbuf, handle);
+  if (result != DIGS_SUCCESS) {
+    logMessage(ERROR, "Error in end transfer to %s: %s (%s)", remoteHost,
+	       digsErrorToString(result), errbuf);
+    md5sum[0] = 0;
+    return result;
+  }
+
+  return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   int copyToSEInbox(char *localFile, char *remoteHost, char *lfn,
+*                     char *md5sum)
+*
+*   Copies a file from the local file system to a remote SE's inbox. A
+*   copy that fails because the SE couldn't be reached is tried again
+*   after a short wait (see waitToRetryTransfer), up to the node's
+*   number of transfer attempts, carrying on from what was already sent
+*    
+*   Parameters:                                                     [I/O]
+*
+*     localFile   Full pathname to file on local machine             I
+*     remoteHost  FQDN of SE to copy to                              I
+*     lfn         Desired logical filename for file                  I
+*     md5sum      Receives the checksum of what was sent, or an       O
+*                 empty string (see getSentChecksum)
+*    
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+static int copyToSEInbox(char *localFile, char *remoteHost, char *lfn,
+			 char *md5sum)
+{
+  struct storageElement *se;
+  digs_error_code_t result;
+  int attempt, attempts;
+
+  md5sum[0] = 0;
+  se = getNode(remoteHost);
+  if (!se) {
+    logMessage(ERROR, "Cannot find node %s", remoteHost);
+    return 0;
+  }
+
+  attempts = getNodeTransferAttempts(remoteHost);
+  for (attempt = 1; attempt <= attempts; attempt++) {
+    result = tryCopyToSEInbox(se, localFile, remoteHost, lfn, md5sum);
+    if (result == DIGS_SUCCESS) {
+      return 1;
+    }
+    if ((attempt >= attempts) || (!waitToRetryTransfer(result, attempt))) {
+      break;
+    }
+    logMessage(WARN, "Retrying copy of %s to inbox on %s (attempt %d of %d)",
+	       localFile, remoteHost, attempt + 1, attempts);
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+*   int getPutIdentity(char **DN, char **group)
+*
+*   Works out who the user is and which group their files go in, and
+*   checks that they may put files on the grid
+*    
+*   Parameters:                                      [I/O]
+*
+*     DN     receives the user's certificate subject    O
+*     group  receives the user's group                  O
+*    
+*   Returns: 1 on success, 0 if the user may not put files. DN and group
+*            should be freed on success
+***********************************************************************/
+static int getPutIdentity(char **DN, char **group)
+{
+    int i;
+
+    logMessage(1, "Trying to get the DN of the user");
+    if (getUserIdentity(DN) == 0)
+    {
+      logMessage(5, "Error obtaining user identity");
+    }
+    logMessage(1, "DN of the user: %s", *DN);
+    logMessage(1, "Trying to get the group of the user");
+    if(getUserGroup(*DN, group) == 0)
+    {
+      globus_libc_free(*DN);
+      globus_libc_free(*group);
+      logMessage(5, "Error obtaining user group");
+      return 0;
+    }
+    logMessage(1, "User group: %s", *group);
+
+    /*
+     * check user is allowed to submit files as this group. Control thread
+     * will do the actual enforcement later but if we check here we can
+     * actually tell the user what's wrong
+     */
+    if (!userInGroup(*DN, *group))
+    {
+      char **groups;
+      int numGroups;
+      logMessage(ERROR, "Error: %s not a member of group %s", *DN, *group);
+      if (getUserGroups(*DN, &numGroups, &groups)) {
+	globus_libc_printf("Your groups: ");
+	for (i = 0; i < numGroups; i++) {
 	  globus_libc_printf("%s ", groups[i]);
 	}
 	globus_libc_printf("\n");
       }
-      globus_libc_free(DN);
-      globus_libc_free(group);
+      globus_libc_free(*DN);
+      globus_libc_free(*group);
       return 0;
     }
 
-    if (canAddFile(DN) == 0)
+    if (canAddFile(*DN) == 0)
     {
-      globus_libc_free(group);
-      globus_libc_free(DN);
-      logMessage(5, "User %s is not allowed to add to the grid", DN);
+      logMessage(5, "User %s is not allowed to add to the grid", *DN);
+      globus_libc_free(*group);
+      globus_libc_free(*DN);
       return 0;
     }
+
+    return 1;
+}
+
+/***********************************************************************
+*   int qcdgridPutFile(char *pfn, char *lfn, char *permissions)
+*
+*   Puts one file onto the data grid    
+*    
+*   Parameters:                                      [I/O]
+*
+*     pfn    Physical filename of file on local disk  I
+*     lfn    Logical name for file on grid            I
+*     permissions  'public' or 'private'              I
+*    
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+int qcdgridPutFile(char *pfn, char *lfn, char *permissions)
+{
+    char *destination;
+    char **list;
+    char *msgBuffer;
+    FILE *f;
+    int i;
+    int success = 0;
+
+    char *DN, *tmpDN;
+
+    char *group;
+    long long size;
+    char hexBuffer[40];
+    
+    //    char * permissions; //read from user or private by default
+    // permissions = "private";
+    
+    time_t now;
+    char * space = " ";
+    char * plus  = "+";
+
+    logMessage(1, "qcdgridPutFile(%s,%s)", pfn, lfn);
+
+    if (!getPutIdentity(&DN, &group))
+    {
+	return 0;
+    }
     
     /* Check to make sure we can read the source file */
     f = fopen(pfn, "rb");
@@ -795,7 +2014,7 @@ int qcdgridPutFile(char *pfn, char *lfn, char *permissions)
 	    return 0;
 	}
 
-	if (!copyToSEInbox(pfn, destination, lfn))
+	if (!copyToSEInbox(pfn, destination, lfn, hexBuffer))
 	{
 	    logMessage(3, "Error copying file to storage element %s; trying another node",
 		       destination);
@@ -822,206 +2041,790 @@ int qcdgridPutFile(char *pfn, char *lfn, char *permissions)
      */
 
     size = getFileLength(pfn);
-    logMessage(1, "Computing checksum");
-    computeMd5Checksum(pfn, md5);
-    for (i = 0; i < 16; i++)
+    getPutChecksum(pfn, hexBuffer);
+    time(&now);
+
+    tmpDN = substituteChars(DN, space, plus);
+
+    //replace spaces in DN by +
+    if(safe_asprintf(&msgBuffer, "putFile %s %s %s %lld %s %ld %s", 
+		     lfn, group, permissions, size, hexBuffer, 
+		     now, tmpDN) < 0)
+    {
+      errorExit("Out of memory in qcdgridPutFile");
+    }
+    globus_libc_free(tmpDN);
+    globus_libc_free(group);
+    globus_libc_free(DN);
+
+    if (sendMessageToMainNode(msgBuffer) == 0)
+    {
+      errorExit("Could not contact control thread");
+    }
+
+    /* Tell main node to check this machine for new files */
+
+    if (safe_asprintf(&msgBuffer, "check %s", destination) < 0)
+    {
+	errorExit("Out of memory in qcdgridPutFile");
+    }
+    sendMessageToMainNode(msgBuffer);
+    globus_libc_free(msgBuffer);
+
+
+    logMessage(3, "Put file %s on grid", lfn);
+
+    /* Success! */
+    return 1;
+}
+
+/***********************************************************************
+*   int qcdgridModifyFile(char *pfn, char *lfn)
+*
+*   Modifies one file on the data grid
+*    
+*   Parameters:                                      [I/O]
+*
+*     pfn    Physical filename of file on local disk  I
+*     lfn    Logical name of file on grid             I
+*    
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+int qcdgridModifyFile(char *pfn, char *lfn)
+{
+    char *DN;
+    int i;
+    FILE *f;
+    int success = 0;
+    char **list;
+    char *destination;
+    time_t now;
+    long long size;
+    char hexBuffer[40];
+    char *msgBuffer;
+
+    logMessage(1, "qcdgridModifyFile(%s,%s)", pfn, lfn);
+
+    
+    /* Check with replica catalogue that file already exists */
+    if (!fileInCollection(lfn))
+    {
+	logMessage(5, "Logical file %s does not exist on grid", lfn);
+	return 0;
+    }
+
+    logMessage(1, "Trying to get the DN of the user");
+    if (getUserIdentity(&DN) == 0)
+    {
+	logMessage(5, "Error obtaining user identity");
+	return 0;
+    }
+
+    if (canAddFile(DN) == 0)
+    {
+	globus_libc_free(DN);
+	logMessage(5, "User %s is not allowed to add to the grid", DN);
+	return 0;
+    }
+    globus_libc_free(DN);
+    
+    /* Check to make sure we can read the source file */
+    f = fopen(pfn, "rb");
+    if (!f)
+    {
+	logMessage(5, "Unable to open file %s", pfn);
+	return 0;
+    }
+    fclose(f);
+
+    /* First find a suitable storage element for the file to go to */
+    list = getSuitableNodeForPrimary(getFileLength(pfn));
+    if (list == NULL) 
+    {
+	logMessage(5, "No place to put modified file on grid");
+	return 0;
+    }
+
+    i = 0;
+
+    /*
+     * Loop over all possible destinations until we find one that works
+     */
+    while ((!success) && (list[i] != NULL))
+    {
+	destination = list[i];
+
+	logMessage(1, "Trying destination: %s", destination);
+	
+	i++;
+
+	if (!copyToSEInbox(pfn, destination, lfn, hexBuffer))
+	{
+	    logMessage(3, "Error copying file to storage element %s; trying another node",
+		       destination);
+	    continue;
+	}
+
+	success = 1;
+    }
+    globus_libc_free(list);
+
+    if (!success)
     {
-      sprintf(&hexBuffer[i*2], "%02X", md5[i]);
+	logMessage(5, "Could not modify file %s", lfn);
+	return 0;
     }
+
+    size = getFileLength(pfn);
+    getPutChecksum(pfn, hexBuffer);
     time(&now);
 
-    tmpDN = substituteChars(DN, space, plus);
+    if (safe_asprintf(&msgBuffer, "modify %s %s %s %lld %d", lfn,
+		      destination, hexBuffer, size, now) < 0)
+    {
+	errorExit("Out of memory in qcdgridModifyFile");
+    }
+
+    if (sendMessageToMainNode(msgBuffer) == 0)
+    {
+	errorExit("Could not contact control thread");
+    }
+    globus_libc_free(msgBuffer);
+
+    /* Tell main node to check this machine for new files */
+
+    if (safe_asprintf(&msgBuffer, "check %s", destination) < 0)
+    {
+	errorExit("Out of memory in qcdgridPutFile");
+    }
+    sendMessageToMainNode(msgBuffer);
+    globus_libc_free(msgBuffer);
+
+    logMessage(3, "Put file %s on grid", lfn);
+    
+    return 1;
+}
+
+/*=====================================================================
+ *
+ * Putting many files at once
+ *
+ *===================================================================*/
+/*
+ * qcdgridPutFiles keeps up to PUT_MAX_IN_FLIGHT copies to inboxes going
+ * at once, and no more than a node's 'putsinflight' property (default
+ * PUT_NODE_IN_FLIGHT) to any one node
+ */
+#define PUT_MAX_IN_FLIGHT 16
+#define PUT_NODE_IN_FLIGHT 4
+
+/* States of a putJob_t */
+enum { PUT_QUEUED, PUT_COPYING, PUT_COPIED, PUT_DONE, PUT_FAILED };
+
+/*
+ * A node files are being put to by qcdgridPutFiles
+ */
+typedef struct putNode_s {
+    char *name;                  /* points into the node table        */
+    struct storageElement *se;
+    int maxInFlight;
+    int inFlight;
+    long long assigned;          /* bytes sent or being sent to it    */
+    int numCopied;               /* files copied but not registered   */
+    int *copied;                 /* their indices in the job list     */
+} putNode_t;
+
+/*
+ * One file being put by qcdgridPutFiles
+ */
+typedef struct putJob_s {
+    char *pfn;
+    char *lfn;
+    long long size;
+    char **candidates;           /* from getSuitableNodeForPrimary    */
+    char *tried;                 /* nonzero for candidates given up on */
+    putNode_t *node;             /* node it is being copied to        */
+    int handle;
+    int attempt;                 /* failed attempts on that node      */
+    transferWatchdog_t watchdog;
+    int state;
+    char md5sum[CHECKSUM_LENGTH + 1];
+} putJob_t;
+
+/***********************************************************************
+*   putNode_t *findPutNode(putNode_t **nodes, int *numNodes, char *name)
+*
+*   Finds a node in qcdgridPutFiles' list of nodes, adding it if it's
+*   not there yet
+*    
+*   Parameters:                                      [I/O]
+*
+*     nodes     the list of nodes                     I/O
+*     numNodes  the number of nodes on the list       I/O
+*     name      FQDN of the node                       I
+*    
+*   Returns: the node, or NULL if it has no storage element
+***********************************************************************/
+static putNode_t *findPutNode(putNode_t **nodes, int *numNodes, char *name)
+{
+    putNode_t *pn;
+    char *prop;
+    int i;
+
+    for (i = 0; i < *numNodes; i++)
+    {
+	if (!strcmp((*nodes)[i].name, name))
+	{
+	    return &(*nodes)[i];
+	}
+    }
+
+    /* the node table has a fixed number of entries for the whole put */
+    if (*nodes == NULL)
+    {
+	*nodes = globus_libc_malloc(getNumNodes() * sizeof(putNode_t));
+	if (!*nodes)
+	{
+	    errorExit("Out of memory in findPutNode");
+	}
+    }
+    if (*numNodes >= getNumNodes())
+    {
+	return NULL;
+    }
+
+    pn = &(*nodes)[*numNodes];
+    pn->se = getNode(name);
+    if (!pn->se)
+    {
+	logMessage(ERROR, "Cannot find node %s", name);
+	return NULL;
+    }
+    pn->name = name;
+    pn->maxInFlight = PUT_NODE_IN_FLIGHT;
+    prop = getNodeProperty(name, "putsinflight");
+    if (prop)
+    {
+	if (atoi(prop) > 0)
+	{
+	    pn->maxInFlight = atoi(prop);
+	}
+	globus_libc_free(prop);
+    }
+    pn->inFlight = 0;
+    pn->assigned = 0;
+    pn->numCopied = 0;
+    pn->copied = NULL;
+    (*numNodes)++;
+    return pn;
+}
+
+/***********************************************************************
+*   int choosePutNode(putJob_t *job, putNode_t **nodes, int *numNodes,
+*                     putNode_t **chosen)
+*
+*   Picks the node to copy a file to: of the candidates not yet given up
+*   on, the one with the least data already sent to it in this put that
+*   still has room for the file
+*    
+*   Parameters:                                      [I/O]
+*
+*     job       the file to place                      I/O
+*     nodes     qcdgridPutFiles' list of nodes         I/O
+*     numNodes  the number of nodes on the list        I/O
+*     chosen    receives the node, or NULL if all the     O
+*               suitable ones are busy
+*    
+*   Returns: 1 if a node was chosen or all are busy, 0 if no candidate
+*            is left to try
+***********************************************************************/
+static int choosePutNode(putJob_t *job, putNode_t **nodes, int *numNodes,
+			 putNode_t **chosen)
+{
+    putNode_t *pn;
+    int remaining = 0;
+    int i;
+
+    *chosen = NULL;
+    for (i = 0; job->candidates[i] != NULL; i++)
+    {
+	if (job->tried[i])
+	{
+	    continue;
+	}
+	pn = findPutNode(nodes, numNodes, job->candidates[i]);
+	if ((!pn) ||
+	    ((getNodeDiskSpace(pn->name) * 1024) - pn->assigned <= job->size))
+	{
+	    job->tried[i] = 1;
+	    continue;
+	}
+	remaining = 1;
+
+	if (pn->inFlight >= pn->maxInFlight)
+	{
+	    continue;
+	}
+	if ((*chosen == NULL) || (pn->assigned < (*chosen)->assigned))
+	{
+	    *chosen = pn;
+	}
+    }
+    return remaining;
+}
+
+/***********************************************************************
+*   void giveUpPutNode(putJob_t *job)
+*
+*   Stops a file from being tried on the node it was last copied to
+*    
+*   Parameters:                                      [I/O]
+*
+*     job  the file                                   I/O
+*    
+*   Returns: (void)
+***********************************************************************/
+static void giveUpPutNode(putJob_t *job)
+{
+    int i;
+
+    for (i = 0; job->candidates[i] != NULL; i++)
+    {
+	if (!strcmp(job->candidates[i], job->node->name))
+	{
+	    job->tried[i] = 1;
+	}
+    }
+    job->attempt = 0;
+}
+
+/***********************************************************************
+*   void finishPutCopy(putJob_t *job, int succeeded)
+*
+*   Records the end of a copy to an inbox. A failed copy is tried again
+*   on the same node up to the node's number of transfer attempts, then
+*   on the other candidates
+*    
+*   Parameters:                                      [I/O]
+*
+*     job        the file                             I/O
+*     succeeded  whether the copy worked               I
+*    
+*   Returns: (void)
+***********************************************************************/
+static void finishPutCopy(putJob_t *job, int succeeded)
+{
+    putNode_t *pn = job->node;
+
+    pn->inFlight--;
+    if (succeeded)
+    {
+	job->state = PUT_COPIED;
+	return;
+    }
+
+    pn->assigned -= job->size;
+    job->attempt++;
+    if (job->attempt >= getNodeTransferAttempts(pn->name))
+    {
+	logMessage(3, "Error copying %s to storage element %s; trying another node",
+		   job->pfn, pn->name);
+	giveUpPutNode(job);
+    }
+    else
+    {
+	logMessage(WARN, "Retrying copy of %s to inbox on %s (attempt %d of %d)",
+		   job->pfn, pn->name, job->attempt + 1,
+		   getNodeTransferAttempts(pn->name));
+    }
+    job->state = PUT_QUEUED;
+}
+
+/***********************************************************************
+*   void registerPutFiles(putNode_t *pn, putJob_t *jobs, char *group,
+*                         char *permissions, char *DN)
+*
+*   Tells the control thread about the files copied to a node's inbox,
+*   as few putFiles messages as they fit in, then forgets them
+*    
+*   Parameters:                                      [I/O]
+*
+*     pn           the node                           I/O
+*     jobs         qcdgridPutFiles' list of files     I/O
+*     group        group the files belong to           I
+*     permissions  'public' or 'private'               I
+*     DN           subject of the submitter            I
+*    
+*   Returns: (void)
+***********************************************************************/
+static void registerPutFiles(putNode_t *pn, putJob_t *jobs, char *group,
+			     char *permissions, char *DN)
+{
+    char *msgBuffer;
+    char *tmpDN;
+    int len, headerLen, start, end;
+    time_t now;
+    putJob_t *job;
+    int i;
 
-    //replace spaces in DN by +
-    if(safe_asprintf(&msgBuffer, "putFile %s %s %s %lld %s %ld %s", 
-		     lfn, group, permissions, size, hexBuffer, 
-		     now, tmpDN) < 0)
+    if (pn->numCopied == 0)
     {
-      errorExit("Out of memory in qcdgridPutFile");
+	return;
     }
-    globus_libc_free(tmpDN);
-    globus_libc_free(group);
-    globus_libc_free(DN);
 
-    if (sendMessageToMainNode(msgBuffer) == 0)
+    msgBuffer = globus_libc_malloc(MAX_MESSAGE_LENGTH);
+    if (!msgBuffer)
     {
-      errorExit("Could not contact control thread");
+	errorExit("Out of memory in registerPutFiles");
     }
 
-    /* Tell main node to check this machine for new files */
+    //replace spaces in DN by +
+    tmpDN = substituteChars(DN, " ", "+");
+    time(&now);
+    headerLen = snprintf(msgBuffer, MAX_MESSAGE_LENGTH, "putFiles %s %s %s %ld %s",
+			 pn->name, group, permissions, (long) now, tmpDN);
+    globus_libc_free(tmpDN);
 
-    if (safe_asprintf(&msgBuffer, "check %s", destination) < 0)
+    for (start = 0; start < pn->numCopied; start = end)
     {
-	errorExit("Out of memory in qcdgridPutFile");
-    }
-    sendMessageToMainNode(msgBuffer);
-    globus_libc_free(msgBuffer);
+	len = headerLen;
+	for (end = start; (end < pn->numCopied) &&
+		 (end - start < MAX_PUT_BATCH_FILES); end++)
+	{
+	    job = &jobs[pn->copied[end]];
+	    if (len + strlen(job->lfn) + 60 >= MAX_MESSAGE_LENGTH)
+	    {
+		break;
+	    }
+	    len += sprintf(&msgBuffer[len], " %s %lld %s", job->lfn,
+			   job->size, job->md5sum);
+	}
+	if (end == start)
+	{
+	    /* a single name too long to send */
+	    jobs[pn->copied[end]].state = PUT_FAILED;
+	    end++;
+	    continue;
+	}
 
+	if (sendMessageToMainNode(msgBuffer) == 0)
+	{
+	    logMessage(5, "Could not contact control thread");
+	    for (i = start; i < end; i++)
+	    {
+		jobs[pn->copied[i]].state = PUT_FAILED;
+	    }
+	    continue;
+	}
 
-    logMessage(3, "Put file %s on grid", lfn);
+	for (i = start; i < end; i++)
+	{
+	    job = &jobs[pn->copied[i]];
+	    job->state = PUT_DONE;
+	    logMessage(3, "Put file %s on grid", job->lfn);
+	}
+    }
 
-    /* Success! */
-    return 1;
+    globus_libc_free(msgBuffer);
+    globus_libc_free(pn->copied);
+    pn->copied = NULL;
+    pn->numCopied = 0;
 }
 
 /***********************************************************************
-*   int qcdgridModifyFile(char *pfn, char *lfn)
+*   int qcdgridPutFiles(int count, char **pfns, char **lfns,
+*                       char *permissions, int *results)
 *
-*   Modifies one file on the data grid
+*   Puts several files onto the data grid at once. The files are copied
+*   to the inboxes of the suitable nodes in parallel, each going to the
+*   node with the least data sent to it so far, and registered with the
+*   control thread in batches
 *    
 *   Parameters:                                      [I/O]
 *
-*     pfn    Physical filename of file on local disk  I
-*     lfn    Logical name of file on grid             I
+*     count        number of files                     I
+*     pfns         physical filenames on local disk    I
+*     lfns         logical names for files on grid     I
+*     permissions  'public' or 'private'               I
+*     results      receives 1 for each file put, 0       O
+*                  for each one that failed
 *    
-*   Returns: 1 on success, 0 on failure
+*   Returns: 1 if every file was put, 0 otherwise
 ***********************************************************************/
-int qcdgridModifyFile(char *pfn, char *lfn)
+int qcdgridPutFiles(int count, char **pfns, char **lfns, char *permissions,
+		    int *results)
 {
-    char *DN;
-    int i;
+    char *DN, *group;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    putJob_t *jobs;
+    putJob_t *job;
+    putNode_t *nodes = NULL;
+    putNode_t *pn;
+    int numNodes = 0;
+    int inFlight = 0;
+    int active;
+    int waitFrom = 0;
+    int numCandidates;
+    digs_error_code_t result;
+    digs_transfer_status_t status;
+    int percentComplete;
     FILE *f;
-    int success = 0;
-    char **list;
-    char *destination;
-    time_t now;
-    long long size;
-    unsigned char md5[16];
-    char hexBuffer[40];
-    char *msgBuffer;
+    int allOK = 1;
+    int i;
 
-    logMessage(1, "qcdgridModifyFile(%s,%s)", pfn, lfn);
+    logMessage(1, "qcdgridPutFiles(%d files)", count);
 
-    
-    /* Check with replica catalogue that file already exists */
-    if (!fileInCollection(lfn))
+    for (i = 0; i < count; i++)
     {
-	logMessage(5, "Logical file %s does not exist on grid", lfn);
-	return 0;
+	results[i] = 0;
     }
 
-    logMessage(1, "Trying to get the DN of the user");
-    if (getUserIdentity(&DN) == 0)
+    if (!getPutIdentity(&DN, &group))
     {
-	logMessage(5, "Error obtaining user identity");
 	return 0;
     }
 
-    if (canAddFile(DN) == 0)
-    {
-	globus_libc_free(DN);
-	logMessage(5, "User %s is not allowed to add to the grid", DN);
-	return 0;
-    }
-    globus_libc_free(DN);
-    
-    /* Check to make sure we can read the source file */
-    f = fopen(pfn, "rb");
-    if (!f)
-    {
-	logMessage(5, "Unable to open file %s", pfn);
-	return 0;
-    }
-    fclose(f);
+    /* Pull up-to-date space free values from main node */
+    updateNodeDiskSpace();
 
-    /* First find a suitable storage element for the file to go to */
-    list = getSuitableNodeForPrimary(getFileLength(pfn));
-    if (list == NULL) 
+    jobs = globus_libc_malloc(count * sizeof(putJob_t));
+    if ((!jobs) && (count > 0))
     {
-	logMessage(5, "No place to put modified file on grid");
-	return 0;
+	errorExit("Out of memory in qcdgridPutFiles");
     }
 
-    i = 0;
-
-    /*
-     * Loop over all possible destinations until we find one that works
-     */
-    while ((!success) && (list[i] != NULL))
+    for (i = 0; i < count; i++)
     {
-	destination = list[i];
+	job = &jobs[i];
+	job->pfn = pfns[i];
+	job->lfn = lfns[i];
+	job->candidates = NULL;
+	job->tried = NULL;
+	job->node = NULL;
+	job->attempt = 0;
+	job->state = PUT_FAILED;
 
-	logMessage(1, "Trying destination: %s", destination);
-	
-	i++;
+	/* Check to make sure we can read the source file */
+	f = fopen(pfns[i], "rb");
+	if (!f)
+	{
+	    logMessage(5, "Unable to open file %s", pfns[i]);
+	    continue;
+	}
+	fclose(f);
 
-	if (!copyToSEInbox(pfn, destination, lfn))
+	/* Check with replica catalogue that file doesn't already exist */
+	if (fileInCollection(lfns[i]))
 	{
-	    logMessage(3, "Error copying file to storage element %s; trying another node",
-		       destination);
+	    logMessage(5, "Logical file %s already exists on grid", lfns[i]);
 	    continue;
 	}
 
-	success = 1;
+	job->size = getFileLength(pfns[i]);
+	job->candidates = getSuitableNodeForPrimary(job->size);
+	if (job->candidates == NULL)
+	{
+	    logMessage(5, "No place to put file %s on grid", lfns[i]);
+	    continue;
+	}
+	for (numCandidates = 0; job->candidates[numCandidates] != NULL;
+	     numCandidates++);
+	job->tried = globus_libc_malloc(numCandidates + 1);
+	if (!job->tried)
+	{
+	    errorExit("Out of memory in qcdgridPutFiles");
+	}
+	memset(job->tried, 0, numCandidates + 1);
+	job->state = PUT_QUEUED;
     }
-    globus_libc_free(list);
 
-    if (!success)
+    do
     {
-	logMessage(5, "Could not modify file %s", lfn);
-	return 0;
-    }
+	active = 0;
 
-    size = getFileLength(pfn);
-    logMessage(1, "Computing checksum");
-    computeMd5Checksum(pfn, md5);
-    for (i = 0; i < 16; i++)
-    {
-	sprintf(&hexBuffer[i*2], "%02X", md5[i]);
-    }
-    time(&now);
+	/* Start copies while there's room */
+	for (i = 0; (i < count) && (inFlight < PUT_MAX_IN_FLIGHT); i++)
+	{
+	    job = &jobs[i];
+	    if (job->state != PUT_QUEUED)
+	    {
+		continue;
+	    }
+	    if (!choosePutNode(job, &nodes, &numNodes, &pn))
+	    {
+		logMessage(5, "Could not put file %s on grid", job->lfn);
+		job->state = PUT_FAILED;
+		continue;
+	    }
+	    if (pn == NULL)
+	    {
+		/* all its nodes are busy */
+		continue;
+	    }
 
-    if (safe_asprintf(&msgBuffer, "modify %s %s %s %lld %d", lfn,
-		      destination, hexBuffer, size, now) < 0)
+	    logMessage(4, "%s -> %s on %s", job->pfn, job->lfn, pn->name);
+	    job->node = pn;
+	    result = pn->se->digs_startCopyToInbox(errbuf, pn->name, job->pfn,
+						   job->lfn, &job->handle);
+	    if (result != DIGS_SUCCESS)
+	    {
+		logMessage((result == DIGS_NO_INBOX) ? INFO : ERROR,
+			   "Error starting copy to inbox on %s: %s (%s)", pn->name,
+			   digsErrorToString(result), errbuf);
+		giveUpPutNode(job);
+		continue;
+	    }
+	    job->state = PUT_COPYING;
+	    startTransferWatchdog(&job->watchdog, pn->se, pn->name, job->handle,
+				  job->size);
+	    pn->inFlight++;
+	    pn->assigned += job->size;
+	    inFlight++;
+	}
+
+	/* See how the copies are getting on */
+	for (i = 0; i < count; i++)
+	{
+	    job = &jobs[i];
+	    if (job->state == PUT_QUEUED)
+	    {
+		active = 1;
+	    }
+	    if (job->state != PUT_COPYING)
+	    {
+		continue;
+	    }
+	    active = 1;
+
+	    pn = job->node;
+	    result = pn->se->digs_monitorTransfer(errbuf, job->handle, &status,
+						  &percentComplete);
+	    if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED))
+	    {
+		logMessage(ERROR, "Error in put transfer to %s: %s (%s)", pn->name,
+			   digsErrorToString(result), errbuf);
+		pn->se->digs_endTransfer(errbuf, job->handle);
+		finishPutCopy(job, 0);
+		inFlight--;
+	    }
+	    else if (status == DIGS_TRANSFER_DONE)
+	    {
+		getSentChecksum(pn->se, job->handle, job->md5sum);
+		result = pn->se->digs_endTransfer(errbuf, job->handle);
+		if (result != DIGS_SUCCESS)
+		{
+		    logMessage(ERROR, "Error in end transfer to %s: %s (%s)", pn->name,
+			       digsErrorToString(result), errbuf);
+		}
+		else
+		{
+		    getPutChecksum(job->pfn, job->md5sum);
+		}
+		finishPutCopy(job, (result == DIGS_SUCCESS));
+		inFlight--;
+
+		if (job->state == PUT_COPIED)
+		{
+		    pn->copied = globus_libc_realloc(pn->copied,
+						     (pn->numCopied + 1) * sizeof(int));
+		    if (!pn->copied)
+		    {
+			errorExit("Out of memory in qcdgridPutFiles");
+		    }
+		    pn->copied[pn->numCopied++] = i;
+		    if (pn->numCopied >= MAX_PUT_BATCH_FILES)
+		    {
+			registerPutFiles(pn, jobs, group, permissions, DN);
+		    }
+		}
+	    }
+	    else if (!checkTransferWatchdog(&job->watchdog, status, percentComplete))
+	    {
+		logMessage(ERROR, "Giving up on put transfer of %s to %s", job->pfn,
+			   pn->name);
+		pn->se->digs_cancelTransfer(errbuf, job->handle);
+		finishPutCopy(job, 0);
+		inFlight--;
+	    }
+	}
+
+	/* Sleep until one of the copies finishes, taking turns between them */
+	if (inFlight > 0)
+	{
+	    for (i = 0; i < count; i++)
+	    {
+		job = &jobs[(waitFrom + i) % count];
+		if (job->state == PUT_COPYING)
+		{
+		    waitFrom = (waitFrom + i + 1) % count;
+		    waitForTransfer(job->node->se, job->handle, 1.0);
+		    break;
+		}
+	    }
+	}
+    } while (active);
+
+    /* Register what's left */
+    for (i = 0; i < numNodes; i++)
     {
-	errorExit("Out of memory in qcdgridModifyFile");
+	registerPutFiles(&nodes[i], jobs, group, permissions, DN);
     }
 
-    if (sendMessageToMainNode(msgBuffer) == 0)
+    /* Tell main node to check the nodes for new files */
+    for (i = 0; i < count; i++)
     {
-	errorExit("Could not contact control thread");
+	job = &jobs[i];
+	results[i] = (job->state == PUT_DONE);
+	if (!results[i])
+	{
+	    allOK = 0;
+	}
+	if (job->candidates)
+	{
+	    globus_libc_free(job->candidates);
+	}
+	if (job->tried)
+	{
+	    globus_libc_free(job->tried);
+	}
     }
-    globus_libc_free(msgBuffer);
-
-    /* Tell main node to check this machine for new files */
 
-    if (safe_asprintf(&msgBuffer, "check %s", destination) < 0)
+    globus_libc_free(jobs);
+    if (nodes)
     {
-	errorExit("Out of memory in qcdgridPutFile");
+	globus_libc_free(nodes);
     }
-    sendMessageToMainNode(msgBuffer);
-    globus_libc_free(msgBuffer);
+    globus_libc_free(group);
+    globus_libc_free(DN);
 
-    logMessage(3, "Put file %s on grid", lfn);
-    
-    return 1;
+    return allOK;
 }
 
 /***********************************************************************
-*   int qcdgridPutDirectory(char *pfn, char *lfn);
+*   int collectPutDirectory(char *pfn, char *lfn, int *count,
+*                           int *space, char ***pfns, char ***lfns)
 *
-*   Puts a whole directory of files onto the grid, including any in
-*   subdirectories. Logical filename structure on the grid is the same
-*   as physical directory structure on disk.
+*   Lists all the files in a local directory and its subdirectories,
+*   along with the logical names they will have on the grid
 *    
-*   Parameters:                                    [I/O]
+*   Parameters:                                      [I/O]
 *
-*     pfn  Physical filename of file on local disk  I
-*     lfn  Logical name for file on grid            I
+*     pfn    Physical name of the directory          I
+*     lfn    Logical name for it on grid             I
+*     count  Number of files on the lists            I/O
+*     space  Number of entries allocated             I/O
+*     pfns   Physical filenames                      I/O
+*     lfns   Logical filenames                       I/O
 *    
-*   Returns: 1 on success, 0 on failure
+*   Returns: 1 on success, 0 if a directory couldn't be read
 ***********************************************************************/
-int qcdgridPutDirectory(char *pfn, char *lfn, char *permissions)
+static int collectPutDirectory(char *pfn, char *lfn, int *count, int *space,
+			       char ***pfns, char ***lfns)
 {
-    /* Need to recursively loop over all files within the directory, in case
-     * any of them are sub-directories. In this case the logical filenames
-     * on the grid will have the same directory structure as the physical
-     * filenames on disk */
     struct dirent *entry;
     DIR *dir;
     char *newlfn, *newpfn;
-
-    logMessage(1, "qcdgridPutDirectory(%s,%s)", pfn, lfn);
+    int result = 1;
 
     /* Open directory */
     dir = opendir(pfn);
@@ -1036,61 +2839,121 @@ int qcdgridPutDirectory(char *pfn, char *lfn, char *permissions)
 
     while (entry)
     {
+	/* Don't want to call recursively on '.' and '..' or we'll be in
+	 * trouble... */
+	if (entry->d_name[0] == '.')
+	{
+	    entry = readdir(dir);
+	    continue;
+	}
+
 	/* Work out new logical and physical filenames */
 	if (safe_asprintf(&newlfn, "%s/%s", lfn, entry->d_name) < 0)
 	{
-	    errorExit("Out of memory in qcdgridPutDirectory");
+	    errorExit("Out of memory in collectPutDirectory");
 	}
 	if (safe_asprintf(&newpfn, "%s/%s", pfn, entry->d_name) < 0)
 	{
-	    errorExit("Out of memory in qcdgridPutDirectory");
+	    errorExit("Out of memory in collectPutDirectory");
 	}
 
-	/* Don't want to call recursively on '.' and '..' or we'll be in
-	 * trouble... */
-	if (entry->d_name[0] != '.')
-	{
-	    /* Find out if this is a subdirectory. Have to use 'stat' -
-	     * checking the entry->d_type field doesn't seem to work on
-	     * trumpton */
-	    struct stat statbuf;
+	/* Find out if this is a subdirectory. Have to use 'stat' -
+	 * checking the entry->d_type field doesn't seem to work on
+	 * trumpton */
+	struct stat statbuf;
 
-	    stat(newpfn, &statbuf);
+	stat(newpfn, &statbuf);
 
-	    /* Handle a subdirectory */
-	    if (S_ISDIR(statbuf.st_mode))
+	if (S_ISDIR(statbuf.st_mode))
+	{
+	    /* NOTE: readdir returns a pointer to a statically allocated
+	     * buffer, so we mustn't rely on entry pointing to the same
+	     * thing when the recursive call returns */
+	    if (!collectPutDirectory(newpfn, newlfn, count, space, pfns, lfns))
 	    {
-		/* and call self recursively. */
-		/* NOTE: readdir returns a pointer to a statically allocated
-		 * buffer, so we mustn't rely on entry pointing to the same
-		 * thing when the recursive call returns */
-		if (!qcdgridPutDirectory(newpfn, newlfn, permissions))
-		{
-		    closedir(dir);
-		    globus_libc_free(newpfn);
-		    globus_libc_free(newlfn);
-		    return 0;
-		}
+		result = 0;
 	    }
-	    else
+	    globus_libc_free(newpfn);
+	    globus_libc_free(newlfn);
+	}
+	else
+	{
+	    if (*count >= *space)
 	    {
-		/* Handle a regular file - just put it on the grid */
-		logMessage(4, "%s -> %s", newpfn, newlfn);
-		if (!qcdgridPutFile(newpfn, newlfn, permissions))
+		*space = (*space * 2) + 64;
+		*pfns = globus_libc_realloc(*pfns, *space * sizeof(char *));
+		*lfns = globus_libc_realloc(*lfns, *space * sizeof(char *));
+		if ((!*pfns) || (!*lfns))
 		{
-		    logMessage(5, "Error processing file %s", newpfn);
+		    errorExit("Out of memory in collectPutDirectory");
 		}
-		/* Pull up-to-date space free values from main node */
-		updateNodeDiskSpace();
 	    }
+	    (*pfns)[*count] = newpfn;
+	    (*lfns)[*count] = newlfn;
+	    (*count)++;
 	}
-	globus_libc_free(newpfn);
-	globus_libc_free(newlfn);
 	entry = readdir(dir);
     }
     
     closedir(dir);
-    return 1;
+    return result;
+}
+
+/***********************************************************************
+*   int qcdgridPutDirectory(char *pfn, char *lfn);
+*
+*   Puts a whole directory of files onto the grid, including any in
+*   subdirectories. Logical filename structure on the grid is the same
+*   as physical directory structure on disk. The files are put together
+*   by qcdgridPutFiles
+*    
+*   Parameters:                                    [I/O]
+*
+*     pfn  Physical filename of file on local disk  I
+*     lfn  Logical name for file on grid            I
+*    
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+int qcdgridPutDirectory(char *pfn, char *lfn, char *permissions)
+{
+    char **pfns = NULL;
+    char **lfns = NULL;
+    int *results;
+    int count = 0;
+    int space = 0;
+    int result;
+    int i;
+
+    logMessage(1, "qcdgridPutDirectory(%s,%s)", pfn, lfn);
+
+    result = collectPutDirectory(pfn, lfn, &count, &space, &pfns, &lfns);
+    if (count == 0)
+    {
+	return result;
+    }
+
+    results = globus_libc_malloc(count * sizeof(int));
+    if (!results)
+    {
+	errorExit("Out of memory in qcdgridPutDirectory");
+    }
+
+    qcdgridPutFiles(count, pfns, lfns, permissions, results);
+
+    for (i = 0; i < count; i++)
+    {
+	if (!results[i])
+	{
+	    logMessage(5, "Error processing file %s", pfns[i]);
+	}
+	globus_libc_free(pfns[i]);
+	globus_libc_free(lfns[i]);
+    }
+    globus_libc_free(pfns);
+    globus_libc_free(lfns);
+    globus_libc_free(results);
+
+    return result;
 }
 
 /*=====================================================================
@@ -153,7 +153,7 @@ static int correctFileCopy(char *fromNode, char *toNode, char *lfn)
 	return 0;
     }
 
-    if (!copyToLocal(fromNode, srcname, tmpname))
+    if (!copyToLocal(fromNode, srcname, tmpname, NULL))
     {
 	globus_libc_fprintf(stderr, "Error copying %s from %s\n", lfn, fromNode);
 	globus_libc_free(srcname);
@@ -163,7 +163,7 @@ static int correctFileCopy(char *fromNode, char *toNode, char *lfn)
 	return 0;
     }
 
-    if (!copyFromLocal(tmpname, toNode, destname))
+    if (!copyFromLocal(tmpname, toNode, destname, NULL))
     {
 	globus_libc_fprintf(stderr, "Error copying %s to %s\n", lfn, toNode);
 	globus_libc_free(srcname);
@@ -0,0 +1,184 @@
+/***********************************************************************
+*
+*   Filename:   digs-repqueue.c
+*
+*   Authors:    DiGS developers        (digs)     EPCC.
+*
+*   Purpose:    Implementation of command line utility to inspect and
+*               manage the control thread's replication queue
+*
+*   Contents:   Main function
+*
+*   Used in:    System administration of DiGS
+*
+*   Contact:    epcc-support@epcc.ed.ac.uk
+*
+*   Copyright (c) 2026 The University of Edinburgh
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of the
+*   License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful, but
+*   WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*   General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program; if not, write to the Free Software
+*   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+*   MA 02111-1307, USA.
+*
+*   As a special exception, you may link this program with code
+*   developed by the OGSA-DAI project without such code being covered
+*   by the GNU General Public License.
+*
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <globus_common.h>
+
+#include "qcdgrid-client.h"
+#include "repqueue.h"
+#include "node.h"
+#include "misc.h"
+
+/*
+ * Returns a printable name for a replication stage
+ */
+static char *stageName(int stage)
+{
+  switch (stage) {
+  case REPSTAGE_WAITING:
+    return "waiting";
+  case REPSTAGE_GETTING:
+    return "getting";
+  case REPSTAGE_WAITING2:
+    return "fetched";
+  case REPSTAGE_PUTTING:
+    return "putting";
+  case REPSTAGE_RELAYING:
+    return "relaying";
+  case REPSTAGE_DONE:
+    return "done";
+  case REPSTAGE_DELETEME:
+    return "finished";
+  }
+  return "error";
+}
+
+/*
+ * Copies the saved replication queue from the control node and prints
+ * it, one replication per line
+ */
+static int printReplicationQueue()
+{
+  char *tmpFile;
+  FILE *f;
+  char *lineBuffer = NULL;
+  int lineBufferSize = 0;
+  int id, reason, priority, stage, numCopies, lfnPos;
+  char from[256], to[256], dir[256], temp[1024];
+
+  tmpFile = getTemporaryFile();
+  if (!tmpFile) {
+    globus_libc_fprintf(stderr, "Error creating temporary file\n");
+    return 0;
+  }
+
+  if (!qcdgridGetReplicationQueue(tmpFile)) {
+    globus_libc_fprintf(stderr, "Error fetching replication queue from control node\n");
+    unlink(tmpFile);
+    globus_libc_free(tmpFile);
+    return 0;
+  }
+
+  f = fopen(tmpFile, "r");
+  if (!f) {
+    globus_libc_fprintf(stderr, "Error opening %s\n", tmpFile);
+    unlink(tmpFile);
+    globus_libc_free(tmpFile);
+    return 0;
+  }
+
+  globus_libc_printf("%6s %4s %-9s %-9s %-30s %-30s %s\n", "ID", "PRIO", "REASON",
+		     "STAGE", "FROM", "TO", "FILE");
+
+  safe_getline(&lineBuffer, &lineBufferSize, f);
+  while (!feof(f)) {
+    removeCrlf(lineBuffer);
+    lfnPos = 0;
+    if ((sscanf(lineBuffer, "R %d %d %d %d %d %255s %255s %255s %1023s %n", &id,
+		&reason, &priority, &stage, &numCopies, from, to, dir, temp,
+		&lfnPos) == 9) && (lfnPos > 0)) {
+      globus_libc_printf("%6d %4d %-9s %-9s %-30s %-30s %s\n", id, priority,
+			 (reason == REPTYPE_REQUESTED) ? "requested" : "copies",
+			 stageName(stage), from, to, &lineBuffer[lfnPos]);
+    }
+    safe_getline(&lineBuffer, &lineBufferSize, f);
+  }
+
+  if (lineBuffer) {
+    globus_libc_free(lineBuffer);
+  }
+  fclose(f);
+  unlink(tmpFile);
+  globus_libc_free(tmpFile);
+  return 1;
+}
+
+/***********************************************************************
+*   int main(int argc, char *argv[])
+*
+*   Main entry point of digs-repqueue executable. With no arguments,
+*   prints the control thread's replication queue. Otherwise sends a
+*   message to the main node to reprioritise or cancel a replication
+*
+*   Parameters:                                            [I/O]
+*
+*     (optional) "-p <id> <priority>" to change the         I
+*                priority of a replication
+*     (optional) "-c <id>" to cancel a replication          I
+*
+*   Returns: 0 on success, 1 on error
+***********************************************************************/
+int main(int argc, char *argv[])
+{
+  char *usage = "Usage: digs-repqueue [-p <id> <priority>] [-c <id>]\n";
+
+  if ((argc != 1) &&
+      (!((argc == 4) && (!strcmp(argv[1], "-p")))) &&
+      (!((argc == 3) && (!strcmp(argv[1], "-c"))))) {
+    globus_libc_printf(usage);
+    return 1;
+  }
+
+  if (!qcdgridInit(0)) {
+    globus_libc_fprintf(stderr, "Error loading grid config\n");
+    return 1;
+  }
+  atexit(qcdgridShutdown);
+
+  if (argc == 1) {
+    if (!printReplicationQueue()) {
+      return 1;
+    }
+  }
+  else if (argc == 4) {
+    if (!qcdgridSetReplicationPriority(atoi(argv[2]), atoi(argv[3]))) {
+      return 1;
+    }
+  }
+  else {
+    if (!qcdgridCancelReplication(atoi(argv[2]))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
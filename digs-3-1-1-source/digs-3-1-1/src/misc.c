@@ -69,6 +69,8 @@
 
 #include "misc.h"
 #include "node.h"
+#include "gridftp-common.h"
+#include "local.h"
 #include "job.h"
 #include "replica.h"
 #include "config.h"
@@ -728,6 +730,97 @@ char *digsErrorToString(digs_error_code_t digsErrorCode){
 	}
 }
 
+/*
+ * Delay before the first retry of a failed transfer, in seconds. Each
+ * later retry waits twice as long as the one before, up to
+ * TRANSFER_RETRY_MAX_DELAY
+ */
+#define TRANSFER_RETRY_DELAY 2
+#define TRANSFER_RETRY_MAX_DELAY 30
+
+/***********************************************************************
+ *   int waitToRetryTransfer(digs_error_code_t error, int attempt)
+ *
+ *   Decides whether a transfer that failed is worth trying again. Only
+ *   failures to reach the node (DIGS_NO_RESPONSE, DIGS_NO_CONNECTION)
+ *   are; anything else would just fail the same way again. If it is
+ *   worth it, waits a little before returning, longer after each
+ *   failed attempt
+ *    
+ *   Parameters:                                                 [I/O]
+ *
+ *     error     What the failed attempt returned                 I
+ *     attempt   Number of the attempt that failed, from 1        I
+ *    
+ *   Returns: 1 if the transfer should be tried again, 0 if not
+ ***********************************************************************/
+int waitToRetryTransfer(digs_error_code_t error, int attempt)
+{
+    int delay;
+
+    if ((error != DIGS_NO_RESPONSE) && (error != DIGS_NO_CONNECTION))
+    {
+	return 0;
+    }
+
+    delay = TRANSFER_RETRY_DELAY;
+    while ((attempt > 1) && (delay < TRANSFER_RETRY_MAX_DELAY))
+    {
+	delay *= 2;
+	attempt--;
+    }
+    if (delay > TRANSFER_RETRY_MAX_DELAY)
+    {
+	delay = TRANSFER_RETRY_MAX_DELAY;
+    }
+
+    globus_libc_usleep(delay * 1000000);
+    return 1;
+}
+
+/***********************************************************************
+ *   void digs_initStat(digs_stat_t *stat)
+ *
+ *   Sets every field of a stat structure to its "not known" value
+ *    
+ *   Parameters:                                                 [I/O]
+ *
+ *     stat   the structure to initialise                         O
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void digs_initStat(digs_stat_t *stat)
+{
+    stat->isDirectory = 0;
+    stat->size = -1;
+    stat->modificationTime = 0;
+    stat->owner = NULL;
+    stat->group = NULL;
+    stat->permissions = NULL;
+    stat->checksum = NULL;
+    stat->checksumType = DIGS_MD5_CHECKSUM;
+}
+
+/***********************************************************************
+ *   void digs_freeStat(digs_stat_t *stat)
+ *
+ *   Frees the strings held by a stat structure and resets it
+ *    
+ *   Parameters:                                                 [I/O]
+ *
+ *     stat   the structure to free                               I/O
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void digs_freeStat(digs_stat_t *stat)
+{
+    if (stat->owner) globus_libc_free(stat->owner);
+    if (stat->group) globus_libc_free(stat->group);
+    if (stat->permissions) globus_libc_free(stat->permissions);
+    if (stat->checksum) globus_libc_free(stat->checksum);
+    digs_initStat(stat);
+}
+
 /***********************************************************************
 *   void convertToLowerCase(char string[])
 *    
@@ -1005,6 +1098,18 @@ int qcdgridInit(int secondaryOK)
 	return 0;
     }
 
+    if (!startupReplicationSystem())
+    {
+	logMessage(4, "Cannot initialise transfer handles");
+	return 0;
+    }
+
+    if (!startupLocalStorage())
+    {
+	logMessage(4, "Cannot initialise local storage");
+	return 0;
+    }
+
     if (!getNodeInfo(secondaryOK))
     {
 	logMessage(4, "Cannot read node config");
@@ -1099,6 +1204,12 @@ int sendMessageToMainNode(char *msg)
     
     logMessage(1, "sendMessageToMainNode(%s)", msg);
 
+    if (strlen(msg) >= MAX_MESSAGE_LENGTH)
+    {
+	logMessage(5, "Message too long for main node (%d bytes)", (int) strlen(msg));
+	return 0;
+    }
+
     hostname = getMainNodeName();
 
     if (globus_io_secure_authorization_data_initialize(&authData)
@@ -1344,7 +1455,8 @@ int isValidChecksum(char *chksum)
 *   int verifyGroupAndPermissionsWithRLS(char *node, char *pfn)
 *
 *   Verifies (and changes if necessary) that remote copy of a file have
-*   correct file permissions and owner and group
+*   correct file permissions and owner and group. Both are read with one
+*   digs_stat, and only what is wrong is changed
 *    
 *   Parameters:                                            [I/O]
 *     node  FQDN of node holding copy of file               I
@@ -1360,7 +1472,9 @@ int verifyGroupAndPermissionsWithRLS(char *node, char *lfn, char *pfn)
     char errbuf[MAX_ERROR_MESSAGE_LENGTH];
     struct storageElement *se;
     digs_error_code_t result;
+    digs_stat_t fileStat;
     char *perms;
+    int permsOK, groupOK;
 
     se = getNode(node);
     if (!se)
@@ -1390,24 +1504,48 @@ int verifyGroupAndPermissionsWithRLS(char *node, char *lfn, char *pfn)
         perms = "0644";  
     }
 
-    result = se->digs_setPermissions(errbuf, pfn, node, perms);
-    if (result != DIGS_SUCCESS)
+    /* Anything the node can't report is set anyway */
+    permsOK = 0;
+    groupOK = 0;
+    result = se->digs_stat(errbuf, pfn, node, &fileStat);
+    if (result == DIGS_SUCCESS)
     {
-	logMessage(5, "Error running digs_setPermissions on %s: %s (%s)",
-		   node, digsErrorToString(result), errbuf);
-	globus_libc_free(RLSgroup);
-	globus_libc_free(RLSpermissions);
-	return 0;
+	permsOK = ((fileStat.permissions) &&
+		   ((strtol(fileStat.permissions, NULL, 8) & 0777) ==
+		    strtol(perms, NULL, 8)));
+	groupOK = ((fileStat.group) && (!strcmp(fileStat.group, RLSgroup)));
+	digs_freeStat(&fileStat);
+    }
+    else
+    {
+	logMessage(3, "Error running digs_stat on %s: %s (%s)", node,
+		   digsErrorToString(result), errbuf);
     }
 
-    result = se->digs_setGroup(errbuf, pfn, node, RLSgroup);
-    if (result != DIGS_SUCCESS)
+    if (!permsOK)
     {
-	logMessage(5, "Error running digs_setGroup on %s: %s (%s)",
-		   node, digsErrorToString(result), errbuf);
-	globus_libc_free(RLSgroup);
-	globus_libc_free(RLSpermissions);
-	return 0;
+	result = se->digs_setPermissions(errbuf, pfn, node, perms);
+	if (result != DIGS_SUCCESS)
+	{
+	    logMessage(5, "Error running digs_setPermissions on %s: %s (%s)",
+		       node, digsErrorToString(result), errbuf);
+	    globus_libc_free(RLSgroup);
+	    globus_libc_free(RLSpermissions);
+	    return 0;
+	}
+    }
+
+    if (!groupOK)
+    {
+	result = se->digs_setGroup(errbuf, pfn, node, RLSgroup);
+	if (result != DIGS_SUCCESS)
+	{
+	    logMessage(5, "Error running digs_setGroup on %s: %s (%s)",
+		       node, digsErrorToString(result), errbuf);
+	    globus_libc_free(RLSgroup);
+	    globus_libc_free(RLSpermissions);
+	    return 0;
+	}
     }
 
     globus_libc_free(RLSgroup);
@@ -1418,43 +1556,25 @@ int verifyGroupAndPermissionsWithRLS(char *node, char *lfn, char *pfn)
 }
 
 /***********************************************************************
-*   int verifyMD5SumWithRLS(char *node, char *lfn, char *pfn)
+*   int compareChecksumWithRLS(char *node, char *lfn, char *pfn,
+*                              char *remoteChecksum)
 *
-*   Verifies that remote copy of a file have correct checksum
+*   Compares the checksum of a remote copy of a file with the one
+*   recorded in the replica catalogue
 *    
 *   Parameters:                                            [I/O]
-*     node  FQDN of node holding copy of file               I
-*     lfn   The logical file name                           I
-*     pfn   Name of file on node                            I
+*     node            FQDN of node holding copy of file     I
+*     lfn             The logical file name                 I
+*     pfn             Name of file on node                  I
+*     remoteChecksum  checksum of the copy on the node      I
 *    
 *   Returns: 1 if checksum matches, 0 if not, -1 if error occurred
 ***********************************************************************/
-int verifyMD5SumWithRLS(char *node, char *lfn, char *pfn)
+int compareChecksumWithRLS(char *node, char *lfn, char *pfn,
+			   char *remoteChecksum)
 {
-    char *remoteChecksum;
     char *RLSchecksum;
 
-    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
-    struct storageElement *se;
-    digs_error_code_t result;
-
-    logMessage(1, "verifyMD5SumWithRLS(%s,%s,%s)", node, lfn, pfn);
-
-    se = getNode(node);
-    if (!se)
-    {
-	logMessage(5, "Error getting SE structure for node %s", node);
-	return -1;
-    }
-    result = se->digs_getChecksum(errbuf, pfn, node, &remoteChecksum,
-				  DIGS_MD5_CHECKSUM);
-    if (result != DIGS_SUCCESS)
-    {
-	logMessage(5, "Error running digs_getChecksum on %s: %s (%s)",
-		   node, digsErrorToString(result), errbuf);
-	return -1;
-    }
-
     // now get the md5sum from RLS and compare
 
     if(!getAttrValueFromRLS(lfn, "md5sum", &RLSchecksum))
@@ -1467,31 +1587,74 @@ int verifyMD5SumWithRLS(char *node, char *lfn, char *pfn)
     {
 	logMessage(3, "Invalid remote checksum '%s' returned from (%s,%s)",
 		   remoteChecksum, node, pfn);
+	globus_libc_free(RLSchecksum);
 	return -1;
     }
     if (!isValidChecksum(RLSchecksum))
     {
 	logMessage(3, "Invalid RLS checksum '%s' returned from (%s,%s)",
 		   RLSchecksum, node, pfn);
+	globus_libc_free(RLSchecksum);
 	return -1;
     }
 
     if (!strcasecmp(remoteChecksum, RLSchecksum))
     {
 	logMessage(1, "Checksums match");
-	se->digs_free_string(&remoteChecksum);
 	globus_libc_free(RLSchecksum);
 	return 1;
     }
     else
     {
 	logMessage(1, "Checksums differ");
-	se->digs_free_string(&remoteChecksum);
 	globus_libc_free(RLSchecksum);
 	return 0;
     }
 }
 
+/***********************************************************************
+*   int verifyMD5SumWithRLS(char *node, char *lfn, char *pfn)
+*
+*   Verifies that remote copy of a file have correct checksum
+*    
+*   Parameters:                                            [I/O]
+*     node  FQDN of node holding copy of file               I
+*     lfn   The logical file name                           I
+*     pfn   Name of file on node                            I
+*    
+*   Returns: 1 if checksum matches, 0 if not, -1 if error occurred
+***********************************************************************/
+int verifyMD5SumWithRLS(char *node, char *lfn, char *pfn)
+{
+    char *remoteChecksum;
+
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    struct storageElement *se;
+    digs_error_code_t result;
+    int match;
+
+    logMessage(1, "verifyMD5SumWithRLS(%s,%s,%s)", node, lfn, pfn);
+
+    se = getNode(node);
+    if (!se)
+    {
+	logMessage(5, "Error getting SE structure for node %s", node);
+	return -1;
+    }
+    result = se->digs_getChecksum(errbuf, pfn, node, &remoteChecksum,
+				  DIGS_MD5_CHECKSUM);
+    if (result != DIGS_SUCCESS)
+    {
+	logMessage(5, "Error running digs_getChecksum on %s: %s (%s)",
+		   node, digsErrorToString(result), errbuf);
+	return -1;
+    }
+
+    match = compareChecksumWithRLS(node, lfn, pfn, remoteChecksum);
+    se->digs_free_string(&remoteChecksum);
+    return match;
+}
+
 
 /***********************************************************************
 *   int chmodRemotely(char *permissions, char *pfn, char *node)
@@ -2338,97 +2501,157 @@ int forEachFileInDirectory(char *ldn, int (*callback)(char *lfn, void *param),
 
 
 /***********************************************************************
-*   int copyToLocal(char *remoteHost, char *remoteFile, char *localFile)
+*   digs_error_code_t tryCopyToLocal(struct storageElement *se,
+*                      char *remoteHost, char *remoteFile,
+*                      char *localFile, double *rate)
 *
-*   Copies a file to the local file system from a remote host using
-*   GridFTP
+*   Makes one attempt at copying a file to the local file system from a
+*   remote host. The copy is given up on if it stalls (see
+*   startTransferWatchdog)
 *    
 *   Parameters:                                                     [I/O]
 *
-*     remoteHost  FQDN of host to copy to                            I
+*     se          Storage element of the remote host                 I
+*     remoteHost  FQDN of host to copy from                          I
 *     remoteFile  Full pathname to file on remote machine            I
 *     localFile   Full pathname to file on local machine             I
+*     rate        Receives the copy's rate in bytes per second, 0     O
+*                 if not known. May be NULL
 *    
-*   Returns: 1 on success, 0 on error
+*   Returns: DIGS_SUCCESS, or the DiGS error code the copy failed with.
+*            A copy given up on because it stalled is DIGS_NO_RESPONSE
 ***********************************************************************/
-int copyToLocal(char *remoteHost, char *remoteFile, char *localFile)
+static digs_error_code_t tryCopyToLocal(struct storageElement *se,
+					char *remoteHost, char *remoteFile,
+					char *localFile, double *rate)
 {
-  struct storageElement *se;
   int handle;
-  time_t startTime, endTime;
   char errbuf[MAX_ERROR_MESSAGE_LENGTH];
   digs_error_code_t result;
-  float timeout;
+  transferWatchdog_t watchdog;
   int percentComplete;
   digs_transfer_status_t status;
 
-  se = getNode(remoteHost);
-  if (!se) {
-    logMessage(ERROR, "Cannot find node %s", remoteHost);
-    return 0;
-  }
-
   result = se->digs_startGetTransfer(errbuf, remoteHost, remoteFile,
 				     localFile, &handle);
   if (result != DIGS_SUCCESS) {
     logMessage(ERROR, "Error starting get transfer from %s: %s (%s)", remoteHost,
 	       digsErrorToString(result), errbuf);
-    return 0;
+    return result;
   }
 
-  timeout = getNodeCopyTimeout(remoteHost);
-
-  startTime = time(NULL);
-  do {
+  startTransferWatchdog(&watchdog, se, remoteHost, handle, -1);
+  while (1) {
     result = se->digs_monitorTransfer(errbuf, handle, &status, &percentComplete);
     if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED)) {
       logMessage(ERROR, "Error in get transfer from %s: %s (%s)", remoteHost,
 		 digsErrorToString(result), errbuf);
       se->digs_endTransfer(errbuf, handle);
-      return 0;
+      return (result != DIGS_SUCCESS) ? result : DIGS_UNKNOWN_ERROR;
+    }
+    if (!checkTransferWatchdog(&watchdog, status, percentComplete)) {
+      logMessage(ERROR, "Giving up on get transfer from %s", remoteHost);
+      se->digs_cancelTransfer(errbuf, handle);
+      return DIGS_NO_RESPONSE;
     }
     if (status == DIGS_TRANSFER_DONE) {
       break;
     }
 
-    globus_libc_usleep(1000);
+    waitForTransfer(se, handle, 1.0);
+  }
 
-    endTime = time(NULL);
-  } while (difftime(endTime, startTime) < timeout);
+  if (rate) {
+    *rate = getTransferWatchdogRate(&watchdog);
+  }
 
   result = se->digs_endTransfer(errbuf, handle);
   if (result != DIGS_SUCCESS) {
     logMessage(ERROR, "Error in end transfer from %s: %s (%s)", remoteHost,
 	       digsErrorToString(result), errbuf);
+    return result;
+  }
+
+  return DIGS_SUCCESS;
+}
+
+
+/***********************************************************************
+*   int copyToLocal(char *remoteHost, char *remoteFile, char *localFile,
+*                   double *rate)
+*
+*   Copies a file to the local file system from a remote host using
+*   GridFTP. A copy that fails because the node couldn't be reached is
+*   tried again after a short wait (see waitToRetryTransfer), up to the
+*   node's number of transfer attempts, carrying on from what was
+*   already fetched
+*    
+*   Parameters:                                                     [I/O]
+*
+*     remoteHost  FQDN of host to copy from                          I
+*     remoteFile  Full pathname to file on remote machine            I
+*     localFile   Full pathname to file on local machine             I
+*     rate        Receives the successful attempt's rate in bytes     O
+*                 per second, 0 if not known. May be NULL
+*    
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+int copyToLocal(char *remoteHost, char *remoteFile, char *localFile,
+		double *rate)
+{
+  struct storageElement *se;
+  digs_error_code_t result;
+  int attempt, attempts;
+
+  se = getNode(remoteHost);
+  if (!se) {
+    logMessage(ERROR, "Cannot find node %s", remoteHost);
     return 0;
   }
 
-  return 1;
+  attempts = getNodeTransferAttempts(remoteHost);
+  for (attempt = 1; attempt <= attempts; attempt++) {
+    result = tryCopyToLocal(se, remoteHost, remoteFile, localFile, rate);
+    if (result == DIGS_SUCCESS) {
+      return 1;
+    }
+    if ((attempt >= attempts) || (!waitToRetryTransfer(result, attempt))) {
+      break;
+    }
+    logMessage(WARN, "Retrying get of %s from %s (attempt %d of %d)",
+	       remoteFile, remoteHost, attempt + 1, attempts);
+  }
+
+  return 0;
 }
 
 
 /***********************************************************************
-*   int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile)
+*   int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile,
+*                     double *rate)
 *
 *   Copies a file from the local file system to a remote host using
-*   GridFTP, synchronously
+*   GridFTP, synchronously. The copy is given up on if it stalls (see
+*   startTransferWatchdog)
 *    
 *   Parameters:                                                     [I/O]
 *
 *     localFile   Full pathname to file on local machine             I
 *     remoteHost  FQDN of host to copy to                            I
 *     remoteFile  Full pathname to file on remote machine            I
+*     rate        Receives the copy's rate in bytes per second, 0     O
+*                 if not known. May be NULL
 *    
 *   Returns: 1 on success, 0 on error
 ***********************************************************************/
-int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile)
+int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile,
+		  double *rate)
 {
   struct storageElement *se;
   int handle;
-  time_t startTime, endTime;
   char errbuf[MAX_ERROR_MESSAGE_LENGTH];
   digs_error_code_t result;
-  float timeout;
+  transferWatchdog_t watchdog;
   int percentComplete;
   digs_transfer_status_t status;
 
@@ -2446,10 +2669,9 @@ int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile)
     return 0;
   }
 
-  timeout = getNodeCopyTimeout(remoteHost);
-
-  startTime = time(NULL);
-  do {
+  startTransferWatchdog(&watchdog, se, remoteHost, handle,
+			getFileLength(localFile));
+  while (1) {
     result = se->digs_monitorTransfer(errbuf, handle, &status, &percentComplete);
     if ((result != DIGS_SUCCESS) || (status == DIGS_TRANSFER_FAILED)) {
       logMessage(ERROR, "Error in put transfer to %s: %s (%s)", remoteHost,
@@ -2457,14 +2679,21 @@ int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile)
       se->digs_endTransfer(errbuf, handle);
       return 0;
     }
+    if (!checkTransferWatchdog(&watchdog, status, percentComplete)) {
+      logMessage(ERROR, "Giving up on put transfer to %s", remoteHost);
+      se->digs_cancelTransfer(errbuf, handle);
+      return 0;
+    }
     if (status == DIGS_TRANSFER_DONE) {
       break;
     }
 
-    globus_libc_usleep(1000);
+    waitForTransfer(se, handle, 1.0);
+  }
 
-    endTime = time(NULL);
-  } while (difftime(endTime, startTime) < timeout);
+  if (rate) {
+    *rate = getTransferWatchdogRate(&watchdog);
+  }
 
   result = se->digs_endTransfer(errbuf, handle);
   if (result != DIGS_SUCCESS) {
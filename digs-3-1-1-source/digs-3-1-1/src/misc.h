@@ -45,6 +45,13 @@
 #define CHECKSUM_LENGTH 32
 #define MAX_PERMISSIONS_LENGTH 32
 
+/*
+ * Longest message the control thread accepts, including the terminating
+ * NUL, and the most files a single putFiles message may register
+ */
+#define MAX_MESSAGE_LENGTH 16384
+#define MAX_PUT_BATCH_FILES 100
+
 /* Need time_t definition */
 #include <sys/stat.h>
 
@@ -114,6 +121,29 @@ typedef enum
   DIGS_TRANSFER_CLEANUP		/* Post-transfer cleanup */
 } digs_transfer_status_t;
 
+/*
+ * Everything a storage element can report about one file from a single
+ * query (see digs_stat). Strings belong to the structure and are freed
+ * by digs_freeStat
+ */
+typedef struct
+{
+  int isDirectory;                    /* 1 for a directory, else 0 */
+  long long int size;                 /* in bytes, -1 if not known */
+  time_t modificationTime;            /* 0 if not known */
+  char *owner;                        /* as digs_getOwner, NULL if not known */
+  char *group;                        /* as digs_getGroup, NULL if not known */
+  char *permissions;                  /* as digs_getPermissions, NULL if not known */
+  char *checksum;                     /* uppercase hex, NULL if the SE doesn't keep one */
+  digs_checksum_type_t checksumType;  /* type of checksum, if there is one */
+} digs_stat_t;
+
+/*
+ * Called by the streaming node scans (digs_scanNodeStream) once for each
+ * file found. Return 1 to carry on, or 0 to stop the scan early
+ */
+typedef int (*digs_scan_callback_t)(const char *filePath, void *userData);
+
 int safe_asprintf(char **ptr, const char *templ, ...);
 int safe_getline (char **lineptr, int *n, FILE *stream);
 char *safe_strdup(const char *str);
@@ -173,6 +203,50 @@ void removeCrlf(char *str);
  ***********************************************************************/
 char *digsErrorToString(digs_error_code_t digsErrorCode);
 
+/***********************************************************************
+ *   int waitToRetryTransfer(digs_error_code_t error, int attempt)
+ *
+ *   Decides whether a transfer that failed is worth trying again. Only
+ *   failures to reach the node (DIGS_NO_RESPONSE, DIGS_NO_CONNECTION)
+ *   are; anything else would just fail the same way again. If it is
+ *   worth it, waits a little before returning, longer after each
+ *   failed attempt
+ *    
+ *   Parameters:                                                 [I/O]
+ *
+ *     error     What the failed attempt returned                 I
+ *     attempt   Number of the attempt that failed, from 1        I
+ *    
+ *   Returns: 1 if the transfer should be tried again, 0 if not
+ ***********************************************************************/
+int waitToRetryTransfer(digs_error_code_t error, int attempt);
+
+/***********************************************************************
+ *   void digs_initStat(digs_stat_t *stat)
+ *
+ *   Sets every field of a stat structure to its "not known" value
+ *    
+ *   Parameters:                                                 [I/O]
+ *
+ *     stat   the structure to initialise                         O
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void digs_initStat(digs_stat_t *stat);
+
+/***********************************************************************
+ *   void digs_freeStat(digs_stat_t *stat)
+ *
+ *   Frees the strings held by a stat structure and resets it
+ *    
+ *   Parameters:                                                 [I/O]
+ *
+ *     stat   the structure to free                               I/O
+ *    
+ *   Returns: (void)
+ ***********************************************************************/
+void digs_freeStat(digs_stat_t *stat);
+
 /*
  * Returns the length of a local file in bytes, given either a full or a
  * relative path to it. Returns -1 on error
@@ -235,6 +309,13 @@ void getChecksum(const char *filePath, char **returnChecksum);
  */
 int verifyMD5SumWithRLS(char *node, char *lfn, char *pfn);
 
+/*
+ * Checks if a checksum already obtained for a copy of a file matches
+ * the entry in RLS
+ */
+int compareChecksumWithRLS(char *node, char *lfn, char *pfn,
+			   char *remoteChecksum);
+
 /*
  * Checks if a group and permissions of a copy of a file matche entry in RLS
  * if not, they get changed on the file
@@ -300,9 +381,11 @@ int forEachFileInDirectory(char *ldn, int (*callback)(char *lfn, void *param),
 			   void *cbparam);
 
 
-int copyToLocal(char *remoteHost, char *remoteFile, char *localFile);
+int copyToLocal(char *remoteHost, char *remoteFile, char *localFile,
+		double *rate);
 
-int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile);
+int copyFromLocal(char *localFile, char *remoteHost, char *remoteFile,
+		  double *rate);
 
 
 #endif
@@ -47,6 +47,7 @@
 #include "replica.h"
 #include "config.h"
 #include "gridftp.h"
+#include "local.h"
 
 #ifdef OMERO
 #include "omero.h"
@@ -81,6 +82,14 @@ char *tmpDir_=NULL;
 int locationWeight_;
 int spaceWeight_;
 
+/*
+ * A transfer that moves less than STALL_MIN_RATE bytes per second for
+ * STALL_PERIOD seconds is given up on. Can be changed per node with the
+ * 'stallrate' (in KB/s) and 'stallperiod' properties
+ */
+#define STALL_MIN_RATE 10240.0
+#define STALL_PERIOD 120.0
+
 /***********************************************************************
 *   int copyFromControlNode(char *remoteFile, char *localFile)
 *    
@@ -97,7 +106,7 @@ int spaceWeight_;
 ***********************************************************************/
 static int copyFromControlNode(char *remoteFile, char *localFile)
 {
-  int handle;
+  int handle, completed;
   time_t startTime, endTime;
   char errbuf[MAX_ERROR_MESSAGE_LENGTH];
   digs_error_code_t result;
@@ -128,7 +137,7 @@ static int copyFromControlNode(char *remoteFile, char *localFile)
       break;
     }
 
-    globus_libc_usleep(1000);
+    digs_waitForTransfers_globus(errbuf, &handle, 1, 1.0, &completed);
 
     endTime = time(NULL);
   } while (difftime(endTime, startTime) < timeout);
@@ -311,6 +320,9 @@ nodeList_t *retiringList_ = NULL;
 void initSEtoGlobus(struct storageElement *se) {
 	se->digs_getLength = digs_getLength_globus;
 	se->digs_getChecksum = digs_getChecksum_globus;
+	se->digs_startChecksum = digs_startChecksum_globus;
+	se->digs_monitorChecksum = digs_monitorChecksum_globus;
+	se->digs_endChecksum = digs_endChecksum_globus;
 	se->digs_doesExist = digs_doesExist_globus;
 	se->digs_isDirectory = digs_isDirectory_globus;
 	se->digs_free_string = digs_free_string_globus;
@@ -320,12 +332,23 @@ void initSEtoGlobus(struct storageElement *se) {
 	se->digs_getPermissions = digs_getPermissions_globus;
 	se->digs_setPermissions = digs_setPermissions_globus;
 	se->digs_getModificationTime = digs_getModificationTime_globus;
+	se->digs_stat = digs_stat_globus;
+	se->digs_statMany = digs_statMany_globus;
 	se->digs_startPutTransfer = digs_startPutTransfer_globus;
+	se->digs_startPutTransfers = NULL;
 	se->digs_startCopyToInbox = digs_startCopyToInbox_globus;
 	se->digs_monitorTransfer = digs_monitorTransfer_globus;
+	se->digs_getTransferProgress = digs_getTransferProgress_globus;
+	se->digs_waitForTransfers = digs_waitForTransfers_globus;
 	se->digs_endTransfer = digs_endTransfer_globus;
 	se->digs_cancelTransfer = digs_cancelTransfer_globus;
 	se->digs_startGetTransfer = digs_startGetTransfer_globus;
+	se->digs_startGetTransfers = NULL;
+	se->digs_startGetRangeTransfer = digs_startGetRangeTransfer_globus;
+	se->digs_getTransferChecksum = digs_getTransferChecksum_globus;
+	se->digs_startRelayTransfer = digs_startRelayTransfer_globus;
+	se->digs_startPeerRelayTransfer = NULL;
+	se->digs_getRelayURL = digs_getRelayURL_globus;
 	se->digs_mkdir = digs_mkdir_globus;
 	se->digs_mkdirtree = digs_mkdirtree_globus;
 	se->digs_mv = digs_mv_globus;
@@ -334,6 +357,7 @@ void initSEtoGlobus(struct storageElement *se) {
 	se->digs_rmr = digs_rmr_globus;
 	se->digs_copyFromInbox = digs_copyFromInbox_globus;
 	se->digs_scanNode = digs_scanNode_globus;
+	se->digs_scanNodeStream = digs_scanNodeStream_globus;
 	se->digs_scanInbox = digs_scanInbox_globus;
 	se->digs_free_string_array = digs_free_string_array_globus;
 	se->digs_ping = digs_ping_globus;
@@ -344,6 +368,9 @@ void initSEtoSRM(struct storageElement *se) {
 #ifdef WITH_SRM
 	se->digs_getLength = digs_getLength_srm;
 	se->digs_getChecksum = digs_getChecksum_srm;
+	se->digs_startChecksum = NULL;
+	se->digs_monitorChecksum = NULL;
+	se->digs_endChecksum = NULL;
 	se->digs_doesExist = digs_doesExist_srm;
 	se->digs_isDirectory = digs_isDirectory_srm;
 	se->digs_free_string = digs_free_string_srm;
@@ -353,12 +380,23 @@ void initSEtoSRM(struct storageElement *se) {
 	se->digs_getPermissions = digs_getPermissions_srm;
 	se->digs_setPermissions = digs_setPermissions_srm;
 	se->digs_getModificationTime = digs_getModificationTime_srm;
+	se->digs_stat = digs_stat_srm;
+	se->digs_statMany = digs_statMany_srm;
 	se->digs_startPutTransfer = digs_startPutTransfer_srm;
+	se->digs_startPutTransfers = digs_startPutTransfers_srm;
 	se->digs_startCopyToInbox = digs_startCopyToInbox_srm;
 	se->digs_monitorTransfer = digs_monitorTransfer_srm;
+	se->digs_getTransferProgress = digs_getTransferProgress_srm;
+	se->digs_waitForTransfers = digs_waitForTransfers_srm;
 	se->digs_endTransfer = digs_endTransfer_srm;
 	se->digs_cancelTransfer = digs_cancelTransfer_srm;
 	se->digs_startGetTransfer = digs_startGetTransfer_srm;
+	se->digs_startGetTransfers = digs_startGetTransfers_srm;
+	se->digs_startGetRangeTransfer = digs_startGetRangeTransfer_srm;
+	se->digs_getTransferChecksum = digs_getTransferChecksum_srm;
+	se->digs_startRelayTransfer = NULL;
+	se->digs_startPeerRelayTransfer = digs_startPeerRelayTransfer_srm;
+	se->digs_getRelayURL = NULL;
 	se->digs_mkdir = digs_mkdir_srm;
 	se->digs_mkdirtree = digs_mkdirtree_srm;
 	se->digs_mv = digs_mv_srm;
@@ -367,6 +405,7 @@ void initSEtoSRM(struct storageElement *se) {
 	se->digs_rmr = digs_rmr_srm;
 	se->digs_copyFromInbox = digs_copyFromInbox_srm;
 	se->digs_scanNode = digs_scanNode_srm;
+	se->digs_scanNodeStream = digs_scanNodeStream_srm;
 	se->digs_scanInbox = digs_scanInbox_srm;
 	se->digs_free_string_array = digs_free_string_array_srm;
 	se->digs_ping = digs_ping_srm;
@@ -377,10 +416,60 @@ void initSEtoSRM(struct storageElement *se) {
 #endif
 }
 
+void initSEtoLocal(struct storageElement *se) {
+	se->digs_getLength = digs_getLength_local;
+	se->digs_getChecksum = digs_getChecksum_local;
+	se->digs_startChecksum = digs_startChecksum_local;
+	se->digs_monitorChecksum = digs_monitorChecksum_local;
+	se->digs_endChecksum = digs_endChecksum_local;
+	se->digs_doesExist = digs_doesExist_local;
+	se->digs_isDirectory = digs_isDirectory_local;
+	se->digs_free_string = digs_free_string_local;
+	se->digs_getOwner = digs_getOwner_local;
+	se->digs_getGroup = digs_getGroup_local;
+	se->digs_setGroup = digs_setGroup_local;
+	se->digs_getPermissions = digs_getPermissions_local;
+	se->digs_setPermissions = digs_setPermissions_local;
+	se->digs_getModificationTime = digs_getModificationTime_local;
+	se->digs_stat = digs_stat_local;
+	se->digs_statMany = digs_statMany_local;
+	se->digs_startPutTransfer = digs_startPutTransfer_local;
+	se->digs_startPutTransfers = NULL;
+	se->digs_startCopyToInbox = digs_startCopyToInbox_local;
+	se->digs_monitorTransfer = digs_monitorTransfer_local;
+	se->digs_getTransferProgress = digs_getTransferProgress_local;
+	se->digs_waitForTransfers = digs_waitForTransfers_local;
+	se->digs_endTransfer = digs_endTransfer_local;
+	se->digs_cancelTransfer = digs_cancelTransfer_local;
+	se->digs_startGetTransfer = digs_startGetTransfer_local;
+	se->digs_startGetTransfers = NULL;
+	se->digs_startGetRangeTransfer = NULL;
+	se->digs_getTransferChecksum = NULL;
+	se->digs_startRelayTransfer = digs_startRelayTransfer_local;
+	se->digs_startPeerRelayTransfer = NULL;
+	se->digs_getRelayURL = digs_getRelayURL_local;
+	se->digs_mkdir = digs_mkdir_local;
+	se->digs_mkdirtree = digs_mkdirtree_local;
+	se->digs_mv = digs_mv_local;
+	se->digs_rm = digs_rm_local;
+	se->digs_rmdir = digs_rmdir_local;
+	se->digs_rmr = digs_rmr_local;
+	se->digs_copyFromInbox = digs_copyFromInbox_local;
+	se->digs_scanNode = digs_scanNode_local;
+	se->digs_scanNodeStream = digs_scanNodeStream_local;
+	se->digs_scanInbox = digs_scanInbox_local;
+	se->digs_free_string_array = digs_free_string_array_local;
+	se->digs_ping = digs_ping_local;
+	se->digs_housekeeping = digs_housekeeping_local;
+}
+
 #ifdef OMERO
 void initSEtoOMERO(struct storageElement *se) {
 	se->digs_getLength = digs_getLength_omero;
 	se->digs_getChecksum = digs_getChecksum_omero;
+	se->digs_startChecksum = NULL;
+	se->digs_monitorChecksum = NULL;
+	se->digs_endChecksum = NULL;
 	se->digs_doesExist = digs_doesExist_omero;
 	se->digs_isDirectory = digs_isDirectory_omero;
 	se->digs_free_string = digs_free_string_omero;
@@ -390,12 +479,23 @@ void initSEtoOMERO(struct storageElement *se) {
 	se->digs_getPermissions = digs_getPermissions_omero;
 	se->digs_setPermissions = digs_setPermissions_omero;
 	se->digs_getModificationTime = digs_getModificationTime_omero;
+	se->digs_stat = digs_stat_omero;
+	se->digs_statMany = digs_statMany_omero;
 	se->digs_startPutTransfer = digs_startPutTransfer_omero;
+	se->digs_startPutTransfers = NULL;
 	se->digs_startCopyToInbox = digs_startCopyToInbox_omero;
 	se->digs_monitorTransfer = digs_monitorTransfer_omero;
+	se->digs_getTransferProgress = digs_getTransferProgress_omero;
+	se->digs_waitForTransfers = digs_waitForTransfers_omero;
 	se->digs_endTransfer = digs_endTransfer_omero;
 	se->digs_cancelTransfer = digs_cancelTransfer_omero;
 	se->digs_startGetTransfer = digs_startGetTransfer_omero;
+	se->digs_startGetTransfers = NULL;
+	se->digs_startGetRangeTransfer = NULL;
+	se->digs_getTransferChecksum = digs_getTransferChecksum_omero;
+	se->digs_startRelayTransfer = NULL;
+	se->digs_startPeerRelayTransfer = digs_startPeerRelayTransfer_omero;
+	se->digs_getRelayURL = NULL;
 	se->digs_mkdir = digs_mkdir_omero;
 	se->digs_mkdirtree = digs_mkdirtree_omero;
 	se->digs_mv = digs_mv_omero;
@@ -404,6 +504,7 @@ void initSEtoOMERO(struct storageElement *se) {
 	se->digs_rmr = digs_rmr_omero;
 	se->digs_copyFromInbox = digs_copyFromInbox_omero;
 	se->digs_scanNode = digs_scanNode_omero;
+	se->digs_scanNodeStream = NULL;
 	se->digs_scanInbox = digs_scanInbox_omero;
 	se->digs_free_string_array = digs_free_string_array_omero;
 	se->digs_ping = digs_ping_omero;
@@ -1044,6 +1145,446 @@ char *getNodeProperty(const char *node, char *prop)
     return lookupValueInHashTable(gridNodes_[i].properties, prop);
 }
 
+/***********************************************************************
+*   void waitForTransfer(struct storageElement *se, int handle,
+*                        float timeOut)
+*
+*   Sleeps until a transfer on a storage element finishes or the time
+*   out expires, whichever is sooner. Storage elements that cannot wait
+*   on a transfer are polled after a short sleep instead. The caller
+*   should check the transfer's status afterwards as usual
+*    
+*   Parameters:                                                    [I/O]
+*
+*     se       storage element the transfer is on                   I
+*     handle   the id of the transfer                               I
+*     timeOut  the longest time to wait, in seconds                 I
+*   
+*   Returns: (void)
+***********************************************************************/
+void waitForTransfer(struct storageElement *se, int handle, float timeOut)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    int completed;
+
+    if (se->digs_waitForTransfers == NULL)
+    {
+	globus_libc_usleep(1000);
+	return;
+    }
+
+    se->digs_waitForTransfers(errbuf, &handle, 1, timeOut, &completed);
+}
+
+/***********************************************************************
+*   void startTransferWatchdog(transferWatchdog_t *w,
+*                              struct storageElement *se, char *node,
+*                              int handle, long long size)
+*
+*   Starts keeping watch on a transfer that has just been started. The
+*   transfer is allowed the node's copy timeout to get going, plus as
+*   long as the whole file would take at the node's stall rate. Once
+*   data is moving it is also given up on if it runs below the stall
+*   rate for the node's stall period
+*    
+*   Parameters:                                                    [I/O]
+*
+*     w        the watchdog                                          O
+*     se       storage element the transfer is on                   I
+*     node     the node the transfer is to or from. Must outlive     I
+*              the watchdog
+*     handle   the id of the transfer                               I
+*     size     the file's length in bytes, or -1 if not known. With  I
+*              no size, only the stall rate bounds the transfer
+*              once it has got going
+*   
+*   Returns: (void)
+***********************************************************************/
+void startTransferWatchdog(transferWatchdog_t *w, struct storageElement *se,
+			   char *node, int handle, long long size)
+{
+    w->se = se;
+    w->node = node;
+    w->handle = handle;
+    w->size = size;
+    w->minRate = getNodeStallRate(node);
+    w->stallPeriod = getNodeStallPeriod(node);
+    w->deadline = getNodeCopyTimeout(node);
+    if (size > 0)
+    {
+	w->deadline += (float)((double)size / w->minRate);
+    }
+    w->started = time(NULL);
+    w->moving = 0;
+    w->bytes = 0;
+    w->numSamples = 0;
+    w->nextSample = 0;
+}
+
+/***********************************************************************
+*   void addWatchdogSample(transferWatchdog_t *w, time_t now)
+*
+*   Records how far the transfer had got at a time, overwriting the
+*   oldest record once the ring is full
+*    
+*   Parameters:                                                    [I/O]
+*
+*     w        the watchdog                                         I/O
+*     now      the current time                                     I
+*   
+*   Returns: (void)
+***********************************************************************/
+static void addWatchdogSample(transferWatchdog_t *w, time_t now)
+{
+    w->sampleTimes[w->nextSample] = now;
+    w->sampleBytes[w->nextSample] = w->bytes;
+    w->nextSample = (w->nextSample + 1) % WATCHDOG_SAMPLES;
+    if (w->numSamples < WATCHDOG_SAMPLES)
+    {
+	w->numSamples++;
+    }
+}
+
+/***********************************************************************
+*   int checkTransferWatchdog(transferWatchdog_t *w,
+*                             digs_transfer_status_t status,
+*                             int percentComplete)
+*
+*   Checks whether a transfer is getting on well enough to carry on
+*   with. Should be called each time the transfer is monitored, with
+*   what digs_monitorTransfer returned. Progress is taken from the
+*   storage element's byte count where it has one, otherwise worked out
+*   from the percentage. In that case the stall period is stretched to
+*   cover the time one percent of the file would take at the stall
+*   rate, so that a large file isn't given up on between steps
+*    
+*   Parameters:                                                    [I/O]
+*
+*     w                the watchdog                                 I/O
+*     status           the transfer's status                        I
+*     percentComplete  the transfer's percentage                    I
+*   
+*   Returns: 1 if the transfer should carry on, 0 if it has stalled or
+*            run out of time and should be given up on
+***********************************************************************/
+int checkTransferWatchdog(transferWatchdog_t *w, digs_transfer_status_t status,
+			  int percentComplete)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    time_t now;
+    float period, interval;
+    long long bytes;
+    double rate;
+    int i, j;
+
+    now = time(NULL);
+
+    period = w->stallPeriod;
+    if ((w->se->digs_getTransferProgress) &&
+	(w->se->digs_getTransferProgress(errbuf, w->handle, &bytes) == DIGS_SUCCESS))
+    {
+	if (bytes > w->bytes)
+	{
+	    w->bytes = bytes;
+	}
+    }
+    else if (w->size > 0)
+    {
+	w->bytes = (w->size * percentComplete) / 100;
+	if (period < (float)(((double)w->size / 100.0) / w->minRate))
+	{
+	    period = (float)(((double)w->size / 100.0) / w->minRate);
+	}
+    }
+    else
+    {
+	/* only a change of percentage counts as progress */
+	w->bytes = percentComplete;
+	w->minRate = 0.0;
+    }
+
+    if ((status == DIGS_TRANSFER_DONE) || (status == DIGS_TRANSFER_FAILED))
+    {
+	return 1;
+    }
+
+    if ((w->deadline > 0.0) &&
+	((w->moving == 0) || (w->size > 0)) &&
+	(difftime(now, w->started) > w->deadline))
+    {
+	logMessage(WARN, "Transfer %d with %s has not finished after %.0f seconds",
+		   w->handle, w->node, w->deadline);
+	return 0;
+    }
+
+    /* waiting for the storage element to get the file ready */
+    if ((status == DIGS_TRANSFER_IN_PREPARATION) ||
+	(status == DIGS_TRANSFER_PREPARATION_COMPLETE))
+    {
+	return 1;
+    }
+
+    if (w->moving == 0)
+    {
+	w->moving = now;
+	addWatchdogSample(w, now);
+	return 1;
+    }
+
+    /* keep enough samples to cover the period twice over */
+    interval = period / (float)(WATCHDOG_SAMPLES / 2);
+    if (interval < 1.0)
+    {
+	interval = 1.0;
+    }
+    j = (w->nextSample + WATCHDOG_SAMPLES - 1) % WATCHDOG_SAMPLES;
+    if (difftime(now, w->sampleTimes[j]) >= interval)
+    {
+	addWatchdogSample(w, now);
+    }
+
+    if (difftime(now, w->moving) < period)
+    {
+	return 1;
+    }
+
+    /* measure from the newest sample at least a period old */
+    for (i = 1; i <= w->numSamples; i++)
+    {
+	j = (w->nextSample + WATCHDOG_SAMPLES - i) % WATCHDOG_SAMPLES;
+	if (difftime(now, w->sampleTimes[j]) >= period)
+	{
+	    break;
+	}
+    }
+    if (i > w->numSamples)
+    {
+	return 1;
+    }
+
+    rate = (double)(w->bytes - w->sampleBytes[j]) /
+	difftime(now, w->sampleTimes[j]);
+    if ((w->bytes == w->sampleBytes[j]) || (rate < w->minRate))
+    {
+	logMessage(WARN, "Transfer %d with %s has stalled (%.0f bytes/s over "
+		   "the last %.0f seconds)", w->handle, w->node, rate,
+		   difftime(now, w->sampleTimes[j]));
+	return 0;
+    }
+    return 1;
+}
+
+/***********************************************************************
+*   double getTransferWatchdogRate(transferWatchdog_t *w)
+*
+*   Gets the average rate of a transfer being watched, from when data
+*   started moving up to the last check
+*    
+*   Parameters:                                                    [I/O]
+*
+*     w        the watchdog                                         I
+*   
+*   Returns: rate in bytes per second, 0 if not known
+***********************************************************************/
+double getTransferWatchdogRate(transferWatchdog_t *w)
+{
+    double seconds;
+
+    /* no rate if progress is only known as a percentage */
+    if ((w->moving == 0) || ((w->size <= 0) && (w->minRate == 0.0)))
+    {
+	return 0.0;
+    }
+
+    seconds = difftime(time(NULL), w->moving);
+    if (seconds < 1.0)
+    {
+	seconds = 1.0;
+    }
+    return (double)w->bytes / seconds;
+}
+
+/***********************************************************************
+*   digs_error_code_t scanNodeWithCallback(struct storageElement *se,
+*                                          char *errorMessage,
+*                                          char *hostname, int allFiles,
+*                                          digs_scan_callback_t callback,
+*                                          void *userData)
+*
+*   Scans all the files on a node, passing each one to a callback as it
+*   is found. Storage elements without a streaming scan are scanned into
+*   a list as usual and the list is then fed to the callback
+*    
+*   Parameters:                                                    [I/O]
+*
+*     se            storage element for the node                    I
+*     errorMessage  receives a description of any error               O
+*                   (MAX_ERROR_MESSAGE_LENGTH chars)
+*     hostname      the node to scan                                I
+*     allFiles      include temporary (locked) files                I
+*     callback      called for each file. Returns 0 to stop         I
+*     userData      passed through to the callback                  I
+*   
+*   Returns: A DiGs error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+digs_error_code_t scanNodeWithCallback(struct storageElement *se,
+				       char *errorMessage, char *hostname,
+				       int allFiles,
+				       digs_scan_callback_t callback,
+				       void *userData)
+{
+    digs_error_code_t result;
+    char **list;
+    int listLength;
+    int i;
+
+    if (se->digs_scanNodeStream != NULL)
+    {
+	return se->digs_scanNodeStream(errorMessage, hostname, allFiles,
+				       callback, userData);
+    }
+
+    result = se->digs_scanNode(errorMessage, hostname, &list, &listLength,
+			       allFiles);
+    if (result != DIGS_SUCCESS)
+    {
+	return result;
+    }
+
+    for (i = 0; i < listLength; i++)
+    {
+	if (!callback(list[i], userData))
+	{
+	    break;
+	}
+    }
+
+    se->digs_free_string_array(&list, &listLength);
+    return DIGS_SUCCESS;
+}
+
+/***********************************************************************
+*   digs_error_code_t startPutTransfers(struct storageElement *se,
+*                                       char *errorMessage,
+*                                       const char *hostname, int count,
+*                                       const char **localPaths,
+*                                       const char **SURLs, int *handles,
+*                                       digs_error_code_t *results)
+*
+*   Starts putting several files to one node. Storage elements that can
+*   batch the requests do so; for the others each file is started on
+*   its own
+*    
+*   Parameters:                                                    [I/O]
+*
+*     se            storage element for the node                    I
+*     errorMessage  receives a description of the first failure       O
+*                   (MAX_ERROR_MESSAGE_LENGTH chars)
+*     hostname      the node to put the files to                    I
+*     count         number of files                                 I
+*     localPaths    the local files                                 I
+*     SURLs         where to put each file on the node              I
+*     handles       receives each transfer's handle, or -1            O
+*     results       receives the result for each file                 O
+*   
+*   Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+*            code of the first failure
+***********************************************************************/
+digs_error_code_t startPutTransfers(struct storageElement *se,
+				    char *errorMessage, const char *hostname,
+				    int count, const char **localPaths,
+				    const char **SURLs, int *handles,
+				    digs_error_code_t *results)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result = DIGS_SUCCESS;
+    int i;
+
+    if (se->digs_startPutTransfers != NULL)
+    {
+	return se->digs_startPutTransfers(errorMessage, hostname, count,
+					  localPaths, SURLs, handles, results);
+    }
+
+    errorMessage[0] = 0;
+    for (i = 0; i < count; i++)
+    {
+	results[i] = se->digs_startPutTransfer(errbuf, hostname, localPaths[i],
+					       SURLs[i], &handles[i]);
+	if (results[i] != DIGS_SUCCESS)
+	{
+	    handles[i] = -1;
+	    if (result == DIGS_SUCCESS)
+	    {
+		result = results[i];
+		strcpy(errorMessage, errbuf);
+	    }
+	}
+    }
+    return result;
+}
+
+/***********************************************************************
+*   digs_error_code_t startGetTransfers(struct storageElement *se,
+*                                       char *errorMessage,
+*                                       const char *hostname, int count,
+*                                       const char **SURLs,
+*                                       const char **localPaths,
+*                                       int *handles,
+*                                       digs_error_code_t *results)
+*
+*   Starts getting several files from one node, batching the requests
+*   where the storage element can
+*    
+*   Parameters:                                                    [I/O]
+*
+*     se            storage element for the node                    I
+*     errorMessage  receives a description of the first failure       O
+*                   (MAX_ERROR_MESSAGE_LENGTH chars)
+*     hostname      the node to get the files from                  I
+*     count         number of files                                 I
+*     SURLs         the files on the node                           I
+*     localPaths    where to store each file locally                I
+*     handles       receives each transfer's handle, or -1            O
+*     results       receives the result for each file                 O
+*   
+*   Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+*            code of the first failure
+***********************************************************************/
+digs_error_code_t startGetTransfers(struct storageElement *se,
+				    char *errorMessage, const char *hostname,
+				    int count, const char **SURLs,
+				    const char **localPaths, int *handles,
+				    digs_error_code_t *results)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result = DIGS_SUCCESS;
+    int i;
+
+    if (se->digs_startGetTransfers != NULL)
+    {
+	return se->digs_startGetTransfers(errorMessage, hostname, count,
+					  SURLs, localPaths, handles, results);
+    }
+
+    errorMessage[0] = 0;
+    for (i = 0; i < count; i++)
+    {
+	results[i] = se->digs_startGetTransfer(errbuf, hostname, SURLs[i],
+					       localPaths[i], &handles[i]);
+	if (results[i] != DIGS_SUCCESS)
+	{
+	    handles[i] = -1;
+	    if (result == DIGS_SUCCESS)
+	    {
+		result = results[i];
+		strcpy(errorMessage, errbuf);
+	    }
+	}
+    }
+    return result;
+}
+
 /***********************************************************************
 *   char *getNodeName(int i)
 *
@@ -1282,6 +1823,97 @@ float getNodeCopyTimeout(char *node)
     return timeout;
 }
 
+/***********************************************************************
+*   int getNodeTransferAttempts(char *node)
+*
+*   Gets the number of times a client should try a transfer to or from
+*   this node before giving up on it. Later attempts resume from
+*   whatever the earlier ones transferred, where the node allows it
+*    
+*   Parameters:                                                    [I/O]
+*
+*     node   Node's FQDN                                            I
+*   
+*   Returns: number of attempts, always at least 1
+***********************************************************************/
+int getNodeTransferAttempts(char *node)
+{
+    char *prop;
+    int attempts = 3;
+
+    prop = getNodeProperty(node, "transferattempts");
+    if (prop)
+    {
+	attempts = atoi(prop);
+	globus_libc_free(prop);
+    }
+    if (attempts < 1)
+    {
+	attempts = 1;
+    }
+    return attempts;
+}
+
+/***********************************************************************
+*   double getNodeStallRate(char *node)
+*
+*   Gets the slowest rate a transfer to or from this node may run at
+*   for the stall period before it is given up on
+*    
+*   Parameters:                                                    [I/O]
+*
+*     node   Node's FQDN                                            I
+*   
+*   Returns: rate in bytes per second, always more than 0
+***********************************************************************/
+double getNodeStallRate(char *node)
+{
+    char *prop;
+    double rate = STALL_MIN_RATE;
+
+    prop = getNodeProperty(node, "stallrate");
+    if (prop)
+    {
+	rate = atof(prop) * 1024.0;
+	globus_libc_free(prop);
+    }
+    if (rate <= 0.0)
+    {
+	rate = STALL_MIN_RATE;
+    }
+    return rate;
+}
+
+/***********************************************************************
+*   float getNodeStallPeriod(char *node)
+*
+*   Gets how long a transfer to or from this node may run below the
+*   stall rate before it is given up on
+*    
+*   Parameters:                                                    [I/O]
+*
+*     node   Node's FQDN                                            I
+*   
+*   Returns: period in seconds, always at least 1
+***********************************************************************/
+float getNodeStallPeriod(char *node)
+{
+    char *prop;
+    float period = STALL_PERIOD;
+
+    prop = getNodeProperty(node, "stallperiod");
+    if (prop)
+    {
+	period = atof(prop);
+	globus_libc_free(prop);
+    }
+    if (period < 1.0)
+    {
+	period = 1.0;
+    }
+    return period;
+}
+
 /***********************************************************************
 *   int getNodeGpfs(char *node)
 *
@@ -1581,6 +2213,9 @@ void writeNodeTable()
 	case OMERO_SE:
 	    globus_libc_fprintf(f, "type=omero\n");
 	    break;
+	case LOCAL_SE:
+	    globus_libc_fprintf(f, "type=local\n");
+	    break;
 	}
 	if (gridNodes_[i].extraRsl)
 	{
@@ -2386,6 +3021,11 @@ int getNodeInfo(int secondaryOK)
 		    gridNodes_[numGridNodes_].storageElementType = SRM;
 		    initSEtoSRM(&gridNodes_[numGridNodes_]);
 		}
+		else if (!strcmp(value, "local"))
+		{
+		    gridNodes_[numGridNodes_].storageElementType = LOCAL_SE;
+		    initSEtoLocal(&gridNodes_[numGridNodes_]);
+		}
 #ifdef OMERO
 		else if (!strcmp(value, "omero"))
 		{
@@ -2759,6 +3399,9 @@ int getNodeInfoFromLocalFile(const char *dir)
 				} else if (!strcmp(value, "srm")) {
 					gridNodes_[numGridNodes_].storageElementType = SRM;
 					initSEtoSRM(&gridNodes_[numGridNodes_]);
+				} else if (!strcmp(value, "local")) {
+					gridNodes_[numGridNodes_].storageElementType = LOCAL_SE;
+					initSEtoLocal(&gridNodes_[numGridNodes_]);
 				} else {
 					logMessage(ERROR, "Unrecognised storage type: %s", value);
 				}
@@ -50,7 +50,7 @@
 #include "hashtable.h"
 
 /* Types of storage elements.*/
-typedef enum {SRM, GLOBUS, OMERO_SE, INVALID_SE_TYPE} storageElementTypes;
+typedef enum {SRM, GLOBUS, OMERO_SE, LOCAL_SE, INVALID_SE_TYPE} storageElementTypes;
 
 /* The storage element interface. */
 struct storageElement{
@@ -131,6 +131,76 @@ struct storageElement{
 			const char *filePath, const char *hostname, char **fileChecksum,
 			digs_checksum_type_t checksumType);
 
+	/***********************************************************************
+	 *digs_error_code_t (*digs_startChecksum)(char *errorMessage,
+	 * const char *filePath, const char *hostname,
+	 * digs_checksum_type_t checksumType, long long int fileLength,
+	 * int *handle)
+	 * 
+	 * Starts checksumming a file on a node without waiting for the result.
+	 * The checksum is given a deadline in proportion to the file's length,
+	 * after which digs_monitorChecksum reports it as failed. The handle
+	 * can be passed to digs_waitForTransfers along with transfer handles.
+	 * NULL if the storage element can only checksum synchronously, with
+	 * digs_getChecksum.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 * 	 filePath 		the full path to the file							I
+	 *   hostname  		the FQDN of the host to contact          			I
+	 * 	 checksumType	the checkdigs_checksum_type_t						I
+	 * 	 fileLength		length of the file in bytes, or -1 if unknown		I
+	 * 	 handle 		the id of the checksum								O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_startChecksum)(char *errorMessage,
+			const char *filePath, const char *hostname,
+			digs_checksum_type_t checksumType, long long int fileLength,
+			int *handle);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_monitorChecksum)(char *errorMessage,
+	 * int handle, digs_transfer_status_t *status)
+	 * 
+	 * Checks whether a checksum started with digs_startChecksum has
+	 * finished. A checksum which has passed its deadline is reported as
+	 * DIGS_TRANSFER_FAILED with DIGS_NO_RESPONSE.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 * 	 handle 		the id of the checksum								I
+	 * 	 status			the status of the checksum							O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_monitorChecksum)(char *errorMessage, int handle,
+			digs_transfer_status_t *status);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_endChecksum)(char *errorMessage, int handle,
+	 * char **fileChecksum)
+	 * 
+	 * Collects the result of a checksum started with digs_startChecksum
+	 * and frees its handle. If the checksum is still running it is
+	 * cancelled. Free the checksum with digs_free_string.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 * 	 handle 		the id of the checksum								I
+	 * 	 fileChecksum	the checksum, in uppercase hex, or NULL on error	O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_endChecksum)(char *errorMessage, int handle,
+			char **fileChecksum);
+
 	/***********************************************************************
 	 * digs_error_code_t digs_doesExist (char *errorMessage,
 	 * const char *filePath, const char *hostname, int *doesExist)
@@ -303,6 +373,59 @@ struct storageElement{
 	digs_error_code_t (*digs_getModificationTime)(char *errorMessage,
 			const char *filePath, const char *hostname,
 			time_t *modificationTime);
+
+	/***********************************************************************
+	 *  digs_error_code_t (*digs_stat)(char *errorMessage,
+	 *		const char *filePath, const char *hostname, digs_stat_t *stat);
+	 * 
+	 *     Gets the type, size, modification time, owner, group and
+	 *     permissions of a file, and its checksum if the node keeps one,
+	 *     in a single request to the node. Use this rather than several
+	 *     of the individual calls above when more than one is wanted.
+	 *     Fields the node can't supply are left at their "not known"
+	 *     values (see digs_stat_t). Free the result with digs_freeStat.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 * 	 filePath 		the full path to the file							I
+	 *   hostname  		the FQDN of the host to contact          			I
+	 * 	 stat			the file's details									O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_stat)(char *errorMessage, const char *filePath,
+			const char *hostname, digs_stat_t *stat);
+
+	/***********************************************************************
+	 *  digs_error_code_t (*digs_statMany)(char *errorMessage,
+	 *		const char *hostname, int count, const char **filePaths,
+	 * 		digs_stat_t *stats, digs_error_code_t *results);
+	 * 
+	 *     As digs_stat, for a list of files on the same node. The
+	 *     requests are batched or overlapped, depending on the node type.
+	 *     Each file gets its own result code; stats[i] is only filled in
+	 *     where results[i] is DIGS_SUCCESS, but every entry must still be
+	 *     freed with digs_freeStat.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   hostname  		the FQDN of the host to contact          			I
+	 * 	 count			the number of files									I
+	 * 	 filePaths		the full paths to the files							I
+	 * 	 stats			array of count entries receiving the details		O
+	 * 	 results		array of count entries receiving the result
+	 * 					for each file										O
+	 *    
+	 *   Returns: DIGS_SUCCESS if every file was stat'd, otherwise the
+	 *            code of the first failure, described in errorMessage
+	 ***********************************************************************/
+	digs_error_code_t (*digs_statMany)(char *errorMessage,
+			const char *hostname, int count, const char **filePaths,
+			digs_stat_t *stats, digs_error_code_t *results);
 	
 
 	/***********************************************************************
@@ -333,6 +456,37 @@ struct storageElement{
 			const char *hostname, const char *localPath, const char *SURL,
 			int *handle);
 
+	/***********************************************************************
+	 *digs_error_code_t (*digs_startPutTransfers)(char *errorMessage,
+	 *		const char *hostname, int count, const char **localPaths,
+	 *		const char **SURLs, int *handles, digs_error_code_t *results);
+	 *
+	 * As digs_startPutTransfer, for several files to the same node. The
+	 * node is asked to prepare them in as few requests as it can. Each
+	 * file gets its own handle and result code; handles[i] is -1 where
+	 * results[i] is not DIGS_SUCCESS. NULL if the storage element can't
+	 * batch them, in which case use startPutTransfers, which falls back
+	 * to one digs_startPutTransfer per file.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   hostname  		the FQDN of the host to contact          			I	
+	 * 	 count			the number of files									I
+	 * 	 localPaths		the full paths to the local files					I
+	 * 	 SURLs			the remote locations to put the files to			I
+	 * 	 handles		array of count entries receiving the transfer ids	O
+	 * 	 results		array of count entries receiving the result
+	 * 					for each file										O
+	 *    
+	 *   Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+	 *            code of the first failure, described in errorMessage
+	 ***********************************************************************/
+	digs_error_code_t (*digs_startPutTransfers)(char *errorMessage,
+			const char *hostname, int count, const char **localPaths,
+			const char **SURLs, int *handles, digs_error_code_t *results);
+
 	/***********************************************************************
 	 *digs_error_code_t (*digs_startCopyToInbox)(char *errorMessage,
 	 *		const char *hostname, const char *localPath, const char *lfn, 
@@ -388,6 +542,50 @@ struct storageElement{
 	digs_error_code_t (*digs_monitorTransfer)(char *errorMessage, int handle, 
 			digs_transfer_status_t *status, int *percentComplete);
 
+	/***********************************************************************
+	 *digs_error_code_t (*digs_getTransferProgress)(char *errorMessage,
+	 *		int handle, long long *bytes);
+	 * 
+	 * Gets how many bytes of a file a transfer has moved so far, not
+	 * counting any kept from an earlier attempt that it resumed. NULL if
+	 * the storage element can only report progress as a percentage.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)		O
+	 * 	 handle 		the id of the transfer							I
+	 * 	 bytes			receives the number of bytes moved				O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_getTransferProgress)(char *errorMessage,
+			int handle, long long *bytes);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_waitForTransfers)(char *errorMessage,
+	 *		int *handles, int count, float timeOut, int *completed);
+	 * 
+	 * Blocks until at least one of several transfers on this storage
+	 * element has finished (successfully or not) or the time out expires.
+	 * NULL if the storage element cannot wait on transfers, in which case
+	 * they have to be polled with digs_monitorTransfer.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)		O
+	 * 	 handles 		the ids of the transfers						I
+	 * 	 count 			the number of handles							I
+	 * 	 timeOut 		the longest time to wait, in seconds			I
+	 * 	 completed		index into handles of a finished transfer, or
+	 * 					-1 if none finished before the time out			O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_waitForTransfers)(char *errorMessage,
+			int *handles, int count, float timeOut, int *completed);
+
 	/***********************************************************************
 	 * digs_error_code_t (*digs_endTransfer)(char *errorMessage, int handle)
 	 * 
@@ -446,6 +644,160 @@ struct storageElement{
 	digs_error_code_t (*digs_startGetTransfer)(char *errorMessage,
 			const char *hostname, const char *SURL, const char *localPath,
 			int *handle);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_startGetTransfers)(char *errorMessage,
+	 *		const char *hostname, int count, const char **SURLs,
+	 *		const char **localPaths, int *handles, digs_error_code_t *results);
+	 *
+	 * As digs_startGetTransfer, for several files from the same node, in
+	 * the same way as digs_startPutTransfers. NULL if the storage element
+	 * can't batch them (see startGetTransfers).
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   hostname  		the FQDN of the host to contact          			I	
+	 * 	 count			the number of files									I
+	 * 	 SURLs			the remote locations to get the files from			I
+	 * 	 localPaths		the full paths to store the files in				I
+	 * 	 handles		array of count entries receiving the transfer ids	O
+	 * 	 results		array of count entries receiving the result
+	 * 					for each file										O
+	 *    
+	 *   Returns: DIGS_SUCCESS if every transfer was started, otherwise the
+	 *            code of the first failure, described in errorMessage
+	 ***********************************************************************/
+	digs_error_code_t (*digs_startGetTransfers)(char *errorMessage,
+			const char *hostname, int count, const char **SURLs,
+			const char **localPaths, int *handles, digs_error_code_t *results);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_startGetRangeTransfer)(char *errorMessage,
+	 *		const char *hostname, const char *SURL, const char *localPath,
+	 *		long long offset, long long length, int *handle);
+	 *
+	 * Starts a get of length bytes of a file, from offset onwards. They
+	 * are written at the same offset into localPath, which must already
+	 * exist and may be shared with other range transfers of the same
+	 * file. The range is not checksummed, and a failed or cancelled
+	 * transfer leaves localPath in place. The handle is used as for
+	 * digs_startGetTransfer. NULL if the storage element can't fetch
+	 * part of a file.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   hostname  		the FQDN of the host to contact          			I	
+	 * 	 SURL 			the remote location to get the file from			I	
+	 * 	 localPath 		the local file to write the range into				I
+	 * 	 offset			where the range starts, in bytes					I
+	 * 	 length			the length of the range, in bytes					I
+	 * 	 handle 		the id of the transfer								O					
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_startGetRangeTransfer)(char *errorMessage,
+			const char *hostname, const char *SURL, const char *localPath,
+			long long offset, long long length, int *handle);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_getTransferChecksum)(char *errorMessage,
+	 *		int handle, char **checksum);
+	 *
+	 * Gets the MD5 checksum of the local file sent by a put, worked out
+	 * from the data as it went. Only valid once the transfer is
+	 * DIGS_TRANSFER_DONE and before digs_endTransfer is called. NULL if
+	 * the storage element can't checksum a put as it sends it.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 * 	 handle 		the id of the transfer								I
+	 * 	 checksum		receives the checksum as upper case hex, to be
+	 * 					freed with digs_free_string							O
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_getTransferChecksum)(char *errorMessage,
+			int handle, char **checksum);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_startRelayTransfer)(char *errorMessage,
+	 *		const char *fromHost, const char *fromSURL, const char *toHost,
+	 *		const char *toSURL, int *handle);
+	 *
+	 * Starts a copy of a file from another node of the same type to this
+	 * one, streamed through this process without being staged on local 
+	 * disk. The handle returned is monitored, ended and cancelled using 
+	 * this storage element's functions, as for a put. NULL if the storage
+	 * element cannot do this, in which case the file should be fetched
+	 * and put in two stages.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   fromHost  		the FQDN of the host to copy from          			I	
+	 * 	 fromSURL 		the location of the file on fromHost				I	
+	 *   toHost  		the FQDN of the host to copy to          			I	
+	 * 	 toSURL 		the location to put the file on toHost				I	
+	 * 	 handle 		the id of the transfer								O					
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_startRelayTransfer)(char *errorMessage,
+			const char *fromHost, const char *fromSURL, const char *toHost,
+			const char *toSURL, int *handle);
+
+	/***********************************************************************
+	 *digs_error_code_t (*digs_startPeerRelayTransfer)(char *errorMessage,
+	 *		const char *hostname, const char *SURL, const char *peerHost,
+	 *		const char *peerURL, int toPeer, int *handle);
+	 *
+	 * Starts a copy between a file on this node and one on a node of
+	 * another type, given by that node's digs_getRelayURL, streamed
+	 * through this process without being staged on local disk. The
+	 * handle is monitored, ended and cancelled using this storage
+	 * element's functions, whichever way the file goes. NULL if the
+	 * storage element cannot do this.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   hostname  		the FQDN of the host to contact          			I	
+	 * 	 SURL 			the location of the file on hostname				I	
+	 *   peerHost  		the FQDN of the node at the other end      			I	
+	 * 	 peerURL		the URL of the file on peerHost						I
+	 * 	 toPeer			set to copy SURL to peerURL, clear to copy
+	 * 					peerURL to SURL										I
+	 * 	 handle 		the id of the transfer								O					
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_startPeerRelayTransfer)(char *errorMessage,
+			const char *hostname, const char *SURL, const char *peerHost,
+			const char *peerURL, int toPeer, int *handle);
+
+	/***********************************************************************
+	 *char *(*digs_getRelayURL)(const char *hostname, const char *SURL);
+	 *
+	 * Gets the URL a node of another type's digs_startPeerRelayTransfer
+	 * reads or writes a file on this node through. NULL if files on the
+	 * storage element can't be reached that way.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 *   hostname  		the FQDN of the host the file is on        			I	
+	 * 	 SURL 			the location of the file on hostname				I	
+	 *    
+	 *   Returns: the URL, to be freed with globus_libc_free
+	 ***********************************************************************/
+	char *(*digs_getRelayURL)(const char *hostname, const char *SURL);
 	
 	/***********************************************************************
 	 * digs_error_code_t (*digs_mkdir)(char *errorMessage, const char *hostname,
@@ -616,6 +968,36 @@ struct storageElement{
 	digs_error_code_t (*digs_scanNode)(char *errorMessage,
 			const char *hostname, char ***list, int *listLength, int allFiles);
 
+	/***********************************************************************
+	 * digs_error_code_t (*digs_scanNodeStream)(char *errorMessage,
+	 * const char *hostname, int allFiles, digs_scan_callback_t callback,
+	 * void *userData);
+	 * 
+	 * As digs_scanNode, but each file is handed to the callback as soon
+	 * as it is found instead of being collected into one array, so a
+	 * node with millions of files can be scanned in bounded memory. The
+	 * path passed to the callback is only valid during the call. The
+	 * order files are reported in is not defined.
+	 * 
+	 * NULL for storage elements that can't stream a scan; use
+	 * scanNodeWithCallback to fall back to digs_scanNode for those.
+	 * 
+	 *   Parameters:                                                	 [I/O]
+	 *
+	 * 	 errorMessage	an error description string	(expects to have
+	 * 					MAX_ERROR_MESSAGE_LENGTH assigned already)			O
+	 *   hostname  		the FQDN of the host to contact          			I	
+	 * 	 allFiles		Show all files or hide any temporary (locked files) I
+	 * 	 callback		called with the full path of each file				I
+	 * 	 userData		passed through to the callback						I
+	 *    
+	 *   Returns: A DiGs error code (DIGS_SUCCESS if successful, or if the
+	 *            callback stopped the scan).
+	 ***********************************************************************/
+	digs_error_code_t (*digs_scanNodeStream)(char *errorMessage,
+			const char *hostname, int allFiles, digs_scan_callback_t callback,
+			void *userData);
+
 	/***********************************************************************
 	 * digs_error_code_t  (*digs_scanInbox)(char *errorMessage, 
 	 * const char *hostname, char ***list, int *listLength, int allFiles);
@@ -909,6 +1291,18 @@ float getNodeCopyTimeout(char *node);
 float getNodeFtpTimeout(char *node);
 float getNodeJobTimeout(char *node);
 
+/*
+ * Gets the number of times to try a client transfer to or from a node
+ */
+int getNodeTransferAttempts(char *node);
+
+/*
+ * Gets the slowest rate (bytes per second) a transfer to or from a node
+ * may run at, and for how long (seconds), before it counts as stalled
+ */
+double getNodeStallRate(char *node);
+float getNodeStallPeriod(char *node);
+
 /*
  * Returns 1 if the node is a GPFS system
  */
@@ -1011,7 +1405,58 @@ char *getTemporaryFile();
 
 void initSEtoGlobus(struct storageElement *se);
 void initSEtoSRM(struct storageElement *se);
+void initSEtoLocal(struct storageElement *se);
 
 char *getNodeProperty(const char *node, char *prop);
 
+void waitForTransfer(struct storageElement *se, int handle, float timeOut);
+
+/*
+ * Keeps watch on a transfer's progress so that it is given up on when
+ * it stalls, rather than after a fixed time. See startTransferWatchdog
+ */
+#define WATCHDOG_SAMPLES 16
+
+typedef struct transferWatchdog_s
+{
+    struct storageElement *se;
+    char *node;                  /* not owned                          */
+    int handle;
+    long long size;              /* -1 if not known                    */
+    double minRate;              /* bytes per second                   */
+    float stallPeriod;           /* seconds                            */
+    float deadline;              /* seconds from the start, 0 for none */
+    time_t started;
+    time_t moving;               /* when data started moving, 0 before */
+    long long bytes;             /* moved so far                       */
+    int numSamples;
+    int nextSample;
+    time_t sampleTimes[WATCHDOG_SAMPLES];
+    long long sampleBytes[WATCHDOG_SAMPLES];
+} transferWatchdog_t;
+
+void startTransferWatchdog(transferWatchdog_t *w, struct storageElement *se,
+			   char *node, int handle, long long size);
+int checkTransferWatchdog(transferWatchdog_t *w, digs_transfer_status_t status,
+			  int percentComplete);
+double getTransferWatchdogRate(transferWatchdog_t *w);
+
+digs_error_code_t scanNodeWithCallback(struct storageElement *se,
+				       char *errorMessage, char *hostname,
+				       int allFiles,
+				       digs_scan_callback_t callback,
+				       void *userData);
+
+digs_error_code_t startPutTransfers(struct storageElement *se,
+				    char *errorMessage, const char *hostname,
+				    int count, const char **localPaths,
+				    const char **SURLs, int *handles,
+				    digs_error_code_t *results);
+
+digs_error_code_t startGetTransfers(struct storageElement *se,
+				    char *errorMessage, const char *hostname,
+				    int count, const char **SURLs,
+				    const char **localPaths, int *handles,
+				    digs_error_code_t *results);
+
 #endif
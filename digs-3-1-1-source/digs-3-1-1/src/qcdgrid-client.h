@@ -94,6 +94,25 @@ int qcdgridEnableNode(char *node);
 int qcdgridRetireNode(char *node);
 int qcdgridUnretireNode(char *node);
 
+/*======================================================================
+ *
+ * Replication queue administration
+ *
+ * qcdgridGetReplicationQueue copies the control thread's last saved
+ * replication queue to the local file pfn. Each line is a record of
+ * the form
+ *
+ *   R <id> <reason> <priority> <stage> <copies> <from> <to> <dir> <temp> <lfn>
+ *
+ * The other two functions only work if the user is a grid
+ * administrator. Replications with a higher priority are started
+ * first. All return 1 on success and 0 on failure.
+ *
+ *====================================================================*/
+int qcdgridGetReplicationQueue(char *pfn);
+int qcdgridSetReplicationPriority(int id, int priority);
+int qcdgridCancelReplication(int id);
+
 /*======================================================================
  *
  * File/directory getting functions
@@ -116,10 +135,14 @@ int qcdgridGetDirectory(char *ldn, char *pdn);
  * success and 0 on failure. qcdgridPutFile puts a single file (pfn in
  * the local filesystem) onto the grid (under logical name lfn).
  * qcdgridPutDirectory does the same for an entire directory of files.
+ * qcdgridPutFiles puts count files at once, copying them in parallel,
+ * and sets results[i] to 1 for each file that was put.
  *
  *====================================================================*/
 int qcdgridPutFile(char *pfn, char *lfn, char *permissions);
 int qcdgridPutDirectory(char *pfn, char *lfn, char *permissions);
+int qcdgridPutFiles(int count, char **pfns, char **lfns, char *permissions,
+		    int *results);
 int qcdgridModifyFile(char *pfn, char *lfn);
 
 /*======================================================================
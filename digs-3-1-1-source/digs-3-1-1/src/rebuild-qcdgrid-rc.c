@@ -242,15 +242,16 @@ void rebuildLocationCatalogue(char *host, int size, int md5sum)
 	globus_libc_fprintf(stderr, "File %s at node %s doesn't have replica entry (or has incorrect) for attribute md5sum\n", lfn, host);
 
 	/*
-	 * check if this is a Globus node - if not, try to find a Globus node to get the checksum from
+	 * check if this is a Globus node - if not, try to find a Globus node to get the checksum from.
+	 * Local nodes compute real MD5s too, so they will do as well
 	 */
-	if (se->storageElementType != GLOBUS) {
+	if ((se->storageElementType != GLOBUS) && (se->storageElementType != LOCAL_SE)) {
 	  char *md5pfn;
 	  char *md5host = getFirstFileLocation(lfn);
 	  se2 = NULL;
 	  while (md5host) {
 	    se2 = getNode(md5host);
-	    if (se2->storageElementType == GLOBUS) {
+	    if ((se2->storageElementType == GLOBUS) || (se2->storageElementType == LOCAL_SE)) {
 	      /* found a Globus node */
 	      md5pfn = constructFilename(md5host, lfn);
 	      break;
@@ -40,11 +40,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "repqueue.h"
 #include "replica.h"
 #include "node.h"
 #include "misc.h"
+#include "bandwidth.h"
 
 /*
  * This structure is the basis of the replication queue, containing
@@ -64,6 +68,13 @@ typedef struct replicationInfo_s
      */
     int numCopies;
 
+    /*
+     * Administrator assigned priority. Replications with a higher
+     * priority are always started before those with a lower one,
+     * regardless of the number of copies
+     */
+    int priority;
+
     char *lfn;                  /* Logical file name */
 
     char *fromNode;             /* Node file is being copied from */
@@ -90,8 +101,50 @@ typedef struct replicationInfo_s
      */
     int handle;
 
+    /*
+     * Keeps watch on the operation in progress, so that it is given up
+     * on if it stalls
+     */
+    transferWatchdog_t watchdog;
+
+    /*
+     * Length of the file from the catalogue, -1 until it has been
+     * looked up
+     */
+    long long size;
+
+    /*
+     * Number of transfers for this replication that have failed. Not
+     * persisted, so a restarted control thread gives each one a fresh
+     * set of attempts
+     */
+    int attempts;
+
+    /*
+     * Set while a relay between nodes of different types is run by the
+     * source node's storage element, which then holds the handle and
+     * writes the destination's -LOCKED file. Not persisted, as relays
+     * always start again from the beginning
+     */
+    int relayFromSource;
+
 } replicationInfo_t;
 
+/*
+ * A failed get or put is tried again, resuming from whatever it had
+ * transferred, up to this many times before the replication is dropped
+ */
+#define REPLICATION_MAX_ATTEMPTS 3
+
+/*
+ * Ways of copying a file between two nodes (see getReplicationRelay)
+ */
+enum { RELAY_NONE,          /* fetched to local disk, then put */
+       RELAY_SAME_TYPE,     /* destination relays from a node like itself */
+       RELAY_FROM_PEER,     /* destination relays from the source's URL */
+       RELAY_TO_PEER,       /* source relays to the destination's URL */
+};
+
 static int nextRepId_ = 0;
 
 /*
@@ -102,6 +155,398 @@ static int replicationQueueLength_ = 0;
 static int replicationQueueAlloced_ = 0;
 static replicationInfo_t *replicationQueue_ = NULL;
 
+/*
+ * The queue is persisted in the QCDgrid directory so that it survives
+ * a restart of the control thread. "repqueue.journal" has a record
+ * appended and synced every time an entry changes, so that nothing is
+ * lost if the thread dies. "repqueue" holds a snapshot of the whole
+ * queue, which the journal is replayed on top of. The snapshot is only
+ * rewritten (via a temporary file and a rename), and the journal
+ * emptied, at the end of an update once the journal has grown past
+ * REPQUEUE_JOURNAL_MAX_RECORDS, or if a change could not be journalled.
+ *
+ * Each record is one line:
+ *
+ *   R <id> <reason> <priority> <stage> <numCopies> <from> <to> <toDir> <tempName> <lfn>
+ *   D <id>
+ *
+ * "R" adds or replaces the entry with that id, "D" removes it. A "-"
+ * stands for a toDir or tempName that has not been set. The LFN is
+ * last as it runs to the end of the line.
+ */
+#define REPQUEUE_SNAPSHOT "repqueue"
+#define REPQUEUE_JOURNAL  "repqueue.journal"
+
+/* Journal records to allow before folding them into a new snapshot */
+#define REPQUEUE_JOURNAL_MAX_RECORDS 1000
+
+static FILE *journal_ = NULL;
+
+/* Records written to the journal since the last snapshot */
+static int journalRecords_ = 0;
+
+/* Set if a change could not be journalled, so only a new snapshot will
+ * record it */
+static int replicationQueueDirty_ = 0;
+
+/***********************************************************************
+*   char *getReplicationQueueFilename(char *name)
+*
+*   Returns the full path of one of the replication queue's state files
+*
+*   Parameters:                                                     [I/O]
+*
+*    name    Name of the file within the QCDgrid directory           I
+*
+*   Returns: newly allocated path, to be freed by the caller
+***********************************************************************/
+static char *getReplicationQueueFilename(char *name)
+{
+    char *filename;
+
+    if (safe_asprintf(&filename, "%s/%s", getQcdgridPath(), name) < 0)
+    {
+	errorExit("Out of memory in getReplicationQueueFilename");
+    }
+    return filename;
+}
+
+/***********************************************************************
+*   void writeReplicationRecord(FILE *f, replicationInfo_t *rep)
+*
+*   Writes a single replication queue entry as an "R" record
+*
+*   Parameters:                                                     [I/O]
+*
+*    f       File to write to                                        I
+*    rep     Queue entry to write                                    I
+*
+*   Returns: (void)
+***********************************************************************/
+static void writeReplicationRecord(FILE *f, replicationInfo_t *rep)
+{
+    globus_libc_fprintf(f, "R %d %d %d %d %d %s %s %s %s %s\n", rep->id,
+			rep->reason, rep->priority, rep->stage, rep->numCopies,
+			rep->fromNode, rep->toNode,
+			rep->toDir ? rep->toDir : "-",
+			rep->tempName ? rep->tempName : "-", rep->lfn);
+}
+
+/***********************************************************************
+*   void syncJournal()
+*
+*   Flushes the journal and forces it out to disk, after a record has
+*   been written to it
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: (void)
+***********************************************************************/
+static void syncJournal()
+{
+    journalRecords_++;
+    if ((fflush(journal_) != 0) || (fsync(fileno(journal_)) != 0))
+    {
+	logMessage(5, "Error writing replication queue journal");
+	replicationQueueDirty_ = 1;
+    }
+}
+
+/***********************************************************************
+*   int openJournal()
+*
+*   Makes sure the journal file is open for appending
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+static int openJournal()
+{
+    char *filename;
+
+    if (journal_)
+    {
+	return 1;
+    }
+
+    filename = getReplicationQueueFilename(REPQUEUE_JOURNAL);
+    journal_ = fopen(filename, "a");
+    if (!journal_)
+    {
+	logMessage(5, "Error opening replication queue journal %s", filename);
+    }
+    globus_libc_free(filename);
+    return (journal_ != NULL);
+}
+
+/***********************************************************************
+*   void journalReplication(replicationInfo_t *rep)
+*
+*   Records the current state of a queue entry in the journal
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry that has been added or changed              I
+*
+*   Returns: (void)
+***********************************************************************/
+static void journalReplication(replicationInfo_t *rep)
+{
+    if (!openJournal())
+    {
+	replicationQueueDirty_ = 1;
+	return;
+    }
+    writeReplicationRecord(journal_, rep);
+    syncJournal();
+}
+
+/***********************************************************************
+*   void journalRemoval(int id)
+*
+*   Records the removal of a queue entry in the journal
+*
+*   Parameters:                                                     [I/O]
+*
+*    id      ID of the replication that has gone from the queue      I
+*
+*   Returns: (void)
+***********************************************************************/
+static void journalRemoval(int id)
+{
+    if (!openJournal())
+    {
+	replicationQueueDirty_ = 1;
+	return;
+    }
+    globus_libc_fprintf(journal_, "D %d\n", id);
+    syncJournal();
+}
+
+/***********************************************************************
+*   void saveReplicationQueue()
+*
+*   Writes a snapshot of the whole queue and empties the journal. The
+*   snapshot is written to a temporary file and renamed into place, so
+*   there is always either the old or the new one on disk
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: (void)
+***********************************************************************/
+static void saveReplicationQueue()
+{
+    char *filename, *tmpFilename;
+    FILE *f;
+    int i;
+
+    logMessage(1, "saveReplicationQueue()");
+
+    filename = getReplicationQueueFilename(REPQUEUE_SNAPSHOT);
+    if (safe_asprintf(&tmpFilename, "%s.tmp", filename) < 0)
+    {
+	errorExit("Out of memory in saveReplicationQueue");
+    }
+
+    f = fopen(tmpFilename, "w");
+    if (!f)
+    {
+	logMessage(5, "Error opening %s to save replication queue", tmpFilename);
+	globus_libc_free(tmpFilename);
+	globus_libc_free(filename);
+	return;
+    }
+
+    for (i = 0; i < replicationQueueLength_; i++)
+    {
+	writeReplicationRecord(f, &replicationQueue_[i]);
+    }
+
+    if ((fflush(f) != 0) || (fsync(fileno(f)) != 0))
+    {
+	logMessage(5, "Error writing replication queue to %s", tmpFilename);
+	fclose(f);
+	unlink(tmpFilename);
+	globus_libc_free(tmpFilename);
+	globus_libc_free(filename);
+	return;
+    }
+    fclose(f);
+
+    if (rename(tmpFilename, filename) < 0)
+    {
+	logMessage(5, "Error renaming %s to %s", tmpFilename, filename);
+	unlink(tmpFilename);
+	globus_libc_free(tmpFilename);
+	globus_libc_free(filename);
+	return;
+    }
+    globus_libc_free(tmpFilename);
+    globus_libc_free(filename);
+
+    /* Everything in the journal is now in the snapshot */
+    replicationQueueDirty_ = 0;
+    journalRecords_ = 0;
+    if (journal_)
+    {
+	fclose(journal_);
+	journal_ = NULL;
+    }
+    filename = getReplicationQueueFilename(REPQUEUE_JOURNAL);
+    journal_ = fopen(filename, "w");
+    if (!journal_)
+    {
+	logMessage(5, "Error truncating replication queue journal %s", filename);
+    }
+    globus_libc_free(filename);
+}
+
+/***********************************************************************
+*   int ranksBefore(replicationInfo_t *rep, int priority, int numCopies)
+*
+*   Determines whether an existing queue entry should be processed
+*   before a replication with the given priority and number of copies
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep        Existing queue entry                                 I
+*    priority   Priority of the other replication                    I
+*    numCopies  Number of copies of the other replication's file     I
+*
+*   Returns: 1 if rep comes first, 0 if not
+***********************************************************************/
+static int ranksBefore(replicationInfo_t *rep, int priority, int numCopies)
+{
+    if (rep->priority != priority)
+    {
+	return (rep->priority > priority);
+    }
+    return (rep->numCopies <= numCopies);
+}
+
+/***********************************************************************
+*   int makeQueueSlot(int priority, int numCopies)
+*
+*   Grows the queue by one and opens up a gap at the correct position
+*   for a replication with the given priority and number of copies
+*
+*   Parameters:                                                     [I/O]
+*
+*    priority   Priority of the new replication                      I
+*    numCopies  Number of copies of the file on the grid             I
+*
+*   Returns: index of the new (uninitialised) entry
+***********************************************************************/
+static int makeQueueSlot(int priority, int numCopies)
+{
+    int i;
+
+    replicationQueueLength_++;
+    if (replicationQueueAlloced_ < replicationQueueLength_)
+    {
+	replicationQueue_ = globus_libc_realloc(replicationQueue_,
+						replicationQueueLength_*
+						sizeof(replicationInfo_t));
+	if (!replicationQueue_)
+	{
+	    errorExit("Out of memory in makeQueueSlot");
+	}
+	replicationQueueAlloced_ = replicationQueueLength_;
+    }
+
+    /*
+     * Work out its correct position in the priority queue
+     */
+    for (i = replicationQueueLength_ - 1; i >= 1; i--)
+    {
+	if (ranksBefore(&replicationQueue_[i-1], priority, numCopies))
+	{
+	    break;
+	}
+	replicationQueue_[i] = replicationQueue_[i-1];
+    }
+    return i;
+}
+
+/***********************************************************************
+*   void freeReplication(replicationInfo_t *rep)
+*
+*   Frees the strings held by a queue entry
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry to free                                     I
+*
+*   Returns: (void)
+***********************************************************************/
+static void freeReplication(replicationInfo_t *rep)
+{
+    globus_libc_free(rep->lfn);
+    globus_libc_free(rep->toNode);
+    globus_libc_free(rep->fromNode);
+    if (rep->tempName)
+    {
+	globus_libc_free(rep->tempName);
+    }
+    if (rep->toDir)
+    {
+	globus_libc_free(rep->toDir);
+    }
+}
+
+/***********************************************************************
+*   void removeFromQueue(int i)
+*
+*   Removes an entry from the queue, closing up the gap
+*
+*   Parameters:                                                     [I/O]
+*
+*    i       Index of the entry to remove                            I
+*
+*   Returns: (void)
+***********************************************************************/
+static void removeFromQueue(int i)
+{
+    freeReplication(&replicationQueue_[i]);
+    replicationQueueLength_--;
+    for (; i < replicationQueueLength_; i++)
+    {
+	replicationQueue_[i] = replicationQueue_[i+1];
+    }
+}
+
+/***********************************************************************
+*   int findReplication(int id)
+*
+*   Looks up a queue entry by its ID
+*
+*   Parameters:                                                     [I/O]
+*
+*    id      ID of the replication                                   I
+*
+*   Returns: index of the entry in the queue, or -1 if not found
+***********************************************************************/
+static int findReplication(int id)
+{
+    int i;
+
+    for (i = 0; i < replicationQueueLength_; i++)
+    {
+	if (replicationQueue_[i].id == id)
+	{
+	    return i;
+	}
+    }
+    return -1;
+}
+
 /***********************************************************************
 *   void addToReplicationQueue(char *from, char *to, char *lfn, int reason)
 *    
@@ -182,32 +627,10 @@ void addToReplicationQueue(char *from, char *to, char *lfn, int reason)
      */
     if (rep < 0)
     {
-	replicationQueueLength_++;
-	if (replicationQueueAlloced_ < replicationQueueLength_)
-	{
-	    replicationQueue_ = globus_libc_realloc(replicationQueue_,
-						    replicationQueueLength_*
-						    sizeof(replicationInfo_t));
-	    if (!replicationQueue_)
-	    {
-		errorExit("Out of memory in addToReplicationQueue");
-	    }
-	}
-
-	/*
-	 * Work out its correct position in the priority queue
-	 */
-	for (i = replicationQueueLength_ - 1; i >= 1; i--)
-	{
-	    if (replicationQueue_[i-1].numCopies <= ncopies)
-	    {
-		break;
-	    }
-	    replicationQueue_[i] = replicationQueue_[i-1];
-	}
-	rep = i;
+	rep = makeQueueSlot(0, ncopies);
 
 	replicationQueue_[rep].id = nextRepId_++;
+	replicationQueue_[rep].priority = 0;
     }
 
     /*
@@ -220,10 +643,15 @@ void addToReplicationQueue(char *from, char *to, char *lfn, int reason)
     replicationQueue_[rep].fromNode = safe_strdup(from);
     replicationQueue_[rep].stage = REPSTAGE_WAITING;
     replicationQueue_[rep].handle = -1;
+    replicationQueue_[rep].attempts = 0;
+    replicationQueue_[rep].relayFromSource = 0;
+    replicationQueue_[rep].size = -1;
     replicationQueue_[rep].toDir = NULL;
 
     /* get temp filename */
     replicationQueue_[rep].tempName = getTemporaryFile();
+
+    journalReplication(&replicationQueue_[rep]);
 }
 
 /*
@@ -232,35 +660,595 @@ void addToReplicationQueue(char *from, char *to, char *lfn, int reason)
 int getFileReplicaCount(char *lfn);
 
 /***********************************************************************
-*   void updateReplicationQueue()
-*    
-*   Updates all the replications in the queue, checking to see if any
-*   have completed and should be removed, or if there are any FTP slots
-*   free for starting new replications. This should be called
-*   periodically
-*    
+*   int finaliseReplication(replicationInfo_t *rep,
+*                           struct storageElement *seTo)
+*
+*   Finishes off a replication once the file has been put onto its
+*   destination: sets the group and permissions of the new copy and
+*   registers it in the replica catalogue
+*
 *   Parameters:                                                     [I/O]
 *
-*     (none)
-*    
-*   Returns: (void)
+*    rep     Queue entry of the completed replication                I
+*    seTo    SE structure of the destination node                    I
+*
+*   Returns: 1 on success, 0 if out of memory
 ***********************************************************************/
-void updateReplicationQueue()
+static int finaliseReplication(replicationInfo_t *rep,
+			       struct storageElement *seTo)
+{
+  char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+  digs_error_code_t result;
+  char *pfn;
+  char *group;
+  char *rlsperms, *permissions;
+
+  /* set group */
+  if (safe_asprintf(&pfn, "%s/%s/%s", getNodePath(rep->toNode),
+		    rep->toDir, rep->lfn) < 0) {
+    logMessage(ERROR, "Out of memory processing replication queue");
+    return 0;
+  }
+  if (!getAttrValueFromRLS(rep->lfn, "group", &group)) {
+    logMessage(3, "Using default group ukq for file %s", rep->lfn);
+    group = safe_strdup("ukq");
+  }
+  result = seTo->digs_setGroup(errbuf, pfn, rep->toNode, group);
+  if (result != DIGS_SUCCESS) {
+    logMessage(ERROR, "Error setting group %s for file %s on %s: %s (%s)", group,
+	       rep->lfn, rep->toNode,
+	       digsErrorToString(result), errbuf);
+  }
+  globus_libc_free(group);
+
+  /* set permissions */
+  if (!getAttrValueFromRLS(rep->lfn, "permissions", &rlsperms)) {
+    logMessage(3, "Using default permissions private for file %s", rep->lfn);
+    rlsperms = safe_strdup("private");
+  }
+  permissions = "0644";
+  if (!strcmp(rlsperms, "private")) {
+    permissions = "0640";
+  }
+  globus_libc_free(rlsperms);
+  result = seTo->digs_setPermissions(errbuf, pfn, rep->toNode,
+				     permissions);
+  if (result != DIGS_SUCCESS) {
+    logMessage(ERROR, "Error setting permissions %s for file %s on %s: %s (%s)",
+	       permissions, rep->lfn, rep->toNode,
+	       digsErrorToString(result), errbuf);
+  }
+
+  globus_libc_free(pfn);
+
+  /* Inform the replica catalogue of the file's new
+   * location */
+  if (!registerFileWithRc(rep->toNode, rep->lfn))
+  {
+    logMessage(5, "Error registering new location in "
+	       "replica catalogue");
+  }
+  /*
+   * Add disk attribute here
+   */
+  if (!setDiskInfo(rep->toNode, rep->lfn, rep->toDir))
+  {
+    logMessage(5, "Error setting disk attribute in "
+	       "replica catalogue");
+  }
+
+  updateLastChecked(rep->lfn, rep->fromNode);
+  updateLastChecked(rep->lfn, rep->toNode);
+
+  return 1;
+}
+
+/***********************************************************************
+*   int reserveReplicationBandwidth(replicationInfo_t *rep, char *from,
+*                                   char *to)
+*
+*   Checks with the bandwidth limits whether the next transfer for a
+*   replication may start now. Looks up the file's size if it isn't
+*   known yet
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry                                            I/O
+*    from    Node being read from, or NULL                           I
+*    to      Node being written to, or NULL                          I
+*
+*   Returns: 1 if the transfer may start, 0 if it should wait
+***********************************************************************/
+static int reserveReplicationBandwidth(replicationInfo_t *rep, char *from,
+				       char *to)
+{
+    char *sizestr;
+
+    if ((rep->size < 0) && (getAttrValueFromRLS(rep->lfn, "size", &sizestr)))
+    {
+	rep->size = strtoll(sizestr, NULL, 10);
+	globus_libc_free(sizestr);
+    }
+
+    return reserveBandwidth(from, to, (rep->size < 0) ? 0 : rep->size);
+}
+
+/***********************************************************************
+*   int checkReplicationTransfer(replicationInfo_t *rep,
+*                                struct storageElement *se, char *node,
+*                                digs_transfer_status_t status,
+*                                int percent)
+*
+*   Checks a replication's transfer with its watchdog, cancelling it if
+*   it has stalled, and logs the rate of one that has finished
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry                                            I/O
+*    se      SE the transfer is on                                   I
+*    node    Node the transfer is on                                 I
+*    status  The transfer's status                                   I
+*    percent Its percentage complete                                 I
+*
+*   Returns: 1 if the transfer should carry on, 0 if it was cancelled
+***********************************************************************/
+static int checkReplicationTransfer(replicationInfo_t *rep,
+				    struct storageElement *se, char *node,
+				    digs_transfer_status_t status, int percent)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    double rate;
+
+    if (!checkTransferWatchdog(&rep->watchdog, status, percent))
+    {
+	logMessage(ERROR, "Giving up on transferring %s with %s", rep->lfn,
+		   node);
+	se->digs_cancelTransfer(errbuf, rep->handle);
+	return 0;
+    }
+
+    if (status == DIGS_TRANSFER_DONE)
+    {
+	rate = getTransferWatchdogRate(&rep->watchdog);
+	if (rate > 0.0)
+	{
+	    logMessage(INFO, "Transferred %s with %s at %.1f KB/s", rep->lfn,
+		       node, rate / 1024.0);
+	}
+    }
+    return 1;
+}
+
+/***********************************************************************
+*   void removeTempFile(replicationInfo_t *rep)
+*
+*   Removes the local copy made for a replication, including a partial
+*   one left by a get that didn't finish
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry whose copy to remove                        I
+*
+*   Returns: (void)
+***********************************************************************/
+static void removeTempFile(replicationInfo_t *rep)
+{
+    char *lockedName;
+
+    if (rep->tempName)
+    {
+	unlink(rep->tempName);
+	if (safe_asprintf(&lockedName, "%s-LOCKED", rep->tempName) >= 0)
+	{
+	    unlink(lockedName);
+	    globus_libc_free(lockedName);
+	}
+    }
+}
+
+/***********************************************************************
+*   void retryReplication(replicationInfo_t *rep, int stage)
+*
+*   Called when a transfer for a replication has failed. Sends it back
+*   to the given stage to be tried again, keeping any partial copy so
+*   that the next attempt can resume from it, or drops it once it has
+*   failed REPLICATION_MAX_ATTEMPTS times
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry whose transfer failed                      I/O
+*    stage   Stage to go back to (REPSTAGE_WAITING or WAITING2)      I
+*
+*   Returns: (void)
+***********************************************************************/
+static void retryReplication(replicationInfo_t *rep, int stage)
+{
+    rep->handle = -1;
+    rep->attempts++;
+    if (rep->attempts >= REPLICATION_MAX_ATTEMPTS)
+    {
+	logMessage(ERROR, "Giving up replicating %s from %s to %s after %d attempts",
+		   rep->lfn, rep->fromNode, rep->toNode, rep->attempts);
+	rep->stage = REPSTAGE_DELETEME;
+	return;
+    }
+    logMessage(WARN, "Retrying replication of %s from %s to %s (attempt %d of %d)",
+	       rep->lfn, rep->fromNode, rep->toNode, rep->attempts + 1,
+	       REPLICATION_MAX_ATTEMPTS);
+    rep->stage = stage;
+}
+
+/*
+ * Gets (or puts) that one pass of updateReplicationQueue decides to
+ * start. They are started together at the end of the pass so that all
+ * those from (or to) the same node can go to it as one batch, which
+ * SRM nodes prepare in a single request
+ */
+typedef struct replicationBatch_s
+{
+    int count;
+    int *entries;               /* index of each one in the queue */
+    char **pfns;                /* remote file for each one */
+} replicationBatch_t;
+
+/***********************************************************************
+*   void addToReplicationBatch(replicationBatch_t *batch, int i,
+*                              char *pfn)
+*
+*   Adds a queue entry to a batch of transfers to start
+*
+*   Parameters:                                                     [I/O]
+*
+*    batch   The batch                                              I/O
+*    i       Index of the entry in the queue                         I
+*    pfn     Remote file to transfer. Freed when the batch starts    I
+*
+*   Returns: (void)
+***********************************************************************/
+static void addToReplicationBatch(replicationBatch_t *batch, int i, char *pfn)
+{
+    if (!batch->entries)
+    {
+	batch->entries = globus_libc_malloc(replicationQueueLength_ * sizeof(int));
+	batch->pfns = globus_libc_malloc(replicationQueueLength_ * sizeof(char *));
+	if ((!batch->entries) || (!batch->pfns))
+	{
+	    errorExit("Out of memory in addToReplicationBatch");
+	}
+    }
+    batch->entries[batch->count] = i;
+    batch->pfns[batch->count] = pfn;
+    batch->count++;
+}
+
+/***********************************************************************
+*   void startReplicationBatch(replicationBatch_t *batch, int put)
+*
+*   Starts the transfers in a batch, one call to the storage element for
+*   each node involved, then empties the batch. Entries whose transfer
+*   started move on to the getting or putting stage; the others go back
+*   to wait for another attempt (see retryReplication)
+*
+*   Parameters:                                                     [I/O]
+*
+*    batch   The batch                                              I/O
+*    put     1 if the batch holds puts, 0 for gets                   I
+*
+*   Returns: (void)
+***********************************************************************/
+static void startReplicationBatch(replicationBatch_t *batch, int put)
+{
+    struct storageElement *se;
+    replicationInfo_t *rep;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    const char **pfns, **localPaths;
+    int *entries, *handles;
+    digs_error_code_t *results;
+    char *node, *otherNode;
+    int i, j, n;
+
+    if (batch->count == 0)
+    {
+	return;
+    }
+
+    pfns = globus_libc_malloc(batch->count * sizeof(char *));
+    localPaths = globus_libc_malloc(batch->count * sizeof(char *));
+    entries = globus_libc_malloc(batch->count * sizeof(int));
+    handles = globus_libc_malloc(batch->count * sizeof(int));
+    results = globus_libc_malloc(batch->count * sizeof(digs_error_code_t));
+    if ((!pfns) || (!localPaths) || (!entries) || (!handles) || (!results))
+    {
+	errorExit("Out of memory in startReplicationBatch");
+    }
+
+    for (i = 0; i < batch->count; i++)
+    {
+	if (batch->entries[i] < 0)
+	{
+	    continue;
+	}
+
+	/* gather everything else in the batch for the same node */
+	rep = &replicationQueue_[batch->entries[i]];
+	node = put ? rep->toNode : rep->fromNode;
+	n = 0;
+	for (j = i; j < batch->count; j++)
+	{
+	    if (batch->entries[j] < 0)
+	    {
+		continue;
+	    }
+	    rep = &replicationQueue_[batch->entries[j]];
+	    otherNode = put ? rep->toNode : rep->fromNode;
+	    if (strcmp(node, otherNode))
+	    {
+		continue;
+	    }
+	    entries[n] = batch->entries[j];
+	    pfns[n] = batch->pfns[j];
+	    localPaths[n] = rep->tempName;
+	    n++;
+	    batch->entries[j] = -1;
+	}
+
+	se = getNode(node);
+	if (put)
+	{
+	    startPutTransfers(se, errbuf, node, n, localPaths, pfns, handles,
+			      results);
+	}
+	else
+	{
+	    startGetTransfers(se, errbuf, node, n, pfns, localPaths, handles,
+			      results);
+	}
+
+	for (j = 0; j < n; j++)
+	{
+	    rep = &replicationQueue_[entries[j]];
+	    if (results[j] == DIGS_SUCCESS)
+	    {
+		rep->handle = handles[j];
+		startTransferWatchdog(&rep->watchdog, se, node, rep->handle,
+				      rep->size);
+		rep->stage = put ? REPSTAGE_PUTTING : REPSTAGE_GETTING;
+		journalReplication(rep);
+	    }
+	    else
+	    {
+		if (put)
+		{
+		    logMessage(ERROR, "Error putting %s onto %s: %s", rep->lfn,
+			       node, digsErrorToString(results[j]));
+		}
+		else
+		{
+		    logMessage(ERROR, "Error starting get transfer of %s from %s: %s",
+			       rep->lfn, node, digsErrorToString(results[j]));
+		}
+		/* a failed put can be retried from the local copy */
+		retryReplication(rep, put ? REPSTAGE_WAITING2 :
+				 REPSTAGE_WAITING);
+		if (rep->stage == REPSTAGE_DELETEME)
+		{
+		    journalRemoval(rep->id);
+		}
+		else
+		{
+		    journalReplication(rep);
+		}
+	    }
+	    globus_libc_free((char *) pfns[j]);
+	}
+    }
+
+    globus_libc_free(pfns);
+    globus_libc_free(localPaths);
+    globus_libc_free(entries);
+    globus_libc_free(handles);
+    globus_libc_free(results);
+
+    globus_libc_free(batch->entries);
+    globus_libc_free(batch->pfns);
+    batch->entries = NULL;
+    batch->pfns = NULL;
+    batch->count = 0;
+}
+
+/***********************************************************************
+*   int getReplicationRelay(struct storageElement *seFrom,
+*                           struct storageElement *seTo)
+*
+*   Works out whether a file can be streamed straight from one node to
+*   another without being staged on local disk, and which end does it.
+*   Nodes of the same type relay between themselves; a GridFTP or local
+*   node and an SRM or OMERO one relay through the URL the GridFTP or
+*   local end gives, run by the SRM or OMERO end
+*
+*   Parameters:                                                     [I/O]
+*
+*    seFrom  SE structure of the source node                         I
+*    seTo    SE structure of the destination node                    I
+*
+*   Returns: one of the RELAY_ values
+***********************************************************************/
+static int getReplicationRelay(struct storageElement *seFrom,
+			       struct storageElement *seTo)
+{
+    if (seFrom->storageElementType == seTo->storageElementType)
+    {
+	return (seTo->digs_startRelayTransfer) ? RELAY_SAME_TYPE : RELAY_NONE;
+    }
+    if ((seTo->digs_startPeerRelayTransfer) && (seFrom->digs_getRelayURL))
+    {
+	return RELAY_FROM_PEER;
+    }
+    if ((seFrom->digs_startPeerRelayTransfer) && (seTo->digs_getRelayURL))
+    {
+	return RELAY_TO_PEER;
+    }
+    return RELAY_NONE;
+}
+
+/***********************************************************************
+*   digs_error_code_t startReplicationRelay(char *errbuf,
+*                                           replicationInfo_t *rep,
+*                                           int relay,
+*                                           struct storageElement *seFrom,
+*                                           struct storageElement *seTo,
+*                                           char *pfn, char *toPfn)
+*
+*   Starts streaming a file straight from its source to its destination.
+*   A relay run by the source writes the destination's -LOCKED file,
+*   which is renamed once it has been checked (see unlockRelayedFile);
+*   otherwise the destination's storage element looks after that as for
+*   a put
+*
+*   Parameters:                                                     [I/O]
+*
+*    errbuf  Receives a message on error                             O
+*    rep     Queue entry. Its handle is set                         I/O
+*    relay   How to relay it, from getReplicationRelay               I
+*    seFrom  SE structure of the source node                         I
+*    seTo    SE structure of the destination node                    I
+*    pfn     The file on the source node                             I
+*    toPfn   The file to create on the destination node              I
+*
+*   Returns: A DiGS error code (DIGS_SUCCESS if successful)
+***********************************************************************/
+static digs_error_code_t startReplicationRelay(char *errbuf,
+					       replicationInfo_t *rep,
+					       int relay,
+					       struct storageElement *seFrom,
+					       struct storageElement *seTo,
+					       char *pfn, char *toPfn)
+{
+    digs_error_code_t result;
+    char dirError[MAX_ERROR_MESSAGE_LENGTH];
+    char *url, *lockedPfn, *slash;
+
+    rep->relayFromSource = 0;
+
+    if (relay == RELAY_SAME_TYPE)
+    {
+	return seTo->digs_startRelayTransfer(errbuf, rep->fromNode, pfn,
+					     rep->toNode, toPfn, &rep->handle);
+    }
+
+    if (relay == RELAY_FROM_PEER)
+    {
+	url = seFrom->digs_getRelayURL(rep->fromNode, pfn);
+	result = seTo->digs_startPeerRelayTransfer(errbuf, rep->toNode, toPfn,
+						   rep->fromNode, url, 0,
+						   &rep->handle);
+	globus_libc_free(url);
+	return result;
+    }
+
+    /* the destination's directory must exist for the source to write to */
+    if (safe_asprintf(&lockedPfn, "%s-LOCKED", toPfn) < 0)
+    {
+	errorExit("Out of memory in startReplicationRelay");
+    }
+    slash = strrchr(toPfn, '/');
+    if (slash)
+    {
+	*slash = 0;
+	seTo->digs_mkdirtree(dirError, rep->toNode, toPfn);
+	*slash = '/';
+    }
+
+    url = seTo->digs_getRelayURL(rep->toNode, lockedPfn);
+    result = seFrom->digs_startPeerRelayTransfer(errbuf, rep->fromNode, pfn,
+						 rep->toNode, url, 1,
+						 &rep->handle);
+    if (result == DIGS_SUCCESS)
+    {
+	rep->relayFromSource = 1;
+    }
+    globus_libc_free(url);
+    globus_libc_free(lockedPfn);
+    return result;
+}
+
+/***********************************************************************
+*   int unlockRelayedFile(replicationInfo_t *rep,
+*                         struct storageElement *seTo)
+*
+*   Gives the file written by a relay the source ran, which has been
+*   checked by ending the transfer, its real name on the destination
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry of the relayed replication                  I
+*    seTo    SE structure of the destination node                    I
+*
+*   Returns: 1 on success, 0 on failure
+***********************************************************************/
+static int unlockRelayedFile(replicationInfo_t *rep,
+			     struct storageElement *seTo)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result;
+    char *pfn, *lockedPfn;
+
+    if (safe_asprintf(&pfn, "%s/%s/%s", getNodePath(rep->toNode),
+		      rep->toDir, rep->lfn) < 0)
+    {
+	errorExit("Out of memory in unlockRelayedFile");
+    }
+    if (safe_asprintf(&lockedPfn, "%s-LOCKED", pfn) < 0)
+    {
+	errorExit("Out of memory in unlockRelayedFile");
+    }
+
+    result = seTo->digs_mv(errbuf, rep->toNode, lockedPfn, pfn);
+    if (result != DIGS_SUCCESS)
+    {
+	logMessage(ERROR, "Error renaming %s on %s: %s (%s)", lockedPfn,
+		   rep->toNode, digsErrorToString(result), errbuf);
+	seTo->digs_rm(errbuf, rep->toNode, lockedPfn);
+    }
+    globus_libc_free(lockedPfn);
+    globus_libc_free(pfn);
+    return (result == DIGS_SUCCESS);
+}
+
+/***********************************************************************
+*   void updateReplicationQueue()
+*    
+*   Updates all the replications in the queue, checking to see if any
+*   have completed and should be removed, or if there are any FTP slots
+*   free for starting new replications. This should be called
+*   periodically
+*    
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*    
+*   Returns: (void)
+***********************************************************************/
+void updateReplicationQueue()
 {
     int i;
     int slotsFree;
     int changed;
     int nc;
+    int oldStage;
+    int relay;
 
-    struct storageElement *seFrom, *seTo;
+    struct storageElement *seFrom, *seTo, *se;
+    char *node;
     char errbuf[MAX_ERROR_MESSAGE_LENGTH];
     digs_error_code_t result;
     digs_transfer_status_t status;
     int percent;
 
-    char *pfn;
-    char *group;
-    char *rlsperms, *permissions;
+    char *pfn, *toPfn;
+
+    replicationBatch_t gets = { 0, NULL, NULL };
+    replicationBatch_t puts = { 0, NULL, NULL };
 
     logMessage(1, "updateReplicationQueue()");
 
@@ -270,6 +1258,8 @@ void updateReplicationQueue()
     slotsFree = 1;
     for (i = 0; i < replicationQueueLength_; i++)
     {
+      oldStage = replicationQueue_[i].stage;
+
       /* get SE structs for source and destination */
       seFrom = getNode(replicationQueue_[i].fromNode);
       seTo = getNode(replicationQueue_[i].toNode);
@@ -285,8 +1275,12 @@ void updateReplicationQueue()
 	    logMessage(ERROR, "Transferring %s from %s failed: %s (%s)",
 		       replicationQueue_[i].lfn, replicationQueue_[i].fromNode,
 		       digsErrorToString(result), errbuf);
-	    replicationQueue_[i].stage = REPSTAGE_DELETEME;
-	    replicationQueue_[i].handle = -1;
+	    retryReplication(&replicationQueue_[i], REPSTAGE_WAITING);
+	  }
+	  else if (!checkReplicationTransfer(&replicationQueue_[i], seFrom,
+					     replicationQueue_[i].fromNode,
+					     status, percent)) {
+	    retryReplication(&replicationQueue_[i], REPSTAGE_WAITING);
 	  }
 	  else {
 	    if (status == DIGS_TRANSFER_DONE) {
@@ -296,8 +1290,7 @@ void updateReplicationQueue()
 		logMessage(ERROR, "Transferring %s from %s failed: %s (%s)",
 			   replicationQueue_[i].lfn, replicationQueue_[i].fromNode,
 			   digsErrorToString(result), errbuf);
-		replicationQueue_[i].stage = REPSTAGE_DELETEME;
-		replicationQueue_[i].handle = -1;
+		retryReplication(&replicationQueue_[i], REPSTAGE_WAITING);
 	      }
 	      else {
 		/* get phase completed successfully, wait to start the put */
@@ -308,90 +1301,56 @@ void updateReplicationQueue()
 	  }
 	}
 	else {
-	  /* in the put phase */
-	  result = seTo->digs_monitorTransfer(errbuf, replicationQueue_[i].handle,
-					      &status, &percent);
+	  /* in the put phase, or relaying straight to the destination. A
+	   * relay the source runs is watched on the source */
+	  if (replicationQueue_[i].relayFromSource) {
+	    se = seFrom;
+	    node = replicationQueue_[i].fromNode;
+	  }
+	  else {
+	    se = seTo;
+	    node = replicationQueue_[i].toNode;
+	  }
+	  result = se->digs_monitorTransfer(errbuf, replicationQueue_[i].handle,
+					    &status, &percent);
 	  if (result != DIGS_SUCCESS) {
-	    seTo->digs_endTransfer(errbuf, replicationQueue_[i].handle);
+	    se->digs_endTransfer(errbuf, replicationQueue_[i].handle);
 	    logMessage(ERROR, "Transferring %s to %s failed: %s (%s)",
 		       replicationQueue_[i].lfn, replicationQueue_[i].toNode,
 		       digsErrorToString(result), errbuf);
-	    replicationQueue_[i].stage = REPSTAGE_DELETEME;
-	    replicationQueue_[i].handle = -1;
+	    retryReplication(&replicationQueue_[i],
+			     (replicationQueue_[i].stage == REPSTAGE_RELAYING) ?
+			     REPSTAGE_WAITING : REPSTAGE_WAITING2);
+	  }
+	  else if (!checkReplicationTransfer(&replicationQueue_[i], se, node,
+					     status, percent)) {
+	    retryReplication(&replicationQueue_[i],
+			     (replicationQueue_[i].stage == REPSTAGE_RELAYING) ?
+			     REPSTAGE_WAITING : REPSTAGE_WAITING2);
 	  }
 	  else {
 	    if (status == DIGS_TRANSFER_DONE) {
 	      /* put transfer is complete */
-	      result = seTo->digs_endTransfer(errbuf, replicationQueue_[i].handle);
+	      result = se->digs_endTransfer(errbuf, replicationQueue_[i].handle);
 	      if (result != DIGS_SUCCESS) {
 		logMessage(ERROR, "Transferring %s to %s failed: %s (%s)",
 			   replicationQueue_[i].lfn, replicationQueue_[i].toNode,
 			   digsErrorToString(result), errbuf);
-		replicationQueue_[i].stage = REPSTAGE_DELETEME;
-		replicationQueue_[i].handle = -1;
+		retryReplication(&replicationQueue_[i],
+				 (replicationQueue_[i].stage == REPSTAGE_RELAYING) ?
+				 REPSTAGE_WAITING : REPSTAGE_WAITING2);
+	      }
+	      else if ((replicationQueue_[i].relayFromSource) &&
+		       (!unlockRelayedFile(&replicationQueue_[i], seTo))) {
+		retryReplication(&replicationQueue_[i], REPSTAGE_WAITING);
 	      }
 	      else {
-		/* put phase completed successfully, finalise replication */
-		/* set group */
-		if (safe_asprintf(&pfn, "%s/%s/%s", getNodePath(replicationQueue_[i].toNode),
-				  replicationQueue_[i].toDir, replicationQueue_[i].lfn) < 0) {
-		  logMessage(ERROR, "Out of memory processing replication queue");
+			/* put phase completed successfully, finalise replication */
+		if (!finaliseReplication(&replicationQueue_[i], seTo)) {
+		  startReplicationBatch(&gets, 0);
+		  startReplicationBatch(&puts, 1);
 		  return;
 		}
-		if (!getAttrValueFromRLS(replicationQueue_[i].lfn, "group", &group)) {
-		  logMessage(3, "Using default group ukq for file %s", replicationQueue_[i].lfn);
-		  group = safe_strdup("ukq");
-		}
-		result = seTo->digs_setGroup(errbuf, pfn, replicationQueue_[i].toNode,
-					     group);
-		if (result != DIGS_SUCCESS) {
-		  logMessage(ERROR, "Error setting group %s for file %s on %s: %s (%s)", group,
-			     replicationQueue_[i].lfn, replicationQueue_[i].toNode,
-			     digsErrorToString(result), errbuf);
-		}
-		globus_libc_free(group);
-
-		/* set permissions */
-		if (!getAttrValueFromRLS(replicationQueue_[i].lfn, "permissions", &rlsperms)) {
-		  logMessage(3, "Using default permissions private for file %s", replicationQueue_[i].lfn);
-		  rlsperms = safe_strdup("private");
-		}
-		permissions = "0644";
-		if (!strcmp(rlsperms, "private")) {
-		  permissions = "0640";
-		}
-		globus_libc_free(rlsperms);
-		result = seTo->digs_setPermissions(errbuf, pfn, replicationQueue_[i].toNode,
-						   permissions);
-		if (result != DIGS_SUCCESS) {
-		  logMessage(ERROR, "Error setting permissions %s for file %s on %s: %s (%s)",
-			     permissions, replicationQueue_[i].lfn, replicationQueue_[i].toNode,
-			     digsErrorToString(result), errbuf);
-		}
-
-		globus_libc_free(pfn);
-
-		/* Inform the replica catalogue of the file's new
-		 * location */
-		if (!registerFileWithRc(replicationQueue_[i].toNode,
-					replicationQueue_[i].lfn)) 
-		{
-		  logMessage(5, "Error registering new location in "
-			     "replica catalogue");
-		}
-		/*
-		 * Add disk attribute here
-		 */
-		if (!setDiskInfo(replicationQueue_[i].toNode,
-				 replicationQueue_[i].lfn,
-				 replicationQueue_[i].toDir))
-		{
-		  logMessage(5, "Error setting disk attribute in "
-			     "replica catalogue");
-		}
-
-		updateLastChecked(replicationQueue_[i].lfn, replicationQueue_[i].fromNode);
-		updateLastChecked(replicationQueue_[i].lfn, replicationQueue_[i].toNode);
 
 		/* done! */
 		replicationQueue_[i].stage = REPSTAGE_DELETEME;
@@ -407,10 +1366,16 @@ void updateReplicationQueue()
 	  /* time to start get operation */
 	  /* check this is still necessary */
 	  nc = getNumCopies(replicationQueue_[i].lfn, 0);
+	  relay = getReplicationRelay(seFrom, seTo);
 	  if ((nc >= getFileReplicaCount(replicationQueue_[i].lfn)) &&
 	      (replicationQueue_[i].reason == REPTYPE_TOOFEWCOPIES)) {
 	    replicationQueue_[i].stage = REPSTAGE_DELETEME;
 	  }
+	  else if (!reserveReplicationBandwidth(&replicationQueue_[i],
+						replicationQueue_[i].fromNode,
+						relay ? replicationQueue_[i].toNode : NULL)) {
+	    /* over the bandwidth limit, leave it until later */
+	  }
 	  else {
 	    /* start get operation */
 	    pfn = constructFilename(replicationQueue_[i].fromNode, replicationQueue_[i].lfn);
@@ -419,27 +1384,64 @@ void updateReplicationQueue()
 			 replicationQueue_[i].lfn, replicationQueue_[i].fromNode);
 	      replicationQueue_[i].stage = REPSTAGE_DELETEME;
 	    }
-	    else {
-	      result = seFrom->digs_startGetTransfer(errbuf, replicationQueue_[i].fromNode,
-						     pfn, replicationQueue_[i].tempName,
-						     &replicationQueue_[i].handle);
-	      if (result == DIGS_SUCCESS) {
-		replicationQueue_[i].stage = REPSTAGE_GETTING;
+	    else if (relay) {
+	      /* stream it straight across without staging it locally */
+	      if (!replicationQueue_[i].toDir) {
+		replicationQueue_[i].toDir = chooseDataDisk(replicationQueue_[i].toNode);
 	      }
-	      else {
-		logMessage(ERROR, "Error starting get transfer of %s from %s: %s (%s)",
+	      if (!replicationQueue_[i].toDir) {
+		replicationQueue_[i].toDir = safe_strdup("data");
+	      }
+
+	      if (safe_asprintf(&toPfn, "%s/%s/%s", getNodePath(replicationQueue_[i].toNode),
+				replicationQueue_[i].toDir, replicationQueue_[i].lfn) < 0) {
+		logMessage(ERROR, "Out of memory processing replication queue");
+		globus_libc_free(pfn);
+		startReplicationBatch(&gets, 0);
+		startReplicationBatch(&puts, 1);
+		return;
+	      }
+
+	      result = startReplicationRelay(errbuf, &replicationQueue_[i], relay,
+					     seFrom, seTo, pfn, toPfn);
+	      if (result == DIGS_SUCCESS) {
+		replicationQueue_[i].stage = REPSTAGE_RELAYING;
+		if (replicationQueue_[i].relayFromSource) {
+		  startTransferWatchdog(&replicationQueue_[i].watchdog, seFrom,
+					replicationQueue_[i].fromNode,
+					replicationQueue_[i].handle,
+					replicationQueue_[i].size);
+		}
+		else {
+		  startTransferWatchdog(&replicationQueue_[i].watchdog, seTo,
+					replicationQueue_[i].toNode,
+					replicationQueue_[i].handle,
+					replicationQueue_[i].size);
+		}
+	      }
+	      else {
+		logMessage(ERROR, "Error relaying %s from %s to %s: %s (%s)",
 			   replicationQueue_[i].lfn, replicationQueue_[i].fromNode,
-			   digsErrorToString(result), errbuf);
+			   replicationQueue_[i].toNode, digsErrorToString(result), errbuf);
 		replicationQueue_[i].stage = REPSTAGE_DELETEME;
 	      }
+	      globus_libc_free(toPfn);
 	      globus_libc_free(pfn);
 	    }
+	    else {
+	      /* started with the others from the same node at the end */
+	      addToReplicationBatch(&gets, i, pfn);
+	    }
 	  }
 	}
-	else if (replicationQueue_[i].stage == REPSTAGE_WAITING2) {
+	else if ((replicationQueue_[i].stage == REPSTAGE_WAITING2) &&
+		 (reserveReplicationBandwidth(&replicationQueue_[i], NULL,
+					      replicationQueue_[i].toNode))) {
 	  /* time to start put operation */
-	  /* choose data disk */
-	  replicationQueue_[i].toDir = chooseDataDisk(replicationQueue_[i].toNode);
+	  /* choose data disk, unless a failed attempt left a partial file on one */
+	  if (!replicationQueue_[i].toDir) {
+	    replicationQueue_[i].toDir = chooseDataDisk(replicationQueue_[i].toNode);
+	  }
 	  if (!replicationQueue_[i].toDir) {
 	    replicationQueue_[i].toDir = safe_strdup("data");
 	  }
@@ -448,25 +1450,30 @@ void updateReplicationQueue()
 	  if (safe_asprintf(&pfn, "%s/%s/%s", getNodePath(replicationQueue_[i].toNode),
 			    replicationQueue_[i].toDir, replicationQueue_[i].lfn) < 0) {
 	    logMessage(ERROR, "Out of memory processing replication queue");
+	    startReplicationBatch(&gets, 0);
+	    startReplicationBatch(&puts, 1);
 	    return;
 	  }
 
-	  result = seTo->digs_startPutTransfer(errbuf, replicationQueue_[i].toNode,
-					       replicationQueue_[i].tempName, pfn,
-					       &replicationQueue_[i].handle);
-	  if (result == DIGS_SUCCESS) {
-	    replicationQueue_[i].stage = REPSTAGE_PUTTING;
-	  }
-	  else {
-	    logMessage(ERROR, "Error putting %s onto %s: %s (%s)", replicationQueue_[i].lfn,
-		       replicationQueue_[i].toNode, digsErrorToString(result), errbuf);
-	    replicationQueue_[i].stage = REPSTAGE_DELETEME;
-	  }
-	  globus_libc_free(pfn);
+	  /* started with the others to the same node at the end */
+	  addToReplicationBatch(&puts, i, pfn);
+	}
+      }
+
+      /* record any change of stage before moving on */
+      if (replicationQueue_[i].stage != oldStage) {
+	if (replicationQueue_[i].stage == REPSTAGE_DELETEME) {
+	  journalRemoval(replicationQueue_[i].id);
+	}
+	else {
+	  journalReplication(&replicationQueue_[i]);
 	}
       }
     }
 
+    startReplicationBatch(&gets, 0);
+    startReplicationBatch(&puts, 1);
+
     /*
      * Delete any "DELETEME" replications
      */
@@ -480,27 +1487,524 @@ void updateReplicationQueue()
 	    {
 		changed = 1;
 		/* make sure the temporary file gets deleted */
-		unlink(replicationQueue_[i].tempName);
-		globus_libc_free(replicationQueue_[i].lfn);
-		globus_libc_free(replicationQueue_[i].toNode);
-		globus_libc_free(replicationQueue_[i].fromNode);
-		globus_libc_free(replicationQueue_[i].tempName);
-		if (replicationQueue_[i].toDir)
-		{
-		    globus_libc_free(replicationQueue_[i].toDir);
-		}
-		
-		replicationQueueLength_--;
+		removeTempFile(&replicationQueue_[i]);
+		removeFromQueue(i);
+		break;
+	    }
+	}
+    } while (changed);
 
-		for (; i < replicationQueueLength_; i++)
-		{
-		    replicationQueue_[i] = replicationQueue_[i+1];
-		}
+    /* The journal has everything else, and a pass that changed nothing
+     * has nothing to save */
+    if ((replicationQueueDirty_) ||
+	(journalRecords_ >= REPQUEUE_JOURNAL_MAX_RECORDS))
+    {
+	saveReplicationQueue();
+    }
+}
+
+/***********************************************************************
+*   int applyReplicationRecord(char *line)
+*
+*   Applies one record from the snapshot or journal to the in-memory
+*   queue
+*
+*   Parameters:                                                     [I/O]
+*
+*    line    The record, without its line ending                     I
+*
+*   Returns: 1 on success, 0 if the record is malformed
+***********************************************************************/
+static int applyReplicationRecord(char *line)
+{
+    int id, reason, priority, stage, numCopies;
+    int rep, lfnPos, n;
+    char *from, *to, *toDir, *tempName;
+
+    if (line[0] == 'D')
+    {
+	if (sscanf(line, "D %d", &id) != 1)
+	{
+	    return 0;
+	}
+	rep = findReplication(id);
+	if (rep >= 0)
+	{
+	    removeFromQueue(rep);
+	}
+	return 1;
+    }
+
+    if (line[0] != 'R')
+    {
+	return 0;
+    }
+
+    from = globus_libc_malloc(strlen(line) + 1);
+    to = globus_libc_malloc(strlen(line) + 1);
+    toDir = globus_libc_malloc(strlen(line) + 1);
+    tempName = globus_libc_malloc(strlen(line) + 1);
+    if ((!from) || (!to) || (!toDir) || (!tempName))
+    {
+	errorExit("Out of memory in applyReplicationRecord");
+    }
+
+    lfnPos = 0;
+    n = sscanf(line, "R %d %d %d %d %d %s %s %s %s %n", &id, &reason,
+	       &priority, &stage, &numCopies, from, to, toDir, tempName,
+	       &lfnPos);
+    if ((n != 9) || (lfnPos == 0) || (line[lfnPos] == 0))
+    {
+	globus_libc_free(from);
+	globus_libc_free(to);
+	globus_libc_free(toDir);
+	globus_libc_free(tempName);
+	return 0;
+    }
+
+    /* A later record for the same replication replaces the earlier one */
+    rep = findReplication(id);
+    if (rep >= 0)
+    {
+	removeFromQueue(rep);
+    }
+
+    rep = makeQueueSlot(priority, numCopies);
+    replicationQueue_[rep].id = id;
+    replicationQueue_[rep].reason = reason;
+    replicationQueue_[rep].priority = priority;
+    replicationQueue_[rep].stage = stage;
+    replicationQueue_[rep].numCopies = numCopies;
+    replicationQueue_[rep].lfn = safe_strdup(&line[lfnPos]);
+    replicationQueue_[rep].fromNode = safe_strdup(from);
+    replicationQueue_[rep].toNode = safe_strdup(to);
+    replicationQueue_[rep].toDir = strcmp(toDir, "-") ? safe_strdup(toDir) : NULL;
+    replicationQueue_[rep].tempName = strcmp(tempName, "-") ? safe_strdup(tempName) : NULL;
+    replicationQueue_[rep].handle = -1;
+    replicationQueue_[rep].attempts = 0;
+    replicationQueue_[rep].relayFromSource = 0;
+    replicationQueue_[rep].size = -1;
+
+    if (id >= nextRepId_)
+    {
+	nextRepId_ = id + 1;
+    }
+
+    globus_libc_free(from);
+    globus_libc_free(to);
+    globus_libc_free(toDir);
+    globus_libc_free(tempName);
+    return 1;
+}
+
+/***********************************************************************
+*   void replayReplicationFile(char *name)
+*
+*   Reads all the records from one of the replication queue's state
+*   files and applies them to the in-memory queue
+*
+*   Parameters:                                                     [I/O]
+*
+*    name    Name of the file within the QCDgrid directory           I
+*
+*   Returns: (void)
+***********************************************************************/
+static void replayReplicationFile(char *name)
+{
+    char *filename;
+    char *lineBuffer = NULL;
+    int lineBufferSize = 0;
+    FILE *f;
+
+    filename = getReplicationQueueFilename(name);
+    f = fopen(filename, "r");
+    globus_libc_free(filename);
+
+    /* Might not have been created yet */
+    if (!f)
+    {
+	return;
+    }
+
+    safe_getline(&lineBuffer, &lineBufferSize, f);
+    while (!feof(f))
+    {
+	removeCrlf(lineBuffer);
+
+	/*
+	 * A malformed line is most likely a record that was only partly
+	 * written when the thread died, so skip it and carry on
+	 */
+	if ((lineBuffer[0]) && (!applyReplicationRecord(lineBuffer)))
+	{
+	    logMessage(5, "Warning: malformed record in replication queue "
+		       "file %s", name);
+	}
+	safe_getline(&lineBuffer, &lineBufferSize, f);
+    }
+
+    if (lineBuffer)
+    {
+	globus_libc_free(lineBuffer);
+    }
+    fclose(f);
+}
+
+/***********************************************************************
+*   void discardTempFile(replicationInfo_t *rep)
+*
+*   Removes any (partial) local copy made for a replication and gives
+*   it a fresh temporary file, so that the get can be started again
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry to reset                                   I/O
+*
+*   Returns: (void)
+***********************************************************************/
+static void discardTempFile(replicationInfo_t *rep)
+{
+    if (rep->tempName)
+    {
+	removeTempFile(rep);
+	globus_libc_free(rep->tempName);
+    }
+    rep->tempName = getTemporaryFile();
+}
+
+/***********************************************************************
+*   int tempFileIsComplete(replicationInfo_t *rep)
+*
+*   Checks whether the local copy for a replication was fully fetched,
+*   by comparing its size with the size in the replica catalogue
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry to check                                    I
+*
+*   Returns: 1 if the local copy is complete, 0 if not
+***********************************************************************/
+static int tempFileIsComplete(replicationInfo_t *rep)
+{
+    struct stat statbuf;
+    char *sizestr;
+    long long size;
+
+    if ((!rep->tempName) || (stat(rep->tempName, &statbuf) < 0))
+    {
+	return 0;
+    }
+
+    if (!getAttrValueFromRLS(rep->lfn, "size", &sizestr))
+    {
+	logMessage(5, "Getting size attribute failed for %s", rep->lfn);
+	return 0;
+    }
+    size = strtoll(sizestr, NULL, 10);
+    globus_libc_free(sizestr);
+
+    return (size == (long long) statbuf.st_size);
+}
+
+/***********************************************************************
+*   void recoverReplication(replicationInfo_t *rep)
+*
+*   Brings a queue entry loaded from disk back to a state from which
+*   updateReplicationQueue can carry on. Transfers that were in
+*   progress when the thread stopped are cleaned up and either resumed
+*   from the local copy or restarted from the beginning
+*
+*   Parameters:                                                     [I/O]
+*
+*    rep     Queue entry to recover                                 I/O
+*
+*   Returns: (void)
+***********************************************************************/
+static void recoverReplication(replicationInfo_t *rep)
+{
+    struct storageElement *seTo;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result;
+    char *pfn, *lockedPfn, *lockedName;
+    int exists;
 
+    switch (rep->stage)
+    {
+    case REPSTAGE_WAITING:
+	/*
+	 * Temporary directory may have been cleared out since. A partial
+	 * file left by an earlier attempt is kept for the get to resume
+	 */
+	if (rep->tempName)
+	{
+	    if (safe_asprintf(&lockedName, "%s-LOCKED", rep->tempName) < 0)
+	    {
+		errorExit("Out of memory in recoverReplication");
+	    }
+	    exists = (access(lockedName, F_OK) == 0);
+	    globus_libc_free(lockedName);
+	    if (exists)
+	    {
 		break;
 	    }
 	}
-    } while (changed);
+	if ((!rep->tempName) || (access(rep->tempName, F_OK) < 0))
+	{
+	    discardTempFile(rep);
+	}
+	break;
+
+    case REPSTAGE_GETTING:
+	/* The partly fetched file is kept so that the get can resume */
+	logMessage(3, "Resuming interrupted get of %s from %s", rep->lfn,
+		   rep->fromNode);
+	rep->stage = REPSTAGE_WAITING;
+	break;
+
+    case REPSTAGE_WAITING2:
+	if (!tempFileIsComplete(rep))
+	{
+	    logMessage(3, "Local copy of %s is incomplete, fetching again",
+		       rep->lfn);
+	    discardTempFile(rep);
+	    rep->stage = REPSTAGE_WAITING;
+	}
+	break;
+
+    case REPSTAGE_DONE:
+    case REPSTAGE_PUTTING:
+    case REPSTAGE_RELAYING:
+	seTo = getNode(rep->toNode);
+	if ((!seTo) || (!rep->toDir))
+	{
+	    discardTempFile(rep);
+	    rep->stage = REPSTAGE_WAITING;
+	    break;
+	}
+
+	if (safe_asprintf(&pfn, "%s/%s/%s", getNodePath(rep->toNode),
+			  rep->toDir, rep->lfn) < 0)
+	{
+	    errorExit("Out of memory in recoverReplication");
+	}
+
+	/*
+	 * The destination only gets its real name once the put has been
+	 * verified, so if it's there the replication just needs to be
+	 * registered
+	 */
+	result = seTo->digs_doesExist(errbuf, pfn, rep->toNode, &exists);
+	if ((result == DIGS_SUCCESS) && (exists))
+	{
+	    logMessage(3, "Put of %s to %s completed, finalising", rep->lfn,
+		       rep->toNode);
+	    if (finaliseReplication(rep, seTo))
+	    {
+		rep->stage = REPSTAGE_DELETEME;
+	    }
+	    globus_libc_free(pfn);
+	    break;
+	}
+
+	/*
+	 * Otherwise the put can resume from the partly written destination
+	 * file, as long as the local copy it came from is still complete.
+	 * Relays always start again from the beginning
+	 */
+	if ((rep->stage != REPSTAGE_RELAYING) && (tempFileIsComplete(rep)))
+	{
+	    logMessage(3, "Resuming interrupted put of %s to %s", rep->lfn,
+		       rep->toNode);
+	    globus_libc_free(pfn);
+	    rep->stage = REPSTAGE_WAITING2;
+	    break;
+	}
+
+	logMessage(3, "Restarting interrupted transfer of %s to %s", rep->lfn,
+		   rep->toNode);
+	if (safe_asprintf(&lockedPfn, "%s-LOCKED", pfn) < 0)
+	{
+	    errorExit("Out of memory in recoverReplication");
+	}
+	result = seTo->digs_rm(errbuf, rep->toNode, lockedPfn);
+	if ((result != DIGS_SUCCESS) && (result != DIGS_FILE_NOT_FOUND))
+	{
+	    logMessage(3, "Could not remove %s on %s: %s (%s)", lockedPfn,
+		       rep->toNode, digsErrorToString(result), errbuf);
+	}
+	globus_libc_free(lockedPfn);
+	globus_libc_free(pfn);
+
+	globus_libc_free(rep->toDir);
+	rep->toDir = NULL;
+
+	if (tempFileIsComplete(rep))
+	{
+	    rep->stage = REPSTAGE_WAITING2;
+	}
+	else
+	{
+	    discardTempFile(rep);
+	    rep->stage = REPSTAGE_WAITING;
+	}
+	break;
+
+    default:
+	rep->stage = REPSTAGE_DELETEME;
+	break;
+    }
+}
+
+/***********************************************************************
+*   int loadReplicationQueue()
+*
+*   Restores the replication queue saved by a previous run of the
+*   control thread, replaying the journal on top of the last snapshot
+*   and recovering any replications that were in progress. Should be
+*   called once at startup, after the node list has been loaded
+*
+*   Parameters:                                                     [I/O]
+*
+*     (none)
+*
+*   Returns: 1 on success, 0 on error
+***********************************************************************/
+int loadReplicationQueue()
+{
+    int i;
+
+    logMessage(1, "loadReplicationQueue()");
+
+    replayReplicationFile(REPQUEUE_SNAPSHOT);
+    replayReplicationFile(REPQUEUE_JOURNAL);
+
+    for (i = 0; i < replicationQueueLength_; i++)
+    {
+	recoverReplication(&replicationQueue_[i]);
+    }
+
+    /* Drop anything that finished or failed */
+    i = 0;
+    while (i < replicationQueueLength_)
+    {
+	if (replicationQueue_[i].stage == REPSTAGE_DELETEME)
+	{
+	    if (replicationQueue_[i].tempName)
+	    {
+		unlink(replicationQueue_[i].tempName);
+	    }
+	    removeFromQueue(i);
+	}
+	else
+	{
+	    i++;
+	}
+    }
+
+    logMessage(3, "Restored %d replications from previous run",
+	       replicationQueueLength_);
+
+    /* Start the new run with a clean snapshot and an empty journal */
+    saveReplicationQueue();
+    return 1;
+}
+
+/***********************************************************************
+*   int setReplicationPriority(int id, int priority)
+*
+*   Changes the priority of a queued replication, moving it to its new
+*   position in the queue
+*
+*   Parameters:                                                     [I/O]
+*
+*    id        ID of the replication                                 I
+*    priority  New priority (higher is sooner)                       I
+*
+*   Returns: 1 on success, 0 if there is no such replication
+***********************************************************************/
+int setReplicationPriority(int id, int priority)
+{
+    replicationInfo_t rep;
+    int i;
+
+    logMessage(1, "setReplicationPriority(%d,%d)", id, priority);
+
+    i = findReplication(id);
+    if (i < 0)
+    {
+	return 0;
+    }
+
+    /* Take it out of the queue and reinsert it at the right place */
+    rep = replicationQueue_[i];
+    replicationQueueLength_--;
+    for (; i < replicationQueueLength_; i++)
+    {
+	replicationQueue_[i] = replicationQueue_[i+1];
+    }
+
+    i = makeQueueSlot(priority, rep.numCopies);
+    replicationQueue_[i] = rep;
+    replicationQueue_[i].priority = priority;
+
+    journalReplication(&replicationQueue_[i]);
+    return 1;
+}
+
+/***********************************************************************
+*   int cancelReplication(int id)
+*
+*   Cancels a queued replication, aborting its transfer if one is in
+*   progress. The entry is removed on the next queue update
+*
+*   Parameters:                                                     [I/O]
+*
+*    id      ID of the replication                                   I
+*
+*   Returns: 1 on success, 0 if there is no such replication
+***********************************************************************/
+int cancelReplication(int id)
+{
+    struct storageElement *se;
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result;
+    int i;
+
+    logMessage(1, "cancelReplication(%d)", id);
+
+    i = findReplication(id);
+    if ((i < 0) || (replicationQueue_[i].stage == REPSTAGE_DELETEME))
+    {
+	return 0;
+    }
+
+    if (replicationQueue_[i].handle >= 0)
+    {
+	if ((replicationQueue_[i].stage == REPSTAGE_GETTING) ||
+	    (replicationQueue_[i].relayFromSource))
+	{
+	    se = getNode(replicationQueue_[i].fromNode);
+	}
+	else
+	{
+	    se = getNode(replicationQueue_[i].toNode);
+	}
+	if (se)
+	{
+	    result = se->digs_cancelTransfer(errbuf, replicationQueue_[i].handle);
+	    if (result != DIGS_SUCCESS)
+	    {
+		logMessage(3, "Error cancelling transfer of %s: %s (%s)",
+			   replicationQueue_[i].lfn, digsErrorToString(result),
+			   errbuf);
+	    }
+	}
+	replicationQueue_[i].handle = -1;
+    }
+
+    replicationQueue_[i].stage = REPSTAGE_DELETEME;
+    journalRemoval(id);
+    return 1;
 }
 
 /*
@@ -55,10 +55,15 @@ enum { REPSTAGE_WAITING,    /* Waiting for a free gridftp slot to do transfer */
        REPSTAGE_GETTING,    /* The get operation is in progress */
        REPSTAGE_WAITING2,   /* Waiting for free slot to do second part of transfer */
        REPSTAGE_PUTTING,    /* The put operation is in progress */
+       REPSTAGE_RELAYING,   /* Streaming directly from source to destination */
 };
 
 void addToReplicationQueue(char *from, char *to, char *lfn, int reason);
 void updateReplicationQueue();
 void buildAllowedInconsistenciesList();
 
+int loadReplicationQueue();
+int setReplicationPriority(int id, int priority);
+int cancelReplication(int id);
+
 #endif
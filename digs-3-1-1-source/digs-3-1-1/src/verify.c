@@ -47,6 +47,7 @@
 #include "node.h"
 #include "verify.h"
 #include "hashtable.h"
+#include "bandwidth.h"
 
 /*
  * Counters which are used to print some statistics at the end of the
@@ -1167,6 +1168,7 @@ static int checkOneFile(char *filename, char *host,
 			  char *permStr;
 			  long long fileSize;
 			  char sizebuf[50];
+			  digs_stat_t fileStat;
 
 			  /*
 			   * FIXME: won't work for multi-disk nodes, but we can't use
@@ -1181,48 +1183,48 @@ static int checkOneFile(char *filename, char *host,
 			  }
 			  
 			  /*
-			   * Get attributes from the node
+			   * Get attributes from the node, all in one go
 			   */
-			  if (se->digs_getGroup(errbuf, pfn, host, &groupAttr) != DIGS_SUCCESS) {
-			    logMessage(ERROR, "Error getting group for %s", filename);
+			  if (se->digs_stat(errbuf, pfn, host, &fileStat) != DIGS_SUCCESS) {
+			    logMessage(ERROR, "Error getting details of %s", filename);
+			    digs_freeStat(&fileStat);
 			    globus_libc_free(pfn);
 			    unrepairedInconsistencies_++;
 			    return 0;
 			  }
-			  if (se->digs_getOwner(errbuf, pfn, host, &ownerAttr) != DIGS_SUCCESS) {
-			    logMessage(ERROR, "Error getting owner for %s", filename);
-			    globus_libc_free(groupAttr);
+			  if ((!fileStat.group) || (!fileStat.owner) || (!fileStat.permissions) ||
+			      (fileStat.size < 0)) {
+			    logMessage(ERROR, "Node did not return all attributes for %s", filename);
+			    digs_freeStat(&fileStat);
 			    globus_libc_free(pfn);
 			    unrepairedInconsistencies_++;
 			    return 0;
 			  }
-			  if (se->digs_getChecksum(errbuf, pfn, host, &md5Attr, DIGS_MD5_CHECKSUM) != DIGS_SUCCESS) {
-			    logMessage(ERROR, "Error getting checksum for %s", filename);
-			    globus_libc_free(pfn);
-			    globus_libc_free(groupAttr);
-			    globus_libc_free(ownerAttr);
-			    unrepairedInconsistencies_++;
-			    return 0;
-			  }
-			  if (se->digs_getPermissions(errbuf, pfn, host, &permsAttr) != DIGS_SUCCESS) {
-			    logMessage(ERROR, "Error getting group for %s", filename);
-			    globus_libc_free(pfn);
-			    globus_libc_free(groupAttr);
-			    globus_libc_free(ownerAttr);
-			    globus_libc_free(md5Attr);
-			    unrepairedInconsistencies_++;
-			    return 0;
+
+			  /*
+			   * Only go back for the checksum if the node didn't keep one
+			   */
+			  if ((fileStat.checksum) && (fileStat.checksumType == DIGS_MD5_CHECKSUM)) {
+			    md5Attr = fileStat.checksum;
+			    fileStat.checksum = NULL;
 			  }
-			  if (se->digs_getLength(errbuf, pfn, host, &fileSize) != DIGS_SUCCESS) {
-			    logMessage(ERROR, "Error getting group for %s", filename);
-			    globus_libc_free(groupAttr);
-			    globus_libc_free(ownerAttr);
-			    globus_libc_free(md5Attr);
-			    globus_libc_free(permsAttr);
+			  else if (se->digs_getChecksum(errbuf, pfn, host, &md5Attr, DIGS_MD5_CHECKSUM) != DIGS_SUCCESS) {
+			    logMessage(ERROR, "Error getting checksum for %s", filename);
+			    digs_freeStat(&fileStat);
 			    globus_libc_free(pfn);
 			    unrepairedInconsistencies_++;
 			    return 0;
 			  }
+
+			  /* take the strings over from the stat structure */
+			  groupAttr = fileStat.group;
+			  ownerAttr = fileStat.owner;
+			  permsAttr = fileStat.permissions;
+			  fileSize = fileStat.size;
+			  fileStat.group = NULL;
+			  fileStat.owner = NULL;
+			  fileStat.permissions = NULL;
+			  digs_freeStat(&fileStat);
 			  globus_libc_free(pfn);
 			  
 			  /*
@@ -1299,6 +1301,109 @@ static int checkOneFile(char *filename, char *host,
     return 1;
 }
 
+/*
+ * What verifyScannedFile needs to check each file found on a node
+ */
+typedef struct verify_scan_s
+{
+    char *host;
+    int pathlen;                /* length of node path, with its slash */
+    qcdgrid_hash_table_t *ignore;
+    qcdgrid_hash_table_t *ht;
+    qcdgrid_hash_table_t *rcFiles;
+    int numRcDisks;
+    qcdgrid_hash_table_t **fileDisksList;
+    int interactive;
+    qcdgrid_hash_table_t *group_d;
+    qcdgrid_hash_table_t *permissions_d;
+    qcdgrid_hash_table_t *md5sum_d;
+    qcdgrid_hash_table_t *size_d;
+    qcdgrid_hash_table_t *submitter_d;
+    struct storageElement *se;
+    int failed;                 /* set if a check stopped the scan */
+} verify_scan_t;
+
+/***********************************************************************
+*   int verifyScannedFile(const char *path, void *param)
+*    
+*   Scan callback for verifyReplicaCatalogue. Works out which data disk
+*   and logical file a path on the node is, and runs checkOneFile on it
+*    
+*   Parameters:                                       [I/O]
+*
+*     path    full path of the file on the node        I
+*     param   the verify_scan_t for the node           I/O
+*    
+*   Returns: 1 to carry on scanning, 0 if a check failed
+***********************************************************************/
+static int verifyScannedFile(const char *path, void *param)
+{
+    verify_scan_t *scan = (verify_scan_t *)param;
+    int pathlen = scan->pathlen;
+    int disknum = 0;
+    char diskname[10];
+    char *line;
+    char *lfn;
+    int ok;
+
+    /* check filename is right sort of path */
+    if ((strlen(path) < (pathlen + 6)) ||
+	(path[pathlen] != 'd') ||
+	(path[pathlen+1] != 'a') ||
+	(path[pathlen+2] != 't') ||
+	(path[pathlen+3] != 'a')) {
+	globus_libc_fprintf(stderr, "Invalid line '%s' returned\n", path);
+	/* skip it */
+	return 1;
+    }
+
+    /* the path is only valid during the callback */
+    line = safe_strdup(path);
+    if (!line) errorExit("Out of memory in verifyScannedFile");
+
+    /* get data directory name and start of lfn */
+    lfn = &line[pathlen+5];
+    if (line[pathlen+4] == '/') {
+	sprintf(diskname, "data");
+    }
+    else {
+	disknum = line[pathlen+4] - '0';
+	lfn++;
+	if (isdigit(line[pathlen+5])) {
+	    disknum = disknum*10 + (line[pathlen+5] - '0');
+	    lfn++;
+	}
+	sprintf(diskname, "data%d", disknum);
+    }
+
+    if ((disknum+1) > numDisksOnCurrentNode_) {
+	numDisksOnCurrentNode_ = disknum + 1;
+	logMessage(3, "Found disk %s on %s", diskname, scan->host);
+    }
+
+    /* ignore contents of NEW directory */
+    if (!strncmp(lfn, "NEW/", 4)) {
+	globus_libc_fprintf(stderr, "Skipping %s\n", lfn);
+	globus_libc_free(line);
+	return 1;
+    }
+
+    /* run checks on this file */
+    ok = checkOneFile(lfn, scan->host, scan->ignore, scan->ht, scan->rcFiles,
+		      disknum, scan->numRcDisks,
+		      diskname, scan->fileDisksList,
+		      scan->interactive, 
+		      scan->group_d, scan->permissions_d, scan->md5sum_d,
+		      scan->size_d, scan->submitter_d, scan->se);
+    globus_libc_free(line);
+
+    if (!ok) {
+	scan->failed = 1;
+	return 0;
+    }
+    return 1;
+}
+
 /***********************************************************************
 *   void verifyReplicaCatalogue(char *host, int interactive)
 *    
@@ -1306,10 +1411,9 @@ static int checkOneFile(char *filename, char *host,
 *   host
 *    
 *   Algorithm: Reads all the filenames registered at the host from the
-*   replica catalogue into rcContents. Reads all the filenames
-*   actually in the host's storage directory by remotely executing
-*   scannode on it, storing the output in nodeContents. Then, for each 
-*   filename in nodeContents, looks for the same filename in rcContents.
+*   replica catalogue into rcContents. Scans the host's storage
+*   directories, and as each file is found, looks for the same filename
+*   in rcContents.
 *   If it finds it, marks the filename in rcContents as "found".
 *   If it doesn't find it, the file is missing from the replica
 *   catalogue. In interactive mode, the user is given the options of 
@@ -1334,12 +1438,8 @@ static void verifyReplicaCatalogue(char *host, int interactive)
     char **rcContents;
     int i;
 
-    /* used for extracting all attributes from RLS */
-    qcdgrid_hash_table_t *md5sum_d;
-    qcdgrid_hash_table_t *submitter_d;
-    qcdgrid_hash_table_t *group_d;
-    qcdgrid_hash_table_t *size_d;
-    qcdgrid_hash_table_t *permissions_d;
+    /* passed to verifyScannedFile for each file on the node */
+    verify_scan_t scan;
 
     /*
      * This hash table will be initialised with all the filenames read from the
@@ -1365,13 +1465,6 @@ static void verifyReplicaCatalogue(char *host, int interactive)
     char errbuf[MAX_ERROR_MESSAGE_LENGTH];
     digs_error_code_t result;
 
-    char **list;
-    int listLength;
-    int pathlen;
-    int disknum = 0;
-    char diskname[10];
-    char *lfn;
-
     logMessage(3, "Processing host %s", host);
 
     /* get storage element struct for node */
@@ -1422,150 +1515,89 @@ static void verifyReplicaCatalogue(char *host, int interactive)
 
     freeLocationFileList(rcContents);
 
-    /* Get files actually stored at node */
-    result = se->digs_scanNode(errbuf, host, &list, &listLength, 0);
-    if (result != DIGS_SUCCESS) {
-      logMessage(ERROR, "Error scanning node %s: %s (%s)", host,
-		 digsErrorToString(result), errbuf);
-      destroyFileDisksList(fileDisksList);
-      destroyHashTable(rcFiles);
-      return;
-    }
-
-    /* get length in characters of initial path to remove */
-    pathlen = strlen(getNodePath(host));
-    if (getNodePath(host)[pathlen-1] != '/') pathlen++;
-
-    /* First count the number of storage dirs */
-    numDisksOnCurrentNode_ = 0;
-    for (i = 0; i < listLength; i++) {
-      if (strlen(list[i]) < (pathlen+6)) {
-	logMessage(3, "Skipping bad line '%s'", list[i]);
-	continue;
-      }
-
-      if ((list[i][pathlen] != 'd') ||
-	  (list[i][pathlen+1] != 'a') ||
-	  (list[i][pathlen+2] != 't') ||
-	  (list[i][pathlen+3] != 'a')) {
-	logMessage(3, "Skipping bad line '%s'", list[i]);
-	continue;
-      }
-      disknum = 0;
-      if (isdigit(list[i][pathlen+4])) {
-	disknum = list[i][pathlen+4] - '0';
-	if (isdigit(list[i][pathlen+5])) {
-	  disknum = disknum*10 + (list[i][pathlen+5] - '0');
-	}
-      }
-      if ((disknum+1) > numDisksOnCurrentNode_) {
-	numDisksOnCurrentNode_ = disknum + 1;
-      }
-    }
-
-
     /* create a hash table to speed up checking for duplicates */
     ht = newHashTable();	
     
     /* hash table for lfns to ignore because they've already been processed */
     ignore = newHashTable();
 
+    /*
+     * The node's files are checked as they are found, so the number of
+     * disks can't be counted from the list first. Start from the number
+     * configured; a file on a disk beyond that raises it
+     */
+    numDisksOnCurrentNode_ = se->numDisks;
+    if (numDisksOnCurrentNode_ < 1)
+    {
+	numDisksOnCurrentNode_ = 1;
+    }
     logMessage(3, "This node has %d disks", numDisksOnCurrentNode_);
 
     /* Obtain attributes for all lfns in RLS */
-    group_d = getAllAttributesValues("group");
-    permissions_d = getAllAttributesValues("permissions");
-    md5sum_d = getAllAttributesValues("md5sum");
-    size_d = getAllAttributesValues("size");
-    submitter_d = getAllAttributesValues("submitter");
+    scan.group_d = getAllAttributesValues("group");
+    scan.permissions_d = getAllAttributesValues("permissions");
+    scan.md5sum_d = getAllAttributesValues("md5sum");
+    scan.size_d = getAllAttributesValues("size");
+    scan.submitter_d = getAllAttributesValues("submitter");
 
+    /* get length in characters of initial path to remove */
+    scan.pathlen = strlen(getNodePath(host));
+    if (getNodePath(host)[scan.pathlen-1] != '/') scan.pathlen++;
+
+    scan.host = host;
+    scan.ignore = ignore;
+    scan.ht = ht;
+    scan.rcFiles = rcFiles;
+    scan.numRcDisks = numRcDisks;
+    scan.fileDisksList = fileDisksList;
+    scan.interactive = interactive;
+    scan.se = se;
+    scan.failed = 0;
 
-    /* Iterate over all lines of node contents */
-    for (i = 0; i < listLength; i++) {
-
-      /* check filename is right sort of path */
-      if (strlen(list[i]) < (pathlen + 6)) {
-	globus_libc_fprintf(stderr, "Invalid line '%s' returned\n", list[i]);
-	/* skip it */
-	continue;
-      }
-
-      if ((list[i][pathlen] != 'd') ||
-	  (list[i][pathlen+1] != 'a') ||
-	  (list[i][pathlen+2] != 't') ||
-	  (list[i][pathlen+3] != 'a')) {
-	globus_libc_fprintf(stderr, "Invalid line '%s' returned\n", list[i]);
-	/* skip it */
-	continue;
-      }
+    cbParam.hostname = host;
+    cbParam.interactive = interactive;
 
-      /* get data directory name and start of lfn */
-      lfn = &list[i][pathlen+5];
-      if (list[i][pathlen+4] == '/') {
-	sprintf(diskname, "data");
+    /* Check each file actually stored at node */
+    result = scanNodeWithCallback(se, errbuf, host, 0, verifyScannedFile,
+				  &scan);
+    if ((result != DIGS_SUCCESS) || (scan.failed)) {
+      if (result != DIGS_SUCCESS) {
+	logMessage(ERROR, "Error scanning node %s: %s (%s)", host,
+		   digsErrorToString(result), errbuf);
       }
       else {
-	disknum = list[i][pathlen+4] - '0';
-	lfn++;
-	if (isdigit(list[i][pathlen+5])) {
-	  disknum = disknum*10 + (list[i][pathlen+5] - '0');
-	  lfn++;
-	}
-	sprintf(diskname, "data%d", disknum);
-      }
-
-      /* ignore contents of NEW directory */
-      if (!strncmp(lfn, "NEW/", 4)) {
-	globus_libc_fprintf(stderr, "Skipping %s\n", lfn);
-	continue;
+	forEachHashTableEntry(rcFiles, extraRcEntryCallback, (void*)&cbParam);
       }
 
-      /* run checks on this file */
-      if (!checkOneFile(lfn, host, ignore, ht, rcFiles,
-			disknum, numRcDisks,
-			diskname, fileDisksList,
-			interactive, 
-			group_d, permissions_d, md5sum_d,
-			size_d, submitter_d, se)) {
-	  forEachHashTableEntry(rcFiles, extraRcEntryCallback, (void*)&cbParam);
-
-	  se->digs_free_string_array(&list, &listLength);
-	  
-	  destroyFileDisksList(fileDisksList);
+      destroyFileDisksList(fileDisksList);
 
-	  destroyHashTable(ht);
-	  destroyHashTable(ignore);
-	  destroyHashTable(rcFiles);
+      destroyHashTable(ht);
+      destroyHashTable(ignore);
+      destroyHashTable(rcFiles);
 
-	  destroyKeyAndValueHashTable(group_d);
-	  destroyKeyAndValueHashTable(submitter_d);
-	  destroyKeyAndValueHashTable(md5sum_d);
-	  destroyKeyAndValueHashTable(size_d);
-	  destroyKeyAndValueHashTable(permissions_d);
+      destroyKeyAndValueHashTable(scan.group_d);
+      destroyKeyAndValueHashTable(scan.submitter_d);
+      destroyKeyAndValueHashTable(scan.md5sum_d);
+      destroyKeyAndValueHashTable(scan.size_d);
+      destroyKeyAndValueHashTable(scan.permissions_d);
 
-	  return;
-      }
+      return;
     }
 
     /* Now check the RC entries to see if there's any 'left over' */
-    cbParam.hostname = host;
-    cbParam.interactive = interactive;
-
     forEachHashTableEntry(rcFiles, extraRcEntryCallback, (void*)&cbParam);
 
-    se->digs_free_string_array(&list, &listLength);
-
     destroyFileDisksList(fileDisksList);
 
     destroyHashTable(ht);
     destroyHashTable(ignore);
     destroyHashTable(rcFiles);
 
-    destroyKeyAndValueHashTable(group_d);
-    destroyKeyAndValueHashTable(submitter_d);
-    destroyKeyAndValueHashTable(md5sum_d);
-    destroyKeyAndValueHashTable(size_d);
-    destroyKeyAndValueHashTable(permissions_d);
+    destroyKeyAndValueHashTable(scan.group_d);
+    destroyKeyAndValueHashTable(scan.submitter_d);
+    destroyKeyAndValueHashTable(scan.md5sum_d);
+    destroyKeyAndValueHashTable(scan.size_d);
+    destroyKeyAndValueHashTable(scan.permissions_d);
 
 }
 
@@ -1629,11 +1661,336 @@ int runGridVerification(char *node, int interactive)
 /* how far we got in checksumming through the list of logical files*/
 int checksumLfnListPos_ = 0;
 
+/*
+ * Default number of checksums runChecksums keeps outstanding on each
+ * node. Can be changed per node with the 'checksumsinflight' property
+ */
+#define CHECKSUMS_IN_FLIGHT 4
+
+/*
+ * Longest time (in seconds) to wait for a checksum to finish before
+ * looking at the outstanding ones again, so that any which have passed
+ * their deadlines are noticed
+ */
+#define CHECKSUM_POLL_INTERVAL 5.0
+
+/* States of a checksumJob_t */
+enum { CHECKSUM_QUEUED, CHECKSUM_RUNNING, CHECKSUM_FINISHED };
+
+/*
+ * One copy of a file waiting to be checksummed by runChecksumJobs
+ */
+typedef struct checksumJob_s {
+    char *lfn;                   /* logical file name (not owned)   */
+    char *node;                  /* node holding the copy           */
+    char *pfn;                   /* name of the copy on the node    */
+    long long size;              /* length of file, -1 if unknown   */
+    struct storageElement *se;
+    int maxInFlight;             /* node's limit on checksums       */
+    int state;
+    int handle;                  /* checksum handle while running   */
+} checksumJob_t;
+
+/*
+ * A copy of a file that couldn't be checksummed because its node was
+ * over the bandwidth limit. These are tried first next time round,
+ * instead of waiting for the next pass through the whole catalogue
+ */
+typedef struct refusedChecksum_s {
+    char *lfn;
+    char *node;
+    long long size;
+} refusedChecksum_t;
+
+static refusedChecksum_t *refusedChecksums_ = NULL;
+static int numRefusedChecksums_ = 0;
+static int refusedChecksumSpace_ = 0;
+
+/*
+ * Remembers a copy the bandwidth limits refused to checksum
+ */
+static void addRefusedChecksum(char *lfn, char *node, long long size)
+{
+    refusedChecksum_t *refused;
+
+    if (numRefusedChecksums_ >= refusedChecksumSpace_)
+    {
+	refusedChecksumSpace_ += 100;
+	refusedChecksums_ = globus_libc_realloc(refusedChecksums_,
+						refusedChecksumSpace_ *
+						sizeof(refusedChecksum_t));
+	if (!refusedChecksums_)
+	{
+	    errorExit("Out of memory in addRefusedChecksum");
+	}
+    }
+    refused = &refusedChecksums_[numRefusedChecksums_];
+    refused->lfn = safe_strdup(lfn);
+    refused->node = safe_strdup(node);
+    if ((!refused->lfn) || (!refused->node))
+    {
+	errorExit("Out of memory in addRefusedChecksum");
+    }
+    refused->size = size;
+    numRefusedChecksums_++;
+}
+
+/*
+ * Deals with the result of checking one copy of a file: result is 1 if
+ * its checksum matched RLS, 0 if not, -1 if it couldn't be checked
+ */
+static void recordChecksumResult(char *lfn, char *node, char *pfn, int result)
+{
+    if (!result)
+    {
+	logMessage(5, "Copy of %s on %s doesn't match with RLS!!\n[%s]", lfn, node, pfn);
+	inconsistencies_++;
+
+	/* don't stop the grid, or remove the file*/ 
+	//removeFileFromLocation(node, lfn);
+	//deleteRemoteFileFullPath(node, pfn);
+
+	/* disable this node only */
+	logMessage(5, "Disabling %s node", node);
+	addToDisabledList(node);
+    }
+    if (result > 0)
+    {
+	updateLastChecked(lfn, node);
+    }
+}
+
+/*
+ * Checks the group and permissions of a copy of a file and adds it to
+ * the list of copies to checksum, unless checks are disabled on its node
+ */
+static void queueChecksum(checksumJob_t **jobs, int *numJobs, int *jobSpace,
+			  char *lfn, char *node, long long size)
+{
+    checksumJob_t *job;
+    char *checksDisabled;
+    char *prop;
+
+    checksDisabled = getNodeProperty(node, "disablechecks");
+    if ((checksDisabled != NULL) && (!strcmp(checksDisabled, "1")))
+    {
+	globus_libc_free(checksDisabled);
+	return;
+    }
+    if (checksDisabled) globus_libc_free(checksDisabled);
+
+    if (*numJobs >= *jobSpace)
+    {
+	*jobSpace += 100;
+	*jobs = globus_libc_realloc(*jobs, (*jobSpace) * sizeof(checksumJob_t));
+	if (!*jobs)
+	{
+	    errorExit("Out of memory in queueChecksum");
+	}
+    }
+    job = &(*jobs)[*numJobs];
+
+    job->lfn = lfn;
+    job->node = safe_strdup(node);
+    if (!job->node)
+    {
+	errorExit("Out of memory in queueChecksum");
+    }
+    job->pfn = constructFilename(node, lfn);
+    job->size = (size > 0) ? size : -1;
+    job->se = getNode(node);
+    job->state = CHECKSUM_QUEUED;
+    job->handle = -1;
+
+    job->maxInFlight = CHECKSUMS_IN_FLIGHT;
+    prop = getNodeProperty(node, "checksumsinflight");
+    if (prop)
+    {
+	job->maxInFlight = atoi(prop);
+	globus_libc_free(prop);
+    }
+    if (job->maxInFlight < 1)
+    {
+	job->maxInFlight = 1;
+    }
+
+    // RADEK location might be NULL, if it is, print warning and skip it. ?? maybe dissable the node first
+    if(!verifyGroupAndPermissionsWithRLS(node, lfn, job->pfn))
+    {
+	logMessage(5, "Error occured in verifyGroupAndPermissionsWithRLS", lfn, node, job->pfn);
+    }
+
+    (*numJobs)++;
+}
+
+/*
+ * Collects the result of a checksum that has finished (or run out of
+ * time) and compares it with RLS
+ */
+static void finishChecksumJob(checksumJob_t *job)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result;
+    char *remoteChecksum;
+
+    result = job->se->digs_endChecksum(errbuf, job->handle, &remoteChecksum);
+    job->state = CHECKSUM_FINISHED;
+    if (result != DIGS_SUCCESS)
+    {
+	logMessage(5, "Error checksumming %s on %s: %s (%s)", job->pfn,
+		   job->node, digsErrorToString(result), errbuf);
+	return;
+    }
+
+    recordChecksumResult(job->lfn, job->node, job->pfn,
+			 compareChecksumWithRLS(job->node, job->lfn, job->pfn,
+						remoteChecksum));
+    job->se->digs_free_string(&remoteChecksum);
+}
+
+/*
+ * Runs all the queued checksums, keeping up to each node's limit
+ * outstanding on it at once. Storage elements that can only checksum
+ * synchronously are done one at a time as before
+ */
+static void runChecksumJobs(checksumJob_t *jobs, int numJobs)
+{
+    char errbuf[MAX_ERROR_MESSAGE_LENGTH];
+    digs_error_code_t result;
+    digs_transfer_status_t status;
+    struct storageElement *waitSE;
+    int *handles;
+    int numHandles;
+    int running;
+    int completed;
+    int i, j;
+
+    handles = globus_libc_malloc((numJobs + 1) * sizeof(int));
+    if (!handles)
+    {
+	errorExit("Out of memory in runChecksumJobs");
+    }
+
+    do
+    {
+	/* start whatever the nodes' limits allow */
+	for (i = 0; i < numJobs; i++)
+	{
+	    if (jobs[i].state != CHECKSUM_QUEUED)
+	    {
+		continue;
+	    }
+
+	    if (!jobs[i].se)
+	    {
+		logMessage(5, "Error getting SE structure for node %s", jobs[i].node);
+		jobs[i].state = CHECKSUM_FINISHED;
+		continue;
+	    }
+
+	    if (jobs[i].se->digs_startChecksum == NULL)
+	    {
+		recordChecksumResult(jobs[i].lfn, jobs[i].node, jobs[i].pfn,
+				     verifyMD5SumWithRLS(jobs[i].node, jobs[i].lfn,
+							 jobs[i].pfn));
+		jobs[i].state = CHECKSUM_FINISHED;
+		continue;
+	    }
+
+	    running = 0;
+	    for (j = 0; j < numJobs; j++)
+	    {
+		if ((jobs[j].state == CHECKSUM_RUNNING) &&
+		    (!strcmp(jobs[j].node, jobs[i].node)))
+		{
+		    running++;
+		}
+	    }
+	    if (running >= jobs[i].maxInFlight)
+	    {
+		continue;
+	    }
+
+	    result = jobs[i].se->digs_startChecksum(errbuf, jobs[i].pfn,
+						    jobs[i].node,
+						    DIGS_MD5_CHECKSUM,
+						    jobs[i].size,
+						    &jobs[i].handle);
+	    if (result != DIGS_SUCCESS)
+	    {
+		logMessage(5, "Error starting checksum of %s on %s: %s (%s)",
+			   jobs[i].pfn, jobs[i].node, digsErrorToString(result),
+			   errbuf);
+		jobs[i].state = CHECKSUM_FINISHED;
+		continue;
+	    }
+	    jobs[i].state = CHECKSUM_RUNNING;
+	}
+
+	/*
+	 * sleep until one finishes. Only handles belonging to the same
+	 * adaptor can be waited on together
+	 */
+	waitSE = NULL;
+	numHandles = 0;
+	for (i = 0; i < numJobs; i++)
+	{
+	    if (jobs[i].state != CHECKSUM_RUNNING)
+	    {
+		continue;
+	    }
+	    if (waitSE == NULL)
+	    {
+		waitSE = jobs[i].se;
+	    }
+	    if (jobs[i].se->digs_waitForTransfers == waitSE->digs_waitForTransfers)
+	    {
+		handles[numHandles++] = jobs[i].handle;
+	    }
+	}
+	if (numHandles == 0)
+	{
+	    break;
+	}
+
+	if (waitSE->digs_waitForTransfers)
+	{
+	    waitSE->digs_waitForTransfers(errbuf, handles, numHandles,
+					  CHECKSUM_POLL_INTERVAL, &completed);
+	}
+	else
+	{
+	    globus_libc_usleep(100000);
+	}
+
+	/* collect everything that has finished or run out of time */
+	for (i = 0; i < numJobs; i++)
+	{
+	    if (jobs[i].state != CHECKSUM_RUNNING)
+	    {
+		continue;
+	    }
+
+	    result = jobs[i].se->digs_monitorChecksum(errbuf, jobs[i].handle,
+						      &status);
+	    if ((result == DIGS_SUCCESS) && (status == DIGS_TRANSFER_IN_PROGRESS))
+	    {
+		continue;
+	    }
+	    finishChecksumJob(&jobs[i]);
+	}
+    } while (1);
+
+    globus_libc_free(handles);
+}
+
 /***********************************************************************
 *   int runChecksums()
 *    
 *   Runs checksums on all copies of the files on the grid and compare
-*   them with RLS entries
+*   them with RLS entries. The copies are checksummed in parallel, up to
+*   CHECKSUMS_IN_FLIGHT (or the node's 'checksumsinflight' property) at
+*   once on each node
 *    
 *   Parameters:                                                [I/O]
 *
@@ -1649,13 +2006,22 @@ int runChecksums(int maxChecksums)
     static int numLfns = 0;
     static int lfnSpace = 0;
 
+    /* The copies to checksum this time round */
+    checksumJob_t *jobs = NULL;
+    int numJobs = 0;
+    int jobSpace = 0;
+
+    /* The copies refused last time round */
+    refusedChecksum_t *retries;
+    int numRetries;
+
     int i;
-    int result;
 
     char *lfn;
     char *firstLoc;
     char *otherLoc;
-    char *checksDisabled;
+    char *sizestr;
+    long long size;
 
     logMessage(1, "runChecksums(%d)", maxChecksums);
 
@@ -1707,6 +2073,39 @@ int runChecksums(int maxChecksums)
     /* Now do our quota of checksums for this iteration */
     inconsistencies_ = 0;
 
+    /* First the copies the bandwidth limits refused last time. Any
+     * refused again go back on the list */
+    retries = refusedChecksums_;
+    numRetries = numRefusedChecksums_;
+    refusedChecksums_ = NULL;
+    numRefusedChecksums_ = 0;
+    refusedChecksumSpace_ = 0;
+    for (i = 0; i < numRetries; i++)
+    {
+	if (nodeIndexFromName(retries[i].node) < 0)
+	{
+	    /* the node has left the grid, so has its copy */
+	    continue;
+	}
+	if ((isNodeDead(retries[i].node)) || (isNodeDisabled(retries[i].node)))
+	{
+	    /* keep it until the node is back, rather than missing it out
+	     * of this sweep */
+	    addRefusedChecksum(retries[i].lfn, retries[i].node, retries[i].size);
+	    continue;
+	}
+	if (reserveBandwidth(retries[i].node, NULL, retries[i].size))
+	{
+	    queueChecksum(&jobs, &numJobs, &jobSpace, retries[i].lfn,
+			  retries[i].node, retries[i].size);
+	}
+	else
+	{
+	    addRefusedChecksum(retries[i].lfn, retries[i].node, retries[i].size);
+	}
+    }
+
+    /* Then decide which other copies to check */
     for (i = 0; i < maxChecksums; i++)
     {
 	/* Check we haven't checked all yet */
@@ -1724,45 +2123,24 @@ int runChecksums(int maxChecksums)
 	    firstLoc = getNextFileLocation(lfn);
 	}
 
+	/* Checksumming reads the whole file, so counts against the limits */
+	size = 0;
+	if (getAttrValueFromRLS(lfn, "size", &sizestr))
+	{
+	    size = strtoll(sizestr, NULL, 10);
+	    globus_libc_free(sizestr);
+	}
+	if ((firstLoc) && (!reserveBandwidth(firstLoc, NULL, size)))
+	{
+	    /* try this file again next time round */
+	    logMessage(3, "Bandwidth limit reached, stopping checksums");
+	    break;
+	}
+
 	if (firstLoc)
 	{
-	    checksDisabled = getNodeProperty(firstLoc, "disablechecks");
-	    if ((checksDisabled == NULL) || (strcmp(checksDisabled, "1")))
-	    {
-	      /* check first available file */
-	      char *pfn1;
-	      pfn1 = constructFilename(firstLoc, lfn);
-	      
-	      // RADEK location might be NULL, if it is, print warning and skip it. ?? maybe dissable the node first
-	      
-	      if(!verifyGroupAndPermissionsWithRLS(firstLoc, lfn, pfn1))
-	      {
-		  logMessage(5, "Error occured in verifyGroupAndPermissionsWithRLS", lfn, firstLoc, pfn1);
-	      }
-	      
-	      /* check with RLS what checksum we are expecting */
-	      result = verifyMD5SumWithRLS(firstLoc, lfn, pfn1);
-	      if(!result)
-	      {
-		  logMessage(5, "Copy of %s on %s doesn't match with RLS!!\n[%s]", lfn, firstLoc, pfn1);
-		  inconsistencies_++;
-		  
-		  /* don't stop the grid, or remove the file*/ 
-		  //removeFileFromLocation(firstLoc, lfn);
-		  //deleteRemoteFileFullPath(firstLoc, pfn1);
-		  
-		  /* disable this node only */
-		  logMessage(5, "Disabling %s node", firstLoc);
-		  addToDisabledList(firstLoc);
-		  
-	      }
-	      if (result > 0)
-	      {
-		  updateLastChecked(lfn, firstLoc);
-	      }
-	      globus_libc_free(pfn1);
-	    }
-	    if (checksDisabled) globus_libc_free(checksDisabled);
+	    /* check first available file */
+	    queueChecksum(&jobs, &numJobs, &jobSpace, lfn, firstLoc, size);
 
 	    otherLoc = getNextFileLocation();
 
@@ -1770,36 +2148,17 @@ int runChecksums(int maxChecksums)
 	    {
 		if ((!isNodeDead(otherLoc)) && (!isNodeDisabled(otherLoc)))
 		{
-		    checksDisabled = getNodeProperty(otherLoc, "disablechecks");
-		    if ((checksDisabled == NULL) || (strcmp(checksDisabled, "1")))
+		    if (reserveBandwidth(otherLoc, NULL, size))
 		    {
-		      /* check all other available files */
-		      char *pfn2;
-
-		      pfn2 = constructFilename(otherLoc, lfn);
-		    
-		      if(!verifyGroupAndPermissionsWithRLS(otherLoc, lfn, pfn2))
-		      {
-			logMessage(5, "Error occured in verifyGroupAndPermissionsWithRLS", lfn, otherLoc, pfn2);
-		      }
-
-		      result = verifyMD5SumWithRLS(otherLoc, lfn, pfn2);
-		      if(!result)
-		      {
-			logMessage(5, "Copy of %s on %s doesn't match with RLS!!\n[%s]", lfn, otherLoc, pfn2);
-			inconsistencies_++;
-		 
-			logMessage(5, "Disabling %s node", otherLoc);
-			addToDisabledList(otherLoc);
-			
-		      }		
-		      if (result > 0)
-		      {
-			updateLastChecked(lfn, otherLoc);
-		      }
-		      globus_libc_free(pfn2);
+			/* check all other available files */
+			queueChecksum(&jobs, &numJobs, &jobSpace, lfn, otherLoc,
+				      size);
+		    }
+		    else
+		    {
+			/* try this copy again next time round */
+			addRefusedChecksum(lfn, otherLoc, size);
 		    }
-		    if (checksDisabled) globus_libc_free(checksDisabled);
 		}
 		otherLoc = getNextFileLocation();
 	    }
@@ -1807,6 +2166,30 @@ int runChecksums(int maxChecksums)
 
 	checksumLfnListPos_++;
     }
+
+    /* Then checksum them all at once */
+    runChecksumJobs(jobs, numJobs);
+
+    for (i = 0; i < numJobs; i++)
+    {
+	globus_libc_free(jobs[i].node);
+	globus_libc_free(jobs[i].pfn);
+    }
+    if (jobs)
+    {
+	globus_libc_free(jobs);
+    }
+
+    /* The jobs pointed at these names, so they can only go now */
+    for (i = 0; i < numRetries; i++)
+    {
+	globus_libc_free(retries[i].lfn);
+	globus_libc_free(retries[i].node);
+    }
+    if (retries)
+    {
+	globus_libc_free(retries);
+    }
     
     return inconsistencies_;
 }